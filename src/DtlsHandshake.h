@@ -58,15 +58,8 @@
 
 #pragma once
 
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#include <openssl/bio.h>
-#include <openssl/dtls1.h>
-#include <openssl/err.h>
-#include <openssl/srtp.h>
-#include <openssl/ssl.h>
-#include <openssl/x509.h>
+#include "DtlsHandshakeNative.h"
+
 #include <msclr/marshal.h>
 #include <msclr/marshal_cppstd.h>
 
@@ -75,41 +68,47 @@
 using namespace System;
 using namespace System::Runtime::InteropServices;
 
-#define SRTP_ALGORITHM "SRTP_AES128_CM_SHA1_80"
-#define DTLS_COOKIE "sipsorcery"
-#define HANDSHAKE_ERROR_STATUS -1
-
-#define SSL_WHERE_INFO(ssl, w, flag, msg) {                \
-    if(w & flag) {                                         \
-      printf("%20.20s", msg);                              \
-      printf(" - %30.30s ", SSL_state_string_long(ssl));   \
-      printf(" - %5.10s ", SSL_state_string(ssl));         \
-      printf("\n");                                        \
-	    }                                                    \
-    } 
-
 namespace SIPSorceryMedia {
 
-  typedef struct {
-    SSL_CTX* ctx;		/* main ssl context */
-    SSL* ssl;       /* the SSL* which represents a "connection" */
-    BIO* bio;
-  } krx;
-
   public ref class DtlsHandshake
   {
   private:
-    static bool _isOpenSSLInitialised = false;
-
-    krx* _k{ nullptr };
+    DtlsHandshakeNative* _native{ nullptr };
     property System::String^ _certFile;
     property System::String^ _keyFile;
     bool _handshakeComplete = false;
 
+    DtlsHandshakeNative* CreateNative();
+
   public:
 
     property System::Boolean Debug;
 
+    /**
+    * If set the OpenSSL state is freed as soon as the handshake completes, keeping only
+    * what the SRTP sessions need. See DtlsHandshakeNative::ReleaseAfterKeyExport.
+    */
+    property System::Boolean ReleaseAfterKeyExport;
+
+    /**
+    * Optional, the cipher suites as an OpenSSL cipher list string. Defaults to
+    * DtlsHandshakeNative::DEFAULT_CIPHER_LIST.
+    */
+    property System::String^ CipherList;
+
+    /**
+    * Optional, the ECDHE key exchange groups as a colon separated list, for example
+    * "X25519:P-256". Defaults to DtlsHandshakeNative::DEFAULT_GROUPS.
+    */
+    property System::String^ Groups;
+
+    /**
+    * If set the server's ECDHE key share is taken from DtlsKeyPool::Default, which
+    * generates key pairs in the background ahead of the handshakes, rather than
+    * generated during the handshake. See DtlsKeyPool.
+    */
+    property System::Boolean UsePrecomputedKeys;
+
     /**
     Initialises the OpenSSL library. Only needs to be called once per process.
     While the initialisation will happen automatically this method can be called 
@@ -117,15 +116,7 @@ namespace SIPSorceryMedia {
     */
     static void InitialiseOpenSSL()
     {
-      // Only need to call the OpenSSL initialisation routines once per process.
-      if (!_isOpenSSLInitialised) {
-        SSL_library_init();
-        SSL_load_error_strings();
-        ERR_load_BIO_strings();
-        OpenSSL_add_all_algorithms();
-
-        _isOpenSSLInitialised = true;
-      }
+      DtlsHandshakeNative::InitialiseOpenSSL();
     }
 
     /**
@@ -204,12 +195,22 @@ namespace SIPSorceryMedia {
     */
     SSL* GetSSL()
     {
-      if (_k != nullptr) {
-        return _k->ssl;
+      if (_native != nullptr) {
+        return _native->GetSSL();
       }
       else {
         return nullptr;
       }
     }
+
+    /**
+    * Gets the SRTP keying material from the completed handshake, whether or not the
+    * OpenSSL state has been released.
+    * @@Returns: 0 if successful or -1 if the handshake hasn't completed.
+    */
+    int ExportSrtpKeyingMaterial(uint8_t* buffer, int length)
+    {
+      return (_native != nullptr) ? _native->ExportSrtpKeyingMaterial(buffer, length) : -1;
+    }
   };
 }
\ No newline at end of file
@@ -0,0 +1,579 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsHandshakeNative.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "DtlsHandshakeNative.h"
+#include "DtlsKeyPool.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTrace.h"
+
+#include <chrono>
+#include <string.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    MetricsRegistry& _metrics = MetricsRegistry::Default();
+
+    MetricCounter& _serverHandshakes = _metrics.GetCounter("sipsm_dtls_handshakes_total", "DTLS handshakes completed.", "role=\"server\"");
+    MetricCounter& _serverFailures = _metrics.GetCounter("sipsm_dtls_handshake_failures_total", "DTLS handshakes that failed.", "role=\"server\"");
+    MetricHistogram& _serverDuration = _metrics.GetHistogram("sipsm_dtls_handshake_duration_ns", "Time taken by a DTLS handshake.", "role=\"server\"");
+
+    MetricCounter& _clientHandshakes = _metrics.GetCounter("sipsm_dtls_handshakes_total", "DTLS handshakes completed.", "role=\"client\"");
+    MetricCounter& _clientFailures = _metrics.GetCounter("sipsm_dtls_handshake_failures_total", "DTLS handshakes that failed.", "role=\"client\"");
+    MetricHistogram& _clientDuration = _metrics.GetHistogram("sipsm_dtls_handshake_duration_ns", "Time taken by a DTLS handshake.", "role=\"client\"");
+
+    /**
+    * Drains the calling thread's OpenSSL error queue into the log.
+    */
+    void LogOpenSslErrors()
+    {
+      unsigned long err;
+      while ((err = ERR_get_error()) != 0) {
+        char description[256];
+        ERR_error_string_n(err, description, sizeof(description));
+        SIPSM_LOG_WARNING("OpenSSL error: %s", description);
+      }
+    }
+
+    uint64_t SteadyNanoseconds()
+    {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+  }
+
+  bool DtlsHandshakeNative::_isOpenSSLInitialised = false;
+
+  const char* const DtlsHandshakeNative::DEFAULT_CIPHER_LIST =
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+    "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA";
+
+  const char* const DtlsHandshakeNative::DEFAULT_GROUPS = "X25519:P-256:P-384";
+
+  int krx_ssl_verify_peer(int ok, X509_STORE_CTX* ctx) {
+    return 1;
+  }
+
+  int verify_cookie(SSL* ssl, const unsigned char* cookie, unsigned int cookie_len)
+  {
+    // Accept any cookie.
+    return 1;
+  }
+
+  int generate_cookie(SSL* ssl, unsigned char* cookie, unsigned int* cookie_len)
+  {
+    int cookieLength = sizeof(DTLS_COOKIE);
+    *cookie_len = cookieLength;
+    memcpy(cookie, (unsigned char*)DTLS_COOKIE, cookieLength);
+    return 1;
+  }
+
+  void krx_ssl_info_callback(const SSL* ssl, int where, int ret)
+  {
+    if (ret == 0) {
+      SIPSM_LOG_WARNING("-- krx_ssl_info_callback: error occurred.");
+      return;
+    }
+
+    SSL_WHERE_INFO(ssl, where, SSL_CB_LOOP, "LOOP");
+    SSL_WHERE_INFO(ssl, where, SSL_CB_HANDSHAKE_START, "HANDSHAKE START");
+    SSL_WHERE_INFO(ssl, where, SSL_CB_HANDSHAKE_DONE, "HANDSHAKE DONE");
+  }
+
+  void DtlsHandshakeNative::InitialiseOpenSSL()
+  {
+    // Only need to call the OpenSSL initialisation routines once per process.
+    if (!_isOpenSSLInitialised) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+      // The error strings and algorithms are loaded by OPENSSL_init_ssl, the older
+      // loading functions are deprecated.
+      OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, nullptr);
+#else
+      SSL_library_init();
+      SSL_load_error_strings();
+      ERR_load_BIO_strings();
+      OpenSSL_add_all_algorithms();
+#endif
+
+      _isOpenSSLInitialised = true;
+    }
+  }
+
+  DtlsHandshakeNative::DtlsHandshakeNative(const std::string& certFile, const std::string& keyFile) :
+    _certFile(certFile),
+    _keyFile(keyFile)
+  {
+    InitialiseOpenSSL();
+
+    _k = new krx();
+    _k->ctx = nullptr;
+    _k->ssl = nullptr;
+    _k->bio = nullptr;
+  }
+
+  DtlsHandshakeNative::~DtlsHandshakeNative()
+  {
+    Shutdown();
+  }
+
+  int DtlsHandshakeNative::InitContext(const SSL_METHOD* method, SOCKET rtpSocket)
+  {
+    int r = 0;
+
+    // The object can be used for another handshake, either after Shutdown or with
+    // the state of the previous one still held.
+    if (_k == nullptr) {
+      _k = new krx();
+      _k->ctx = nullptr;
+      _k->ssl = nullptr;
+      _k->bio = nullptr;
+    }
+    else {
+      FreeState(false);
+    }
+
+    OPENSSL_cleanse(_keyingMaterial, sizeof(_keyingMaterial));
+    _isReleased = false;
+    _steppedRole = 0;
+
+    /* create a new context using DTLS */
+    _k->ctx = (_keyPool != nullptr) ? _keyPool->NewContext(method) : SSL_CTX_new(method);
+    if (!_k->ctx) {
+      SIPSM_LOG_ERROR("Error: cannot create SSL_CTX.");
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    /* set our supported ciphers */
+    r = (CipherList.empty()) ? 1 : SSL_CTX_set_cipher_list(_k->ctx, CipherList.c_str());
+    if (r != 1) {
+      SIPSM_LOG_ERROR("Error: cannot set the cipher list %s.", CipherList.c_str());
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    /* set our supported key exchange groups */
+    if (!Groups.empty()) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+      r = SSL_CTX_set1_groups_list(_k->ctx, Groups.c_str());
+#else
+      r = SSL_CTX_set1_curves_list(_k->ctx, Groups.c_str());
+#endif
+    }
+    if (r != 1) {
+      SIPSM_LOG_ERROR("Error: cannot set the key exchange groups %s.", Groups.c_str());
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    // As the server pick from our preference order, cheapest first, rather than
+    // the client's.
+    SSL_CTX_set_options(_k->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    /* enable srtp */
+    r = SSL_CTX_set_tlsext_use_srtp(_k->ctx, SRTP_ALGORITHM);
+    if (r != 0) {
+      SIPSM_LOG_ERROR("Error: cannot setup srtp.");
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    /* certificate file; contains also the public key */
+    r = SSL_CTX_use_certificate_file(_k->ctx, _certFile.c_str(), SSL_FILETYPE_PEM);
+    if (r != 1) {
+      SIPSM_LOG_ERROR("Error: cannot load certificate file.");
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    /* load private key */
+    r = SSL_CTX_use_PrivateKey_file(_k->ctx, _keyFile.c_str(), SSL_FILETYPE_PEM);
+    if (r != 1) {
+      SIPSM_LOG_ERROR("Error: cannot load private key file.");
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    /* check if the private key is valid */
+    r = SSL_CTX_check_private_key(_k->ctx);
+    if (r != 1) {
+      SIPSM_LOG_ERROR("Error: checking the private key failed.");
+      LogOpenSslErrors();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    // Don't need to use a handshake cookie at this point. The DTLS
+    // handshake does not get initiated until the ICE connection is done
+    // and that serves as the DoS protection.
+    //SSL_CTX_set_cookie_generate_cb(_k->ctx, generate_cookie);
+    //SSL_CTX_set_cookie_verify_cb(_k->ctx, verify_cookie);
+    SSL_CTX_set_ecdh_auto(_k->ctx, 1);                        // Needed for FireFox DTLS negotiation.
+
+    // The peer's certificate doesn't need to be verified but it
+    // does need to be supplied so the fingerprint can be passed
+    // to the caller.
+    SSL_CTX_set_verify(_k->ctx, SSL_VERIFY_PEER, krx_ssl_verify_peer);
+
+    /* create SSL* */
+    _k->ssl = SSL_new(_k->ctx);
+    if (!_k->ssl) {
+      SIPSM_LOG_ERROR("Error: cannot create new SSL*.");
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    _k->bio = BIO_new_dgram((int)rtpSocket, BIO_NOCLOSE);
+    if (!_k->bio) {
+      SIPSM_LOG_ERROR("Error: cannot create new BIO*.");
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    SSL_set_bio(_k->ssl, _k->bio, _k->bio);
+
+    if (Debug) {
+      SSL_set_info_callback(_k->ssl, krx_ssl_info_callback);
+    }
+
+    return 0;
+  }
+
+  void DtlsHandshakeNative::OnHandshakeComplete(uint8_t* fingerprint, int* fingerprintLength)
+  {
+    _peerFingerprintLength = 0;
+
+    X509* peerCert = SSL_get_peer_certificate(_k->ssl);
+    if (peerCert != NULL) {
+
+      const EVP_MD* digest = EVP_get_digestbyname("sha256");
+      unsigned int length = 0;
+      if (X509_digest(peerCert, digest, _peerFingerprint, &length) == 1) {
+        _peerFingerprintLength = length;
+      }
+      else {
+        SIPSM_LOG_ERROR("Failed to get fingerprint for peer certificate.");
+      }
+
+      X509_free(peerCert);
+    }
+
+    // Set the fingerprint of the X509 certificate provided by the
+    // peer so the calling application can check.
+    memcpy(fingerprint, _peerFingerprint, _peerFingerprintLength);
+    *fingerprintLength = _peerFingerprintLength;
+
+    SRTP_PROTECTION_PROFILE* profile = SSL_get_selected_srtp_profile(_k->ssl);
+    _srtpProfile = (profile != nullptr) ? profile->name : "";
+
+    if (ReleaseAfterKeyExport) {
+      ReleaseState();
+    }
+  }
+
+  int DtlsHandshakeNative::GetPeerFingerprint(uint8_t* fingerprint) const
+  {
+    memcpy(fingerprint, _peerFingerprint, _peerFingerprintLength);
+    return _peerFingerprintLength;
+  }
+
+  int DtlsHandshakeNative::ExportSrtpKeyingMaterial(uint8_t* buffer, int length)
+  {
+    if (buffer == nullptr || length < SRTP_KEYING_MATERIAL_LENGTH) {
+      return -1;
+    }
+
+    if (_isReleased) {
+      memcpy(buffer, _keyingMaterial, SRTP_KEYING_MATERIAL_LENGTH);
+      return 0;
+    }
+
+    if (!IsHandshakeComplete()) {
+      SIPSM_LOG_ERROR("Cannot export the SRTP keying material, the DTLS handshake has not completed.");
+      return -1;
+    }
+
+    const char* label = "EXTRACTOR-dtls_srtp";
+    if (SSL_export_keying_material(_k->ssl, buffer, SRTP_KEYING_MATERIAL_LENGTH, label, strlen(label), NULL, 0, 0) != 1) {
+      SIPSM_LOG_ERROR("Export of SSL key information failed.");
+      LogOpenSslErrors();
+      return -1;
+    }
+
+    return 0;
+  }
+
+  int DtlsHandshakeNative::ReleaseState()
+  {
+    if (_isReleased) {
+      return 0;
+    }
+
+    if (ExportSrtpKeyingMaterial(_keyingMaterial, sizeof(_keyingMaterial)) != 0) {
+      return -1;
+    }
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    FreeState(false);
+    _isReleased = true;
+
+    SIPSM_LOG_DEBUG("DTLS state released after key export.");
+
+    return 0;
+  }
+
+  void DtlsHandshakeNative::FreeState(bool sendCloseNotify)
+  {
+    if (_k->ssl != nullptr) {
+      if (sendCloseNotify) {
+        SSL_shutdown(_k->ssl);
+      }
+
+      // The BIO is owned by the SSL connection.
+      SSL_free(_k->ssl);
+      _k->ssl = nullptr;
+      _k->bio = nullptr;
+    }
+
+    if (_k->ctx != nullptr) {
+      SSL_CTX_free(_k->ctx);
+      _k->ctx = nullptr;
+    }
+  }
+
+  /*
+  * Performs the server side of a DTLS handshake.
+  */
+  int DtlsHandshakeNative::DoHandshakeAsServer(SOCKET rtpSocket, uint8_t* fingerprint, int* fingerprintLength)
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    *fingerprintLength = 0;
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    ScopedLatency latency(_serverDuration);
+    SIPSM_TRACE_SCOPE("dtls", "DtlsHandshake::DoHandshakeAsServer", 0);
+
+    if (InitContext(DTLS_server_method(), rtpSocket) != 0) {
+      _serverFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    // Wait for a client to initiate the DTLS handshake.
+    SSL_set_accept_state(_k->ssl);
+
+    // No cookie required.
+    //BIO_ADDR* clientAddr = BIO_ADDR_new();
+    //DTLSv1_listen(_k->ssl, clientAddr);
+    //BIO_ADDR_free(clientAddr);
+
+    // Attempt to complete the DTLS handshake
+    // If successful, the DTLS link state is initialized internally
+    if (SSL_accept(_k->ssl) <= 0) {
+      SIPSM_LOG_ERROR("Failed to complete SSL handshake.");
+      _serverFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+    else {
+      SIPSM_LOG_INFO("DTLS server handshake completed.");
+    }
+
+    _serverHandshakes.Add();
+    OnHandshakeComplete(fingerprint, fingerprintLength);
+
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    return 0;
+  }
+
+  /*
+  * Performs the client side of a DTLS handshake.
+  */
+  int DtlsHandshakeNative::DoHandshakeAsClient(SOCKET rtpSocket, const sockaddr* svrAddr, uint8_t* fingerprint, int* fingerprintLength)
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    *fingerprintLength = 0;
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    ScopedLatency latency(_clientDuration);
+    SIPSM_TRACE_SCOPE("dtls", "DtlsHandshake::DoHandshakeAsClient", 0);
+
+    if (InitContext(DTLS_client_method(), rtpSocket) != 0) {
+      _clientFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    // We will be initiating the handshake.
+    SSL_set_connect_state(_k->ssl);
+
+    if (BIO_ctrl(_k->bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, const_cast<sockaddr*>(svrAddr)) <= 0) {
+      SIPSM_LOG_ERROR("Error: BIO_CTL to set BIO_CTRL_DGRAM_SET_CONNECTED failed.");
+    }
+
+    if (SSL_connect(_k->ssl) <= 0) {
+      // Did another thread read our DTLS packets?! Make sure there are no
+      // other active socket receivers.
+      SIPSM_LOG_ERROR("Failed to complete SSL client connection handshake.");
+      _clientFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+    else {
+      SIPSM_LOG_INFO("DTLS client handshake completed.");
+    }
+
+    _clientHandshakes.Add();
+    OnHandshakeComplete(fingerprint, fingerprintLength);
+
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    return 0;
+  }
+
+  int DtlsHandshakeNative::BeginHandshakeAsServer(SOCKET rtpSocket)
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    SIPSM_TRACE_SCOPE("dtls", "DtlsHandshake::BeginHandshakeAsServer", 0);
+
+    _steppedStartNanoseconds = SteadyNanoseconds();
+
+    if (InitContext(DTLS_server_method(), rtpSocket) != 0 || BIO_socket_nbio((int)rtpSocket, 1) != 1) {
+      _serverFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    SSL_set_accept_state(_k->ssl);
+    _steppedRole = 1;
+
+    return 0;
+  }
+
+  int DtlsHandshakeNative::BeginHandshakeAsClient(SOCKET rtpSocket, const sockaddr* svrAddr)
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    SIPSM_TRACE_SCOPE("dtls", "DtlsHandshake::BeginHandshakeAsClient", 0);
+
+    _steppedStartNanoseconds = SteadyNanoseconds();
+
+    if (InitContext(DTLS_client_method(), rtpSocket) != 0 || BIO_socket_nbio((int)rtpSocket, 1) != 1) {
+      _clientFailures.Add();
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    SSL_set_connect_state(_k->ssl);
+
+    if (BIO_ctrl(_k->bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, const_cast<sockaddr*>(svrAddr)) <= 0) {
+      SIPSM_LOG_ERROR("Error: BIO_CTL to set BIO_CTRL_DGRAM_SET_CONNECTED failed.");
+    }
+
+    _steppedRole = 2;
+
+    return 0;
+  }
+
+  int DtlsHandshakeNative::ContinueHandshake(uint8_t* fingerprint, int* fingerprintLength, int* timeoutMilliseconds)
+  {
+    *fingerprintLength = 0;
+    *timeoutMilliseconds = -1;
+
+    if (_steppedRole == 0 || _k == nullptr || _k->ssl == nullptr) {
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+    SIPSM_TRACE_SCOPE("dtls", "DtlsHandshake::ContinueHandshake", 0);
+
+    // A blocking handshake resends its last flight from inside the read, a stepped one
+    // has to check the retransmission timer itself.
+    timeval timeout;
+    if (DTLSv1_get_timeout(_k->ssl, &timeout) == 1 && timeout.tv_sec == 0 && timeout.tv_usec == 0 &&
+      DTLSv1_handle_timeout(_k->ssl) < 0) {
+      SIPSM_LOG_ERROR("DTLS handshake failed, the peer stopped responding.");
+      EndSteppedHandshake(false);
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    int result = SSL_do_handshake(_k->ssl);
+    if (result <= 0) {
+      int error = SSL_get_error(_k->ssl, result);
+      if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        if (DTLSv1_get_timeout(_k->ssl, &timeout) == 1) {
+          *timeoutMilliseconds = (int)(timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000);
+        }
+        return HANDSHAKE_PENDING_STATUS;
+      }
+
+      SIPSM_LOG_ERROR("Failed to complete SSL handshake, error %d.", error);
+      LogOpenSslErrors();
+      EndSteppedHandshake(false);
+      return HANDSHAKE_ERROR_STATUS;
+    }
+
+    SIPSM_LOG_INFO("DTLS %s handshake completed.", (_steppedRole == 1) ? "server" : "client");
+    EndSteppedHandshake(true);
+    OnHandshakeComplete(fingerprint, fingerprintLength);
+
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    return 0;
+  }
+
+  void DtlsHandshakeNative::EndSteppedHandshake(bool isSuccess)
+  {
+    bool isServer = (_steppedRole == 1);
+    _steppedRole = 0;
+
+    if (!isSuccess) {
+      (isServer ? _serverFailures : _clientFailures).Add();
+      return;
+    }
+
+    (isServer ? _serverHandshakes : _clientHandshakes).Add();
+    if (MetricsControl::IsEnabled()) {
+      (isServer ? _serverDuration : _clientDuration).Record(SteadyNanoseconds() - _steppedStartNanoseconds);
+    }
+  }
+
+  bool DtlsHandshakeNative::IsHandshakeComplete()
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    return _isReleased || (_k != nullptr && _k->ssl != nullptr && SSL_get_state(_k->ssl) == TLS_ST_OK);
+  }
+
+  void DtlsHandshakeNative::Shutdown()
+  {
+    // Log any OpenSSL errors left on this thread.
+    LogOpenSslErrors();
+
+    if (_k != nullptr) {
+      MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Dtls, !MemoryAccount::IsOpenSslHooked());
+
+      FreeState(true);
+
+      delete _k;
+      _k = nullptr;
+    }
+
+    OPENSSL_cleanse(_keyingMaterial, sizeof(_keyingMaterial));
+    _isReleased = false;
+  }
+}
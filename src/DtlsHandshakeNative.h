@@ -0,0 +1,302 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsHandshakeNative.h
+//
+// Description: Native (non-CLR) implementation of the server and client ends
+// of a DTLS handshake. This is the core used by both the C++/CLI DtlsHandshake
+// class and the flat C API in NativeApi.h. See DtlsHandshake.h for remarks
+// about the choice of a datagram BIO.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//
+// OpenSSL License:
+// This application includes software developed by the OpenSSL Project and
+// cryptographic software written by Eric Young (eay@cryptsoft.com)
+// See the accompanying LICENSE file for conditions.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef int SOCKET;
+#endif
+
+#include <openssl/bio.h>
+#include <openssl/dtls1.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/srtp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "MediaLog.h"
+#include "MediaMemory.h"
+
+#include <stdio.h>
+#include <string>
+
+#define SRTP_ALGORITHM "SRTP_AES128_CM_SHA1_80"
+#define DTLS_COOKIE "sipsorcery"
+#define HANDSHAKE_ERROR_STATUS -1
+#define HANDSHAKE_PENDING_STATUS 1
+
+#define SSL_WHERE_INFO(ssl, w, flag, msg) {                                  \
+    if(w & flag) {                                                           \
+      SIPSM_LOG_DEBUG("%20.20s - %30.30s - %5.10s", msg,                     \
+        SSL_state_string_long(ssl), SSL_state_string(ssl));                  \
+    }                                                                        \
+  }
+
+namespace SIPSorceryMedia {
+
+  class DtlsKeyPool;
+
+  typedef struct {
+    SSL_CTX* ctx;		/* main ssl context */
+    SSL* ssl;       /* the SSL* which represents a "connection" */
+    BIO* bio;
+  } krx;
+
+  class DtlsHandshakeNative
+  {
+  public:
+
+    /**
+    * The maximum length of the certificate fingerprint set by the handshake methods.
+    */
+    static const int FINGERPRINT_MAX_LENGTH = EVP_MAX_MD_SIZE;
+
+    /**
+    * The length of the keying material exported for the SRTP_AES128_CM_SHA1_80
+    * profile, a master key and salt for each direction (RFC5764 4.2).
+    */
+    static const int SRTP_KEYING_MATERIAL_LENGTH = 60;
+
+    /**
+    * The default cipher suites, in order of preference. The AES128-GCM suites are the
+    * cheapest that browsers offer, the ECDSA ones are only chosen if the certificate
+    * has an ECDSA key. The CBC suites are kept last for older peers.
+    */
+    static const char* const DEFAULT_CIPHER_LIST;
+
+    /**
+    * The default key exchange groups, in order of preference.
+    */
+    static const char* const DEFAULT_GROUPS;
+
+    /**
+    Initialises the OpenSSL library. Only needs to be called once per process.
+    */
+    static void InitialiseOpenSSL();
+
+    /**
+    * Constructor.
+    * @param[in] certFile: path to the certificate file, must be in PEM format.
+    * @param[in] keyFile: path to the private key file, must be in PEM format.
+    */
+    DtlsHandshakeNative(const std::string& certFile, const std::string& keyFile);
+
+    /**
+    * Destructor. Cleans up the SSL context and associated structures.
+    */
+    ~DtlsHandshakeNative();
+
+    /**
+    * Performs the DTLS handshake as the server. This method blocks waiting for the
+    * client to initiate the connection and then attempts to complete the handshake.
+    * @param[in] socket: handle to the socket to perform the DTLS handshake on.
+    * @param[out] fingerprint: buffer of at least FINGERPRINT_MAX_LENGTH bytes that will
+    *  be set with the sha256 fingerprint of the client's X509 certificate.
+    * @param[out] fingerprintLength: the length of the fingerprint, 0 if not available.
+    * @@Returns: 0 if the handshake completed successfully or -1 if there was an error.
+    */
+    int DoHandshakeAsServer(SOCKET socket, uint8_t* fingerprint, int* fingerprintLength);
+
+    /**
+    * Performs the DTLS handshake as the client.
+    * @param[in] socket: handle to the socket to perform the DTLS handshake on. The socket
+    *  must have had connect called to set the remote destination end point.
+    * @param[in] svrAddr: the address of the remote server.
+    * @param[out] fingerprint: buffer of at least FINGERPRINT_MAX_LENGTH bytes that will
+    *  be set with the sha256 fingerprint of the server's X509 certificate.
+    * @param[out] fingerprintLength: the length of the fingerprint, 0 if not available.
+    * @@Returns: 0 if the handshake completed successfully or -1 if there was an error.
+    */
+    int DoHandshakeAsClient(SOCKET socket, const sockaddr* svrAddr, uint8_t* fingerprint, int* fingerprintLength);
+
+    /**
+    * Starts the server side of a handshake without blocking. The handshake is then
+    * stepped by ContinueHandshake each time the socket becomes readable, so one thread
+    * can drive many handshakes. The socket is switched to non-blocking.
+    * @param[in] socket: handle to the socket to perform the DTLS handshake on.
+    * @@Returns: 0 if the handshake was started or -1 if there was an error.
+    */
+    int BeginHandshakeAsServer(SOCKET socket);
+
+    /**
+    * Starts the client side of a handshake without blocking, see BeginHandshakeAsServer.
+    * The client's first flight is sent by the first call to ContinueHandshake.
+    * @param[in] socket: handle to the socket to perform the DTLS handshake on. The socket
+    *  must have had connect called to set the remote destination end point.
+    * @param[in] svrAddr: the address of the remote server.
+    * @@Returns: 0 if the handshake was started or -1 if there was an error.
+    */
+    int BeginHandshakeAsClient(SOCKET socket, const sockaddr* svrAddr);
+
+    /**
+    * Processes whatever datagrams have arrived for a handshake started by one of the
+    * Begin methods, and resends the last flight if its retransmission timer has expired.
+    * @param[out] fingerprint: buffer of at least FINGERPRINT_MAX_LENGTH bytes that will
+    *  be set with the sha256 fingerprint of the peer's X509 certificate.
+    * @param[out] fingerprintLength: the length of the fingerprint, 0 if not available.
+    * @param[out] timeoutMilliseconds: if the handshake is pending, how long until
+    *  ContinueHandshake should be called again even if nothing arrives, -1 for no limit.
+    * @@Returns: 0 if the handshake completed, HANDSHAKE_PENDING_STATUS if it is waiting
+    *  for the socket to become readable or -1 if there was an error.
+    */
+    int ContinueHandshake(uint8_t* fingerprint, int* fingerprintLength, int* timeoutMilliseconds);
+
+    /**
+    * Checks whether the DTLS handshake has been completed.
+    * @@Returns: true if it has been completed or false if not.
+    */
+    bool IsHandshakeComplete();
+
+    /**
+    * Shutsdown the SSL context and the instance and cleans up.
+    */
+    void Shutdown();
+
+    /**
+    * Provides access to the SSL connection. Access is needed by the SRTP connection to
+    * initialise its keying material. Null once the state has been released.
+    */
+    SSL* GetSSL()
+    {
+      return (_k != nullptr) ? _k->ssl : nullptr;
+    }
+
+    /**
+    * Gets the SRTP keying material from the completed handshake, from the SSL connection
+    * or the copy kept when the state was released.
+    * @param[out] buffer: set with the client key, server key, client salt and server salt.
+    * @param[in] length: the length of the buffer, at least SRTP_KEYING_MATERIAL_LENGTH.
+    * @@Returns: 0 if successful or -1 if the handshake hasn't completed.
+    */
+    int ExportSrtpKeyingMaterial(uint8_t* buffer, int length);
+
+    /**
+    * Gets the name of the SRTP protection profile negotiated by the handshake, empty if
+    * the handshake hasn't completed.
+    */
+    const std::string& GetSrtpProfile() const { return _srtpProfile; }
+
+    /**
+    * Gets the fingerprint of the peer's certificate.
+    * @param[out] fingerprint: buffer of at least FINGERPRINT_MAX_LENGTH bytes.
+    * @@Returns: the length of the fingerprint, 0 if not available.
+    */
+    int GetPeerFingerprint(uint8_t* fingerprint) const;
+
+    /**
+    * Keeps the SRTP keying material, profile and peer fingerprint and frees the SSL
+    * connection, context and BIO. After this the handshake still reports as complete
+    * but GetSSL returns null and Shutdown has no close_notify to send, the peer finds
+    * out the call has ended from the signalling, an RTCP BYE or ICE consent expiry.
+    * Called automatically after a successful handshake if ReleaseAfterKeyExport is set.
+    * @@Returns: 0 if successful or -1 if the handshake hasn't completed.
+    */
+    int ReleaseState();
+
+    /**
+    * Whether the OpenSSL state has been released by ReleaseState.
+    */
+    bool IsReleased() const { return _isReleased; }
+
+    /**
+    * Optional, the account the memory held by OpenSSL for this connection is charged to.
+    */
+    void SetMemoryAccount(MemoryAccount* account) { _memoryAccount = account; }
+
+    /**
+    * Optional, the pool the handshake's ECDHE key share is taken from instead of being
+    * generated on the handshake's thread, see DtlsKeyPool. Must outlive the handshake.
+    */
+    void SetKeyPool(DtlsKeyPool* pool) { _keyPool = pool; }
+
+    /**
+    * If set the OpenSSL state transitions are printed during the handshake.
+    */
+    bool Debug = false;
+
+    /**
+    * If set the OpenSSL state is released as soon as a handshake completes, see
+    * ReleaseState. An established connection otherwise holds tens of KB of certificates,
+    * handshake buffers and BIO state for the whole call only so Shutdown can send a
+    * close_notify.
+    */
+    bool ReleaseAfterKeyExport = false;
+
+    /**
+    * The cipher suites to offer or accept, an OpenSSL cipher list string. As the server
+    * the first suite in this list that the client also supports is chosen. Empty for
+    * OpenSSL's defaults.
+    */
+    std::string CipherList = DEFAULT_CIPHER_LIST;
+
+    /**
+    * The ECDHE key exchange groups to offer or accept, a colon separated list of OpenSSL
+    * group names. As the server the first group in this list that the client also
+    * supports is chosen. Empty for OpenSSL's defaults. The list also limits the curves
+    * accepted for ECDSA signatures, so it must include the curve of an ECDSA
+    * certificate's key.
+    */
+    std::string Groups = DEFAULT_GROUPS;
+
+  private:
+
+    static bool _isOpenSSLInitialised;
+
+    /**
+    * Creates the SSL context, loads the certificate and key and creates the SSL
+    * connection bound to a datagram BIO on the socket.
+    */
+    int InitContext(const SSL_METHOD* method, SOCKET socket);
+
+    /**
+    * Reads the fingerprint of the remote peer's certificate and the negotiated SRTP
+    * profile from the SSL connection once the handshake has completed.
+    */
+    void OnHandshakeComplete(uint8_t* fingerprint, int* fingerprintLength);
+
+    /**
+    * Frees the SSL connection, and with it the BIO, and the SSL context.
+    * @param[in] sendCloseNotify: true to send a close_notify alert to the peer first.
+    */
+    void FreeState(bool sendCloseNotify);
+
+    /**
+    * Records the outcome of a handshake stepped by ContinueHandshake.
+    */
+    void EndSteppedHandshake(bool isSuccess);
+
+    krx* _k{ nullptr };
+    MemoryAccount* _memoryAccount{ nullptr };
+    DtlsKeyPool* _keyPool{ nullptr };
+    bool _isReleased{ false };
+    int _steppedRole{ 0 };                      // 1 server, 2 client, 0 if no handshake is being stepped.
+    uint64_t _steppedStartNanoseconds{ 0 };
+    uint8_t _keyingMaterial[SRTP_KEYING_MATERIAL_LENGTH];
+    uint8_t _peerFingerprint[FINGERPRINT_MAX_LENGTH];
+    int _peerFingerprintLength{ 0 };
+    std::string _srtpProfile;
+    std::string _certFile;
+    std::string _keyFile;
+  };
+}
@@ -0,0 +1,798 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsKeyPool.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "DtlsKeyPool.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/provider.h>
+#define SIPSM_DTLS_KEY_POOL
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    MetricCounter& _taken = MetricsRegistry::Default().GetCounter("sipsm_dtls_key_pool_taken_total", "ECDHE key pairs handed to handshakes from the pool.");
+    MetricCounter& _misses = MetricsRegistry::Default().GetCounter("sipsm_dtls_key_pool_misses_total", "ECDHE key pairs generated inline because the pool was empty.");
+
+#ifdef SIPSM_DTLS_KEY_POOL
+
+    const char* const PROVIDER_NAME = "sipsm-keypool";
+    const char* const PROVIDER_PROPERTIES = "provider=sipsm-keypool";
+
+    /**
+    * The SSL contexts take the provider's key management when it has the algorithm and
+    * everything else from the default provider.
+    */
+    const char* const PROVIDER_PREFERRED = "?provider=sipsm-keypool";
+    const char* const DEFAULT_PROVIDER = "provider=default";
+
+    const int ALGORITHM_X25519 = 0;
+    const int ALGORITHM_EC = 1;
+    const int ALGORITHM_COUNT = 2;
+    const char* const ALGORITHM_NAMES[ALGORITHM_COUNT] = { "X25519", "EC" };
+
+    const int KEYPAIR_AND_PARAMETERS = OSSL_KEYMGMT_SELECT_KEYPAIR | OSSL_KEYMGMT_SELECT_ALL_PARAMETERS;
+    const int MAX_GROUP_NAME_LENGTH = 64;
+
+    // What the default provider reports for an X25519 key, needed for the parameters
+    // only key libssl creates before it sets the peer's key share.
+    const int X25519_BITS = 253;
+    const int X25519_SECURITY_BITS = 128;
+    const int X25519_KEY_LENGTH = 32;
+
+    struct ProviderContext
+    {
+      DtlsKeyPool* Pool = nullptr;
+      EVP_KEYMGMT* Defaults[ALGORITHM_COUNT] = { nullptr, nullptr };
+    };
+
+    /**
+    * The key data behind an EVP_PKEY from the provider. Wraps a key from the default
+    * provider, which is missing for an X25519 key with only its parameters.
+    */
+    struct PoolKey
+    {
+      ProviderContext* Provider;
+      int Algorithm;
+      int Selection;                            // The OSSL_KEYMGMT_SELECT parts the key has.
+      EVP_PKEY* Key;
+      char GroupName[MAX_GROUP_NAME_LENGTH];
+    };
+
+    struct PoolKeyGen
+    {
+      ProviderContext* Provider;
+      int Algorithm;
+      int Selection;
+      char GroupName[MAX_GROUP_NAME_LENGTH];
+    };
+
+    thread_local ProviderContext* _loadingProvider = nullptr;
+
+    void CopyGroupName(char* groupName, const char* name)
+    {
+      strncpy(groupName, name, MAX_GROUP_NAME_LENGTH - 1);
+      groupName[MAX_GROUP_NAME_LENGTH - 1] = '\0';
+    }
+
+    bool IsP256(const char* groupName)
+    {
+      return strcmp(groupName, "prime256v1") == 0 || strcmp(groupName, "P-256") == 0 || strcmp(groupName, "secp256r1") == 0;
+    }
+
+    EVP_PKEY* FromData(int algorithm, int selection, OSSL_PARAM* params)
+    {
+      EVP_PKEY* key = nullptr;
+      EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(nullptr, ALGORITHM_NAMES[algorithm], DEFAULT_PROVIDER);
+      if (ctx == nullptr || EVP_PKEY_fromdata_init(ctx) <= 0 || EVP_PKEY_fromdata(ctx, &key, selection, params) <= 0) {
+        key = nullptr;
+      }
+      EVP_PKEY_CTX_free(ctx);
+      return key;
+    }
+
+    /**
+    * Creates the default provider's key holding only an EC group.
+    */
+    EVP_PKEY* EcParameters(const char* groupName)
+    {
+      OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, const_cast<char*>(groupName), 0),
+        OSSL_PARAM_construct_end()
+      };
+      return FromData(ALGORITHM_EC, EVP_PKEY_KEY_PARAMETERS, params);
+    }
+
+    PoolKey* NewPoolKey(ProviderContext* provider, int algorithm)
+    {
+      PoolKey* key = new (std::nothrow) PoolKey();
+      if (key != nullptr) {
+        key->Provider = provider;
+        key->Algorithm = algorithm;
+        key->Selection = (algorithm == ALGORITHM_X25519) ? OSSL_KEYMGMT_SELECT_ALL_PARAMETERS : 0;
+        key->Key = nullptr;
+        key->GroupName[0] = '\0';
+      }
+      return key;
+    }
+
+    template <int Algorithm>
+    void* KeyNew(void* provctx)
+    {
+      return NewPoolKey(static_cast<ProviderContext*>(provctx), Algorithm);
+    }
+
+    void KeyFree(void* keydata)
+    {
+      PoolKey* key = static_cast<PoolKey*>(keydata);
+      if (key != nullptr) {
+        EVP_PKEY_free(key->Key);
+        delete key;
+      }
+    }
+
+    int KeyHas(const void* keydata, int selection)
+    {
+      const PoolKey* key = static_cast<const PoolKey*>(keydata);
+      return key != nullptr && ((selection & KEYPAIR_AND_PARAMETERS) & ~key->Selection) == 0;
+    }
+
+    int KeyGetParams(void* keydata, OSSL_PARAM params[])
+    {
+      PoolKey* key = static_cast<PoolKey*>(keydata);
+      if (key->Key != nullptr) {
+        return EVP_PKEY_get_params(key->Key, params);
+      }
+
+      if (key->Algorithm == ALGORITHM_X25519) {
+        OSSL_PARAM* p;
+        if (((p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_BITS)) != nullptr && !OSSL_PARAM_set_int(p, X25519_BITS)) ||
+          ((p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_SECURITY_BITS)) != nullptr && !OSSL_PARAM_set_int(p, X25519_SECURITY_BITS)) ||
+          ((p = OSSL_PARAM_locate(params, OSSL_PKEY_PARAM_MAX_SIZE)) != nullptr && !OSSL_PARAM_set_int(p, X25519_KEY_LENGTH))) {
+          return 0;
+        }
+      }
+
+      return 1;
+    }
+
+    template <int Algorithm>
+    const OSSL_PARAM* KeyGettableParams(void* provctx)
+    {
+      return EVP_KEYMGMT_gettable_params(static_cast<ProviderContext*>(provctx)->Defaults[Algorithm]);
+    }
+
+    int KeySetParams(void* keydata, const OSSL_PARAM params[])
+    {
+      PoolKey* key = static_cast<PoolKey*>(keydata);
+
+      // libssl sets the peer's key share on a key it copied the parameters to.
+      const OSSL_PARAM* encoded = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY);
+      if (encoded != nullptr && (key->Selection & OSSL_KEYMGMT_SELECT_KEYPAIR) == 0) {
+        const void* publicKey = nullptr;
+        size_t publicKeyLength = 0;
+        if (!OSSL_PARAM_get_octet_string_ptr(encoded, &publicKey, &publicKeyLength)) {
+          return 0;
+        }
+
+        OSSL_PARAM keyParams[3];
+        int count = 0;
+        if (key->Algorithm == ALGORITHM_EC) {
+          keyParams[count++] = OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, key->GroupName, 0);
+        }
+        keyParams[count++] = OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, const_cast<void*>(publicKey), publicKeyLength);
+        keyParams[count] = OSSL_PARAM_construct_end();
+
+        EVP_PKEY* peerKey = FromData(key->Algorithm, EVP_PKEY_PUBLIC_KEY, keyParams);
+        if (peerKey == nullptr) {
+          return 0;
+        }
+
+        EVP_PKEY_free(key->Key);
+        key->Key = peerKey;
+        key->Selection |= OSSL_KEYMGMT_SELECT_PUBLIC_KEY | OSSL_KEYMGMT_SELECT_ALL_PARAMETERS;
+        return 1;
+      }
+
+      return key->Key == nullptr || EVP_PKEY_set_params(key->Key, const_cast<OSSL_PARAM*>(params));
+    }
+
+    template <int Algorithm>
+    const OSSL_PARAM* KeySettableParams(void* provctx)
+    {
+      return EVP_KEYMGMT_settable_params(static_cast<ProviderContext*>(provctx)->Defaults[Algorithm]);
+    }
+
+    int KeyValidate(const void* keydata, int selection, int checktype)
+    {
+      const PoolKey* key = static_cast<const PoolKey*>(keydata);
+      if (key->Key == nullptr) {
+        return 1;
+      }
+
+      EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_pkey(nullptr, key->Key, DEFAULT_PROVIDER);
+      selection &= key->Selection;
+      bool isValid = ctx != nullptr &&
+        ((selection & OSSL_KEYMGMT_SELECT_PUBLIC_KEY) == 0 || EVP_PKEY_public_check(ctx) == 1) &&
+        ((selection & OSSL_KEYMGMT_SELECT_PRIVATE_KEY) == 0 || EVP_PKEY_private_check(ctx) == 1) &&
+        (key->Algorithm != ALGORITHM_EC || (selection & OSSL_KEYMGMT_SELECT_DOMAIN_PARAMETERS) == 0 || EVP_PKEY_param_check(ctx) == 1);
+      EVP_PKEY_CTX_free(ctx);
+      return isValid ? 1 : 0;
+    }
+
+    int KeyMatch(const void* keydata1, const void* keydata2, int selection)
+    {
+      const PoolKey* key1 = static_cast<const PoolKey*>(keydata1);
+      const PoolKey* key2 = static_cast<const PoolKey*>(keydata2);
+
+      if ((selection & OSSL_KEYMGMT_SELECT_KEYPAIR) != 0) {
+        return key1->Key != nullptr && key2->Key != nullptr && EVP_PKEY_eq(key1->Key, key2->Key) == 1;
+      }
+      if (key1->Key != nullptr && key2->Key != nullptr) {
+        return EVP_PKEY_parameters_eq(key1->Key, key2->Key) == 1;
+      }
+      return key1->Algorithm == ALGORITHM_X25519 || strcmp(key1->GroupName, key2->GroupName) == 0;
+    }
+
+    int KeyImport(void* keydata, int selection, const OSSL_PARAM params[])
+    {
+      PoolKey* key = static_cast<PoolKey*>(keydata);
+
+      EVP_PKEY* imported = FromData(key->Algorithm, selection, const_cast<OSSL_PARAM*>(params));
+      if (imported == nullptr) {
+        return 0;
+      }
+
+      EVP_PKEY_free(key->Key);
+      key->Key = imported;
+      key->Selection |= selection & KEYPAIR_AND_PARAMETERS;
+
+      if (key->Algorithm == ALGORITHM_EC &&
+        EVP_PKEY_get_utf8_string_param(imported, OSSL_PKEY_PARAM_GROUP_NAME, key->GroupName, sizeof(key->GroupName), nullptr) == 1) {
+        key->Selection |= OSSL_KEYMGMT_SELECT_ALL_PARAMETERS;
+      }
+
+      return 1;
+    }
+
+    int KeyExport(void* keydata, int selection, OSSL_CALLBACK* callback, void* callbackArg)
+    {
+      PoolKey* key = static_cast<PoolKey*>(keydata);
+      if (key->Key != nullptr) {
+        return EVP_PKEY_export(key->Key, selection, callback, callbackArg);
+      }
+
+      OSSL_PARAM none[] = { OSSL_PARAM_END };
+      return callback(none, callbackArg);
+    }
+
+    template <int Algorithm>
+    const OSSL_PARAM* KeyTypes(int selection)
+    {
+      static const OSSL_PARAM x25519Types[] = {
+        OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PUB_KEY, nullptr, 0),
+        OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PRIV_KEY, nullptr, 0),
+        OSSL_PARAM_END
+      };
+      static const OSSL_PARAM ecTypes[] = {
+        OSSL_PARAM_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, nullptr, 0),
+        OSSL_PARAM_octet_string(OSSL_PKEY_PARAM_PUB_KEY, nullptr, 0),
+        OSSL_PARAM_BN(OSSL_PKEY_PARAM_PRIV_KEY, nullptr, 0),
+        OSSL_PARAM_END
+      };
+      return (Algorithm == ALGORITHM_X25519) ? x25519Types : ecTypes;
+    }
+
+    void* KeyDup(const void* keydataFrom, int selection)
+    {
+      const PoolKey* from = static_cast<const PoolKey*>(keydataFrom);
+      PoolKey* key = NewPoolKey(from->Provider, from->Algorithm);
+      if (key == nullptr) {
+        return nullptr;
+      }
+
+      memcpy(key->GroupName, from->GroupName, sizeof(key->GroupName));
+
+      if ((selection & OSSL_KEYMGMT_SELECT_KEYPAIR) != 0 && from->Key != nullptr) {
+        key->Key = EVP_PKEY_dup(from->Key);
+        key->Selection = from->Selection;
+      }
+      else if (from->Algorithm == ALGORITHM_EC && (from->Selection & OSSL_KEYMGMT_SELECT_ALL_PARAMETERS) != 0) {
+        key->Key = EcParameters(from->GroupName);
+        key->Selection = OSSL_KEYMGMT_SELECT_ALL_PARAMETERS;
+      }
+
+      if (key->Selection != 0 && key->Key == nullptr && from->Algorithm == ALGORITHM_EC) {
+        KeyFree(key);
+        return nullptr;
+      }
+
+      return key;
+    }
+
+    int KeyGenSetParams(void* genctx, const OSSL_PARAM params[])
+    {
+      PoolKeyGen* gen = static_cast<PoolKeyGen*>(genctx);
+      const OSSL_PARAM* p = OSSL_PARAM_locate_const(params, OSSL_PKEY_PARAM_GROUP_NAME);
+      const char* groupName = nullptr;
+      if (p != nullptr) {
+        if (!OSSL_PARAM_get_utf8_string_ptr(p, &groupName)) {
+          return 0;
+        }
+        CopyGroupName(gen->GroupName, groupName);
+      }
+      return 1;
+    }
+
+    template <int Algorithm>
+    void* KeyGenInit(void* provctx, int selection, const OSSL_PARAM params[])
+    {
+      PoolKeyGen* gen = new (std::nothrow) PoolKeyGen();
+      if (gen == nullptr) {
+        return nullptr;
+      }
+
+      gen->Provider = static_cast<ProviderContext*>(provctx);
+      gen->Algorithm = Algorithm;
+      gen->Selection = selection;
+      gen->GroupName[0] = '\0';
+
+      if (params != nullptr && !KeyGenSetParams(gen, params)) {
+        delete gen;
+        return nullptr;
+      }
+      return gen;
+    }
+
+    int KeyGenSetTemplate(void* genctx, void* templ)
+    {
+      PoolKeyGen* gen = static_cast<PoolKeyGen*>(genctx);
+      const PoolKey* key = static_cast<const PoolKey*>(templ);
+      if (key->GroupName[0] != '\0') {
+        CopyGroupName(gen->GroupName, key->GroupName);
+      }
+      return 1;
+    }
+
+    template <int Algorithm>
+    const OSSL_PARAM* KeyGenSettableParams(void* genctx, void* provctx)
+    {
+      return EVP_KEYMGMT_gen_settable_params(static_cast<ProviderContext*>(provctx)->Defaults[Algorithm]);
+    }
+
+    /**
+    * Generates a key, which is where a handshake's key share comes from. The key
+    * pair is taken from the pool for the groups it holds.
+    */
+    void* KeyGen(void* genctx, OSSL_CALLBACK* callback, void* callbackArg)
+    {
+      PoolKeyGen* gen = static_cast<PoolKeyGen*>(genctx);
+      if (gen->Algorithm == ALGORITHM_EC && gen->GroupName[0] == '\0') {
+        return nullptr;
+      }
+
+      PoolKey* key = NewPoolKey(gen->Provider, gen->Algorithm);
+      if (key == nullptr) {
+        return nullptr;
+      }
+      memcpy(key->GroupName, gen->GroupName, sizeof(key->GroupName));
+
+      if ((gen->Selection & OSSL_KEYMGMT_SELECT_KEYPAIR) == 0) {
+        if (gen->Algorithm == ALGORITHM_EC) {
+          key->Key = EcParameters(gen->GroupName);
+          key->Selection = OSSL_KEYMGMT_SELECT_ALL_PARAMETERS;
+        }
+      }
+      else if (gen->Algorithm == ALGORITHM_X25519) {
+        key->Key = gen->Provider->Pool->Take(DtlsKeyGroup::X25519);
+        key->Selection = KEYPAIR_AND_PARAMETERS;
+      }
+      else if (IsP256(gen->GroupName)) {
+        key->Key = gen->Provider->Pool->Take(DtlsKeyGroup::P256);
+        key->Selection = KEYPAIR_AND_PARAMETERS;
+      }
+      else {
+        key->Key = EVP_PKEY_Q_keygen(nullptr, DEFAULT_PROVIDER, "EC", gen->GroupName);
+        key->Selection = KEYPAIR_AND_PARAMETERS;
+      }
+
+      // Only an X25519 key with just its parameters has nothing to wrap.
+      bool isKeyRequired = (gen->Selection & OSSL_KEYMGMT_SELECT_KEYPAIR) != 0 || gen->Algorithm == ALGORITHM_EC;
+      if (isKeyRequired && key->Key == nullptr) {
+        KeyFree(key);
+        return nullptr;
+      }
+      return key;
+    }
+
+    void KeyGenCleanup(void* genctx)
+    {
+      delete static_cast<PoolKeyGen*>(genctx);
+    }
+
+    const char* EcQueryOperationName(int operationId)
+    {
+      switch (operationId) {
+      case OSSL_OP_KEYEXCH: return "ECDH";
+      case OSSL_OP_SIGNATURE: return "ECDSA";
+      default: return nullptr;
+      }
+    }
+
+    typedef void (*DispatchFunction)(void);
+
+#define SIPSM_KEY_DISPATCH(ALGORITHM)                                                                \
+    { OSSL_FUNC_KEYMGMT_NEW, (DispatchFunction)KeyNew<ALGORITHM> },                                  \
+    { OSSL_FUNC_KEYMGMT_FREE, (DispatchFunction)KeyFree },                                           \
+    { OSSL_FUNC_KEYMGMT_HAS, (DispatchFunction)KeyHas },                                             \
+    { OSSL_FUNC_KEYMGMT_GET_PARAMS, (DispatchFunction)KeyGetParams },                                \
+    { OSSL_FUNC_KEYMGMT_GETTABLE_PARAMS, (DispatchFunction)KeyGettableParams<ALGORITHM> },           \
+    { OSSL_FUNC_KEYMGMT_SET_PARAMS, (DispatchFunction)KeySetParams },                                \
+    { OSSL_FUNC_KEYMGMT_SETTABLE_PARAMS, (DispatchFunction)KeySettableParams<ALGORITHM> },           \
+    { OSSL_FUNC_KEYMGMT_VALIDATE, (DispatchFunction)KeyValidate },                                   \
+    { OSSL_FUNC_KEYMGMT_MATCH, (DispatchFunction)KeyMatch },                                         \
+    { OSSL_FUNC_KEYMGMT_IMPORT, (DispatchFunction)KeyImport },                                       \
+    { OSSL_FUNC_KEYMGMT_IMPORT_TYPES, (DispatchFunction)KeyTypes<ALGORITHM> },                       \
+    { OSSL_FUNC_KEYMGMT_EXPORT, (DispatchFunction)KeyExport },                                       \
+    { OSSL_FUNC_KEYMGMT_EXPORT_TYPES, (DispatchFunction)KeyTypes<ALGORITHM> },                       \
+    { OSSL_FUNC_KEYMGMT_DUP, (DispatchFunction)KeyDup },                                             \
+    { OSSL_FUNC_KEYMGMT_GEN_INIT, (DispatchFunction)KeyGenInit<ALGORITHM> },                         \
+    { OSSL_FUNC_KEYMGMT_GEN_SET_TEMPLATE, (DispatchFunction)KeyGenSetTemplate },                     \
+    { OSSL_FUNC_KEYMGMT_GEN_SET_PARAMS, (DispatchFunction)KeyGenSetParams },                         \
+    { OSSL_FUNC_KEYMGMT_GEN_SETTABLE_PARAMS, (DispatchFunction)KeyGenSettableParams<ALGORITHM> },    \
+    { OSSL_FUNC_KEYMGMT_GEN, (DispatchFunction)KeyGen },                                             \
+    { OSSL_FUNC_KEYMGMT_GEN_CLEANUP, (DispatchFunction)KeyGenCleanup }
+
+    const OSSL_DISPATCH X25519_FUNCTIONS[] = {
+      SIPSM_KEY_DISPATCH(ALGORITHM_X25519),
+      { 0, nullptr }
+    };
+
+    const OSSL_DISPATCH EC_FUNCTIONS[] = {
+      SIPSM_KEY_DISPATCH(ALGORITHM_EC),
+      { OSSL_FUNC_KEYMGMT_QUERY_OPERATION_NAME, (DispatchFunction)EcQueryOperationName },
+      { 0, nullptr }
+    };
+
+#undef SIPSM_KEY_DISPATCH
+
+    // The first name has to be the default provider's, it is the name used to find
+    // the default provider's key management when a key is passed to its key exchange.
+    const OSSL_ALGORITHM KEY_MANAGEMENT[] = {
+      { "X25519:1.3.101.110", PROVIDER_PROPERTIES, X25519_FUNCTIONS, "X25519 with pooled key pairs" },
+      { "EC:id-ecPublicKey:1.2.840.10045.2.1", PROVIDER_PROPERTIES, EC_FUNCTIONS, "EC with pooled P-256 key pairs" },
+      { nullptr, nullptr, nullptr, nullptr }
+    };
+
+    /**
+    * libssl only uses a group declared by the provider its key management comes from,
+    * so the provider declares the groups it takes the key management of, with the
+    * default provider's values. Other EC groups can't be used with the pool.
+    */
+    struct TlsGroup
+    {
+      const char* Name;
+      const char* InternalName;
+      const char* Algorithm;
+      unsigned int Id;
+      unsigned int SecurityBits;
+    };
+
+    const int TLS_GROUP_COUNT = 7;
+
+    const TlsGroup TLS_GROUPS[TLS_GROUP_COUNT] = {
+      { "x25519", "X25519", "X25519", 29, 128 },
+      { "secp256r1", "prime256v1", "EC", 23, 128 },
+      { "P-256", "prime256v1", "EC", 23, 128 },
+      { "secp384r1", "secp384r1", "EC", 24, 192 },
+      { "P-384", "secp384r1", "EC", 24, 192 },
+      { "secp521r1", "secp521r1", "EC", 25, 256 },
+      { "P-521", "secp521r1", "EC", 25, 256 },
+    };
+
+    int ProviderGetCapabilities(void* provctx, const char* capability, OSSL_CALLBACK* callback, void* callbackArg)
+    {
+      if (strcmp(capability, "TLS-GROUP") != 0) {
+        return 0;
+      }
+
+      for (const TlsGroup& group : TLS_GROUPS) {
+        unsigned int id = group.Id;
+        unsigned int securityBits = group.SecurityBits;
+        int minTls = TLS1_VERSION;
+        int maxTls = 0;
+        int minDtls = DTLS1_VERSION;
+        int maxDtls = 0;
+
+        OSSL_PARAM params[] = {
+          OSSL_PARAM_construct_utf8_string(OSSL_CAPABILITY_TLS_GROUP_NAME, const_cast<char*>(group.Name), 0),
+          OSSL_PARAM_construct_utf8_string(OSSL_CAPABILITY_TLS_GROUP_NAME_INTERNAL, const_cast<char*>(group.InternalName), 0),
+          OSSL_PARAM_construct_utf8_string(OSSL_CAPABILITY_TLS_GROUP_ALG, const_cast<char*>(group.Algorithm), 0),
+          OSSL_PARAM_construct_uint(OSSL_CAPABILITY_TLS_GROUP_ID, &id),
+          OSSL_PARAM_construct_uint(OSSL_CAPABILITY_TLS_GROUP_SECURITY_BITS, &securityBits),
+          OSSL_PARAM_construct_int(OSSL_CAPABILITY_TLS_GROUP_MIN_TLS, &minTls),
+          OSSL_PARAM_construct_int(OSSL_CAPABILITY_TLS_GROUP_MAX_TLS, &maxTls),
+          OSSL_PARAM_construct_int(OSSL_CAPABILITY_TLS_GROUP_MIN_DTLS, &minDtls),
+          OSSL_PARAM_construct_int(OSSL_CAPABILITY_TLS_GROUP_MAX_DTLS, &maxDtls),
+          OSSL_PARAM_construct_end()
+        };
+
+        if (!callback(params, callbackArg)) {
+          return 0;
+        }
+      }
+
+      return 1;
+    }
+
+    const OSSL_ALGORITHM* ProviderQueryOperation(void* provctx, int operationId, int* noCache)
+    {
+      *noCache = 0;
+      return (operationId == OSSL_OP_KEYMGMT) ? KEY_MANAGEMENT : nullptr;
+    }
+
+    const OSSL_DISPATCH PROVIDER_FUNCTIONS[] = {
+      { OSSL_FUNC_PROVIDER_QUERY_OPERATION, (DispatchFunction)ProviderQueryOperation },
+      { OSSL_FUNC_PROVIDER_GET_CAPABILITIES, (DispatchFunction)ProviderGetCapabilities },
+      { 0, nullptr }
+    };
+
+    /**
+    * Called by OSSL_PROVIDER_load, the provider's context is the pool being constructed.
+    */
+    int ProviderInit(const OSSL_CORE_HANDLE* handle, const OSSL_DISPATCH* in, const OSSL_DISPATCH** out, void** provctx)
+    {
+      if (_loadingProvider == nullptr) {
+        return 0;
+      }
+
+      *out = PROVIDER_FUNCTIONS;
+      *provctx = _loadingProvider;
+      return 1;
+    }
+
+#endif
+
+    EVP_PKEY* GenerateKey(DtlsKeyGroup group)
+    {
+#ifdef SIPSM_DTLS_KEY_POOL
+      return (group == DtlsKeyGroup::X25519) ? EVP_PKEY_Q_keygen(nullptr, DEFAULT_PROVIDER, "X25519") :
+        EVP_PKEY_Q_keygen(nullptr, DEFAULT_PROVIDER, "EC", "P-256");
+#else
+      return nullptr;
+#endif
+    }
+  }
+
+  struct DtlsKeyPool::Impl
+  {
+    int Capacity = DEFAULT_CAPACITY;
+    MediaScheduler* Scheduler = nullptr;
+
+    mutable std::mutex Lock;
+    std::vector<EVP_PKEY*> Keys[GROUP_COUNT];
+
+    std::atomic<bool> IsRefillPending{ false };
+    std::atomic<bool> IsStopping{ false };
+    std::atomic<uint64_t> Taken{ 0 };
+    std::atomic<uint64_t> Misses{ 0 };
+    std::atomic<uint64_t> Generated{ 0 };
+
+#ifdef SIPSM_DTLS_KEY_POOL
+    ProviderContext Provider;
+    OSSL_LIB_CTX* LibraryContext = nullptr;
+    OSSL_PROVIDER* PoolProvider = nullptr;
+    OSSL_PROVIDER* DefaultProvider = nullptr;
+#endif
+
+    /**
+    * Generates key pairs until each group is full, without holding the lock while
+    * generating so handshakes can keep taking from the pool.
+    */
+    void Refill()
+    {
+      for (int g = 0; g < GROUP_COUNT; g++) {
+        while (!IsStopping.load(std::memory_order_relaxed)) {
+          {
+            std::lock_guard<std::mutex> lock(Lock);
+            if ((int)Keys[g].size() >= Capacity) {
+              break;
+            }
+          }
+
+          EVP_PKEY* key = GenerateKey((DtlsKeyGroup)g);
+          if (key == nullptr) {
+            SIPSM_LOG_WARNING("Failed to generate an ECDHE key pair for the DTLS key pool.");
+            return;
+          }
+
+          std::lock_guard<std::mutex> lock(Lock);
+          if ((int)Keys[g].size() >= Capacity) {
+            EVP_PKEY_free(key);
+            break;
+          }
+          Keys[g].push_back(key);
+          Generated.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    }
+
+    static void RunRefill(void* context)
+    {
+      Impl* impl = static_cast<Impl*>(context);
+      impl->Refill();
+      impl->IsRefillPending.store(false, std::memory_order_release);
+    }
+
+    void ScheduleRefill()
+    {
+      if (IsStopping.load(std::memory_order_relaxed) || IsRefillPending.exchange(true, std::memory_order_acq_rel)) {
+        return;
+      }
+
+      if (Scheduler->Submit(RunRefill, this, TaskPriority::Background) != 0) {
+        IsRefillPending.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  DtlsKeyPool& DtlsKeyPool::Default()
+  {
+    // Deliberately never freed, handshakes on other threads may still be using
+    // its SSL contexts during process shutdown.
+    static DtlsKeyPool* defaultPool = new DtlsKeyPool();
+    return *defaultPool;
+  }
+
+  bool DtlsKeyPool::IsSupported()
+  {
+#ifdef SIPSM_DTLS_KEY_POOL
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  DtlsKeyPool::DtlsKeyPool(int capacity, MediaScheduler* scheduler) :
+    _impl(new Impl())
+  {
+    _impl->Capacity = (capacity > 0) ? capacity : DEFAULT_CAPACITY;
+    _impl->Scheduler = (scheduler != nullptr) ? scheduler : &MediaScheduler::Default();
+
+#ifdef SIPSM_DTLS_KEY_POOL
+    _impl->Provider.Pool = this;
+    for (int a = 0; a < ALGORITHM_COUNT; a++) {
+      _impl->Provider.Defaults[a] = EVP_KEYMGMT_fetch(nullptr, ALGORITHM_NAMES[a], DEFAULT_PROVIDER);
+    }
+
+    // The provider goes in first so the SSL contexts find its key management before
+    // the default provider's.
+    _impl->LibraryContext = OSSL_LIB_CTX_new();
+    if (_impl->LibraryContext != nullptr && _impl->Provider.Defaults[ALGORITHM_X25519] != nullptr &&
+      _impl->Provider.Defaults[ALGORITHM_EC] != nullptr &&
+      OSSL_PROVIDER_add_builtin(_impl->LibraryContext, PROVIDER_NAME, ProviderInit) == 1) {
+      _loadingProvider = &_impl->Provider;
+      _impl->PoolProvider = OSSL_PROVIDER_load(_impl->LibraryContext, PROVIDER_NAME);
+      _loadingProvider = nullptr;
+      _impl->DefaultProvider = OSSL_PROVIDER_load(_impl->LibraryContext, "default");
+    }
+
+    if (_impl->PoolProvider == nullptr || _impl->DefaultProvider == nullptr) {
+      SIPSM_LOG_WARNING("Failed to load the DTLS key pool provider, ECDHE key pairs will be generated inline.");
+      OSSL_PROVIDER_unload(_impl->PoolProvider);
+      OSSL_PROVIDER_unload(_impl->DefaultProvider);
+      OSSL_LIB_CTX_free(_impl->LibraryContext);
+      _impl->PoolProvider = nullptr;
+      _impl->DefaultProvider = nullptr;
+      _impl->LibraryContext = nullptr;
+    }
+#endif
+  }
+
+  DtlsKeyPool::~DtlsKeyPool()
+  {
+    _impl->IsStopping.store(true, std::memory_order_relaxed);
+    while (_impl->IsRefillPending.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+
+    for (int g = 0; g < GROUP_COUNT; g++) {
+      for (EVP_PKEY* key : _impl->Keys[g]) {
+        EVP_PKEY_free(key);
+      }
+    }
+
+#ifdef SIPSM_DTLS_KEY_POOL
+    OSSL_PROVIDER_unload(_impl->PoolProvider);
+    OSSL_PROVIDER_unload(_impl->DefaultProvider);
+    OSSL_LIB_CTX_free(_impl->LibraryContext);
+    for (int a = 0; a < ALGORITHM_COUNT; a++) {
+      EVP_KEYMGMT_free(_impl->Provider.Defaults[a]);
+    }
+#endif
+
+    delete _impl;
+  }
+
+  void DtlsKeyPool::Fill()
+  {
+#ifdef SIPSM_DTLS_KEY_POOL
+    if (_impl->LibraryContext != nullptr) {
+      _impl->Refill();
+    }
+#endif
+  }
+
+  SSL_CTX* DtlsKeyPool::NewContext(const SSL_METHOD* method)
+  {
+#ifdef SIPSM_DTLS_KEY_POOL
+    if (_impl->LibraryContext != nullptr) {
+      return SSL_CTX_new_ex(_impl->LibraryContext, PROVIDER_PREFERRED, method);
+    }
+#endif
+    return SSL_CTX_new(method);
+  }
+
+  EVP_PKEY* DtlsKeyPool::Take(DtlsKeyGroup group)
+  {
+    EVP_PKEY* key = nullptr;
+    int remaining = 0;
+    {
+      std::lock_guard<std::mutex> lock(_impl->Lock);
+      std::vector<EVP_PKEY*>& keys = _impl->Keys[(int)group];
+      if (!keys.empty()) {
+        key = keys.back();
+        keys.pop_back();
+        remaining = (int)keys.size();
+      }
+    }
+
+    if (key != nullptr) {
+      _impl->Taken.fetch_add(1, std::memory_order_relaxed);
+      _taken.Add();
+      if (remaining <= _impl->Capacity / 2) {
+        _impl->ScheduleRefill();
+      }
+      return key;
+    }
+
+    _impl->Misses.fetch_add(1, std::memory_order_relaxed);
+    _misses.Add();
+    _impl->ScheduleRefill();
+    return GenerateKey(group);
+  }
+
+  DtlsKeyPoolStats DtlsKeyPool::GetStats() const
+  {
+    DtlsKeyPoolStats stats;
+    stats.Taken = _impl->Taken.load(std::memory_order_relaxed);
+    stats.Misses = _impl->Misses.load(std::memory_order_relaxed);
+    stats.Generated = _impl->Generated.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    for (int g = 0; g < GROUP_COUNT; g++) {
+      stats.Available[g] = (int)_impl->Keys[g].size();
+    }
+    return stats;
+  }
+}
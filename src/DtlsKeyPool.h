@@ -0,0 +1,118 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsKeyPool.h
+//
+// Description: A pool of ephemeral ECDHE key pairs generated ahead of the DTLS
+// handshakes that use them. Generating the server's key share is one of the
+// more expensive steps of a handshake and sits on the call setup path, the
+// pool moves it to the scheduler's background lane where it runs when the
+// workers have nothing more urgent to do.
+//
+// OpenSSL has no callback for the key share, so the pool is handed to it as
+// a small provider loaded into a library context of the pool's own. The
+// provider's X25519 and EC key management takes the key pairs it generates
+// from the pool and passes everything else, including the key exchange, to
+// OpenSSL's default provider. SSL contexts created by NewContext are in that
+// library context and prefer the provider. Each key pair is used by one
+// handshake only and freed with it, so the key shares stay ephemeral. When
+// the pool for a group is empty the key pair is generated inline as before.
+// X25519 and P-256 key pairs are pooled, other EC groups are generated inline.
+//
+// Requires OpenSSL 3, with older versions NewContext creates an ordinary
+// context and nothing is pooled.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  class MediaScheduler;
+
+  enum class DtlsKeyGroup
+  {
+    X25519 = 0,
+    P256 = 1,
+  };
+
+  struct DtlsKeyPoolStats
+  {
+    uint64_t Taken;             // Key pairs handed to handshakes from the pool.
+    uint64_t Misses;            // Key pairs generated inline because the pool was empty.
+    uint64_t Generated;         // Key pairs generated into the pool.
+    int Available[2];           // Key pairs in the pool for each DtlsKeyGroup.
+  };
+
+  class DtlsKeyPool
+  {
+  public:
+
+    static const int GROUP_COUNT = 2;
+
+    /**
+    * The key pairs kept for each group. The pool is topped up once it is half empty.
+    */
+    static const int DEFAULT_CAPACITY = 64;
+
+    /**
+    * The process wide pool, filled on MediaScheduler::Default. Never destroyed.
+    */
+    static DtlsKeyPool& Default();
+
+    /**
+    * Whether the OpenSSL version supports pooling key pairs.
+    */
+    static bool IsSupported();
+
+    /**
+    * Constructor. The pool starts empty, it is filled as handshakes use it or by Fill.
+    * @param[in] capacity: the key pairs kept for each group.
+    * @param[in] scheduler: the scheduler the pool is topped up on, null for
+    *  MediaScheduler::Default.
+    */
+    explicit DtlsKeyPool(int capacity = DEFAULT_CAPACITY, MediaScheduler* scheduler = nullptr);
+
+    /**
+    * Destructor. Waits for a top up in progress. The SSL contexts created by
+    * NewContext must have been freed.
+    */
+    ~DtlsKeyPool();
+
+    DtlsKeyPool(const DtlsKeyPool&) = delete;
+    DtlsKeyPool& operator=(const DtlsKeyPool&) = delete;
+
+    /**
+    * Generates key pairs on the calling thread until the pool for each group is full,
+    * for example at startup before calls are accepted.
+    */
+    void Fill();
+
+    /**
+    * Creates an SSL context whose handshakes take their key shares from the pool.
+    * @param[in] method: the method to create the context with, e.g. DTLS_server_method().
+    * @@Returns: the new context or null if it couldn't be created.
+    */
+    SSL_CTX* NewContext(const SSL_METHOD* method);
+
+    /**
+    * Takes a key pair from the pool, or generates it inline if the pool is empty, and
+    * tops the pool up in the background once it is half empty. Used by the provider,
+    * the caller owns the key.
+    * @@Returns: the key pair or null if it couldn't be generated.
+    */
+    EVP_PKEY* Take(DtlsKeyGroup group);
+
+    DtlsKeyPoolStats GetStats() const;
+
+  private:
+
+    struct Impl;
+    Impl* _impl;
+  };
+}
@@ -0,0 +1,885 @@
+//-----------------------------------------------------------------------------
+// Filename: EncoderService.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "EncoderService.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+typedef int socklen_t;
+#define SHUT_RDWR SD_BOTH
+#else
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const uint32_t MESSAGE_MAGIC = 0x31455653;    // "SVE1"
+    const uint32_t MAX_PAYLOAD_LENGTH = 64 * 1024 * 1024;
+    const int ACCEPT_POLL_MILLISECONDS = 100;
+
+    enum MessageType : uint32_t
+    {
+      MESSAGE_INIT = 1,
+      MESSAGE_ENCODE = 2,
+      MESSAGE_SET_CPU_USED = 3,
+      MESSAGE_SET_RESOLUTION = 4,
+      MESSAGE_RESULT = 100,
+      MESSAGE_ENCODED = 101,
+    };
+
+    struct MessageHeader
+    {
+      uint32_t Magic;
+      uint32_t Type;
+      uint32_t Length;      // The bytes following the header.
+      uint32_t Reserved;
+    };
+
+    struct InitMessage
+    {
+      uint32_t Width;
+      uint32_t Height;
+      uint32_t Stride;
+      uint32_t TargetBitrate;
+      uint32_t MinQuantizer;
+      uint32_t MaxQuantizer;
+      uint32_t IsCbr;
+      int32_t CpuUsed;
+    };
+
+    struct SettingMessage
+    {
+      int32_t First;
+      int32_t Second;
+    };
+
+    struct EncodeMessage
+    {
+      int32_t SampleCount;
+      uint32_t ImageLength;     // Followed by the I420 image.
+    };
+
+    struct ResultMessage
+    {
+      int32_t Status;
+      uint32_t Reserved;
+    };
+
+    struct EncodedMessage
+    {
+      int32_t Status;
+      uint32_t IsKeyFrame;
+      uint64_t EncodeNanoseconds;
+      uint32_t FrameLength;     // Followed by the encoded frame.
+      uint32_t Reserved;
+    };
+
+    void InitialiseSockets()
+    {
+#ifdef _WIN32
+      static std::once_flag once;
+      std::call_once(once, []() {
+        WSADATA wsaData;
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+      });
+#endif
+    }
+
+    int LastSocketError()
+    {
+#ifdef _WIN32
+      return WSAGetLastError();
+#else
+      return errno;
+#endif
+    }
+
+    struct Endpoint
+    {
+      sockaddr_storage Address;
+      socklen_t AddressLength = 0;
+      bool IsUnix = false;
+      std::string Path;
+      std::string Host;
+    };
+
+    /**
+    * Parses "unix:<path>" or "tcp:<host>:<port>".
+    */
+    int ParseEndpoint(const std::string& text, Endpoint& endpoint)
+    {
+      memset(&endpoint.Address, 0, sizeof(endpoint.Address));
+
+      if (text.compare(0, 5, "unix:") == 0) {
+        sockaddr_un* address = reinterpret_cast<sockaddr_un*>(&endpoint.Address);
+        endpoint.IsUnix = true;
+        endpoint.Path = text.substr(5);
+        if (endpoint.Path.empty() || endpoint.Path.size() >= sizeof(address->sun_path)) {
+          return -1;
+        }
+
+        address->sun_family = AF_UNIX;
+        memcpy(address->sun_path, endpoint.Path.c_str(), endpoint.Path.size() + 1);
+        endpoint.AddressLength = (socklen_t)sizeof(sockaddr_un);
+        return 0;
+      }
+      else if (text.compare(0, 4, "tcp:") == 0) {
+        size_t colon = text.rfind(':');
+        if (colon <= 4) {
+          return -1;
+        }
+
+        endpoint.Host = text.substr(4, colon - 4);
+        std::string port = text.substr(colon + 1);
+        if (endpoint.Host.size() > 2 && endpoint.Host.front() == '[' && endpoint.Host.back() == ']') {
+          endpoint.Host = endpoint.Host.substr(1, endpoint.Host.size() - 2);
+        }
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(endpoint.Host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr) {
+          return -1;
+        }
+
+        memcpy(&endpoint.Address, result->ai_addr, result->ai_addrlen);
+        endpoint.AddressLength = (socklen_t)result->ai_addrlen;
+        freeaddrinfo(result);
+        return 0;
+      }
+
+      return -1;
+    }
+
+    bool IsLoopback(const Endpoint& endpoint)
+    {
+      if (endpoint.Address.ss_family == AF_INET) {
+        const sockaddr_in* address = reinterpret_cast<const sockaddr_in*>(&endpoint.Address);
+        return (ntohl(address->sin_addr.s_addr) >> 24) == 127;
+      }
+      else if (endpoint.Address.ss_family == AF_INET6) {
+        const sockaddr_in6* address = reinterpret_cast<const sockaddr_in6*>(&endpoint.Address);
+        return IN6_IS_ADDR_LOOPBACK(&address->sin6_addr) != 0;
+      }
+      return false;
+    }
+
+    void SetNoDelay(SOCKET socket, const Endpoint& endpoint)
+    {
+      // Each frame is a request and a reply, Nagle would hold the reply back.
+      if (!endpoint.IsUnix) {
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+      }
+    }
+
+    int SendAll(SOCKET socket, const void* data, size_t length)
+    {
+      const char* position = static_cast<const char*>(data);
+      while (length > 0) {
+        int chunk = (length > 0x40000000) ? 0x40000000 : (int)length;
+        int sent = (int)send(socket, position, chunk, SEND_FLAGS);
+        if (sent <= 0) {
+#ifndef _WIN32
+          if (sent < 0 && errno == EINTR) {
+            continue;
+          }
+#endif
+          return -1;
+        }
+        position += sent;
+        length -= (size_t)sent;
+      }
+      return 0;
+    }
+
+    int ReceiveAll(SOCKET socket, void* data, size_t length)
+    {
+      char* position = static_cast<char*>(data);
+      while (length > 0) {
+        int chunk = (length > 0x40000000) ? 0x40000000 : (int)length;
+        int received = (int)recv(socket, position, chunk, 0);
+        if (received <= 0) {
+#ifndef _WIN32
+          if (received < 0 && errno == EINTR) {
+            continue;
+          }
+#endif
+          return -1;
+        }
+        position += received;
+        length -= (size_t)received;
+      }
+      return 0;
+    }
+
+    int SendMessage(SOCKET socket, uint32_t type, const void* message, size_t messageLength, const uint8_t* data, size_t dataLength)
+    {
+      MessageHeader header = { MESSAGE_MAGIC, type, (uint32_t)(messageLength + dataLength), 0 };
+      if (SendAll(socket, &header, sizeof(header)) != 0 || SendAll(socket, message, messageLength) != 0) {
+        return -1;
+      }
+      return (dataLength > 0) ? SendAll(socket, data, dataLength) : 0;
+    }
+
+    /**
+    * Reads a message, the payload is left in the buffer.
+    */
+    int ReceiveMessage(SOCKET socket, uint32_t& type, std::vector<uint8_t>& payload)
+    {
+      MessageHeader header;
+      if (ReceiveAll(socket, &header, sizeof(header)) != 0) {
+        return -1;
+      }
+
+      if (header.Magic != MESSAGE_MAGIC || header.Length > MAX_PAYLOAD_LENGTH) {
+        SIPSM_LOG_WARNING("Encoder service message with a bad header, type %u length %u.", header.Type, header.Length);
+        return -1;
+      }
+
+      type = header.Type;
+      payload.resize(header.Length);
+      return (header.Length > 0) ? ReceiveAll(socket, payload.data(), header.Length) : 0;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // EncoderWorker.
+  //---------------------------------------------------------------------------
+
+  struct EncoderWorker::Impl
+  {
+    struct Connection
+    {
+      SOCKET Socket = INVALID_SOCKET;
+      std::thread Thread;
+      std::atomic<bool> IsDone{ false };
+    };
+
+    SOCKET Listener = INVALID_SOCKET;
+    Endpoint ListenEndpoint;
+    std::string Name;
+    std::thread AcceptThread;
+    std::atomic<bool> IsStopping{ false };
+
+    mutable std::mutex Lock;
+    std::vector<std::unique_ptr<Connection>> Connections;
+    VpxStats Totals{};
+
+    void Accept()
+    {
+      while (!IsStopping.load(std::memory_order_acquire)) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(Listener, &readable);
+        timeval timeout = { 0, ACCEPT_POLL_MILLISECONDS * 1000 };
+
+        Reap(false);
+
+        if (select((int)Listener + 1, &readable, nullptr, nullptr, &timeout) <= 0) {
+          continue;
+        }
+
+        SOCKET socket = accept(Listener, nullptr, nullptr);
+        if (socket == INVALID_SOCKET) {
+          continue;
+        }
+
+        SetNoDelay(socket, ListenEndpoint);
+
+        std::unique_ptr<Connection> connection(new Connection());
+        connection->Socket = socket;
+        Connection* serving = connection.get();
+
+        std::lock_guard<std::mutex> lock(Lock);
+        connection->Thread = std::thread([this, serving]() { Serve(*serving); });
+        Connections.push_back(std::move(connection));
+      }
+    }
+
+    /**
+    * Joins the threads of closed connections, or of all of them when stopping.
+    */
+    void Reap(bool isAll)
+    {
+      std::vector<std::unique_ptr<Connection>> finished;
+      {
+        std::lock_guard<std::mutex> lock(Lock);
+        for (auto it = Connections.begin(); it != Connections.end();) {
+          if (isAll || (*it)->IsDone.load(std::memory_order_acquire)) {
+            // A connection that is done has closed its socket under the lock, and the
+            // handle may already belong to another socket.
+            if (isAll && !(*it)->IsDone.load(std::memory_order_acquire)) {
+              shutdown((*it)->Socket, SHUT_RDWR);
+            }
+            finished.push_back(std::move(*it));
+            it = Connections.erase(it);
+          }
+          else {
+            ++it;
+          }
+        }
+      }
+
+      for (auto& connection : finished) {
+        connection->Thread.join();
+      }
+    }
+
+    void Serve(Connection& connection)
+    {
+      VpxEncoderNative encoder;
+      std::vector<uint8_t> payload;
+      uint32_t type = 0;
+      bool isOpen = true;
+
+      while (isOpen && ReceiveMessage(connection.Socket, type, payload) == 0) {
+        ResultMessage result = { -1, 0 };
+
+        switch (type) {
+        case MESSAGE_INIT:
+          if (payload.size() >= sizeof(InitMessage)) {
+            InitMessage init;
+            memcpy(&init, payload.data(), sizeof(init));
+
+            VpxEncoderConfig config;
+            config.TargetBitrate = init.TargetBitrate;
+            config.MinQuantizer = init.MinQuantizer;
+            config.MaxQuantizer = init.MaxQuantizer;
+            config.IsCbr = init.IsCbr != 0;
+            config.CpuUsed = init.CpuUsed;
+            result.Status = encoder.InitEncoder(init.Width, init.Height, init.Stride, config);
+          }
+          isOpen = SendMessage(connection.Socket, MESSAGE_RESULT, &result, sizeof(result), nullptr, 0) == 0;
+          break;
+
+        case MESSAGE_SET_CPU_USED:
+        case MESSAGE_SET_RESOLUTION:
+          if (payload.size() >= sizeof(SettingMessage)) {
+            SettingMessage setting;
+            memcpy(&setting, payload.data(), sizeof(setting));
+            result.Status = (type == MESSAGE_SET_CPU_USED) ? encoder.SetCpuUsed(setting.First) :
+              encoder.SetResolution((unsigned int)setting.First, (unsigned int)setting.Second);
+          }
+          isOpen = SendMessage(connection.Socket, MESSAGE_RESULT, &result, sizeof(result), nullptr, 0) == 0;
+          break;
+
+        case MESSAGE_ENCODE:
+        {
+          EncodedMessage encoded;
+          memset(&encoded, 0, sizeof(encoded));
+          encoded.Status = -1;
+
+          const uint8_t* frame = nullptr;
+          int frameLength = 0;
+
+          EncodeMessage request;
+          if (payload.size() >= sizeof(request)) {
+            memcpy(&request, payload.data(), sizeof(request));
+          }
+
+          // Encode fails an image that is shorter than a frame of the encoder's size.
+          if (payload.size() >= sizeof(request) && request.ImageLength == payload.size() - sizeof(request)) {
+            bool isKeyFrame = false;
+            uint64_t start = MediaScheduler::NowNanoseconds();
+            encoded.Status = encoder.Encode(payload.data() + sizeof(request), (int)request.ImageLength, request.SampleCount,
+              &frame, &frameLength, &isKeyFrame);
+            encoded.EncodeNanoseconds = MediaScheduler::NowNanoseconds() - start;
+            encoded.IsKeyFrame = isKeyFrame ? 1 : 0;
+            encoded.FrameLength = (encoded.Status == 0 && frame != nullptr) ? (uint32_t)frameLength : 0;
+          }
+
+          isOpen = SendMessage(connection.Socket, MESSAGE_ENCODED, &encoded, sizeof(encoded), frame, encoded.FrameLength) == 0;
+          break;
+        }
+
+        default:
+          SIPSM_LOG_WARNING("Encoder worker closing a connection that sent message type %u.", type);
+          isOpen = false;
+          break;
+        }
+      }
+
+      const VpxStats& stats = encoder.GetStats();
+      {
+        std::lock_guard<std::mutex> lock(Lock);
+        Totals.FramesEncoded += stats.FramesEncoded;
+        Totals.KeyFramesEncoded += stats.KeyFramesEncoded;
+        Totals.BytesEncoded += stats.BytesEncoded;
+        Totals.EncodeFailures += stats.EncodeFailures;
+
+        // Closed under the lock so Reap can't shut the socket down after it's closed.
+        closesocket(connection.Socket);
+        connection.IsDone.store(true, std::memory_order_release);
+      }
+    }
+  };
+
+  EncoderWorker::EncoderWorker() :
+    _impl(new Impl())
+  { }
+
+  EncoderWorker::~EncoderWorker()
+  {
+    Stop();
+    delete _impl;
+  }
+
+  int EncoderWorker::Listen(const std::string& endpoint)
+  {
+    InitialiseSockets();
+
+    if (_impl->Listener != INVALID_SOCKET) {
+      SIPSM_LOG_ERROR("The encoder worker is already listening on %s.", _impl->Name.c_str());
+      return -1;
+    }
+
+    Endpoint& listenEndpoint = _impl->ListenEndpoint;
+    if (ParseEndpoint(endpoint, listenEndpoint) != 0) {
+      SIPSM_LOG_ERROR("Invalid encoder worker endpoint %s.", endpoint.c_str());
+      return -1;
+    }
+
+    // Connections aren't authenticated, anything that can connect can use the worker.
+    if (!listenEndpoint.IsUnix && !IsLoopback(listenEndpoint)) {
+      SIPSM_LOG_ERROR("The encoder worker only listens on loopback addresses, not %s.", endpoint.c_str());
+      return -1;
+    }
+
+    SOCKET listener = socket(listenEndpoint.Address.ss_family, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) {
+      SIPSM_LOG_ERROR("Failed to create the encoder worker socket, error %d.", LastSocketError());
+      return -1;
+    }
+
+    if (listenEndpoint.IsUnix) {
+      // A socket file left behind by a worker that didn't stop cleanly.
+#ifdef _WIN32
+      DeleteFileA(listenEndpoint.Path.c_str());
+#else
+      unlink(listenEndpoint.Path.c_str());
+#endif
+    }
+    else {
+      int reuse = 1;
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+    }
+
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&listenEndpoint.Address), listenEndpoint.AddressLength) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+      SIPSM_LOG_ERROR("Failed to listen on %s, error %d.", endpoint.c_str(), LastSocketError());
+      closesocket(listener);
+      return -1;
+    }
+
+    _impl->Listener = listener;
+    _impl->Name = endpoint;
+
+    if (!listenEndpoint.IsUnix) {
+      sockaddr_storage bound;
+      socklen_t boundLength = sizeof(bound);
+      getsockname(listener, reinterpret_cast<sockaddr*>(&bound), &boundLength);
+      uint16_t port = (bound.ss_family == AF_INET6) ? ntohs(reinterpret_cast<sockaddr_in6*>(&bound)->sin6_port) :
+        ntohs(reinterpret_cast<sockaddr_in*>(&bound)->sin_port);
+      _impl->Name = endpoint.substr(0, endpoint.rfind(':') + 1) + std::to_string(port);
+    }
+
+    return 0;
+  }
+
+  const std::string& EncoderWorker::GetEndpoint() const
+  {
+    return _impl->Name;
+  }
+
+  int EncoderWorker::Start()
+  {
+    if (_impl->Listener == INVALID_SOCKET || _impl->AcceptThread.joinable()) {
+      return -1;
+    }
+
+    _impl->IsStopping.store(false, std::memory_order_release);
+    _impl->AcceptThread = std::thread([this]() { _impl->Accept(); });
+    return 0;
+  }
+
+  void EncoderWorker::Stop()
+  {
+    _impl->IsStopping.store(true, std::memory_order_release);
+    if (_impl->AcceptThread.joinable()) {
+      _impl->AcceptThread.join();
+    }
+
+    _impl->Reap(true);
+
+    if (_impl->Listener != INVALID_SOCKET) {
+      closesocket(_impl->Listener);
+      _impl->Listener = INVALID_SOCKET;
+
+      if (_impl->ListenEndpoint.IsUnix) {
+#ifdef _WIN32
+        DeleteFileA(_impl->ListenEndpoint.Path.c_str());
+#else
+        unlink(_impl->ListenEndpoint.Path.c_str());
+#endif
+      }
+    }
+  }
+
+  int EncoderWorker::GetConnectionCount() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    int count = 0;
+    for (auto& connection : _impl->Connections) {
+      count += connection->IsDone.load(std::memory_order_acquire) ? 0 : 1;
+    }
+    return count;
+  }
+
+  VpxStats EncoderWorker::GetStats() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    return _impl->Totals;
+  }
+
+  //---------------------------------------------------------------------------
+  // EncoderWorkerPool.
+  //---------------------------------------------------------------------------
+
+  void EncoderWorkerPool::Add(const std::string& endpoint)
+  {
+    std::unique_ptr<Worker> worker(new Worker());
+    worker->Endpoint = endpoint;
+    _workers.push_back(std::move(worker));
+  }
+
+  int EncoderWorkerPool::GetEncoderCount(int worker) const
+  {
+    return (worker >= 0 && worker < (int)_workers.size()) ? _workers[worker]->Encoders.load(std::memory_order_relaxed) : 0;
+  }
+
+  int EncoderWorkerPool::Pick() const
+  {
+    uint64_t now = MediaScheduler::NowNanoseconds();
+    int best = -1;
+    int bestEncoders = 0;
+
+    for (int i = 0; i < (int)_workers.size(); i++) {
+      const Worker& worker = *_workers[i];
+      int encoders = worker.Encoders.load(std::memory_order_relaxed);
+      if (worker.RetryAfterNanoseconds.load(std::memory_order_relaxed) <= now && (best < 0 || encoders < bestEncoders)) {
+        best = i;
+        bestEncoders = encoders;
+      }
+    }
+
+    return best;
+  }
+
+  void EncoderWorkerPool::MarkFailed(int worker)
+  {
+    if (worker >= 0 && worker < (int)_workers.size()) {
+      _workers[worker]->RetryAfterNanoseconds.store(MediaScheduler::NowNanoseconds() + RETRY_MILLISECONDS * 1000000ULL,
+        std::memory_order_relaxed);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // RemoteVpxEncoder.
+  //---------------------------------------------------------------------------
+
+  RemoteVpxEncoder::RemoteVpxEncoder(EncoderWorkerPool& pool) :
+    _workerPool(pool)
+  { }
+
+  RemoteVpxEncoder::~RemoteVpxEncoder()
+  {
+    Disconnect(false);
+  }
+
+  int RemoteVpxEncoder::InitEncoder(unsigned int width, unsigned int height, unsigned int stride, const VpxEncoderConfig& config)
+  {
+    InitialiseSockets();
+    Disconnect(false);
+
+    _config = config;
+    _width = _initialWidth = (int)width;
+    _height = _initialHeight = (int)height;
+    _stride = (int)stride;
+    _cpuUsed = config.CpuUsed;
+
+    return Connect();
+  }
+
+  int RemoteVpxEncoder::SetCpuUsed(int cpuUsed)
+  {
+    if (cpuUsed < -16 || cpuUsed > 16) {
+      return -1;
+    }
+
+    _cpuUsed = cpuUsed;
+    return SendSetting(MESSAGE_SET_CPU_USED, cpuUsed, 0);
+  }
+
+  int RemoteVpxEncoder::SetResolution(unsigned int width, unsigned int height)
+  {
+    if (width == 0 || height == 0 || (int)width > _initialWidth || (int)height > _initialHeight) {
+      SIPSM_LOG_ERROR("Can't change the remote encoder to %ux%u, it was initialised for %dx%d.", width, height,
+        _initialWidth, _initialHeight);
+      return -1;
+    }
+
+    _width = (int)width;
+    _height = (int)height;
+    return SendSetting(MESSAGE_SET_RESOLUTION, (int32_t)width, (int32_t)height);
+  }
+
+  int RemoteVpxEncoder::Encode(const uint8_t* i420, int i420Length, int sampleCount, MediaBufferPtr& frame, bool* isKeyFrame)
+  {
+    frame.Reset();
+    if (isKeyFrame != nullptr) {
+      *isKeyFrame = false;
+    }
+
+    EncodeMessage request = { sampleCount, (uint32_t)i420Length };
+    uint64_t start = 0;
+    bool isSent = false;
+
+    // A frame that fails on one worker is sent once more to another.
+    for (int attempt = 0; attempt < 2 && !isSent; attempt++) {
+      if (_socket == -1 && Connect() != 0) {
+        break;
+      }
+
+      start = MediaScheduler::NowNanoseconds();
+      if (Request(MESSAGE_ENCODE, &request, sizeof(request), i420, (size_t)i420Length) == 0 &&
+        _reply.size() >= sizeof(EncodedMessage)) {
+        isSent = true;
+      }
+      else {
+        Disconnect(true);
+      }
+    }
+
+    if (!isSent) {
+      _stats.EncodeFailures++;
+      return -1;
+    }
+
+    uint64_t roundTrip = MediaScheduler::NowNanoseconds() - start;
+
+    EncodedMessage encoded;
+    memcpy(&encoded, _reply.data(), sizeof(encoded));
+
+    _remoteStats.FramesSent++;
+    _remoteStats.BytesSent += (uint64_t)i420Length;
+    _remoteStats.BytesReceived += encoded.FrameLength;
+    _remoteStats.RoundTripNanosecondsTotal += roundTrip;
+    _remoteStats.RoundTripMaxNanoseconds = (roundTrip > _remoteStats.RoundTripMaxNanoseconds) ? roundTrip : _remoteStats.RoundTripMaxNanoseconds;
+    _remoteStats.WorkerEncodeNanosecondsTotal += encoded.EncodeNanoseconds;
+
+    if (encoded.Status != 0 || encoded.FrameLength > _reply.size() - sizeof(encoded)) {
+      _stats.EncodeFailures++;
+      return -1;
+    }
+
+    if (encoded.FrameLength > 0) {
+      frame = _pool->Acquire(encoded.FrameLength);
+      if (!frame) {
+        SIPSM_LOG_ERROR("Failed to allocate a buffer for the encoded frame.");
+        return -1;
+      }
+      memcpy(frame->Data(), _reply.data() + sizeof(encoded), encoded.FrameLength);
+      frame->SetId(sampleCount);
+
+      _stats.FramesEncoded++;
+      _stats.KeyFramesEncoded += (encoded.IsKeyFrame != 0) ? 1 : 0;
+      _stats.BytesEncoded += encoded.FrameLength;
+
+      if (isKeyFrame != nullptr) {
+        *isKeyFrame = encoded.IsKeyFrame != 0;
+      }
+    }
+
+    return 0;
+  }
+
+  void RemoteVpxEncoder::Park()
+  {
+    Disconnect(false);
+    _isParked = true;
+  }
+
+  std::string RemoteVpxEncoder::GetWorkerEndpoint() const
+  {
+    return (_worker >= 0) ? _workerPool._workers[_worker]->Endpoint : std::string();
+  }
+
+  /**
+  * Connects to the least loaded worker and sets its encoder up the way this one is.
+  */
+  int RemoteVpxEncoder::Connect()
+  {
+    if (_initialWidth == 0) {
+      SIPSM_LOG_ERROR("The remote encoder hasn't been initialised.");
+      return -1;
+    }
+
+    for (int attempt = 0; attempt < _workerPool.GetWorkerCount(); attempt++) {
+      int worker = _workerPool.Pick();
+      if (worker < 0) {
+        break;
+      }
+
+      const std::string& name = _workerPool._workers[worker]->Endpoint;
+      Endpoint endpoint;
+      SOCKET socket = INVALID_SOCKET;
+      if (ParseEndpoint(name, endpoint) == 0) {
+        socket = ::socket(endpoint.Address.ss_family, SOCK_STREAM, 0);
+      }
+
+      if (socket == INVALID_SOCKET ||
+        connect(socket, reinterpret_cast<const sockaddr*>(&endpoint.Address), endpoint.AddressLength) != 0) {
+        SIPSM_LOG_WARNING("Failed to connect to encoder worker %s, error %d.", name.c_str(), LastSocketError());
+        if (socket != INVALID_SOCKET) {
+          closesocket(socket);
+        }
+        _workerPool.MarkFailed(worker);
+        continue;
+      }
+
+      SetNoDelay(socket, endpoint);
+
+      _socket = (intptr_t)socket;
+      _worker = worker;
+      _workerPool._workers[worker]->Encoders.fetch_add(1, std::memory_order_relaxed);
+      _remoteStats.Connects++;
+
+      InitMessage init;
+      init.Width = (uint32_t)_initialWidth;
+      init.Height = (uint32_t)_initialHeight;
+      init.Stride = (uint32_t)_stride;
+      init.TargetBitrate = _config.TargetBitrate;
+      init.MinQuantizer = _config.MinQuantizer;
+      init.MaxQuantizer = _config.MaxQuantizer;
+      init.IsCbr = _config.IsCbr ? 1 : 0;
+      init.CpuUsed = _cpuUsed;
+
+      if (Request(MESSAGE_INIT, &init, sizeof(init), nullptr, 0) != 0) {
+        Disconnect(true);
+        continue;
+      }
+
+      ResultMessage result = { -1, 0 };
+      memcpy(&result, _reply.data(), (_reply.size() < sizeof(result)) ? _reply.size() : sizeof(result));
+
+      if (result.Status == 0 && (_width != _initialWidth || _height != _initialHeight)) {
+        result.Status = SendSetting(MESSAGE_SET_RESOLUTION, _width, _height);
+      }
+
+      if (result.Status != 0) {
+        SIPSM_LOG_ERROR("Encoder worker %s couldn't create a %dx%d encoder.", name.c_str(), _initialWidth, _initialHeight);
+        Disconnect(false);
+        return -1;
+      }
+
+      _isParked = false;
+      return 0;
+    }
+
+    SIPSM_LOG_ERROR("No encoder worker is available.");
+    return -1;
+  }
+
+  void RemoteVpxEncoder::Disconnect(bool isFailed)
+  {
+    if (_socket != -1) {
+      closesocket((SOCKET)_socket);
+      _socket = -1;
+    }
+
+    if (_worker >= 0) {
+      _workerPool._workers[_worker]->Encoders.fetch_sub(1, std::memory_order_relaxed);
+      if (isFailed) {
+        _workerPool.MarkFailed(_worker);
+      }
+      _worker = -1;
+    }
+  }
+
+  /**
+  * Sends a message to the worker and reads its reply into _reply.
+  * @@Returns: 0 if successful or -1 if the connection failed.
+  */
+  int RemoteVpxEncoder::Request(uint32_t type, const void* message, size_t messageLength, const uint8_t* data, size_t dataLength)
+  {
+    uint32_t replyType = 0;
+    SOCKET socket = (SOCKET)_socket;
+
+    if (SendMessage(socket, type, message, messageLength, data, dataLength) != 0 ||
+      ReceiveMessage(socket, replyType, _reply) != 0) {
+      SIPSM_LOG_WARNING("Lost the connection to encoder worker %s.", GetWorkerEndpoint().c_str());
+      return -1;
+    }
+
+    uint32_t expected = (type == MESSAGE_ENCODE) ? MESSAGE_ENCODED : MESSAGE_RESULT;
+    return (replyType == expected) ? 0 : -1;
+  }
+
+  /**
+  * Applies a setting on the worker. While parked the setting is only stored and is
+  * applied on connecting.
+  */
+  int RemoteVpxEncoder::SendSetting(uint32_t type, int32_t first, int32_t second)
+  {
+    if (_socket == -1) {
+      return 0;
+    }
+
+    SettingMessage setting = { first, second };
+    if (Request(type, &setting, sizeof(setting), nullptr, 0) != 0 || _reply.size() < sizeof(ResultMessage)) {
+      // The next frame reconnects and applies the setting.
+      Disconnect(true);
+      return 0;
+    }
+
+    ResultMessage result;
+    memcpy(&result, _reply.data(), sizeof(result));
+    return result.Status;
+  }
+}
@@ -0,0 +1,254 @@
+//-----------------------------------------------------------------------------
+// Filename: EncoderService.h
+//
+// Description: Moves VP8 encoding out of the media process so the number of
+// encoders isn't limited by the cores of one host. An EncoderWorker, running
+// in its own process, accepts connections on a Unix domain or loopback TCP
+// socket and runs a VpxEncoderNative for each one. A
+// RemoteVpxEncoder has the same encoder methods as VpxEncoderNative and
+// sends each raw frame to a worker, chosen from an EncoderWorkerPool, and
+// returns the compressed frame.
+//
+// Each call is one request and one reply on the connection. A message is a
+// 16 byte header (magic, type, payload length, reserved) followed by a
+// fixed layout payload and, for frames, the image or the encoded frame. All
+// fields are in little endian byte order, the order of every platform the
+// library builds on.
+//
+// If a worker goes away the encoder connects to another one and resends the
+// frame. The new worker's first frame is a key frame, just as after Park.
+//
+// Connections are not authenticated and the worker trusts its clients, so
+// it only listens on loopback. A worker on another host has to be reached
+// through an authenticated tunnel such as SSH port forwarding.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+#include "VpxEncoderNative.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  /**
+  * Running totals for a remote encoder, in addition to its VpxStats. All fields
+  * are plain 64 bit integers so the structure can be copied straight across the
+  * flat C API.
+  */
+  struct RemoteEncoderStats
+  {
+    uint64_t FramesSent;
+    uint64_t BytesSent;                     // Raw image bytes sent to workers.
+    uint64_t BytesReceived;                 // Encoded bytes returned by workers.
+    uint64_t RoundTripNanosecondsTotal;     // From sending a frame to having its reply.
+    uint64_t RoundTripMaxNanoseconds;
+    uint64_t WorkerEncodeNanosecondsTotal;  // The part of the round trips spent in libvpx.
+    uint64_t Connects;                      // Including the first, so more than one is a failover.
+  };
+
+  /**
+  * Serves encoders to RemoteVpxEncoder instances in other processes.
+  */
+  class EncoderWorker
+  {
+  public:
+    EncoderWorker();
+
+    /**
+    * Stops the worker if it is running.
+    */
+    ~EncoderWorker();
+
+    EncoderWorker(const EncoderWorker&) = delete;
+    EncoderWorker& operator=(const EncoderWorker&) = delete;
+
+    /**
+    * Opens the listening socket.
+    * @param[in] endpoint: "unix:<path>" for a Unix domain socket or "tcp:<host>:<port>".
+    *  The TCP host must be a loopback address. A TCP port of 0 picks a free port, see
+    *  GetEndpoint.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int Listen(const std::string& endpoint);
+
+    /**
+    * Gets the endpoint clients connect to, with the port filled in for "tcp:<host>:0".
+    */
+    const std::string& GetEndpoint() const;
+
+    /**
+    * Starts accepting connections on a thread of its own. Each connection gets its
+    * own thread and encoder.
+    * @@Returns: 0 if successful or -1 if Listen hasn't succeeded.
+    */
+    int Start();
+
+    /**
+    * Closes the listening socket and every connection and waits for their threads.
+    */
+    void Stop();
+
+    int GetConnectionCount() const;
+
+    /**
+    * Gets the totals over every encoder the worker has run.
+    */
+    VpxStats GetStats() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+
+  /**
+  * The workers RemoteVpxEncoder instances are spread across. The workers must all be
+  * added before the pool is used.
+  */
+  class EncoderWorkerPool
+  {
+  public:
+
+    /**
+    * How long a worker that refused a connection is skipped for.
+    */
+    static const int RETRY_MILLISECONDS = 1000;
+
+    EncoderWorkerPool() { }
+
+    EncoderWorkerPool(const EncoderWorkerPool&) = delete;
+    EncoderWorkerPool& operator=(const EncoderWorkerPool&) = delete;
+
+    /**
+    * Adds a worker.
+    * @param[in] endpoint: see EncoderWorker::Listen.
+    */
+    void Add(const std::string& endpoint);
+
+    int GetWorkerCount() const { return (int)_workers.size(); }
+
+    /**
+    * Gets the number of encoders connected to a worker.
+    */
+    int GetEncoderCount(int worker) const;
+
+  private:
+    friend class RemoteVpxEncoder;
+
+    struct Worker
+    {
+      std::string Endpoint;
+      std::atomic<int> Encoders{ 0 };
+      std::atomic<uint64_t> RetryAfterNanoseconds{ 0 };
+    };
+
+    /**
+    * Picks the available worker with the fewest encoders.
+    * @@Returns: the worker's index or -1 if none are available.
+    */
+    int Pick() const;
+
+    /**
+    * Skips a worker for RETRY_MILLISECONDS after it couldn't be reached.
+    */
+    void MarkFailed(int worker);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+  };
+
+  /**
+  * A VP8 encoder that runs on an EncoderWorker. The methods match the encoder
+  * methods of VpxEncoderNative.
+  */
+  class RemoteVpxEncoder
+  {
+  public:
+
+    /**
+    * @param[in] pool: the workers to encode on, must outlive the encoder.
+    */
+    explicit RemoteVpxEncoder(EncoderWorkerPool& pool);
+    ~RemoteVpxEncoder();
+
+    RemoteVpxEncoder(const RemoteVpxEncoder&) = delete;
+    RemoteVpxEncoder& operator=(const RemoteVpxEncoder&) = delete;
+
+    /**
+    * Connects to a worker and initialises its encoder.
+    * See VpxEncoderNative::InitEncoder for the parameters.
+    * @@Returns: 0 if successful or -1 if no worker could be used.
+    */
+    int InitEncoder(unsigned int width, unsigned int height, unsigned int stride, const VpxEncoderConfig& config);
+
+    /**
+    * See VpxEncoderNative::SetCpuUsed.
+    */
+    int SetCpuUsed(int cpuUsed);
+
+    /**
+    * See VpxEncoderNative::SetResolution.
+    */
+    int SetResolution(unsigned int width, unsigned int height);
+
+    /**
+    * Sends an I420 frame to the worker and waits for the encoded frame.
+    * See VpxEncoderNative::Encode for the parameters.
+    * @@Returns: 0 if successful or -1 if the frame couldn't be encoded on any worker.
+    */
+    int Encode(const uint8_t* i420, int i420Length, int sampleCount, MediaBufferPtr& frame, bool* isKeyFrame);
+
+    /**
+    * Disconnects from the worker, which frees its encoder. The next frame connects again
+    * and is a key frame.
+    */
+    void Park();
+    bool IsParked() const { return _isParked; }
+
+    /**
+    * Sets the pool that encoded frames are allocated from. Defaults to
+    * MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    int GetWidth() const { return _width; }
+    int GetHeight() const { return _height; }
+    int GetStride() const { return _stride; }
+
+    /**
+    * Gets the endpoint of the worker in use, empty if not connected.
+    */
+    std::string GetWorkerEndpoint() const;
+
+    const VpxStats& GetStats() const { return _stats; }
+    const RemoteEncoderStats& GetRemoteStats() const { return _remoteStats; }
+
+  private:
+    int Connect();
+    void Disconnect(bool isFailed);
+    int Request(uint32_t type, const void* message, size_t messageLength, const uint8_t* data, size_t dataLength);
+    int SendSetting(uint32_t type, int32_t first, int32_t second);
+
+    EncoderWorkerPool& _workerPool;
+    intptr_t _socket = -1;
+    int _worker = -1;
+    bool _isParked = false;
+
+    VpxEncoderConfig _config;
+    int _width = 0, _height = 0, _stride = 0;
+    int _initialWidth = 0, _initialHeight = 0;
+    int _cpuUsed = 0;
+
+    std::vector<uint8_t> _reply;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+    VpxStats _stats{};
+    RemoteEncoderStats _remoteStats{};
+  };
+}
@@ -12,12 +12,15 @@
 namespace SIPSorceryMedia {
 
 	ImageConvert::ImageConvert()
+		: _native(new ImageConvertNative())
 	{ }
 
 	ImageConvert::~ImageConvert()
 	{
-		sws_freeContext(_swsContextRGBToYUV);
-		sws_freeContext(_swsContextYUVToRGB);
+		if (_native != nullptr) {
+			delete _native;
+			_native = nullptr;
+		}
 	}
 
 	int ImageConvert::ConvertRGBtoYUV(unsigned char* bmp, VideoSubTypesEnum rgbInputFormat, int width, int height, int stride, VideoSubTypesEnum yuvOutputFormat, /* out */ array<Byte> ^% buffer)
@@ -25,37 +28,17 @@ namespace SIPSorceryMedia {
 		AVPixelFormat rgbPixelFormat = VideoSubTypes::GetPixelFormatForVideoSubType(rgbInputFormat);
 		AVPixelFormat yuvPixelFormat = VideoSubTypes::GetPixelFormatForVideoSubType(yuvOutputFormat);
 
-		_swsContextRGBToYUV = sws_getCachedContext(_swsContextRGBToYUV, width, height, rgbPixelFormat, width, height, yuvPixelFormat, SWS_BILINEAR, NULL, NULL, NULL);
-
-		if (!_swsContextRGBToYUV) {
-			fprintf(stderr, "Could not initialize the conversion context in ImageConvert::ConvertRGBtoYUV.\n");
+		int bufferSize = ImageConvertNative::GetBufferSize(yuvPixelFormat, width, height);
+		if (bufferSize <= 0) {
 			return -1;
 		}
 
-		AVFrame* dstFrame = av_frame_alloc();
-		int num_bytes = avpicture_get_size(yuvPixelFormat, width, height);
-		
-		int bufferSize = num_bytes*sizeof(uint8_t);
-		uint8_t* dstFrameBuffer = (uint8_t *)av_malloc(bufferSize);
-		avpicture_fill((AVPicture*)dstFrame, dstFrameBuffer, yuvPixelFormat, width, height);
-
-		uint8_t * srcData[1] = { bmp };		// RGB has one plane
-    int srcLinesize[1] = { stride };
-
-		int res = sws_scale(_swsContextRGBToYUV, srcData, srcLinesize, 0, height, dstFrame->data, dstFrame->linesize);
-
-		if (res == 0) {
-			fprintf(stderr, "The conversion failed in ImageConvert::ConvertRGBtoYUV.\n");
-			return -1;
-		}
-	
+		// Convert straight into the managed buffer rather than an intermediate native one.
 		buffer = gcnew array<Byte>(bufferSize);
-		Marshal::Copy((IntPtr)dstFrameBuffer, buffer, 0, bufferSize);
+		pin_ptr<Byte> pBuffer = &buffer[0];
+		int outLength = 0;
 
-		av_freep(&dstFrameBuffer);
-		av_frame_free(&dstFrame);
-		
-		return 0;
+		return _native->ConvertRGBtoYUV(bmp, rgbPixelFormat, width, height, stride, yuvPixelFormat, pBuffer, bufferSize, &outLength);
 	}
 
 	int ImageConvert::ConvertYUVToRGB(unsigned char* yuv, VideoSubTypesEnum yuvInputFormat, int width, int height, VideoSubTypesEnum rgbOutputFormat, /* out */ array<Byte> ^% buffer, /* out */ int % stride)
@@ -63,41 +46,20 @@ namespace SIPSorceryMedia {
 		AVPixelFormat yuvPixelFormat = VideoSubTypes::GetPixelFormatForVideoSubType(yuvInputFormat);
 		AVPixelFormat rgbPixelFormat = VideoSubTypes::GetPixelFormatForVideoSubType(rgbOutputFormat);
 
-		_swsContextYUVToRGB = sws_getCachedContext(_swsContextYUVToRGB, width, height, yuvPixelFormat, width, height, rgbPixelFormat, SWS_BILINEAR, NULL, NULL, NULL);
-
-		if (!_swsContextYUVToRGB) {
-			fprintf(stderr, "Could not initialize the conversion context in ImageConvert::ConvertRGBtoYUV.\n");
-			return -1;
-		}
-
-		AVFrame* srcFrame = av_frame_alloc();
-		int srcNumBytes = avpicture_get_size(yuvPixelFormat, width, height);
-		int srcBufferSize = srcNumBytes * sizeof(uint8_t);
-		uint8_t* srcFrameBuffer = (uint8_t *)av_malloc(srcBufferSize);
-		avpicture_fill((AVPicture*)srcFrame, yuv, yuvPixelFormat, width, height);
-
-		AVFrame* dstFrame = av_frame_alloc();
-		int num_bytes = avpicture_get_size(rgbPixelFormat, width, height);
-		int bufferSize = num_bytes*sizeof(uint8_t);
-		uint8_t* dstFrameBuffer = (uint8_t *)av_malloc(bufferSize);
-		avpicture_fill((AVPicture*)dstFrame, dstFrameBuffer, rgbPixelFormat, width, height);
-
-		int res = sws_scale(_swsContextYUVToRGB, srcFrame->data, srcFrame->linesize, 0, height, dstFrame->data, dstFrame->linesize);
-
-		if (res == 0) {
-			fprintf(stderr, "The conversion failed in ImageConvert::ConvertRGBtoYUV.\n");
+		int bufferSize = ImageConvertNative::GetBufferSize(rgbPixelFormat, width, height);
+		if (bufferSize <= 0) {
 			return -1;
 		}
 
+		// Convert straight into the managed buffer rather than an intermediate native one.
 		buffer = gcnew array<Byte>(bufferSize);
-		Marshal::Copy((IntPtr)dstFrameBuffer, buffer, 0, bufferSize);
-		stride = dstFrame->linesize[0];
+		pin_ptr<Byte> pBuffer = &buffer[0];
+		int outLength = 0;
+		int outStride = 0;
 
-		av_freep(&dstFrameBuffer);
-		av_frame_free(&dstFrame);
-		av_freep(&srcFrameBuffer);
-		av_frame_free(&srcFrame);
+		int res = _native->ConvertYUVToRGB(yuv, yuvPixelFormat, width, height, rgbPixelFormat, pBuffer, bufferSize, &outLength, &outStride);
+		stride = outStride;
 
-		return 0;
+		return res;
 	}
 }
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 
+#include "ImageConvertNative.h"
 #include "VideoSubTypes.h"
 
 extern "C"
@@ -87,7 +88,6 @@ namespace SIPSorceryMedia {
       /* out */ int % stride);
 
   private:
-    SwsContext* _swsContextRGBToYUV;
-    SwsContext* _swsContextYUVToRGB;
+    ImageConvertNative* _native;
   };
 }
\ No newline at end of file
@@ -0,0 +1,308 @@
+//-----------------------------------------------------------------------------
+// Filename: ImageConvertNative.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "ImageConvertNative.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTrace.h"
+
+#include <stdio.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    MetricsRegistry& _metrics = MetricsRegistry::Default();
+
+    MetricCounter& _rgbToYuvFrames = _metrics.GetCounter("sipsm_image_convert_frames_total", "Images converted.", "op=\"rgb_to_yuv\"");
+    MetricCounter& _rgbToYuvFailures = _metrics.GetCounter("sipsm_image_convert_failures_total", "Image conversions that failed.", "op=\"rgb_to_yuv\"");
+    MetricHistogram& _rgbToYuvDuration = _metrics.GetHistogram("sipsm_image_convert_duration_ns", "Time taken to convert an image.", "op=\"rgb_to_yuv\"");
+
+    MetricCounter& _yuvToRgbFrames = _metrics.GetCounter("sipsm_image_convert_frames_total", "Images converted.", "op=\"yuv_to_rgb\"");
+    MetricCounter& _yuvToRgbFailures = _metrics.GetCounter("sipsm_image_convert_failures_total", "Image conversions that failed.", "op=\"yuv_to_rgb\"");
+    MetricHistogram& _yuvToRgbDuration = _metrics.GetHistogram("sipsm_image_convert_duration_ns", "Time taken to convert an image.", "op=\"yuv_to_rgb\"");
+
+    MetricCounter& _scaleFrames = _metrics.GetCounter("sipsm_image_convert_frames_total", "Images converted.", "op=\"scale\"");
+    MetricCounter& _scaleFailures = _metrics.GetCounter("sipsm_image_convert_failures_total", "Image conversions that failed.", "op=\"scale\"");
+    MetricHistogram& _scaleDuration = _metrics.GetHistogram("sipsm_image_convert_duration_ns", "Time taken to convert an image.", "op=\"scale\"");
+  }
+
+  ImageConvertNative::ImageConvertNative()
+  { }
+
+  ImageConvertNative::~ImageConvertNative()
+  {
+    Park();
+  }
+
+  void ImageConvertNative::Park()
+  {
+    FreeContext(_rgbToYuv);
+    FreeContext(_yuvToRgb);
+    FreeContext(_scale);
+  }
+
+  SwsContext* ImageConvertNative::GetContext(ScaleContext& scale, int width, int height, AVPixelFormat sourceFormat,
+    int outWidth, int outHeight, AVPixelFormat destinationFormat)
+  {
+    if (scale.Context == nullptr || scale.Width != width || scale.Height != height ||
+      scale.OutWidth != outWidth || scale.OutHeight != outHeight ||
+      scale.SourceFormat != sourceFormat || scale.DestinationFormat != destinationFormat) {
+      MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Convert);
+
+      scale.Context = sws_getCachedContext(scale.Context, width, height, sourceFormat, outWidth, outHeight, destinationFormat, SWS_BILINEAR, NULL, NULL, NULL);
+      scale.Width = width;
+      scale.Height = height;
+      scale.OutWidth = outWidth;
+      scale.OutHeight = outHeight;
+      scale.SourceFormat = sourceFormat;
+      scale.DestinationFormat = destinationFormat;
+    }
+
+    return scale.Context;
+  }
+
+  void ImageConvertNative::FreeContext(ScaleContext& scale)
+  {
+    if (scale.Context != nullptr) {
+      MemoryAccountScope memoryScope(_memoryAccount, MemoryCategory::Convert);
+      sws_freeContext(scale.Context);
+      scale = ScaleContext();
+    }
+  }
+
+  int ImageConvertNative::GetBufferSize(AVPixelFormat pixelFormat, int width, int height)
+  {
+    return av_image_get_buffer_size(pixelFormat, width, height, 1);
+  }
+
+  int ImageConvertNative::ConvertRGBtoYUV(const uint8_t* bmp, AVPixelFormat rgbPixelFormat, int width, int height, int stride,
+    AVPixelFormat yuvPixelFormat, uint8_t* buffer, int bufferLength, int* outLength)
+  {
+    *outLength = 0;
+
+    ScopedLatency latency(_rgbToYuvDuration);
+    SIPSM_TRACE_SCOPE("convert", "ImageConvert::ConvertRGBtoYUV", 0);
+
+    SwsContext* context = GetContext(_rgbToYuv, width, height, rgbPixelFormat, width, height, yuvPixelFormat);
+
+    if (!context) {
+      SIPSM_LOG_ERROR("Could not initialize the conversion context in ImageConvert::ConvertRGBtoYUV.");
+      _stats.ConvertFailures++;
+      _rgbToYuvFailures.Add();
+      return -1;
+    }
+
+    int bufferSize = GetBufferSize(yuvPixelFormat, width, height);
+
+    if (buffer == nullptr || bufferSize <= 0 || bufferLength < bufferSize) {
+      SIPSM_LOG_ERROR("The destination buffer was too small in ImageConvert::ConvertRGBtoYUV.");
+      _stats.ConvertFailures++;
+      _rgbToYuvFailures.Add();
+      return -1;
+    }
+
+    uint8_t* dstData[4];
+    int dstLinesize[4];
+    av_image_fill_arrays(dstData, dstLinesize, buffer, yuvPixelFormat, width, height, 1);
+
+    const uint8_t* srcData[1] = { bmp };    // RGB has one plane
+    int srcLinesize[1] = { stride };
+
+    int res = sws_scale(context, srcData, srcLinesize, 0, height, dstData, dstLinesize);
+
+    if (res == 0) {
+      SIPSM_LOG_ERROR("The conversion failed in ImageConvert::ConvertRGBtoYUV.");
+      _stats.ConvertFailures++;
+      _rgbToYuvFailures.Add();
+      return -1;
+    }
+
+    *outLength = bufferSize;
+    _stats.FramesConverted++;
+    _rgbToYuvFrames.Add();
+    _stats.BytesOut += bufferSize;
+
+    return 0;
+  }
+
+  int ImageConvertNative::ConvertYUVToRGB(const uint8_t* yuv, AVPixelFormat yuvPixelFormat, int width, int height,
+    AVPixelFormat rgbPixelFormat, uint8_t* buffer, int bufferLength, int* outLength, int* stride)
+  {
+    *outLength = 0;
+
+    ScopedLatency latency(_yuvToRgbDuration);
+    SIPSM_TRACE_SCOPE("convert", "ImageConvert::ConvertYUVToRGB", 0);
+
+    SwsContext* context = GetContext(_yuvToRgb, width, height, yuvPixelFormat, width, height, rgbPixelFormat);
+
+    if (!context) {
+      SIPSM_LOG_ERROR("Could not initialize the conversion context in ImageConvert::ConvertYUVToRGB.");
+      _stats.ConvertFailures++;
+      _yuvToRgbFailures.Add();
+      return -1;
+    }
+
+    int bufferSize = GetBufferSize(rgbPixelFormat, width, height);
+
+    if (buffer == nullptr || bufferSize <= 0 || bufferLength < bufferSize) {
+      SIPSM_LOG_ERROR("The destination buffer was too small in ImageConvert::ConvertYUVToRGB.");
+      _stats.ConvertFailures++;
+      _yuvToRgbFailures.Add();
+      return -1;
+    }
+
+    uint8_t* srcData[4];
+    int srcLinesize[4];
+    av_image_fill_arrays(srcData, srcLinesize, yuv, yuvPixelFormat, width, height, 1);
+
+    uint8_t* dstData[4];
+    int dstLinesize[4];
+    av_image_fill_arrays(dstData, dstLinesize, buffer, rgbPixelFormat, width, height, 1);
+
+    int res = sws_scale(context, srcData, srcLinesize, 0, height, dstData, dstLinesize);
+
+    if (res == 0) {
+      SIPSM_LOG_ERROR("The conversion failed in ImageConvert::ConvertYUVToRGB.");
+      _stats.ConvertFailures++;
+      _yuvToRgbFailures.Add();
+      return -1;
+    }
+
+    *outLength = bufferSize;
+    *stride = dstLinesize[0];
+    _stats.FramesConverted++;
+    _yuvToRgbFrames.Add();
+    _stats.BytesOut += bufferSize;
+
+    return 0;
+  }
+
+  int ImageConvertNative::ConvertRGBtoYUV(const uint8_t* bmp, AVPixelFormat rgbPixelFormat, int width, int height, int stride,
+    AVPixelFormat yuvPixelFormat, MediaBufferPtr& frame)
+  {
+    frame.Reset();
+
+    int bufferSize = GetBufferSize(yuvPixelFormat, width, height);
+    if (bufferSize <= 0) {
+      SIPSM_LOG_ERROR("Unsupported output format or dimensions in ImageConvert::ConvertRGBtoYUV.");
+      _stats.ConvertFailures++;
+      _rgbToYuvFailures.Add();
+      return -1;
+    }
+
+    MediaBufferPtr buffer = _pool->Acquire(bufferSize);
+    if (!buffer) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer in ImageConvert::ConvertRGBtoYUV.");
+      _stats.ConvertFailures++;
+      _rgbToYuvFailures.Add();
+      return -1;
+    }
+
+    int outLength = 0;
+    int res = ConvertRGBtoYUV(bmp, rgbPixelFormat, width, height, stride, yuvPixelFormat, buffer->Data(), (int)buffer->Capacity(), &outLength);
+
+    if (res == 0) {
+      buffer->SetLength(outLength);
+      frame = std::move(buffer);
+    }
+
+    return res;
+  }
+
+  int ImageConvertNative::ConvertYUVToRGB(const uint8_t* yuv, AVPixelFormat yuvPixelFormat, int width, int height,
+    AVPixelFormat rgbPixelFormat, MediaBufferPtr& frame, int* stride)
+  {
+    frame.Reset();
+
+    int bufferSize = GetBufferSize(rgbPixelFormat, width, height);
+    if (bufferSize <= 0) {
+      SIPSM_LOG_ERROR("Unsupported output format or dimensions in ImageConvert::ConvertYUVToRGB.");
+      _stats.ConvertFailures++;
+      _yuvToRgbFailures.Add();
+      return -1;
+    }
+
+    MediaBufferPtr buffer = _pool->Acquire(bufferSize);
+    if (!buffer) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer in ImageConvert::ConvertYUVToRGB.");
+      _stats.ConvertFailures++;
+      _yuvToRgbFailures.Add();
+      return -1;
+    }
+
+    int outLength = 0;
+    int res = ConvertYUVToRGB(yuv, yuvPixelFormat, width, height, rgbPixelFormat, buffer->Data(), (int)buffer->Capacity(), &outLength, stride);
+
+    if (res == 0) {
+      buffer->SetLength(outLength);
+      frame = std::move(buffer);
+    }
+
+    return res;
+  }
+
+  int ImageConvertNative::Scale(const uint8_t* image, AVPixelFormat pixelFormat, int width, int height, int outWidth, int outHeight,
+    MediaBufferPtr& frame)
+  {
+    frame.Reset();
+
+    ScopedLatency latency(_scaleDuration);
+    SIPSM_TRACE_SCOPE("convert", "ImageConvert::Scale", 0);
+
+    int bufferSize = GetBufferSize(pixelFormat, outWidth, outHeight);
+    if (image == nullptr || bufferSize <= 0 || GetBufferSize(pixelFormat, width, height) <= 0) {
+      SIPSM_LOG_ERROR("Unsupported format or dimensions in ImageConvert::Scale.");
+      _stats.ConvertFailures++;
+      _scaleFailures.Add();
+      return -1;
+    }
+
+    SwsContext* context = GetContext(_scale, width, height, pixelFormat, outWidth, outHeight, pixelFormat);
+
+    if (!context) {
+      SIPSM_LOG_ERROR("Could not initialize the conversion context in ImageConvert::Scale.");
+      _stats.ConvertFailures++;
+      _scaleFailures.Add();
+      return -1;
+    }
+
+    MediaBufferPtr buffer = _pool->Acquire(bufferSize);
+    if (!buffer) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer in ImageConvert::Scale.");
+      _stats.ConvertFailures++;
+      _scaleFailures.Add();
+      return -1;
+    }
+
+    uint8_t* srcData[4];
+    int srcLinesize[4];
+    av_image_fill_arrays(srcData, srcLinesize, image, pixelFormat, width, height, 1);
+
+    uint8_t* dstData[4];
+    int dstLinesize[4];
+    av_image_fill_arrays(dstData, dstLinesize, buffer->Data(), pixelFormat, outWidth, outHeight, 1);
+
+    int res = sws_scale(context, srcData, srcLinesize, 0, height, dstData, dstLinesize);
+
+    if (res == 0) {
+      SIPSM_LOG_ERROR("The conversion failed in ImageConvert::Scale.");
+      _stats.ConvertFailures++;
+      _scaleFailures.Add();
+      return -1;
+    }
+
+    buffer->SetLength(bufferSize);
+    frame = std::move(buffer);
+    _stats.FramesConverted++;
+    _scaleFrames.Add();
+    _stats.BytesOut += bufferSize;
+
+    return 0;
+  }
+}
@@ -0,0 +1,203 @@
+//-----------------------------------------------------------------------------
+// Filename: ImageConvertNative.h
+//
+// Description: Native (non-CLR) pixel format conversion using ffmpeg's
+// swscale. This is the core used by both the C++/CLI ImageConvert class and
+// the flat C API in NativeApi.h.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+#include "MediaMemory.h"
+
+#include <stdint.h>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+}
+
+namespace SIPSorceryMedia {
+
+  /**
+  * Running totals for a converter instance. All fields are plain 64 bit integers
+  * so the structure can be copied straight across the flat C API.
+  */
+  struct ImageConvertStats
+  {
+    uint64_t FramesConverted;
+    uint64_t BytesOut;
+    uint64_t ConvertFailures;
+  };
+
+  class ImageConvertNative
+  {
+  public:
+
+    ImageConvertNative();
+    ~ImageConvertNative();
+
+    /**
+    * Gets the number of bytes required to hold an image in the specified pixel format
+    * with no row padding.
+    * @@Returns: the buffer size required or a negative value if the format is not supported.
+    */
+    static int GetBufferSize(AVPixelFormat pixelFormat, int width, int height);
+
+    /**
+    * Converts an RGB pixel formatted image to a YUV image.
+    * @param[in] bmp: the RGB source image to convert.
+    * @param[in] rgbInputFormat: the RGB type of source image (e.g. RGB32. BGR32 etc.).
+    * @param[in] width: the width of the source image.
+    * @param[in] height: the height of the source image.
+    * @param[in] stride: the stride of the source image.
+    * @param[in] yuvOutputFormat: the YUV format for the destination image (e.g. I420, YUV2 etc.).
+    * @param[out] buffer: the caller supplied buffer to write the destination YUV image to.
+    * @param[in] bufferLength: the length of the destination buffer. Must be at least
+    *  GetBufferSize for the output format.
+    * @param[out] outLength: the number of bytes written to the destination buffer.
+    * @@Returns 0 if successful.
+    */
+    int ConvertRGBtoYUV(
+      const uint8_t* bmp,
+      AVPixelFormat rgbInputFormat,
+      int width,
+      int height,
+      int stride,
+      AVPixelFormat yuvOutputFormat,
+      uint8_t* buffer,
+      int bufferLength,
+      int* outLength);
+
+    /**
+    * Converts an RGB pixel formatted image to a YUV image in a pooled buffer.
+    * @param[out] frame: set to the converted image.
+    * See the ConvertRGBtoYUV overload above for the remaining parameters.
+    * @@Returns 0 if successful.
+    */
+    int ConvertRGBtoYUV(
+      const uint8_t* bmp,
+      AVPixelFormat rgbInputFormat,
+      int width,
+      int height,
+      int stride,
+      AVPixelFormat yuvOutputFormat,
+      MediaBufferPtr& frame);
+
+    /**
+    * Converts a YUV pixel formatted image to an RGB image.
+    * @param[in] yuv: the source image to convert.
+    * @param[in] yuvInputFormat: the YUV type of source image (e.g. I420, YUV2 etc.).
+    * @param[in] width: the width of the source image.
+    * @param[in] height: the height of the source image.
+    * @param[in] rgbOutputFormat: the RGB type format for the destination image.
+    * @param[out] buffer: the caller supplied buffer to write the destination RGB image to.
+    * @param[in] bufferLength: the length of the destination buffer. Must be at least
+    *  GetBufferSize for the output format.
+    * @param[out] outLength: the number of bytes written to the destination buffer.
+    * @param[out] stride: holds the stride (length of each row) in the destination RGB image.
+    * @@Returns 0 if successful.
+    */
+    int ConvertYUVToRGB(
+      const uint8_t* yuv,
+      AVPixelFormat yuvInputFormat,
+      int width,
+      int height,
+      AVPixelFormat rgbOutputFormat,
+      uint8_t* buffer,
+      int bufferLength,
+      int* outLength,
+      int* stride);
+
+    /**
+    * Converts a YUV pixel formatted image to an RGB image in a pooled buffer.
+    * @param[out] frame: set to the converted image.
+    * See the ConvertYUVToRGB overload above for the remaining parameters.
+    * @@Returns 0 if successful.
+    */
+    int ConvertYUVToRGB(
+      const uint8_t* yuv,
+      AVPixelFormat yuvInputFormat,
+      int width,
+      int height,
+      AVPixelFormat rgbOutputFormat,
+      MediaBufferPtr& frame,
+      int* stride);
+
+    /**
+    * Scales an image to a different size in the same pixel format in a pooled buffer,
+    * for example to make a thumbnail of a decoded I420 frame.
+    * @param[in] image: the source image, with no row padding.
+    * @param[in] pixelFormat: the pixel format of the source and destination images.
+    * @param[in] width: the width of the source image.
+    * @param[in] height: the height of the source image.
+    * @param[in] outWidth: the width of the destination image.
+    * @param[in] outHeight: the height of the destination image.
+    * @param[out] frame: set to the scaled image.
+    * @@Returns 0 if successful.
+    */
+    int Scale(
+      const uint8_t* image,
+      AVPixelFormat pixelFormat,
+      int width,
+      int height,
+      int outWidth,
+      int outHeight,
+      MediaBufferPtr& frame);
+
+    /**
+    * Frees the swscale contexts while the session is idle. They are created again by
+    * the next conversion.
+    */
+    void Park();
+
+    /**
+    * Sets the pool that converted images are allocated from. Defaults to
+    * MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    /**
+    * Optional, the account the memory held by swscale is charged to.
+    */
+    void SetMemoryAccount(MemoryAccount* account) { _memoryAccount = account; }
+
+    /**
+    * Gets the running totals for this converter.
+    */
+    const ImageConvertStats& GetStats() const { return _stats; }
+
+  private:
+
+    /**
+    * Holds a cached swscale context and the parameters it was created for, so the
+    * memory account is only measured when the context has to be created again.
+    */
+    struct ScaleContext
+    {
+      SwsContext* Context{ nullptr };
+      int Width = 0;
+      int Height = 0;
+      int OutWidth = 0;
+      int OutHeight = 0;
+      AVPixelFormat SourceFormat = AV_PIX_FMT_NONE;
+      AVPixelFormat DestinationFormat = AV_PIX_FMT_NONE;
+    };
+
+    SwsContext* GetContext(ScaleContext& scale, int width, int height, AVPixelFormat sourceFormat,
+      int outWidth, int outHeight, AVPixelFormat destinationFormat);
+    void FreeContext(ScaleContext& scale);
+
+    ScaleContext _rgbToYuv;
+    ScaleContext _yuvToRgb;
+    ScaleContext _scale;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+    MemoryAccount* _memoryAccount{ nullptr };
+    ImageConvertStats _stats{};
+  };
+}
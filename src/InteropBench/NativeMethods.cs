@@ -0,0 +1,61 @@
+﻿//-----------------------------------------------------------------------------
+// Filename: NativeMethods.cs
+//
+// Description: P/Invoke declarations for the flat C API exported by the
+// SIPSorceryMedia native library, see NativeApi.h. The non-blocking functions
+// are declared with [SuppressGCTransition] since they never block, call back
+// into managed code or take a lock.
+//
+// License: 
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+using System;
+using System.Runtime.InteropServices;
+
+namespace SIPSorcery.Media.InteropBench
+{
+    [StructLayout(LayoutKind.Sequential)]
+    public struct SrtpStats
+    {
+        public ulong RtpProtected;
+        public ulong RtpUnprotected;
+        public ulong RtcpProtected;
+        public ulong RtcpUnprotected;
+        public ulong BytesProtected;
+        public ulong BytesUnprotected;
+        public ulong ProtectFailures;
+        public ulong UnprotectFailures;
+    }
+
+    public static unsafe class NativeMethods
+    {
+        public const string LIBRARY_NAME = "SIPSorceryMedia";
+
+        public const int SIPSM_OK = 0;
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_get_api_version")]
+        public static extern int GetApiVersion();
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_get_api_version")]
+        [SuppressGCTransition]
+        public static extern int GetApiVersionNoTransition();
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_srtp_create")]
+        public static extern int SrtpCreate(byte* key, int keyLength, int isClient, out IntPtr session);
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_srtp_destroy")]
+        public static extern void SrtpDestroy(IntPtr session);
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_srtp_protect_rtp")]
+        public static extern int SrtpProtectRtp(IntPtr session, byte* buffer, int length, int capacity, int* outLength);
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_srtp_protect_rtp")]
+        [SuppressGCTransition]
+        public static extern int SrtpProtectRtpNoTransition(IntPtr session, byte* buffer, int length, int capacity, int* outLength);
+
+        [DllImport(LIBRARY_NAME, CallingConvention = CallingConvention.Cdecl, EntryPoint = "sipsm_srtp_get_stats")]
+        [SuppressGCTransition]
+        public static extern int SrtpGetStats(IntPtr session, SrtpStats* stats);
+    }
+}
@@ -0,0 +1,157 @@
+﻿//-----------------------------------------------------------------------------
+// Filename: Program.cs
+//
+// Description: Micro-benchmark comparing the per call cost of the C++/CLI
+// wrapper classes against the flat C API called via P/Invoke, P/Invoke with
+// [SuppressGCTransition] and unmanaged function pointers.
+//
+// Usage:
+// dotnet run -c Release -- [iterations]
+//
+// License: 
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+using System;
+using System.Diagnostics;
+using System.Runtime.InteropServices;
+using SIPSorceryMedia;
+
+namespace SIPSorcery.Media.InteropBench
+{
+    unsafe class Program
+    {
+        private const int DEFAULT_ITERATIONS = 1000000;
+        private const int SRTP_MASTER_KEY_LENGTH = 30;
+        private const int RTP_PACKET_LENGTH = 172;          // 12 byte header + 160 byte G711 payload.
+        private const int SRTP_MAX_TRAILER_LENGTH = 144;
+
+        static void Main(string[] args)
+        {
+            int iterations = (args.Length > 0) ? int.Parse(args[0]) : DEFAULT_ITERATIONS;
+
+            Console.WriteLine($"Interop benchmark, {iterations} iterations per case.");
+            Console.WriteLine($"{"Case",-45} {"ns/call",10}");
+
+            BenchTrivialCalls(iterations);
+            BenchSrtpProtect(iterations);
+        }
+
+        private static void Report(string name, Stopwatch sw, int iterations)
+        {
+            double nsPerCall = sw.Elapsed.TotalMilliseconds * 1000000.0 / iterations;
+            Console.WriteLine($"{name,-45} {nsPerCall,10:0.0}");
+        }
+
+        private static void BenchTrivialCalls(int iterations)
+        {
+            var vpx = new VpxEncoder();
+            int sink = 0;
+
+            var sw = Stopwatch.StartNew();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink += vpx.GetWidth();
+            }
+            Report("C++/CLI trivial method", sw, iterations);
+
+            sw.Restart();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink += NativeMethods.GetApiVersion();
+            }
+            Report("P/Invoke trivial function", sw, iterations);
+
+            sw.Restart();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink += NativeMethods.GetApiVersionNoTransition();
+            }
+            Report("P/Invoke [SuppressGCTransition] trivial", sw, iterations);
+
+            var lib = NativeLibrary.Load(NativeMethods.LIBRARY_NAME, typeof(Program).Assembly, null);
+            var getVersion = (delegate* unmanaged[Cdecl]<int>)NativeLibrary.GetExport(lib, "sipsm_get_api_version");
+
+            sw.Restart();
+            for (int i = 0; i < iterations; i++)
+            {
+                sink += getVersion();
+            }
+            Report("Function pointer trivial function", sw, iterations);
+
+            vpx.Dispose();
+            GC.KeepAlive(sink);
+        }
+
+        private static byte[] CreateRtpPacket()
+        {
+            var packet = new byte[RTP_PACKET_LENGTH + SRTP_MAX_TRAILER_LENGTH];
+            packet[0] = 0x80;       // Version 2.
+            packet[1] = 0x00;       // PCMU.
+            packet[8] = 0x12;       // SSRC.
+            packet[9] = 0x34;
+            packet[10] = 0x56;
+            packet[11] = 0x78;
+            return packet;
+        }
+
+        private static void SetSequenceNumber(byte[] packet, int seq)
+        {
+            packet[2] = (byte)(seq >> 8);
+            packet[3] = (byte)seq;
+        }
+
+        private static void BenchSrtpProtect(int iterations)
+        {
+            var key = new byte[SRTP_MASTER_KEY_LENGTH];
+            new Random(1).NextBytes(key);
+            var template = CreateRtpPacket();
+            var packet = new byte[template.Length];
+
+            // C++/CLI wrapper, the buffer is pinned on every call.
+            var srtp = new Srtp(key, true);
+            var sw = Stopwatch.StartNew();
+            for (int i = 0; i < iterations; i++)
+            {
+                Buffer.BlockCopy(template, 0, packet, 0, RTP_PACKET_LENGTH);
+                SetSequenceNumber(packet, i);
+                srtp.ProtectRTP(packet, RTP_PACKET_LENGTH, out int outLength);
+            }
+            Report("C++/CLI Srtp.ProtectRTP", sw, iterations);
+            srtp.Dispose();
+
+            fixed (byte* pKey = key)
+            fixed (byte* pPacket = packet)
+            {
+                NativeMethods.SrtpCreate(pKey, key.Length, 1, out IntPtr session);
+                int outLength = 0;
+
+                sw.Restart();
+                for (int i = 0; i < iterations; i++)
+                {
+                    Buffer.BlockCopy(template, 0, packet, 0, RTP_PACKET_LENGTH);
+                    SetSequenceNumber(packet, i);
+                    NativeMethods.SrtpProtectRtp(session, pPacket, RTP_PACKET_LENGTH, packet.Length, &outLength);
+                }
+                Report("P/Invoke sipsm_srtp_protect_rtp", sw, iterations);
+                NativeMethods.SrtpDestroy(session);
+
+                NativeMethods.SrtpCreate(pKey, key.Length, 1, out session);
+
+                sw.Restart();
+                for (int i = 0; i < iterations; i++)
+                {
+                    Buffer.BlockCopy(template, 0, packet, 0, RTP_PACKET_LENGTH);
+                    SetSequenceNumber(packet, i);
+                    NativeMethods.SrtpProtectRtpNoTransition(session, pPacket, RTP_PACKET_LENGTH, packet.Length, &outLength);
+                }
+                Report("P/Invoke [SuppressGCTransition] protect", sw, iterations);
+
+                SrtpStats stats;
+                NativeMethods.SrtpGetStats(session, &stats);
+                Console.WriteLine($"Native session protected {stats.RtpProtected} packets with {stats.ProtectFailures} failures.");
+                NativeMethods.SrtpDestroy(session);
+            }
+        }
+    }
+}
@@ -0,0 +1,427 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaAsync.h
+//
+// Description: C++20 coroutine awaitables for the blocking native calls, so a
+// session can be written as straight line code that gives up its thread
+// while it waits. A coroutine suspended on a socket, a handshake or an
+// encode holds no thread, it is resumed by a MediaScheduler worker when the
+// MediaEventLoop sees its socket become readable or its task has run. A few
+// workers can then serve thousands of sessions instead of a thread each.
+//
+//   AsyncTask RunSession(MediaEventLoop& loop, DtlsHandshakeNative& dtls, SOCKET s)
+//   {
+//     uint8_t fingerprint[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+//     int fingerprintLength = 0;
+//     if (co_await DtlsAcceptAsync(loop, dtls, s, fingerprint, &fingerprintLength) != 0) {
+//       co_return;
+//     }
+//     uint8_t packet[1500];
+//     while (co_await ReceiveAsync(loop, s, packet, sizeof(packet), 5000) > 0) { ... }
+//   }
+//
+// Only compiled for C++20, the header is empty for earlier standards and for
+// the managed assemblies.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && !defined(__cplusplus_cli)
+
+#include "DtlsHandshakeNative.h"
+#include "MediaBuffer.h"
+#include "MediaEventLoop.h"
+#include "MediaScheduler.h"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  /**
+  * The return type of a coroutine that starts straight away and runs to completion
+  * on its own, nothing waits for it. Its frame is freed when it finishes. An exception
+  * escaping the coroutine terminates the process, as it would on a plain thread.
+  */
+  struct AsyncTask
+  {
+    struct promise_type
+    {
+      AsyncTask get_return_object() noexcept { return AsyncTask(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept { }
+      void unhandled_exception() noexcept { std::terminate(); }
+    };
+  };
+
+  namespace AsyncDetail {
+
+    inline void Resume(void* context)
+    {
+      std::coroutine_handle<>::from_address(context).resume();
+    }
+
+    /**
+    * Queues a coroutine on a scheduler, or resumes it on the calling thread if the
+    * scheduler won't take it.
+    */
+    inline void ResumeOn(MediaScheduler& scheduler, TaskPriority priority, std::coroutine_handle<> handle)
+    {
+      if (scheduler.Submit(Resume, handle.address(), priority) != 0) {
+        handle.resume();
+      }
+    }
+  }
+
+  /**
+  * Moves the awaiting coroutine onto a scheduler worker, see Schedule.
+  */
+  class ScheduleAwaitable
+  {
+  public:
+    ScheduleAwaitable(MediaScheduler& scheduler, TaskPriority priority) :
+      _scheduler(scheduler), _priority(priority) { }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      // If the scheduler won't take the task the coroutine carries on where it is.
+      return _scheduler.Submit(AsyncDetail::Resume, handle.address(), _priority) == 0;
+    }
+
+    void await_resume() const noexcept { }
+
+  private:
+    MediaScheduler& _scheduler;
+    TaskPriority _priority;
+  };
+
+  /**
+  * co_await Schedule(scheduler, priority) continues the coroutine on one of the
+  * scheduler's workers in the given lane.
+  */
+  inline ScheduleAwaitable Schedule(MediaScheduler& scheduler, TaskPriority priority)
+  {
+    return ScheduleAwaitable(scheduler, priority);
+  }
+
+  /**
+  * A flag one coroutine waits on and any thread sets, for example from a sample or
+  * RTP callback. The waiter is resumed on a scheduler worker. Only one coroutine may
+  * wait at a time.
+  */
+  class AsyncEvent
+  {
+  public:
+
+    /**
+    * @param[in] scheduler: the scheduler the waiter is resumed on, must outlive the event.
+    * @param[in] priority: the lane the waiter is resumed in.
+    */
+    explicit AsyncEvent(MediaScheduler& scheduler, TaskPriority priority = TaskPriority::Video) :
+      _scheduler(scheduler), _priority(priority) { }
+
+    AsyncEvent(const AsyncEvent&) = delete;
+    AsyncEvent& operator=(const AsyncEvent&) = delete;
+
+    /**
+    * Sets the event and resumes the coroutine waiting on it, if there is one.
+    */
+    void Set()
+    {
+      void* previous = _state.exchange(SetState(), std::memory_order_acq_rel);
+      if (previous != nullptr && previous != SetState()) {
+        AsyncDetail::ResumeOn(_scheduler, _priority, std::coroutine_handle<>::from_address(previous));
+      }
+    }
+
+    /**
+    * Clears the event if it is set. Has no effect while a coroutine is waiting.
+    */
+    void Reset()
+    {
+      void* expected = SetState();
+      _state.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+    }
+
+    bool IsSet() const { return _state.load(std::memory_order_acquire) == SetState(); }
+
+    class Awaiter
+    {
+    public:
+      explicit Awaiter(AsyncEvent& owner) : _owner(owner) { }
+
+      bool await_ready() const noexcept { return _owner.IsSet(); }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        // Fails if the event was set in the meantime, the coroutine then carries on.
+        void* expected = nullptr;
+        return _owner._state.compare_exchange_strong(expected, handle.address(), std::memory_order_acq_rel);
+      }
+
+      void await_resume() const noexcept { }
+
+    private:
+      AsyncEvent& _owner;
+    };
+
+    Awaiter operator co_await() { return Awaiter(*this); }
+
+  private:
+
+    // Null if not set and no one is waiting, the event's own address if set, otherwise
+    // the waiting coroutine's handle.
+    void* SetState() const { return const_cast<AsyncEvent*>(this); }
+
+    MediaScheduler& _scheduler;
+    TaskPriority _priority;
+    std::atomic<void*> _state{ nullptr };
+  };
+
+  /**
+  * Runs an encode as a scheduler task, see EncodeAsync.
+  */
+  template<typename Encoder>
+  class EncodeAwaitable
+  {
+  public:
+    EncodeAwaitable(MediaScheduler& scheduler, Encoder& encoder, const uint8_t* i420, int i420Length, int sampleCount,
+      MediaBufferPtr& frame, bool* isKeyFrame) :
+      _scheduler(scheduler), _encoder(encoder), _i420(i420), _i420Length(i420Length), _sampleCount(sampleCount),
+      _frame(frame), _isKeyFrame(isKeyFrame) { }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      _handle = handle;
+      if (_scheduler.Submit(Run, this, TaskPriority::Video) != 0) {
+        Encode();
+        return false;
+      }
+      return true;
+    }
+
+    int await_resume() const noexcept { return _result; }
+
+  private:
+
+    // The coroutine carries on from the worker that ran the encode.
+    static void Run(void* context)
+    {
+      EncodeAwaitable* awaitable = static_cast<EncodeAwaitable*>(context);
+      awaitable->Encode();
+      awaitable->_handle.resume();
+    }
+
+    void Encode()
+    {
+      _result = _encoder.Encode(_i420, _i420Length, _sampleCount, _frame, _isKeyFrame);
+    }
+
+    MediaScheduler& _scheduler;
+    Encoder& _encoder;
+    const uint8_t* _i420;
+    int _i420Length;
+    int _sampleCount;
+    MediaBufferPtr& _frame;
+    bool* _isKeyFrame;
+    std::coroutine_handle<> _handle;
+    int _result = -1;
+  };
+
+  /**
+  * Encodes a frame on a scheduler worker in the Video lane, so a coroutine running in
+  * a more urgent lane doesn't hold its worker for the length of an encode.
+  * @param[in] encoder: a VpxEncoderNative or RemoteVpxEncoder, only one encode may be
+  *  outstanding on it at a time.
+  * See VpxEncoderNative::Encode for the other parameters, which must stay valid until
+  * the encode completes.
+  * @@Returns: an awaitable whose result is Encode's result.
+  */
+  template<typename Encoder>
+  EncodeAwaitable<Encoder> EncodeAsync(MediaScheduler& scheduler, Encoder& encoder, const uint8_t* i420, int i420Length,
+    int sampleCount, MediaBufferPtr& frame, bool* isKeyFrame)
+  {
+    return EncodeAwaitable<Encoder>(scheduler, encoder, i420, i420Length, sampleCount, frame, isKeyFrame);
+  }
+
+  /**
+  * Receives a datagram once the socket is readable, see ReceiveAsync.
+  */
+  class ReceiveAwaitable
+  {
+  public:
+    ReceiveAwaitable(MediaEventLoop& loop, SOCKET socket, uint8_t* buffer, int length, int timeoutMilliseconds,
+      TaskPriority priority) :
+      _loop(loop), _socket(socket), _buffer(buffer), _length(length), _timeoutMilliseconds(timeoutMilliseconds),
+      _priority(priority) { }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      _handle = handle;
+      if (_loop.WaitReadable(_socket, _timeoutMilliseconds, OnWait, this, _priority) != 0) {
+        _result = -1;
+        return false;
+      }
+      return true;
+    }
+
+    int await_resume() const noexcept { return _result; }
+
+  private:
+
+    static void OnWait(void* context, bool isReady)
+    {
+      ReceiveAwaitable* awaitable = static_cast<ReceiveAwaitable*>(context);
+      if (isReady) {
+        int result = (int)recv(awaitable->_socket, reinterpret_cast<char*>(awaitable->_buffer), awaitable->_length, 0);
+        awaitable->_result = (result < 0) ? -1 : result;
+      }
+      else {
+        awaitable->_result = 0;
+      }
+      awaitable->_handle.resume();
+    }
+
+    MediaEventLoop& _loop;
+    SOCKET _socket;
+    uint8_t* _buffer;
+    int _length;
+    int _timeoutMilliseconds;
+    TaskPriority _priority;
+    std::coroutine_handle<> _handle;
+    int _result = -1;
+  };
+
+  /**
+  * Waits for a datagram on a socket without holding a thread.
+  * @param[in] loop: the event loop that watches the socket.
+  * @param[in] socket: the socket, which must stay open until the receive completes.
+  * @param[out] buffer: set with the datagram.
+  * @param[in] length: the length of the buffer.
+  * @param[in] timeoutMilliseconds: how long to wait or MediaEventLoop::WAIT_INFINITE.
+  * @param[in] priority: the scheduler lane the coroutine is resumed in.
+  * @@Returns: an awaitable whose result is the length of the datagram, 0 if the wait
+  *  timed out or -1 if the receive failed.
+  */
+  inline ReceiveAwaitable ReceiveAsync(MediaEventLoop& loop, SOCKET socket, uint8_t* buffer, int length,
+    int timeoutMilliseconds = MediaEventLoop::WAIT_INFINITE, TaskPriority priority = TaskPriority::Video)
+  {
+    return ReceiveAwaitable(loop, socket, buffer, length, timeoutMilliseconds, priority);
+  }
+
+  /**
+  * Steps a DTLS handshake each time its socket becomes readable or its retransmission
+  * timer expires, see DtlsAcceptAsync and DtlsConnectAsync.
+  */
+  class DtlsHandshakeAwaitable
+  {
+  public:
+    DtlsHandshakeAwaitable(MediaEventLoop& loop, DtlsHandshakeNative& handshake, SOCKET socket, const sockaddr* svrAddr,
+      uint8_t* fingerprint, int* fingerprintLength) :
+      _loop(loop), _handshake(handshake), _socket(socket), _svrAddr(svrAddr), _fingerprint(fingerprint),
+      _fingerprintLength(fingerprintLength) { }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      _handle = handle;
+
+      int result = (_svrAddr == nullptr) ?
+        _handshake.BeginHandshakeAsServer(_socket) :
+        _handshake.BeginHandshakeAsClient(_socket, _svrAddr);
+      if (result != 0) {
+        _result = HANDSHAKE_ERROR_STATUS;
+        return false;
+      }
+
+      // Once a wait has been started the coroutine may already be resuming on another
+      // thread, so nothing here can be touched after Step returns false.
+      return !Step();
+    }
+
+    int await_resume() const noexcept { return _result; }
+
+  private:
+
+    /**
+    * Continues the handshake and, if it is still pending, waits for the socket.
+    * @@Returns: true if the handshake has finished, false if a wait was started.
+    */
+    bool Step()
+    {
+      int timeoutMilliseconds = MediaEventLoop::WAIT_INFINITE;
+      int result = _handshake.ContinueHandshake(_fingerprint, _fingerprintLength, &timeoutMilliseconds);
+      if (result == HANDSHAKE_PENDING_STATUS) {
+        if (_loop.WaitReadable(_socket, timeoutMilliseconds, OnWait, this, TaskPriority::Background) == 0) {
+          return false;
+        }
+        result = HANDSHAKE_ERROR_STATUS;
+      }
+
+      _result = result;
+      return true;
+    }
+
+    // A timed out wait still steps the handshake, that is when the last flight is resent.
+    static void OnWait(void* context, bool isReady)
+    {
+      (void)isReady;
+      DtlsHandshakeAwaitable* awaitable = static_cast<DtlsHandshakeAwaitable*>(context);
+      std::coroutine_handle<> handle = awaitable->_handle;
+      if (awaitable->Step()) {
+        handle.resume();
+      }
+    }
+
+    MediaEventLoop& _loop;
+    DtlsHandshakeNative& _handshake;
+    SOCKET _socket;
+    const sockaddr* _svrAddr;
+    uint8_t* _fingerprint;
+    int* _fingerprintLength;
+    std::coroutine_handle<> _handle;
+    int _result = HANDSHAKE_ERROR_STATUS;
+  };
+
+  /**
+  * Performs the server side of a DTLS handshake without holding a thread while it
+  * waits for the client. The socket is switched to non-blocking. The handshake's
+  * steps run in the scheduler's Background lane so they don't delay media.
+  * See DtlsHandshakeNative::DoHandshakeAsServer for the parameters.
+  * @@Returns: an awaitable whose result is 0 if the handshake completed or -1 if not.
+  */
+  inline DtlsHandshakeAwaitable DtlsAcceptAsync(MediaEventLoop& loop, DtlsHandshakeNative& handshake, SOCKET socket,
+    uint8_t* fingerprint, int* fingerprintLength)
+  {
+    return DtlsHandshakeAwaitable(loop, handshake, socket, nullptr, fingerprint, fingerprintLength);
+  }
+
+  /**
+  * Performs the client side of a DTLS handshake, see DtlsAcceptAsync.
+  * See DtlsHandshakeNative::DoHandshakeAsClient for the parameters, svrAddr must not
+  * be null.
+  */
+  inline DtlsHandshakeAwaitable DtlsConnectAsync(MediaEventLoop& loop, DtlsHandshakeNative& handshake, SOCKET socket,
+    const sockaddr* svrAddr, uint8_t* fingerprint, int* fingerprintLength)
+  {
+    return DtlsHandshakeAwaitable(loop, handshake, socket, svrAddr, fingerprint, fingerprintLength);
+  }
+}
+
+#endif
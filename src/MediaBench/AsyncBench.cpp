@@ -0,0 +1,407 @@
+//-----------------------------------------------------------------------------
+// Filename: AsyncBench.cpp
+//
+// Description: The cost of switching between sessions written as coroutines
+// on MediaAsync.h compared to a thread per session. A token is passed round
+// a ring of 1000 sessions, each iteration is one hand over from a session
+// to the next. The thread rings block each session's thread on a condition
+// variable or a socket, the coroutine rings suspend 1000 coroutines on a
+// single scheduler worker and, for the sockets, the event loop's thread.
+//
+// Only built for C++20, the coroutine awaitables need it.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaAsync.h"
+#include "MediaLog.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+typedef int socklen_t;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int SESSION_COUNT = 1000;
+
+  /**
+  * Signals the benchmark thread when the ring has made its hand overs.
+  */
+  class Completion
+  {
+  public:
+    void Set()
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _isSet = true;
+      _set.notify_one();
+    }
+
+    void Wait()
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _set.wait(lock, [this]() { return _isSet; });
+    }
+
+  private:
+    std::mutex _lock;
+    std::condition_variable _set;
+    bool _isSet = false;
+  };
+
+  /**
+  * Called by the session holding the token.
+  * @@Returns: true if the token should be passed on, false once the ring is done.
+  */
+  bool TakeToken(std::atomic<uint64_t>& remaining, Completion& done)
+  {
+    if (remaining.fetch_sub(1, std::memory_order_relaxed) == 1) {
+      done.Set();
+      return false;
+    }
+    return true;
+  }
+
+  struct ThreadSession
+  {
+    std::mutex Lock;
+    std::condition_variable Ready;
+    bool HasToken = false;
+  };
+
+  struct ThreadRing
+  {
+    std::vector<std::unique_ptr<ThreadSession>> Sessions;
+    std::atomic<uint64_t> Remaining{ 0 };
+    std::atomic<bool> IsStopping{ false };
+    Completion Done;
+
+    void Pass(int index)
+    {
+      ThreadSession& session = *Sessions[index];
+      std::lock_guard<std::mutex> lock(session.Lock);
+      session.HasToken = true;
+      session.Ready.notify_one();
+    }
+
+    void Run(int index)
+    {
+      ThreadSession& session = *Sessions[index];
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(session.Lock);
+          session.Ready.wait(lock, [&session]() { return session.HasToken; });
+          session.HasToken = false;
+        }
+
+        if (IsStopping.load(std::memory_order_acquire)) {
+          return;
+        }
+
+        if (TakeToken(Remaining, Done)) {
+          Pass((index + 1) % SESSION_COUNT);
+        }
+      }
+    }
+  };
+
+  struct CoroutineRing
+  {
+    std::vector<std::unique_ptr<AsyncEvent>> Events;
+    std::atomic<uint64_t> Remaining{ 0 };
+    std::atomic<bool> IsStopping{ false };
+    std::atomic<int> Finished{ 0 };
+    Completion Done;
+  };
+
+  AsyncTask RunCoroutineSession(CoroutineRing& ring, int index)
+  {
+    AsyncEvent& event = *ring.Events[index];
+    for (;;) {
+      co_await event;
+      event.Reset();
+
+      if (ring.IsStopping.load(std::memory_order_acquire)) {
+        break;
+      }
+
+      if (TakeToken(ring.Remaining, ring.Done)) {
+        ring.Events[(index + 1) % SESSION_COUNT]->Set();
+      }
+    }
+
+    ring.Finished.fetch_add(1, std::memory_order_release);
+  }
+
+  /**
+  * A ring of loopback UDP sockets, a session passes the token by sending a
+  * datagram to the next session's socket.
+  */
+  struct SocketRing
+  {
+    std::vector<SOCKET> Sockets;
+    std::vector<sockaddr_in> Addresses;
+    SOCKET Sender = INVALID_SOCKET;
+    std::atomic<uint64_t> Remaining{ 0 };
+    std::atomic<bool> IsStopping{ false };
+    std::atomic<int> Finished{ 0 };
+    Completion Done;
+
+    int Open()
+    {
+#ifdef _WIN32
+      WSADATA wsaData;
+      WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+      Sender = socket(AF_INET, SOCK_DGRAM, 0);
+      for (int i = 0; i < SESSION_COUNT; i++) {
+        SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s == INVALID_SOCKET) {
+          SIPSM_LOG_ERROR("Failed to create the socket for session %d.", i);
+          return -1;
+        }
+        Sockets.push_back(s);
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+          getsockname(s, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+          SIPSM_LOG_ERROR("Failed to bind the socket for session %d.", i);
+          return -1;
+        }
+        Addresses.push_back(address);
+      }
+      return 0;
+    }
+
+    void Close()
+    {
+      for (SOCKET s : Sockets) {
+        closesocket(s);
+      }
+      closesocket(Sender);
+    }
+
+    void Pass(SOCKET from, int index)
+    {
+      char token = 1;
+      sendto(from, &token, 1, 0, reinterpret_cast<const sockaddr*>(&Addresses[index]), sizeof(sockaddr_in));
+    }
+
+    /**
+    * Wakes every session so it sees IsStopping.
+    */
+    void Stop()
+    {
+      IsStopping.store(true, std::memory_order_release);
+      for (int i = 0; i < SESSION_COUNT; i++) {
+        Pass(Sender, i);
+      }
+    }
+
+    void RunThread(int index)
+    {
+      char token = 0;
+      for (;;) {
+        if (recv(Sockets[index], &token, 1, 0) < 0 || IsStopping.load(std::memory_order_acquire)) {
+          return;
+        }
+
+        if (TakeToken(Remaining, Done)) {
+          Pass(Sockets[index], (index + 1) % SESSION_COUNT);
+        }
+      }
+    }
+  };
+
+  AsyncTask RunSocketSession(SocketRing& ring, MediaEventLoop& loop, int index)
+  {
+    uint8_t token = 0;
+    for (;;) {
+      int length = co_await ReceiveAsync(loop, ring.Sockets[index], &token, 1);
+      if (length < 0 || ring.IsStopping.load(std::memory_order_acquire)) {
+        break;
+      }
+
+      if (TakeToken(ring.Remaining, ring.Done)) {
+        ring.Pass(ring.Sockets[index], (index + 1) % SESSION_COUNT);
+      }
+    }
+
+    ring.Finished.fetch_add(1, std::memory_order_release);
+  }
+
+  void WaitForFinished(std::atomic<int>& finished)
+  {
+    while (finished.load(std::memory_order_acquire) < SESSION_COUNT) {
+      std::this_thread::yield();
+    }
+  }
+
+  MediaSchedulerConfig SingleWorker()
+  {
+    MediaSchedulerConfig config;
+    config.WorkerCount = 1;
+    return config;
+  }
+}
+
+MEDIA_BENCH(token_ring_1000_threads)
+{
+  state.PauseTiming();
+
+  ThreadRing ring;
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    ring.Sessions.emplace_back(new ThreadSession());
+  }
+  ring.Remaining.store(state.Iterations());
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    threads.emplace_back([&ring, i]() { ring.Run(i); });
+  }
+
+  state.ResumeTiming();
+
+  ring.Pass(0);
+  ring.Done.Wait();
+
+  state.PauseTiming();
+
+  ring.IsStopping.store(true, std::memory_order_release);
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    ring.Pass(i);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  state.SetCounter("threads", SESSION_COUNT + 1);
+}
+
+MEDIA_BENCH(token_ring_1000_coroutines)
+{
+  state.PauseTiming();
+
+  MediaScheduler scheduler(SingleWorker());
+  CoroutineRing ring;
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    ring.Events.emplace_back(new AsyncEvent(scheduler));
+  }
+  ring.Remaining.store(state.Iterations());
+
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    RunCoroutineSession(ring, i);
+  }
+
+  state.ResumeTiming();
+
+  ring.Events[0]->Set();
+  ring.Done.Wait();
+
+  state.PauseTiming();
+
+  ring.IsStopping.store(true, std::memory_order_release);
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    ring.Events[i]->Set();
+  }
+  WaitForFinished(ring.Finished);
+
+  state.SetCounter("threads", 2);
+}
+
+MEDIA_BENCH(udp_ring_1000_threads)
+{
+  state.PauseTiming();
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  SocketRing ring;
+  if (ring.Open() != 0) {
+    ring.Close();
+    return;
+  }
+  ring.Remaining.store(state.Iterations());
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    threads.emplace_back([&ring, i]() { ring.RunThread(i); });
+  }
+
+  state.ResumeTiming();
+
+  ring.Pass(ring.Sender, 0);
+  ring.Done.Wait();
+
+  state.PauseTiming();
+
+  ring.Stop();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ring.Close();
+
+  state.SetCounter("threads", SESSION_COUNT + 1);
+}
+
+MEDIA_BENCH(udp_ring_1000_coroutines)
+{
+  state.PauseTiming();
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  SocketRing ring;
+  if (ring.Open() != 0) {
+    ring.Close();
+    return;
+  }
+  ring.Remaining.store(state.Iterations());
+
+  MediaScheduler scheduler(SingleWorker());
+  {
+    MediaEventLoop loop(scheduler);
+    for (int i = 0; i < SESSION_COUNT; i++) {
+      RunSocketSession(ring, loop, i);
+    }
+
+    state.ResumeTiming();
+
+    ring.Pass(ring.Sender, 0);
+    ring.Done.Wait();
+
+    state.PauseTiming();
+
+    ring.Stop();
+    WaitForFinished(ring.Finished);
+  }
+  ring.Close();
+
+  state.SetCounter("threads", 3);
+}
+
+#endif
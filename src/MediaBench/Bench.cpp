@@ -0,0 +1,420 @@
+//-----------------------------------------------------------------------------
+// Filename: Bench.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace SIPSorceryMedia {
+  namespace Bench {
+
+    namespace {
+
+      struct RegisteredBench
+      {
+        std::string Name;
+        BenchFunction Function;
+      };
+
+      std::vector<RegisteredBench>& Registered()
+      {
+        static std::vector<RegisteredBench> benches;
+        return benches;
+      }
+
+      struct RegisteredChild
+      {
+        std::string Name;
+        BenchChildFunction Function;
+      };
+
+      std::vector<RegisteredChild>& RegisteredChildren()
+      {
+        static std::vector<RegisteredChild> children;
+        return children;
+      }
+
+      std::string& ExecutablePath()
+      {
+        static std::string path;
+        return path;
+      }
+
+      const uint64_t MAX_ITERATIONS = 1000000000ULL;
+    }
+
+    void BenchState::PauseTiming()
+    {
+      if (!_isPaused) {
+        _elapsed += std::chrono::steady_clock::now() - _start;
+        _isPaused = true;
+      }
+    }
+
+    void BenchState::ResumeTiming()
+    {
+      if (_isPaused) {
+        _start = std::chrono::steady_clock::now();
+        _isPaused = false;
+      }
+    }
+
+    void BenchRunner::Register(const char* name, BenchFunction function)
+    {
+      Registered().push_back({ name, function });
+    }
+
+    std::vector<std::string> BenchRunner::List()
+    {
+      std::vector<std::string> names;
+      for (auto& bench : Registered()) {
+        names.push_back(bench.Name);
+      }
+      return names;
+    }
+
+    BenchResult BenchRunner::RunOne(const std::string& name, BenchFunction function, int minTimeMilliseconds, int repetitions)
+    {
+      std::chrono::nanoseconds minTime = std::chrono::milliseconds(minTimeMilliseconds);
+      uint64_t iterations = 1;
+
+      BenchResult result;
+      result.Name = name;
+      double itemsPerIteration = 1;
+
+      while (true) {
+        BenchState state(iterations);
+        state._start = std::chrono::steady_clock::now();
+        function(state);
+        state.PauseTiming();
+
+        if (state._elapsed >= minTime || iterations >= MAX_ITERATIONS || !result.Samples.empty()) {
+          result.Iterations = iterations;
+          result.Samples.push_back((double)state._elapsed.count() / iterations);
+          itemsPerIteration = (double)state.ItemsProcessed() / iterations;
+          result.Counters = state._counters;
+
+          if ((int)result.Samples.size() >= repetitions) {
+            break;
+          }
+
+          // The remaining repetitions use the same iteration count.
+          continue;
+        }
+
+        // Scale towards the minimum time, overshooting a little so the next run is
+        // normally the last. Cap the growth for benchmarks that are too quick to time.
+        uint64_t next = iterations * 10;
+        if (state._elapsed.count() > 0) {
+          double scale = 1.4 * minTime.count() / state._elapsed.count();
+          uint64_t predicted = (uint64_t)(iterations * scale);
+          next = (predicted < iterations + 1) ? iterations + 1 : (predicted > next ? next : predicted);
+        }
+        iterations = (next > MAX_ITERATIONS) ? MAX_ITERATIONS : next;
+      }
+
+      std::vector<double> sorted = result.Samples;
+      std::sort(sorted.begin(), sorted.end());
+      size_t middle = sorted.size() / 2;
+      result.NanosecondsPerIteration = (sorted.size() % 2 == 1) ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+      result.ItemsPerSecond = (result.NanosecondsPerIteration > 0) ? itemsPerIteration * 1e9 / result.NanosecondsPerIteration : 0;
+
+      return result;
+    }
+
+    std::vector<BenchResult> BenchRunner::Run(const std::string& filter, int minTimeMilliseconds, int repetitions)
+    {
+      std::vector<BenchResult> results;
+
+      for (auto& bench : Registered()) {
+        if (filter.empty() || bench.Name.find(filter) != std::string::npos) {
+          results.push_back(RunOne(bench.Name, bench.Function, minTimeMilliseconds, repetitions));
+        }
+      }
+
+      return results;
+    }
+  
+    void FillRandom(uint8_t* buffer, size_t length, uint64_t seed)
+    {
+      for (size_t i = 0; i < length; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(seed >> 56);
+      }
+    }
+
+    void WriteRtpHeader(uint8_t* packet, uint8_t payloadType, uint16_t sequenceNumber, uint32_t timestamp, uint32_t ssrc)
+    {
+      packet[0] = 0x80;
+      packet[1] = payloadType & 0x7f;
+      packet[2] = (uint8_t)(sequenceNumber >> 8);
+      packet[3] = (uint8_t)sequenceNumber;
+      packet[4] = (uint8_t)(timestamp >> 24);
+      packet[5] = (uint8_t)(timestamp >> 16);
+      packet[6] = (uint8_t)(timestamp >> 8);
+      packet[7] = (uint8_t)timestamp;
+      packet[8] = (uint8_t)(ssrc >> 24);
+      packet[9] = (uint8_t)(ssrc >> 16);
+      packet[10] = (uint8_t)(ssrc >> 8);
+      packet[11] = (uint8_t)ssrc;
+    }
+
+    void BenchRunner::RegisterChild(const char* name, BenchChildFunction function)
+    {
+      RegisteredChildren().push_back({ name, function });
+    }
+
+    int BenchRunner::RunChild(const std::string& name, const std::string& argument)
+    {
+      for (auto& child : RegisteredChildren()) {
+        if (child.Name == name) {
+          return child.Function(argument);
+        }
+      }
+
+      fprintf(stderr, "There is no benchmark child process called %s.\n", name.c_str());
+      return 1;
+    }
+
+    void BenchChildProcess::SetExecutablePath(const char* path)
+    {
+      ExecutablePath() = (path != nullptr) ? path : "";
+    }
+
+    BenchChildProcess::~BenchChildProcess()
+    {
+      if (_process != 0) {
+        Wait();
+      }
+    }
+
+#if defined(_WIN32)
+
+    int BenchChildProcess::Start(const std::string& name, const std::string& argument, bool isInputPiped)
+    {
+      char path[MAX_PATH];
+      if (GetModuleFileNameA(nullptr, path, sizeof(path)) == 0) {
+        return -1;
+      }
+
+      std::string commandLine = "\"" + std::string(path) + "\" --child " + name + " \"" + argument + "\"";
+
+      STARTUPINFOA startup;
+      memset(&startup, 0, sizeof(startup));
+      startup.cb = sizeof(startup);
+      startup.dwFlags = STARTF_USESTDHANDLES;
+      startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+      startup.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+      startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+      HANDLE readPipe = nullptr, writePipe = nullptr;
+      if (isInputPiped) {
+        SECURITY_ATTRIBUTES attributes = { sizeof(attributes), nullptr, TRUE };
+        if (!CreatePipe(&readPipe, &writePipe, &attributes, 0)) {
+          return -1;
+        }
+        SetHandleInformation(writePipe, HANDLE_FLAG_INHERIT, 0);
+        startup.hStdInput = readPipe;
+      }
+
+      PROCESS_INFORMATION process;
+      BOOL isStarted = CreateProcessA(path, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process);
+
+      if (readPipe != nullptr) {
+        CloseHandle(readPipe);
+      }
+
+      if (!isStarted) {
+        if (writePipe != nullptr) {
+          CloseHandle(writePipe);
+        }
+        return -1;
+      }
+
+      CloseHandle(process.hThread);
+      _process = (intptr_t)process.hProcess;
+      _input = (writePipe != nullptr) ? (intptr_t)writePipe : -1;
+      return 0;
+    }
+
+    int BenchChildProcess::Write(const void* data, size_t length)
+    {
+      const uint8_t* position = static_cast<const uint8_t*>(data);
+      while (length > 0) {
+        DWORD written = 0;
+        if (_input == -1 || !WriteFile((HANDLE)_input, position, (DWORD)length, &written, nullptr)) {
+          return -1;
+        }
+        position += written;
+        length -= written;
+      }
+      return 0;
+    }
+
+    void BenchChildProcess::CloseInput()
+    {
+      if (_input != -1) {
+        CloseHandle((HANDLE)_input);
+        _input = -1;
+      }
+    }
+
+    int BenchChildProcess::Wait()
+    {
+      CloseInput();
+
+      if (_process == 0) {
+        return -1;
+      }
+
+      DWORD exitCode = (DWORD)-1;
+      WaitForSingleObject((HANDLE)_process, INFINITE);
+      GetExitCodeProcess((HANDLE)_process, &exitCode);
+      CloseHandle((HANDLE)_process);
+      _process = 0;
+      return (int)exitCode;
+    }
+
+    int BenchChildProcess::ReadInput(void* buffer, size_t length)
+    {
+      HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+      uint8_t* position = static_cast<uint8_t*>(buffer);
+      while (length > 0) {
+        DWORD read = 0;
+        if (!ReadFile(input, position, (DWORD)length, &read, nullptr) || read == 0) {
+          return -1;
+        }
+        position += read;
+        length -= read;
+      }
+      return 0;
+    }
+
+#else
+
+    int BenchChildProcess::Start(const std::string& name, const std::string& argument, bool isInputPiped)
+    {
+#if defined(__linux__)
+      std::string path = "/proc/self/exe";
+#else
+      std::string path = ExecutablePath();
+#endif
+
+      int pipeFds[2] = { -1, -1 };
+      if (isInputPiped && pipe(pipeFds) != 0) {
+        return -1;
+      }
+
+      posix_spawn_file_actions_t actions;
+      posix_spawn_file_actions_init(&actions);
+      if (isInputPiped) {
+        posix_spawn_file_actions_adddup2(&actions, pipeFds[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipeFds[0]);
+        posix_spawn_file_actions_addclose(&actions, pipeFds[1]);
+      }
+
+      std::vector<char*> argv = { &path[0], const_cast<char*>("--child"), const_cast<char*>(name.c_str()),
+        const_cast<char*>(argument.c_str()), nullptr };
+
+      pid_t pid = 0;
+      int result = posix_spawnp(&pid, path.c_str(), &actions, nullptr, argv.data(), environ);
+      posix_spawn_file_actions_destroy(&actions);
+
+      if (isInputPiped) {
+        close(pipeFds[0]);
+      }
+
+      if (result != 0) {
+        if (isInputPiped) {
+          close(pipeFds[1]);
+        }
+        return -1;
+      }
+
+      // A child that exits early mustn't kill the benchmark on the next write.
+      signal(SIGPIPE, SIG_IGN);
+
+      _process = (intptr_t)pid;
+      _input = (isInputPiped) ? pipeFds[1] : -1;
+      return 0;
+    }
+
+    int BenchChildProcess::Write(const void* data, size_t length)
+    {
+      const uint8_t* position = static_cast<const uint8_t*>(data);
+      while (length > 0) {
+        ssize_t written = (_input != -1) ? write((int)_input, position, length) : -1;
+        if (written < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return -1;
+        }
+        position += written;
+        length -= (size_t)written;
+      }
+      return 0;
+    }
+
+    void BenchChildProcess::CloseInput()
+    {
+      if (_input != -1) {
+        close((int)_input);
+        _input = -1;
+      }
+    }
+
+    int BenchChildProcess::Wait()
+    {
+      CloseInput();
+
+      if (_process == 0) {
+        return -1;
+      }
+
+      int status = 0;
+      while (waitpid((pid_t)_process, &status, 0) < 0 && errno == EINTR) {}
+      _process = 0;
+      return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    int BenchChildProcess::ReadInput(void* buffer, size_t length)
+    {
+      uint8_t* position = static_cast<uint8_t*>(buffer);
+      while (length > 0) {
+        ssize_t count = read(STDIN_FILENO, position, length);
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        else if (count <= 0) {
+          return -1;
+        }
+        position += count;
+        length -= (size_t)count;
+      }
+      return 0;
+    }
+
+#endif
+  }
+}
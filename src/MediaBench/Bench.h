@@ -0,0 +1,242 @@
+//-----------------------------------------------------------------------------
+// Filename: Bench.h
+//
+// Description: Minimal benchmark harness for the native media code. Each
+// benchmark is a function registered with MEDIA_BENCH that runs its body
+// state.Iterations() times. The runner picks the iteration count so each
+// benchmark runs for at least the minimum time and reports the time per
+// iteration along with any counters the benchmark sets.
+//
+//   MEDIA_BENCH(metrics_counter_add)
+//   {
+//     for (uint64_t i = 0; i < state.Iterations(); i++) {
+//       counter.Add();
+//     }
+//   }
+//
+// A benchmark that needs a second process registers the child's body with
+// MEDIA_BENCH_CHILD and starts it with BenchChildProcess, which runs this
+// executable again with --child <name> <argument>.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace SIPSorceryMedia {
+  namespace Bench {
+
+    class BenchState
+    {
+    public:
+      explicit BenchState(uint64_t iterations) : _iterations(iterations) { }
+
+      uint64_t Iterations() const { return _iterations; }
+
+      /**
+      * Excludes setup work done inside the benchmark body from the measured time.
+      */
+      void PauseTiming();
+      void ResumeTiming();
+
+      /**
+      * Sets the number of items (packets, frames, sessions) processed by the run so
+      * the runner can report a rate. Defaults to the iteration count.
+      */
+      void SetItemsProcessed(uint64_t items) { _items = items; }
+
+      /**
+      * Records an additional result, e.g. a latency percentile or bytes per session.
+      */
+      void SetCounter(const std::string& name, double value) { _counters[name] = value; }
+
+      std::chrono::nanoseconds Elapsed() const { return _elapsed; }
+      uint64_t ItemsProcessed() const { return (_items > 0) ? _items : _iterations; }
+      const std::map<std::string, double>& Counters() const { return _counters; }
+
+    private:
+      friend class BenchRunner;
+
+      uint64_t _iterations;
+      uint64_t _items = 0;
+      bool _isPaused = false;
+      std::chrono::steady_clock::time_point _start;
+      std::chrono::nanoseconds _elapsed{ 0 };
+      std::map<std::string, double> _counters;
+    };
+
+    typedef void (*BenchFunction)(BenchState& state);
+
+    /**
+    * The body of a child process, returning its exit code.
+    */
+    typedef int (*BenchChildFunction)(const std::string& argument);
+
+    struct BenchResult
+    {
+      std::string Name;
+      uint64_t Iterations;
+      double NanosecondsPerIteration;     // The median of the samples.
+      double ItemsPerSecond;
+      std::map<std::string, double> Counters;
+
+      /**
+      * The time per iteration of each repetition, all run with the same iteration count.
+      */
+      std::vector<double> Samples;
+    };
+
+    class BenchRunner
+    {
+    public:
+
+      /**
+      * Adds a benchmark to the process wide list. Used by MEDIA_BENCH.
+      */
+      static void Register(const char* name, BenchFunction function);
+
+      /**
+      * Runs the registered benchmarks.
+      * @param[in] filter: only benchmarks whose name contains the filter are run.
+      * @param[in] minTimeMilliseconds: the minimum time each benchmark is run for.
+      * @param[in] repetitions: the number of times each benchmark is repeated once its
+      *  iteration count has been chosen, giving a sample per repetition.
+      * @@Returns: the results in the order they were run.
+      */
+      static std::vector<BenchResult> Run(const std::string& filter, int minTimeMilliseconds, int repetitions = 1);
+
+      /**
+      * Gets the names of the registered benchmarks.
+      */
+      static std::vector<std::string> List();
+
+      /**
+      * Adds a child process body to the process wide list. Used by MEDIA_BENCH_CHILD.
+      */
+      static void RegisterChild(const char* name, BenchChildFunction function);
+
+      /**
+      * Runs a child process body, called by main for --child.
+      * @@Returns: the child's exit code, 1 if there is no child with the name.
+      */
+      static int RunChild(const std::string& name, const std::string& argument);
+
+    private:
+      static BenchResult RunOne(const std::string& name, BenchFunction function, int minTimeMilliseconds, int repetitions);
+    };
+
+    struct BenchRegistration
+    {
+      BenchRegistration(const char* name, BenchFunction function) { BenchRunner::Register(name, function); }
+    };
+
+    struct BenchChildRegistration
+    {
+      BenchChildRegistration(const char* name, BenchChildFunction function) { BenchRunner::RegisterChild(name, function); }
+    };
+
+    /**
+    * A copy of this executable running a MEDIA_BENCH_CHILD body.
+    */
+    class BenchChildProcess
+    {
+    public:
+      BenchChildProcess() { }
+
+      /**
+      * Waits for the child if it is still running.
+      */
+      ~BenchChildProcess();
+
+      BenchChildProcess(const BenchChildProcess&) = delete;
+      BenchChildProcess& operator=(const BenchChildProcess&) = delete;
+
+      /**
+      * Sets the executable to start, from main's argv[0]. Only used where the running
+      * executable can't be found another way.
+      */
+      static void SetExecutablePath(const char* path);
+
+      /**
+      * Starts the child.
+      * @param[in] name: the MEDIA_BENCH_CHILD to run.
+      * @param[in] argument: passed to the child, must not contain quotes.
+      * @param[in] isInputPiped: true to connect the child's standard input to Write.
+      * @@Returns: 0 if successful or -1 if the process couldn't be started.
+      */
+      int Start(const std::string& name, const std::string& argument, bool isInputPiped = false);
+
+      /**
+      * Writes to the child's standard input.
+      * @@Returns: 0 if everything was written or -1 if not.
+      */
+      int Write(const void* data, size_t length);
+
+      /**
+      * Closes the child's standard input and waits for it to exit.
+      * @@Returns: the child's exit code or -1 if it didn't exit normally.
+      */
+      int Wait();
+
+      /**
+      * Reads exactly length bytes from standard input, for a child started with
+      * isInputPiped.
+      * @@Returns: 0 if successful or -1 at the end of the input.
+      */
+      static int ReadInput(void* buffer, size_t length);
+
+    private:
+      void CloseInput();
+
+      intptr_t _process = 0;
+      intptr_t _input = -1;
+    };
+
+    /**
+    * The length of the fixed RTP header written by WriteRtpHeader.
+    */
+    const int RTP_HEADER_LENGTH = 12;
+
+    /**
+    * Fills a buffer with seeded pseudo random bytes so every run uses the same input.
+    */
+    void FillRandom(uint8_t* buffer, size_t length, uint64_t seed);
+
+    /**
+    * Writes an RTP version 2 header with no padding, extension or CSRCs.
+    * @param[in] packet: the start of the packet, at least RTP_HEADER_LENGTH bytes.
+    */
+    void WriteRtpHeader(uint8_t* packet, uint8_t payloadType, uint16_t sequenceNumber, uint32_t timestamp, uint32_t ssrc);
+
+    /**
+    * Stops the compiler optimising away a value computed by a benchmark.
+    */
+    template <typename T>
+    inline void DoNotOptimise(const T& value)
+    {
+#ifdef _MSC_VER
+      static volatile const void* sink;
+      sink = &value;
+#else
+      asm volatile("" : : "r,m"(value) : "memory");
+#endif
+    }
+  }
+}
+
+#define MEDIA_BENCH(name) \
+  static void name(SIPSorceryMedia::Bench::BenchState& state); \
+  static SIPSorceryMedia::Bench::BenchRegistration name##_registration(#name, name); \
+  static void name(SIPSorceryMedia::Bench::BenchState& state)
+
+#define MEDIA_BENCH_CHILD(name) \
+  static int name(const std::string& argument); \
+  static SIPSorceryMedia::Bench::BenchChildRegistration name##_registration(#name, name); \
+  static int name(const std::string& argument)
@@ -0,0 +1,572 @@
+//-----------------------------------------------------------------------------
+// Filename: BenchReport.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "BenchReport.h"
+#include "MediaTopology.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/utsname.h>
+#endif
+
+namespace SIPSorceryMedia {
+  namespace Bench {
+
+    namespace {
+
+      /**
+      * Above this many sample pairs the U distribution is approximated as normal
+      * rather than counted exactly.
+      */
+      const int EXACT_U_MAX_PAIRS = 400;
+
+      std::string CpuBrand()
+      {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int regs[12] = {};
+        __cpuid(regs, 0x80000000);
+        if ((unsigned int)regs[0] >= 0x80000004) {
+          __cpuid(regs, 0x80000002);
+          __cpuid(regs + 4, 0x80000003);
+          __cpuid(regs + 8, 0x80000004);
+          std::string brand(reinterpret_cast<const char*>(regs), sizeof(regs));
+          return brand.substr(0, brand.find('\0'));
+        }
+#elif defined(__x86_64__) || defined(__i386__)
+        unsigned int regs[12] = {};
+        if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+          __get_cpuid(0x80000002, &regs[0], &regs[1], &regs[2], &regs[3]);
+          __get_cpuid(0x80000003, &regs[4], &regs[5], &regs[6], &regs[7]);
+          __get_cpuid(0x80000004, &regs[8], &regs[9], &regs[10], &regs[11]);
+          std::string brand(reinterpret_cast<const char*>(regs), sizeof(regs));
+          return brand.substr(0, brand.find('\0'));
+        }
+#endif
+        return "unknown";
+      }
+
+      std::string Trim(const std::string& value)
+      {
+        size_t start = value.find_first_not_of(" \t");
+        size_t end = value.find_last_not_of(" \t");
+        return (start == std::string::npos) ? std::string() : value.substr(start, end - start + 1);
+      }
+
+      std::string JsonString(const std::string& value)
+      {
+        std::string out = "\"";
+        for (char c : value) {
+          if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+          }
+          else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+          }
+          else {
+            out += c;
+          }
+        }
+        return out + "\"";
+      }
+
+      std::string JsonNumber(double value)
+      {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.9g", value);
+        return buffer;
+      }
+
+      /**
+      * Just enough of a JSON reader for the files ToJson writes.
+      */
+      struct JsonValue
+      {
+        enum Type { Null, Bool, Number, String, Array, Object } Kind = Null;
+        double NumberValue = 0;
+        std::string StringValue;
+        std::vector<JsonValue> Items;
+        std::vector<std::pair<std::string, JsonValue>> Members;
+
+        const JsonValue* Find(const char* key) const
+        {
+          for (auto& member : Members) {
+            if (member.first == key) {
+              return &member.second;
+            }
+          }
+          return nullptr;
+        }
+
+        std::string GetString(const char* key) const
+        {
+          const JsonValue* value = Find(key);
+          return (value != nullptr && value->Kind == String) ? value->StringValue : std::string();
+        }
+
+        double GetNumber(const char* key) const
+        {
+          const JsonValue* value = Find(key);
+          return (value != nullptr && value->Kind == Number) ? value->NumberValue : 0;
+        }
+      };
+
+      class JsonParser
+      {
+      public:
+        explicit JsonParser(const std::string& text) : _text(text) { }
+
+        bool Parse(JsonValue& value)
+        {
+          return ParseValue(value) && (SkipSpace(), _pos == _text.size());
+        }
+
+      private:
+        void SkipSpace()
+        {
+          while (_pos < _text.size() && strchr(" \t\r\n", _text[_pos]) != nullptr) {
+            _pos++;
+          }
+        }
+
+        bool Consume(char c)
+        {
+          SkipSpace();
+          if (_pos < _text.size() && _text[_pos] == c) {
+            _pos++;
+            return true;
+          }
+          return false;
+        }
+
+        bool ParseString(std::string& out)
+        {
+          if (!Consume('"')) {
+            return false;
+          }
+
+          while (_pos < _text.size() && _text[_pos] != '"') {
+            char c = _text[_pos++];
+            if (c == '\\' && _pos < _text.size()) {
+              char escaped = _text[_pos++];
+              if (escaped == 'u' && _pos + 4 <= _text.size()) {
+                out += (char)strtol(_text.substr(_pos, 4).c_str(), nullptr, 16);
+                _pos += 4;
+              }
+              else {
+                out += (escaped == 'n') ? '\n' : (escaped == 't') ? '\t' : escaped;
+              }
+            }
+            else {
+              out += c;
+            }
+          }
+
+          return Consume('"');
+        }
+
+        bool ParseValue(JsonValue& value)
+        {
+          SkipSpace();
+          if (_pos >= _text.size()) {
+            return false;
+          }
+
+          char c = _text[_pos];
+
+          if (c == '{') {
+            _pos++;
+            value.Kind = JsonValue::Object;
+            if (Consume('}')) {
+              return true;
+            }
+            do {
+              std::pair<std::string, JsonValue> member;
+              if (!ParseString(member.first) || !Consume(':') || !ParseValue(member.second)) {
+                return false;
+              }
+              value.Members.push_back(std::move(member));
+            } while (Consume(','));
+            return Consume('}');
+          }
+          else if (c == '[') {
+            _pos++;
+            value.Kind = JsonValue::Array;
+            if (Consume(']')) {
+              return true;
+            }
+            do {
+              JsonValue item;
+              if (!ParseValue(item)) {
+                return false;
+              }
+              value.Items.push_back(std::move(item));
+            } while (Consume(','));
+            return Consume(']');
+          }
+          else if (c == '"') {
+            value.Kind = JsonValue::String;
+            return ParseString(value.StringValue);
+          }
+          else if (_text.compare(_pos, 4, "true") == 0 || _text.compare(_pos, 5, "false") == 0) {
+            value.Kind = JsonValue::Bool;
+            value.NumberValue = (c == 't') ? 1 : 0;
+            _pos += (c == 't') ? 4 : 5;
+            return true;
+          }
+          else if (_text.compare(_pos, 4, "null") == 0) {
+            _pos += 4;
+            return true;
+          }
+
+          const char* start = _text.c_str() + _pos;
+          char* end = nullptr;
+          value.Kind = JsonValue::Number;
+          value.NumberValue = strtod(start, &end);
+          if (end == start) {
+            return false;
+          }
+          _pos += end - start;
+          return true;
+        }
+
+        const std::string& _text;
+        size_t _pos = 0;
+      };
+
+      double Median(std::vector<double> values)
+      {
+        if (values.empty()) {
+          return 0;
+        }
+        std::sort(values.begin(), values.end());
+        size_t middle = values.size() / 2;
+        return (values.size() % 2 == 1) ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+      }
+
+      /**
+      * Gets the smallest p-value the U test can give for the sample sizes, reached
+      * when every current sample is slower than every baseline sample.
+      */
+      double MinimumPValue(size_t n, size_t m)
+      {
+        double combinations = 1;
+        for (size_t i = 1; i <= m; i++) {
+          combinations = combinations * (n + i) / i;
+        }
+        return 1.0 / combinations;
+      }
+    }
+
+    BenchEnvironment BenchEnvironment::Capture()
+    {
+      BenchEnvironment env;
+
+#ifdef _WIN32
+      env.Os = "Windows";
+#else
+      struct utsname name;
+      env.Os = (uname(&name) == 0) ? std::string(name.sysname) + " " + name.release + " " + name.machine : "unknown";
+#endif
+
+#if defined(_MSC_FULL_VER)
+      env.Compiler = "MSVC " + std::to_string(_MSC_FULL_VER);
+#elif defined(__clang__)
+      env.Compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+      env.Compiler = "gcc " __VERSION__;
+#else
+      env.Compiler = "unknown";
+#endif
+
+      env.Cpu = Trim(CpuBrand());
+      if (env.Cpu == "unknown" || env.Cpu.empty()) {
+        FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+        char line[256];
+        while (cpuinfo != nullptr && fgets(line, sizeof(line), cpuinfo) != nullptr) {
+          const char* colon = strchr(line, ':');
+          if (strncmp(line, "model name", 10) == 0 && colon != nullptr) {
+            env.Cpu = Trim(std::string(colon + 1, strcspn(colon + 1, "\n")));
+            break;
+          }
+        }
+        if (cpuinfo != nullptr) {
+          fclose(cpuinfo);
+        }
+      }
+
+#ifdef NDEBUG
+      env.Build = "release";
+#else
+      env.Build = "debug";
+#endif
+
+      env.Processors = MediaTopology::GetProcessorCount();
+      env.NumaNodes = MediaTopology::GetNumaNodeCount();
+
+      time_t now = time(nullptr);
+      struct tm utc;
+#ifdef _WIN32
+      gmtime_s(&utc, &now);
+#else
+      gmtime_r(&now, &utc);
+#endif
+      char timestamp[32];
+      strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+      env.Timestamp = timestamp;
+
+      return env;
+    }
+
+    bool BenchEnvironment::IsComparable(const BenchEnvironment& other) const
+    {
+      return Os == other.Os && Compiler == other.Compiler && Cpu == other.Cpu && Build == other.Build &&
+        Processors == other.Processors;
+    }
+
+    std::string BenchReport::ToJson(const BenchRun& run)
+    {
+      const BenchEnvironment& env = run.Environment;
+      std::string json = "{\n  \"environment\": {\n";
+      json += "    \"os\": " + JsonString(env.Os) + ",\n";
+      json += "    \"compiler\": " + JsonString(env.Compiler) + ",\n";
+      json += "    \"cpu\": " + JsonString(env.Cpu) + ",\n";
+      json += "    \"build\": " + JsonString(env.Build) + ",\n";
+      json += "    \"processors\": " + std::to_string(env.Processors) + ",\n";
+      json += "    \"numa_nodes\": " + std::to_string(env.NumaNodes) + ",\n";
+      json += "    \"timestamp\": " + JsonString(env.Timestamp) + ",\n";
+      json += "    \"label\": " + JsonString(env.Label) + "\n  },\n";
+      json += "  \"benchmarks\": [";
+
+      for (size_t i = 0; i < run.Results.size(); i++) {
+        const BenchResult& result = run.Results[i];
+        json += (i == 0) ? "\n" : ",\n";
+        json += "    {\n      \"name\": " + JsonString(result.Name) + ",\n";
+        json += "      \"iterations\": " + std::to_string(result.Iterations) + ",\n";
+        json += "      \"ns_per_iteration\": " + JsonNumber(result.NanosecondsPerIteration) + ",\n";
+        json += "      \"items_per_second\": " + JsonNumber(result.ItemsPerSecond) + ",\n";
+
+        auto threshold = run.Thresholds.find(result.Name);
+        if (threshold != run.Thresholds.end()) {
+          json += "      \"threshold_percent\": " + JsonNumber(threshold->second) + ",\n";
+        }
+
+        json += "      \"samples\": [";
+        for (size_t s = 0; s < result.Samples.size(); s++) {
+          json += ((s == 0) ? "" : ", ") + JsonNumber(result.Samples[s]);
+        }
+        json += "],\n      \"counters\": {";
+
+        bool first = true;
+        for (auto& counter : result.Counters) {
+          json += ((first) ? "" : ", ") + JsonString(counter.first) + ": " + JsonNumber(counter.second);
+          first = false;
+        }
+        json += "}\n    }";
+      }
+
+      json += "\n  ]\n}\n";
+      return json;
+    }
+
+    int BenchReport::Load(const std::string& path, BenchRun& run)
+    {
+      FILE* file = fopen(path.c_str(), "rb");
+      if (file == nullptr) {
+        return -1;
+      }
+
+      std::string text;
+      char buffer[4096];
+      size_t read;
+      while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, read);
+      }
+      fclose(file);
+
+      JsonValue root;
+      if (!JsonParser(text).Parse(root) || root.Kind != JsonValue::Object) {
+        return -1;
+      }
+
+      const JsonValue* env = root.Find("environment");
+      if (env != nullptr) {
+        run.Environment.Os = env->GetString("os");
+        run.Environment.Compiler = env->GetString("compiler");
+        run.Environment.Cpu = env->GetString("cpu");
+        run.Environment.Build = env->GetString("build");
+        run.Environment.Processors = (int)env->GetNumber("processors");
+        run.Environment.NumaNodes = (int)env->GetNumber("numa_nodes");
+        run.Environment.Timestamp = env->GetString("timestamp");
+        run.Environment.Label = env->GetString("label");
+      }
+
+      const JsonValue* benchmarks = root.Find("benchmarks");
+      if (benchmarks == nullptr || benchmarks->Kind != JsonValue::Array) {
+        return -1;
+      }
+
+      for (auto& item : benchmarks->Items) {
+        BenchResult result;
+        result.Name = item.GetString("name");
+        result.Iterations = (uint64_t)item.GetNumber("iterations");
+        result.NanosecondsPerIteration = item.GetNumber("ns_per_iteration");
+        result.ItemsPerSecond = item.GetNumber("items_per_second");
+
+        const JsonValue* samples = item.Find("samples");
+        if (samples != nullptr) {
+          for (auto& sample : samples->Items) {
+            result.Samples.push_back(sample.NumberValue);
+          }
+        }
+
+        const JsonValue* counters = item.Find("counters");
+        if (counters != nullptr) {
+          for (auto& counter : counters->Members) {
+            result.Counters[counter.first] = counter.second.NumberValue;
+          }
+        }
+
+        const JsonValue* threshold = item.Find("threshold_percent");
+        if (threshold != nullptr && threshold->Kind == JsonValue::Number) {
+          run.Thresholds[result.Name] = threshold->NumberValue;
+        }
+
+        run.Results.push_back(std::move(result));
+      }
+
+      return 0;
+    }
+
+    double BenchReport::MannWhitneyPValue(const std::vector<double>& baseline, const std::vector<double>& current)
+    {
+      size_t n = current.size();
+      size_t m = baseline.size();
+      if (n == 0 || m == 0) {
+        return 1;
+      }
+
+      // U counts the pairs where the current sample is slower, ties count a half.
+      double u = 0;
+      for (double c : current) {
+        for (double b : baseline) {
+          u += (c > b) ? 1.0 : (c == b) ? 0.5 : 0.0;
+        }
+      }
+
+      size_t pairs = n * m;
+
+      if (pairs > (size_t)EXACT_U_MAX_PAIRS) {
+        double mean = pairs / 2.0;
+        double sd = sqrt(pairs * (n + m + 1) / 12.0);
+        double z = (u - 0.5 - mean) / sd;
+        return 0.5 * erfc(z / sqrt(2.0));
+      }
+
+      // counts[i][j][k]: the orderings of i current and j baseline samples with U = k.
+      // Built up one sample at a time keeping a row per baseline count.
+      std::vector<std::vector<double>> previous(m + 1, std::vector<double>(pairs + 1, 0));
+      for (size_t j = 0; j <= m; j++) {
+        previous[j][0] = 1;
+      }
+
+      for (size_t i = 1; i <= n; i++) {
+        std::vector<std::vector<double>> row(m + 1, std::vector<double>(pairs + 1, 0));
+        row[0][0] = 1;
+        for (size_t j = 1; j <= m; j++) {
+          for (size_t k = 0; k <= i * j; k++) {
+            // The largest sample is either a current one, beating all j baseline
+            // samples, or a baseline one, beating none.
+            row[j][k] = ((k >= j) ? previous[j][k - j] : 0) + row[j - 1][k];
+          }
+        }
+        previous.swap(row);
+      }
+
+      double total = 0, atLeast = 0;
+      size_t observed = (size_t)ceil(u);
+      for (size_t k = 0; k <= pairs; k++) {
+        total += previous[m][k];
+        if (k >= observed) {
+          atLeast += previous[m][k];
+        }
+      }
+
+      return atLeast / total;
+    }
+
+    std::vector<BenchComparison> BenchReport::Compare(const BenchRun& baseline, const BenchRun& current,
+      double thresholdPercent, double alpha)
+    {
+      std::vector<BenchComparison> comparisons;
+
+      for (auto& result : current.Results) {
+        BenchComparison comparison;
+        comparison.Name = result.Name;
+        comparison.CurrentNanoseconds = result.NanosecondsPerIteration;
+
+        auto threshold = baseline.Thresholds.find(result.Name);
+        comparison.ThresholdPercent = (threshold != baseline.Thresholds.end()) ? threshold->second : thresholdPercent;
+
+        const BenchResult* base = nullptr;
+        for (auto& candidate : baseline.Results) {
+          if (candidate.Name == result.Name) {
+            base = &candidate;
+            break;
+          }
+        }
+
+        if (base == nullptr || base->NanosecondsPerIteration <= 0) {
+          comparison.Verdict = BenchVerdict::NotInBaseline;
+          comparisons.push_back(comparison);
+          continue;
+        }
+
+        std::vector<double> baseSamples = (base->Samples.empty()) ? std::vector<double>(1, base->NanosecondsPerIteration) : base->Samples;
+        std::vector<double> currentSamples = (result.Samples.empty()) ? std::vector<double>(1, result.NanosecondsPerIteration) : result.Samples;
+
+        comparison.BaselineNanoseconds = Median(baseSamples);
+        comparison.ChangePercent = 100.0 * (comparison.CurrentNanoseconds / comparison.BaselineNanoseconds - 1.0);
+
+        bool isTestable = MinimumPValue(currentSamples.size(), baseSamples.size()) <= alpha;
+
+        if (comparison.ChangePercent > comparison.ThresholdPercent) {
+          comparison.PValue = MannWhitneyPValue(baseSamples, currentSamples);
+          if (!isTestable || comparison.PValue <= alpha) {
+            comparison.Verdict = BenchVerdict::Regressed;
+          }
+        }
+        else if (comparison.ChangePercent < -comparison.ThresholdPercent) {
+          comparison.PValue = MannWhitneyPValue(currentSamples, baseSamples);
+          if (!isTestable || comparison.PValue <= alpha) {
+            comparison.Verdict = BenchVerdict::Improved;
+          }
+        }
+
+        comparisons.push_back(comparison);
+      }
+
+      return comparisons;
+    }
+  }
+}
@@ -0,0 +1,108 @@
+//-----------------------------------------------------------------------------
+// Filename: BenchReport.h
+//
+// Description: Machine readable benchmark results and regression checks.
+// A run is written as JSON with a description of the machine it ran on.
+// A later run can be compared against a committed baseline file in the same
+// format. A benchmark has regressed if its median time per iteration is
+// more than the threshold slower and a one-sided Mann-Whitney U test on the
+// repetition samples says the slowdown is unlikely to be noise.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "Bench.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SIPSorceryMedia {
+  namespace Bench {
+
+    struct BenchEnvironment
+    {
+      std::string Os;
+      std::string Compiler;
+      std::string Cpu;
+      std::string Build;            // "release" or "debug".
+      int Processors = 0;
+      int NumaNodes = 0;
+      std::string Timestamp;        // UTC, ISO 8601.
+      std::string Label;            // Free text supplied by the caller, e.g. the commit.
+
+      /**
+      * Describes the machine and build the benchmarks are running on.
+      */
+      static BenchEnvironment Capture();
+
+      /**
+      * Whether timings from the two environments can be compared. The timestamp and
+      * label are ignored.
+      */
+      bool IsComparable(const BenchEnvironment& other) const;
+    };
+
+    struct BenchRun
+    {
+      BenchEnvironment Environment;
+      std::vector<BenchResult> Results;
+
+      /**
+      * Optional per benchmark regression thresholds in percent, read from the baseline.
+      */
+      std::map<std::string, double> Thresholds;
+    };
+
+    enum class BenchVerdict
+    {
+      Unchanged = 0,
+      Regressed = 1,
+      Improved = 2,
+      NotInBaseline = 3,
+    };
+
+    struct BenchComparison
+    {
+      std::string Name;
+      double BaselineNanoseconds = 0;
+      double CurrentNanoseconds = 0;
+      double ChangePercent = 0;     // Positive is slower.
+      double PValue = 1;
+      double ThresholdPercent = 0;
+      BenchVerdict Verdict = BenchVerdict::Unchanged;
+    };
+
+    class BenchReport
+    {
+    public:
+
+      static std::string ToJson(const BenchRun& run);
+
+      /**
+      * Reads a run, normally a baseline, written by ToJson.
+      * @@Returns: 0 if successful or -1 if the file could not be read or parsed.
+      */
+      static int Load(const std::string& path, BenchRun& run);
+
+      /**
+      * Compares each current result with the baseline result of the same name.
+      * @param[in] thresholdPercent: the slowdown allowed for benchmarks without their
+      *  own threshold in the baseline.
+      * @param[in] alpha: the significance level. If there are too few samples for the
+      *  test to ever reach it, the threshold alone decides.
+      */
+      static std::vector<BenchComparison> Compare(const BenchRun& baseline, const BenchRun& current,
+        double thresholdPercent, double alpha);
+
+      /**
+      * Gets the probability of a Mann-Whitney U at least as large as the observed one
+      * if the current samples are not slower than the baseline samples.
+      */
+      static double MannWhitneyPValue(const std::vector<double>& baseline, const std::vector<double>& current);
+    };
+  }
+}
@@ -0,0 +1,66 @@
+//-----------------------------------------------------------------------------
+// Filename: BufferPoolBench.cpp
+//
+// Description: Cost of acquiring and releasing a pooled media buffer compared
+// to the system allocator, for packet and frame sized buffers.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaBuffer.h"
+
+#include <stdlib.h>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+  const size_t PACKET_SIZE = 1500;
+  const size_t FRAME_SIZE = 640 * 480 * 3 / 2;     // VGA I420.
+}
+
+MEDIA_BENCH(buffer_pool_acquire_packet)
+{
+  MediaBufferPool& pool = MediaBufferPool::Default();
+  uint64_t allocationsBefore = pool.GetStats().SystemAllocations;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    MediaBufferPtr buffer = pool.Acquire(PACKET_SIZE);
+    DoNotOptimise(buffer->Data());
+  }
+
+  state.SetCounter("system_allocations", (double)(pool.GetStats().SystemAllocations - allocationsBefore));
+}
+
+MEDIA_BENCH(buffer_pool_acquire_frame)
+{
+  MediaBufferPool& pool = MediaBufferPool::Default();
+  uint64_t allocationsBefore = pool.GetStats().SystemAllocations;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    MediaBufferPtr buffer = pool.Acquire(FRAME_SIZE);
+    DoNotOptimise(buffer->Data());
+  }
+
+  state.SetCounter("system_allocations", (double)(pool.GetStats().SystemAllocations - allocationsBefore));
+}
+
+MEDIA_BENCH(malloc_packet)
+{
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    void* buffer = malloc(PACKET_SIZE);
+    DoNotOptimise(buffer);
+    free(buffer);
+  }
+}
+
+MEDIA_BENCH(malloc_frame)
+{
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    void* buffer = malloc(FRAME_SIZE);
+    DoNotOptimise(buffer);
+    free(buffer);
+  }
+}
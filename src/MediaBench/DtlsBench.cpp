@@ -0,0 +1,355 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsBench.cpp
+//
+// Description: DTLS handshake benchmarks. The memory a call's connection
+// holds once the handshake has completed, with the OpenSSL state kept for
+// the life of the call and with it released as soon as the SRTP keys are
+// exported, and the server's CPU time per handshake for each certificate,
+// cipher and key exchange group configuration. The handshakes run over a
+// pair of loopback UDP sockets with the server end on the benchmark thread
+// and the client end on a second thread. Only the server end is measured,
+// the client end stands in for a browser and offers the default suites and
+// groups.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "DtlsHandshakeNative.h"
+#include "MediaLog.h"
+#include "MediaMemory.h"
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#define closesocket close
+#endif
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int CALL_COUNT = 16;
+
+  // The cipher string used before the suites and groups were configurable.
+  const char* LEGACY_CIPHER_LIST = "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH";
+
+  enum class CertificateKey
+  {
+    EcdsaP256,
+    Rsa2048,
+  };
+
+  /**
+  * A self signed certificate and key written to the temp directory, the handshake
+  * only takes them from PEM files.
+  */
+  struct TestCertificate
+  {
+    std::string CertFile;
+    std::string KeyFile;
+
+    explicit TestCertificate(CertificateKey keyType = CertificateKey::EcdsaP256)
+    {
+      const char* name = (keyType == CertificateKey::Rsa2048) ? "rsa2048" : "ecdsa_p256";
+      std::filesystem::path dir = std::filesystem::temp_directory_path();
+      CertFile = (dir / (std::string("mediabench_dtls_") + name + "_cert.pem")).string();
+      KeyFile = (dir / (std::string("mediabench_dtls_") + name + "_key.pem")).string();
+
+      EVP_PKEY* key = nullptr;
+      EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id((keyType == CertificateKey::Rsa2048) ? EVP_PKEY_RSA : EVP_PKEY_EC, nullptr);
+      EVP_PKEY_keygen_init(keyCtx);
+      if (keyType == CertificateKey::Rsa2048) {
+        EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048);
+      }
+      else {
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1);
+      }
+      EVP_PKEY_keygen(keyCtx, &key);
+      EVP_PKEY_CTX_free(keyCtx);
+
+      X509* cert = X509_new();
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_get_notBefore(cert), 0);
+      X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+      X509_set_pubkey(cert, key);
+      X509_NAME* subject = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, (const unsigned char*)"mediabench", -1, -1, 0);
+      X509_set_issuer_name(cert, subject);
+      X509_sign(cert, key, EVP_sha256());
+
+      FILE* file = fopen(CertFile.c_str(), "wb");
+      PEM_write_X509(file, cert);
+      fclose(file);
+
+      file = fopen(KeyFile.c_str(), "wb");
+      PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+      fclose(file);
+
+      X509_free(cert);
+      EVP_PKEY_free(key);
+    }
+
+    ~TestCertificate()
+    {
+      std::error_code ignore;
+      std::filesystem::remove(CertFile, ignore);
+      std::filesystem::remove(KeyFile, ignore);
+    }
+  };
+
+  /**
+  * The server's cipher suites and key exchange groups.
+  */
+  struct ServerConfig
+  {
+    std::string CipherList = DtlsHandshakeNative::DEFAULT_CIPHER_LIST;
+    std::string Groups = DtlsHandshakeNative::DEFAULT_GROUPS;
+  };
+
+  /**
+  * Gets the CPU time used by the calling thread.
+  */
+  uint64_t ThreadCpuNanoseconds()
+  {
+#ifdef _WIN32
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+    uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+    uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+    return (kernel + user) * 100;
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+  }
+
+  SOCKET BindLoopback(sockaddr_in& address)
+  {
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(s, (sockaddr*)&address, sizeof(address));
+
+    socklen_t length = sizeof(address);
+    getsockname(s, (sockaddr*)&address, &length);
+    return s;
+  }
+
+  /**
+  * One call's DTLS connection, server and client ends. The sockets stay open for
+  * as long as the call so a kept connection can still send its close_notify.
+  */
+  struct Call
+  {
+    MemoryAccount ServerAccount;
+    MemoryAccount ClientAccount;
+    std::unique_ptr<DtlsHandshakeNative> Server;
+    std::unique_ptr<DtlsHandshakeNative> Client;
+    SOCKET ServerSocket;
+    SOCKET ClientSocket;
+    uint64_t ServerCpuNanoseconds = 0;
+
+    Call(const TestCertificate& certificate, bool releaseAfterKeyExport, const ServerConfig& config = ServerConfig()) :
+      Server(new DtlsHandshakeNative(certificate.CertFile, certificate.KeyFile)),
+      Client(new DtlsHandshakeNative(certificate.CertFile, certificate.KeyFile))
+    {
+      Server->SetMemoryAccount(&ServerAccount);
+      Client->SetMemoryAccount(&ClientAccount);
+      Server->ReleaseAfterKeyExport = releaseAfterKeyExport;
+      Client->ReleaseAfterKeyExport = releaseAfterKeyExport;
+      Server->CipherList = config.CipherList;
+      Server->Groups = config.Groups;
+
+      sockaddr_in serverAddress, clientAddress;
+      ServerSocket = BindLoopback(serverAddress);
+      ClientSocket = BindLoopback(clientAddress);
+      connect(ClientSocket, (sockaddr*)&serverAddress, sizeof(serverAddress));
+
+      uint8_t clientFingerprint[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+      int clientFingerprintLength = 0;
+      std::thread client([&] {
+        Client->DoHandshakeAsClient(ClientSocket, (sockaddr*)&serverAddress, clientFingerprint, &clientFingerprintLength);
+      });
+
+      uint8_t fingerprint[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+      int fingerprintLength = 0;
+      uint64_t start = ThreadCpuNanoseconds();
+      Server->DoHandshakeAsServer(ServerSocket, fingerprint, &fingerprintLength);
+      ServerCpuNanoseconds = ThreadCpuNanoseconds() - start;
+      client.join();
+    }
+
+    ~Call()
+    {
+      Server.reset();
+      Client.reset();
+      closesocket(ServerSocket);
+      closesocket(ClientSocket);
+    }
+
+    bool IsEstablished()
+    {
+      uint8_t material[DtlsHandshakeNative::SRTP_KEYING_MATERIAL_LENGTH];
+      return Server->ExportSrtpKeyingMaterial(material, sizeof(material)) == 0 &&
+        Client->ExportSrtpKeyingMaterial(material, sizeof(material)) == 0;
+    }
+  };
+
+  /**
+  * Sets up CALL_COUNT calls and gets the average bytes held by the server end of
+  * each once the handshakes have completed.
+  */
+  double ServerBytesPerCall(const TestCertificate& certificate, bool releaseAfterKeyExport, int& failures)
+  {
+    std::vector<std::unique_ptr<Call>> calls;
+    int64_t bytes = 0;
+
+    for (int i = 0; i < CALL_COUNT; i++) {
+      calls.emplace_back(new Call(certificate, releaseAfterKeyExport));
+      failures += (calls.back()->IsEstablished()) ? 0 : 1;
+    }
+
+    for (auto& call : calls) {
+      bytes += call->ServerAccount.GetBytes();
+    }
+
+    return (double)bytes / CALL_COUNT;
+  }
+
+  /**
+  * Sets the process up for the handshake benchmarks. Every handshake logs its
+  * completion at info, so the level is raised while they run.
+  */
+  struct DtlsBenchScope
+  {
+    LogLevel PreviousLevel;
+
+    DtlsBenchScope()
+    {
+#ifdef _WIN32
+      WSADATA wsaData;
+      WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+      PreviousLevel = MediaLog::GetLevel();
+      MediaLog::SetLevel(LogLevel::Warning);
+
+      DtlsHandshakeNative::InitialiseOpenSSL();
+    }
+
+    ~DtlsBenchScope()
+    {
+      MediaLog::SetLevel(PreviousLevel);
+    }
+  };
+
+  /**
+  * Times complete handshakes and reports the CPU time the server end used.
+  */
+  void ServerHandshake(BenchState& state, CertificateKey keyType, const ServerConfig& config)
+  {
+    state.PauseTiming();
+
+    DtlsBenchScope scope;
+    TestCertificate certificate(keyType);
+    { Call warmup(certificate, true, config); }
+
+    state.ResumeTiming();
+
+    uint64_t serverCpu = 0;
+    int failures = 0;
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      Call call(certificate, true, config);
+      serverCpu += call.ServerCpuNanoseconds;
+      failures += (call.IsEstablished()) ? 0 : 1;
+    }
+
+    state.SetCounter("server_cpu_us_per_handshake", (double)serverCpu / state.Iterations() / 1000.0);
+    state.SetCounter("handshake_failures", failures);
+  }
+}
+
+MEDIA_BENCH(dtls_handshake_footprint)
+{
+  state.PauseTiming();
+
+  DtlsBenchScope scope;
+  TestCertificate certificate;
+
+  // The first handshake loads OpenSSL's algorithms and error strings, which
+  // stay allocated for the life of the process.
+  { Call warmup(certificate, false); }
+
+  int failures = 0;
+  double keptBytes = ServerBytesPerCall(certificate, false, failures);
+  double releasedBytes = ServerBytesPerCall(certificate, true, failures);
+
+  state.ResumeTiming();
+
+  // Each iteration is a complete handshake that releases its state.
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    Call call(certificate, true);
+    DoNotOptimise(call.Server->IsReleased());
+  }
+
+  state.SetCounter("kept_bytes_per_call", keptBytes);
+  state.SetCounter("released_bytes_per_call", releasedBytes);
+  state.SetCounter("saved_bytes_per_call", keptBytes - releasedBytes);
+  state.SetCounter("openssl_hooked", MemoryAccount::IsOpenSslHooked() ? 1 : 0);
+  state.SetCounter("handshake_failures", failures);
+}
+
+MEDIA_BENCH(dtls_server_handshake_rsa2048_legacy)
+{
+  ServerConfig config;
+  config.CipherList = LEGACY_CIPHER_LIST;
+  config.Groups = "";
+  ServerHandshake(state, CertificateKey::Rsa2048, config);
+}
+
+MEDIA_BENCH(dtls_server_handshake_rsa2048_x25519)
+{
+  ServerHandshake(state, CertificateKey::Rsa2048, ServerConfig());
+}
+
+MEDIA_BENCH(dtls_server_handshake_ecdsa_p256_legacy)
+{
+  ServerConfig config;
+  config.CipherList = LEGACY_CIPHER_LIST;
+  config.Groups = "";
+  ServerHandshake(state, CertificateKey::EcdsaP256, config);
+}
+
+MEDIA_BENCH(dtls_server_handshake_ecdsa_p256_x25519)
+{
+  ServerHandshake(state, CertificateKey::EcdsaP256, ServerConfig());
+}
+
+MEDIA_BENCH(dtls_server_handshake_ecdsa_p256_p256)
+{
+  ServerConfig config;
+  config.Groups = "P-256";
+  ServerHandshake(state, CertificateKey::EcdsaP256, config);
+}
+
+MEDIA_BENCH(dtls_server_handshake_ecdsa_p256_p384)
+{
+  // The certificate's own curve has to stay in the list.
+  ServerConfig config;
+  config.Groups = "P-384:P-256";
+  ServerHandshake(state, CertificateKey::EcdsaP256, config);
+}
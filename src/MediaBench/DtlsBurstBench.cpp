@@ -0,0 +1,305 @@
+//-----------------------------------------------------------------------------
+// Filename: DtlsBurstBench.cpp
+//
+// Description: Call setup latency for a burst of 1000 DTLS handshakes started
+// at once, with the server's ECDHE key shares generated inline and taken
+// from a DtlsKeyPool filled before the burst, as it would be in the idle time
+// before a burst of calls. The server ends are stepped by the benchmark
+// thread and the client ends, standing in for browsers, by a second thread,
+// over loopback UDP sockets. The latency of each handshake is from the start
+// of the burst to the server end completing.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "DtlsHandshakeNative.h"
+#include "DtlsKeyPool.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+
+#include <openssl/pem.h>
+
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#define closesocket close
+#endif
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int BURST_SIZE = 1000;
+
+  /**
+  * How long a burst can take before the handshakes still pending count as failed.
+  */
+  const uint64_t BURST_TIMEOUT_NANOSECONDS = 60ULL * 1000 * 1000 * 1000;
+
+  /**
+  * A self signed ECDSA P-256 certificate and key written to the temp directory.
+  */
+  struct TestCertificate
+  {
+    std::string CertFile;
+    std::string KeyFile;
+
+    TestCertificate()
+    {
+      std::filesystem::path dir = std::filesystem::temp_directory_path();
+      CertFile = (dir / "mediabench_dtls_burst_cert.pem").string();
+      KeyFile = (dir / "mediabench_dtls_burst_key.pem").string();
+
+      EVP_PKEY* key = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-256");
+
+      X509* cert = X509_new();
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_get_notBefore(cert), 0);
+      X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+      X509_set_pubkey(cert, key);
+      X509_NAME* subject = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, (const unsigned char*)"mediabench", -1, -1, 0);
+      X509_set_issuer_name(cert, subject);
+      X509_sign(cert, key, EVP_sha256());
+
+      FILE* file = fopen(CertFile.c_str(), "wb");
+      PEM_write_X509(file, cert);
+      fclose(file);
+
+      file = fopen(KeyFile.c_str(), "wb");
+      PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+      fclose(file);
+
+      X509_free(cert);
+      EVP_PKEY_free(key);
+    }
+
+    ~TestCertificate()
+    {
+      std::error_code ignore;
+      std::filesystem::remove(CertFile, ignore);
+      std::filesystem::remove(KeyFile, ignore);
+    }
+  };
+
+  uint64_t ThreadCpuNanoseconds()
+  {
+#ifdef _WIN32
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+    uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+    uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+    return (kernel + user) * 100;
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+  }
+
+  SOCKET BindLoopback(sockaddr_in& address)
+  {
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(s, (sockaddr*)&address, sizeof(address));
+
+    socklen_t length = sizeof(address);
+    getsockname(s, (sockaddr*)&address, &length);
+    return s;
+  }
+
+  /**
+  * One call's server and client ends.
+  */
+  struct BurstCall
+  {
+    std::unique_ptr<DtlsHandshakeNative> Server;
+    std::unique_ptr<DtlsHandshakeNative> Client;
+    SOCKET ServerSocket;
+    SOCKET ClientSocket;
+    sockaddr_in ServerAddress;
+
+    BurstCall(const TestCertificate& certificate, DtlsKeyPool* pool) :
+      Server(new DtlsHandshakeNative(certificate.CertFile, certificate.KeyFile)),
+      Client(new DtlsHandshakeNative(certificate.CertFile, certificate.KeyFile))
+    {
+      Server->ReleaseAfterKeyExport = true;
+      Client->ReleaseAfterKeyExport = true;
+      Server->SetKeyPool(pool);
+
+      sockaddr_in clientAddress;
+      ServerSocket = BindLoopback(ServerAddress);
+      ClientSocket = BindLoopback(clientAddress);
+      connect(ClientSocket, (sockaddr*)&ServerAddress, sizeof(ServerAddress));
+    }
+
+    ~BurstCall()
+    {
+      Server.reset();
+      Client.reset();
+      closesocket(ServerSocket);
+      closesocket(ClientSocket);
+    }
+  };
+
+  /**
+  * Steps the handshakes whose sockets are readable until they are all done, or the
+  * burst times out. Every handshake is stepped once first, which sends the clients'
+  * first flights, and a handshake is also stepped when its socket is quiet for
+  * POLL_MILLISECONDS so its retransmission timer is checked.
+  * @@Returns: the handshakes that failed.
+  */
+  template <typename Socket, typename Step>
+  int StepAll(std::vector<std::unique_ptr<BurstCall>>& calls, uint64_t start, Socket socketOf, Step step)
+  {
+    const int POLL_MILLISECONDS = 100;
+
+    std::vector<BurstCall*> pending;
+    for (auto& call : calls) {
+      pending.push_back(call.get());
+    }
+
+    std::vector<pollfd> sockets;
+    int failures = 0;
+    bool isFirstPass = true;
+
+    while (!pending.empty()) {
+      sockets.resize(pending.size());
+      for (size_t i = 0; i < pending.size(); i++) {
+        sockets[i].fd = socketOf(*pending[i]);
+        sockets[i].events = POLLIN;
+        sockets[i].revents = 0;
+      }
+
+      int ready = (isFirstPass) ? 0 : poll(sockets.data(), (unsigned long)sockets.size(), POLL_MILLISECONDS);
+
+      size_t kept = 0;
+      for (size_t i = 0; i < pending.size(); i++) {
+        int result = HANDSHAKE_PENDING_STATUS;
+        if (isFirstPass || ready == 0 || sockets[i].revents != 0) {
+          result = step(*pending[i]);
+        }
+        if (result == HANDSHAKE_PENDING_STATUS) {
+          pending[kept++] = pending[i];
+        }
+        else {
+          failures += (result == 0) ? 0 : 1;
+        }
+      }
+      pending.resize(kept);
+      isFirstPass = false;
+
+      if (MediaScheduler::NowNanoseconds() - start > BURST_TIMEOUT_NANOSECONDS) {
+        return failures + (int)pending.size();
+      }
+    }
+
+    return failures;
+  }
+
+  void RunBurst(BenchState& state, bool isPooled)
+  {
+    state.PauseTiming();
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    LogLevel previousLevel = MediaLog::GetLevel();
+    MediaLog::SetLevel(LogLevel::Warning);
+    DtlsHandshakeNative::InitialiseOpenSSL();
+
+    TestCertificate certificate;
+    std::unique_ptr<DtlsKeyPool> pool((isPooled) ? new DtlsKeyPool(BURST_SIZE) : nullptr);
+    std::unique_ptr<MetricHistogram> latency(new MetricHistogram());
+    uint64_t serverCpu = 0;
+    uint64_t burstNanoseconds = 0;
+    int failures = 0;
+
+    state.ResumeTiming();
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      state.PauseTiming();
+      if (pool != nullptr) {
+        pool->Fill();
+      }
+      std::vector<std::unique_ptr<BurstCall>> calls;
+      for (int c = 0; c < BURST_SIZE; c++) {
+        calls.emplace_back(new BurstCall(certificate, pool.get()));
+      }
+      state.ResumeTiming();
+
+      uint64_t start = MediaScheduler::NowNanoseconds();
+
+      std::thread clients([&] {
+        for (auto& call : calls) {
+          call->Client->BeginHandshakeAsClient(call->ClientSocket, (sockaddr*)&call->ServerAddress);
+        }
+        StepAll(calls, start, [](BurstCall& call) { return call.ClientSocket; }, [](BurstCall& call) {
+          uint8_t fingerprint[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+          int fingerprintLength = 0, timeout = 0;
+          return call.Client->ContinueHandshake(fingerprint, &fingerprintLength, &timeout);
+        });
+      });
+
+      uint64_t cpuStart = ThreadCpuNanoseconds();
+      for (auto& call : calls) {
+        call->Server->BeginHandshakeAsServer(call->ServerSocket);
+      }
+      failures += StepAll(calls, start, [](BurstCall& call) { return call.ServerSocket; }, [&](BurstCall& call) {
+        uint8_t fingerprint[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+        int fingerprintLength = 0, timeout = 0;
+        int result = call.Server->ContinueHandshake(fingerprint, &fingerprintLength, &timeout);
+        if (result == 0) {
+          latency->Record(MediaScheduler::NowNanoseconds() - start);
+        }
+        return result;
+      });
+      serverCpu += ThreadCpuNanoseconds() - cpuStart;
+      burstNanoseconds += MediaScheduler::NowNanoseconds() - start;
+
+      clients.join();
+
+      state.PauseTiming();
+      calls.clear();
+      state.ResumeTiming();
+    }
+
+    MetricHistogramSnapshot snapshot = latency->Snapshot();
+    state.SetItemsProcessed(state.Iterations() * BURST_SIZE);
+    state.SetCounter("setup_p50_ms", snapshot.P50 / 1e6);
+    state.SetCounter("setup_p99_ms", snapshot.P99 / 1e6);
+    state.SetCounter("burst_ms", (double)burstNanoseconds / state.Iterations() / 1e6);
+    state.SetCounter("server_cpu_us_per_handshake", (double)serverCpu / state.Iterations() / BURST_SIZE / 1000.0);
+    state.SetCounter("handshake_failures", failures);
+    state.SetCounter("pool_misses", (pool != nullptr) ? (double)pool->GetStats().Misses : 0.0);
+
+    MediaLog::SetLevel(previousLevel);
+  }
+}
+
+MEDIA_BENCH(dtls_burst_1000_inline_keys)
+{
+  RunBurst(state, false);
+}
+
+MEDIA_BENCH(dtls_burst_1000_pooled_keys)
+{
+  RunBurst(state, true);
+}
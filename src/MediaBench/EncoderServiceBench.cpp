@@ -0,0 +1,211 @@
+//-----------------------------------------------------------------------------
+// Filename: EncoderServiceBench.cpp
+//
+// Description: The latency added by encoding on an EncoderWorker in another
+// process instead of in process. Each benchmark encodes the same 640x480
+// frames, in process, on a worker over a Unix domain socket and on a worker
+// over TCP loopback. The remote runs report the round trip and the part of
+// it the worker spent encoding, the difference is the cost of the transport.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "EncoderService.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+#include "VpxEncoderNative.h"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int WIDTH = 640;
+  const int HEIGHT = 480;
+  const int FRAME_COUNT = 8;
+  const int WORKER_START_TIMEOUT_MILLISECONDS = 10000;
+
+  /**
+  * A few I420 frames with the pattern moving between them so the encoder has
+  * something to do on every frame.
+  */
+  std::vector<std::vector<uint8_t>> TestFrames()
+  {
+    std::vector<std::vector<uint8_t>> frames;
+    for (int f = 0; f < FRAME_COUNT; f++) {
+      std::vector<uint8_t> i420((size_t)WIDTH * HEIGHT * 3 / 2);
+      for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+          i420[(size_t)y * WIDTH + x] = (uint8_t)((x + f * 4) ^ (y * 3));
+        }
+      }
+      memset(i420.data() + (size_t)WIDTH * HEIGHT, 128, (size_t)WIDTH * HEIGHT / 2);
+      frames.push_back(std::move(i420));
+    }
+    return frames;
+  }
+
+  VpxEncoderConfig TestConfig()
+  {
+    VpxEncoderConfig config;
+    config.TargetBitrate = 1000;
+    config.CpuUsed = 8;
+    return config;
+  }
+
+  std::string UnixEndpoint()
+  {
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("sipsm-encoder-" + std::to_string(pid) + ".sock");
+    return "unix:" + path.string();
+  }
+
+  /**
+  * Starts a worker process and connects an encoder to it.
+  */
+  int StartWorker(const std::string& endpoint, BenchChildProcess& child, std::unique_ptr<EncoderWorkerPool>& pool,
+    std::unique_ptr<RemoteVpxEncoder>& encoder)
+  {
+    if (child.Start("encoder_worker", endpoint, true) != 0) {
+      return -1;
+    }
+
+    // The worker isn't listening straight away. The failed attempts are quietened as
+    // the pool logs each one.
+    LogLevel level = MediaLog::GetLevel();
+    MediaLog::SetLevel(LogLevel::Critical);
+
+    uint64_t deadline = MediaScheduler::NowNanoseconds() + WORKER_START_TIMEOUT_MILLISECONDS * 1000000ULL;
+    int result = -1;
+    while (result != 0 && MediaScheduler::NowNanoseconds() < deadline) {
+      pool.reset(new EncoderWorkerPool());
+      pool->Add(endpoint);
+      encoder.reset(new RemoteVpxEncoder(*pool));
+      result = encoder->InitEncoder(WIDTH, HEIGHT, 1, TestConfig());
+      if (result != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+
+    MediaLog::SetLevel(level);
+    if (result != 0) {
+      SIPSM_LOG_ERROR("The encoder worker on %s didn't start.", endpoint.c_str());
+    }
+    return result;
+  }
+
+  void RunRemote(BenchState& state, const std::string& endpoint)
+  {
+    state.PauseTiming();
+    MediaLog::SetLevel(LogLevel::Warning);
+
+    std::vector<std::vector<uint8_t>> frames = TestFrames();
+
+    BenchChildProcess child;
+    std::unique_ptr<EncoderWorkerPool> pool;
+    std::unique_ptr<RemoteVpxEncoder> encoder;
+    if (StartWorker(endpoint, child, pool, encoder) != 0) {
+      return;
+    }
+
+    // The first frame is a key frame, encoded before the timing starts.
+    MediaBufferPtr encoded;
+    bool isKeyFrame = false;
+    encoder->Encode(frames[0].data(), (int)frames[0].size(), 0, encoded, &isKeyFrame);
+    RemoteEncoderStats before = encoder->GetRemoteStats();
+
+    state.ResumeTiming();
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      const std::vector<uint8_t>& frame = frames[(i + 1) % FRAME_COUNT];
+      encoder->Encode(frame.data(), (int)frame.size(), (int)(i + 1), encoded, &isKeyFrame);
+    }
+
+    state.PauseTiming();
+
+    RemoteEncoderStats after = encoder->GetRemoteStats();
+    uint64_t frameCount = after.FramesSent - before.FramesSent;
+    if (frameCount > 0) {
+      double roundTrip = (double)(after.RoundTripNanosecondsTotal - before.RoundTripNanosecondsTotal) / frameCount / 1000;
+      double workerEncode = (double)(after.WorkerEncodeNanosecondsTotal - before.WorkerEncodeNanosecondsTotal) / frameCount / 1000;
+      state.SetCounter("round_trip_mean_us", roundTrip);
+      state.SetCounter("worker_encode_mean_us", workerEncode);
+      state.SetCounter("added_latency_mean_us", roundTrip - workerEncode);
+      state.SetCounter("round_trip_max_us", (double)after.RoundTripMaxNanoseconds / 1000);
+    }
+    state.SetCounter("encode_failures", (double)encoder->GetStats().EncodeFailures);
+
+    encoder.reset();
+    child.Wait();
+  }
+}
+
+MEDIA_BENCH_CHILD(encoder_worker)
+{
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  EncoderWorker worker;
+  if (worker.Listen(argument) != 0 || worker.Start() != 0) {
+    return 1;
+  }
+
+  // Serves until the benchmark closes the worker's standard input.
+  uint8_t byte = 0;
+  while (BenchChildProcess::ReadInput(&byte, 1) == 0) {}
+
+  worker.Stop();
+  return 0;
+}
+
+MEDIA_BENCH(encoder_640x480_in_process)
+{
+  state.PauseTiming();
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  std::vector<std::vector<uint8_t>> frames = TestFrames();
+  VpxEncoderNative encoder;
+  if (encoder.InitEncoder(WIDTH, HEIGHT, 1, TestConfig()) != 0) {
+    return;
+  }
+
+  MediaBufferPtr encoded;
+  bool isKeyFrame = false;
+  encoder.Encode(frames[0].data(), (int)frames[0].size(), 0, encoded, &isKeyFrame);
+
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    const std::vector<uint8_t>& frame = frames[(i + 1) % FRAME_COUNT];
+    encoder.Encode(frame.data(), (int)frame.size(), (int)(i + 1), encoded, &isKeyFrame);
+  }
+}
+
+MEDIA_BENCH(encoder_640x480_worker_unix_socket)
+{
+  RunRemote(state, UnixEndpoint());
+}
+
+MEDIA_BENCH(encoder_640x480_worker_tcp_loopback)
+{
+  // A fixed port as the worker process picks it, not the benchmark.
+  RunRemote(state, "tcp:127.0.0.1:47391");
+}
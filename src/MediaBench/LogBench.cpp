@@ -0,0 +1,72 @@
+//-----------------------------------------------------------------------------
+// Filename: LogBench.cpp
+//
+// Description: Cost of a log call on the calling thread. A statement below
+// the log level must cost no more than a load and a branch. An enabled
+// statement formats into the queue and must not wait on the sink.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  void DiscardSink(LogLevel level, const char* message, size_t length, void* context)
+  { }
+
+  /**
+  * Points the logger at a sink that does nothing for the duration of a benchmark.
+  */
+  struct LogBenchScope
+  {
+    uint64_t DroppedBefore;
+
+    LogBenchScope(uint32_t rateLimit)
+    {
+      MediaLog::SetSink(DiscardSink, nullptr);
+      MediaLog::SetRateLimit(rateLimit);
+      MediaLog::SetLevel(LogLevel::Info);
+      DroppedBefore = MediaLog::GetDroppedCount();
+    }
+
+    ~LogBenchScope()
+    {
+      MediaLog::Flush();
+      MediaLog::SetRateLimit(MediaLog::DEFAULT_RATE_LIMIT);
+      MediaLog::SetSink(nullptr, nullptr);
+    }
+  };
+}
+
+MEDIA_BENCH(log_disabled)
+{
+  LogBenchScope scope(MediaLog::DEFAULT_RATE_LIMIT);
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    SIPSM_LOG_DEBUG("VPX codec failed to decode the frame: %s, count %llu.", "Corrupt frame", (unsigned long long)i);
+  }
+}
+
+MEDIA_BENCH(log_enabled)
+{
+  LogBenchScope scope(0);
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    SIPSM_LOG_ERROR("VPX codec failed to decode the frame: %s, count %llu.", "Corrupt frame", (unsigned long long)i);
+  }
+  state.SetCounter("dropped", (double)(MediaLog::GetDroppedCount() - scope.DroppedBefore));
+}
+
+MEDIA_BENCH(log_rate_limited)
+{
+  // An error storm from a single statement, all but the first few messages each
+  // second are suppressed before being formatted.
+  LogBenchScope scope(MediaLog::DEFAULT_RATE_LIMIT);
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    SIPSM_LOG_ERROR("VPX codec failed to decode the frame: %s, count %llu.", "Corrupt frame", (unsigned long long)i);
+  }
+}
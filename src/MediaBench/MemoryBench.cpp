@@ -0,0 +1,172 @@
+//-----------------------------------------------------------------------------
+// Filename: MemoryBench.cpp
+//
+// Description: The memory held by a session, measured through the session's
+// MemoryAccount while it is active and after it has been parked, and the
+// cost of waking a parked session up. A session here is the native state of
+// a 640x480 video leg: a send and a receive SRTP session, a VP8 encoder and
+// decoder and an RGB to I420 converter.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "ImageConvertNative.h"
+#include "MediaMemory.h"
+#include "SrtpNative.h"
+#include "VpxEncoderNative.h"
+
+#include <memory>
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int WIDTH = 640;
+  const int HEIGHT = 480;
+  const int SESSION_COUNT = 16;
+  const int RTP_PAYLOAD_LENGTH = 1000;
+
+  struct Session
+  {
+    MemoryAccount Account;
+    SrtpNative Send;
+    SrtpNative Receive;
+    ImageConvertNative Converter;
+    VpxEncoderNative Encoder;
+    VpxEncoderNative Decoder;
+    int FrameCount = 0;
+
+    int Init(int id)
+    {
+      Send.SetMemoryAccount(&Account);
+      Receive.SetMemoryAccount(&Account);
+      Converter.SetMemoryAccount(&Account);
+      Encoder.SetMemoryAccount(&Account);
+      Decoder.SetMemoryAccount(&Account);
+
+      uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+      for (int i = 0; i < SrtpNative::SRTP_MASTER_KEY_LEN; i++) {
+        key[i] = (uint8_t)(id * 13 + i);
+      }
+
+      if (Send.InitWithKey(key, sizeof(key), true) != 0 || Receive.InitWithKey(key, sizeof(key), false) != 0 ||
+        Encoder.InitEncoder(WIDTH, HEIGHT, 1, VpxEncoderConfig()) != 0 || Decoder.InitDecoder() != 0) {
+        return -1;
+      }
+
+      return 0;
+    }
+
+    /**
+    * Sends a frame through the session so every context has allocated what it
+    * holds in the steady state.
+    */
+    void SendFrame(const std::vector<uint8_t>& bgr)
+    {
+      MediaBufferPtr i420, encoded, decoded;
+      bool isKeyFrame = false;
+      unsigned int width = 0, height = 0;
+
+      Converter.ConvertRGBtoYUV(bgr.data(), AV_PIX_FMT_BGR24, WIDTH, HEIGHT, WIDTH * 3, AV_PIX_FMT_YUV420P, i420);
+      Encoder.Encode(i420->Data(), (int)i420->Length(), FrameCount, encoded, &isKeyFrame);
+      if (encoded) {
+        Decoder.Decode(encoded->Data(), (int)encoded->Length(), decoded, &width, &height);
+      }
+
+      uint8_t packet[RTP_HEADER_LENGTH + RTP_PAYLOAD_LENGTH + SRTP_MAX_TRAILER_LEN];
+      memset(packet, 0, sizeof(packet));
+      WriteRtpHeader(packet, 96, (uint16_t)FrameCount, 0, 1);
+
+      int length = 0;
+      Send.ProtectRTP(packet, RTP_HEADER_LENGTH + RTP_PAYLOAD_LENGTH, &length);
+      Receive.UnprotectRTP(packet, length, &length);
+
+      FrameCount++;
+    }
+
+    void Park()
+    {
+      Converter.Park();
+      Encoder.Park();
+      Decoder.Park();
+    }
+  };
+
+  std::vector<uint8_t> TestImage()
+  {
+    std::vector<uint8_t> bgr((size_t)WIDTH * HEIGHT * 3);
+    for (size_t i = 0; i < bgr.size(); i++) {
+      bgr[i] = (uint8_t)(i * 7 + (i >> 9));
+    }
+    return bgr;
+  }
+}
+
+MEDIA_BENCH(session_idle_footprint_640x480)
+{
+  state.PauseTiming();
+
+  std::vector<uint8_t> bgr = TestImage();
+  SrtpNative::InitialiseLibSrtp();
+
+  // One session is created and dropped first so the libraries' one off global
+  // allocations aren't charged to the measured sessions.
+  {
+    Session warmup;
+    warmup.Init(0);
+    warmup.SendFrame(bgr);
+  }
+
+  int64_t heapBefore = MemoryAccount::GetHeapBytes();
+  std::vector<std::unique_ptr<Session>> sessions;
+  for (int i = 0; i < SESSION_COUNT; i++) {
+    std::unique_ptr<Session> session(new Session());
+    session->Init(i + 1);
+    for (int f = 0; f < 3; f++) {
+      session->SendFrame(bgr);
+    }
+    sessions.push_back(std::move(session));
+  }
+
+  int64_t activeHeap = MemoryAccount::GetHeapBytes() - heapBefore;
+  int64_t activeAccounted = 0;
+  for (auto& session : sessions) {
+    activeAccounted += session->Account.GetBytes();
+  }
+
+  for (auto& session : sessions) {
+    session->Park();
+  }
+
+  int64_t idleHeap = MemoryAccount::GetHeapBytes() - heapBefore;
+  MemoryUsage idle{};
+  for (auto& session : sessions) {
+    MemoryUsage usage = session->Account.GetUsage();
+    idle.SrtpBytes += usage.SrtpBytes;
+    idle.CodecBytes += usage.CodecBytes;
+    idle.ConvertBytes += usage.ConvertBytes;
+    idle.TotalBytes += usage.TotalBytes;
+  }
+
+  state.ResumeTiming();
+
+  // Each iteration wakes a parked session with a frame and parks it again.
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    Session& session = *sessions[i % SESSION_COUNT];
+    session.SendFrame(bgr);
+    session.Park();
+  }
+
+  state.SetCounter("active_bytes_per_session", (double)activeAccounted / SESSION_COUNT);
+  state.SetCounter("idle_bytes_per_session", (double)idle.TotalBytes / SESSION_COUNT);
+  state.SetCounter("idle_srtp_bytes_per_session", (double)idle.SrtpBytes / SESSION_COUNT);
+  state.SetCounter("idle_codec_bytes_per_session", (double)idle.CodecBytes / SESSION_COUNT);
+  state.SetCounter("idle_convert_bytes_per_session", (double)idle.ConvertBytes / SESSION_COUNT);
+  state.SetCounter("heap_active_bytes_per_session", (double)activeHeap / SESSION_COUNT);
+  state.SetCounter("heap_idle_bytes_per_session", (double)idleHeap / SESSION_COUNT);
+}
@@ -0,0 +1,170 @@
+//-----------------------------------------------------------------------------
+// Filename: NetworkEmulatorBench.cpp
+//
+// Description: Cost of pushing datagrams through the network emulator and a
+// replayable scenario that streams packetised VP8 frames over a link with
+// bursty loss and jitter. The scenario reports how long the receiver goes
+// without a complete frame after a loss, in virtual time, and checks that a
+// second run with the same seed delivers exactly the same packets.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaMetrics.h"
+#include "NetworkEmulator.h"
+#include "Vp8Packetiser.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t MILLISECOND = 1000000ULL;
+  const int FRAMES_PER_SECOND = 30;
+  const uint32_t RTP_TIMESTAMP_STEP = 90000 / FRAMES_PER_SECOND;
+  const int SCENARIO_FRAMES = 30 * FRAMES_PER_SECOND;
+
+  struct ScenarioResult
+  {
+    uint64_t Digest = 0;
+    uint64_t FramesComplete = 0;
+    uint64_t FramesMissing = 0;
+    MetricHistogramSnapshot Recovery{};
+  };
+
+  LinkConfig ScenarioLink(uint64_t seed)
+  {
+    LinkConfig config;
+    config.DelayNanoseconds = 40 * MILLISECOND;
+    config.JitterNanoseconds = 15 * MILLISECOND;
+    config.BurstLoss.GoodToBad = 0.005;
+    config.BurstLoss.BadToGood = 0.25;
+    config.BurstLoss.LossInBad = 0.5;
+    config.LossRate = 0.002;
+    config.BandwidthBitsPerSecond = 2000000;
+    config.QueueLimitBytes = 64 * 1024;
+    config.Seed = seed;
+    return config;
+  }
+
+  /**
+  * Streams SCENARIO_FRAMES frames at 30fps, a 20KB key frame every 3 seconds and
+  * 3-5KB delta frames in between, and measures the outage after each loss.
+  */
+  ScenarioResult RunScenario(uint64_t seed)
+  {
+    VirtualClock clock;
+    EmulatedLink link(clock, ScenarioLink(seed));
+    Vp8Packetiser packetiser(0x12345678, 96);
+    Vp8Depacketiser depacketiser;
+    MetricHistogram recovery;
+    ScenarioResult result;
+
+    static uint8_t frame[20 * 1024];
+    std::vector<MediaBufferPtr> packets;
+    MediaBufferPtr datagram, received;
+    uint32_t lastTimestamp = 0;
+    bool hasLast = false;
+
+    const uint64_t interval = 1000 * MILLISECOND / FRAMES_PER_SECOND;
+
+    for (int n = 0; n <= SCENARIO_FRAMES; n++) {
+      uint64_t sendAt = n * interval;
+
+      // Deliver everything due before the next frame is sent.
+      while (link.NextDeliveryNanoseconds() <= sendAt) {
+        clock.AdvanceTo(link.NextDeliveryNanoseconds());
+
+        while (link.Receive(datagram) == 1) {
+          depacketiser.Push(datagram->Data(), (int)datagram->Length(), received);
+
+          if (received) {
+            uint32_t timestamp = (uint32_t)received->Id();
+            uint32_t expected = lastTimestamp + RTP_TIMESTAMP_STEP;
+
+            if (hasLast && timestamp > expected) {
+              // The outage runs from when the first missing frame was sent until now.
+              uint64_t firstMissingSentAt = (expected / RTP_TIMESTAMP_STEP) * interval;
+              recovery.Record(clock.Now() - firstMissingSentAt);
+              result.FramesMissing += (timestamp - expected) / RTP_TIMESTAMP_STEP;
+            }
+
+            result.FramesComplete++;
+            lastTimestamp = timestamp;
+            hasLast = true;
+            received.Reset();
+          }
+        }
+      }
+
+      if (n == SCENARIO_FRAMES) {
+        break;
+      }
+
+      clock.AdvanceTo(sendAt);
+      int frameLength = (n % (3 * FRAMES_PER_SECOND) == 0) ? (int)sizeof(frame) : 3000 + (n * 37) % 2000;
+
+      packets.clear();
+      packetiser.Packetise(frame, frameLength, n * RTP_TIMESTAMP_STEP, packets);
+
+      for (auto& packet : packets) {
+        link.Send(packet->Data(), packet->Length());
+      }
+    }
+
+    result.Digest = link.GetDigest();
+    result.Recovery = recovery.Snapshot();
+    return result;
+  }
+}
+
+MEDIA_BENCH(netem_link_send_receive)
+{
+  VirtualClock clock;
+  LinkConfig config;
+  config.DelayNanoseconds = 20 * MILLISECOND;
+  config.JitterNanoseconds = 5 * MILLISECOND;
+  config.LossRate = 0.01;
+  EmulatedLink link(clock, config);
+
+  uint8_t packet[1200];
+  memset(packet, 0xab, sizeof(packet));
+  MediaBufferPtr datagram;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    link.Send(packet, sizeof(packet));
+    clock.Advance(MILLISECOND);
+    while (link.Receive(datagram) == 1) {
+      DoNotOptimise(datagram->Data());
+    }
+  }
+
+  state.SetCounter("delivered", (double)link.GetStats().Delivered);
+}
+
+MEDIA_BENCH(netem_vp8_burst_recovery)
+{
+  ScenarioResult result;
+  bool isReplayExact = true;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    result = RunScenario(42);
+  }
+
+  state.PauseTiming();
+  isReplayExact = RunScenario(42).Digest == result.Digest && RunScenario(43).Digest != result.Digest;
+  state.ResumeTiming();
+
+  state.SetItemsProcessed(state.Iterations() * SCENARIO_FRAMES);
+  state.SetCounter("frames_complete", (double)result.FramesComplete);
+  state.SetCounter("frames_missing", (double)result.FramesMissing);
+  state.SetCounter("recovery_p50_ms", result.Recovery.P50 / 1e6);
+  state.SetCounter("recovery_p99_ms", result.Recovery.P99 / 1e6);
+  state.SetCounter("recovery_max_ms", result.Recovery.Max / 1e6);
+  state.SetCounter("replay_mismatches", (isReplayExact) ? 0.0 : 1.0);
+}
@@ -0,0 +1,103 @@
+//-----------------------------------------------------------------------------
+// Filename: NumaBench.cpp
+//
+// Description: Throughput of a thread reading frames from a buffer pool on
+// its own NUMA node compared to one on a remote node, the access pattern of
+// an encoder or SRTP stage placed on a different socket to its session's
+// buffers. On a single node host both benchmarks use the one node and the
+// remote_node counter is reported as -1.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaBuffer.h"
+#include "MediaTopology.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const size_t FRAME_SIZE = 1280 * 720 * 3 / 2;     // 720p I420.
+  const int FRAME_COUNT = 32;                       // Well beyond the last level cache.
+
+  int FirstNodeWithProcessors()
+  {
+    for (int node = 0; node < MediaTopology::GetNumaNodeCount(); node++) {
+      if (!MediaTopology::GetNodeProcessors(node).empty()) {
+        return node;
+      }
+    }
+    return 0;
+  }
+
+  std::vector<int> AllProcessors()
+  {
+    std::vector<int> processors;
+    for (int node = 0; node < MediaTopology::GetNumaNodeCount(); node++) {
+      std::vector<int> nodeProcessors = MediaTopology::GetNodeProcessors(node);
+      processors.insert(processors.end(), nodeProcessors.begin(), nodeProcessors.end());
+    }
+    return processors;
+  }
+
+  void RunFrameScan(BenchState& state, int computeNode, int memoryNode)
+  {
+    state.PauseTiming();
+
+    MediaTopology::SetThreadAffinity(MediaTopology::GetNodeProcessors(computeNode));
+    MediaBufferPool& pool = MediaBufferPool::ForNode(memoryNode);
+
+    std::vector<MediaBufferPtr> frames;
+    for (int i = 0; i < FRAME_COUNT; i++) {
+      MediaBufferPtr frame = pool.Acquire(FRAME_SIZE);
+      memset(frame->Data(), i, FRAME_SIZE);
+      frames.push_back(frame);
+    }
+
+    state.ResumeTiming();
+
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      const uint64_t* words = reinterpret_cast<const uint64_t*>(frames[i % FRAME_COUNT]->Data());
+      for (size_t w = 0; w < FRAME_SIZE / sizeof(uint64_t); w++) {
+        sum += words[w];
+      }
+    }
+    DoNotOptimise(sum);
+
+    state.PauseTiming();
+    frames.clear();
+    MediaTopology::SetThreadAffinity(AllProcessors());
+    state.ResumeTiming();
+
+    state.SetCounter("frame_bytes", (double)FRAME_SIZE);
+    state.SetCounter("numa_nodes", (double)MediaTopology::GetNumaNodeCount());
+  }
+}
+
+MEDIA_BENCH(numa_local_frame_scan)
+{
+  int node = FirstNodeWithProcessors();
+  RunFrameScan(state, node, node);
+}
+
+MEDIA_BENCH(numa_remote_frame_scan)
+{
+  int node = FirstNodeWithProcessors();
+  int remote = -1;
+  for (int candidate = 0; candidate < MediaTopology::GetNumaNodeCount(); candidate++) {
+    if (candidate != node) {
+      remote = candidate;
+      break;
+    }
+  }
+
+  RunFrameScan(state, node, (remote >= 0) ? remote : node);
+  state.SetCounter("remote_node", (double)remote);
+}
@@ -0,0 +1,166 @@
+//-----------------------------------------------------------------------------
+// Filename: SchedulerBench.cpp
+//
+// Description: Task dispatch overhead of the media scheduler and the queue
+// delay seen by audio and video tasks when the workers are saturated with
+// a mix of video and background work.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t VIDEO_TASK_NANOSECONDS = 50000;
+  const uint64_t BACKGROUND_TASK_NANOSECONDS = 100000;
+  const int MAX_OUTSTANDING_PER_WORKER = 4;
+  const int CONTEXT_COUNT = 4096;
+
+  std::atomic<uint64_t> _completed{ 0 };
+
+  void CountTask(void* context)
+  {
+    _completed.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void WaitForCompleted(uint64_t target)
+  {
+    while (_completed.load(std::memory_order_acquire) < target) {
+      std::this_thread::yield();
+    }
+  }
+
+  struct SpawnContext
+  {
+    MediaScheduler* Scheduler;
+    uint64_t Count;
+  };
+
+  void SpawnTasks(void* context)
+  {
+    SpawnContext* spawn = static_cast<SpawnContext*>(context);
+    for (uint64_t i = 0; i < spawn->Count; i++) {
+      spawn->Scheduler->Submit(CountTask, nullptr, TaskPriority::Video);
+    }
+  }
+
+  struct MixedTask
+  {
+    uint64_t SubmittedAt;
+    uint64_t WorkNanoseconds;
+    MetricHistogram* Delay;
+    std::atomic<int>* Outstanding;
+  };
+
+  void RunMixedTask(void* context)
+  {
+    MixedTask* task = static_cast<MixedTask*>(context);
+    uint64_t start = MediaScheduler::NowNanoseconds();
+    task->Delay->Record(start - task->SubmittedAt);
+
+    while (MediaScheduler::NowNanoseconds() - start < task->WorkNanoseconds) {
+    }
+    task->Outstanding->fetch_sub(1, std::memory_order_release);
+  }
+}
+
+MEDIA_BENCH(scheduler_dispatch_external)
+{
+  // Submitted from a thread that isn't a worker so every task goes through the
+  // injection queue.
+  MediaScheduler& scheduler = MediaScheduler::Default();
+  uint64_t target = _completed.load() + state.Iterations();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    scheduler.Submit(CountTask, nullptr, TaskPriority::Video);
+  }
+  WaitForCompleted(target);
+}
+
+MEDIA_BENCH(scheduler_dispatch_worker)
+{
+  // Submitted from a worker onto its own queue, the path taken by follow on work
+  // such as a packetiser task queued by an encoder task.
+  MediaScheduler& scheduler = MediaScheduler::Default();
+  uint64_t target = _completed.load() + state.Iterations();
+
+  SpawnContext spawn = { &scheduler, state.Iterations() };
+  scheduler.Submit(SpawnTasks, &spawn, TaskPriority::Video);
+  WaitForCompleted(target);
+}
+
+MEDIA_BENCH(scheduler_parallel_for)
+{
+  MediaScheduler& scheduler = MediaScheduler::Default();
+  std::atomic<uint64_t> total{ 0 };
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    scheduler.ParallelFor(8, [](void* context, int index) {
+      static_cast<std::atomic<uint64_t>*>(context)->fetch_add((uint64_t)index, std::memory_order_relaxed);
+    }, &total, TaskPriority::Video);
+  }
+  DoNotOptimise(total.load());
+}
+
+MEDIA_BENCH(scheduler_mixed_latency)
+{
+  // Each iteration queues an audio task, two 50us video tasks and four 100us
+  // background tasks, keeping the workers saturated. Audio tasks should only wait
+  // for a worker to finish its current task.
+  MediaScheduler& scheduler = MediaScheduler::Default();
+  int maxOutstanding = scheduler.GetWorkerCount() * MAX_OUTSTANDING_PER_WORKER + 7;
+
+  std::unique_ptr<MetricHistogram> audioDelay(new MetricHistogram());
+  std::unique_ptr<MetricHistogram> videoDelay(new MetricHistogram());
+  std::unique_ptr<MetricHistogram> backgroundDelay(new MetricHistogram());
+  std::unique_ptr<MixedTask[]> tasks(new MixedTask[CONTEXT_COUNT]);
+  std::atomic<int> outstanding{ 0 };
+  int next = 0;
+
+  auto submit = [&](TaskPriority priority, uint64_t work, MetricHistogram* delay) {
+    MixedTask& task = tasks[next++ % CONTEXT_COUNT];
+    task.SubmittedAt = MediaScheduler::NowNanoseconds();
+    task.WorkNanoseconds = work;
+    task.Delay = delay;
+    task.Outstanding = &outstanding;
+    outstanding.fetch_add(1, std::memory_order_relaxed);
+    scheduler.Submit(RunMixedTask, &task, priority);
+  };
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    while (outstanding.load(std::memory_order_acquire) > maxOutstanding) {
+      std::this_thread::yield();
+    }
+
+    submit(TaskPriority::Audio, 0, audioDelay.get());
+    for (int v = 0; v < 2; v++) {
+      submit(TaskPriority::Video, VIDEO_TASK_NANOSECONDS, videoDelay.get());
+    }
+    for (int b = 0; b < 4; b++) {
+      submit(TaskPriority::Background, BACKGROUND_TASK_NANOSECONDS, backgroundDelay.get());
+    }
+  }
+
+  while (outstanding.load(std::memory_order_acquire) > 0) {
+    std::this_thread::yield();
+  }
+
+  MetricHistogramSnapshot audio = audioDelay->Snapshot();
+  MetricHistogramSnapshot video = videoDelay->Snapshot();
+  MetricHistogramSnapshot background = backgroundDelay->Snapshot();
+  state.SetCounter("audio_delay_p50_ns", (double)audio.P50);
+  state.SetCounter("audio_delay_p99_ns", (double)audio.P99);
+  state.SetCounter("video_delay_p99_ns", (double)video.P99);
+  state.SetCounter("background_delay_p99_ns", (double)background.P99);
+}
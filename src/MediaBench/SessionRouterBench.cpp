@@ -0,0 +1,388 @@
+//-----------------------------------------------------------------------------
+// Filename: SessionRouterBench.cpp
+//
+// Description: The cost of routing a datagram to its session with 100k
+// sessions sharing a socket. Half the lookups hit on the 5-tuple and half
+// come from an address that isn't mapped and fall back to the RTP SSRC.
+// The churn benchmarks keep replacing sessions on another thread, removing
+// their entries, retiring the old session and adding a new one, while the
+// benchmark thread and any other readers route. The same routing and churn
+// against std::unordered_map behind a mutex is the comparison.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaScheduler.h"
+#include "SessionRouter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int SESSION_COUNT = 100000;
+  const int LOOKUP_ORDER_LENGTH = 1 << 16;
+  const int CHURN_PER_MILLISECOND = 10;
+  const int MAX_EXTRA_READERS = 3;
+  const uint64_t SESSION_ALIVE = 0x53455353494f4e31ULL;
+  const uint8_t PROTOCOL_UDP = 17;
+
+  struct BenchSession
+  {
+    uint64_t Magic = SESSION_ALIVE;
+    int Index = 0;
+  };
+
+  void DestroySession(void* session)
+  {
+    BenchSession* benchSession = static_cast<BenchSession*>(session);
+    benchSession->Magic = 0;
+    delete benchSession;
+  }
+
+  FiveTuple MakeTuple(uint32_t sourceAddress, uint16_t sourcePort)
+  {
+    FiveTuple tuple;
+    tuple.Protocol = PROTOCOL_UDP;
+    tuple.SourcePort = sourcePort;
+    tuple.DestinationPort = 5000;
+    uint8_t destination[4] = { 192, 0, 2, 1 };
+    uint8_t source[4] = { (uint8_t)(sourceAddress >> 24), (uint8_t)(sourceAddress >> 16), (uint8_t)(sourceAddress >> 8), (uint8_t)sourceAddress };
+    tuple.SourceAddress[10] = tuple.SourceAddress[11] = 0xff;
+    tuple.DestinationAddress[10] = tuple.DestinationAddress[11] = 0xff;
+    memcpy(tuple.SourceAddress + 12, source, 4);
+    memcpy(tuple.DestinationAddress + 12, destination, 4);
+    return tuple;
+  }
+
+  /**
+  * The keys of every session and the datagrams routed to them. The keys never change,
+  * churn replaces the session behind them.
+  */
+  struct Workload
+  {
+    std::vector<FiveTuple> Tuples;
+    std::vector<FiveTuple> ReboundTuples;     // The same peer after a NAT rebinding, not mapped.
+    std::vector<uint32_t> Ssrcs;
+    std::vector<uint8_t> RtpHeaders;          // 12 bytes a session.
+    std::vector<int> Order;
+
+    Workload()
+    {
+      std::mt19937 random(7);
+      for (int i = 0; i < SESSION_COUNT; i++) {
+        uint32_t address = 0x0a000000 | (uint32_t)i;
+        Tuples.push_back(MakeTuple(address, (uint16_t)(10000 + i % 50000)));
+        ReboundTuples.push_back(MakeTuple(address, (uint16_t)(60000 + i % 5000)));
+
+        // An odd multiplier keeps the SSRCs distinct.
+        uint32_t ssrc = (uint32_t)i * 2654435761u;
+        Ssrcs.push_back(ssrc);
+        uint8_t header[12] = { 0x80, 96, 0, 0, 0, 0, 0, 0,
+          (uint8_t)(ssrc >> 24), (uint8_t)(ssrc >> 16), (uint8_t)(ssrc >> 8), (uint8_t)ssrc };
+        RtpHeaders.insert(RtpHeaders.end(), header, header + sizeof(header));
+      }
+
+      for (int i = 0; i < LOOKUP_ORDER_LENGTH; i++) {
+        Order.push_back((int)(random() % SESSION_COUNT));
+      }
+    }
+
+    const FiveTuple& TupleFor(uint64_t lookup, int index) const
+    {
+      return (lookup & 1) ? ReboundTuples[index] : Tuples[index];
+    }
+
+    const uint8_t* RtpHeader(int index) const { return &RtpHeaders[(size_t)index * 12]; }
+  };
+
+  const Workload& GetWorkload()
+  {
+    static Workload workload;
+    return workload;
+  }
+
+  struct TupleHash
+  {
+    size_t operator()(const FiveTuple& tuple) const
+    {
+      uint64_t hash = 14695981039346656037ULL;
+      const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&tuple);
+      for (size_t i = 0; i < sizeof(FiveTuple); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+      }
+      return (size_t)hash;
+    }
+  };
+
+  /**
+  * The comparison, the same maps behind one mutex.
+  */
+  struct MutexRouter
+  {
+    std::mutex Lock;
+    std::unordered_map<FiveTuple, BenchSession*, TupleHash> Addresses;
+    std::unordered_map<uint32_t, BenchSession*> Ssrcs;
+
+    ~MutexRouter()
+    {
+      for (auto& entry : Addresses) {
+        DestroySession(entry.second);
+      }
+    }
+  };
+
+  struct ChurnCounters
+  {
+    std::atomic<bool> IsStopping{ false };
+    std::atomic<uint64_t> Replaced{ 0 };
+    std::atomic<uint64_t> Misses{ 0 };
+    std::atomic<uint64_t> StaleSessions{ 0 };
+  };
+
+  /**
+  * Runs a churn function CHURN_PER_MILLISECOND times a millisecond until stopped.
+  */
+  template<typename Replace>
+  void Churn(ChurnCounters& counters, Replace replace)
+  {
+    std::mt19937 random(11);
+    auto next = std::chrono::steady_clock::now();
+    while (!counters.IsStopping.load(std::memory_order_relaxed)) {
+      for (int i = 0; i < CHURN_PER_MILLISECOND; i++) {
+        replace((int)(random() % SESSION_COUNT));
+        counters.Replaced.fetch_add(1, std::memory_order_relaxed);
+      }
+      next += std::chrono::milliseconds(1);
+      std::this_thread::sleep_until(next);
+    }
+  }
+
+  int ExtraReaderCount()
+  {
+    int processors = (int)std::thread::hardware_concurrency();
+    return std::max(0, std::min(MAX_EXTRA_READERS, processors - 2));
+  }
+
+  /**
+  * Routes one datagram on the lock-free router and checks the session is still alive.
+  */
+  void RouteLockFree(const SessionRouter& router, const Workload& workload, uint64_t lookup, ChurnCounters& counters)
+  {
+    int index = workload.Order[lookup % LOOKUP_ORDER_LENGTH];
+    SessionRouter::ReadScope scope(router);
+    BenchSession* session = static_cast<BenchSession*>(router.Route(workload.TupleFor(lookup, index), workload.RtpHeader(index), 12));
+    if (session == nullptr) {
+      counters.Misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (session->Magic != SESSION_ALIVE || session->Index != index) {
+      counters.StaleSessions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void RouteMutex(MutexRouter& router, const Workload& workload, uint64_t lookup, ChurnCounters& counters)
+  {
+    int index = workload.Order[lookup % LOOKUP_ORDER_LENGTH];
+    std::lock_guard<std::mutex> lock(router.Lock);
+    BenchSession* session = nullptr;
+    auto address = router.Addresses.find(workload.TupleFor(lookup, index));
+    if (address != router.Addresses.end()) {
+      session = address->second;
+    }
+    else {
+      auto ssrc = router.Ssrcs.find(workload.Ssrcs[index]);
+      if (ssrc != router.Ssrcs.end()) {
+        session = ssrc->second;
+      }
+    }
+
+    if (session == nullptr) {
+      counters.Misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (session->Magic != SESSION_ALIVE || session->Index != index) {
+      counters.StaleSessions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void FillLockFree(SessionRouter& router, const Workload& workload)
+  {
+    for (int i = 0; i < SESSION_COUNT; i++) {
+      BenchSession* session = new BenchSession();
+      session->Index = i;
+      router.AddAddress(workload.Tuples[i], session);
+      router.AddSsrc(workload.Ssrcs[i], session);
+    }
+  }
+
+  void DestroyLockFreeSessions(SessionRouter& router, const Workload& workload)
+  {
+    for (int i = 0; i < SESSION_COUNT; i++) {
+      void* session = router.LookupAddress(workload.Tuples[i]);
+      if (session != nullptr) {
+        router.RemoveAddress(workload.Tuples[i]);
+        router.RemoveSsrc(workload.Ssrcs[i]);
+        router.Retire(session, DestroySession);
+      }
+    }
+  }
+
+  void FillMutex(MutexRouter& router, const Workload& workload)
+  {
+    for (int i = 0; i < SESSION_COUNT; i++) {
+      BenchSession* session = new BenchSession();
+      session->Index = i;
+      router.Addresses[workload.Tuples[i]] = session;
+      router.Ssrcs[workload.Ssrcs[i]] = session;
+    }
+  }
+
+  void SetChurnCounters(BenchState& state, ChurnCounters& counters, int extraReaders, double seconds)
+  {
+    state.SetCounter("churn_per_second", seconds > 0 ? counters.Replaced.load() / seconds : 0);
+    state.SetCounter("misses", (double)counters.Misses.load());
+    state.SetCounter("stale_sessions", (double)counters.StaleSessions.load());
+    state.SetCounter("extra_readers", extraReaders);
+  }
+}
+
+MEDIA_BENCH(session_router_lookup_100k)
+{
+  state.PauseTiming();
+
+  const Workload& workload = GetWorkload();
+  SessionRouter router(SESSION_COUNT);
+  FillLockFree(router, workload);
+  ChurnCounters counters;
+
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    RouteLockFree(router, workload, i, counters);
+  }
+
+  state.PauseTiming();
+
+  state.SetCounter("misses", (double)counters.Misses.load());
+  DestroyLockFreeSessions(router, workload);
+}
+
+MEDIA_BENCH(session_router_lookup_100k_churn)
+{
+  state.PauseTiming();
+
+  const Workload& workload = GetWorkload();
+  SessionRouter router(SESSION_COUNT);
+  FillLockFree(router, workload);
+  ChurnCounters counters;
+
+  // The churn thread is the only writer, so the lookup before removing is safe.
+  std::thread churn([&]() {
+    Churn(counters, [&](int index) {
+      void* old = router.LookupAddress(workload.Tuples[index]);
+      router.RemoveAddress(workload.Tuples[index]);
+      router.RemoveSsrc(workload.Ssrcs[index]);
+      router.Retire(old, DestroySession);
+
+      BenchSession* session = new BenchSession();
+      session->Index = index;
+      router.AddAddress(workload.Tuples[index], session);
+      router.AddSsrc(workload.Ssrcs[index], session);
+    });
+  });
+
+  int extraReaders = ExtraReaderCount();
+  std::vector<std::thread> readers;
+  for (int r = 0; r < extraReaders; r++) {
+    readers.emplace_back([&, r]() {
+      for (uint64_t i = (uint64_t)r * 7919; !counters.IsStopping.load(std::memory_order_relaxed); i++) {
+        RouteLockFree(router, workload, i, counters);
+      }
+    });
+  }
+
+  uint64_t start = MediaScheduler::NowNanoseconds();
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    RouteLockFree(router, workload, i, counters);
+  }
+
+  state.PauseTiming();
+  double seconds = (MediaScheduler::NowNanoseconds() - start) / 1e9;
+
+  counters.IsStopping.store(true);
+  churn.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+
+  SetChurnCounters(state, counters, extraReaders, seconds);
+  state.SetCounter("grace_periods", (double)router.GetStats().GracePeriods);
+  DestroyLockFreeSessions(router, workload);
+}
+
+MEDIA_BENCH(session_router_lookup_100k_churn_mutex_map)
+{
+  state.PauseTiming();
+
+  const Workload& workload = GetWorkload();
+  std::unique_ptr<MutexRouter> router(new MutexRouter());
+  FillMutex(*router, workload);
+  ChurnCounters counters;
+
+  std::thread churn([&]() {
+    Churn(counters, [&](int index) {
+      std::lock_guard<std::mutex> lock(router->Lock);
+      BenchSession* old = router->Addresses[workload.Tuples[index]];
+      router->Addresses.erase(workload.Tuples[index]);
+      router->Ssrcs.erase(workload.Ssrcs[index]);
+      DestroySession(old);
+
+      BenchSession* session = new BenchSession();
+      session->Index = index;
+      router->Addresses[workload.Tuples[index]] = session;
+      router->Ssrcs[workload.Ssrcs[index]] = session;
+    });
+  });
+
+  int extraReaders = ExtraReaderCount();
+  std::vector<std::thread> readers;
+  for (int r = 0; r < extraReaders; r++) {
+    readers.emplace_back([&, r]() {
+      for (uint64_t i = (uint64_t)r * 7919; !counters.IsStopping.load(std::memory_order_relaxed); i++) {
+        RouteMutex(*router, workload, i, counters);
+      }
+    });
+  }
+
+  uint64_t start = MediaScheduler::NowNanoseconds();
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    RouteMutex(*router, workload, i, counters);
+  }
+
+  state.PauseTiming();
+  double seconds = (MediaScheduler::NowNanoseconds() - start) / 1e9;
+
+  counters.IsStopping.store(true);
+  churn.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+
+  SetChurnCounters(state, counters, extraReaders, seconds);
+}
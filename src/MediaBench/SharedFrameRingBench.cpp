@@ -0,0 +1,205 @@
+//-----------------------------------------------------------------------------
+// Filename: SharedFrameRingBench.cpp
+//
+// Description: Passing 640x480 I420 frames from this process to a second
+// one, through a SharedFrameRing and, for comparison, through a pipe. The
+// producer copies a prepared image into each frame as the stage writing it
+// would, the consumer reads every cache line of it. The time includes the
+// consumer getting through the last frame.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+#include "SharedFrameRing.h"
+
+#include <chrono>
+#include <memory>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int WIDTH = 640;
+  const int HEIGHT = 480;
+  const int FRAME_LENGTH = WIDTH * HEIGHT * 3 / 2;
+  const int SLOT_COUNT = 8;
+  const int CACHE_LINE = 64;
+  const int CONSUMER_TIMEOUT_MILLISECONDS = 10000;
+  const uint64_t END_ID = UINT64_MAX;
+
+  struct PipeFrameHeader
+  {
+    uint64_t Id;
+    uint64_t Length;
+  };
+
+  std::vector<uint8_t> TestImage()
+  {
+    std::vector<uint8_t> i420(FRAME_LENGTH);
+    for (size_t i = 0; i < i420.size(); i++) {
+      i420[i] = (uint8_t)(i * 7 + (i >> 9));
+    }
+    return i420;
+  }
+
+  uint8_t ReadFrame(const uint8_t* data, int length)
+  {
+    uint8_t sum = 0;
+    for (int i = 0; i < length; i += CACHE_LINE) {
+      sum += data[i];
+    }
+    return sum;
+  }
+}
+
+MEDIA_BENCH_CHILD(shm_ring_consumer)
+{
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  std::unique_ptr<SharedFrameRing> ring(SharedFrameRing::Open(argument));
+  if (!ring) {
+    return 1;
+  }
+
+  SharedFrame frame;
+  uint8_t sum = 0;
+  while (ring->Receive(frame, CONSUMER_TIMEOUT_MILLISECONDS) == 0) {
+    uint64_t id = frame.Id;
+    sum += ReadFrame(frame.Data, frame.Length);
+    ring->Release(frame);
+
+    if (id == END_ID) {
+      break;
+    }
+  }
+
+  DoNotOptimise(sum);
+  return 0;
+}
+
+MEDIA_BENCH(shm_ring_i420_640x480_two_process)
+{
+  state.PauseTiming();
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  std::vector<uint8_t> image = TestImage();
+
+  SharedFrameRingConfig config;
+  config.Width = WIDTH;
+  config.Height = HEIGHT;
+  config.SlotCount = SLOT_COUNT;
+
+  std::unique_ptr<SharedFrameRing> ring(SharedFrameRing::Create(config));
+  BenchChildProcess consumer;
+  if (!ring || consumer.Start("shm_ring_consumer", ring->GetName()) != 0) {
+    return;
+  }
+
+  // A first frame is passed before the timing starts so the consumer's process start
+  // up isn't counted.
+  SharedFrame frame;
+  ring->Acquire(frame);
+  frame.Id = 0;
+  ring->Publish(frame);
+
+  uint64_t startDeadline = MediaScheduler::NowNanoseconds() + CONSUMER_TIMEOUT_MILLISECONDS * 1000000ULL;
+  while (ring->GetStats().FramesReceived == 0) {
+    if (MediaScheduler::NowNanoseconds() > startDeadline) {
+      SIPSM_LOG_ERROR("The shared frame ring consumer didn't start.");
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ring->ClearStats();
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations() + 1; i++) {
+    ring->Acquire(frame);
+    bool isEnd = (i == state.Iterations());
+    frame.Id = (isEnd) ? END_ID : i;
+    frame.Width = WIDTH;
+    frame.Height = HEIGHT;
+    frame.Length = (isEnd) ? 0 : FRAME_LENGTH;
+    memcpy(frame.Data, image.data(), frame.Length);
+    ring->Publish(frame);
+  }
+
+  int exitCode = consumer.Wait();
+  state.PauseTiming();
+
+  if (exitCode != 0) {
+    SIPSM_LOG_ERROR("The shared frame ring consumer exited with %d.", exitCode);
+  }
+
+  SharedFrameRingStats stats = ring->GetStats();
+  state.SetCounter("latency_mean_us", (stats.FramesReceived > 0) ?
+    (double)stats.LatencyTotalNanoseconds / stats.FramesReceived / 1000 : 0);
+  state.SetCounter("latency_max_us", (double)stats.LatencyMaxNanoseconds / 1000);
+  state.SetCounter("megabytes_per_second", (double)FRAME_LENGTH * state.Iterations() /
+    ((double)state.Elapsed().count() / 1e9) / 1e6);
+}
+
+MEDIA_BENCH_CHILD(pipe_consumer)
+{
+  std::vector<uint8_t> buffer(FRAME_LENGTH);
+  PipeFrameHeader header;
+  uint8_t sum = 0;
+
+  while (BenchChildProcess::ReadInput(&header, sizeof(header)) == 0 && header.Id != END_ID) {
+    if (header.Length > buffer.size() || BenchChildProcess::ReadInput(buffer.data(), (size_t)header.Length) != 0) {
+      return 1;
+    }
+    sum += ReadFrame(buffer.data(), (int)header.Length);
+  }
+
+  DoNotOptimise(sum);
+  return 0;
+}
+
+MEDIA_BENCH(pipe_i420_640x480_two_process)
+{
+  state.PauseTiming();
+
+  std::vector<uint8_t> image = TestImage();
+
+  BenchChildProcess consumer;
+  if (consumer.Start("pipe_consumer", "-", true) != 0) {
+    return;
+  }
+
+  // Unlike the ring the consumer can't say it's ready, its start up is timed but is
+  // small next to the minimum run time.
+  state.ResumeTiming();
+
+  PipeFrameHeader header;
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    header.Id = i;
+    header.Length = FRAME_LENGTH;
+    if (consumer.Write(&header, sizeof(header)) != 0 || consumer.Write(image.data(), image.size()) != 0) {
+      break;
+    }
+  }
+
+  header.Id = END_ID;
+  header.Length = 0;
+  consumer.Write(&header, sizeof(header));
+
+  int exitCode = consumer.Wait();
+  state.PauseTiming();
+
+  if (exitCode != 0) {
+    SIPSM_LOG_ERROR("The pipe consumer exited with %d.", exitCode);
+  }
+
+  state.SetCounter("megabytes_per_second", (double)FRAME_LENGTH * state.Iterations() /
+    ((double)state.Elapsed().count() / 1e9) / 1e6);
+}
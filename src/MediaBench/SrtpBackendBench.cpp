@@ -0,0 +1,142 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpBackendBench.cpp
+//
+// Description: Packets per second protecting and unprotecting 1200 byte video
+// packets with libsrtp, using whatever crypto it was built with, and with
+// the OpenSSL EVP transform. The libsrtp_backend counter says which libsrtp
+// was measured, the speed up is largest against its internal AES.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+#include "SrtpNative.h"
+
+#include <memory>
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t INPUT_SEED = 20261018;
+  const int VIDEO_PAYLOAD_LENGTH = 1200;
+  const int PACKET_CAPACITY = RTP_HEADER_LENGTH + VIDEO_PAYLOAD_LENGTH + SRTP_MAX_TRAILER_LEN;
+  const uint32_t VIDEO_SSRC = 0x5eed0002;
+
+  /**
+  * The packets protected ahead, untimed, for the unprotect benchmarks.
+  */
+  const int PREPARED_PACKETS = 256;
+
+  /**
+  * A sending and a receiving session on one backend. Turning off the OpenSSL
+  * preference only affects the sessions created while it is off.
+  */
+  struct Sessions
+  {
+    SrtpNative Sender;
+    SrtpNative Receiver;
+
+    explicit Sessions(bool isOpenSsl)
+    {
+      MediaLog::SetLevel(LogLevel::Warning);
+      SrtpNative::InitialiseLibSrtp();
+
+      uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+      FillRandom(key, sizeof(key), INPUT_SEED);
+
+      SrtpNative::SetOpenSslPreferred(isOpenSsl);
+      Sender.SetNativeTransform(isOpenSsl);
+      Receiver.SetNativeTransform(isOpenSsl);
+      Sender.InitWithKey(key, sizeof(key), true);
+      Receiver.InitWithKey(key, sizeof(key), false);
+      SrtpNative::SetOpenSslPreferred(false);
+    }
+  };
+
+  void SetBackendCounters(BenchState& state)
+  {
+    SrtpCryptoInfo info = SrtpNative::GetCryptoInfo();
+    state.SetCounter("libsrtp_backend", (double)info.LibSrtp);
+    state.SetCounter("aes_ni", (info.IsAesNi) ? 1.0 : 0.0);
+  }
+
+  void RunProtect(BenchState& state, bool isOpenSsl)
+  {
+    Sessions sessions(isOpenSsl);
+
+    uint8_t payload[VIDEO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED + 1);
+    uint8_t packet[PACKET_CAPACITY];
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      WriteRtpHeader(packet, 96, (uint16_t)i, 0, VIDEO_SSRC);
+      memcpy(packet + RTP_HEADER_LENGTH, payload, VIDEO_PAYLOAD_LENGTH);
+      int outLength = 0;
+      sessions.Sender.ProtectRTP(packet, RTP_HEADER_LENGTH + VIDEO_PAYLOAD_LENGTH, &outLength);
+      DoNotOptimise(outLength);
+    }
+
+    state.SetItemsProcessed(state.Iterations());
+    SetBackendCounters(state);
+  }
+
+  void RunUnprotect(BenchState& state, bool isOpenSsl)
+  {
+    Sessions sessions(isOpenSsl);
+
+    uint8_t payload[VIDEO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED + 1);
+    std::vector<uint8_t> buffers(PREPARED_PACKETS * PACKET_CAPACITY);
+    std::unique_ptr<int[]> lengths(new int[PREPARED_PACKETS]);
+    uint64_t failures = 0;
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      int prepared = (int)(i % PREPARED_PACKETS);
+
+      if (prepared == 0) {
+        state.PauseTiming();
+        for (int p = 0; p < PREPARED_PACKETS; p++) {
+          uint8_t* packet = buffers.data() + p * PACKET_CAPACITY;
+          WriteRtpHeader(packet, 96, (uint16_t)(i + p), 0, VIDEO_SSRC);
+          memcpy(packet + RTP_HEADER_LENGTH, payload, VIDEO_PAYLOAD_LENGTH);
+          sessions.Sender.ProtectRTP(packet, RTP_HEADER_LENGTH + VIDEO_PAYLOAD_LENGTH, &lengths[p]);
+        }
+        state.ResumeTiming();
+      }
+
+      int outLength = 0;
+      int res = sessions.Receiver.UnprotectRTP(buffers.data() + prepared * PACKET_CAPACITY, lengths[prepared], &outLength);
+      failures += (res != srtp_err_status_ok) ? 1 : 0;
+    }
+
+    state.SetItemsProcessed(state.Iterations());
+    state.SetCounter("failures", (double)failures);
+    SetBackendCounters(state);
+  }
+}
+
+MEDIA_BENCH(srtp_backend_protect_video_libsrtp)
+{
+  RunProtect(state, false);
+}
+
+MEDIA_BENCH(srtp_backend_protect_video_openssl)
+{
+  RunProtect(state, true);
+}
+
+MEDIA_BENCH(srtp_backend_unprotect_video_libsrtp)
+{
+  RunUnprotect(state, false);
+}
+
+MEDIA_BENCH(srtp_backend_unprotect_video_openssl)
+{
+  RunUnprotect(state, true);
+}
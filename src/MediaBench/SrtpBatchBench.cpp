@@ -0,0 +1,190 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpBatchBench.cpp
+//
+// Description: Packets per second protecting and unprotecting 20ms audio
+// packets for eight sessions, as an SFU forwarding one packet to eight
+// peers does. Compares libsrtp a packet at a time, the native transform a
+// packet at a time and the native transform batching the eight packets
+// through the multi-buffer kernels.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+#include "SrtpKeystream.h"
+#include "SrtpMultiBuffer.h"
+#include "SrtpNative.h"
+
+#include <memory>
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t INPUT_SEED = 20261018;
+  const int AUDIO_PAYLOAD_LENGTH = 160;
+  const int SESSION_COUNT = 8;
+  const int PACKET_CAPACITY = RTP_HEADER_LENGTH + AUDIO_PAYLOAD_LENGTH + SRTP_MAX_TRAILER_LEN;
+
+  /**
+  * The packets protected ahead, untimed, for the unprotect benchmarks.
+  */
+  const int PREPARED_ROUNDS = 64;
+
+  enum class Mode { LibSrtp, Native, NativeBatch };
+
+  /**
+  * A sending and a receiving session for each peer, each peer with its own key.
+  */
+  struct Sessions
+  {
+    SrtpNative Senders[SESSION_COUNT];
+    SrtpNative Receivers[SESSION_COUNT];
+    SrtpNative* SenderPointers[SESSION_COUNT];
+    SrtpNative* ReceiverPointers[SESSION_COUNT];
+
+    explicit Sessions(Mode mode)
+    {
+      MediaLog::SetLevel(LogLevel::Warning);
+      SrtpNative::InitialiseLibSrtp();
+
+      for (int s = 0; s < SESSION_COUNT; s++) {
+        uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+        FillRandom(key, sizeof(key), INPUT_SEED + s);
+        Senders[s].SetNativeTransform(mode != Mode::LibSrtp);
+        Receivers[s].SetNativeTransform(mode != Mode::LibSrtp);
+        Senders[s].InitWithKey(key, sizeof(key), true);
+        Receivers[s].InitWithKey(key, sizeof(key), false);
+        SenderPointers[s] = &Senders[s];
+        ReceiverPointers[s] = &Receivers[s];
+      }
+    }
+  };
+
+  void Protect(Sessions& sessions, Mode mode, SrtpBatchPacket* packets)
+  {
+    if (mode == Mode::NativeBatch) {
+      SrtpNative::ProtectRTPBatch(sessions.SenderPointers, packets, SESSION_COUNT);
+    }
+    else {
+      for (int s = 0; s < SESSION_COUNT; s++) {
+        packets[s].Status = sessions.Senders[s].ProtectRTP(packets[s].Buffer, packets[s].Length, &packets[s].OutLength);
+      }
+    }
+  }
+
+  void Unprotect(Sessions& sessions, Mode mode, SrtpBatchPacket* packets)
+  {
+    if (mode == Mode::NativeBatch) {
+      SrtpNative::UnprotectRTPBatch(sessions.ReceiverPointers, packets, SESSION_COUNT);
+    }
+    else {
+      for (int s = 0; s < SESSION_COUNT; s++) {
+        packets[s].Status = sessions.Receivers[s].UnprotectRTP(packets[s].Buffer, packets[s].Length, &packets[s].OutLength);
+      }
+    }
+  }
+
+  void RunProtect(BenchState& state, Mode mode)
+  {
+    Sessions sessions(mode);
+
+    uint8_t payload[AUDIO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED + SESSION_COUNT);
+    std::vector<uint8_t> buffers(SESSION_COUNT * PACKET_CAPACITY);
+    SrtpBatchPacket packets[SESSION_COUNT];
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      for (int s = 0; s < SESSION_COUNT; s++) {
+        uint8_t* packet = buffers.data() + s * PACKET_CAPACITY;
+        WriteRtpHeader(packet, 0, (uint16_t)i, 0, (uint32_t)s + 1);
+        memcpy(packet + RTP_HEADER_LENGTH, payload, AUDIO_PAYLOAD_LENGTH);
+        packets[s] = SrtpBatchPacket{ packet, RTP_HEADER_LENGTH + AUDIO_PAYLOAD_LENGTH, 0, 0 };
+      }
+
+      Protect(sessions, mode, packets);
+      DoNotOptimise(packets[SESSION_COUNT - 1].OutLength);
+    }
+
+    state.SetItemsProcessed(state.Iterations() * SESSION_COUNT);
+  }
+
+  void RunUnprotect(BenchState& state, Mode mode)
+  {
+    Sessions sessions(mode);
+
+    uint8_t payload[AUDIO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED + SESSION_COUNT);
+    std::vector<uint8_t> buffers(PREPARED_ROUNDS * SESSION_COUNT * PACKET_CAPACITY);
+    std::unique_ptr<SrtpBatchPacket[]> packets(new SrtpBatchPacket[PREPARED_ROUNDS * SESSION_COUNT]);
+    uint64_t failures = 0;
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      int round = (int)(i % PREPARED_ROUNDS);
+      SrtpBatchPacket* roundPackets = packets.get() + round * SESSION_COUNT;
+
+      if (round == 0) {
+        state.PauseTiming();
+        for (int r = 0; r < PREPARED_ROUNDS; r++) {
+          for (int s = 0; s < SESSION_COUNT; s++) {
+            uint8_t* packet = buffers.data() + (r * SESSION_COUNT + s) * PACKET_CAPACITY;
+            WriteRtpHeader(packet, 0, (uint16_t)(i + r), 0, (uint32_t)s + 1);
+            memcpy(packet + RTP_HEADER_LENGTH, payload, AUDIO_PAYLOAD_LENGTH);
+            SrtpBatchPacket& batchPacket = packets[r * SESSION_COUNT + s];
+            batchPacket = SrtpBatchPacket{ packet, RTP_HEADER_LENGTH + AUDIO_PAYLOAD_LENGTH, 0, 0 };
+          }
+          Protect(sessions, Mode::Native, packets.get() + r * SESSION_COUNT);
+          for (int s = 0; s < SESSION_COUNT; s++) {
+            SrtpBatchPacket& batchPacket = packets[r * SESSION_COUNT + s];
+            batchPacket.Length = batchPacket.OutLength;
+          }
+        }
+        state.ResumeTiming();
+      }
+
+      Unprotect(sessions, mode, roundPackets);
+      for (int s = 0; s < SESSION_COUNT; s++) {
+        failures += (roundPackets[s].Status != srtp_err_status_ok) ? 1 : 0;
+      }
+    }
+
+    state.SetItemsProcessed(state.Iterations() * SESSION_COUNT);
+    state.SetCounter("failures", (double)failures);
+    state.SetCounter("multi_buffer", SrtpMultiBuffer::IsSupported() ? 1.0 : 0.0);
+  }
+}
+
+MEDIA_BENCH(srtp_protect_8_sessions_libsrtp)
+{
+  RunProtect(state, Mode::LibSrtp);
+}
+
+MEDIA_BENCH(srtp_protect_8_sessions_native)
+{
+  RunProtect(state, Mode::Native);
+}
+
+MEDIA_BENCH(srtp_protect_8_sessions_batch)
+{
+  RunProtect(state, Mode::NativeBatch);
+}
+
+MEDIA_BENCH(srtp_unprotect_8_sessions_libsrtp)
+{
+  RunUnprotect(state, Mode::LibSrtp);
+}
+
+MEDIA_BENCH(srtp_unprotect_8_sessions_native)
+{
+  RunUnprotect(state, Mode::Native);
+}
+
+MEDIA_BENCH(srtp_unprotect_8_sessions_batch)
+{
+  RunUnprotect(state, Mode::NativeBatch);
+}
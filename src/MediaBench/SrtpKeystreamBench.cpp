@@ -0,0 +1,119 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpKeystreamBench.cpp
+//
+// Description: Per packet latency of protecting 20ms G.711 audio packets
+// with libsrtp, with the OpenSSL transform computing the keystream inline
+// and with the keystream precomputed between packets. The precompute runs
+// outside the timed region, as it would in the scheduler's idle time.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+#include "SrtpKeystream.h"
+#include "SrtpNative.h"
+
+#include <memory>
+#include <string.h>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t INPUT_SEED = 20261018;
+  const int AUDIO_PAYLOAD_LENGTH = 160;
+  const int PRECOMPUTE_PACKETS = 64;
+  const uint32_t AUDIO_SSRC = 0x5eed0001;
+
+  /**
+  * Protects a stream of audio packets, timing each one, and reports the latency
+  * percentiles. Every half cache of packets the keystream is precomputed, untimed.
+  */
+  template <typename Protect, typename Precompute>
+  void RunAudioProtect(BenchState& state, Protect protect, Precompute precompute)
+  {
+    std::unique_ptr<MetricHistogram> latency(new MetricHistogram());
+
+    uint8_t payload[AUDIO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED + 1);
+    uint8_t packet[RTP_HEADER_LENGTH + AUDIO_PAYLOAD_LENGTH + SRTP_MAX_TRAILER_LEN];
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      if (i % (PRECOMPUTE_PACKETS / 2) == 0) {
+        state.PauseTiming();
+        precompute();
+        state.ResumeTiming();
+      }
+
+      WriteRtpHeader(packet, 0, (uint16_t)i, (uint32_t)i * AUDIO_PAYLOAD_LENGTH, AUDIO_SSRC);
+      memcpy(packet + RTP_HEADER_LENGTH, payload, sizeof(payload));
+
+      int outLength = 0;
+      uint64_t start = MediaScheduler::NowNanoseconds();
+      protect(packet, RTP_HEADER_LENGTH + AUDIO_PAYLOAD_LENGTH, &outLength);
+      latency->Record(MediaScheduler::NowNanoseconds() - start);
+      DoNotOptimise(outLength);
+    }
+
+    MetricHistogramSnapshot snapshot = latency->Snapshot();
+    state.SetCounter("protect_p50_ns", (double)snapshot.P50);
+    state.SetCounter("protect_p99_ns", (double)snapshot.P99);
+    state.SetCounter("protect_p999_ns", (double)snapshot.P999);
+  }
+
+  void MakeKey(uint8_t* key)
+  {
+    FillRandom(key, SrtpNative::SRTP_MASTER_KEY_LEN, INPUT_SEED);
+  }
+}
+
+MEDIA_BENCH(srtp_protect_audio_libsrtp)
+{
+  MediaLog::SetLevel(LogLevel::Warning);
+  SrtpNative::InitialiseLibSrtp();
+
+  uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+  MakeKey(key);
+  SrtpNative sender;
+  sender.InitWithKey(key, sizeof(key), true);
+
+  RunAudioProtect(state,
+    [&](uint8_t* packet, int length, int* outLength) { sender.ProtectRTP(packet, length, outLength); },
+    [] {});
+}
+
+MEDIA_BENCH(srtp_protect_audio_inline)
+{
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+  MakeKey(key);
+  SrtpKeystreamSender sender;
+  sender.Init(key, 0);
+
+  RunAudioProtect(state,
+    [&](uint8_t* packet, int length, int* outLength) { sender.Protect(packet, length, outLength); },
+    [] {});
+}
+
+MEDIA_BENCH(srtp_protect_audio_precomputed)
+{
+  MediaLog::SetLevel(LogLevel::Warning);
+
+  uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+  MakeKey(key);
+  SrtpKeystreamSender sender;
+  sender.Init(key, PRECOMPUTE_PACKETS);
+
+  RunAudioProtect(state,
+    [&](uint8_t* packet, int length, int* outLength) { sender.Protect(packet, length, outLength); },
+    [&] { sender.Precompute(); });
+
+  SrtpKeystreamStats stats = sender.GetStats();
+  state.SetCounter("keystream_hit_ratio", (stats.Packets > 0) ? (double)stats.KeystreamHits / stats.Packets : 0.0);
+}
@@ -0,0 +1,148 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpRekeyBench.cpp
+//
+// Description: Rekeys an SRTP session with an MKI under a full rate stream of
+// video packets, some arriving out of order, and checks that no packet is
+// lost and the per packet latency does not spike. Another thread rekeys the
+// receiver and then the sender every few thousand packets while the stream
+// runs, the steady scenario is the same stream without rekeying.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+#include "SrtpNative.h"
+
+#include <atomic>
+#include <memory>
+#include <string.h>
+#include <thread>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const uint64_t INPUT_SEED = 20261018;
+  const int VIDEO_PAYLOAD_LENGTH = 1200;
+  const int PACKET_CAPACITY = RTP_HEADER_LENGTH + VIDEO_PAYLOAD_LENGTH + SRTP_MAX_TRAILER_LEN;
+  const uint32_t VIDEO_SSRC = 0x5eed0003;
+  const int MKI_LENGTH = 4;
+
+  /**
+  * The packets sent between rekeys.
+  */
+  const uint64_t REKEY_PACKETS = 4096;
+
+  void MakeKey(uint8_t* key, uint8_t* mki, uint32_t generation)
+  {
+    FillRandom(key, SrtpNative::SRTP_MASTER_KEY_LEN, INPUT_SEED + generation);
+    mki[0] = (uint8_t)(generation >> 24);
+    mki[1] = (uint8_t)(generation >> 16);
+    mki[2] = (uint8_t)(generation >> 8);
+    mki[3] = (uint8_t)generation;
+  }
+
+  /**
+  * Sends packets in pairs, the second of each pair unprotected first, timing the
+  * protect and unprotect of each packet. If rekeying, a thread rekeys both sessions
+  * each time another REKEY_PACKETS have been sent.
+  */
+  void RunStream(BenchState& state, bool isRekeying)
+  {
+    MediaLog::SetLevel(LogLevel::Warning);
+    SrtpNative::InitialiseLibSrtp();
+
+    uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+    uint8_t mki[MKI_LENGTH];
+    MakeKey(key, mki, 0);
+
+    SrtpNative sender;
+    SrtpNative receiver;
+    sender.SetMki(mki, MKI_LENGTH);
+    receiver.SetMki(mki, MKI_LENGTH);
+    sender.InitWithKey(key, sizeof(key), true);
+    receiver.InitWithKey(key, sizeof(key), false);
+
+    std::atomic<uint64_t> packetsSent{ 0 };
+    std::atomic<bool> isStopping{ false };
+    uint64_t rekeys = 0;
+    uint64_t rekeyFailures = 0;
+
+    std::thread rekeyThread;
+    if (isRekeying) {
+      rekeyThread = std::thread([&] {
+        uint32_t generation = 0;
+        while (!isStopping.load(std::memory_order_relaxed)) {
+          if (packetsSent.load(std::memory_order_relaxed) < (generation + 1) * REKEY_PACKETS) {
+            std::this_thread::yield();
+            continue;
+          }
+
+          // The receiver learns the new key before the first packet under it is sent.
+          uint8_t newKey[SrtpNative::SRTP_MASTER_KEY_LEN];
+          uint8_t newMki[MKI_LENGTH];
+          MakeKey(newKey, newMki, ++generation);
+          rekeyFailures += (receiver.Rekey(newKey, sizeof(newKey), newMki) != srtp_err_status_ok) ? 1 : 0;
+          rekeyFailures += (sender.Rekey(newKey, sizeof(newKey), newMki) != srtp_err_status_ok) ? 1 : 0;
+          rekeys++;
+        }
+      });
+    }
+
+    std::unique_ptr<MetricHistogram> latency(new MetricHistogram());
+    uint8_t payload[VIDEO_PAYLOAD_LENGTH];
+    FillRandom(payload, sizeof(payload), INPUT_SEED - 1);
+    uint8_t packets[2][PACKET_CAPACITY];
+    int lengths[2] = { 0, 0 };
+    uint64_t protectTimes[2] = { 0, 0 };
+    uint64_t failures = 0;
+
+    for (uint64_t i = 0; i < state.Iterations(); i++) {
+      int slot = (int)(i & 1);
+      WriteRtpHeader(packets[slot], 96, (uint16_t)i, 0, VIDEO_SSRC);
+      memcpy(packets[slot] + RTP_HEADER_LENGTH, payload, VIDEO_PAYLOAD_LENGTH);
+
+      uint64_t start = MediaScheduler::NowNanoseconds();
+      failures += (sender.ProtectRTP(packets[slot], RTP_HEADER_LENGTH + VIDEO_PAYLOAD_LENGTH, &lengths[slot]) != srtp_err_status_ok) ? 1 : 0;
+      protectTimes[slot] = MediaScheduler::NowNanoseconds() - start;
+      packetsSent.store(i + 1, std::memory_order_relaxed);
+
+      if (slot == 1 || i + 1 == state.Iterations()) {
+        for (int s = slot; s >= 0; s--) {
+          int outLength = 0;
+          start = MediaScheduler::NowNanoseconds();
+          failures += (receiver.UnprotectRTP(packets[s], lengths[s], &outLength) != srtp_err_status_ok) ? 1 : 0;
+          latency->Record(protectTimes[s] + MediaScheduler::NowNanoseconds() - start);
+        }
+      }
+    }
+
+    isStopping.store(true, std::memory_order_relaxed);
+    if (rekeyThread.joinable()) {
+      rekeyThread.join();
+    }
+
+    MetricHistogramSnapshot snapshot = latency->Snapshot();
+    state.SetItemsProcessed(state.Iterations());
+    state.SetCounter("failures", (double)(failures + rekeyFailures));
+    state.SetCounter("rekeys", (double)rekeys);
+    state.SetCounter("packet_p50_ns", (double)snapshot.P50);
+    state.SetCounter("packet_p99_ns", (double)snapshot.P99);
+    state.SetCounter("packet_p999_ns", (double)snapshot.P999);
+  }
+}
+
+MEDIA_BENCH(srtp_rekey_stream_steady)
+{
+  RunStream(state, false);
+}
+
+MEDIA_BENCH(srtp_rekey_stream_rekeyed)
+{
+  RunStream(state, true);
+}
@@ -0,0 +1,182 @@
+//-----------------------------------------------------------------------------
+// Filename: ThumbnailBench.cpp
+//
+// Description: The cost of keeping live thumbnails of many VP8 streams. The
+// streams all replay the same encoded clip, each starting at a different
+// frame so their key frames are spread out, and want a thumbnail once a
+// second. The keyframe_only scenario offers every frame to a
+// ThumbnailStream sharing a pool of two decoders, the full_decode scenario
+// is the alternative of a decoder per stream decoding every frame and
+// scaling the latest one each second. Both advance the streams 33ms of
+// media time at a time and let the decodes for each step finish before the
+// next one, as they would have to in real time.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "ImageConvertNative.h"
+#include "MediaScheduler.h"
+#include "ThumbnailDecoder.h"
+#include "VpxEncoderNative.h"
+
+#include <memory>
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int WIDTH = 640;
+  const int HEIGHT = 360;
+  const int CLIP_FRAMES = 90;
+  const int STREAM_COUNT = 100;
+  const int REFRESH_MILLISECONDS = 1000;
+  const uint64_t FRAME_NANOSECONDS = 1000000000ULL / 30;
+
+  /**
+  * Encodes a clip of a moving pattern. The encoder puts a key frame at least every
+  * 20 frames.
+  */
+  std::vector<std::vector<uint8_t>> EncodeClip()
+  {
+    VpxEncoderConfig config;
+    config.TargetBitrate = 800;
+    config.CpuUsed = 8;
+
+    VpxEncoderNative encoder;
+    encoder.InitEncoder(WIDTH, HEIGHT, 1, config);
+
+    std::vector<uint8_t> i420((size_t)WIDTH * HEIGHT * 3 / 2);
+    std::vector<std::vector<uint8_t>> clip;
+
+    for (int f = 0; f < CLIP_FRAMES; f++) {
+      for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+          i420[(size_t)y * WIDTH + x] = (uint8_t)((x + f * 4) ^ (y * 3));
+        }
+      }
+      memset(i420.data() + (size_t)WIDTH * HEIGHT, 128, (size_t)WIDTH * HEIGHT / 2);
+
+      MediaBufferPtr encoded;
+      bool isKeyFrame = false;
+      if (encoder.Encode(i420.data(), (int)i420.size(), f, encoded, &isKeyFrame) == 0 && encoded) {
+        clip.emplace_back(encoded->Data(), encoded->Data() + encoded->Length());
+      }
+    }
+
+    return clip;
+  }
+
+  /**
+  * The clip frame a stream is on at a step, each stream starts at a different frame.
+  */
+  const std::vector<uint8_t>& FrameAt(const std::vector<std::vector<uint8_t>>& clip, int stream, int step)
+  {
+    return clip[(stream * 7 + step) % clip.size()];
+  }
+}
+
+MEDIA_BENCH(thumbnail_keyframe_only_100_streams)
+{
+  state.PauseTiming();
+  std::vector<std::vector<uint8_t>> clip = EncodeClip();
+  if (clip.empty()) {
+    return;
+  }
+
+  ThumbnailDecoderPool pool(2, ThumbnailDecoderPool::DEFAULT_WIDTH, ThumbnailDecoderPool::DEFAULT_HEIGHT);
+  std::vector<std::unique_ptr<ThumbnailStream>> streams;
+  for (int s = 0; s < STREAM_COUNT; s++) {
+    streams.emplace_back(new ThumbnailStream(pool, REFRESH_MILLISECONDS));
+  }
+  uint64_t now = MediaScheduler::NowNanoseconds();
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    for (int step = 0; step < CLIP_FRAMES; step++) {
+      for (int s = 0; s < STREAM_COUNT; s++) {
+        const std::vector<uint8_t>& frame = FrameAt(clip, s, step);
+        streams[s]->PushFrame(frame.data(), (int)frame.size(), now);
+      }
+      pool.Flush();
+      now += FRAME_NANOSECONDS;
+    }
+  }
+
+  ThumbnailStats stats = pool.GetStats();
+  double streamSeconds = (double)state.Iterations() * STREAM_COUNT * CLIP_FRAMES * FRAME_NANOSECONDS / 1e9;
+
+  state.SetItemsProcessed(state.Iterations() * STREAM_COUNT * CLIP_FRAMES);
+  state.SetCounter("thumbnails", (double)stats.ThumbnailsUpdated);
+  state.SetCounter("decodes_skipped", (double)stats.DecodesSkipped);
+  state.SetCounter("decode_us_per_thumbnail", (stats.ThumbnailsUpdated > 0) ? stats.DecodeNanosecondsTotal / 1000.0 / stats.ThumbnailsUpdated : 0.0);
+  state.SetCounter("decode_us_per_stream_second", stats.DecodeNanosecondsTotal / 1000.0 / streamSeconds);
+  state.SetCounter("decoders", (double)pool.GetDecoderCount());
+}
+
+MEDIA_BENCH(thumbnail_full_decode_100_streams)
+{
+  state.PauseTiming();
+  std::vector<std::vector<uint8_t>> clip = EncodeClip();
+  if (clip.empty()) {
+    return;
+  }
+
+  struct FullDecodeStream
+  {
+    VpxEncoderNative Decoder;
+    ImageConvertNative Convert;
+    uint64_t LastThumbnailNanoseconds = 0;
+    MediaBufferPtr Thumbnail;
+  };
+
+  std::vector<std::unique_ptr<FullDecodeStream>> streams;
+  for (int s = 0; s < STREAM_COUNT; s++) {
+    streams.emplace_back(new FullDecodeStream());
+    streams.back()->Decoder.InitDecoder();
+  }
+  uint64_t now = MediaScheduler::NowNanoseconds();
+  uint64_t thumbnails = 0;
+  uint64_t decodeNanoseconds = 0;
+  state.ResumeTiming();
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    for (int step = 0; step < CLIP_FRAMES; step++) {
+      uint64_t start = MediaScheduler::NowNanoseconds();
+
+      for (int s = 0; s < STREAM_COUNT; s++) {
+        FullDecodeStream& stream = *streams[s];
+        const std::vector<uint8_t>& frame = FrameAt(clip, s, step);
+
+        MediaBufferPtr decoded;
+        unsigned int width = 0, height = 0;
+        if (stream.Decoder.Decode(frame.data(), (int)frame.size(), decoded, &width, &height) != 0 || !decoded) {
+          continue;
+        }
+
+        if (now - stream.LastThumbnailNanoseconds >= REFRESH_MILLISECONDS * 1000000ULL) {
+          stream.Convert.Scale(decoded->Data(), AV_PIX_FMT_YUV420P, (int)width, (int)height,
+            ThumbnailDecoderPool::DEFAULT_WIDTH, ThumbnailDecoderPool::DEFAULT_HEIGHT, stream.Thumbnail);
+          stream.LastThumbnailNanoseconds = now;
+          thumbnails++;
+        }
+      }
+
+      decodeNanoseconds += MediaScheduler::NowNanoseconds() - start;
+      now += FRAME_NANOSECONDS;
+    }
+  }
+
+  double streamSeconds = (double)state.Iterations() * STREAM_COUNT * CLIP_FRAMES * FRAME_NANOSECONDS / 1e9;
+
+  state.SetItemsProcessed(state.Iterations() * STREAM_COUNT * CLIP_FRAMES);
+  state.SetCounter("thumbnails", (double)thumbnails);
+  state.SetCounter("decodes_skipped", 0.0);
+  state.SetCounter("decode_us_per_thumbnail", (thumbnails > 0) ? decodeNanoseconds / 1000.0 / thumbnails : 0.0);
+  state.SetCounter("decode_us_per_stream_second", decodeNanoseconds / 1000.0 / streamSeconds);
+  state.SetCounter("decoders", (double)STREAM_COUNT);
+}
@@ -0,0 +1,50 @@
+//-----------------------------------------------------------------------------
+// Filename: TraceBench.cpp
+//
+// Description: Cost of a trace scope with tracing off, which is what every
+// native stage pays in production, and with tracing on.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "MediaTrace.h"
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+MEDIA_BENCH(trace_scope_disabled)
+{
+  MediaTrace::SetEnabled(false);
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    SIPSM_TRACE_SCOPE("bench", "trace_scope_disabled", i);
+  }
+}
+
+MEDIA_BENCH(trace_scope_enabled)
+{
+  MediaTrace::SetEnabled(true);
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    SIPSM_TRACE_SCOPE("bench", "trace_scope_enabled", i);
+  }
+  MediaTrace::SetEnabled(false);
+  MediaTrace::Clear();
+}
+
+MEDIA_BENCH(trace_export_chrome_json)
+{
+  MediaTrace::SetEnabled(true);
+  for (int i = 0; i < MediaTrace::RING_CAPACITY; i++) {
+    SIPSM_TRACE_SCOPE("bench", "trace_export_chrome_json", i);
+  }
+  MediaTrace::SetEnabled(false);
+
+  size_t length = 0;
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    length += MediaTrace::Export(TraceFormat::ChromeJson).size();
+  }
+  DoNotOptimise(length);
+  state.SetItemsProcessed(state.Iterations() * MediaTrace::RING_CAPACITY);
+  MediaTrace::Clear();
+}
@@ -0,0 +1,139 @@
+//-----------------------------------------------------------------------------
+// Filename: Vp8BitstreamBench.cpp
+//
+// Description: The cost of inspecting VP8 frames and RTP packets without
+// decoding them. The frames are a 30 fps stream with a key frame every two
+// seconds, the packets carry the extended payload descriptor browsers send,
+// with a 15 bit picture ID, TL0PICIDX and temporal layer. Both scenarios
+// check the parsed fields against the ones written.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "Vp8Bitstream.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::Bench;
+
+namespace {
+
+  const int STREAM_FRAMES = 600;
+  const int KEY_FRAME_INTERVAL = 60;
+  const int FRAME_WIDTH = 1280;
+  const int FRAME_HEIGHT = 720;
+  const int FRAME_LENGTH = 64;
+  const int DESCRIPTOR_LENGTH = 6;
+  const int PACKETS_PER_FRAME = 4;
+
+  /**
+  * Writes the uncompressed data chunk of a frame followed by filler.
+  */
+  void WriteFrame(uint8_t* frame, bool isKeyFrame, uint32_t firstPartitionLength)
+  {
+    uint32_t tag = ((isKeyFrame) ? 0 : 1) | (0 << 1) | 0x10 | (firstPartitionLength << 5);
+    frame[0] = (uint8_t)tag;
+    frame[1] = (uint8_t)(tag >> 8);
+    frame[2] = (uint8_t)(tag >> 16);
+
+    int offset = 3;
+    if (isKeyFrame) {
+      frame[3] = 0x9d;
+      frame[4] = 0x01;
+      frame[5] = 0x2a;
+      frame[6] = (uint8_t)FRAME_WIDTH;
+      frame[7] = (uint8_t)(FRAME_WIDTH >> 8);
+      frame[8] = (uint8_t)FRAME_HEIGHT;
+      frame[9] = (uint8_t)(FRAME_HEIGHT >> 8);
+      offset = 10;
+    }
+    memset(frame + offset, 0x5a, FRAME_LENGTH - offset);
+  }
+
+  /**
+  * Writes an RTP packet with an extended payload descriptor, the first packet of a
+  * frame starts with the frame's header.
+  */
+  void WritePacket(uint8_t* packet, uint16_t sequenceNumber, uint16_t pictureId, int temporalLayer, const uint8_t* frame, bool isFrameStart)
+  {
+    WriteRtpHeader(packet, 96, sequenceNumber, 0, 0);
+
+    uint8_t* descriptor = packet + RTP_HEADER_LENGTH;
+    descriptor[0] = 0x80 | ((isFrameStart) ? 0x10 : 0);
+    descriptor[1] = 0x80 | 0x40 | 0x20;
+    descriptor[2] = 0x80 | (uint8_t)((pictureId >> 8) & 0x7f);
+    descriptor[3] = (uint8_t)pictureId;
+    descriptor[4] = (uint8_t)pictureId;
+    descriptor[5] = (uint8_t)(temporalLayer << 6);
+    memcpy(descriptor + DESCRIPTOR_LENGTH, frame, FRAME_LENGTH);
+  }
+}
+
+MEDIA_BENCH(vp8_parse_frame_header)
+{
+  std::vector<uint8_t> frames(STREAM_FRAMES * FRAME_LENGTH);
+  for (int n = 0; n < STREAM_FRAMES; n++) {
+    WriteFrame(&frames[n * FRAME_LENGTH], (n % KEY_FRAME_INTERVAL) == 0, 1000 + n);
+  }
+
+  uint64_t keyFrames = 0;
+  uint64_t mismatches = 0;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    int n = (int)(i % STREAM_FRAMES);
+    Vp8FrameInfo info;
+
+    if (Vp8Bitstream::ParseFrameHeader(&frames[n * FRAME_LENGTH], FRAME_LENGTH, &info) != 0 ||
+      info.IsKeyFrame != ((n % KEY_FRAME_INTERVAL) == 0) || info.FirstPartitionLength != 1000 + n) {
+      mismatches++;
+    }
+    else if (info.IsKeyFrame) {
+      keyFrames++;
+      mismatches += (info.Width == FRAME_WIDTH && info.Height == FRAME_HEIGHT) ? 0 : 1;
+    }
+  }
+
+  state.SetItemsProcessed(state.Iterations());
+  state.SetCounter("key_frames", (double)keyFrames);
+  state.SetCounter("mismatches", (double)mismatches);
+}
+
+MEDIA_BENCH(vp8_inspect_rtp)
+{
+  const int packetLength = RTP_HEADER_LENGTH + DESCRIPTOR_LENGTH + FRAME_LENGTH;
+  const int packetCount = STREAM_FRAMES * PACKETS_PER_FRAME;
+
+  std::vector<uint8_t> frame(FRAME_LENGTH);
+  std::vector<uint8_t> packets(packetCount * packetLength);
+  for (int p = 0; p < packetCount; p++) {
+    int n = p / PACKETS_PER_FRAME;
+    WriteFrame(frame.data(), (n % KEY_FRAME_INTERVAL) == 0, 1000 + n);
+    WritePacket(&packets[p * packetLength], (uint16_t)p, (uint16_t)n, n % 3, frame.data(), (p % PACKETS_PER_FRAME) == 0);
+  }
+
+  uint64_t keyFrames = 0;
+  uint64_t mismatches = 0;
+
+  for (uint64_t i = 0; i < state.Iterations(); i++) {
+    int p = (int)(i % packetCount);
+    int n = p / PACKETS_PER_FRAME;
+    Vp8PayloadDescriptor descriptor;
+    Vp8FrameInfo info;
+
+    int result = Vp8Bitstream::InspectRtp(&packets[p * packetLength], packetLength, &descriptor, &info);
+    if (result != (((p % PACKETS_PER_FRAME) == 0) ? 1 : 0) || descriptor.PictureId != n || descriptor.TemporalLayer != n % 3) {
+      mismatches++;
+    }
+    else if (result == 1 && info.IsKeyFrame) {
+      keyFrames++;
+    }
+  }
+
+  state.SetItemsProcessed(state.Iterations());
+  state.SetCounter("key_frames", (double)keyFrames);
+  state.SetCounter("mismatches", (double)mismatches);
+}
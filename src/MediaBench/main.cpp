@@ -0,0 +1,215 @@
+//-----------------------------------------------------------------------------
+// Filename: main.cpp
+//
+// Description: Runs the native media benchmarks.
+//
+// Usage:
+// MediaBench [--filter <name>] [--min-time <ms>] [--repetitions <n>]
+//   [--json <file>] [--label <text>] [--baseline <file>] [--threshold <percent>]
+//   [--alpha <p>] [--force-compare] [--openssl-accounting] [--list]
+//
+// --openssl-accounting counts OpenSSL's allocations exactly, through its
+// allocation hooks, for the memory footprint benchmarks. It is off by default
+// as the library leaves it to the application.
+//
+// MediaBench --child <name> <argument> is used by the benchmarks themselves
+// to run the other side of a two process benchmark.
+//
+// Counters named failures or mismatches, or ending in _failures or
+// _mismatches, are the benchmarks' correctness checks and the exit code is 3
+// if any of them is above zero. With --baseline each result is compared
+// against the baseline run and the exit code is 2 if any benchmark
+// regressed. A baseline recorded on a different machine, compiler or build
+// is compared for information only unless --force-compare is given.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Bench.h"
+#include "BenchReport.h"
+#include "MediaMemory.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace SIPSorceryMedia::Bench;
+
+static const int DEFAULT_MIN_TIME_MILLISECONDS = 500;
+static const int DEFAULT_REPETITIONS = 1;
+static const double DEFAULT_THRESHOLD_PERCENT = 10;
+static const double DEFAULT_ALPHA = 0.05;
+
+static bool EndsWith(const std::string& text, const char* suffix)
+{
+  size_t length = strlen(suffix);
+  return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+static bool IsCheckCounter(const std::string& name)
+{
+  return name == "failures" || name == "mismatches" || EndsWith(name, "_failures") || EndsWith(name, "_mismatches");
+}
+
+static const char* VerdictName(BenchVerdict verdict)
+{
+  switch (verdict) {
+  case BenchVerdict::Regressed: return "REGRESSED";
+  case BenchVerdict::Improved: return "improved";
+  case BenchVerdict::NotInBaseline: return "new";
+  default: return "ok";
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::string filter;
+  int minTime = DEFAULT_MIN_TIME_MILLISECONDS;
+  int repetitions = DEFAULT_REPETITIONS;
+  std::string jsonPath, baselinePath, label;
+  double threshold = DEFAULT_THRESHOLD_PERCENT;
+  double alpha = DEFAULT_ALPHA;
+  bool forceCompare = false;
+
+  BenchChildProcess::SetExecutablePath(argv[0]);
+  if (argc >= 3 && strcmp(argv[1], "--child") == 0) {
+    return BenchRunner::RunChild(argv[2], (argc >= 4) ? argv[3] : "");
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    }
+    else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      minTime = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+      repetitions = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      jsonPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+      label = argv[++i];
+    }
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baselinePath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+      alpha = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--force-compare") == 0) {
+      forceCompare = true;
+    }
+    else if (strcmp(argv[i], "--openssl-accounting") == 0) {
+      // Has to come before OpenSSL's first allocation.
+      if (SIPSorceryMedia::MemoryAccount::EnableOpenSslAccounting() != 0) {
+        fprintf(stderr, "OpenSSL had already allocated memory, its allocations are measured from the heap.\n");
+      }
+    }
+    else if (strcmp(argv[i], "--list") == 0) {
+      for (auto& name : BenchRunner::List()) {
+        printf("%s\n", name.c_str());
+      }
+      return 0;
+    }
+    else {
+      printf("Usage: %s [--filter <name>] [--min-time <ms>] [--repetitions <n>] [--json <file>] [--label <text>]\n"
+        "  [--baseline <file>] [--threshold <percent>] [--alpha <p>] [--force-compare] [--openssl-accounting] [--list]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  BenchRun baseline;
+  if (!baselinePath.empty() && BenchReport::Load(baselinePath, baseline) != 0) {
+    fprintf(stderr, "Failed to read the baseline %s.\n", baselinePath.c_str());
+    return 1;
+  }
+
+  // Thresholds travel with the results so a baseline refreshed with --json and
+  // --baseline keeps them.
+  BenchRun run;
+  run.Environment = BenchEnvironment::Capture();
+  run.Environment.Label = label;
+  run.Thresholds = baseline.Thresholds;
+
+  printf("%s, %s, %d processors, %s build.\n", run.Environment.Cpu.c_str(), run.Environment.Os.c_str(),
+    run.Environment.Processors, run.Environment.Build.c_str());
+  printf("%-45s %14s %14s %14s\n", "Benchmark", "Iterations", "ns/iter", "items/s");
+
+  run.Results = BenchRunner::Run(filter, minTime, (repetitions > 0) ? repetitions : 1);
+
+  for (auto& result : run.Results) {
+    printf("%-45s %14llu %14.1f %14.0f\n", result.Name.c_str(), (unsigned long long)result.Iterations,
+      result.NanosecondsPerIteration, result.ItemsPerSecond);
+
+    for (auto& counter : result.Counters) {
+      printf("  %-43s %14.1f\n", counter.first.c_str(), counter.second);
+    }
+  }
+
+  if (!jsonPath.empty()) {
+    std::string json = BenchReport::ToJson(run);
+    FILE* file = fopen(jsonPath.c_str(), "wb");
+    if (file == nullptr || fwrite(json.data(), 1, json.size(), file) != json.size()) {
+      fprintf(stderr, "Failed to write the results to %s.\n", jsonPath.c_str());
+      return 1;
+    }
+    fclose(file);
+  }
+
+  int exitCode = 0;
+
+  if (!baselinePath.empty()) {
+    bool isEnforced = forceCompare || baseline.Environment.IsComparable(run.Environment);
+
+    printf("\nCompared with %s (%s, %s, %s).\n", baselinePath.c_str(), baseline.Environment.Cpu.c_str(),
+      baseline.Environment.Compiler.c_str(), baseline.Environment.Timestamp.c_str());
+    if (!isEnforced) {
+      printf("The baseline was recorded on a different machine or build, regressions are reported but not enforced.\n");
+    }
+
+    printf("%-45s %14s %14s %9s %8s %10s\n", "Benchmark", "baseline ns", "current ns", "change", "p", "verdict");
+
+    int regressions = 0;
+    for (auto& comparison : BenchReport::Compare(baseline, run, threshold, alpha)) {
+      char pValue[16] = "-";
+      if (comparison.Verdict != BenchVerdict::NotInBaseline && fabs(comparison.ChangePercent) > comparison.ThresholdPercent) {
+        snprintf(pValue, sizeof(pValue), "%.3f", comparison.PValue);
+      }
+
+      printf("%-45s %14.1f %14.1f %8.1f%% %8s %10s\n", comparison.Name.c_str(), comparison.BaselineNanoseconds,
+        comparison.CurrentNanoseconds, comparison.ChangePercent, pValue, VerdictName(comparison.Verdict));
+
+      if (comparison.Verdict == BenchVerdict::Regressed) {
+        regressions++;
+      }
+    }
+
+    if (regressions > 0 && isEnforced) {
+      printf("%d benchmark(s) regressed by more than their threshold.\n", regressions);
+      exitCode = 2;
+    }
+  }
+
+  int failedChecks = 0;
+  for (auto& result : run.Results) {
+    for (auto& counter : result.Counters) {
+      if (IsCheckCounter(counter.first) && counter.second > 0) {
+        printf("%s failed its check, %s is %.0f.\n", result.Name.c_str(), counter.first.c_str(), counter.second);
+        failedChecks++;
+      }
+    }
+  }
+
+  if (failedChecks > 0) {
+    exitCode = 3;
+  }
+
+  return exitCode;
+}
@@ -0,0 +1,598 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaBuffer.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaBuffer.h"
+#include "MediaTopology.h"
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    // NUMA placement is per page (Windows reserves address space in 64KB units),
+    // smaller buffers are left to first touch placement.
+#ifdef _WIN32
+    const size_t NUMA_MIN_SIZE = 64 * 1024;
+#else
+    const size_t NUMA_MIN_SIZE = 4096;
+#endif
+
+    // Thread caches are kept for the first few pools created, which in practice
+    // is the default pool plus one per NUMA node. Any further pools go straight
+    // to their shared free lists.
+    const int MAX_CACHED_POOLS = 8;
+
+    // Each thread holds at most this many bytes per size class, and never more
+    // than THREAD_CACHE_MAX_BUFFERS buffers.
+    const size_t THREAD_CACHE_MAX_BYTES = 256 * 1024;
+    const int THREAD_CACHE_MAX_BUFFERS = 32;
+
+    std::atomic<int> _nextPoolId{ 0 };
+
+    /**
+    * Increments a counter that only the calling thread writes to. Avoids the cost
+    * of a locked read-modify-write while still letting other threads read it.
+    */
+    inline void Bump(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    int ThreadCacheLimit(int sizeClass)
+    {
+      size_t perClass = THREAD_CACHE_MAX_BYTES / (MediaBufferPool::MIN_SIZE_CLASS << sizeClass);
+      if (perClass < 1) {
+        return 1;
+      }
+      return (perClass > THREAD_CACHE_MAX_BUFFERS) ? THREAD_CACHE_MAX_BUFFERS : (int)perClass;
+    }
+  }
+
+  struct SizeClassList
+  {
+    std::mutex Lock;
+    MediaBuffer* Head = nullptr;
+  };
+
+  struct MediaBufferPool::Impl
+  {
+    SizeClassList Classes[SIZE_CLASS_COUNT];
+
+    // Only used by pools without a thread cache slot, other pools count acquires
+    // and releases in the thread caches.
+    std::atomic<uint64_t> Acquires{ 0 };
+    std::atomic<uint64_t> Releases{ 0 };
+    std::atomic<uint64_t> BytesAcquired{ 0 };
+    std::atomic<uint64_t> BytesReleased{ 0 };
+
+    std::atomic<uint64_t> PoolHits{ 0 };
+    std::atomic<uint64_t> SystemAllocations{ 0 };
+    std::atomic<uint64_t> SystemFrees{ 0 };
+    std::atomic<int64_t> BuffersPooled{ 0 };
+    std::atomic<int64_t> BytesPooled{ 0 };
+    std::atomic<int64_t> BytesAllocated{ 0 };
+  };
+
+  struct ThreadCache;
+
+  /**
+  * Tracks the live thread caches so their counters can be summed, and keeps the
+  * counters of threads that have exited. Never freed as threads can exit during
+  * process shutdown.
+  */
+  struct ThreadCacheRegistry
+  {
+    static const int COUNTER_COUNT = 5;
+
+    std::mutex Lock;
+    std::vector<ThreadCache*> Caches;
+    uint64_t Retired[MAX_CACHED_POOLS][COUNTER_COUNT] = {};
+
+    // Cache slots whose pool has been destroyed. Pool ids are never reused so a
+    // slot stays destroyed for the life of the process.
+    bool Destroyed[MAX_CACHED_POOLS] = {};
+
+    static ThreadCacheRegistry& Instance()
+    {
+      static ThreadCacheRegistry* registry = new ThreadCacheRegistry();
+      return *registry;
+    }
+  };
+
+  /**
+  * Per thread cache of released buffers. Lets a thread that acquires and releases
+  * buffers of the same size, which is the normal pattern for a media pipeline
+  * stage, do so without taking a lock or touching a shared cache line.
+  */
+  struct ThreadCache
+  {
+    struct PoolCache
+    {
+      MediaBufferPool* Pool = nullptr;
+      MediaBuffer* Heads[MediaBufferPool::SIZE_CLASS_COUNT] = {};
+      int Counts[MediaBufferPool::SIZE_CLASS_COUNT] = {};
+
+      // Only written by the owning thread, see Bump.
+      std::atomic<uint64_t> Acquires{ 0 };
+      std::atomic<uint64_t> ThreadCacheHits{ 0 };
+      std::atomic<uint64_t> Releases{ 0 };
+      std::atomic<uint64_t> BytesAcquired{ 0 };
+      std::atomic<uint64_t> BytesReleased{ 0 };
+
+      void ReadCounters(uint64_t* counters) const
+      {
+        counters[0] += Acquires.load(std::memory_order_relaxed);
+        counters[1] += ThreadCacheHits.load(std::memory_order_relaxed);
+        counters[2] += Releases.load(std::memory_order_relaxed);
+        counters[3] += BytesAcquired.load(std::memory_order_relaxed);
+        counters[4] += BytesReleased.load(std::memory_order_relaxed);
+      }
+    };
+
+    PoolCache Pools[MAX_CACHED_POOLS];
+
+    ThreadCache()
+    {
+      ThreadCacheRegistry& registry = ThreadCacheRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry.Lock);
+      registry.Caches.push_back(this);
+    }
+
+    ~ThreadCache()
+    {
+      ThreadCacheRegistry& registry = ThreadCacheRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry.Lock);
+
+      // Hand anything still cached back to the shared free lists so other threads
+      // can use it. The registry lock stops the pool being destroyed part way
+      // through, buffers cached for a pool that has already gone are freed directly.
+      for (int i = 0; i < MAX_CACHED_POOLS; i++) {
+        if (Pools[i].Pool != nullptr) {
+          if (registry.Destroyed[i]) {
+            Discard(Pools[i]);
+          }
+          else {
+            Flush(Pools[i]);
+          }
+        }
+      }
+
+      for (int i = 0; i < MAX_CACHED_POOLS; i++) {
+        Pools[i].ReadCounters(registry.Retired[i]);
+      }
+      registry.Caches.erase(std::remove(registry.Caches.begin(), registry.Caches.end(), this), registry.Caches.end());
+    }
+
+    static void Flush(PoolCache& cache)
+    {
+      for (int sizeClass = 0; sizeClass < MediaBufferPool::SIZE_CLASS_COUNT; sizeClass++) {
+        MediaBuffer* buffer = cache.Heads[sizeClass];
+        cache.Heads[sizeClass] = nullptr;
+        cache.Counts[sizeClass] = 0;
+
+        while (buffer != nullptr) {
+          MediaBuffer* next = buffer->_next;
+          buffer->_next = nullptr;
+          cache.Pool->Recycle(buffer, false);
+          buffer = next;
+        }
+      }
+    }
+
+    static void Discard(PoolCache& cache)
+    {
+      for (int sizeClass = 0; sizeClass < MediaBufferPool::SIZE_CLASS_COUNT; sizeClass++) {
+        MediaBuffer* buffer = cache.Heads[sizeClass];
+        cache.Heads[sizeClass] = nullptr;
+        cache.Counts[sizeClass] = 0;
+
+        while (buffer != nullptr) {
+          MediaBuffer* next = buffer->_next;
+          MediaBufferPool::Deallocate(buffer);
+          buffer = next;
+        }
+      }
+      cache.Pool = nullptr;
+    }
+  };
+
+  thread_local ThreadCache _threadCache;
+
+  void MediaBuffer::Release()
+  {
+    if (_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      _pool->Recycle(this, true);
+    }
+  }
+
+  MediaBufferPool& MediaBufferPool::Default()
+  {
+    // Deliberately never freed, thread caches may hand buffers back during
+    // process shutdown after static destructors have run.
+    static MediaBufferPool* defaultPool = new MediaBufferPool();
+    return *defaultPool;
+  }
+
+  MediaBufferPool& MediaBufferPool::ForNode(int node)
+  {
+    if (node < 0 || node >= MediaTopology::GetNumaNodeCount() || MediaTopology::GetNumaNodeCount() == 1) {
+      return Default();
+    }
+
+    static std::mutex nodePoolsLock;
+    static std::vector<MediaBufferPool*>* nodePools = new std::vector<MediaBufferPool*>(MediaTopology::GetNumaNodeCount(), nullptr);
+
+    std::lock_guard<std::mutex> lock(nodePoolsLock);
+    if ((*nodePools)[node] == nullptr) {
+      MediaBufferPoolConfig config;
+      config.NumaNode = node;
+      (*nodePools)[node] = new MediaBufferPool(config);
+    }
+    return *(*nodePools)[node];
+  }
+
+  MediaBufferPool::MediaBufferPool(const MediaBufferPoolConfig& config) :
+    _config(config),
+    _impl(new Impl()),
+    _id(_nextPoolId.fetch_add(1))
+  { }
+
+  MediaBufferPool::~MediaBufferPool()
+  {
+    if (_id < MAX_CACHED_POOLS) {
+      ThreadCache::PoolCache& cache = _threadCache.Pools[_id];
+      if (cache.Pool == this) {
+        ThreadCache::Flush(cache);
+        cache.Pool = nullptr;
+      }
+
+      // Other threads' caches can't be touched from here, they free the buffers
+      // they hold for this pool when they exit.
+      ThreadCacheRegistry& registry = ThreadCacheRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry.Lock);
+      registry.Destroyed[_id] = true;
+    }
+
+    Trim();
+    delete _impl;
+  }
+
+  int MediaBufferPool::GetSizeClass(size_t size)
+  {
+    if (size > MAX_SIZE_CLASS) {
+      return -1;
+    }
+    else if (size <= MIN_SIZE_CLASS) {
+      return 0;
+    }
+
+    // The size class is the number of bits needed for size - 1, less the 8 bits
+    // of the minimum class.
+    uint64_t value = (uint64_t)(size - 1);
+#ifdef _MSC_VER
+    unsigned long highestBit;
+    _BitScanReverse64(&highestBit, value);
+    return (int)highestBit - 7;
+#else
+    return (63 - __builtin_clzll(value)) - 7;
+#endif
+  }
+
+  MediaBuffer* MediaBufferPool::Allocate(int sizeClass, size_t size)
+  {
+    size_t capacity = (sizeClass < 0) ? size : (MIN_SIZE_CLASS << sizeClass);
+    uint8_t* data = nullptr;
+    bool isMapped = false;
+
+    if (_config.UseHugePages && capacity >= HUGE_PAGE_SIZE) {
+#ifdef _WIN32
+      // Large pages need the SeLockMemoryPrivilege, without it the allocation fails
+      // and normal pages are used.
+      auto virtualAlloc = [this](size_t length, DWORD flags) {
+        return static_cast<uint8_t*>((_config.NumaNode >= 0) ?
+          VirtualAllocExNuma(GetCurrentProcess(), nullptr, length, flags, PAGE_READWRITE, (DWORD)_config.NumaNode) :
+          VirtualAlloc(nullptr, length, flags, PAGE_READWRITE));
+      };
+
+      size_t largePage = GetLargePageMinimum();
+      if (largePage > 0) {
+        size_t mapSize = (capacity + largePage - 1) & ~(largePage - 1);
+        data = virtualAlloc(mapSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES);
+        if (data != nullptr) {
+          capacity = mapSize;
+        }
+      }
+      if (data == nullptr) {
+        data = virtualAlloc(capacity, MEM_RESERVE | MEM_COMMIT);
+      }
+#else
+      size_t mapSize = (capacity + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+      void* mapped = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (mapped == MAP_FAILED) {
+        // No reserved huge pages, ask for transparent huge pages instead.
+        mapped = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED) {
+          madvise(mapped, mapSize, MADV_HUGEPAGE);
+        }
+      }
+      if (mapped != MAP_FAILED) {
+        data = static_cast<uint8_t*>(mapped);
+        capacity = mapSize;
+        if (_config.NumaNode >= 0) {
+          MediaTopology::BindMemory(data, capacity, _config.NumaNode);
+        }
+      }
+#endif
+      isMapped = (data != nullptr);
+    }
+
+    if (data == nullptr && _config.NumaNode >= 0 && capacity >= NUMA_MIN_SIZE) {
+      // Released the same way as the huge page mappings above.
+      data = static_cast<uint8_t*>(MediaTopology::AllocateOnNode(capacity, _config.NumaNode));
+      isMapped = (data != nullptr);
+    }
+
+    if (data == nullptr) {
+#ifdef _WIN32
+      data = static_cast<uint8_t*>(_aligned_malloc(capacity, MediaBuffer::ALIGNMENT));
+#else
+      void* ptr = nullptr;
+      if (posix_memalign(&ptr, MediaBuffer::ALIGNMENT, capacity) == 0) {
+        data = static_cast<uint8_t*>(ptr);
+      }
+#endif
+    }
+
+    if (data == nullptr) {
+      return nullptr;
+    }
+
+    MediaBuffer* buffer = new (std::nothrow) MediaBuffer();
+    if (buffer == nullptr) {
+#ifdef _WIN32
+      if (isMapped) VirtualFree(data, 0, MEM_RELEASE); else _aligned_free(data);
+#else
+      if (isMapped) munmap(data, capacity); else free(data);
+#endif
+      return nullptr;
+    }
+
+    buffer->_pool = this;
+    buffer->_sizeClass = sizeClass;
+    buffer->_data = data;
+    buffer->_capacity = capacity;
+    buffer->_isMapped = isMapped;
+
+    _impl->SystemAllocations.fetch_add(1, std::memory_order_relaxed);
+    _impl->BytesAllocated.fetch_add(capacity, std::memory_order_relaxed);
+
+    return buffer;
+  }
+
+  void MediaBufferPool::Free(MediaBuffer* buffer)
+  {
+    _impl->SystemFrees.fetch_add(1, std::memory_order_relaxed);
+    _impl->BytesAllocated.fetch_sub(buffer->_capacity, std::memory_order_relaxed);
+    Deallocate(buffer);
+  }
+
+  void MediaBufferPool::Deallocate(MediaBuffer* buffer)
+  {
+#ifdef _WIN32
+    if (buffer->_isMapped) {
+      VirtualFree(buffer->_data, 0, MEM_RELEASE);
+    }
+    else {
+      _aligned_free(buffer->_data);
+    }
+#else
+    if (buffer->_isMapped) {
+      munmap(buffer->_data, buffer->_capacity);
+    }
+    else {
+      free(buffer->_data);
+    }
+#endif
+
+    delete buffer;
+  }
+
+  MediaBufferPtr MediaBufferPool::Acquire(size_t size)
+  {
+    int sizeClass = GetSizeClass(size);
+    MediaBuffer* buffer = nullptr;
+    ThreadCache::PoolCache* cache = (_id < MAX_CACHED_POOLS) ? &_threadCache.Pools[_id] : nullptr;
+
+    if (sizeClass >= 0) {
+      if (cache != nullptr && cache->Heads[sizeClass] != nullptr) {
+        buffer = cache->Heads[sizeClass];
+        cache->Heads[sizeClass] = buffer->_next;
+        cache->Counts[sizeClass]--;
+        Bump(cache->ThreadCacheHits, 1);
+      }
+
+      if (buffer == nullptr) {
+        SizeClassList& list = _impl->Classes[sizeClass];
+        {
+          std::lock_guard<std::mutex> lock(list.Lock);
+          buffer = list.Head;
+          if (buffer != nullptr) {
+            list.Head = buffer->_next;
+          }
+        }
+
+        if (buffer != nullptr) {
+          _impl->PoolHits.fetch_add(1, std::memory_order_relaxed);
+          _impl->BuffersPooled.fetch_sub(1, std::memory_order_relaxed);
+          _impl->BytesPooled.fetch_sub(buffer->_capacity, std::memory_order_relaxed);
+        }
+      }
+    }
+
+    if (buffer == nullptr) {
+      buffer = Allocate(sizeClass, size);
+      if (buffer == nullptr) {
+        return MediaBufferPtr();
+      }
+    }
+
+    buffer->_next = nullptr;
+    buffer->_length = size;
+    buffer->_id = 0;
+    buffer->_refCount.store(1, std::memory_order_relaxed);
+
+    if (cache != nullptr) {
+      Bump(cache->Acquires, 1);
+      Bump(cache->BytesAcquired, buffer->_capacity);
+    }
+    else {
+      _impl->Acquires.fetch_add(1, std::memory_order_relaxed);
+      _impl->BytesAcquired.fetch_add(buffer->_capacity, std::memory_order_relaxed);
+    }
+
+    return MediaBufferPtr(buffer);
+  }
+
+  void MediaBufferPool::Recycle(MediaBuffer* buffer, bool isRelease)
+  {
+    ThreadCache::PoolCache* cache = (isRelease && _id < MAX_CACHED_POOLS) ? &_threadCache.Pools[_id] : nullptr;
+
+    if (isRelease) {
+      if (cache != nullptr) {
+        Bump(cache->Releases, 1);
+        Bump(cache->BytesReleased, buffer->_capacity);
+      }
+      else {
+        _impl->Releases.fetch_add(1, std::memory_order_relaxed);
+        _impl->BytesReleased.fetch_add(buffer->_capacity, std::memory_order_relaxed);
+      }
+    }
+
+    int sizeClass = buffer->_sizeClass;
+
+    if (sizeClass < 0) {
+      Free(buffer);
+      return;
+    }
+
+    if (cache != nullptr) {
+      cache->Pool = this;
+      if (cache->Counts[sizeClass] < ThreadCacheLimit(sizeClass)) {
+        buffer->_next = cache->Heads[sizeClass];
+        cache->Heads[sizeClass] = buffer;
+        cache->Counts[sizeClass]++;
+        return;
+      }
+    }
+
+    if ((size_t)_impl->BytesPooled.load(std::memory_order_relaxed) + buffer->_capacity > _config.MaxPooledBytes) {
+      Free(buffer);
+      return;
+    }
+
+    SizeClassList& list = _impl->Classes[sizeClass];
+    {
+      std::lock_guard<std::mutex> lock(list.Lock);
+      buffer->_next = list.Head;
+      list.Head = buffer;
+    }
+
+    _impl->BuffersPooled.fetch_add(1, std::memory_order_relaxed);
+    _impl->BytesPooled.fetch_add(buffer->_capacity, std::memory_order_relaxed);
+  }
+
+  void MediaBufferPool::Reserve(size_t size, int count)
+  {
+    int sizeClass = GetSizeClass(size);
+    if (sizeClass < 0) {
+      return;
+    }
+
+    for (int i = 0; i < count; i++) {
+      MediaBuffer* buffer = Allocate(sizeClass, size);
+      if (buffer == nullptr) {
+        break;
+      }
+      Recycle(buffer, false);
+    }
+  }
+
+  void MediaBufferPool::Trim()
+  {
+    for (int sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++) {
+      SizeClassList& list = _impl->Classes[sizeClass];
+      MediaBuffer* buffer = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(list.Lock);
+        buffer = list.Head;
+        list.Head = nullptr;
+      }
+
+      while (buffer != nullptr) {
+        MediaBuffer* next = buffer->_next;
+        _impl->BuffersPooled.fetch_sub(1, std::memory_order_relaxed);
+        _impl->BytesPooled.fetch_sub(buffer->_capacity, std::memory_order_relaxed);
+        Free(buffer);
+        buffer = next;
+      }
+    }
+  }
+
+  MediaBufferPoolStats MediaBufferPool::GetStats() const
+  {
+    uint64_t counters[ThreadCacheRegistry::COUNTER_COUNT] = {
+      _impl->Acquires.load(std::memory_order_relaxed),
+      0,
+      _impl->Releases.load(std::memory_order_relaxed),
+      _impl->BytesAcquired.load(std::memory_order_relaxed),
+      _impl->BytesReleased.load(std::memory_order_relaxed)
+    };
+
+    if (_id < MAX_CACHED_POOLS) {
+      ThreadCacheRegistry& registry = ThreadCacheRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry.Lock);
+      for (int i = 0; i < ThreadCacheRegistry::COUNTER_COUNT; i++) {
+        counters[i] += registry.Retired[_id][i];
+      }
+      for (ThreadCache* threadCache : registry.Caches) {
+        threadCache->Pools[_id].ReadCounters(counters);
+      }
+    }
+
+    MediaBufferPoolStats stats;
+    stats.Acquires = counters[0];
+    stats.ThreadCacheHits = counters[1];
+    stats.PoolHits = _impl->PoolHits.load(std::memory_order_relaxed);
+    stats.SystemAllocations = _impl->SystemAllocations.load(std::memory_order_relaxed);
+    stats.SystemFrees = _impl->SystemFrees.load(std::memory_order_relaxed);
+    stats.Releases = counters[2];
+    // The counters are read without stopping other threads so can briefly be out of step.
+    stats.BuffersInUse = (counters[0] > counters[2]) ? counters[0] - counters[2] : 0;
+    stats.BytesInUse = (counters[3] > counters[4]) ? counters[3] - counters[4] : 0;
+    stats.BuffersPooled = (uint64_t)_impl->BuffersPooled.load(std::memory_order_relaxed);
+    stats.BytesPooled = (uint64_t)_impl->BytesPooled.load(std::memory_order_relaxed);
+    stats.BytesAllocated = (uint64_t)_impl->BytesAllocated.load(std::memory_order_relaxed);
+    return stats;
+  }
+}
@@ -0,0 +1,257 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaBuffer.h
+//
+// Description: Reference counted, aligned buffers for media frames and packets
+// and the size class pool they are allocated from. A single pool is shared by
+// all the native stages (image conversion, encode, decode, SRTP) so that in
+// the steady state no stage needs to go to the system allocator.
+//
+// Buffers are grouped in power of two size classes from 256 bytes to 16MB.
+// Released buffers go to a small per thread cache first and then to the
+// pool's shared free list. Requests larger than the biggest size class are
+// allocated directly and freed on release.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  class MediaBufferPool;
+
+  /**
+  * A reference counted buffer. Instances are only ever created by a MediaBufferPool
+  * and are normally held through a MediaBufferPtr.
+  */
+  class MediaBuffer
+  {
+  public:
+
+    /**
+    * The alignment of the data pointer. Suitable for SIMD loads and avoids false
+    * sharing between buffers.
+    */
+    static const size_t ALIGNMENT = 64;
+
+    uint8_t* Data() { return _data; }
+    const uint8_t* Data() const { return _data; }
+
+    /**
+    * The number of usable bytes in the buffer. May be larger than what was requested.
+    */
+    size_t Capacity() const { return _capacity; }
+
+    /**
+    * The number of bytes of valid data in the buffer, set by the stage that filled it.
+    */
+    size_t Length() const { return _length; }
+    void SetLength(size_t length) { _length = length; }
+
+    /**
+    * The frame or packet identifier the buffer currently holds, set by the stage
+    * that filled it.
+    */
+    uint64_t Id() const { return _id; }
+    void SetId(uint64_t id) { _id = id; }
+
+    void AddRef() { _refCount.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+    * Decrements the reference count and returns the buffer to its pool when it
+    * reaches zero.
+    */
+    void Release();
+
+  private:
+
+    friend class MediaBufferPool;
+    friend struct ThreadCache;
+
+    MediaBuffer() = default;
+
+    std::atomic<int32_t> _refCount{ 0 };
+    int32_t _sizeClass = 0;
+    MediaBufferPool* _pool = nullptr;
+    uint8_t* _data = nullptr;
+    size_t _capacity = 0;
+    size_t _length = 0;
+    uint64_t _id = 0;
+    MediaBuffer* _next = nullptr;     // Free list link, only used while the buffer is pooled.
+    bool _isMapped = false;           // Data was allocated with mmap/VirtualAlloc rather than the heap.
+  };
+
+  /**
+  * Smart pointer that holds a reference on a MediaBuffer.
+  */
+  class MediaBufferPtr
+  {
+  public:
+    MediaBufferPtr() = default;
+    explicit MediaBufferPtr(MediaBuffer* buffer) : _buffer(buffer) { }    // Takes over an existing reference.
+    MediaBufferPtr(const MediaBufferPtr& other) : _buffer(other._buffer) { if (_buffer) _buffer->AddRef(); }
+    MediaBufferPtr(MediaBufferPtr&& other) noexcept : _buffer(other._buffer) { other._buffer = nullptr; }
+    ~MediaBufferPtr() { Reset(); }
+
+    MediaBufferPtr& operator=(const MediaBufferPtr& other)
+    {
+      if (other._buffer) other._buffer->AddRef();
+      Reset();
+      _buffer = other._buffer;
+      return *this;
+    }
+
+    MediaBufferPtr& operator=(MediaBufferPtr&& other) noexcept
+    {
+      if (this != &other) {
+        Reset();
+        _buffer = other._buffer;
+        other._buffer = nullptr;
+      }
+      return *this;
+    }
+
+    void Reset()
+    {
+      if (_buffer) {
+        _buffer->Release();
+        _buffer = nullptr;
+      }
+    }
+
+    /**
+    * Gives up ownership of the reference without releasing it.
+    */
+    MediaBuffer* Detach()
+    {
+      MediaBuffer* buffer = _buffer;
+      _buffer = nullptr;
+      return buffer;
+    }
+
+    MediaBuffer* Get() const { return _buffer; }
+    MediaBuffer* operator->() const { return _buffer; }
+    explicit operator bool() const { return _buffer != nullptr; }
+
+  private:
+    MediaBuffer* _buffer = nullptr;
+  };
+
+  /**
+  * Pool occupancy and allocation counters. A steady state with no system
+  * allocations shows up as SystemAllocations no longer increasing.
+  */
+  struct MediaBufferPoolStats
+  {
+    uint64_t Acquires;              // Total buffers handed out.
+    uint64_t ThreadCacheHits;       // Acquires satisfied from the calling thread's cache.
+    uint64_t PoolHits;              // Acquires satisfied from the shared free list.
+    uint64_t SystemAllocations;     // Acquires that needed a new allocation from the system.
+    uint64_t SystemFrees;           // Buffers returned to the system.
+    uint64_t Releases;              // Buffers released back to the pool.
+    uint64_t BuffersInUse;          // Buffers currently held by callers.
+    uint64_t BytesInUse;            // Capacity of the buffers currently held by callers.
+    uint64_t BuffersPooled;         // Buffers on the shared free lists.
+    uint64_t BytesPooled;           // Capacity of the buffers on the shared free lists.
+    uint64_t BytesAllocated;        // Total capacity currently allocated from the system.
+  };
+
+  struct MediaBufferPoolConfig
+  {
+    /**
+    * Maximum number of bytes the shared free lists will hold on to. Buffers released
+    * once the limit is reached are returned to the system.
+    */
+    size_t MaxPooledBytes = 256 * 1024 * 1024;
+
+    /**
+    * If set size classes of 2MB and above are backed by huge/large pages when the
+    * operating system allows it, falling back to normal pages if not.
+    */
+    bool UseHugePages = false;
+
+    /**
+    * If 0 or more buffers of a page and above are allocated on this NUMA node.
+    * Smaller buffers are placed by the operating system when first written,
+    * normally on the node of the writing thread.
+    */
+    int NumaNode = -1;
+  };
+
+  class MediaBufferPool
+  {
+  public:
+
+    static const int SIZE_CLASS_COUNT = 17;         // 256 bytes to 16MB.
+    static const size_t MIN_SIZE_CLASS = 256;
+    static const size_t MAX_SIZE_CLASS = MIN_SIZE_CLASS << (SIZE_CLASS_COUNT - 1);
+
+    /**
+    * The process wide pool used by all stages unless a different one is supplied.
+    * It is never destroyed so buffers can safely be released during shutdown.
+    */
+    static MediaBufferPool& Default();
+
+    /**
+    * Gets a process wide pool whose buffers are allocated on a NUMA node. Returns
+    * the default pool if the node is negative or the host only has one node.
+    * Never destroyed.
+    */
+    static MediaBufferPool& ForNode(int node);
+
+    /**
+    * Creates a pool. A pool must outlive every buffer acquired from it. Threads
+    * may outlive it, buffers they still cache for it are freed when they exit.
+    */
+    explicit MediaBufferPool(const MediaBufferPoolConfig& config = MediaBufferPoolConfig());
+    ~MediaBufferPool();
+
+    MediaBufferPool(const MediaBufferPool&) = delete;
+    MediaBufferPool& operator=(const MediaBufferPool&) = delete;
+
+    /**
+    * Gets a buffer with a capacity of at least the requested size. The buffer's
+    * length is set to the requested size.
+    * @param[in] size: the number of bytes required.
+    * @@Returns: the buffer or an empty pointer if the allocation failed.
+    */
+    MediaBufferPtr Acquire(size_t size);
+
+    /**
+    * Pre-allocates buffers for a size class so the first frames don't hit the
+    * system allocator.
+    */
+    void Reserve(size_t size, int count);
+
+    /**
+    * Returns all pooled buffers to the system. Buffers in use are not affected.
+    */
+    void Trim();
+
+    MediaBufferPoolStats GetStats() const;
+
+    const MediaBufferPoolConfig& GetConfig() const { return _config; }
+
+  private:
+
+    friend class MediaBuffer;
+    friend struct ThreadCache;
+    struct Impl;
+
+    static int GetSizeClass(size_t size);
+
+    MediaBuffer* Allocate(int sizeClass, size_t size);
+    void Free(MediaBuffer* buffer);
+    static void Deallocate(MediaBuffer* buffer);      // Frees without touching the pool's counters.
+    void Recycle(MediaBuffer* buffer, bool isRelease);
+
+    MediaBufferPoolConfig _config;
+    Impl* _impl;
+    int _id;
+  };
+}
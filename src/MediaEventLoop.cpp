@@ -0,0 +1,428 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaEventLoop.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaEventLoop.h"
+#include "MediaLog.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#define poll WSAPoll
+typedef WSAPOLLFD pollfd;
+typedef int socklen_t;
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const int EVENT_BATCH = 64;
+
+    struct SocketWait
+    {
+      SOCKET Socket;
+      uint64_t DeadlineNanoseconds;     // 0 for no limit.
+      SocketWaitFunction Function;
+      void* Context;
+      TaskPriority Priority;
+      bool IsReady;
+    };
+
+    void DeliverWait(void* context)
+    {
+      SocketWait* wait = static_cast<SocketWait*>(context);
+      wait->Function(wait->Context, wait->IsReady);
+      delete wait;
+    }
+  }
+
+  /**
+  * On Linux each wait arms its socket in an epoll set, one shot, from the thread that
+  * starts it, so the loop's thread only runs when a socket is ready or a deadline
+  * passes. Elsewhere the loop polls every waiting socket and has to be woken to add
+  * one, the cost of a wake grows with the number of waits.
+  */
+  struct MediaEventLoop::Impl
+  {
+    MediaScheduler& Scheduler;
+    std::thread Thread;
+    std::atomic<bool> IsStopping{ false };
+
+    // The waits that haven't ended and, for those with a limit, their deadlines.
+    std::mutex Lock;
+    std::unordered_set<SocketWait*> Waits;
+    std::set<std::pair<uint64_t, SocketWait*>> Deadlines;
+
+    // A pipe can't be polled on Windows, so a loopback UDP socket sending to itself
+    // interrupts the wait instead.
+    SOCKET WakeSocket = INVALID_SOCKET;
+    sockaddr_in WakeAddress;
+
+#ifdef __linux__
+    int EpollFd = -1;
+#endif
+
+    explicit Impl(MediaScheduler& scheduler) : Scheduler(scheduler) { }
+
+    int Open()
+    {
+#ifdef _WIN32
+      WSADATA wsaData;
+      WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+      WakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+      if (WakeSocket == INVALID_SOCKET) {
+        return -1;
+      }
+
+      memset(&WakeAddress, 0, sizeof(WakeAddress));
+      WakeAddress.sin_family = AF_INET;
+      WakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t length = sizeof(WakeAddress);
+
+      if (bind(WakeSocket, reinterpret_cast<sockaddr*>(&WakeAddress), sizeof(WakeAddress)) != 0 ||
+        getsockname(WakeSocket, reinterpret_cast<sockaddr*>(&WakeAddress), &length) != 0) {
+        return -1;
+      }
+
+#ifdef __linux__
+      EpollFd = epoll_create1(EPOLL_CLOEXEC);
+      if (EpollFd < 0) {
+        return -1;
+      }
+
+      // The wake socket stays armed, it is the only entry without a wait.
+      epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.ptr = nullptr;
+      if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, WakeSocket, &event) != 0) {
+        return -1;
+      }
+#endif
+
+      return 0;
+    }
+
+    void Close()
+    {
+#ifdef __linux__
+      if (EpollFd >= 0) {
+        close(EpollFd);
+      }
+#endif
+      if (WakeSocket != INVALID_SOCKET) {
+        closesocket(WakeSocket);
+      }
+    }
+
+    void Wake()
+    {
+      char byte = 0;
+      sendto(WakeSocket, &byte, 1, 0, reinterpret_cast<const sockaddr*>(&WakeAddress), sizeof(WakeAddress));
+    }
+
+    void DrainWake()
+    {
+      char buffer[64];
+      pollfd fd = {};
+      fd.fd = WakeSocket;
+      fd.events = POLLIN;
+      while (poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN) != 0) {
+        recv(WakeSocket, buffer, sizeof(buffer), 0);
+      }
+    }
+
+    /**
+    * Starts watching a wait's socket, called with the lock held.
+    * @@Returns: true if the loop's thread needs waking to see the wait.
+    */
+    bool Arm(SocketWait* wait, int* result)
+    {
+      *result = 0;
+#ifdef __linux__
+      // A socket keeps its entry after a one shot wait, so it is normally modified.
+      epoll_event event = {};
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.ptr = wait;
+      if (epoll_ctl(EpollFd, EPOLL_CTL_MOD, wait->Socket, &event) != 0 &&
+        (errno != ENOENT || epoll_ctl(EpollFd, EPOLL_CTL_ADD, wait->Socket, &event) != 0)) {
+        *result = -1;
+        return false;
+      }
+
+      // Only a new earliest deadline changes how long the loop sleeps for.
+      return wait->DeadlineNanoseconds != 0 && Deadlines.begin()->second == wait;
+#else
+      return true;
+#endif
+    }
+
+    /**
+    * Stops watching a wait's socket once the wait has timed out, called with the lock held.
+    */
+    void Disarm(SocketWait* wait)
+    {
+#ifdef __linux__
+      epoll_ctl(EpollFd, EPOLL_CTL_DEL, wait->Socket, nullptr);
+#else
+      (void)wait;
+#endif
+    }
+
+    /**
+    * Removes a wait that has ended, called with the lock held.
+    * @@Returns: false if the wait had already ended.
+    */
+    bool Remove(SocketWait* wait)
+    {
+      if (Waits.erase(wait) == 0) {
+        return false;
+      }
+      if (wait->DeadlineNanoseconds != 0) {
+        Deadlines.erase(std::make_pair(wait->DeadlineNanoseconds, wait));
+      }
+      return true;
+    }
+
+    void Complete(SocketWait* wait, bool isReady)
+    {
+      wait->IsReady = isReady;
+
+      MediaTask task;
+      task.Run = DeliverWait;
+      task.Context = wait;
+      if (Scheduler.Submit(task, wait->Priority) != 0) {
+        DeliverWait(wait);
+      }
+    }
+
+    /**
+    * Waits for sockets to become ready, for up to timeoutMilliseconds, and adds the
+    * ready waits to the list.
+    */
+    void WaitReady(int timeoutMilliseconds, std::vector<SocketWait*>& ready)
+    {
+#ifdef __linux__
+      epoll_event events[EVENT_BATCH];
+      int count = epoll_wait(EpollFd, events, EVENT_BATCH, timeoutMilliseconds);
+
+      std::lock_guard<std::mutex> lock(Lock);
+      for (int i = 0; i < count; i++) {
+        SocketWait* wait = static_cast<SocketWait*>(events[i].data.ptr);
+        if (wait == nullptr) {
+          DrainWake();
+        }
+        else if (Remove(wait)) {
+          ready.push_back(wait);
+        }
+      }
+#else
+      std::vector<SocketWait*> polled;
+      std::vector<pollfd> fds;
+      {
+        std::lock_guard<std::mutex> lock(Lock);
+        polled.assign(Waits.begin(), Waits.end());
+      }
+
+      fds.resize(polled.size() + 1);
+      fds[0].fd = WakeSocket;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      for (size_t i = 0; i < polled.size(); i++) {
+        fds[i + 1].fd = polled[i]->Socket;
+        fds[i + 1].events = POLLIN;
+        fds[i + 1].revents = 0;
+      }
+
+      if (poll(fds.data(), (unsigned long)fds.size(), timeoutMilliseconds) <= 0) {
+        return;
+      }
+
+      if ((fds[0].revents & POLLIN) != 0) {
+        DrainWake();
+      }
+
+      // An error or hang up also ends the wait, the receive reports it. Only this
+      // thread removes waits so the polled ones are all still there.
+      std::lock_guard<std::mutex> lock(Lock);
+      for (size_t i = 0; i < polled.size(); i++) {
+        if ((fds[i + 1].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) != 0 && Remove(polled[i])) {
+          ready.push_back(polled[i]);
+        }
+      }
+#endif
+    }
+
+    void Run()
+    {
+      std::vector<SocketWait*> ready;
+      std::vector<SocketWait*> expired;
+
+      while (!IsStopping.load(std::memory_order_acquire)) {
+        int timeout = -1;
+        {
+          std::lock_guard<std::mutex> lock(Lock);
+          if (!Deadlines.empty()) {
+            uint64_t now = MediaScheduler::NowNanoseconds();
+            uint64_t deadline = Deadlines.begin()->first;
+            timeout = (deadline <= now) ? 0 : (int)((deadline - now + 999999) / 1000000);
+          }
+        }
+
+        WaitReady(timeout, ready);
+
+        {
+          std::lock_guard<std::mutex> lock(Lock);
+          uint64_t now = MediaScheduler::NowNanoseconds();
+          while (!Deadlines.empty() && Deadlines.begin()->first <= now) {
+            SocketWait* wait = Deadlines.begin()->second;
+            Remove(wait);
+            Disarm(wait);
+            expired.push_back(wait);
+          }
+        }
+
+        for (SocketWait* wait : ready) {
+          Complete(wait, true);
+        }
+        for (SocketWait* wait : expired) {
+          Complete(wait, false);
+        }
+        ready.clear();
+        expired.clear();
+      }
+
+      std::vector<SocketWait*> remaining;
+      {
+        std::lock_guard<std::mutex> lock(Lock);
+        remaining.assign(Waits.begin(), Waits.end());
+        for (SocketWait* wait : remaining) {
+          Remove(wait);
+          Disarm(wait);
+        }
+      }
+      for (SocketWait* wait : remaining) {
+        Complete(wait, false);
+      }
+    }
+  };
+
+  MediaEventLoop& MediaEventLoop::Default()
+  {
+    static MediaEventLoop* loop = new MediaEventLoop(MediaScheduler::Default());
+    return *loop;
+  }
+
+  MediaEventLoop::MediaEventLoop(MediaScheduler& scheduler) :
+    _impl(new Impl(scheduler))
+  {
+    if (_impl->Open() != 0) {
+      SIPSM_LOG_ERROR("The media event loop failed to create its wake up socket.");
+      _impl->IsStopping.store(true);
+      return;
+    }
+
+    _impl->Thread = std::thread([this]() { _impl->Run(); });
+  }
+
+  MediaEventLoop::~MediaEventLoop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_impl->Lock);
+      _impl->IsStopping.store(true, std::memory_order_release);
+    }
+
+    if (_impl->Thread.joinable()) {
+      _impl->Wake();
+      _impl->Thread.join();
+    }
+
+    _impl->Close();
+    delete _impl;
+  }
+
+  int MediaEventLoop::WaitReadable(SOCKET socket, int timeoutMilliseconds, SocketWaitFunction function, void* context,
+    TaskPriority priority)
+  {
+    if (function == nullptr) {
+      return -1;
+    }
+
+    SocketWait* wait = new SocketWait();
+    wait->Socket = socket;
+    wait->DeadlineNanoseconds = (timeoutMilliseconds >= 0) ?
+      MediaScheduler::NowNanoseconds() + (uint64_t)timeoutMilliseconds * 1000000ULL : 0;
+    wait->Function = function;
+    wait->Context = context;
+    wait->Priority = priority;
+    wait->IsReady = false;
+
+    bool isWakeNeeded = false;
+    {
+      std::lock_guard<std::mutex> lock(_impl->Lock);
+      if (_impl->IsStopping.load(std::memory_order_acquire)) {
+        delete wait;
+        return -1;
+      }
+
+      // Recorded before the socket is armed as it may be ready straight away.
+      _impl->Waits.insert(wait);
+      if (wait->DeadlineNanoseconds != 0) {
+        _impl->Deadlines.insert(std::make_pair(wait->DeadlineNanoseconds, wait));
+      }
+
+      int result = 0;
+      isWakeNeeded = _impl->Arm(wait, &result);
+      if (result != 0) {
+        SIPSM_LOG_WARNING("The media event loop failed to watch socket %d.", (int)socket);
+        _impl->Remove(wait);
+        delete wait;
+        return -1;
+      }
+    }
+
+    if (isWakeNeeded) {
+      _impl->Wake();
+    }
+    return 0;
+  }
+
+  int MediaEventLoop::GetWaitCount() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    return (int)_impl->Waits.size();
+  }
+
+  MediaScheduler& MediaEventLoop::GetScheduler() const
+  {
+    return _impl->Scheduler;
+  }
+}
@@ -0,0 +1,88 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaEventLoop.h
+//
+// Description: Waits for sockets to become readable without a blocked
+// thread per socket. One thread watches every socket being waited on, with
+// epoll on Linux and poll elsewhere, and when one becomes readable or its
+// wait times out queues the waiter's function on a MediaScheduler. Together
+// with the scheduler this is the event loop the awaitables in MediaAsync.h
+// resume from, so a few threads can serve thousands of sessions.
+//
+// A wait is one shot: the function is called exactly once, with isReady
+// false if the wait timed out or the loop was destroyed first.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaScheduler.h"
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+typedef int SOCKET;
+#endif
+
+namespace SIPSorceryMedia {
+
+  /**
+  * Called on a scheduler worker when a wait ends.
+  * @param[in] isReady: true if the socket is readable, false if the wait timed out or
+  *  the loop was destroyed.
+  */
+  typedef void (*SocketWaitFunction)(void* context, bool isReady);
+
+  class MediaEventLoop
+  {
+  public:
+
+    static const int WAIT_INFINITE = -1;
+
+    /**
+    * The process wide loop, resuming waiters on MediaScheduler::Default. Never destroyed.
+    */
+    static MediaEventLoop& Default();
+
+    /**
+    * Starts the loop's thread.
+    * @param[in] scheduler: the scheduler the wait functions are queued on, must outlive
+    *  the loop.
+    */
+    explicit MediaEventLoop(MediaScheduler& scheduler);
+
+    /**
+    * Ends the outstanding waits, with isReady false, and stops the loop's thread.
+    */
+    ~MediaEventLoop();
+
+    MediaEventLoop(const MediaEventLoop&) = delete;
+    MediaEventLoop& operator=(const MediaEventLoop&) = delete;
+
+    /**
+    * Waits for a socket to become readable and returns straight away.
+    * @param[in] socket: the socket, which stays owned by the caller and must stay open
+    *  until the function has been called.
+    * @param[in] timeoutMilliseconds: how long to wait or WAIT_INFINITE.
+    * @param[in] function: called once when the wait ends.
+    * @param[in] priority: the scheduler lane the function is queued on.
+    * @@Returns: 0 if the wait was started or -1 if the loop is stopping.
+    */
+    int WaitReadable(SOCKET socket, int timeoutMilliseconds, SocketWaitFunction function, void* context,
+      TaskPriority priority = TaskPriority::Video);
+
+    /**
+    * Gets the number of waits that haven't ended.
+    */
+    int GetWaitCount() const;
+
+    MediaScheduler& GetScheduler() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+}
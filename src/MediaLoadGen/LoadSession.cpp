@@ -0,0 +1,321 @@
+//-----------------------------------------------------------------------------
+// Filename: LoadSession.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "LoadSession.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+#include "MediaTrace.h"
+
+#include <string.h>
+
+namespace SIPSorceryMedia {
+  namespace LoadGen {
+
+    const char* const STAGE_NAMES[STAGE_COUNT] = {
+      "source", "convert", "encode", "packetise", "protect",
+      "transport", "unprotect", "depacketise", "decode"
+    };
+
+    namespace {
+      const uint8_t VP8_PAYLOAD_TYPE = 96;
+      const uint32_t RTP_VIDEO_CLOCK_RATE = 90000;
+
+      const OverloadStage OVERLOAD_STAGES[STAGE_COUNT] = {
+        OverloadStage::Capture, OverloadStage::Convert, OverloadStage::Encode, OverloadStage::Protect, OverloadStage::Protect,
+        OverloadStage::Protect, OverloadStage::Receive, OverloadStage::Receive, OverloadStage::Decode
+      };
+    }
+
+    LoadSession::LoadSession(int id, const LoadConfig& config, LoadStats& stats) :
+      _id(id),
+      _config(config),
+      _stats(stats),
+      _packetiser(0x5a000000 | (uint32_t)id, VP8_PAYLOAD_TYPE, config.MaxPacketSize)
+    { }
+
+    int LoadSession::Init(const SessionPlacement& placement, MediaBufferPool& pool)
+    {
+      _placement = placement;
+      _width = _config.Width;
+      _height = _config.Height;
+      _rgb.resize((size_t)_config.Width * _config.Height * 3);
+
+      _converter.SetBufferPool(&pool);
+      _encoder.SetBufferPool(&pool);
+      _packetiser.SetBufferPool(&pool);
+      _sendSrtp.SetBufferPool(&pool);
+      _receiveSrtp.SetBufferPool(&pool);
+      _depacketiser.SetBufferPool(&pool);
+      _decoder.SetBufferPool(&pool);
+
+      VpxEncoderConfig encoderConfig;
+      encoderConfig.TargetBitrate = _config.TargetBitrate;
+
+      int res = 0;
+      if (_config.EncoderWorkers != nullptr) {
+        _remoteEncoder.reset(new RemoteVpxEncoder(*_config.EncoderWorkers));
+        _remoteEncoder->SetBufferPool(&pool);
+        res = _remoteEncoder->InitEncoder(_config.Width, _config.Height, 1, encoderConfig);
+      }
+      else {
+        res = _encoder.InitEncoder(_config.Width, _config.Height, 1, encoderConfig);
+      }
+
+      if (res != 0 || _decoder.InitDecoder() != 0) {
+        SIPSM_LOG_ERROR("Load session %d failed to initialise its VP8 encoder or decoder.", _id);
+        return -1;
+      }
+
+      // Each session has its own key, the two ends of a session share it.
+      uint8_t key[SrtpNative::SRTP_MASTER_KEY_LEN];
+      for (int i = 0; i < SrtpNative::SRTP_MASTER_KEY_LEN; i++) {
+        key[i] = (uint8_t)(_id * 31 + i * 7);
+      }
+
+      if (_sendSrtp.InitWithKey(key, sizeof(key), true) != 0 || _receiveSrtp.InitWithKey(key, sizeof(key), false) != 0) {
+        SIPSM_LOG_ERROR("Load session %d failed to create its SRTP sessions.", _id);
+        return -1;
+      }
+
+      return 0;
+    }
+
+    bool LoadSession::BeginFrame(uint64_t dueNanoseconds)
+    {
+      if (_inFlight.exchange(true, std::memory_order_acquire)) {
+        if (dueNanoseconds >= _stats.MeasureFromNanoseconds) {
+          _stats.FramesDue.fetch_add(1, std::memory_order_relaxed);
+          _stats.FramesOverrun.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (_overload != nullptr) {
+          _overload->RecordFrame(true);
+        }
+        return false;
+      }
+
+      _dueNanoseconds = dueNanoseconds;
+
+      if (_overload != nullptr) {
+        _degradation = _overload->GetSettings();
+
+        if (_degradation.IsPaused || _frameCount % _degradation.FrameRateDivisor != 0) {
+          if (IsMeasuring()) {
+            _stats.FramesThrottled.fetch_add(1, std::memory_order_relaxed);
+          }
+          _frameCount++;
+          _inFlight.store(false, std::memory_order_release);
+          return false;
+        }
+      }
+
+      if (IsMeasuring()) {
+        _stats.FramesDue.fetch_add(1, std::memory_order_relaxed);
+      }
+      return true;
+    }
+
+    void LoadSession::RunTask(void* context)
+    {
+      static_cast<LoadSession*>(context)->ProcessFrame();
+    }
+
+    void LoadSession::ExpireTask(void* context)
+    {
+      static_cast<LoadSession*>(context)->ExpireFrame();
+    }
+
+    void LoadSession::ExpireFrame()
+    {
+      if (IsMeasuring()) {
+        _stats.FramesExpired.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (_overload != nullptr) {
+        _overload->RecordFrame(true);
+      }
+      _frameCount++;
+      _inFlight.store(false, std::memory_order_release);
+    }
+
+    void LoadSession::Record(LoadStage stage, uint64_t start, uint64_t end)
+    {
+      if (_overload != nullptr) {
+        _overload->RecordStage(OVERLOAD_STAGES[stage], end - start);
+      }
+      if (IsMeasuring()) {
+        _stats.StageDuration[stage].Record(end - start);
+      }
+    }
+
+    void LoadSession::FillSource(int width, int height)
+    {
+      // A diagonal gradient that moves every frame, so the encoder has real motion
+      // to code rather than a static image.
+      uint8_t shift = (uint8_t)(_frameCount * 3);
+      uint8_t* row = _rgb.data();
+
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          uint8_t value = (uint8_t)(x + y + shift);
+          row[x * 3] = value;
+          row[x * 3 + 1] = (uint8_t)(value ^ y);
+          row[x * 3 + 2] = (uint8_t)(_id * 40 + (y >> 3));
+        }
+        row += width * 3;
+      }
+    }
+
+    void LoadSession::ApplyDegradation()
+    {
+      // A real source would be asked to capture at the lower resolution, the
+      // synthetic one simply draws a smaller image.
+      int width = (_config.Width / _degradation.ResolutionDivisor) & ~1;
+      int height = (_config.Height / _degradation.ResolutionDivisor) & ~1;
+
+      if (width != _width || height != _height) {
+        int res = (_remoteEncoder) ? _remoteEncoder->SetResolution(width, height) : _encoder.SetResolution(width, height);
+        if (res == 0) {
+          _width = width;
+          _height = height;
+        }
+      }
+
+      if (_degradation.CpuUsed != _cpuUsed) {
+        int res = (_remoteEncoder) ? _remoteEncoder->SetCpuUsed(_degradation.CpuUsed) : _encoder.SetCpuUsed(_degradation.CpuUsed);
+        if (res == 0) {
+          _cpuUsed = _degradation.CpuUsed;
+        }
+      }
+    }
+
+    void LoadSession::ProcessFrame()
+    {
+      MediaTrace::SetCurrentFrame(((uint64_t)_id << 32) | (uint32_t)_frameCount);
+      uint32_t timestamp = (uint32_t)(_frameCount * RTP_VIDEO_CLOCK_RATE / _config.FramesPerSecond);
+      bool measuring = IsMeasuring();
+
+      if (_overload != nullptr) {
+        ApplyDegradation();
+      }
+
+      uint64_t start = MediaScheduler::NowNanoseconds();
+      FillSource(_width, _height);
+      uint64_t end = MediaScheduler::NowNanoseconds();
+      Record(StageSource, start, end);
+
+      MediaBufferPtr i420;
+      start = end;
+      int res = _converter.ConvertRGBtoYUV(_rgb.data(), AV_PIX_FMT_BGR24, _width, _height, _width * 3, AV_PIX_FMT_YUV420P, i420);
+      end = MediaScheduler::NowNanoseconds();
+      Record(StageConvert, start, end);
+
+      MediaBufferPtr encoded;
+      bool isKeyFrame = false;
+      if (res == 0) {
+        start = end;
+        res = (_remoteEncoder) ?
+          _remoteEncoder->Encode(i420->Data(), (int)i420->Length(), (int)_frameCount, encoded, &isKeyFrame) :
+          _encoder.Encode(i420->Data(), (int)i420->Length(), (int)_frameCount, encoded, &isKeyFrame);
+        end = MediaScheduler::NowNanoseconds();
+        Record(StageEncode, start, end);
+      }
+
+      if (res == 0 && encoded) {
+        if (measuring) {
+          _stats.FramesEncoded.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::vector<MediaBufferPtr> packets;
+        start = end;
+        res = _packetiser.Packetise(encoded->Data(), (int)encoded->Length(), timestamp, packets);
+        end = MediaScheduler::NowNanoseconds();
+        Record(StagePacketise, start, end);
+
+        start = end;
+        for (size_t i = 0; i < packets.size() && res == 0; i++) {
+          int protectedLength = 0;
+          res = _sendSrtp.ProtectRTP(packets[i]->Data(), (int)packets[i]->Length(), &protectedLength);
+          packets[i]->SetLength(protectedLength);
+        }
+        end = MediaScheduler::NowNanoseconds();
+        Record(StageProtect, start, end);
+
+        start = end;
+        uint64_t bytes = 0;
+        for (auto& packet : packets) {
+          bytes += packet->Length();
+          _wire.push_back(std::move(packet));
+        }
+        end = MediaScheduler::NowNanoseconds();
+        Record(StageTransport, start, end);
+
+        if (measuring) {
+          _stats.PacketsSent.fetch_add(packets.size(), std::memory_order_relaxed);
+          _stats.BytesSent.fetch_add(bytes, std::memory_order_relaxed);
+        }
+      }
+
+      // The receive side of the session.
+      if (res == 0 && !_wire.empty()) {
+        start = end;
+        for (auto& packet : _wire) {
+          int rtpLength = 0;
+          if (_receiveSrtp.UnprotectRTP(packet->Data(), (int)packet->Length(), &rtpLength) == 0) {
+            packet->SetLength(rtpLength);
+          }
+          else {
+            packet->SetLength(0);
+            res = -1;
+          }
+        }
+        end = MediaScheduler::NowNanoseconds();
+        Record(StageUnprotect, start, end);
+
+        MediaBufferPtr received;
+        start = end;
+        for (auto& packet : _wire) {
+          if (packet->Length() > 0) {
+            _depacketiser.Push(packet->Data(), (int)packet->Length(), received);
+          }
+        }
+        _wire.clear();
+        end = MediaScheduler::NowNanoseconds();
+        Record(StageDepacketise, start, end);
+
+        if (received) {
+          MediaBufferPtr decoded;
+          unsigned int width = 0, height = 0;
+          start = end;
+          if (_decoder.Decode(received->Data(), (int)received->Length(), decoded, &width, &height) != 0) {
+            res = -1;
+          }
+          end = MediaScheduler::NowNanoseconds();
+          Record(StageDecode, start, end);
+
+          if (decoded && measuring) {
+            _stats.FramesDecoded.fetch_add(1, std::memory_order_relaxed);
+            _stats.FrameLatency.Record(end - _dueNanoseconds);
+          }
+        }
+      }
+
+      if (res != 0 && measuring) {
+        _stats.Failures.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      if (_overload != nullptr) {
+        uint64_t interval = 1000000000ULL / _config.FramesPerSecond;
+        _overload->RecordFrame(MediaScheduler::NowNanoseconds() > _dueNanoseconds + interval);
+      }
+
+      _wire.clear();
+      _frameCount++;
+      _inFlight.store(false, std::memory_order_release);
+    }
+  }
+}
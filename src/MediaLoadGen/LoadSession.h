@@ -0,0 +1,164 @@
+//-----------------------------------------------------------------------------
+// Filename: LoadSession.h
+//
+// Description: A simulated WebRTC peer for the load generator. Each frame
+// runs through the real native send path, a synthetic source, RGB to I420
+// conversion, VP8 encode, RTP packetisation and SRTP protect, then across
+// an in-memory transport and back through the mirrored receive path, SRTP
+// unprotect, depacketisation and VP8 decode.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "EncoderService.h"
+#include "ImageConvertNative.h"
+#include "MediaBuffer.h"
+#include "MediaMetrics.h"
+#include "MediaTopology.h"
+#include "OverloadController.h"
+#include "SrtpNative.h"
+#include "Vp8Packetiser.h"
+#include "VpxEncoderNative.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+namespace SIPSorceryMedia {
+  namespace LoadGen {
+
+    enum LoadStage
+    {
+      StageSource = 0,
+      StageConvert,
+      StageEncode,
+      StagePacketise,
+      StageProtect,
+      StageTransport,
+      StageUnprotect,
+      StageDepacketise,
+      StageDecode,
+      STAGE_COUNT
+    };
+
+    extern const char* const STAGE_NAMES[STAGE_COUNT];
+
+    struct LoadConfig
+    {
+      int Width = 640;
+      int Height = 480;
+      int FramesPerSecond = 30;
+      unsigned int TargetBitrate = 500;     // In kbps.
+      int MaxPacketSize = Vp8Packetiser::DEFAULT_MAX_PACKET_SIZE;
+
+      /**
+      * Optional, encodes on these workers instead of in process.
+      */
+      EncoderWorkerPool* EncoderWorkers = nullptr;
+    };
+
+    /**
+    * Totals shared by all the sessions in a run. Only frames captured after
+    * MeasureFromNanoseconds are counted so encoder start up is excluded.
+    */
+    struct LoadStats
+    {
+      uint64_t MeasureFromNanoseconds = 0;
+
+      MetricHistogram StageDuration[STAGE_COUNT];
+      MetricHistogram FrameLatency;
+
+      std::atomic<uint64_t> FramesDue{ 0 };
+      std::atomic<uint64_t> FramesOverrun{ 0 };     // Due while the previous frame was still in flight.
+      std::atomic<uint64_t> FramesExpired{ 0 };     // Still queued when the next frame was due.
+      std::atomic<uint64_t> FramesThrottled{ 0 };   // Not sent because the overload controller said so.
+      std::atomic<uint64_t> FramesEncoded{ 0 };
+      std::atomic<uint64_t> FramesDecoded{ 0 };
+      std::atomic<uint64_t> PacketsSent{ 0 };
+      std::atomic<uint64_t> BytesSent{ 0 };
+      std::atomic<uint64_t> Failures{ 0 };
+    };
+
+    class LoadSession
+    {
+    public:
+      LoadSession(int id, const LoadConfig& config, LoadStats& stats);
+
+      /**
+      * Creates the encoder, decoder and SRTP contexts.
+      * @param[in] placement: the core group chosen for the session, its buffer pool is used
+      *  for all the stages.
+      * @@Returns: 0 if successful or -1 if not.
+      */
+      int Init(const SessionPlacement& placement, MediaBufferPool& pool);
+
+      /**
+      * Optional, puts the session under the control of the overload controller. The
+      * session reports its stage times and deadline misses and applies the degradation
+      * it is given.
+      */
+      void SetOverload(OverloadSession* overload) { _overload = overload; }
+      OverloadSession* GetOverload() const { return _overload; }
+
+      /**
+      * Claims the session for the frame due at the given time.
+      * @@Returns: false if the previous frame is still in flight, the frame is counted
+      *  as an overrun, or if the overload controller says to skip the frame.
+      */
+      bool BeginFrame(uint64_t dueNanoseconds);
+
+      /**
+      * Sends the claimed frame through the full pipeline and receives it again.
+      */
+      void ProcessFrame();
+
+      /**
+      * Gives up the claimed frame without processing it.
+      */
+      void ExpireFrame();
+
+      bool IsInFlight() const { return _inFlight.load(std::memory_order_acquire); }
+      const SessionPlacement& GetPlacement() const { return _placement; }
+
+      static void RunTask(void* context);
+      static void ExpireTask(void* context);
+
+    private:
+      void FillSource(int width, int height);
+      void ApplyDegradation();
+      void Record(LoadStage stage, uint64_t start, uint64_t end);
+      bool IsMeasuring() const { return _dueNanoseconds >= _stats.MeasureFromNanoseconds; }
+
+      int _id;
+      LoadConfig _config;
+      LoadStats& _stats;
+      SessionPlacement _placement;
+
+      std::atomic<bool> _inFlight{ false };
+      uint64_t _dueNanoseconds = 0;
+      uint64_t _frameCount = 0;
+
+      OverloadSession* _overload{ nullptr };
+      DegradationSettings _degradation;
+      int _cpuUsed = 0;
+      int _width = 0, _height = 0;
+
+      std::vector<uint8_t> _rgb;
+      ImageConvertNative _converter;
+      VpxEncoderNative _encoder;
+      std::unique_ptr<RemoteVpxEncoder> _remoteEncoder;   // Used instead of _encoder with EncoderWorkers.
+      Vp8Packetiser _packetiser;
+      SrtpNative _sendSrtp;
+
+      std::vector<MediaBufferPtr> _wire;     // The in-memory transport.
+
+      SrtpNative _receiveSrtp;
+      Vp8Depacketiser _depacketiser;
+      VpxEncoderNative _decoder;
+    };
+  }
+}
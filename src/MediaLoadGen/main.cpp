@@ -0,0 +1,467 @@
+//-----------------------------------------------------------------------------
+// Filename: main.cpp
+//
+// Description: In-process load generator for capacity testing. Runs N
+// simulated sessions through the real native media stack (see LoadSession.h)
+// on the media scheduler and reports how many sessions a core sustains,
+// the time spent in each stage and the capture to decode latency.
+//
+// A run is sustained if fewer than 1% of the frames were skipped because the
+// session fell behind and the 99th percentile latency is within the budget.
+// With --ramp the session count is increased by the step until a run is no
+// longer sustained, giving the capacity of the host.
+//
+// With --overload the sessions run under the overload controller (see
+// OverloadController.h). A quarter of the sessions are high priority, half
+// normal and a quarter low, and every fifth session isn't visible. With
+// --ramp and --offered-load the ramp is followed by a run at that
+// percentage of the capacity found, with the controller, to check that
+// the latency stays within the budget when the host is overloaded.
+//
+// With --encoder-workers the sessions encode on EncoderWorker processes (see
+// EncoderService.h), spread over the comma separated endpoints, instead of
+// in process. --encoder-worker runs this process as a worker on the
+// endpoint until it is killed.
+//
+// Usage:
+// MediaLoadGen [--sessions <n>] [--ramp <step>] [--max-sessions <n>]
+//   [--duration <s>] [--warmup <s>] [--width <px>] [--height <px>] [--fps <n>]
+//   [--bitrate <kbps>] [--latency-budget <ms>] [--placement spread|pack|none]
+//   [--group-size <n>] [--overload] [--offered-load <percent>] [--trace <file>]
+//   [--encoder-workers <endpoint>[,<endpoint>...]]
+// MediaLoadGen --encoder-worker <endpoint>
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "EncoderService.h"
+#include "LoadSession.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+#include "MediaTopology.h"
+#include "MediaTrace.h"
+#include "OverloadController.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace SIPSorceryMedia;
+using namespace SIPSorceryMedia::LoadGen;
+
+namespace {
+
+  const double MAX_SKIPPED_FRACTION = 0.01;
+
+  struct Options
+  {
+    LoadConfig Config;
+    MediaPlacementConfig Placement;
+    int Sessions = 8;
+    int RampStep = 0;
+    int MaxSessions = 1000;
+    int DurationSeconds = 10;
+    int WarmupSeconds = 2;
+    double LatencyBudgetMilliseconds = 0;   // 0 for one frame interval.
+    bool IsOverloadControlled = false;
+    int OfferedLoadPercent = 0;
+    std::string TracePath;
+    std::string EncoderWorkerEndpoint;
+    std::string EncoderWorkers;
+  };
+
+  struct TrialResult
+  {
+    int Sessions = 0;
+    double Seconds = 0;
+    double CpuSeconds = 0;
+    double SkippedFraction = 0;
+    double P99LatencyMilliseconds = 0;
+    bool IsSustained = false;
+    bool IsLatencyBounded = false;
+  };
+
+  /**
+  * Gets the user and kernel CPU time used by all the threads in the process.
+  */
+  double GetProcessCpuSeconds()
+  {
+#ifdef _WIN32
+    FILETIME creation, exitTime, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user);
+    auto toSeconds = [](const FILETIME& ft) {
+      return (double)(((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 1e7;
+    };
+    return toSeconds(kernel) + toSeconds(user);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+  }
+
+  void SleepUntil(uint64_t nanoseconds)
+  {
+    std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(nanoseconds)));
+  }
+
+  void PrintReport(const LoadStats& stats, const TrialResult& result, int processorCount)
+  {
+    double coresUsed = result.CpuSeconds / result.Seconds;
+    double sessionsPerCore = (coresUsed > 0) ? result.Sessions / coresUsed : 0;
+
+    printf("\nSessions %d for %.1fs on %d processors, %s.\n", result.Sessions, result.Seconds, processorCount,
+      (result.IsSustained) ? "sustained" : "NOT sustained");
+    printf("  CPU            %.2f cores used, %.1f sessions per core.\n", coresUsed, sessionsPerCore);
+    printf("  Frames         %llu due, %llu encoded, %llu decoded, %llu overrun, %llu expired, %llu failed, %llu throttled.\n",
+      (unsigned long long)stats.FramesDue.load(), (unsigned long long)stats.FramesEncoded.load(),
+      (unsigned long long)stats.FramesDecoded.load(), (unsigned long long)stats.FramesOverrun.load(),
+      (unsigned long long)stats.FramesExpired.load(), (unsigned long long)stats.Failures.load(),
+      (unsigned long long)stats.FramesThrottled.load());
+    printf("  Transport      %llu packets, %.2f Mbps per session.\n", (unsigned long long)stats.PacketsSent.load(),
+      stats.BytesSent.load() * 8.0 / result.Seconds / 1e6 / result.Sessions);
+
+    MetricHistogramSnapshot latency = stats.FrameLatency.Snapshot();
+    printf("  Latency (ms)   p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n", latency.P50 / 1e6, latency.P90 / 1e6,
+      latency.P99 / 1e6, latency.P999 / 1e6, latency.Max / 1e6);
+
+    uint64_t totalStage = 0;
+    MetricHistogramSnapshot stages[STAGE_COUNT];
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      stages[i] = stats.StageDuration[i].Snapshot();
+      totalStage += stages[i].Sum;
+    }
+
+    printf("  %-14s %10s %10s %10s %8s %12s\n", "Stage", "mean us", "p50 us", "p99 us", "share", "cores/100");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      const MetricHistogramSnapshot& s = stages[i];
+      double mean = (s.Count > 0) ? s.Sum / (double)s.Count / 1e3 : 0;
+      double share = (totalStage > 0) ? 100.0 * s.Sum / totalStage : 0;
+      double coresPer100 = s.Sum / 1e9 / result.Seconds * 100.0 / result.Sessions;
+      printf("  %-14s %10.1f %10.1f %10.1f %7.1f%% %12.3f\n", STAGE_NAMES[i], mean, s.P50 / 1e3, s.P99 / 1e3, share, coresPer100);
+    }
+  }
+
+  void PrintOverloadReport(const OverloadController& controller)
+  {
+    static const char* const LEVEL_NAMES[] = { "none", "fast encode", "reduced frame rate", "reduced resolution", "paused" };
+    OverloadStats stats = controller.GetStats();
+
+    printf("  Overload       %llu of %llu intervals overloaded, %llu shedding, %llu steps up, %llu steps down.\n",
+      (unsigned long long)stats.OverloadedIntervals, (unsigned long long)stats.Intervals,
+      (unsigned long long)stats.SheddingIntervals, (unsigned long long)stats.Escalations, (unsigned long long)stats.Relaxations);
+    printf("  Degradation    high %s, normal %s, low %s, %.0f%% of the cores in use.\n",
+      LEVEL_NAMES[(int)controller.GetLevel(SessionPriority::High)], LEVEL_NAMES[(int)controller.GetLevel(SessionPriority::Normal)],
+      LEVEL_NAMES[(int)controller.GetLevel(SessionPriority::Low)], controller.GetUtilisation() * 100);
+  }
+
+  SessionPriority PriorityForSession(int index)
+  {
+    switch (index % 4) {
+    case 0: return SessionPriority::High;
+    case 3: return SessionPriority::Low;
+    default: return SessionPriority::Normal;
+    }
+  }
+
+  TrialResult RunTrial(const Options& options, int sessionCount)
+  {
+    std::unique_ptr<LoadStats> stats(new LoadStats());
+    TrialResult result;
+    result.Sessions = sessionCount;
+
+    // Declared before the placement so the placement's schedulers, which run any
+    // queued frames when they stop, are destroyed first.
+    std::unique_ptr<OverloadController> overload;
+    std::vector<std::unique_ptr<LoadSession>> sessions;
+    std::vector<MediaScheduler*> schedulers;
+    MediaPlacement placement(options.Placement);
+
+    if (options.IsOverloadControlled) {
+      overload.reset(new OverloadController());
+    }
+
+    for (int i = 0; i < sessionCount; i++) {
+      SessionPlacement sessionPlacement = placement.PlaceSession();
+      std::unique_ptr<LoadSession> session(new LoadSession(i, options.Config, *stats));
+
+      if (session->Init(sessionPlacement, placement.GetBufferPool(sessionPlacement)) != 0) {
+        fprintf(stderr, "Failed to initialise session %d.\n", i);
+        exit(1);
+      }
+
+      if (overload) {
+        session->SetOverload(overload->AddSession(PriorityForSession(i), i % 5 != 4));
+      }
+
+      schedulers.push_back(&placement.GetScheduler(sessionPlacement));
+      sessions.push_back(std::move(session));
+    }
+
+    const uint64_t interval = 1000000000ULL / options.Config.FramesPerSecond;
+    const uint64_t start = MediaScheduler::NowNanoseconds() + 100000000ULL;
+    const uint64_t measureFrom = start + options.WarmupSeconds * 1000000000ULL;
+    const uint64_t end = measureFrom + options.DurationSeconds * 1000000000ULL;
+    stats->MeasureFromNanoseconds = measureFrom;
+
+    double cpuAtMeasureFrom = -1;
+
+    // Frames are due at the frame rate, with the sessions staggered across the
+    // frame interval as real peers would be.
+    for (uint64_t frame = 0;; frame++) {
+      uint64_t frameStart = start + frame * interval;
+      if (frameStart >= end) {
+        break;
+      }
+
+      for (int i = 0; i < sessionCount; i++) {
+        uint64_t due = frameStart + interval * i / sessionCount;
+        SleepUntil(due);
+
+        if (cpuAtMeasureFrom < 0 && due >= measureFrom) {
+          cpuAtMeasureFrom = GetProcessCpuSeconds();
+        }
+
+        if (overload) {
+          overload->Evaluate(due);
+        }
+
+        LoadSession* session = sessions[i].get();
+        if (session->BeginFrame(due)) {
+          MediaTask task;
+          task.Run = LoadSession::RunTask;
+          task.Context = session;
+          task.DeadlineNanoseconds = due + interval;
+          task.Expired = LoadSession::ExpireTask;
+
+          if (schedulers[i]->Submit(task, TaskPriority::Video) != 0) {
+            session->ExpireFrame();
+          }
+        }
+      }
+    }
+
+    SleepUntil(end);
+    result.CpuSeconds = GetProcessCpuSeconds() - cpuAtMeasureFrom;
+    result.Seconds = options.DurationSeconds;
+
+    for (auto& session : sessions) {
+      while (session->IsInFlight()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      placement.ReleaseSession(session->GetPlacement());
+    }
+
+    uint64_t due = stats->FramesDue.load();
+    uint64_t skipped = stats->FramesOverrun.load() + stats->FramesExpired.load();
+    double budget = (options.LatencyBudgetMilliseconds > 0) ? options.LatencyBudgetMilliseconds : interval / 1e6;
+
+    result.SkippedFraction = (due > 0) ? (double)skipped / due : 1.0;
+    result.P99LatencyMilliseconds = stats->FrameLatency.Snapshot().P99 / 1e6;
+    result.IsLatencyBounded = result.P99LatencyMilliseconds <= budget && stats->Failures.load() == 0;
+    result.IsSustained = result.IsLatencyBounded && result.SkippedFraction <= MAX_SKIPPED_FRACTION &&
+      stats->FramesThrottled.load() == 0;
+
+    PrintReport(*stats, result, MediaTopology::GetProcessorCount());
+    if (overload) {
+      PrintOverloadReport(*overload);
+    }
+    return result;
+  }
+
+  bool ParsePolicy(const char* name, AffinityPolicy& policy)
+  {
+    if (strcmp(name, "spread") == 0) {
+      policy = AffinityPolicy::Spread;
+    }
+    else if (strcmp(name, "pack") == 0) {
+      policy = AffinityPolicy::Pack;
+    }
+    else if (strcmp(name, "none") == 0) {
+      policy = AffinityPolicy::None;
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options options;
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+
+    if (strcmp(argv[i], "--sessions") == 0 && hasValue) {
+      options.Sessions = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--ramp") == 0 && hasValue) {
+      options.RampStep = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--max-sessions") == 0 && hasValue) {
+      options.MaxSessions = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--duration") == 0 && hasValue) {
+      options.DurationSeconds = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--warmup") == 0 && hasValue) {
+      options.WarmupSeconds = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--width") == 0 && hasValue) {
+      options.Config.Width = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--height") == 0 && hasValue) {
+      options.Config.Height = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--fps") == 0 && hasValue) {
+      options.Config.FramesPerSecond = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--bitrate") == 0 && hasValue) {
+      options.Config.TargetBitrate = (unsigned int)atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--latency-budget") == 0 && hasValue) {
+      options.LatencyBudgetMilliseconds = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--placement") == 0 && hasValue && ParsePolicy(argv[i + 1], options.Placement.Policy)) {
+      i++;
+    }
+    else if (strcmp(argv[i], "--group-size") == 0 && hasValue) {
+      options.Placement.GroupSize = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--overload") == 0) {
+      options.IsOverloadControlled = true;
+    }
+    else if (strcmp(argv[i], "--offered-load") == 0 && hasValue) {
+      options.OfferedLoadPercent = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--trace") == 0 && hasValue) {
+      options.TracePath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--encoder-worker") == 0 && hasValue) {
+      options.EncoderWorkerEndpoint = argv[++i];
+    }
+    else if (strcmp(argv[i], "--encoder-workers") == 0 && hasValue) {
+      options.EncoderWorkers = argv[++i];
+    }
+    else {
+      printf("Usage: %s [--sessions <n>] [--ramp <step>] [--max-sessions <n>] [--duration <s>] [--warmup <s>]\n"
+        "  [--width <px>] [--height <px>] [--fps <n>] [--bitrate <kbps>] [--latency-budget <ms>]\n"
+        "  [--placement spread|pack|none] [--group-size <n>] [--overload] [--offered-load <percent>] [--trace <file>]\n"
+        "  [--encoder-workers <endpoint>[,<endpoint>...]]\n"
+        "       %s --encoder-worker <endpoint>\n", argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  if (options.Sessions < 1 || options.DurationSeconds < 1 || options.Config.FramesPerSecond < 1 ||
+    options.Config.Width < 16 || options.Config.Height < 16) {
+    fprintf(stderr, "Invalid load parameters.\n");
+    return 1;
+  }
+
+  if (!options.EncoderWorkerEndpoint.empty()) {
+    EncoderWorker worker;
+    if (worker.Listen(options.EncoderWorkerEndpoint) != 0 || worker.Start() != 0) {
+      fprintf(stderr, "Failed to start the encoder worker on %s.\n", options.EncoderWorkerEndpoint.c_str());
+      return 1;
+    }
+
+    printf("Encoder worker listening on %s.\n", worker.GetEndpoint().c_str());
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+  }
+
+  EncoderWorkerPool encoderWorkers;
+  if (!options.EncoderWorkers.empty()) {
+    size_t start = 0;
+    while (start <= options.EncoderWorkers.size()) {
+      size_t comma = options.EncoderWorkers.find(',', start);
+      size_t end = (comma == std::string::npos) ? options.EncoderWorkers.size() : comma;
+      if (end > start) {
+        encoderWorkers.Add(options.EncoderWorkers.substr(start, end - start));
+      }
+      start = end + 1;
+    }
+    options.Config.EncoderWorkers = &encoderWorkers;
+  }
+
+  SrtpNative::InitialiseLibSrtp();
+  MediaLog::SetLevel(LogLevel::Warning);
+  MediaTrace::SetEnabled(!options.TracePath.empty());
+
+  printf("Load generator: %dx%d at %d fps, %u kbps, %d processors on %d NUMA nodes.\n", options.Config.Width,
+    options.Config.Height, options.Config.FramesPerSecond, options.Config.TargetBitrate,
+    MediaTopology::GetProcessorCount(), MediaTopology::GetNumaNodeCount());
+  if (encoderWorkers.GetWorkerCount() > 0) {
+    printf("Encoding on %d encoder workers.\n", encoderWorkers.GetWorkerCount());
+  }
+
+  int exitCode = 0;
+
+  if (options.RampStep > 0) {
+    TrialResult lastSustained;
+
+    for (int sessions = options.RampStep; sessions <= options.MaxSessions; sessions += options.RampStep) {
+      TrialResult result = RunTrial(options, sessions);
+      if (!result.IsSustained) {
+        break;
+      }
+      lastSustained = result;
+    }
+
+    if (lastSustained.Sessions > 0) {
+      double coresUsed = lastSustained.CpuSeconds / lastSustained.Seconds;
+      printf("\nCapacity: %d sessions sustained, %.1f sessions per core.\n", lastSustained.Sessions,
+        (coresUsed > 0) ? lastSustained.Sessions / coresUsed : 0);
+
+      if (options.OfferedLoadPercent > 0) {
+        Options overloaded = options;
+        overloaded.IsOverloadControlled = true;
+        int sessions = std::max(lastSustained.Sessions + 1, lastSustained.Sessions * options.OfferedLoadPercent / 100);
+
+        printf("\nOffered load %d%%, %d sessions under the overload controller.\n", options.OfferedLoadPercent, sessions);
+        TrialResult result = RunTrial(overloaded, sessions);
+        printf("\nLatency under %d%% offered load is %s, p99 %.2f ms.\n", options.OfferedLoadPercent,
+          (result.IsLatencyBounded) ? "bounded" : "NOT bounded", result.P99LatencyMilliseconds);
+        exitCode = (result.IsLatencyBounded) ? 0 : 2;
+      }
+    }
+    else {
+      printf("\nCapacity: the first step of %d sessions was not sustained.\n", options.RampStep);
+      exitCode = 2;
+    }
+  }
+  else {
+    // Under the overload controller degraded frames are expected, only the latency counts.
+    TrialResult result = RunTrial(options, options.Sessions);
+    exitCode = ((options.IsOverloadControlled) ? result.IsLatencyBounded : result.IsSustained) ? 0 : 2;
+  }
+
+  if (!options.TracePath.empty()) {
+    std::string trace = MediaTrace::Export(TraceFormat::ChromeJson);
+    FILE* file = fopen(options.TracePath.c_str(), "wb");
+    if (file != nullptr) {
+      fwrite(trace.data(), 1, trace.size(), file);
+      fclose(file);
+      printf("Trace written to %s.\n", options.TracePath.c_str());
+    }
+  }
+
+  MediaLog::Flush();
+  return exitCode;
+}
@@ -0,0 +1,298 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaLog.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaLog.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdarg.h>
+#include <stdio.h>
+#include <thread>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const uint64_t RATE_LIMIT_WINDOW_MILLISECONDS = 1000;
+
+    struct LogSlot
+    {
+      std::atomic<uint64_t> Sequence;
+      LogLevel Level;
+      uint32_t ThreadId;
+      int64_t Timestamp;
+      int Length;
+      char Message[MediaLog::MAX_MESSAGE_LENGTH];
+    };
+
+    /**
+    * The queue is a bounded multi-producer queue (Vyukov). Each slot's sequence says
+    * whether it is free for the producer that claims that position or holds a message
+    * for the writer. Producers claim positions with a CAS on Tail, only the writer
+    * thread advances Head. Never freed so logging works during process shutdown.
+    */
+    struct LogState
+    {
+      LogSlot Slots[MediaLog::QUEUE_CAPACITY];
+
+      alignas(64) std::atomic<uint64_t> Tail{ 0 };
+      alignas(64) uint64_t Head = 0;
+      std::atomic<uint64_t> Written{ 0 };
+      std::atomic<bool> IsWriterIdle{ false };
+
+      std::atomic<uint64_t> Dropped{ 0 };
+      std::atomic<uint64_t> Suppressed{ 0 };
+      std::atomic<uint32_t> RateLimit{ MediaLog::DEFAULT_RATE_LIMIT };
+
+      std::mutex Lock;
+      std::condition_variable WorkSignal;
+      std::condition_variable FlushSignal;
+
+      std::mutex SinkLock;
+      LogSinkCallback Sink = nullptr;
+      void* SinkContext = nullptr;
+
+      std::once_flag WriterStarted;
+      std::thread Writer;
+
+      LogState()
+      {
+        for (int i = 0; i < MediaLog::QUEUE_CAPACITY; i++) {
+          Slots[i].Sequence.store((uint64_t)i, std::memory_order_relaxed);
+        }
+      }
+
+      static LogState& Instance()
+      {
+        static LogState* state = new LogState();
+        return *state;
+      }
+    };
+
+    const char* LevelName(LogLevel level)
+    {
+      switch (level) {
+      case LogLevel::Trace: return "TRACE";
+      case LogLevel::Debug: return "DEBUG";
+      case LogLevel::Info: return "INFO";
+      case LogLevel::Warning: return "WARN";
+      case LogLevel::Error: return "ERROR";
+      default: return "CRIT";
+      }
+    }
+
+    uint32_t GetThreadId()
+    {
+#ifdef _WIN32
+      return (uint32_t)GetCurrentThreadId();
+#else
+      return (uint32_t)syscall(SYS_gettid);
+#endif
+    }
+
+    void WriteToStderr(const LogSlot& slot)
+    {
+      time_t seconds = (time_t)(slot.Timestamp / 1000);
+      struct tm utc;
+#ifdef _WIN32
+      gmtime_s(&utc, &seconds);
+#else
+      gmtime_r(&seconds, &utc);
+#endif
+
+      char time[32];
+      strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &utc);
+
+      fprintf(stderr, "%s.%03dZ %-5s [%u] %.*s\n", time, (int)(slot.Timestamp % 1000), LevelName(slot.Level),
+        slot.ThreadId, slot.Length, slot.Message);
+    }
+
+    void RunWriter(LogState& state)
+    {
+      while (true) {
+        bool hasWritten = false;
+
+        while (true) {
+          LogSlot& slot = state.Slots[state.Head % MediaLog::QUEUE_CAPACITY];
+          if (slot.Sequence.load(std::memory_order_acquire) != state.Head + 1) {
+            break;
+          }
+
+          {
+            std::lock_guard<std::mutex> sinkLock(state.SinkLock);
+            if (state.Sink != nullptr) {
+              state.Sink(slot.Level, slot.Message, (size_t)slot.Length, state.SinkContext);
+            }
+            else {
+              WriteToStderr(slot);
+            }
+          }
+
+          slot.Sequence.store(state.Head + MediaLog::QUEUE_CAPACITY, std::memory_order_release);
+          state.Head++;
+          state.Written.store(state.Head, std::memory_order_release);
+          hasWritten = true;
+        }
+
+        if (hasWritten) {
+          fflush(stderr);
+        }
+
+        std::unique_lock<std::mutex> lock(state.Lock);
+        if (hasWritten) {
+          state.FlushSignal.notify_all();
+        }
+
+        // Producers only signal when they see the writer idle. Either a producer sees
+        // the idle flag, and takes the lock so its signal can't land before the wait,
+        // or the writer sees its message here, both orders being seq_cst.
+        state.IsWriterIdle.store(true, std::memory_order_seq_cst);
+        if (state.Slots[state.Head % MediaLog::QUEUE_CAPACITY].Sequence.load(std::memory_order_seq_cst) != state.Head + 1) {
+          state.WorkSignal.wait(lock);
+        }
+        state.IsWriterIdle.store(false, std::memory_order_relaxed);
+      }
+    }
+
+    void Enqueue(LogState& state, LogLevel level, uint32_t suppressed, const char* format, va_list args)
+    {
+      std::call_once(state.WriterStarted, [&state]() {
+        state.Writer = std::thread([&state]() { RunWriter(state); });
+      });
+
+      uint64_t position = state.Tail.load(std::memory_order_relaxed);
+      LogSlot* slot;
+
+      while (true) {
+        slot = &state.Slots[position % MediaLog::QUEUE_CAPACITY];
+        int64_t diff = (int64_t)slot->Sequence.load(std::memory_order_acquire) - (int64_t)position;
+
+        if (diff == 0) {
+          if (state.Tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if (diff < 0) {
+          // Full, the writer hasn't freed this slot from the previous lap yet.
+          state.Dropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        else {
+          position = state.Tail.load(std::memory_order_relaxed);
+        }
+      }
+
+      int length = vsnprintf(slot->Message, sizeof(slot->Message), format, args);
+      length = (length < 0) ? 0 : (length >= (int)sizeof(slot->Message)) ? (int)sizeof(slot->Message) - 1 : length;
+
+      if (suppressed > 0 && length < (int)sizeof(slot->Message) - 1) {
+        int extra = snprintf(slot->Message + length, sizeof(slot->Message) - length, " (%u similar messages suppressed)", suppressed);
+        length = (extra < 0) ? length : (length + extra >= (int)sizeof(slot->Message)) ? (int)sizeof(slot->Message) - 1 : length + extra;
+      }
+
+      // Trailing new lines from messages that used to go to printf.
+      while (length > 0 && (slot->Message[length - 1] == '\n' || slot->Message[length - 1] == '\r')) {
+        length--;
+      }
+
+      slot->Length = length;
+      slot->Level = level;
+      slot->ThreadId = GetThreadId();
+      slot->Timestamp = (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+      slot->Sequence.store(position + 1, std::memory_order_seq_cst);
+
+      if (state.IsWriterIdle.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> lock(state.Lock);
+        state.WorkSignal.notify_one();
+      }
+    }
+  }
+
+  std::atomic<int> MediaLog::_level{ (int)LogLevel::Info };
+
+  void MediaLog::SetRateLimit(uint32_t messagesPerSecond)
+  {
+    LogState::Instance().RateLimit.store(messagesPerSecond, std::memory_order_relaxed);
+  }
+
+  void MediaLog::SetSink(LogSinkCallback sink, void* context)
+  {
+    LogState& state = LogState::Instance();
+    std::lock_guard<std::mutex> lock(state.SinkLock);
+    state.Sink = sink;
+    state.SinkContext = context;
+  }
+
+  void MediaLog::Write(LogSite* site, LogLevel level, const char* format, ...)
+  {
+    if (!IsEnabled(level)) {
+      return;
+    }
+
+    LogState& state = LogState::Instance();
+    uint32_t suppressed = 0;
+    uint32_t rateLimit = state.RateLimit.load(std::memory_order_relaxed);
+
+    if (site != nullptr && rateLimit > 0) {
+      uint64_t now = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+      uint64_t windowStart = site->WindowStart.load(std::memory_order_relaxed);
+
+      if (now - windowStart >= RATE_LIMIT_WINDOW_MILLISECONDS &&
+        site->WindowStart.compare_exchange_strong(windowStart, now, std::memory_order_relaxed)) {
+        site->WindowCount.store(0, std::memory_order_relaxed);
+        suppressed = site->Suppressed.exchange(0, std::memory_order_relaxed);
+      }
+
+      if (site->WindowCount.fetch_add(1, std::memory_order_relaxed) >= rateLimit) {
+        site->Suppressed.fetch_add(1, std::memory_order_relaxed);
+        state.Suppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    va_list args;
+    va_start(args, format);
+    Enqueue(state, level, suppressed, format, args);
+    va_end(args);
+  }
+
+  void MediaLog::Flush()
+  {
+    LogState& state = LogState::Instance();
+    uint64_t target = state.Tail.load(std::memory_order_acquire);
+
+    std::unique_lock<std::mutex> lock(state.Lock);
+    // The writer signals under the lock after every batch it writes.
+    while (state.Written.load(std::memory_order_acquire) < target) {
+      state.WorkSignal.notify_one();
+      state.FlushSignal.wait(lock);
+    }
+  }
+
+  uint64_t MediaLog::GetDroppedCount()
+  {
+    return LogState::Instance().Dropped.load(std::memory_order_relaxed);
+  }
+
+  uint64_t MediaLog::GetSuppressedCount()
+  {
+    return LogState::Instance().Suppressed.load(std::memory_order_relaxed);
+  }
+}
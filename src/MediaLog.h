@@ -0,0 +1,135 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaLog.h
+//
+// Description: Asynchronous logging for the native media code. A log call
+// formats its message into a slot in a bounded lock-free queue and returns,
+// a background thread hands the queued messages to the sink. The default
+// sink writes to stderr and can be replaced, for example to forward to the
+// .NET logger. Media threads never block on console or file I/O.
+//
+// Each call site is rate limited, by default to 10 messages a second, so an
+// error repeated on every packet or frame can't flood the queue. The number
+// of suppressed messages is appended to the site's first message in the next
+// window. If the queue is full the message is dropped and counted.
+//
+//   SIPSM_LOG_ERROR("VPX codec failed to decode the frame: %s.", error);
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  enum class LogLevel
+  {
+    Trace = 0,
+    Debug = 1,
+    Info = 2,
+    Warning = 3,
+    Error = 4,
+    Critical = 5,
+    Off = 6,
+  };
+
+  /**
+  * Receives each message on the background writer thread. The message is not null
+  * terminated and is only valid for the duration of the call.
+  */
+  typedef void (*LogSinkCallback)(LogLevel level, const char* message, size_t length, void* context);
+
+  /**
+  * Rate limiting state for a single log statement, see SIPSM_LOG.
+  */
+  struct LogSite
+  {
+    std::atomic<uint64_t> WindowStart{ 0 };
+    std::atomic<uint32_t> WindowCount{ 0 };
+    std::atomic<uint32_t> Suppressed{ 0 };
+  };
+
+  class MediaLog
+  {
+  public:
+
+    /**
+    * The number of messages that can be waiting for the writer thread.
+    */
+    static const int QUEUE_CAPACITY = 4096;
+
+    /**
+    * Longer messages are truncated.
+    */
+    static const int MAX_MESSAGE_LENGTH = 240;
+
+    static const uint32_t DEFAULT_RATE_LIMIT = 10;
+
+    static bool IsEnabled(LogLevel level) { return (int)level >= _level.load(std::memory_order_relaxed); }
+    static void SetLevel(LogLevel level) { _level.store((int)level, std::memory_order_relaxed); }
+    static LogLevel GetLevel() { return (LogLevel)_level.load(std::memory_order_relaxed); }
+
+    /**
+    * Sets the maximum number of messages each call site can log per second.
+    * @param[in] messagesPerSecond: the limit, 0 for no limit.
+    */
+    static void SetRateLimit(uint32_t messagesPerSecond);
+
+    /**
+    * Replaces the sink messages are written to. Waits for any message being written
+    * to the old sink to finish.
+    * @param[in] sink: the new sink or nullptr to restore the default stderr sink.
+    * @param[in] context: opaque value passed to the sink.
+    */
+    static void SetSink(LogSinkCallback sink, void* context);
+
+    /**
+    * Queues a message, use the SIPSM_LOG macros rather than calling directly.
+    * @param[in] site: the call site's rate limiting state, can be nullptr.
+    * @param[in] level: the message's level.
+    * @param[in] format: printf style format string.
+    */
+    static void Write(LogSite* site, LogLevel level, const char* format, ...);
+
+    /**
+    * Blocks until every message queued before the call has been written to the sink.
+    */
+    static void Flush();
+
+    /**
+    * Gets the number of messages dropped because the queue was full.
+    */
+    static uint64_t GetDroppedCount();
+
+    /**
+    * Gets the number of messages suppressed by the rate limit.
+    */
+    static uint64_t GetSuppressedCount();
+
+  private:
+    static std::atomic<int> _level;
+  };
+}
+
+#ifndef SIPSM_DISABLE_LOGGING
+#define SIPSM_LOG(level, ...)                                               \
+  do {                                                                      \
+    if (SIPSorceryMedia::MediaLog::IsEnabled(level)) {                      \
+      static SIPSorceryMedia::LogSite _logSite;                             \
+      SIPSorceryMedia::MediaLog::Write(&_logSite, level, __VA_ARGS__);      \
+    }                                                                       \
+  } while (0)
+#else
+#define SIPSM_LOG(level, ...) do { } while (0)
+#endif
+
+#define SIPSM_LOG_TRACE(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Trace, __VA_ARGS__)
+#define SIPSM_LOG_DEBUG(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Debug, __VA_ARGS__)
+#define SIPSM_LOG_INFO(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Info, __VA_ARGS__)
+#define SIPSM_LOG_WARNING(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Warning, __VA_ARGS__)
+#define SIPSM_LOG_ERROR(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Error, __VA_ARGS__)
+#define SIPSM_LOG_CRITICAL(...) SIPSM_LOG(SIPSorceryMedia::LogLevel::Critical, __VA_ARGS__)
@@ -0,0 +1,298 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaMemory.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaMemory.h"
+#include "MediaLog.h"
+
+#include <atomic>
+#include <stdlib.h>
+
+#include <openssl/crypto.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  struct MemoryAccount::Block
+  {
+    std::atomic<int64_t> Bytes[CATEGORY_COUNT];
+    std::atomic<int64_t> Total{ 0 };
+    std::atomic<int64_t> Peak{ 0 };
+
+    // One for the account plus one for every OpenSSL allocation charged to it, so
+    // memory freed after the account is gone doesn't touch a deleted block.
+    std::atomic<int64_t> References{ 1 };
+
+    Block()
+    {
+      for (int i = 0; i < CATEGORY_COUNT; i++) {
+        Bytes[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    void Add(int category, int64_t bytes)
+    {
+      Bytes[category].fetch_add(bytes, std::memory_order_relaxed);
+      int64_t total = Total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+      int64_t peak = Peak.load(std::memory_order_relaxed);
+      while (total > peak && !Peak.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+    }
+
+    void Release()
+    {
+      if (References.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+      }
+    }
+
+    MemoryUsage GetUsage() const
+    {
+      MemoryUsage usage;
+      usage.DtlsBytes = Bytes[(int)MemoryCategory::Dtls].load(std::memory_order_relaxed);
+      usage.SrtpBytes = Bytes[(int)MemoryCategory::Srtp].load(std::memory_order_relaxed);
+      usage.CodecBytes = Bytes[(int)MemoryCategory::Codec].load(std::memory_order_relaxed);
+      usage.ConvertBytes = Bytes[(int)MemoryCategory::Convert].load(std::memory_order_relaxed);
+      usage.OtherBytes = Bytes[(int)MemoryCategory::Other].load(std::memory_order_relaxed);
+      usage.TotalBytes = Total.load(std::memory_order_relaxed);
+      usage.PeakBytes = Peak.load(std::memory_order_relaxed);
+      return usage;
+    }
+  };
+
+  namespace {
+
+    // The account and category OpenSSL allocations on this thread are charged to,
+    // and the bytes charged on this thread so far so a scope can tell how much of
+    // the heap growth it has already seen.
+    thread_local MemoryAccount* t_account = nullptr;
+    thread_local MemoryCategory t_category = MemoryCategory::Other;
+    thread_local int64_t t_charged = 0;
+
+    std::atomic<bool> _isOpenSslHooked{ false };
+  }
+
+  // A friend of MemoryAccount rather than in the anonymous namespace so it can
+  // reach the account's block.
+  struct OpenSslHooks
+  {
+    /**
+    * Placed in front of every OpenSSL allocation. 16 bytes on all platforms so the
+    * memory returned to OpenSSL keeps malloc's alignment.
+    */
+    struct alignas(16) AllocationHeader
+    {
+      MemoryAccount::Block* Owner;
+      uint32_t Size;
+      uint32_t Category;
+    };
+
+    static_assert(sizeof(AllocationHeader) == 16, "The allocation header must not change the alignment.");
+
+    static MemoryAccount::Block& Unattributed()
+    {
+      static MemoryAccount::Block* block = new MemoryAccount::Block();
+      return *block;
+    }
+
+    static MemoryAccount::Block* CurrentBlock(MemoryAccount* account)
+    {
+      return (account != nullptr) ? account->_block : &Unattributed();
+    }
+
+    static void Charge(AllocationHeader* header, size_t size)
+    {
+      header->Owner = CurrentBlock(t_account);
+      header->Size = (uint32_t)size;
+      header->Category = (uint32_t)((t_account != nullptr) ? t_category : MemoryCategory::Other);
+
+      int64_t bytes = (int64_t)size + sizeof(AllocationHeader);
+      header->Owner->References.fetch_add(1, std::memory_order_relaxed);
+      header->Owner->Add(header->Category, bytes);
+      t_charged += bytes;
+    }
+
+    static void Uncharge(AllocationHeader* header)
+    {
+      int64_t bytes = (int64_t)header->Size + sizeof(AllocationHeader);
+      header->Owner->Add(header->Category, -bytes);
+      t_charged -= bytes;
+      header->Owner->Release();
+    }
+
+    static void* Malloc(size_t size, const char*, int)
+    {
+      if (size > UINT32_MAX) {
+        return nullptr;
+      }
+
+      AllocationHeader* header = static_cast<AllocationHeader*>(malloc(sizeof(AllocationHeader) + size));
+      if (header == nullptr) {
+        return nullptr;
+      }
+
+      Charge(header, size);
+      return header + 1;
+    }
+
+    static void Free(void* memory, const char*, int)
+    {
+      if (memory != nullptr) {
+        AllocationHeader* header = static_cast<AllocationHeader*>(memory) - 1;
+        Uncharge(header);
+        free(header);
+      }
+    }
+
+    static void* Realloc(void* memory, size_t size, const char* file, int line)
+    {
+      if (memory == nullptr) {
+        return Malloc(size, file, line);
+      }
+
+      if (size == 0) {
+        Free(memory, file, line);
+        return nullptr;
+      }
+
+      if (size > UINT32_MAX) {
+        return nullptr;
+      }
+
+      // The header moves with the memory. The old size is credited to its owner and
+      // the new size charged to whoever is resizing it.
+      AllocationHeader* header = static_cast<AllocationHeader*>(realloc(static_cast<AllocationHeader*>(memory) - 1,
+        sizeof(AllocationHeader) + size));
+      if (header == nullptr) {
+        return nullptr;
+      }
+
+      Uncharge(header);
+      Charge(header, size);
+      return header + 1;
+    }
+  };
+
+  MemoryAccount::MemoryAccount() :
+    _block(new Block())
+  { }
+
+  MemoryAccount::~MemoryAccount()
+  {
+    _block->Release();
+  }
+
+  void MemoryAccount::Add(MemoryCategory category, int64_t bytes)
+  {
+    _block->Add((int)category, bytes);
+  }
+
+  int64_t MemoryAccount::GetBytes() const
+  {
+    return _block->Total.load(std::memory_order_relaxed);
+  }
+
+  int64_t MemoryAccount::GetBytes(MemoryCategory category) const
+  {
+    return _block->Bytes[(int)category].load(std::memory_order_relaxed);
+  }
+
+  MemoryUsage MemoryAccount::GetUsage() const
+  {
+    return _block->GetUsage();
+  }
+
+  MemoryUsage MemoryAccount::GetUnattributedUsage()
+  {
+    return OpenSslHooks::Unattributed().GetUsage();
+  }
+
+  int MemoryAccount::EnableOpenSslAccounting()
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    static const int result = [] {
+      if (CRYPTO_set_mem_functions(OpenSslHooks::Malloc, OpenSslHooks::Realloc, OpenSslHooks::Free) != 1) {
+        SIPSM_LOG_INFO("OpenSSL had already allocated memory, its memory will be measured from the heap.");
+        return -1;
+      }
+      _isOpenSslHooked.store(true, std::memory_order_relaxed);
+      return 0;
+    }();
+    return result;
+#else
+    return -1;
+#endif
+  }
+
+  bool MemoryAccount::IsOpenSslHooked()
+  {
+    return _isOpenSslHooked.load(std::memory_order_relaxed);
+  }
+
+  int64_t MemoryAccount::GetHeapBytes()
+  {
+#if defined(_WIN32)
+    HEAP_SUMMARY summary;
+    summary.cb = sizeof(summary);
+    return (HeapSummary(GetProcessHeap(), 0, &summary)) ? (int64_t)summary.cbAllocated : 0;
+#elif defined(__APPLE__)
+    malloc_statistics_t stats;
+    malloc_zone_statistics(nullptr, &stats);
+    return (int64_t)stats.size_in_use;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return (int64_t)(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo info = mallinfo();
+    return (int64_t)(unsigned int)info.uordblks + (int64_t)(unsigned int)info.hblkhd;
+#else
+    return 0;
+#endif
+  }
+
+  MemoryAccountScope::MemoryAccountScope(MemoryAccount* account, MemoryCategory category, bool isHeapMeasured) :
+    _account(account),
+    _category(category),
+    _isHeapMeasured(isHeapMeasured)
+  {
+    if (_account != nullptr) {
+      _previousAccount = t_account;
+      _previousCategory = t_category;
+      t_account = account;
+      t_category = category;
+
+      _chargedBefore = t_charged;
+      _heapBefore = (_isHeapMeasured) ? MemoryAccount::GetHeapBytes() : 0;
+    }
+  }
+
+  MemoryAccountScope::~MemoryAccountScope()
+  {
+    if (_account != nullptr) {
+      if (_isHeapMeasured) {
+        // Whatever the heap grew by that wasn't already charged through the OpenSSL
+        // hooks or by a nested scope.
+        int64_t growth = MemoryAccount::GetHeapBytes() - _heapBefore - (t_charged - _chargedBefore);
+        if (growth != 0) {
+          _account->Add(_category, growth);
+          t_charged += growth;
+        }
+      }
+
+      t_account = _previousAccount;
+      t_category = _previousCategory;
+    }
+  }
+}
@@ -0,0 +1,141 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaMemory.h
+//
+// Description: Per session accounting of the memory held by the native
+// libraries. A server with tens of thousands of idle legs is limited by
+// what each leg keeps allocated in OpenSSL, libsrtp, libvpx and swscale,
+// none of which show up in the media buffer pool statistics.
+//
+// Each component (DtlsHandshakeNative, SrtpNative, VpxEncoderNative,
+// ImageConvertNative) can be given a MemoryAccount. While it creates,
+// resizes or frees its library contexts it opens a MemoryAccountScope and
+// the change in the size of the heap is charged to the account. If the
+// application calls EnableOpenSslAccounting at startup, memory allocated by
+// OpenSSL is counted exactly, through its allocation hooks, and charged to
+// the account of the scope open on the allocating thread whenever that is.
+// Otherwise OpenSSL is measured from the heap like the other libraries. The
+// heap measurement is an estimate if other threads allocate at the same time,
+// it is exact when sessions are set up on one thread.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  enum class MemoryCategory
+  {
+    Dtls = 0,
+    Srtp = 1,
+    Codec = 2,
+    Convert = 3,
+    Other = 4,
+  };
+
+  /**
+  * The bytes held by an account. All fields are plain 64 bit integers so the
+  * structure can be copied straight across the flat C API.
+  */
+  struct MemoryUsage
+  {
+    int64_t DtlsBytes;
+    int64_t SrtpBytes;
+    int64_t CodecBytes;
+    int64_t ConvertBytes;
+    int64_t OtherBytes;
+    int64_t TotalBytes;
+    int64_t PeakBytes;
+  };
+
+  class MemoryAccount
+  {
+  public:
+
+    static const int CATEGORY_COUNT = 5;
+
+    MemoryAccount();
+
+    /**
+    * Memory allocated by OpenSSL for the account and not yet freed stays valid, it is
+    * simply no longer reported.
+    */
+    ~MemoryAccount();
+
+    MemoryAccount(const MemoryAccount&) = delete;
+    MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+    /**
+    * Charges, or with a negative value credits, bytes to a category.
+    */
+    void Add(MemoryCategory category, int64_t bytes);
+
+    int64_t GetBytes() const;
+    int64_t GetBytes(MemoryCategory category) const;
+    MemoryUsage GetUsage() const;
+
+    /**
+    * Gets the memory allocated by OpenSSL while no account was in scope.
+    */
+    static MemoryUsage GetUnattributedUsage();
+
+    /**
+    * Optional, routes OpenSSL's allocations through the accounting. This replaces
+    * OpenSSL's allocator for the whole process, so every OpenSSL allocation, including
+    * the host's own TLS, pays a 16 byte header and an atomic update. OpenSSL only
+    * allows it before its first allocation, so call it at startup before any DTLS or
+    * SRTP session is created.
+    * @@Returns: 0 if the hooks are installed or -1 if OpenSSL had already allocated
+    *  memory, in which case OpenSSL is measured like the other libraries.
+    */
+    static int EnableOpenSslAccounting();
+
+    /**
+    * Whether OpenSSL's allocations are being counted through the hooks.
+    */
+    static bool IsOpenSslHooked();
+
+    /**
+    * Gets the bytes in use on the process heap, 0 if the platform can't say.
+    */
+    static int64_t GetHeapBytes();
+
+  private:
+    friend struct OpenSslHooks;
+
+    struct Block;
+    Block* _block;
+  };
+
+  /**
+  * Charges the heap growth on the calling thread while the scope is open to an
+  * account. Scopes nest, the memory is charged to the innermost one. A scope with
+  * no account does nothing.
+  */
+  class MemoryAccountScope
+  {
+  public:
+    /**
+    * @param[in] isHeapMeasured: false if everything allocated in the scope goes through
+    *  the OpenSSL hooks, so the heap isn't sampled and allocations made by other threads
+    *  at the same time can't be charged to the account.
+    */
+    MemoryAccountScope(MemoryAccount* account, MemoryCategory category, bool isHeapMeasured = true);
+    ~MemoryAccountScope();
+
+    MemoryAccountScope(const MemoryAccountScope&) = delete;
+    MemoryAccountScope& operator=(const MemoryAccountScope&) = delete;
+
+  private:
+    MemoryAccount* _account;
+    MemoryCategory _category;
+    bool _isHeapMeasured;
+    int64_t _heapBefore = 0;
+    int64_t _chargedBefore = 0;
+    MemoryAccount* _previousAccount = nullptr;
+    MemoryCategory _previousCategory = MemoryCategory::Other;
+  };
+}
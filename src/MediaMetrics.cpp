@@ -0,0 +1,372 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaMetrics.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaMetrics.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdarg.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  std::atomic<bool> MetricsControl::_enabled{ true };
+
+  unsigned int MetricsControl::AssignShard()
+  {
+    static std::atomic<unsigned int> nextShard{ 0 };
+    return nextShard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+  }
+
+  uint64_t MetricCounter::Value() const
+  {
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < MetricsControl::SHARD_COUNT; i++) {
+      total += _shards[i].Value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  uint64_t MetricHistogram::BucketUpperBound(int index)
+  {
+    if (index < SUB_BUCKET_COUNT) {
+      return (uint64_t)index;
+    }
+
+    int shift = index / SUB_BUCKET_HALF - 1;
+    uint64_t subBucket = (uint64_t)(index - shift * SUB_BUCKET_HALF);
+    return ((subBucket + 1) << shift) - 1;
+  }
+
+  MetricHistogramSnapshot MetricHistogram::Snapshot() const
+  {
+    MetricHistogramSnapshot snapshot{};
+    std::vector<uint64_t> counts(BUCKET_COUNT, 0);
+
+    for (unsigned int s = 0; s < HISTOGRAM_SHARD_COUNT; s++) {
+      snapshot.Sum += _shards[s].Sum.load(std::memory_order_relaxed);
+      for (int i = 0; i < BUCKET_COUNT; i++) {
+        counts[i] += _shards[s].Buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    int first = -1, last = -1;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+      if (counts[i] > 0) {
+        if (first < 0) {
+          first = i;
+        }
+        last = i;
+        snapshot.Count += counts[i];
+      }
+    }
+
+    if (snapshot.Count == 0) {
+      return snapshot;
+    }
+
+    snapshot.Min = (first == 0) ? 0 : BucketUpperBound(first - 1) + 1;
+    snapshot.Max = BucketUpperBound(last);
+
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t* results[] = { &snapshot.P50, &snapshot.P90, &snapshot.P99, &snapshot.P999 };
+
+    for (int q = 0; q < 4; q++) {
+      uint64_t rank = (uint64_t)(quantiles[q] * snapshot.Count + 0.5);
+      if (rank < 1) {
+        rank = 1;
+      }
+
+      uint64_t cumulative = 0;
+      for (int i = first; i <= last; i++) {
+        cumulative += counts[i];
+        if (cumulative >= rank) {
+          *results[q] = BucketUpperBound(i);
+          break;
+        }
+      }
+    }
+
+    return snapshot;
+  }
+
+  namespace {
+
+    enum class MetricType { Counter, Gauge, Histogram };
+
+    struct MetricEntry
+    {
+      std::string Name;
+      std::string Help;
+      std::string Labels;
+      MetricType Type;
+      std::unique_ptr<MetricCounter> Counter;
+      std::unique_ptr<MetricGauge> Gauge;
+      std::unique_ptr<MetricHistogram> Histogram;
+    };
+
+    const char* TypeName(MetricType type)
+    {
+      switch (type) {
+      case MetricType::Counter: return "counter";
+      case MetricType::Gauge: return "gauge";
+      default: return "summary";
+      }
+    }
+
+    std::string JoinLabels(const std::string& labels, const char* extra)
+    {
+      if (labels.empty() && extra == nullptr) {
+        return "";
+      }
+
+      std::string joined = "{" + labels;
+      if (extra != nullptr) {
+        if (!labels.empty()) {
+          joined += ",";
+        }
+        joined += extra;
+      }
+      return joined + "}";
+    }
+
+    std::string JsonEscape(const std::string& value)
+    {
+      std::string escaped;
+      for (char c : value) {
+        if (c == '"' || c == '\\') {
+          escaped += '\\';
+        }
+        escaped += c;
+      }
+      return escaped;
+    }
+
+    void AppendFormat(std::string& out, const char* format, ...)
+    {
+      char buffer[512];
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+
+      if (length > 0) {
+        out.append(buffer, std::min<size_t>((size_t)length, sizeof(buffer) - 1));
+      }
+    }
+  }
+
+  struct MetricsRegistry::Impl
+  {
+    mutable std::mutex Lock;
+    std::vector<std::unique_ptr<MetricEntry>> Entries;
+
+    MetricEntry& GetOrAdd(const std::string& name, const std::string& help, const std::string& labels, MetricType type)
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+
+      for (auto& entry : Entries) {
+        if (entry->Type == type && entry->Name == name && entry->Labels == labels) {
+          return *entry;
+        }
+      }
+
+      std::unique_ptr<MetricEntry> entry(new MetricEntry());
+      entry->Name = name;
+      entry->Help = help;
+      entry->Labels = labels;
+      entry->Type = type;
+
+      switch (type) {
+      case MetricType::Counter: entry->Counter.reset(new MetricCounter()); break;
+      case MetricType::Gauge: entry->Gauge.reset(new MetricGauge()); break;
+      case MetricType::Histogram: entry->Histogram.reset(new MetricHistogram()); break;
+      }
+
+      Entries.push_back(std::move(entry));
+      return *Entries.back();
+    }
+  };
+
+  MetricsRegistry& MetricsRegistry::Default()
+  {
+    // Deliberately never freed so metrics held in function level statics stay
+    // valid during process shutdown.
+    static MetricsRegistry* defaultRegistry = new MetricsRegistry();
+    return *defaultRegistry;
+  }
+
+  MetricsRegistry::MetricsRegistry() :
+    _impl(new Impl())
+  { }
+
+  MetricsRegistry::~MetricsRegistry()
+  {
+    delete _impl;
+  }
+
+  MetricCounter& MetricsRegistry::GetCounter(const std::string& name, const std::string& help, const std::string& labels)
+  {
+    return *_impl->GetOrAdd(name, help, labels, MetricType::Counter).Counter;
+  }
+
+  MetricGauge& MetricsRegistry::GetGauge(const std::string& name, const std::string& help, const std::string& labels)
+  {
+    return *_impl->GetOrAdd(name, help, labels, MetricType::Gauge).Gauge;
+  }
+
+  MetricHistogram& MetricsRegistry::GetHistogram(const std::string& name, const std::string& help, const std::string& labels)
+  {
+    return *_impl->GetOrAdd(name, help, labels, MetricType::Histogram).Histogram;
+  }
+
+  std::string MetricsRegistry::Snapshot(MetricsFormat format) const
+  {
+    // Copy the entry pointers so the values are read without holding the lock.
+    // Entries are never removed so the pointers remain valid.
+    std::vector<const MetricEntry*> entries;
+    {
+      std::lock_guard<std::mutex> lock(_impl->Lock);
+      for (auto& entry : _impl->Entries) {
+        entries.push_back(entry.get());
+      }
+    }
+
+    // Prometheus requires all the samples for a metric name to be grouped together.
+    std::stable_sort(entries.begin(), entries.end(),
+      [](const MetricEntry* a, const MetricEntry* b) { return a->Name < b->Name; });
+
+    std::string out;
+
+    if (format == MetricsFormat::Prometheus) {
+      const std::string* lastName = nullptr;
+
+      for (const MetricEntry* entry : entries) {
+        if (lastName == nullptr || *lastName != entry->Name) {
+          AppendFormat(out, "# HELP %s %s\n", entry->Name.c_str(), entry->Help.c_str());
+          AppendFormat(out, "# TYPE %s %s\n", entry->Name.c_str(), TypeName(entry->Type));
+          lastName = &entry->Name;
+        }
+
+        switch (entry->Type) {
+        case MetricType::Counter:
+          AppendFormat(out, "%s%s %llu\n", entry->Name.c_str(), JoinLabels(entry->Labels, nullptr).c_str(),
+            (unsigned long long)entry->Counter->Value());
+          break;
+        case MetricType::Gauge:
+          AppendFormat(out, "%s%s %lld\n", entry->Name.c_str(), JoinLabels(entry->Labels, nullptr).c_str(),
+            (long long)entry->Gauge->Value());
+          break;
+        case MetricType::Histogram:
+        {
+          MetricHistogramSnapshot h = entry->Histogram->Snapshot();
+          const char* quantiles[] = { "quantile=\"0.5\"", "quantile=\"0.9\"", "quantile=\"0.99\"", "quantile=\"0.999\"" };
+          uint64_t values[] = { h.P50, h.P90, h.P99, h.P999 };
+          for (int q = 0; q < 4; q++) {
+            AppendFormat(out, "%s%s %llu\n", entry->Name.c_str(), JoinLabels(entry->Labels, quantiles[q]).c_str(),
+              (unsigned long long)values[q]);
+          }
+          AppendFormat(out, "%s_sum%s %llu\n", entry->Name.c_str(), JoinLabels(entry->Labels, nullptr).c_str(), (unsigned long long)h.Sum);
+          AppendFormat(out, "%s_count%s %llu\n", entry->Name.c_str(), JoinLabels(entry->Labels, nullptr).c_str(), (unsigned long long)h.Count);
+          break;
+        }
+        }
+      }
+    }
+    else {
+      out += "{\"metrics\":[";
+
+      for (size_t i = 0; i < entries.size(); i++) {
+        const MetricEntry* entry = entries[i];
+
+        AppendFormat(out, "%s{\"name\":\"%s\",\"labels\":\"%s\",\"type\":\"%s\",", (i > 0) ? "," : "",
+          entry->Name.c_str(), JsonEscape(entry->Labels).c_str(), TypeName(entry->Type));
+
+        switch (entry->Type) {
+        case MetricType::Counter:
+          AppendFormat(out, "\"value\":%llu}", (unsigned long long)entry->Counter->Value());
+          break;
+        case MetricType::Gauge:
+          AppendFormat(out, "\"value\":%lld}", (long long)entry->Gauge->Value());
+          break;
+        case MetricType::Histogram:
+        {
+          MetricHistogramSnapshot h = entry->Histogram->Snapshot();
+          AppendFormat(out, "\"count\":%llu,\"sum\":%llu,\"min\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu}",
+            (unsigned long long)h.Count, (unsigned long long)h.Sum, (unsigned long long)h.Min, (unsigned long long)h.Max,
+            (unsigned long long)h.P50, (unsigned long long)h.P90, (unsigned long long)h.P99, (unsigned long long)h.P999);
+          break;
+        }
+        }
+      }
+
+      out += "]}";
+    }
+
+    return out;
+  }
+
+  struct MetricsReporter::Impl
+  {
+    std::thread Thread;
+    std::mutex Lock;
+    std::condition_variable Signal;
+    bool IsStopping = false;
+  };
+
+  MetricsReporter::MetricsReporter() :
+    _impl(new Impl())
+  { }
+
+  MetricsReporter::~MetricsReporter()
+  {
+    Stop();
+    delete _impl;
+  }
+
+  void MetricsReporter::Start(MetricsRegistry& registry, int intervalMilliseconds, MetricsFormat format, MetricsReportCallback callback, void* context)
+  {
+    Stop();
+
+    _impl->IsStopping = false;
+    Impl* impl = _impl;
+
+    _impl->Thread = std::thread([impl, &registry, intervalMilliseconds, format, callback, context]() {
+      std::unique_lock<std::mutex> lock(impl->Lock);
+
+      while (!impl->IsStopping) {
+        impl->Signal.wait_for(lock, std::chrono::milliseconds(intervalMilliseconds), [impl] { return impl->IsStopping; });
+        if (impl->IsStopping) {
+          break;
+        }
+
+        lock.unlock();
+        std::string snapshot = registry.Snapshot(format);
+        callback(snapshot.c_str(), snapshot.size(), context);
+        lock.lock();
+      }
+    });
+  }
+
+  void MetricsReporter::Stop()
+  {
+    if (_impl->Thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_impl->Lock);
+        _impl->IsStopping = true;
+      }
+      _impl->Signal.notify_all();
+      _impl->Thread.join();
+    }
+  }
+}
@@ -0,0 +1,307 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaMetrics.h
+//
+// Description: Process wide metrics for the native media stages. Provides
+// counters, gauges and latency histograms that are cheap enough to update
+// on every packet or frame, a registry they are looked up from by name and
+// exporters for the Prometheus text format and JSON.
+//
+// Counters and histograms are sharded: each thread updates its own cache
+// line so media threads never contend with each other. The shards are only
+// summed when a snapshot is taken. Histograms use a log-linear (HDR style)
+// bucket layout covering 1ns to ~18 minutes with ~3% relative error.
+//
+// Metrics are registered once, typically into a function level static, and
+// live for the life of the process:
+//
+//   static MetricCounter& packets = MetricsRegistry::Default().GetCounter(
+//     "sipsm_srtp_packets_total", "Packets processed.", "op=\"protect\"");
+//   packets.Add(1);
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  enum class MetricsFormat
+  {
+    Prometheus = 0,
+    Json = 1,
+  };
+
+  /**
+  * Global switch for recording. When disabled every update is a single relaxed
+  * load and a branch.
+  */
+  class MetricsControl
+  {
+  public:
+    static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+
+    /**
+    * Gets the shard the calling thread should update. Threads are assigned shards
+    * round robin the first time they record a metric.
+    */
+    static unsigned int ThreadShard()
+    {
+      static thread_local unsigned int shard = AssignShard();
+      return shard;
+    }
+
+    static const unsigned int SHARD_COUNT = 16;
+
+  private:
+    static unsigned int AssignShard();
+    static std::atomic<bool> _enabled;
+  };
+
+  /**
+  * Monotonically increasing count, e.g. packets protected.
+  */
+  class MetricCounter
+  {
+  public:
+    void Add(uint64_t value = 1)
+    {
+      if (MetricsControl::IsEnabled()) {
+        _shards[MetricsControl::ThreadShard()].Value.fetch_add(value, std::memory_order_relaxed);
+      }
+    }
+
+    uint64_t Value() const;
+
+  private:
+    struct alignas(64) Shard
+    {
+      std::atomic<uint64_t> Value{ 0 };
+    };
+
+    Shard _shards[MetricsControl::SHARD_COUNT];
+  };
+
+  /**
+  * Value that can go up and down, e.g. active sessions. Gauges are not sharded
+  * as they are expected to change at a much lower rate than counters.
+  */
+  class MetricGauge
+  {
+  public:
+    void Set(int64_t value) { _value.store(value, std::memory_order_relaxed); }
+    void Add(int64_t value) { _value.fetch_add(value, std::memory_order_relaxed); }
+    int64_t Value() const { return _value.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<int64_t> _value{ 0 };
+  };
+
+  /**
+  * Summary of a histogram taken at a point in time.
+  */
+  struct MetricHistogramSnapshot
+  {
+    uint64_t Count;
+    uint64_t Sum;
+    uint64_t Min;
+    uint64_t Max;
+    uint64_t P50;
+    uint64_t P90;
+    uint64_t P99;
+    uint64_t P999;
+  };
+
+  /**
+  * Log-linear histogram of non-negative integer values, normally latencies in
+  * nanoseconds.
+  */
+  class MetricHistogram
+  {
+  public:
+
+    static const int SUB_BUCKET_BITS = 6;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static const int MAX_VALUE_BITS = 40;
+    static const int BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) * SUB_BUCKET_HALF;
+
+    void Record(uint64_t value)
+    {
+      if (MetricsControl::IsEnabled()) {
+        Shard& shard = _shards[MetricsControl::ThreadShard() % HISTOGRAM_SHARD_COUNT];
+        shard.Buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.Sum.fetch_add(value, std::memory_order_relaxed);
+      }
+    }
+
+    /**
+    * Gets the bucket a value is counted in. Values below SUB_BUCKET_COUNT have a
+    * bucket each, above that every power of two is split into SUB_BUCKET_HALF
+    * linear buckets.
+    */
+    static int BucketIndex(uint64_t value)
+    {
+      if (value < (uint64_t)SUB_BUCKET_COUNT) {
+        return (int)value;
+      }
+
+      int msb = HighestBit(value);
+      if (msb >= MAX_VALUE_BITS) {
+        return BUCKET_COUNT - 1;
+      }
+
+      int shift = msb - SUB_BUCKET_BITS + 1;
+      return shift * SUB_BUCKET_HALF + (int)(value >> shift);
+    }
+
+    /**
+    * Gets the highest value that is counted in a bucket.
+    */
+    static uint64_t BucketUpperBound(int index);
+
+    MetricHistogramSnapshot Snapshot() const;
+
+  private:
+
+    static const unsigned int HISTOGRAM_SHARD_COUNT = 4;
+
+    static int HighestBit(uint64_t value)
+    {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanReverse64(&index, value);
+      return (int)index;
+#else
+      return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    struct alignas(64) Shard
+    {
+      std::atomic<uint64_t> Sum{ 0 };
+      std::atomic<uint64_t> Buckets[BUCKET_COUNT];
+
+      Shard()
+      {
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+          Buckets[i].store(0, std::memory_order_relaxed);
+        }
+      }
+    };
+
+    Shard _shards[HISTOGRAM_SHARD_COUNT];
+  };
+
+  /**
+  * Records the time from construction to destruction into a histogram in nanoseconds.
+  */
+  class ScopedLatency
+  {
+  public:
+    explicit ScopedLatency(MetricHistogram& histogram) :
+      _histogram(histogram),
+      _enabled(MetricsControl::IsEnabled())
+    {
+      if (_enabled) {
+        _start = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~ScopedLatency()
+    {
+      if (_enabled) {
+        auto elapsed = std::chrono::steady_clock::now() - _start;
+        _histogram.Record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+      }
+    }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+  private:
+    MetricHistogram& _histogram;
+    bool _enabled;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  class MetricsRegistry
+  {
+  public:
+
+    /**
+    * The process wide registry used by all the native stages. Never destroyed.
+    */
+    static MetricsRegistry& Default();
+
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    /**
+    * Gets or creates a metric. The returned reference remains valid for the life of
+    * the registry. Calling with the same name and labels returns the same metric.
+    * @param[in] name: the metric name, e.g. sipsm_vpx_frames_total.
+    * @param[in] help: description included in the Prometheus output.
+    * @param[in] labels: optional Prometheus label pairs, e.g. type="key".
+    */
+    MetricCounter& GetCounter(const std::string& name, const std::string& help, const std::string& labels = "");
+    MetricGauge& GetGauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    MetricHistogram& GetHistogram(const std::string& name, const std::string& help, const std::string& labels = "");
+
+    /**
+    * Writes the current value of every registered metric.
+    * @param[in] format: Prometheus text exposition format or JSON.
+    * @@Returns: the formatted snapshot.
+    */
+    std::string Snapshot(MetricsFormat format) const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+
+  typedef void (*MetricsReportCallback)(const char* snapshot, size_t length, void* context);
+
+  /**
+  * Background thread that periodically snapshots a registry and hands the result
+  * to a callback, e.g. to write a file scraped by Prometheus or forward to .NET.
+  */
+  class MetricsReporter
+  {
+  public:
+    MetricsReporter();
+    ~MetricsReporter();
+
+    /**
+    * Starts the reporter thread. Any existing reporter thread is stopped first.
+    * @param[in] registry: the registry to snapshot.
+    * @param[in] intervalMilliseconds: the period between snapshots.
+    * @param[in] format: the format to pass to the callback.
+    * @param[in] callback: called on the reporter thread with each snapshot.
+    * @param[in] context: opaque value passed to the callback.
+    */
+    void Start(MetricsRegistry& registry, int intervalMilliseconds, MetricsFormat format, MetricsReportCallback callback, void* context);
+
+    /**
+    * Stops the reporter thread, blocking until it exits.
+    */
+    void Stop();
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+}
@@ -0,0 +1,516 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaScheduler.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaScheduler.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTopology.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const int IDLE_SPIN_COUNT = 64;
+
+    struct PriorityMetrics
+    {
+      MetricCounter& Executed;
+      MetricCounter& Expired;
+      MetricHistogram& QueueDelay;
+
+      PriorityMetrics(const char* labels) :
+        Executed(MetricsRegistry::Default().GetCounter("sipsm_scheduler_tasks_total", "Tasks run by the media scheduler.", labels)),
+        Expired(MetricsRegistry::Default().GetCounter("sipsm_scheduler_tasks_expired_total", "Tasks skipped because their deadline passed.", labels)),
+        QueueDelay(MetricsRegistry::Default().GetHistogram("sipsm_scheduler_queue_delay_ns", "Time from a task being submitted to it starting.", labels))
+      { }
+    };
+
+    PriorityMetrics _priorityMetrics[MediaScheduler::PRIORITY_COUNT] = {
+      PriorityMetrics("priority=\"audio\""),
+      PriorityMetrics("priority=\"retransmit\""),
+      PriorityMetrics("priority=\"video\""),
+      PriorityMetrics("priority=\"background\""),
+    };
+
+    MetricCounter& _steals = MetricsRegistry::Default().GetCounter("sipsm_scheduler_steals_total", "Tasks taken from another worker's queue.");
+
+    struct TaskItem
+    {
+      TaskFunction Run;
+      void* Context;
+      uint64_t Deadline;
+      TaskFunction Expired;
+      uint64_t SubmittedAt;
+    };
+
+    struct TaskSlot
+    {
+      std::atomic<TaskFunction> Run{ nullptr };
+      std::atomic<void*> Context{ nullptr };
+      std::atomic<uint64_t> Deadline{ 0 };
+      std::atomic<TaskFunction> Expired{ nullptr };
+      std::atomic<uint64_t> SubmittedAt{ 0 };
+    };
+
+    /**
+    * Bounded single producer, multiple consumer FIFO. Only the owning worker pushes.
+    * The owner and thieves both take the oldest task, oldest first keeps the queue
+    * delay of media tasks fair where a LIFO owner would starve older frames. A
+    * consumer copies the slot before claiming it with a CAS on the head. If the
+    * producer reused the slot meanwhile the CAS fails and the copy is discarded.
+    */
+    class WorkerQueue
+    {
+    public:
+      bool Push(const TaskItem& item)
+      {
+        int64_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) >= MediaScheduler::WORKER_QUEUE_CAPACITY) {
+          return false;
+        }
+
+        TaskSlot& slot = _slots[tail % MediaScheduler::WORKER_QUEUE_CAPACITY];
+        slot.Run.store(item.Run, std::memory_order_relaxed);
+        slot.Context.store(item.Context, std::memory_order_relaxed);
+        slot.Deadline.store(item.Deadline, std::memory_order_relaxed);
+        slot.Expired.store(item.Expired, std::memory_order_relaxed);
+        slot.SubmittedAt.store(item.SubmittedAt, std::memory_order_relaxed);
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+
+      bool Take(TaskItem& item)
+      {
+        int64_t head = _head.load(std::memory_order_acquire);
+
+        while (head < _tail.load(std::memory_order_acquire)) {
+          TaskSlot& slot = _slots[head % MediaScheduler::WORKER_QUEUE_CAPACITY];
+          item.Run = slot.Run.load(std::memory_order_relaxed);
+          item.Context = slot.Context.load(std::memory_order_relaxed);
+          item.Deadline = slot.Deadline.load(std::memory_order_relaxed);
+          item.Expired = slot.Expired.load(std::memory_order_relaxed);
+          item.SubmittedAt = slot.SubmittedAt.load(std::memory_order_relaxed);
+
+          if (_head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      bool IsEmpty() const
+      {
+        return _head.load(std::memory_order_acquire) >= _tail.load(std::memory_order_acquire);
+      }
+
+    private:
+      alignas(64) std::atomic<int64_t> _head{ 0 };
+      alignas(64) std::atomic<int64_t> _tail{ 0 };
+      TaskSlot _slots[MediaScheduler::WORKER_QUEUE_CAPACITY];
+    };
+
+    struct InjectionQueue
+    {
+      std::mutex Lock;
+      std::deque<TaskItem> Items;
+      std::atomic<int> Count{ 0 };
+    };
+
+    struct Worker
+    {
+      WorkerQueue Queues[MediaScheduler::PRIORITY_COUNT];
+      std::thread Thread;
+      uint32_t RandomState;
+
+      // Only updated by the worker's own thread.
+      alignas(64) std::atomic<uint64_t> Submitted{ 0 };
+      std::atomic<uint64_t> Executed{ 0 };
+      std::atomic<uint64_t> Expired{ 0 };
+      std::atomic<uint64_t> Steals{ 0 };
+      std::atomic<uint64_t> Overflows{ 0 };
+    };
+
+    void Bump(std::atomic<uint64_t>& counter)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+  }
+
+  struct MediaScheduler::Impl
+  {
+    MediaSchedulerConfig Config;
+    std::vector<std::unique_ptr<Worker>> Workers;
+    InjectionQueue Injection[PRIORITY_COUNT];
+
+    std::mutex IdleLock;
+    std::condition_variable IdleSignal;
+    std::atomic<int> IdleCount{ 0 };
+    std::atomic<bool> IsStopping{ false };
+
+    std::atomic<uint64_t> ExternalSubmitted{ 0 };
+
+    bool HasWork()
+    {
+      for (int p = 0; p < PRIORITY_COUNT; p++) {
+        if (Injection[p].Count.load(std::memory_order_acquire) > 0) {
+          return true;
+        }
+        for (auto& worker : Workers) {
+          if (!worker->Queues[p].IsEmpty()) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    void Wake()
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (IdleCount.load(std::memory_order_relaxed) > 0) {
+        // Taking the lock orders the notify after any idle worker's final check for
+        // work so the wake up can't be lost.
+        { std::lock_guard<std::mutex> lock(IdleLock); }
+        IdleSignal.notify_one();
+      }
+    }
+
+    bool TakeInjected(int priority, TaskItem& item)
+    {
+      InjectionQueue& queue = Injection[priority];
+      if (queue.Count.load(std::memory_order_acquire) == 0) {
+        return false;
+      }
+
+      std::lock_guard<std::mutex> lock(queue.Lock);
+      if (queue.Items.empty()) {
+        return false;
+      }
+      item = queue.Items.front();
+      queue.Items.pop_front();
+      queue.Count.fetch_sub(1, std::memory_order_release);
+      return true;
+    }
+
+    bool TryTake(int index, TaskItem& item, int& priority)
+    {
+      Worker& self = *Workers[index];
+      int workerCount = (int)Workers.size();
+
+      for (priority = 0; priority < PRIORITY_COUNT; priority++) {
+        if (self.Queues[priority].Take(item) || TakeInjected(priority, item)) {
+          return true;
+        }
+
+        if (workerCount > 1) {
+          self.RandomState ^= self.RandomState << 13;
+          self.RandomState ^= self.RandomState >> 17;
+          self.RandomState ^= self.RandomState << 5;
+          int start = (int)(self.RandomState % (uint32_t)workerCount);
+
+          for (int i = 0; i < workerCount; i++) {
+            int victim = (start + i) % workerCount;
+            if (victim != index && Workers[victim]->Queues[priority].Take(item)) {
+              Bump(self.Steals);
+              _steals.Add();
+              return true;
+            }
+          }
+        }
+      }
+      return false;
+    }
+
+    void Execute(Worker& worker, const TaskItem& item, int priority)
+    {
+      PriorityMetrics& metrics = _priorityMetrics[priority];
+      uint64_t now = (item.Deadline != 0 || item.SubmittedAt != 0) ? NowNanoseconds() : 0;
+
+      if (item.SubmittedAt != 0) {
+        metrics.QueueDelay.Record(now - item.SubmittedAt);
+      }
+
+      if (item.Deadline != 0 && now > item.Deadline) {
+        Bump(worker.Expired);
+        metrics.Expired.Add();
+        if (item.Expired != nullptr) {
+          item.Expired(item.Context);
+        }
+        return;
+      }
+
+      item.Run(item.Context);
+      Bump(worker.Executed);
+      metrics.Executed.Add();
+    }
+
+    static void RunWorker(Impl* impl, int index);
+  };
+
+  namespace {
+    struct CurrentWorker
+    {
+      const void* Scheduler;
+      int Index;
+    };
+
+    thread_local CurrentWorker _currentWorker = { nullptr, -1 };
+
+    struct RangeState
+    {
+      std::atomic<int> Next{ 0 };
+      std::atomic<int> Completed{ 0 };
+      std::atomic<int> References{ 0 };
+      int Count;
+      TaskRangeFunction Function;
+      void* Context;
+
+      void RunAvailable()
+      {
+        int index;
+        while ((index = Next.fetch_add(1, std::memory_order_relaxed)) < Count) {
+          Function(Context, index);
+          Completed.fetch_add(1, std::memory_order_release);
+        }
+      }
+
+      void Release()
+      {
+        if (References.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      static void RunHelper(void* context)
+      {
+        RangeState* state = static_cast<RangeState*>(context);
+        state->RunAvailable();
+        state->Release();
+      }
+    };
+  }
+
+  void MediaScheduler::Impl::RunWorker(Impl* impl, int index)
+  {
+    int processor = -1;
+    if (!impl->Config.Processors.empty()) {
+      processor = impl->Config.Processors[index % impl->Config.Processors.size()];
+    }
+    else if (impl->Config.PinWorkers) {
+      unsigned int processorCount = std::thread::hardware_concurrency();
+      processor = (int)((impl->Config.FirstProcessor + index) % (processorCount > 0 ? processorCount : 1));
+    }
+
+    if (processor >= 0 && MediaTopology::SetThreadAffinity(std::vector<int>(1, processor)) != 0) {
+      SIPSM_LOG_WARNING("Failed to pin media scheduler worker to processor %d.", processor);
+    }
+
+    _currentWorker = { impl, index };
+    Worker& worker = *impl->Workers[index];
+    TaskItem item;
+    int priority;
+
+    while (true) {
+      bool hasTask = impl->TryTake(index, item, priority);
+
+      for (int spin = 0; !hasTask && spin < IDLE_SPIN_COUNT; spin++) {
+        std::this_thread::yield();
+        hasTask = impl->TryTake(index, item, priority);
+      }
+
+      if (hasTask) {
+        impl->Execute(worker, item, priority);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(impl->IdleLock);
+      impl->IdleCount.fetch_add(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      bool hasWork = impl->HasWork();
+      if (!hasWork && impl->IsStopping.load(std::memory_order_acquire)) {
+        impl->IdleCount.fetch_sub(1, std::memory_order_relaxed);
+        break;
+      }
+      if (!hasWork) {
+        impl->IdleSignal.wait(lock);
+      }
+      impl->IdleCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    _currentWorker = { nullptr, -1 };
+  }
+
+  MediaScheduler& MediaScheduler::Default()
+  {
+    static MediaScheduler* defaultScheduler = new MediaScheduler();
+    return *defaultScheduler;
+  }
+
+  uint64_t MediaScheduler::NowNanoseconds()
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  MediaScheduler::MediaScheduler(const MediaSchedulerConfig& config) :
+    _impl(new Impl())
+  {
+    _impl->Config = config;
+
+    int workerCount = config.WorkerCount;
+    if (workerCount <= 0 && !config.Processors.empty()) {
+      workerCount = (int)config.Processors.size();
+    }
+    if (workerCount <= 0) {
+      workerCount = (int)std::thread::hardware_concurrency();
+      workerCount = (workerCount > 0) ? workerCount : 1;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+      std::unique_ptr<Worker> worker(new Worker());
+      worker->RandomState = 0x9E3779B9u * (uint32_t)(i + 1);
+      _impl->Workers.push_back(std::move(worker));
+    }
+
+    // Start the threads once all the workers exist as they steal from each other.
+    for (int i = 0; i < workerCount; i++) {
+      _impl->Workers[i]->Thread = std::thread(&Impl::RunWorker, _impl, i);
+    }
+  }
+
+  MediaScheduler::~MediaScheduler()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_impl->IdleLock);
+      _impl->IsStopping.store(true, std::memory_order_release);
+    }
+    _impl->IdleSignal.notify_all();
+
+    for (auto& worker : _impl->Workers) {
+      if (worker->Thread.joinable()) {
+        worker->Thread.join();
+      }
+    }
+
+    delete _impl;
+  }
+
+  int MediaScheduler::Submit(const MediaTask& task, TaskPriority priority)
+  {
+    int lane = (int)priority;
+    CurrentWorker current = _currentWorker;
+    bool isWorker = (current.Scheduler == _impl);
+
+    // Tasks running while the scheduler stops can still queue follow on work, the
+    // workers don't exit until every queue is empty.
+    if (task.Run == nullptr || lane < 0 || lane >= PRIORITY_COUNT ||
+      (!isWorker && _impl->IsStopping.load(std::memory_order_acquire))) {
+      return -1;
+    }
+
+    TaskItem item = { task.Run, task.Context, task.DeadlineNanoseconds, task.Expired,
+      MetricsControl::IsEnabled() ? NowNanoseconds() : 0 };
+
+    if (isWorker) {
+      Worker& worker = *_impl->Workers[current.Index];
+      Bump(worker.Submitted);
+      if (worker.Queues[lane].Push(item)) {
+        _impl->Wake();
+        return 0;
+      }
+      Bump(worker.Overflows);
+    }
+    else {
+      _impl->ExternalSubmitted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    InjectionQueue& queue = _impl->Injection[lane];
+    {
+      std::lock_guard<std::mutex> lock(queue.Lock);
+      queue.Items.push_back(item);
+      queue.Count.fetch_add(1, std::memory_order_release);
+    }
+    _impl->Wake();
+    return 0;
+  }
+
+  int MediaScheduler::Submit(TaskFunction run, void* context, TaskPriority priority)
+  {
+    MediaTask task;
+    task.Run = run;
+    task.Context = context;
+    return Submit(task, priority);
+  }
+
+  void MediaScheduler::ParallelFor(int count, TaskRangeFunction function, void* context, TaskPriority priority)
+  {
+    if (count <= 0) {
+      return;
+    }
+
+    int helpers = std::min(count - 1, (int)_impl->Workers.size());
+    if (helpers == 0) {
+      for (int i = 0; i < count; i++) {
+        function(context, i);
+      }
+      return;
+    }
+
+    // The state is reference counted as helper tasks can start after the calling
+    // thread has already completed every index and returned.
+    RangeState* state = new RangeState();
+    state->Count = count;
+    state->Function = function;
+    state->Context = context;
+    state->References.store(helpers + 1, std::memory_order_relaxed);
+
+    for (int i = 0; i < helpers; i++) {
+      if (Submit(RangeState::RunHelper, state, priority) != 0) {
+        state->Release();
+      }
+    }
+
+    state->RunAvailable();
+    while (state->Completed.load(std::memory_order_acquire) < count) {
+      std::this_thread::yield();
+    }
+    state->Release();
+  }
+
+  int MediaScheduler::GetWorkerCount() const
+  {
+    return (int)_impl->Workers.size();
+  }
+
+  MediaSchedulerStats MediaScheduler::GetStats() const
+  {
+    MediaSchedulerStats stats{};
+    stats.Submitted = _impl->ExternalSubmitted.load(std::memory_order_relaxed);
+
+    for (auto& worker : _impl->Workers) {
+      stats.Submitted += worker->Submitted.load(std::memory_order_relaxed);
+      stats.Executed += worker->Executed.load(std::memory_order_relaxed);
+      stats.Expired += worker->Expired.load(std::memory_order_relaxed);
+      stats.Steals += worker->Steals.load(std::memory_order_relaxed);
+      stats.Overflows += worker->Overflows.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+}
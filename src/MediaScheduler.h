@@ -0,0 +1,146 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaScheduler.h
+//
+// Description: Work-stealing task scheduler shared by the native media
+// workloads (encoding, conversion slices, SRTP, handshakes) so they run on
+// one set of worker threads instead of each creating their own and
+// oversubscribing the cores.
+//
+// Each worker has a bounded queue per priority lane. Tasks submitted from a
+// worker go on its own queue, tasks submitted from other threads go on a
+// shared injection queue. An idle worker takes from its own queue first and
+// then steals from the other workers. Lanes are strictly ordered: a worker
+// always runs an audio task before a retransmission, a retransmission
+// before video and video before background work.
+//
+// A task can have a deadline. If no worker has started it by then it is
+// skipped, and its expiry function is called instead so it can release
+// its resources. This stops a backlog of stale video frames delaying
+// newer ones.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  enum class TaskPriority
+  {
+    Audio = 0,
+    Retransmit = 1,
+    Video = 2,
+    Background = 3,
+  };
+
+  typedef void (*TaskFunction)(void* context);
+  typedef void (*TaskRangeFunction)(void* context, int index);
+
+  struct MediaTask
+  {
+    TaskFunction Run = nullptr;
+    void* Context = nullptr;
+
+    /**
+    * Optional, the time from MediaScheduler::NowNanoseconds after which the task
+    * is no longer worth running. 0 for no deadline.
+    */
+    uint64_t DeadlineNanoseconds = 0;
+
+    /**
+    * Optional, called with the context instead of Run if the deadline passes.
+    */
+    TaskFunction Expired = nullptr;
+  };
+
+  struct MediaSchedulerConfig
+  {
+    /**
+    * The number of worker threads, 0 for one per logical processor.
+    */
+    int WorkerCount = 0;
+
+    /**
+    * If true worker i is pinned to logical processor (FirstProcessor + i) modulo
+    * the processor count.
+    */
+    bool PinWorkers = false;
+    int FirstProcessor = 0;
+
+    /**
+    * Optional, the logical processors to run the workers on, see MediaPlacement.
+    * Worker i is pinned to Processors[i % size] and WorkerCount defaults to the
+    * number of processors. Takes precedence over PinWorkers.
+    */
+    std::vector<int> Processors;
+  };
+
+  struct MediaSchedulerStats
+  {
+    uint64_t Submitted;
+    uint64_t Executed;
+    uint64_t Expired;
+    uint64_t Steals;
+    uint64_t Overflows;
+  };
+
+  class MediaScheduler
+  {
+  public:
+
+    static const int PRIORITY_COUNT = 4;
+
+    /**
+    * The number of tasks each worker's queue for a lane holds before further tasks
+    * overflow to the shared injection queue.
+    */
+    static const int WORKER_QUEUE_CAPACITY = 1024;
+
+    /**
+    * The process wide scheduler with a worker per logical processor. Never destroyed.
+    */
+    static MediaScheduler& Default();
+
+    /**
+    * Gets the clock used for task deadlines.
+    */
+    static uint64_t NowNanoseconds();
+
+    explicit MediaScheduler(const MediaSchedulerConfig& config = MediaSchedulerConfig());
+
+    /**
+    * Runs the tasks still queued, including any they submit, and stops the workers.
+    */
+    ~MediaScheduler();
+
+    MediaScheduler(const MediaScheduler&) = delete;
+    MediaScheduler& operator=(const MediaScheduler&) = delete;
+
+    /**
+    * Queues a task and returns without waiting for it to run.
+    * @param[in] task: the task to run, Run must be set.
+    * @param[in] priority: the lane to queue the task on.
+    * @@Returns: 0 on success or -1 if the task was invalid or the scheduler is stopping.
+    */
+    int Submit(const MediaTask& task, TaskPriority priority);
+    int Submit(TaskFunction run, void* context, TaskPriority priority);
+
+    /**
+    * Calls function(context, index) for every index in [0, count) using the
+    * workers and the calling thread, and returns once all the calls are complete.
+    * Used to split a frame into slices.
+    */
+    void ParallelFor(int count, TaskRangeFunction function, void* context, TaskPriority priority);
+
+    int GetWorkerCount() const;
+    MediaSchedulerStats GetStats() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+}
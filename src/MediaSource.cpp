@@ -8,6 +8,8 @@
 //-----------------------------------------------------------------------------
 
 #include "MediaSource.h"
+#include "MediaLog.h"
+#include "MediaTrace.h"
 
 namespace SIPSorceryMedia {
 
@@ -301,6 +303,7 @@ namespace SIPSorceryMedia {
       try {
         DWORD streamIndex, flags;
         LONGLONG sampleTimestamp;
+        uint64_t readStart = MediaTrace::IsEnabled() ? MediaTrace::NowNanoseconds() : 0;
 
         CHECKHR_THROW(_sourceReader->ReadSample(
           MF_SOURCE_READER_ANY_STREAM,
@@ -313,11 +316,11 @@ namespace SIPSorceryMedia {
 
         if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
         {
-          std::cout << "End of stream." << std::endl;
+          SIPSM_LOG_INFO("End of stream.");
           sampleProps->EndOfStream = true;
 
           if (_loop) {
-            std::cout << "resetting media source position to start." << std::endl;
+            SIPSM_LOG_DEBUG("Resetting media source position to start.");
 
             PROPVARIANT var = { 0 };
             var.vt = VT_I8;
@@ -336,24 +339,24 @@ namespace SIPSorceryMedia {
 
         if (flags & MF_SOURCE_READERF_NEWSTREAM)
         {
-          std::cout << "New stream." << std::endl;
+          SIPSM_LOG_DEBUG("New stream.");
         }
 
         if (flags & MF_SOURCE_READERF_NATIVEMEDIATYPECHANGED)
         {
-          std::cout << "Native type changed." << std::endl;
+          SIPSM_LOG_DEBUG("Native type changed.");
         }
 
         if (flags & MF_SOURCE_READERF_CURRENTMEDIATYPECHANGED)
         {
-          std::cout << "Current type changed for stream index " << streamIndex << "." << std::endl;
+          SIPSM_LOG_DEBUG("Current type changed for stream index %lu.", streamIndex);
 
           if (streamIndex == _videoStreamIndex) {
             CHECKHR_THROW(_sourceReader->GetCurrentMediaType(
               (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
               &pVideoType), "Error retrieving current media type from first video stream.");
 
-            std::cout << GetMediaTypeDescription(pVideoType) << std::endl;
+            SIPSM_LOG_DEBUG("%s", GetMediaTypeDescription(pVideoType).c_str());
 
             // Get the frame dimensions and stride
             UINT32 nWidth, nHeight;
@@ -373,14 +376,12 @@ namespace SIPSorceryMedia {
           }
         }
 
-        if (flags & MF_SOURCE_READERF_STREAMTICK)
-        {
-          std::cout << "Stream tick." << std::endl;
-        }
-
         if (pSample == nullptr)
         {
-          std::cout << "Failed to get media sample in from source reader." << std::endl;
+          // Expected on a stream tick (a gap in the stream) and at the end of the stream.
+          if (!(flags & (MF_SOURCE_READERF_STREAMTICK | MF_SOURCE_READERF_ENDOFSTREAM))) {
+            SIPSM_LOG_WARNING("Failed to get media sample in from source reader.");
+          }
         }
         else
         {
@@ -408,6 +409,12 @@ namespace SIPSorceryMedia {
 
           pVideoBuffer->Unlock();
 
+          // Tag the stages the caller runs on this sample with its timestamp.
+          MediaTrace::SetCurrentFrame((uint64_t)sampleTimestamp);
+          if (readStart != 0) {
+            MediaTrace::Record("source", "MediaSource::GetSample", (uint64_t)sampleTimestamp, readStart, MediaTrace::NowNanoseconds());
+          }
+
           if (streamIndex == _videoStreamIndex) {
             sampleProps->Width = _width;
             sampleProps->Height = _height;
@@ -0,0 +1,425 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaTopology.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaTopology.h"
+#include "MediaBuffer.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    struct Topology
+    {
+      std::vector<std::vector<int>> NodeProcessors;
+      std::vector<int> ProcessorNodes;
+      int ProcessorCount = 0;
+    };
+
+#ifndef _WIN32
+    /**
+    * Parses a kernel CPU list such as "0-3,8-11".
+    */
+    std::vector<int> ParseCpuList(const char* list)
+    {
+      std::vector<int> cpus;
+      const char* p = list;
+
+      while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+          break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+          last = strtol(p + 1, &end, 10);
+          p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+          cpus.push_back((int)cpu);
+        }
+        if (*p == ',') {
+          p++;
+        }
+      }
+      return cpus;
+    }
+#endif
+
+    Topology Discover()
+    {
+      Topology topology;
+      std::vector<bool> allowed;
+
+#ifdef _WIN32
+      DWORD_PTR processMask = 0, systemMask = 0;
+      GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+      for (int cpu = 0; cpu < (int)(sizeof(DWORD_PTR) * 8); cpu++) {
+        allowed.push_back((processMask & ((DWORD_PTR)1 << cpu)) != 0);
+      }
+
+      // Only processor group 0 is used, the same limit SetThreadAffinityMask has.
+      ULONG highestNode = 0;
+      if (GetNumaHighestNodeNumber(&highestNode)) {
+        for (USHORT node = 0; node <= highestNode; node++) {
+          std::vector<int> processors;
+          GROUP_AFFINITY affinity = {};
+          if (GetNumaNodeProcessorMaskEx(node, &affinity) && affinity.Group == 0) {
+            for (int cpu = 0; cpu < (int)allowed.size(); cpu++) {
+              if (allowed[cpu] && (affinity.Mask & ((KAFFINITY)1 << cpu)) != 0) {
+                processors.push_back(cpu);
+              }
+            }
+          }
+          topology.NodeProcessors.push_back(processors);
+        }
+      }
+#else
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+          allowed.push_back(CPU_ISSET(cpu, &set) != 0);
+        }
+      }
+
+      DIR* dir = opendir("/sys/devices/system/node");
+      if (dir != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+          int node;
+          if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0) {
+            continue;
+          }
+
+          char path[256];
+          snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+          FILE* file = fopen(path, "r");
+          if (file == nullptr) {
+            continue;
+          }
+
+          char list[4096] = { 0 };
+          if (fgets(list, sizeof(list), file) != nullptr) {
+            if ((int)topology.NodeProcessors.size() <= node) {
+              topology.NodeProcessors.resize(node + 1);
+            }
+            for (int cpu : ParseCpuList(list)) {
+              if (cpu < (int)allowed.size() && allowed[cpu]) {
+                topology.NodeProcessors[node].push_back(cpu);
+              }
+            }
+          }
+          fclose(file);
+        }
+        closedir(dir);
+      }
+#endif
+
+      int usable = 0;
+      for (auto& processors : topology.NodeProcessors) {
+        std::sort(processors.begin(), processors.end());
+        usable += (int)processors.size();
+      }
+
+      // No NUMA information, e.g. a kernel without NUMA support or a container
+      // hiding sysfs. Treat the host as a single node.
+      if (usable == 0) {
+        topology.NodeProcessors.assign(1, std::vector<int>());
+        for (int cpu = 0; cpu < (int)allowed.size(); cpu++) {
+          if (allowed[cpu]) {
+            topology.NodeProcessors[0].push_back(cpu);
+          }
+        }
+        if (topology.NodeProcessors[0].empty()) {
+          unsigned int count = std::thread::hardware_concurrency();
+          for (unsigned int cpu = 0; cpu < std::max(count, 1u); cpu++) {
+            topology.NodeProcessors[0].push_back((int)cpu);
+          }
+        }
+      }
+
+      for (int node = 0; node < (int)topology.NodeProcessors.size(); node++) {
+        for (int cpu : topology.NodeProcessors[node]) {
+          if ((int)topology.ProcessorNodes.size() <= cpu) {
+            topology.ProcessorNodes.resize(cpu + 1, 0);
+          }
+          topology.ProcessorNodes[cpu] = node;
+          topology.ProcessorCount++;
+        }
+      }
+
+      return topology;
+    }
+
+    const Topology& GetTopology()
+    {
+      static Topology topology = Discover();
+      return topology;
+    }
+
+    size_t GetPageSize()
+    {
+#ifdef _WIN32
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      return info.dwAllocationGranularity;
+#else
+      long pageSize = sysconf(_SC_PAGESIZE);
+      return (pageSize > 0) ? (size_t)pageSize : 4096;
+#endif
+    }
+  }
+
+  int MediaTopology::GetProcessorCount()
+  {
+    return GetTopology().ProcessorCount;
+  }
+
+  int MediaTopology::GetNumaNodeCount()
+  {
+    return (int)GetTopology().NodeProcessors.size();
+  }
+
+  std::vector<int> MediaTopology::GetNodeProcessors(int node)
+  {
+    const Topology& topology = GetTopology();
+    return (node >= 0 && node < (int)topology.NodeProcessors.size()) ? topology.NodeProcessors[node] : std::vector<int>();
+  }
+
+  int MediaTopology::GetProcessorNode(int processor)
+  {
+    const Topology& topology = GetTopology();
+    return (processor >= 0 && processor < (int)topology.ProcessorNodes.size()) ? topology.ProcessorNodes[processor] : 0;
+  }
+
+  int MediaTopology::GetCurrentProcessor()
+  {
+#ifdef _WIN32
+    return (int)GetCurrentProcessorNumber();
+#else
+    int cpu = sched_getcpu();
+    return (cpu >= 0) ? cpu : 0;
+#endif
+  }
+
+  int MediaTopology::SetThreadAffinity(const std::vector<int>& processors)
+  {
+    if (processors.empty()) {
+      return -1;
+    }
+
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (int cpu : processors) {
+      if (cpu >= 0 && cpu < (int)(sizeof(DWORD_PTR) * 8)) {
+        mask |= (DWORD_PTR)1 << cpu;
+      }
+    }
+    return (mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0) ? 0 : -1;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : processors) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) ? 0 : -1;
+#endif
+  }
+
+  int MediaTopology::BindMemory(void* address, size_t length, int node)
+  {
+#if defined(__linux__) && defined(SYS_mbind)
+    // Called directly rather than through libnuma to avoid the dependency.
+    const int MPOL_PREFERRED_MODE = 1;
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * 8)) {
+      return -1;
+    }
+    unsigned long nodeMask = 1UL << node;
+    long res = syscall(SYS_mbind, address, length, MPOL_PREFERRED_MODE, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+    return (res == 0) ? 0 : -1;
+#else
+    return -1;
+#endif
+  }
+
+  void* MediaTopology::AllocateOnNode(size_t length, int node)
+  {
+    size_t pageSize = GetPageSize();
+    length = (length + pageSize - 1) & ~(pageSize - 1);
+
+#ifdef _WIN32
+    return VirtualAllocExNuma(GetCurrentProcess(), nullptr, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)node);
+#else
+    void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+      return nullptr;
+    }
+    if (GetNumaNodeCount() > 1 && BindMemory(mapped, length, node) != 0) {
+      SIPSM_LOG_WARNING("Failed to bind %zu bytes to NUMA node %d.", length, node);
+    }
+    return mapped;
+#endif
+  }
+
+  void MediaTopology::FreeOnNode(void* address, size_t length)
+  {
+#ifdef _WIN32
+    VirtualFree(address, 0, MEM_RELEASE);
+#else
+    size_t pageSize = GetPageSize();
+    munmap(address, (length + pageSize - 1) & ~(pageSize - 1));
+#endif
+  }
+
+  struct MediaPlacement::Impl
+  {
+    struct Group
+    {
+      int NumaNode;
+      std::vector<int> Processors;
+      int Sessions = 0;
+      std::unique_ptr<MediaScheduler> Scheduler;
+    };
+
+    MediaPlacementConfig Config;
+    std::mutex Lock;
+    std::vector<Group> Groups;
+  };
+
+  MediaPlacement& MediaPlacement::Default()
+  {
+    static MediaPlacement* defaultPlacement = new MediaPlacement();
+    return *defaultPlacement;
+  }
+
+  MediaPlacement::MediaPlacement(const MediaPlacementConfig& config) :
+    _impl(new Impl())
+  {
+    _impl->Config = config;
+
+    for (int node = 0; node < MediaTopology::GetNumaNodeCount(); node++) {
+      std::vector<int> processors = MediaTopology::GetNodeProcessors(node);
+      int groupSize = (config.GroupSize > 0) ? config.GroupSize : (int)processors.size();
+
+      for (size_t start = 0; start < processors.size(); start += groupSize) {
+        Impl::Group group;
+        group.NumaNode = node;
+        group.Processors.assign(processors.begin() + start, processors.begin() + std::min(processors.size(), start + groupSize));
+        _impl->Groups.push_back(std::move(group));
+      }
+    }
+  }
+
+  MediaPlacement::~MediaPlacement()
+  {
+    delete _impl;
+  }
+
+  SessionPlacement MediaPlacement::PlaceSession()
+  {
+    SessionPlacement placement;
+    if (_impl->Config.Policy == AffinityPolicy::None || _impl->Groups.empty()) {
+      return placement;
+    }
+
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    int chosen = -1;
+
+    if (_impl->Config.Policy == AffinityPolicy::Pack) {
+      for (int i = 0; i < (int)_impl->Groups.size(); i++) {
+        if (_impl->Groups[i].Sessions < _impl->Config.MaxSessionsPerGroup) {
+          chosen = i;
+          break;
+        }
+      }
+    }
+
+    if (chosen < 0) {
+      chosen = 0;
+      for (int i = 1; i < (int)_impl->Groups.size(); i++) {
+        if (_impl->Groups[i].Sessions < _impl->Groups[chosen].Sessions) {
+          chosen = i;
+        }
+      }
+    }
+
+    Impl::Group& group = _impl->Groups[chosen];
+    group.Sessions++;
+    placement.Group = chosen;
+    placement.NumaNode = group.NumaNode;
+    placement.Processors = group.Processors;
+    return placement;
+  }
+
+  void MediaPlacement::ReleaseSession(const SessionPlacement& placement)
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    if (placement.Group >= 0 && placement.Group < (int)_impl->Groups.size() && _impl->Groups[placement.Group].Sessions > 0) {
+      _impl->Groups[placement.Group].Sessions--;
+    }
+  }
+
+  int MediaPlacement::BindCurrentThread(const SessionPlacement& placement)
+  {
+    if (placement.Group < 0) {
+      return 0;
+    }
+    return MediaTopology::SetThreadAffinity(placement.Processors);
+  }
+
+  MediaBufferPool& MediaPlacement::GetBufferPool(const SessionPlacement& placement)
+  {
+    return MediaBufferPool::ForNode(placement.NumaNode);
+  }
+
+  MediaScheduler& MediaPlacement::GetScheduler(const SessionPlacement& placement)
+  {
+    if (placement.Group < 0 || placement.Group >= (int)_impl->Groups.size()) {
+      return MediaScheduler::Default();
+    }
+
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    Impl::Group& group = _impl->Groups[placement.Group];
+    if (group.Scheduler == nullptr) {
+      MediaSchedulerConfig config;
+      config.Processors = group.Processors;
+      group.Scheduler.reset(new MediaScheduler(config));
+    }
+    return *group.Scheduler;
+  }
+
+  int MediaPlacement::GetGroupCount() const
+  {
+    return (int)_impl->Groups.size();
+  }
+}
@@ -0,0 +1,165 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaTopology.h
+//
+// Description: Processor and NUMA topology discovery, thread affinity and
+// placement of media sessions onto groups of cores.
+//
+// On a multi-socket host a session whose frames are allocated on one node,
+// encoded on a core on another and protected on a third pays for remote
+// memory accesses and cache line transfers at every stage. MediaPlacement
+// assigns each session a core group within a single NUMA node. The
+// session's threads are bound to that group and its buffers come from a
+// pool local to the node. If the host has a single node, everything works
+// the same with one node.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  class MediaBufferPool;
+  class MediaScheduler;
+
+  class MediaTopology
+  {
+  public:
+
+    /**
+    * Gets the number of logical processors the process is allowed to run on.
+    */
+    static int GetProcessorCount();
+
+    /**
+    * Gets the number of NUMA nodes, always at least 1. Nodes are numbered as the
+    * operating system numbers them.
+    */
+    static int GetNumaNodeCount();
+
+    /**
+    * Gets the usable logical processors on a NUMA node. Empty for a node with only
+    * memory or whose processors the process isn't allowed to use.
+    */
+    static std::vector<int> GetNodeProcessors(int node);
+
+    /**
+    * Gets the NUMA node a logical processor belongs to, 0 if unknown.
+    */
+    static int GetProcessorNode(int processor);
+
+    /**
+    * Gets the logical processor the calling thread is currently running on.
+    */
+    static int GetCurrentProcessor();
+
+    /**
+    * Restricts the calling thread to a set of logical processors.
+    * @@Returns: 0 on success or -1 on failure.
+    */
+    static int SetThreadAffinity(const std::vector<int>& processors);
+
+    /**
+    * Asks the operating system to place the pages of a page aligned range that
+    * hasn't been touched yet on a NUMA node. Linux only.
+    * @@Returns: 0 on success or -1 if the range could not be bound.
+    */
+    static int BindMemory(void* address, size_t length, int node);
+
+    /**
+    * Allocates whole pages preferring a NUMA node. The memory is mapped directly
+    * from the operating system (mmap or VirtualAlloc) so it is page aligned.
+    * @param[in] length: the number of bytes, rounded up to whole pages.
+    * @param[in] node: the preferred node.
+    * @@Returns: the memory, release with FreeOnNode, or nullptr on failure.
+    */
+    static void* AllocateOnNode(size_t length, int node);
+    static void FreeOnNode(void* address, size_t length);
+  };
+
+  enum class AffinityPolicy
+  {
+    None = 0,       // Sessions are not bound, the operating system schedules their threads.
+    Spread = 1,     // Each new session goes to the core group with the fewest sessions.
+    Pack = 2,       // Fill the lowest core group up to MaxSessionsPerGroup before the next.
+  };
+
+  struct MediaPlacementConfig
+  {
+    AffinityPolicy Policy = AffinityPolicy::Spread;
+
+    /**
+    * The number of processors in a core group, 0 for a group per NUMA node. Groups
+    * never span nodes.
+    */
+    int GroupSize = 0;
+
+    /**
+    * The number of sessions the Pack policy puts on a group before moving to the
+    * next one. Once every group is full sessions are spread.
+    */
+    int MaxSessionsPerGroup = 16;
+  };
+
+  struct SessionPlacement
+  {
+    int Group = -1;
+    int NumaNode = -1;
+    std::vector<int> Processors;
+  };
+
+  class MediaPlacement
+  {
+  public:
+
+    /**
+    * The process wide placement using the Spread policy. Never destroyed.
+    */
+    static MediaPlacement& Default();
+
+    explicit MediaPlacement(const MediaPlacementConfig& config = MediaPlacementConfig());
+    ~MediaPlacement();
+
+    MediaPlacement(const MediaPlacement&) = delete;
+    MediaPlacement& operator=(const MediaPlacement&) = delete;
+
+    /**
+    * Chooses the core group for a new session according to the policy.
+    */
+    SessionPlacement PlaceSession();
+
+    /**
+    * Removes a session from its group's count once it ends.
+    */
+    void ReleaseSession(const SessionPlacement& placement);
+
+    /**
+    * Binds the calling thread to the session's core group. Call from each thread
+    * that runs one of the session's stages.
+    * @@Returns: 0 on success or -1 on failure. Always succeeds if the policy is None.
+    */
+    int BindCurrentThread(const SessionPlacement& placement);
+
+    /**
+    * Gets the buffer pool local to the session's NUMA node, for the stages'
+    * SetBufferPool.
+    */
+    MediaBufferPool& GetBufferPool(const SessionPlacement& placement);
+
+    /**
+    * Gets a scheduler whose workers are pinned to the session's core group. The
+    * scheduler is created the first time it is needed.
+    */
+    MediaScheduler& GetScheduler(const SessionPlacement& placement);
+
+    int GetGroupCount() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+}
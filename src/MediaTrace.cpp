@@ -0,0 +1,387 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaTrace.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "MediaTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    struct TraceEvent
+    {
+      const char* Category;
+      const char* Name;
+      uint64_t FrameId;
+      uint64_t Start;
+      uint64_t End;
+    };
+
+    /**
+    * Overwriting ring of events. Only the owning thread writes, by filling the slot
+    * at Head and then publishing the new Head. A reader copies the slots and then
+    * re-reads Head to discard any that the writer may have overwritten meanwhile.
+    */
+    struct TraceRing
+    {
+      uint32_t ThreadId = 0;
+      bool InUse = false;
+      std::atomic<uint64_t> Head{ 0 };
+      uint64_t ClearedHead = 0;
+      TraceEvent Events[MediaTrace::RING_CAPACITY];
+    };
+
+    /**
+    * All the rings ever created. Rings are handed back when their thread exits and
+    * reused by new threads so thread churn doesn't grow memory. Never freed.
+    */
+    struct TraceRegistry
+    {
+      std::mutex Lock;
+      std::vector<TraceRing*> Rings;
+
+      static TraceRegistry& Instance()
+      {
+        static TraceRegistry* registry = new TraceRegistry();
+        return *registry;
+      }
+    };
+
+    uint32_t GetThreadId()
+    {
+#ifdef _WIN32
+      return (uint32_t)GetCurrentThreadId();
+#else
+      return (uint32_t)syscall(SYS_gettid);
+#endif
+    }
+
+    uint32_t GetProcessId()
+    {
+#ifdef _WIN32
+      return (uint32_t)GetCurrentProcessId();
+#else
+      return (uint32_t)getpid();
+#endif
+    }
+
+    struct ThreadTraceState
+    {
+      TraceRing* Ring = nullptr;
+      uint64_t CurrentFrame = 0;
+
+      ~ThreadTraceState()
+      {
+        if (Ring != nullptr) {
+          std::lock_guard<std::mutex> lock(TraceRegistry::Instance().Lock);
+          Ring->InUse = false;
+        }
+      }
+
+      TraceRing* GetRing()
+      {
+        if (Ring == nullptr) {
+          TraceRegistry& registry = TraceRegistry::Instance();
+          std::lock_guard<std::mutex> lock(registry.Lock);
+
+          for (TraceRing* ring : registry.Rings) {
+            if (!ring->InUse) {
+              Ring = ring;
+              break;
+            }
+          }
+
+          if (Ring == nullptr) {
+            Ring = new TraceRing();
+            registry.Rings.push_back(Ring);
+          }
+
+          Ring->InUse = true;
+          Ring->ThreadId = GetThreadId();
+          Ring->Head.store(0, std::memory_order_relaxed);
+          Ring->ClearedHead = 0;
+        }
+        return Ring;
+      }
+    };
+
+    thread_local ThreadTraceState _threadTrace;
+
+    struct ExportedRing
+    {
+      uint32_t ThreadId;
+      std::vector<TraceEvent> Events;
+    };
+
+    /**
+    * Copies the valid events out of every ring.
+    */
+    std::vector<ExportedRing> CopyRings()
+    {
+      std::vector<ExportedRing> exported;
+      TraceRegistry& registry = TraceRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry.Lock);
+
+      for (TraceRing* ring : registry.Rings) {
+        uint64_t head = ring->Head.load(std::memory_order_acquire);
+        uint64_t first = (head > (uint64_t)MediaTrace::RING_CAPACITY) ? head - MediaTrace::RING_CAPACITY : 0;
+        first = std::max(first, ring->ClearedHead);
+
+        std::vector<TraceEvent> events;
+        events.reserve((size_t)(head - first));
+        for (uint64_t i = first; i < head; i++) {
+          events.push_back(ring->Events[i % MediaTrace::RING_CAPACITY]);
+        }
+
+        // Anything the writer has lapped since the copy started is unreliable. The
+        // slot at the new head may be mid-write as well. The fence keeps the copies
+        // above from moving after the load of the head.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t headAfter = ring->Head.load(std::memory_order_relaxed);
+        if (headAfter + 1 > first + MediaTrace::RING_CAPACITY) {
+          uint64_t firstValid = headAfter + 1 - MediaTrace::RING_CAPACITY;
+          size_t discard = (size_t)std::min<uint64_t>(firstValid - first, events.size());
+          events.erase(events.begin(), events.begin() + discard);
+        }
+
+        if (!events.empty()) {
+          std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+            return (a.Start != b.Start) ? a.Start < b.Start : a.End > b.End;
+          });
+          exported.push_back({ ring->ThreadId, std::move(events) });
+        }
+      }
+
+      return exported;
+    }
+
+    void AppendJsonString(std::string& out, const char* value)
+    {
+      out += '"';
+      for (const char* c = value; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+          out += '\\';
+        }
+        out += *c;
+      }
+      out += '"';
+    }
+
+    std::string ExportChromeJson(const std::vector<ExportedRing>& rings)
+    {
+      std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+      uint32_t pid = GetProcessId();
+      bool isFirst = true;
+      char buffer[256];
+
+      for (auto& ring : rings) {
+        for (auto& ev : ring.Events) {
+          if (!isFirst) {
+            out += ',';
+          }
+          isFirst = false;
+
+          out += "{\"name\":";
+          AppendJsonString(out, ev.Name);
+          out += ",\"cat\":";
+          AppendJsonString(out, ev.Category);
+          snprintf(buffer, sizeof(buffer), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"frame\":%llu}}",
+            ev.Start / 1000.0, (ev.End - ev.Start) / 1000.0, pid, ring.ThreadId, (unsigned long long)ev.FrameId);
+          out += buffer;
+        }
+      }
+
+      out += "]}";
+      return out;
+    }
+
+    // Minimal protobuf writer for the handful of Perfetto trace fields used.
+    // See protos/perfetto/trace/trace_packet.proto in the Perfetto repository.
+
+    void WriteVarint(std::string& out, uint64_t value)
+    {
+      while (value >= 0x80) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+      }
+      out += (char)value;
+    }
+
+    void WriteTag(std::string& out, int field, int wireType)
+    {
+      WriteVarint(out, ((uint64_t)field << 3) | wireType);
+    }
+
+    void WriteVarintField(std::string& out, int field, uint64_t value)
+    {
+      WriteTag(out, field, 0);
+      WriteVarint(out, value);
+    }
+
+    void WriteBytesField(std::string& out, int field, const std::string& value)
+    {
+      WriteTag(out, field, 2);
+      WriteVarint(out, value.size());
+      out += value;
+    }
+
+    const int TRACE_PACKET = 1;                     // Trace.packet
+    const int PACKET_TIMESTAMP = 8;                 // TracePacket.timestamp
+    const int PACKET_SEQUENCE_ID = 10;              // TracePacket.trusted_packet_sequence_id
+    const int PACKET_TRACK_EVENT = 11;              // TracePacket.track_event
+    const int PACKET_TRACK_DESCRIPTOR = 60;         // TracePacket.track_descriptor
+    const int TRACK_DESCRIPTOR_UUID = 1;
+    const int TRACK_DESCRIPTOR_THREAD = 4;
+    const int THREAD_DESCRIPTOR_PID = 1;
+    const int THREAD_DESCRIPTOR_TID = 2;
+    const int TRACK_EVENT_DEBUG_ANNOTATIONS = 4;
+    const int TRACK_EVENT_TYPE = 9;
+    const int TRACK_EVENT_TRACK_UUID = 11;
+    const int TRACK_EVENT_CATEGORIES = 22;
+    const int TRACK_EVENT_NAME = 23;
+    const int DEBUG_ANNOTATION_UINT_VALUE = 3;
+    const int DEBUG_ANNOTATION_NAME = 10;
+    const int TYPE_SLICE_BEGIN = 1;
+    const int TYPE_SLICE_END = 2;
+    const uint32_t SEQUENCE_ID = 1;
+    const uint64_t TRACK_UUID_BASE = 0x5349505300000000ULL;
+
+    void WritePacket(std::string& out, uint64_t timestamp, int field, const std::string& payload)
+    {
+      std::string packet;
+      if (timestamp != 0) {
+        WriteVarintField(packet, PACKET_TIMESTAMP, timestamp);
+      }
+      WriteVarintField(packet, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+      WriteBytesField(packet, field, payload);
+      WriteBytesField(out, TRACE_PACKET, packet);
+    }
+
+    std::string ExportPerfetto(const std::vector<ExportedRing>& rings)
+    {
+      std::string out;
+      uint32_t pid = GetProcessId();
+
+      for (auto& ring : rings) {
+        uint64_t trackUuid = TRACK_UUID_BASE | ring.ThreadId;
+
+        std::string thread;
+        WriteVarintField(thread, THREAD_DESCRIPTOR_PID, pid);
+        WriteVarintField(thread, THREAD_DESCRIPTOR_TID, ring.ThreadId);
+
+        std::string track;
+        WriteVarintField(track, TRACK_DESCRIPTOR_UUID, trackUuid);
+        WriteBytesField(track, TRACK_DESCRIPTOR_THREAD, thread);
+
+        WritePacket(out, 0, PACKET_TRACK_DESCRIPTOR, track);
+
+        // Slices on a track must be emitted in timestamp order with properly nested
+        // ends, so merge the begin and end points.
+        struct Point { uint64_t Timestamp; bool IsEnd; const TraceEvent* Event; };
+        std::vector<Point> points;
+        points.reserve(ring.Events.size() * 2);
+        for (auto& ev : ring.Events) {
+          points.push_back({ ev.Start, false, &ev });
+          // A zero length slice would sort its end before its begin.
+          points.push_back({ std::max(ev.End, ev.Start + 1), true, &ev });
+        }
+        std::stable_sort(points.begin(), points.end(), [](const Point& a, const Point& b) {
+          return (a.Timestamp != b.Timestamp) ? a.Timestamp < b.Timestamp : (a.IsEnd && !b.IsEnd);
+        });
+
+        for (auto& point : points) {
+          std::string trackEvent;
+          WriteVarintField(trackEvent, TRACK_EVENT_TYPE, point.IsEnd ? TYPE_SLICE_END : TYPE_SLICE_BEGIN);
+          WriteVarintField(trackEvent, TRACK_EVENT_TRACK_UUID, trackUuid);
+
+          if (!point.IsEnd) {
+            WriteBytesField(trackEvent, TRACK_EVENT_NAME, point.Event->Name);
+            WriteBytesField(trackEvent, TRACK_EVENT_CATEGORIES, point.Event->Category);
+
+            std::string annotation;
+            WriteBytesField(annotation, DEBUG_ANNOTATION_NAME, "frame");
+            WriteVarintField(annotation, DEBUG_ANNOTATION_UINT_VALUE, point.Event->FrameId);
+            WriteBytesField(trackEvent, TRACK_EVENT_DEBUG_ANNOTATIONS, annotation);
+          }
+
+          WritePacket(out, point.Timestamp, PACKET_TRACK_EVENT, trackEvent);
+        }
+      }
+
+      return out;
+    }
+  }
+
+  std::atomic<bool> MediaTrace::_enabled{ false };
+
+  void MediaTrace::SetCurrentFrame(uint64_t frameId)
+  {
+    _threadTrace.CurrentFrame = frameId;
+  }
+
+  uint64_t MediaTrace::GetCurrentFrame()
+  {
+    return _threadTrace.CurrentFrame;
+  }
+
+  uint64_t MediaTrace::NowNanoseconds()
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void MediaTrace::Record(const char* category, const char* name, uint64_t frameId, uint64_t startNanoseconds, uint64_t endNanoseconds)
+  {
+    if (!IsEnabled()) {
+      return;
+    }
+
+    ThreadTraceState& state = _threadTrace;
+    TraceRing* ring = state.GetRing();
+
+    uint64_t head = ring->Head.load(std::memory_order_relaxed);
+    TraceEvent& ev = ring->Events[head % RING_CAPACITY];
+    ev.Category = category;
+    ev.Name = name;
+    ev.FrameId = (state.CurrentFrame != 0) ? state.CurrentFrame : frameId;
+    ev.Start = startNanoseconds;
+    ev.End = endNanoseconds;
+    ring->Head.store(head + 1, std::memory_order_release);
+  }
+
+  std::string MediaTrace::Export(TraceFormat format)
+  {
+    std::vector<ExportedRing> rings = CopyRings();
+    return (format == TraceFormat::Perfetto) ? ExportPerfetto(rings) : ExportChromeJson(rings);
+  }
+
+  void MediaTrace::Clear()
+  {
+    // Rings are only ever written by their own thread so rather than resetting the
+    // heads, which would race with the writers, mark everything before the current
+    // head as already exported.
+    TraceRegistry& registry = TraceRegistry::Instance();
+    std::lock_guard<std::mutex> lock(registry.Lock);
+    for (TraceRing* ring : registry.Rings) {
+      ring->ClearedHead = ring->Head.load(std::memory_order_acquire);
+    }
+  }
+}
@@ -0,0 +1,128 @@
+//-----------------------------------------------------------------------------
+// Filename: MediaTrace.h
+//
+// Description: Lightweight tracing of the native media stages. Each stage
+// records a scoped event (name, start time, duration and frame ID) into a
+// ring buffer owned by the calling thread. Only the owning thread writes to
+// a ring so recording never takes a lock. The rings can be exported at any
+// time as Chrome trace JSON (chrome://tracing, https://ui.perfetto.dev) or as
+// a Perfetto protobuf trace to see where the time for a frame went.
+//
+// Frame IDs: a pipeline sets the frame it is working on with
+// MediaTrace::SetCurrentFrame (for example from the sample timestamp) and
+// every stage traced on that thread is tagged with it. Stages that know
+// their own frame ID, such as the encoder's sample count, use it when no
+// current frame has been set.
+//
+// Tracing is compiled in but off by default, when off a scope costs one
+// relaxed load. Defining SIPSM_DISABLE_TRACING removes it completely.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace SIPSorceryMedia {
+
+  enum class TraceFormat
+  {
+    ChromeJson = 0,
+    Perfetto = 1,
+  };
+
+  class MediaTrace
+  {
+  public:
+
+    /**
+    * The number of events each thread's ring holds before the oldest are overwritten.
+    */
+    static const int RING_CAPACITY = 8192;
+
+    static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+
+    /**
+    * Sets the frame the calling thread is working on. Subsequent events on the
+    * thread are tagged with it. Set to 0 to clear.
+    */
+    static void SetCurrentFrame(uint64_t frameId);
+    static uint64_t GetCurrentFrame();
+
+    /**
+    * Gets the trace clock in nanoseconds.
+    */
+    static uint64_t NowNanoseconds();
+
+    /**
+    * Records an event into the calling thread's ring.
+    * @param[in] category: the stage category, must be a string literal.
+    * @param[in] name: the event name, must be a string literal.
+    * @param[in] frameId: the frame the event is for, 0 to use the current frame.
+    * @param[in] startNanoseconds: the start time from NowNanoseconds.
+    * @param[in] endNanoseconds: the end time from NowNanoseconds.
+    */
+    static void Record(const char* category, const char* name, uint64_t frameId, uint64_t startNanoseconds, uint64_t endNanoseconds);
+
+    /**
+    * Exports the events currently in all the rings. Events being written while the
+    * export is in progress may be omitted.
+    * @param[in] format: Chrome trace JSON or Perfetto protobuf (binary).
+    * @@Returns: the trace.
+    */
+    static std::string Export(TraceFormat format);
+
+    /**
+    * Discards all recorded events.
+    */
+    static void Clear();
+
+  private:
+    static std::atomic<bool> _enabled;
+  };
+
+  /**
+  * Records an event covering the lifetime of the object.
+  */
+  class TraceScope
+  {
+  public:
+    TraceScope(const char* category, const char* name, uint64_t frameId = 0) :
+      _category(category),
+      _name(name),
+      _frameId(frameId),
+      _start(MediaTrace::IsEnabled() ? MediaTrace::NowNanoseconds() : 0)
+    { }
+
+    ~TraceScope()
+    {
+      if (_start != 0) {
+        MediaTrace::Record(_category, _name, _frameId, _start, MediaTrace::NowNanoseconds());
+      }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+  private:
+    const char* _category;
+    const char* _name;
+    uint64_t _frameId;
+    uint64_t _start;
+  };
+}
+
+#define SIPSM_TRACE_CONCAT_INNER(a, b) a##b
+#define SIPSM_TRACE_CONCAT(a, b) SIPSM_TRACE_CONCAT_INNER(a, b)
+
+#ifndef SIPSM_DISABLE_TRACING
+#define SIPSM_TRACE_SCOPE(category, name, frameId) \
+  SIPSorceryMedia::TraceScope SIPSM_TRACE_CONCAT(_traceScope, __LINE__)(category, name, frameId)
+#else
+#define SIPSM_TRACE_SCOPE(category, name, frameId)
+#endif
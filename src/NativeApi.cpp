@@ -0,0 +1,887 @@
+//-----------------------------------------------------------------------------
+// Filename: NativeApi.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "NativeApi.h"
+#include "DtlsHandshakeNative.h"
+#include "DtlsKeyPool.h"
+#include "ImageConvertNative.h"
+#include "MediaBuffer.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+#include "MediaTrace.h"
+#include "SrtpNative.h"
+#include "ThumbnailDecoder.h"
+#include "Vp8Bitstream.h"
+#include "VpxEncoderNative.h"
+
+#include <string.h>
+#include <new>
+
+using namespace SIPSorceryMedia;
+
+// The opaque handles handed out to callers.
+struct sipsm_srtp { SrtpNative Srtp; };
+struct sipsm_vpx { VpxEncoderNative Vpx; };
+struct sipsm_image_convert { ImageConvertNative Converter; };
+struct sipsm_thumbnail_pool
+{
+  sipsm_thumbnail_pool(int decoders, int width, int height) : Pool(decoders, width, height) { }
+  ThumbnailDecoderPool Pool;
+};
+struct sipsm_thumbnail_stream
+{
+  sipsm_thumbnail_stream(ThumbnailDecoderPool& pool, int refreshMilliseconds) : Stream(pool, refreshMilliseconds) { }
+  ThumbnailStream Stream;
+};
+struct sipsm_dtls
+{
+  sipsm_dtls(const char* certFile, const char* keyFile) : Dtls(certFile, keyFile) { }
+  DtlsHandshakeNative Dtls;
+};
+
+static bool TryGetPixelFormat(int32_t pixelFormat, AVPixelFormat* avPixelFormat)
+{
+  switch (pixelFormat)
+  {
+    case SIPSM_PIXEL_FORMAT_I420: *avPixelFormat = AV_PIX_FMT_YUV420P; return true;
+    case SIPSM_PIXEL_FORMAT_RGB24: *avPixelFormat = AV_PIX_FMT_RGB24; return true;
+    case SIPSM_PIXEL_FORMAT_RGB32: *avPixelFormat = AV_PIX_FMT_RGB32; return true;
+    case SIPSM_PIXEL_FORMAT_YUY2: *avPixelFormat = AV_PIX_FMT_YUYV422; return true;
+    case SIPSM_PIXEL_FORMAT_BGR24: *avPixelFormat = AV_PIX_FMT_BGR24; return true;
+    default: return false;
+  }
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_get_api_version(void)
+{
+  return SIPSM_API_VERSION;
+}
+
+/* Buffer pool. The sipsm_buffer handle is the MediaBuffer itself. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_buffer_acquire(int32_t size, sipsm_buffer** buffer, uint8_t** data, int32_t* capacity)
+{
+  if (size < 0 || buffer == nullptr || data == nullptr || capacity == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  MediaBufferPtr acquired = MediaBufferPool::Default().Acquire(size);
+  if (!acquired) {
+    return SIPSM_ERROR;
+  }
+
+  *data = acquired->Data();
+  *capacity = (acquired->Capacity() > INT32_MAX) ? INT32_MAX : (int32_t)acquired->Capacity();
+  *buffer = reinterpret_cast<sipsm_buffer*>(acquired.Detach());
+
+  return SIPSM_OK;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_buffer_add_ref(sipsm_buffer* buffer)
+{
+  if (buffer != nullptr) {
+    reinterpret_cast<MediaBuffer*>(buffer)->AddRef();
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_buffer_release(sipsm_buffer* buffer)
+{
+  if (buffer != nullptr) {
+    reinterpret_cast<MediaBuffer*>(buffer)->Release();
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_buffer_pool_reserve(int32_t size, int32_t count)
+{
+  if (size > 0 && count > 0) {
+    MediaBufferPool::Default().Reserve(size, count);
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_buffer_pool_trim(void)
+{
+  MediaBufferPool::Default().Trim();
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_buffer_pool_get_stats(sipsm_buffer_pool_stats* stats)
+{
+  if (stats == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  MediaBufferPoolStats s = MediaBufferPool::Default().GetStats();
+  stats->acquires = s.Acquires;
+  stats->thread_cache_hits = s.ThreadCacheHits;
+  stats->pool_hits = s.PoolHits;
+  stats->system_allocations = s.SystemAllocations;
+  stats->system_frees = s.SystemFrees;
+  stats->releases = s.Releases;
+  stats->buffers_in_use = s.BuffersInUse;
+  stats->bytes_in_use = s.BytesInUse;
+  stats->buffers_pooled = s.BuffersPooled;
+  stats->bytes_pooled = s.BytesPooled;
+  stats->bytes_allocated = s.BytesAllocated;
+
+  return SIPSM_OK;
+}
+
+/* Metrics. */
+
+SIPSM_API void SIPSM_CALL sipsm_metrics_set_enabled(int32_t enabled)
+{
+  MetricsControl::SetEnabled(enabled != 0);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_metrics_snapshot(int32_t format, char* out, int32_t outCapacity, int32_t* outLength)
+{
+  if (outLength == nullptr || (out == nullptr && outCapacity > 0) ||
+    (format != SIPSM_METRICS_FORMAT_PROMETHEUS && format != SIPSM_METRICS_FORMAT_JSON)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  std::string snapshot = MetricsRegistry::Default().Snapshot(
+    (format == SIPSM_METRICS_FORMAT_JSON) ? MetricsFormat::Json : MetricsFormat::Prometheus);
+
+  *outLength = (int32_t)snapshot.size();
+  if (outCapacity < (int32_t)snapshot.size()) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+  memcpy(out, snapshot.data(), snapshot.size());
+
+  return SIPSM_OK;
+}
+
+/* Tracing. */
+
+SIPSM_API void SIPSM_CALL sipsm_trace_set_enabled(int32_t enabled)
+{
+  MediaTrace::SetEnabled(enabled != 0);
+}
+
+SIPSM_API void SIPSM_CALL sipsm_trace_set_current_frame(uint64_t frameId)
+{
+  MediaTrace::SetCurrentFrame(frameId);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_trace_export(int32_t format, char* out, int32_t outCapacity, int32_t* outLength)
+{
+  if (outLength == nullptr || (out == nullptr && outCapacity > 0) ||
+    (format != SIPSM_TRACE_FORMAT_CHROME_JSON && format != SIPSM_TRACE_FORMAT_PERFETTO)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  std::string trace = MediaTrace::Export(
+    (format == SIPSM_TRACE_FORMAT_PERFETTO) ? TraceFormat::Perfetto : TraceFormat::ChromeJson);
+
+  *outLength = (int32_t)trace.size();
+  if (outCapacity < (int32_t)trace.size()) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+  memcpy(out, trace.data(), trace.size());
+
+  return SIPSM_OK;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_trace_clear(void)
+{
+  MediaTrace::Clear();
+}
+
+/* Logging. */
+
+namespace {
+  sipsm_log_callback _logCallback = nullptr;
+
+  void ForwardLog(LogLevel level, const char* message, size_t length, void* context)
+  {
+    _logCallback((int32_t)level, message, (int32_t)length, context);
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_log_set_level(int32_t level)
+{
+  if (level >= SIPSM_LOG_LEVEL_TRACE && level <= SIPSM_LOG_LEVEL_NONE) {
+    MediaLog::SetLevel((LogLevel)level);
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_log_set_rate_limit(int32_t messagesPerSecond)
+{
+  MediaLog::SetRateLimit((messagesPerSecond > 0) ? (uint32_t)messagesPerSecond : 0);
+}
+
+SIPSM_API void SIPSM_CALL sipsm_log_set_sink(sipsm_log_callback callback, void* context)
+{
+  // Detach the old callback before replacing it, SetSink waits for any call in
+  // progress to finish.
+  MediaLog::SetSink(nullptr, nullptr);
+  _logCallback = callback;
+  if (callback != nullptr) {
+    MediaLog::SetSink(ForwardLog, context);
+  }
+}
+
+SIPSM_API void SIPSM_CALL sipsm_log_flush(void)
+{
+  MediaLog::Flush();
+}
+
+/* SRTP. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create(const uint8_t* key, int32_t keyLength, int32_t isClient, sipsm_srtp** session)
+{
+  if (key == nullptr || session == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  sipsm_srtp* s = new (std::nothrow) sipsm_srtp();
+  if (s == nullptr) {
+    return SIPSM_ERROR;
+  }
+
+  int res = s->Srtp.InitWithKey(key, keyLength, isClient != 0);
+  if (res != srtp_err_status_ok) {
+    delete s;
+    return res;
+  }
+
+  *session = s;
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create_with_mki(const uint8_t* key, int32_t keyLength, const uint8_t* mki, int32_t mkiLength,
+  int32_t isClient, sipsm_srtp** session)
+{
+  if (key == nullptr || mki == nullptr || session == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  sipsm_srtp* s = new (std::nothrow) sipsm_srtp();
+  if (s == nullptr) {
+    return SIPSM_ERROR;
+  }
+
+  int res = s->Srtp.SetMki(mki, mkiLength);
+  if (res == srtp_err_status_ok) {
+    res = s->Srtp.InitWithKey(key, keyLength, isClient != 0);
+  }
+  if (res != srtp_err_status_ok) {
+    delete s;
+    return res;
+  }
+
+  *session = s;
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_rekey(sipsm_srtp* session, const uint8_t* key, int32_t keyLength, const uint8_t* mki, int32_t mkiLength)
+{
+  if (session == nullptr || key == nullptr || mki == nullptr || mkiLength != session->Srtp.GetMkiLength()) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return session->Srtp.Rekey(key, keyLength, mki);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create_from_dtls(sipsm_dtls* dtls, int32_t isClient, sipsm_srtp** session)
+{
+  if (dtls == nullptr || session == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  sipsm_srtp* s = new (std::nothrow) sipsm_srtp();
+  if (s == nullptr) {
+    return SIPSM_ERROR;
+  }
+
+  uint8_t material[DtlsHandshakeNative::SRTP_KEYING_MATERIAL_LENGTH];
+  int res = dtls->Dtls.ExportSrtpKeyingMaterial(material, sizeof(material));
+  if (res == 0) {
+    res = s->Srtp.InitFromKeyingMaterial(material, sizeof(material), isClient != 0);
+    OPENSSL_cleanse(material, sizeof(material));
+  }
+
+  if (res != 0) {
+    delete s;
+    return SIPSM_ERROR;
+  }
+
+  *session = s;
+  return SIPSM_OK;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_srtp_destroy(sipsm_srtp* session)
+{
+  delete session;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_protect_rtp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t capacity, int32_t* outLength)
+{
+  if (session == nullptr || buffer == nullptr || outLength == nullptr || length <= 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+  else if (capacity < length + SRTP_MAX_TRAILER_LEN) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+
+  return session->Srtp.ProtectRTP(buffer, length, outLength);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_unprotect_rtp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t* outLength)
+{
+  if (session == nullptr || buffer == nullptr || outLength == nullptr || length <= 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return session->Srtp.UnprotectRTP(buffer, length, outLength);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_protect_rtcp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t capacity, int32_t* outLength)
+{
+  if (session == nullptr || buffer == nullptr || outLength == nullptr || length <= 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+  else if (capacity < length + SRTP_MAX_TRAILER_LEN) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+
+  return session->Srtp.ProtectRTCP(buffer, length, outLength);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_unprotect_rtcp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t* outLength)
+{
+  if (session == nullptr || buffer == nullptr || outLength == nullptr || length <= 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return session->Srtp.UnprotectRTCP(buffer, length, outLength);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_get_stats(sipsm_srtp* session, sipsm_srtp_stats* stats)
+{
+  if (session == nullptr || stats == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  const SrtpStats& s = session->Srtp.GetStats();
+  stats->rtp_protected = s.RtpProtected;
+  stats->rtp_unprotected = s.RtpUnprotected;
+  stats->rtcp_protected = s.RtcpProtected;
+  stats->rtcp_unprotected = s.RtcpUnprotected;
+  stats->bytes_protected = s.BytesProtected;
+  stats->bytes_unprotected = s.BytesUnprotected;
+  stats->protect_failures = s.ProtectFailures;
+  stats->unprotect_failures = s.UnprotectFailures;
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_srtp_get_crypto_info(sipsm_srtp_crypto_info* info)
+{
+  if (info == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  SrtpCryptoInfo cryptoInfo = SrtpNative::GetCryptoInfo();
+  info->libsrtp_backend = (int32_t)cryptoInfo.LibSrtp;
+  info->rtp_backend = (int32_t)cryptoInfo.Rtp;
+  info->is_aes_gcm_available = (cryptoInfo.IsAesGcmAvailable) ? 1 : 0;
+  info->is_aes_ni = (cryptoInfo.IsAesNi) ? 1 : 0;
+
+  return SIPSM_OK;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_srtp_set_openssl_preferred(int32_t isPreferred)
+{
+  SrtpNative::SetOpenSslPreferred(isPreferred != 0);
+}
+
+/* VP8. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_create(sipsm_vpx** codec)
+{
+  if (codec == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  *codec = new (std::nothrow) sipsm_vpx();
+  return (*codec != nullptr) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_vpx_destroy(sipsm_vpx* codec)
+{
+  delete codec;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_init_encoder(sipsm_vpx* codec, uint32_t width, uint32_t height, uint32_t stride,
+  uint32_t targetBitrate, uint32_t minQuantizer, uint32_t maxQuantizer, int32_t isCbr)
+{
+  if (codec == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  VpxEncoderConfig config;
+  config.TargetBitrate = targetBitrate;
+  config.MinQuantizer = minQuantizer;
+  config.MaxQuantizer = maxQuantizer;
+  config.IsCbr = isCbr != 0;
+
+  return (codec->Vpx.InitEncoder(width, height, stride, config) == 0) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_init_decoder(sipsm_vpx* codec)
+{
+  if (codec == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return (codec->Vpx.InitDecoder() == 0) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_encode(sipsm_vpx* codec, const uint8_t* i420, int32_t i420Length, int32_t sampleCount,
+  uint8_t* out, int32_t outCapacity, int32_t* outLength, int32_t* isKeyFrame)
+{
+  if (codec == nullptr || i420 == nullptr || outLength == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  const uint8_t* frame = nullptr;
+  int frameLength = 0;
+  bool keyFrame = false;
+
+  if (codec->Vpx.Encode(i420, i420Length, sampleCount, &frame, &frameLength, &keyFrame) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  *outLength = frameLength;
+  if (isKeyFrame != nullptr) {
+    *isKeyFrame = keyFrame ? 1 : 0;
+  }
+
+  if (frame != nullptr) {
+    if (out == nullptr || outCapacity < frameLength) {
+      return SIPSM_ERROR_BUFFER_TOO_SMALL;
+    }
+    memcpy(out, frame, frameLength);
+  }
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_decode(sipsm_vpx* codec, const uint8_t* buffer, int32_t bufferLength,
+  uint8_t* out, int32_t outCapacity, int32_t* outLength, uint32_t* width, uint32_t* height)
+{
+  if (codec == nullptr || buffer == nullptr || outLength == nullptr || width == nullptr || height == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  const uint8_t* frame = nullptr;
+  int frameLength = 0;
+
+  if (codec->Vpx.Decode(buffer, bufferLength, &frame, &frameLength, width, height) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  *outLength = frameLength;
+
+  if (frame != nullptr) {
+    if (out == nullptr || outCapacity < frameLength) {
+      return SIPSM_ERROR_BUFFER_TOO_SMALL;
+    }
+    memcpy(out, frame, frameLength);
+  }
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vpx_get_stats(sipsm_vpx* codec, sipsm_vpx_stats* stats)
+{
+  if (codec == nullptr || stats == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  const VpxStats& s = codec->Vpx.GetStats();
+  stats->frames_encoded = s.FramesEncoded;
+  stats->key_frames_encoded = s.KeyFramesEncoded;
+  stats->bytes_encoded = s.BytesEncoded;
+  stats->encode_failures = s.EncodeFailures;
+  stats->frames_decoded = s.FramesDecoded;
+  stats->bytes_decoded = s.BytesDecoded;
+  stats->decode_failures = s.DecodeFailures;
+
+  return SIPSM_OK;
+}
+
+/* VP8 bitstream. */
+
+static void CopyFrameInfo(const Vp8FrameInfo& from, sipsm_vp8_frame_info* to)
+{
+  to->is_key_frame = from.IsKeyFrame;
+  to->version = from.Version;
+  to->is_shown = from.IsShown;
+  to->first_partition_length = from.FirstPartitionLength;
+  to->width = from.Width;
+  to->height = from.Height;
+  to->horizontal_scale = from.HorizontalScale;
+  to->vertical_scale = from.VerticalScale;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vp8_parse_frame_header(const uint8_t* frame, int32_t length, sipsm_vp8_frame_info* info)
+{
+  if (frame == nullptr || info == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  Vp8FrameInfo frameInfo;
+  if (Vp8Bitstream::ParseFrameHeader(frame, length, &frameInfo) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  CopyFrameInfo(frameInfo, info);
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_vp8_inspect_rtp(const uint8_t* rtp, int32_t length, sipsm_vp8_descriptor* descriptor,
+  sipsm_vp8_frame_info* info)
+{
+  if (rtp == nullptr || descriptor == nullptr || info == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  Vp8PayloadDescriptor payloadDescriptor;
+  Vp8FrameInfo frameInfo;
+  int result = Vp8Bitstream::InspectRtp(rtp, length, &payloadDescriptor, &frameInfo);
+  if (result < 0) {
+    return SIPSM_ERROR;
+  }
+
+  descriptor->length = payloadDescriptor.Length;
+  descriptor->is_non_reference = payloadDescriptor.IsNonReference;
+  descriptor->is_partition_start = payloadDescriptor.IsPartitionStart;
+  descriptor->partition_index = payloadDescriptor.PartitionIndex;
+  descriptor->picture_id = payloadDescriptor.PictureId;
+  descriptor->tl0_pic_idx = payloadDescriptor.Tl0PicIdx;
+  descriptor->temporal_layer = payloadDescriptor.TemporalLayer;
+  descriptor->is_layer_sync = payloadDescriptor.IsLayerSync;
+  descriptor->key_index = payloadDescriptor.KeyIndex;
+
+  if (result == 1) {
+    CopyFrameInfo(frameInfo, info);
+  }
+
+  return result;
+}
+
+/* Thumbnails. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_pool_create(int32_t decoders, int32_t width, int32_t height, sipsm_thumbnail_pool** pool)
+{
+  if (pool == nullptr || decoders < 0 || width < 0 || height < 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  *pool = new (std::nothrow) sipsm_thumbnail_pool(
+    (decoders > 0) ? decoders : ThumbnailDecoderPool::DEFAULT_DECODERS,
+    (width > 0) ? width : ThumbnailDecoderPool::DEFAULT_WIDTH,
+    (height > 0) ? height : ThumbnailDecoderPool::DEFAULT_HEIGHT);
+  return (*pool != nullptr) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_thumbnail_pool_destroy(sipsm_thumbnail_pool* pool)
+{
+  delete pool;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_pool_get_stats(sipsm_thumbnail_pool* pool, sipsm_thumbnail_stats* stats)
+{
+  if (pool == nullptr || stats == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  ThumbnailStats s = pool->Pool.GetStats();
+  stats->frames_offered = s.FramesOffered;
+  stats->key_frames_offered = s.KeyFramesOffered;
+  stats->decodes_queued = s.DecodesQueued;
+  stats->decodes_skipped = s.DecodesSkipped;
+  stats->thumbnails_updated = s.ThumbnailsUpdated;
+  stats->decode_failures = s.DecodeFailures;
+  stats->decode_nanoseconds_total = s.DecodeNanosecondsTotal;
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_create(sipsm_thumbnail_pool* pool, int32_t refreshMilliseconds,
+  sipsm_thumbnail_stream** stream)
+{
+  if (pool == nullptr || stream == nullptr || refreshMilliseconds < 0) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  *stream = new (std::nothrow) sipsm_thumbnail_stream(pool->Pool, refreshMilliseconds);
+  return (*stream != nullptr) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_thumbnail_stream_destroy(sipsm_thumbnail_stream* stream)
+{
+  delete stream;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_push(sipsm_thumbnail_stream* stream, const uint8_t* frame, int32_t length)
+{
+  if (stream == nullptr || frame == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  int result = stream->Stream.PushFrame(frame, length, MediaScheduler::NowNanoseconds());
+  return (result < 0) ? SIPSM_ERROR : result;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_is_refresh_due(sipsm_thumbnail_stream* stream)
+{
+  if (stream == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return stream->Stream.IsRefreshDue(MediaScheduler::NowNanoseconds()) ? 1 : 0;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_get(sipsm_thumbnail_stream* stream, uint8_t* out, int32_t outCapacity,
+  int32_t* outLength, int32_t* width, int32_t* height)
+{
+  if (stream == nullptr || outLength == nullptr || width == nullptr || height == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  MediaBufferPtr image;
+  uint64_t updatedNanoseconds = 0;
+  if (stream->Stream.GetThumbnail(image, width, height, &updatedNanoseconds) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  *outLength = (int32_t)image->Length();
+  if (out == nullptr || outCapacity < *outLength) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+  memcpy(out, image->Data(), image->Length());
+
+  return SIPSM_OK;
+}
+
+/* Image conversion. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_create(sipsm_image_convert** converter)
+{
+  if (converter == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  *converter = new (std::nothrow) sipsm_image_convert();
+  return (*converter != nullptr) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_image_convert_destroy(sipsm_image_convert* converter)
+{
+  delete converter;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_image_get_buffer_size(int32_t pixelFormat, int32_t width, int32_t height)
+{
+  AVPixelFormat avPixelFormat;
+  if (!TryGetPixelFormat(pixelFormat, &avPixelFormat)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return ImageConvertNative::GetBufferSize(avPixelFormat, width, height);
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_rgb_to_yuv(sipsm_image_convert* converter, const uint8_t* rgb, int32_t rgbFormat,
+  int32_t width, int32_t height, int32_t stride, int32_t yuvFormat, uint8_t* out, int32_t outCapacity, int32_t* outLength)
+{
+  AVPixelFormat rgbPixelFormat, yuvPixelFormat;
+
+  if (converter == nullptr || rgb == nullptr || outLength == nullptr ||
+    !TryGetPixelFormat(rgbFormat, &rgbPixelFormat) || !TryGetPixelFormat(yuvFormat, &yuvPixelFormat)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  int required = ImageConvertNative::GetBufferSize(yuvPixelFormat, width, height);
+  if (out == nullptr || outCapacity < required) {
+    *outLength = required;
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+
+  int length = 0;
+  int res = converter->Converter.ConvertRGBtoYUV(rgb, rgbPixelFormat, width, height, stride, yuvPixelFormat, out, outCapacity, &length);
+  *outLength = length;
+
+  return (res == 0) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_yuv_to_rgb(sipsm_image_convert* converter, const uint8_t* yuv, int32_t yuvFormat,
+  int32_t width, int32_t height, int32_t rgbFormat, uint8_t* out, int32_t outCapacity, int32_t* outLength, int32_t* outStride)
+{
+  AVPixelFormat yuvPixelFormat, rgbPixelFormat;
+
+  if (converter == nullptr || yuv == nullptr || outLength == nullptr || outStride == nullptr ||
+    !TryGetPixelFormat(yuvFormat, &yuvPixelFormat) || !TryGetPixelFormat(rgbFormat, &rgbPixelFormat)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  int required = ImageConvertNative::GetBufferSize(rgbPixelFormat, width, height);
+  if (out == nullptr || outCapacity < required) {
+    *outLength = required;
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+
+  int length = 0, stride = 0;
+  int res = converter->Converter.ConvertYUVToRGB(yuv, yuvPixelFormat, width, height, rgbPixelFormat, out, outCapacity, &length, &stride);
+  *outLength = length;
+  *outStride = stride;
+
+  return (res == 0) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_get_stats(sipsm_image_convert* converter, sipsm_image_convert_stats* stats)
+{
+  if (converter == nullptr || stats == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  const ImageConvertStats& s = converter->Converter.GetStats();
+  stats->frames_converted = s.FramesConverted;
+  stats->bytes_out = s.BytesOut;
+  stats->convert_failures = s.ConvertFailures;
+
+  return SIPSM_OK;
+}
+
+/* DTLS. */
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_create(const char* certFile, const char* keyFile, sipsm_dtls** dtls)
+{
+  if (certFile == nullptr || keyFile == nullptr || dtls == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  *dtls = new (std::nothrow) sipsm_dtls(certFile, keyFile);
+  return (*dtls != nullptr) ? SIPSM_OK : SIPSM_ERROR;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_dtls_destroy(sipsm_dtls* dtls)
+{
+  delete dtls;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_handshake_as_server(sipsm_dtls* dtls, intptr_t socket,
+  uint8_t* fingerprint, int32_t fingerprintCapacity, int32_t* fingerprintLength)
+{
+  if (dtls == nullptr || fingerprint == nullptr || fingerprintLength == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  uint8_t fp[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+  int fpLength = 0;
+
+  if (dtls->Dtls.DoHandshakeAsServer((SOCKET)socket, fp, &fpLength) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  *fingerprintLength = fpLength;
+  if (fingerprintCapacity < fpLength) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+  memcpy(fingerprint, fp, fpLength);
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_handshake_as_client(sipsm_dtls* dtls, intptr_t socket,
+  const uint8_t* serverAddress, int32_t serverAddressLength,
+  uint8_t* fingerprint, int32_t fingerprintCapacity, int32_t* fingerprintLength)
+{
+  if (dtls == nullptr || serverAddress == nullptr || fingerprint == nullptr || fingerprintLength == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  // Copied so the address is aligned and its family can be checked against its length.
+  sockaddr_storage address;
+  if (serverAddressLength < (int32_t)sizeof(sockaddr_in) || serverAddressLength > (int32_t)sizeof(address)) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+  memset(&address, 0, sizeof(address));
+  memcpy(&address, serverAddress, serverAddressLength);
+
+  if (!(address.ss_family == AF_INET || (address.ss_family == AF_INET6 && serverAddressLength >= (int32_t)sizeof(sockaddr_in6)))) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  uint8_t fp[DtlsHandshakeNative::FINGERPRINT_MAX_LENGTH];
+  int fpLength = 0;
+
+  if (dtls->Dtls.DoHandshakeAsClient((SOCKET)socket, reinterpret_cast<const sockaddr*>(&address), fp, &fpLength) != 0) {
+    return SIPSM_ERROR;
+  }
+
+  *fingerprintLength = fpLength;
+  if (fingerprintCapacity < fpLength) {
+    return SIPSM_ERROR_BUFFER_TOO_SMALL;
+  }
+  memcpy(fingerprint, fp, fpLength);
+
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_is_handshake_complete(sipsm_dtls* dtls)
+{
+  return (dtls != nullptr && dtls->Dtls.IsHandshakeComplete()) ? 1 : 0;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_dtls_set_release_after_key_export(sipsm_dtls* dtls, int32_t release)
+{
+  if (dtls != nullptr) {
+    dtls->Dtls.ReleaseAfterKeyExport = (release != 0);
+  }
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_set_cipher_list(sipsm_dtls* dtls, const char* cipherList)
+{
+  if (dtls == nullptr || cipherList == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  dtls->Dtls.CipherList = cipherList;
+  return SIPSM_OK;
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_set_groups(sipsm_dtls* dtls, const char* groups)
+{
+  if (dtls == nullptr || groups == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  dtls->Dtls.Groups = groups;
+  return SIPSM_OK;
+}
+
+SIPSM_API void SIPSM_CALL sipsm_dtls_set_precomputed_keys(sipsm_dtls* dtls, int32_t enable)
+{
+  if (dtls != nullptr) {
+    dtls->Dtls.SetKeyPool((enable != 0) ? &DtlsKeyPool::Default() : nullptr);
+  }
+}
+
+SIPSM_API int32_t SIPSM_CALL sipsm_dtls_release_state(sipsm_dtls* dtls)
+{
+  if (dtls == nullptr) {
+    return SIPSM_ERROR_INVALID_ARGUMENT;
+  }
+
+  return (dtls->Dtls.ReleaseState() == 0) ? SIPSM_OK : SIPSM_ERROR;
+}
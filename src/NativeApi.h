@@ -0,0 +1,502 @@
+//-----------------------------------------------------------------------------
+// Filename: NativeApi.h
+//
+// Description: Flat C API over the native media core. The API is intended to
+// be called from .NET using P/Invoke or unmanaged function pointers without
+// needing the C++/CLI wrappers and with no marshalling:
+//
+//  - All objects are exposed as opaque handles that must be destroyed with
+//    the matching sipsm_*_destroy function.
+//  - Buffers are passed as a pointer and length. The caller owns them and is
+//    responsible for pinning (or using stackalloc/native memory).
+//  - Statistics are returned in blittable structs made up only of 64 bit
+//    integers.
+//  - No function blocks or calls back into managed code, apart from the DTLS
+//    handshake functions, sipsm_log_set_sink and sipsm_log_flush. The log
+//    sink is only ever called on the native logging thread. The buffer pool
+//    functions may briefly take a lock when the calling thread's cache is
+//    empty. Everything else is safe to declare with [SuppressGCTransition].
+//
+// Unless otherwise noted functions return SIPSM_OK (0) on success or one of
+// the negative SIPSM_ERROR_* codes. The SRTP protect/unprotect functions
+// additionally return the positive libsrtp srtp_err_status_t value on a
+// libsrtp failure.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#define SIPSM_API __declspec(dllexport)
+#define SIPSM_CALL __cdecl
+#else
+#define SIPSM_API __attribute__((visibility("default")))
+#define SIPSM_CALL
+#endif
+
+#define SIPSM_API_VERSION 1
+
+#define SIPSM_OK 0
+#define SIPSM_ERROR -1
+#define SIPSM_ERROR_INVALID_ARGUMENT -2
+#define SIPSM_ERROR_BUFFER_TOO_SMALL -3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Opaque handles. */
+  typedef struct sipsm_srtp sipsm_srtp;
+  typedef struct sipsm_vpx sipsm_vpx;
+  typedef struct sipsm_image_convert sipsm_image_convert;
+  typedef struct sipsm_dtls sipsm_dtls;
+  typedef struct sipsm_buffer sipsm_buffer;
+  typedef struct sipsm_thumbnail_pool sipsm_thumbnail_pool;
+  typedef struct sipsm_thumbnail_stream sipsm_thumbnail_stream;
+
+  /* Pixel formats, the ordinals match the managed VideoSubTypesEnum. */
+  typedef enum {
+    SIPSM_PIXEL_FORMAT_I420 = 0,
+    SIPSM_PIXEL_FORMAT_RGB24 = 1,
+    SIPSM_PIXEL_FORMAT_RGB32 = 2,
+    SIPSM_PIXEL_FORMAT_YUY2 = 3,
+    SIPSM_PIXEL_FORMAT_BGR24 = 4,
+  } sipsm_pixel_format;
+
+  typedef enum {
+    SIPSM_METRICS_FORMAT_PROMETHEUS = 0,
+    SIPSM_METRICS_FORMAT_JSON = 1,
+  } sipsm_metrics_format;
+
+  typedef enum {
+    SIPSM_TRACE_FORMAT_CHROME_JSON = 0,
+    SIPSM_TRACE_FORMAT_PERFETTO = 1,
+  } sipsm_trace_format;
+
+  /* Log levels, the ordinals match Microsoft.Extensions.Logging.LogLevel. */
+  typedef enum {
+    SIPSM_LOG_LEVEL_TRACE = 0,
+    SIPSM_LOG_LEVEL_DEBUG = 1,
+    SIPSM_LOG_LEVEL_INFO = 2,
+    SIPSM_LOG_LEVEL_WARNING = 3,
+    SIPSM_LOG_LEVEL_ERROR = 4,
+    SIPSM_LOG_LEVEL_CRITICAL = 5,
+    SIPSM_LOG_LEVEL_NONE = 6,
+  } sipsm_log_level;
+
+  /**
+  * Receives native log messages. The message is not null terminated.
+  */
+  typedef void (SIPSM_CALL* sipsm_log_callback)(int32_t level, const char* message, int32_t length, void* context);
+
+  typedef struct {
+    uint64_t rtp_protected;
+    uint64_t rtp_unprotected;
+    uint64_t rtcp_protected;
+    uint64_t rtcp_unprotected;
+    uint64_t bytes_protected;
+    uint64_t bytes_unprotected;
+    uint64_t protect_failures;
+    uint64_t unprotect_failures;
+  } sipsm_srtp_stats;
+
+  /* SRTP crypto backends, the ordinals match SrtpCryptoBackend. */
+  typedef enum {
+    SIPSM_SRTP_CRYPTO_LIBSRTP_INTERNAL = 0,
+    SIPSM_SRTP_CRYPTO_LIBSRTP_OPENSSL = 1,
+    SIPSM_SRTP_CRYPTO_OPENSSL = 2,
+    SIPSM_SRTP_CRYPTO_UNKNOWN = 3,
+  } sipsm_srtp_crypto_backend;
+
+  typedef struct {
+    int32_t libsrtp_backend;
+    int32_t rtp_backend;
+    int32_t is_aes_gcm_available;
+    int32_t is_aes_ni;
+  } sipsm_srtp_crypto_info;
+
+  typedef struct {
+    uint64_t frames_encoded;
+    uint64_t key_frames_encoded;
+    uint64_t bytes_encoded;
+    uint64_t encode_failures;
+    uint64_t frames_decoded;
+    uint64_t bytes_decoded;
+    uint64_t decode_failures;
+  } sipsm_vpx_stats;
+
+  /* The uncompressed data chunk of a VP8 frame, see Vp8FrameInfo. */
+  typedef struct {
+    int32_t is_key_frame;
+    int32_t version;
+    int32_t is_shown;
+    int32_t first_partition_length;
+    int32_t width;
+    int32_t height;
+    int32_t horizontal_scale;
+    int32_t vertical_scale;
+  } sipsm_vp8_frame_info;
+
+  /* The VP8 payload descriptor of an RTP packet, fields that aren't present are -1. */
+  typedef struct {
+    int32_t length;
+    int32_t is_non_reference;
+    int32_t is_partition_start;
+    int32_t partition_index;
+    int32_t picture_id;
+    int32_t tl0_pic_idx;
+    int32_t temporal_layer;
+    int32_t is_layer_sync;
+    int32_t key_index;
+  } sipsm_vp8_descriptor;
+
+  typedef struct {
+    uint64_t frames_offered;
+    uint64_t key_frames_offered;
+    uint64_t decodes_queued;
+    uint64_t decodes_skipped;
+    uint64_t thumbnails_updated;
+    uint64_t decode_failures;
+    uint64_t decode_nanoseconds_total;
+  } sipsm_thumbnail_stats;
+
+  typedef struct {
+    uint64_t frames_converted;
+    uint64_t bytes_out;
+    uint64_t convert_failures;
+  } sipsm_image_convert_stats;
+
+  typedef struct {
+    uint64_t acquires;
+    uint64_t thread_cache_hits;
+    uint64_t pool_hits;
+    uint64_t system_allocations;
+    uint64_t system_frees;
+    uint64_t releases;
+    uint64_t buffers_in_use;
+    uint64_t bytes_in_use;
+    uint64_t buffers_pooled;
+    uint64_t bytes_pooled;
+    uint64_t bytes_allocated;
+  } sipsm_buffer_pool_stats;
+
+  /**
+  * Gets the version of this API. Does no work and can be used to measure the cost
+  * of a call across the managed/native boundary.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_get_api_version(void);
+
+  /* Buffer pool. Buffers come from the same pool the native encoder, decoder and
+     converters use, letting a caller fill or hold a frame without copying it. */
+
+  /**
+  * Acquires a reference counted buffer from the shared pool.
+  * @param[in] size: the number of bytes required.
+  * @param[out] buffer: the buffer handle, release with sipsm_buffer_release.
+  * @param[out] data: pointer to the buffer's memory, 64 byte aligned.
+  * @param[out] capacity: the usable length of the buffer, at least size.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_buffer_acquire(int32_t size, sipsm_buffer** buffer, uint8_t** data, int32_t* capacity);
+  SIPSM_API void SIPSM_CALL sipsm_buffer_add_ref(sipsm_buffer* buffer);
+  SIPSM_API void SIPSM_CALL sipsm_buffer_release(sipsm_buffer* buffer);
+
+  /**
+  * Pre-allocates buffers so the first frames don't hit the system allocator.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_buffer_pool_reserve(int32_t size, int32_t count);
+
+  /**
+  * Returns the pool's free buffers to the system.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_buffer_pool_trim(void);
+  SIPSM_API int32_t SIPSM_CALL sipsm_buffer_pool_get_stats(sipsm_buffer_pool_stats* stats);
+
+  /* Metrics. */
+
+  /**
+  * Turns recording of the process wide metrics on or off. Recording is on by default.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_metrics_set_enabled(int32_t enabled);
+
+  /**
+  * Writes a snapshot of the process wide metrics, not null terminated. If the buffer is
+  * too small SIPSM_ERROR_BUFFER_TOO_SMALL is returned and outLength is set to the
+  * required length.
+  * @param[in] format: one of the sipsm_metrics_format values.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_metrics_snapshot(int32_t format, char* out, int32_t outCapacity, int32_t* outLength);
+
+  /* Tracing. */
+
+  /**
+  * Turns recording of the per stage trace events on or off. Tracing is off by default.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_trace_set_enabled(int32_t enabled);
+
+  /**
+  * Sets the frame ID the stages subsequently called on this thread are tagged with.
+  * Set to 0 to clear.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_trace_set_current_frame(uint64_t frameId);
+
+  /**
+  * Writes the recorded trace events using the same buffer convention as
+  * sipsm_metrics_snapshot. The Perfetto format is binary.
+  * @param[in] format: one of the sipsm_trace_format values.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_trace_export(int32_t format, char* out, int32_t outCapacity, int32_t* outLength);
+  SIPSM_API void SIPSM_CALL sipsm_trace_clear(void);
+
+  /* Logging. */
+
+  /**
+  * Sets the minimum level of native messages that are logged. The default is
+  * SIPSM_LOG_LEVEL_INFO.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_log_set_level(int32_t level);
+
+  /**
+  * Sets the maximum number of messages each native log statement can write per
+  * second, 0 for no limit. The default is 10.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_log_set_rate_limit(int32_t messagesPerSecond);
+
+  /**
+  * Forwards native log messages to a callback instead of stderr.
+  * @param[in] callback: called on the native logging thread, NULL to restore stderr.
+  * @param[in] context: opaque value passed to the callback.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_log_set_sink(sipsm_log_callback callback, void* context);
+
+  /**
+  * Blocks until the messages logged so far have been passed to the sink.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_log_flush(void);
+
+  /* SRTP. */
+
+  /**
+  * Creates an SRTP session from raw key material (master key followed by master salt).
+  * @param[in] isClient: non-zero if the session will be used to send.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create(const uint8_t* key, int32_t keyLength, int32_t isClient, sipsm_srtp** session);
+
+  /**
+  * Creates an SRTP session from the keying material of a completed DTLS handshake.
+  * @param[in] isClient: non-zero if the session will be used to receive.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create_from_dtls(sipsm_dtls* dtls, int32_t isClient, sipsm_srtp** session);
+
+  /**
+  * Creates an SRTP session whose packets carry an MKI, so it can be rekeyed with
+  * sipsm_srtp_rekey. See SrtpNative::SetMki.
+  * @param[in] mkiLength: the MKI length, 1 to 4 bytes.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_create_with_mki(const uint8_t* key, int32_t keyLength, const uint8_t* mki, int32_t mkiLength,
+    int32_t isClient, sipsm_srtp** session);
+
+  /**
+  * Changes the master key of a session created with an MKI without losing packets,
+  * see SrtpNative::Rekey. Must not be called at the same time as the RTCP functions.
+  * @param[in] mkiLength: must be the length the session was created with.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_rekey(sipsm_srtp* session, const uint8_t* key, int32_t keyLength, const uint8_t* mki, int32_t mkiLength);
+
+  SIPSM_API void SIPSM_CALL sipsm_srtp_destroy(sipsm_srtp* session);
+
+  /**
+  * Protects an RTP packet in place.
+  * @param[in] length: the length of the RTP packet in the buffer.
+  * @param[in] capacity: the total length of the buffer, must leave room for the
+  *  authentication tag.
+  * @param[out] outLength: the length of the protected packet.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_protect_rtp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t capacity, int32_t* outLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_unprotect_rtp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t* outLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_protect_rtcp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t capacity, int32_t* outLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_unprotect_rtcp(sipsm_srtp* session, uint8_t* buffer, int32_t length, int32_t* outLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_get_stats(sipsm_srtp* session, sipsm_srtp_stats* stats);
+
+  /**
+  * Gets the crypto backends SRTP uses, see SrtpNative::GetCryptoInfo.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_srtp_get_crypto_info(sipsm_srtp_crypto_info* info);
+
+  /**
+  * Sets whether sessions created from now on protect RTP with OpenSSL unless libsrtp
+  * is known to use OpenSSL. Defaults to off.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_srtp_set_openssl_preferred(int32_t isPreferred);
+
+  /* VP8. */
+
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_create(sipsm_vpx** codec);
+  SIPSM_API void SIPSM_CALL sipsm_vpx_destroy(sipsm_vpx* codec);
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_init_encoder(sipsm_vpx* codec, uint32_t width, uint32_t height, uint32_t stride,
+    uint32_t targetBitrate, uint32_t minQuantizer, uint32_t maxQuantizer, int32_t isCbr);
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_init_decoder(sipsm_vpx* codec);
+
+  /**
+  * Encodes an I420 frame. If the encoder did not output a frame outLength is set to 0.
+  * If the output buffer is too small SIPSM_ERROR_BUFFER_TOO_SMALL is returned and
+  * outLength is set to the required length.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_encode(sipsm_vpx* codec, const uint8_t* i420, int32_t i420Length, int32_t sampleCount,
+    uint8_t* out, int32_t outCapacity, int32_t* outLength, int32_t* isKeyFrame);
+
+  /**
+  * Decodes a VP8 frame to a packed I420 image. If the decoder did not output an image
+  * outLength is set to 0. If the output buffer is too small SIPSM_ERROR_BUFFER_TOO_SMALL
+  * is returned and outLength, width and height are set for the image that was dropped.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_decode(sipsm_vpx* codec, const uint8_t* buffer, int32_t bufferLength,
+    uint8_t* out, int32_t outCapacity, int32_t* outLength, uint32_t* width, uint32_t* height);
+  SIPSM_API int32_t SIPSM_CALL sipsm_vpx_get_stats(sipsm_vpx* codec, sipsm_vpx_stats* stats);
+
+  /**
+  * Reads the key frame flag, version, show flag, first partition length and, for key
+  * frames, the dimensions from the start of an encoded VP8 frame without decoding it.
+  * Only the first 10 bytes are read.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_vp8_parse_frame_header(const uint8_t* frame, int32_t length, sipsm_vp8_frame_info* info);
+
+  /**
+  * Reads the VP8 payload descriptor of an unprotected RTP packet and, if the packet
+  * starts a frame, the frame's header. Returns 1 if the packet starts a frame and info
+  * was set, 0 if it doesn't, or an error.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_vp8_inspect_rtp(const uint8_t* rtp, int32_t length, sipsm_vp8_descriptor* descriptor,
+    sipsm_vp8_frame_info* info);
+
+  /* Thumbnails. */
+
+  /**
+  * Creates a pool of VP8 decoders shared by thumbnail streams.
+  * @param[in] decoders: the number of decoders, 0 for the default of 2.
+  * @param[in] width: the maximum thumbnail width, 0 for the default of 160.
+  * @param[in] height: the maximum thumbnail height, 0 for the default of 90.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_pool_create(int32_t decoders, int32_t width, int32_t height, sipsm_thumbnail_pool** pool);
+
+  /**
+  * Destroys a pool. The streams using it must have been destroyed.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_thumbnail_pool_destroy(sipsm_thumbnail_pool* pool);
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_pool_get_stats(sipsm_thumbnail_pool* pool, sipsm_thumbnail_stats* stats);
+
+  /**
+  * Creates a thumbnail stream decoding a key frame at most every refreshMilliseconds.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_create(sipsm_thumbnail_pool* pool, int32_t refreshMilliseconds,
+    sipsm_thumbnail_stream** stream);
+  SIPSM_API void SIPSM_CALL sipsm_thumbnail_stream_destroy(sipsm_thumbnail_stream* stream);
+
+  /**
+  * Offers an encoded VP8 frame of the stream. Returns 1 if it was queued for decoding,
+  * 0 if it wasn't needed, or an error if its header is invalid.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_push(sipsm_thumbnail_stream* stream, const uint8_t* frame, int32_t length);
+
+  /**
+  * Returns 1 if the refresh interval has passed without a key frame, the caller can
+  * send a PLI, otherwise 0.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_is_refresh_due(sipsm_thumbnail_stream* stream);
+
+  /**
+  * Copies the latest thumbnail, a packed I420 image. Returns SIPSM_ERROR if no thumbnail
+  * has been decoded yet. If the output buffer is too small SIPSM_ERROR_BUFFER_TOO_SMALL
+  * is returned and outLength, width and height are set for the thumbnail.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_thumbnail_stream_get(sipsm_thumbnail_stream* stream, uint8_t* out, int32_t outCapacity,
+    int32_t* outLength, int32_t* width, int32_t* height);
+
+  /* Image conversion. */
+
+  SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_create(sipsm_image_convert** converter);
+  SIPSM_API void SIPSM_CALL sipsm_image_convert_destroy(sipsm_image_convert* converter);
+
+  /**
+  * Gets the buffer length required for an image, returns a negative value if the
+  * pixel format is not recognised.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_image_get_buffer_size(int32_t pixelFormat, int32_t width, int32_t height);
+  SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_rgb_to_yuv(sipsm_image_convert* converter, const uint8_t* rgb, int32_t rgbFormat,
+    int32_t width, int32_t height, int32_t stride, int32_t yuvFormat, uint8_t* out, int32_t outCapacity, int32_t* outLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_yuv_to_rgb(sipsm_image_convert* converter, const uint8_t* yuv, int32_t yuvFormat,
+    int32_t width, int32_t height, int32_t rgbFormat, uint8_t* out, int32_t outCapacity, int32_t* outLength, int32_t* outStride);
+  SIPSM_API int32_t SIPSM_CALL sipsm_image_convert_get_stats(sipsm_image_convert* converter, sipsm_image_convert_stats* stats);
+
+  /* DTLS. The handshake functions block and must not be called with [SuppressGCTransition]. */
+
+  /**
+  * Creates a DTLS handshake context.
+  * @param[in] certFile: UTF-8 path to the PEM certificate file.
+  * @param[in] keyFile: UTF-8 path to the PEM private key file.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_create(const char* certFile, const char* keyFile, sipsm_dtls** dtls);
+  SIPSM_API void SIPSM_CALL sipsm_dtls_destroy(sipsm_dtls* dtls);
+
+  /**
+  * Performs the server side of the DTLS handshake on a socket.
+  * @param[out] fingerprint: buffer for the sha256 fingerprint of the peer's certificate.
+  * @param[in] fingerprintCapacity: length of the fingerprint buffer, at least 32.
+  * @param[out] fingerprintLength: the length of the fingerprint written.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_handshake_as_server(sipsm_dtls* dtls, intptr_t socket,
+    uint8_t* fingerprint, int32_t fingerprintCapacity, int32_t* fingerprintLength);
+
+  /**
+  * Performs the client side of the DTLS handshake on a socket. A context can be used
+  * for another handshake, as either side, once the previous one has finished.
+  * @param[in] serverAddress: the server's sockaddr_in or sockaddr_in6, as in the
+  *  buffer of a .NET SocketAddress.
+  * @param[in] serverAddressLength: the length of the server address.
+  * @param[out] fingerprint: buffer for the sha256 fingerprint of the peer's certificate.
+  * @param[in] fingerprintCapacity: length of the fingerprint buffer, at least 32.
+  * @param[out] fingerprintLength: the length of the fingerprint written.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_handshake_as_client(sipsm_dtls* dtls, intptr_t socket,
+    const uint8_t* serverAddress, int32_t serverAddressLength,
+    uint8_t* fingerprint, int32_t fingerprintCapacity, int32_t* fingerprintLength);
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_is_handshake_complete(sipsm_dtls* dtls);
+
+  /**
+  * Sets the cipher suites, an OpenSSL cipher list string, used by the next handshake.
+  * The default prefers ECDHE-ECDSA-AES128-GCM-SHA256.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_set_cipher_list(sipsm_dtls* dtls, const char* cipherList);
+
+  /**
+  * Sets the ECDHE key exchange groups, a colon separated list such as "X25519:P-256",
+  * used by the next handshake. The default prefers X25519.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_set_groups(sipsm_dtls* dtls, const char* groups);
+
+  /**
+  * If non-zero the ECDHE key share of the next handshake is taken from a process wide
+  * pool of key pairs generated in the background, rather than generated during the
+  * handshake. Needs OpenSSL 3, otherwise it has no effect.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_dtls_set_precomputed_keys(sipsm_dtls* dtls, int32_t enable);
+
+  /**
+  * If non-zero the OpenSSL state is freed as soon as a handshake completes, keeping
+  * only the SRTP keying material, profile and peer fingerprint. sipsm_srtp_create_from_dtls
+  * still works afterwards but no close_notify is sent when the context is destroyed.
+  */
+  SIPSM_API void SIPSM_CALL sipsm_dtls_set_release_after_key_export(sipsm_dtls* dtls, int32_t release);
+
+  /**
+  * Frees the OpenSSL state of a completed handshake now, see
+  * sipsm_dtls_set_release_after_key_export.
+  */
+  SIPSM_API int32_t SIPSM_CALL sipsm_dtls_release_state(sipsm_dtls* dtls);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,194 @@
+//-----------------------------------------------------------------------------
+// Filename: NetworkEmulator.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "NetworkEmulator.h"
+#include "MediaLog.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    const uint64_t FNV_PRIME = 1099511628211ULL;
+
+    uint64_t SplitMix64(uint64_t& state)
+    {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+
+    uint64_t RotateLeft(uint64_t x, int k)
+    {
+      return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t HashValue(uint64_t hash, uint64_t value)
+    {
+      for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((value >> (i * 8)) & 0xff)) * FNV_PRIME;
+      }
+      return hash;
+    }
+  }
+
+  DeterministicRandom::DeterministicRandom(uint64_t seed)
+  {
+    for (int i = 0; i < 4; i++) {
+      _state[i] = SplitMix64(seed);
+    }
+  }
+
+  uint64_t DeterministicRandom::Next()
+  {
+    uint64_t result = RotateLeft(_state[1] * 5, 7) * 9;
+    uint64_t t = _state[1] << 17;
+
+    _state[2] ^= _state[0];
+    _state[3] ^= _state[1];
+    _state[1] ^= _state[2];
+    _state[0] ^= _state[3];
+    _state[2] ^= t;
+    _state[3] = RotateLeft(_state[3], 45);
+
+    return result;
+  }
+
+  EmulatedLink::EmulatedLink(VirtualClock& clock, const LinkConfig& config) :
+    _clock(clock),
+    _config(config),
+    _random(config.Seed)
+  { }
+
+  bool EmulatedLink::IsLost(double randomLoss, double transition, double burstLoss)
+  {
+    if (_config.BurstLoss.GoodToBad > 0) {
+      _isBadState = (_isBadState) ? transition >= _config.BurstLoss.BadToGood : transition < _config.BurstLoss.GoodToBad;
+      double lossProbability = (_isBadState) ? _config.BurstLoss.LossInBad : _config.BurstLoss.LossInGood;
+
+      if (burstLoss < lossProbability) {
+        _stats.BurstLost++;
+        return true;
+      }
+    }
+
+    if (randomLoss < _config.LossRate) {
+      _stats.RandomLost++;
+      return true;
+    }
+
+    return false;
+  }
+
+  int EmulatedLink::Send(const uint8_t* data, size_t length)
+  {
+    _stats.Sent++;
+    uint64_t now = _clock.Now();
+
+    // The same random values are drawn for every packet whichever impairments are
+    // enabled, so changing one setting doesn't shift the sequence the others see.
+    double randomLoss = _random.NextDouble();
+    double transition = _random.NextDouble();
+    double burstLoss = _random.NextDouble();
+    double reorder = _random.NextDouble();
+    double duplicate = _random.NextDouble();
+    uint64_t jitter = _random.NextUpTo(_config.JitterNanoseconds);
+
+    // The serialiser and its queue come before the lossy part of the path, so a
+    // packet that will be lost still uses its share of the bandwidth.
+    uint64_t departure = now;
+    if (_config.BandwidthBitsPerSecond > 0) {
+      uint64_t start = std::max(now, _linkFreeAt);
+      uint64_t queuedBytes = (start - now) * _config.BandwidthBitsPerSecond / 8000000000ULL;
+
+      if (_config.QueueLimitBytes > 0 && queuedBytes + length > _config.QueueLimitBytes) {
+        _stats.QueueDropped++;
+        return 0;
+      }
+
+      _linkFreeAt = start + length * 8000000000ULL / _config.BandwidthBitsPerSecond;
+      departure = _linkFreeAt;
+    }
+
+    if (IsLost(randomLoss, transition, burstLoss)) {
+      return 0;
+    }
+
+    uint64_t deliverAt = departure + _config.DelayNanoseconds + jitter;
+
+    if (reorder < _config.ReorderRate) {
+      // Held back without holding back the packets behind it.
+      deliverAt += _config.ReorderNanoseconds;
+      _stats.Reordered++;
+    }
+    else {
+      deliverAt = std::max(deliverAt, _lastInOrderDelivery);
+      _lastInOrderDelivery = deliverAt;
+    }
+
+    if (Schedule(data, length, deliverAt) != 0) {
+      return -1;
+    }
+
+    if (duplicate < _config.DuplicateRate) {
+      _stats.Duplicated++;
+      return Schedule(data, length, deliverAt);
+    }
+
+    return 0;
+  }
+
+  int EmulatedLink::Schedule(const uint8_t* data, size_t length, uint64_t deliverAt)
+  {
+    MediaBufferPtr datagram = _pool->Acquire(length);
+    if (!datagram) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer for an emulated datagram of %zu bytes.", length);
+      return -1;
+    }
+
+    memcpy(datagram->Data(), data, length);
+
+    InFlight entry;
+    entry.DeliverAt = deliverAt;
+    entry.Index = _nextIndex++;
+    entry.Datagram = std::move(datagram);
+
+    _inFlight.push_back(std::move(entry));
+    std::push_heap(_inFlight.begin(), _inFlight.end(), LaterFirst());
+    return 0;
+  }
+
+  int EmulatedLink::Receive(MediaBufferPtr& datagram)
+  {
+    if (_inFlight.empty() || _inFlight.front().DeliverAt > _clock.Now()) {
+      return 0;
+    }
+
+    std::pop_heap(_inFlight.begin(), _inFlight.end(), LaterFirst());
+    InFlight& entry = _inFlight.back();
+
+    _digest = HashValue(_digest, entry.DeliverAt);
+    _digest = HashValue(_digest, entry.Index);
+    _digest = HashValue(_digest, entry.Datagram->Length());
+
+    _stats.Delivered++;
+    _stats.BytesDelivered += entry.Datagram->Length();
+
+    datagram = std::move(entry.Datagram);
+    _inFlight.pop_back();
+    return 1;
+  }
+
+  uint64_t EmulatedLink::NextDeliveryNanoseconds() const
+  {
+    return (_inFlight.empty()) ? NO_DELIVERY : _inFlight.front().DeliverAt;
+  }
+}
@@ -0,0 +1,225 @@
+//-----------------------------------------------------------------------------
+// Filename: NetworkEmulator.h
+//
+// Description: Deterministic in-memory datagram link emulator for testing
+// transport behaviour (jitter buffers, NACK, FEC, congestion control)
+// without a real network. A link adds delay, jitter, random and bursty
+// (Gilbert-Elliott) loss, reordering, duplication and a bandwidth cap with
+// a bounded queue.
+//
+// Time is a virtual clock that the test advances, so a scenario runs as
+// fast as the CPU allows. The random numbers come from the link's own
+// generator, not the standard library distributions whose output differs
+// between implementations, so a scenario replays bit-exactly from its seed
+// on every platform. GetDigest summarises the deliveries so two runs can be
+// compared.
+//
+//   VirtualClock clock;
+//   LinkConfig config;
+//   config.DelayNanoseconds = 40 * 1000000ULL;
+//   config.BurstLoss.GoodToBad = 0.01;
+//   EmulatedLink link(clock, config);
+//
+//   link.Send(packet, length);
+//   clock.AdvanceTo(link.NextDeliveryNanoseconds());
+//   while (link.Receive(datagram) == 1) { ... }
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  /**
+  * A manually advanced clock in nanoseconds shared by the links in a scenario.
+  */
+  class VirtualClock
+  {
+  public:
+    uint64_t Now() const { return _now; }
+    void Advance(uint64_t nanoseconds) { _now += nanoseconds; }
+
+    /**
+    * Moves the clock forward to a time. Never moves it backwards.
+    */
+    void AdvanceTo(uint64_t nanoseconds) { if (nanoseconds > _now) _now = nanoseconds; }
+
+  private:
+    uint64_t _now = 0;
+  };
+
+  /**
+  * Small, fast pseudo random generator (xoshiro256**) with the same output on
+  * every platform for a given seed.
+  */
+  class DeterministicRandom
+  {
+  public:
+    explicit DeterministicRandom(uint64_t seed);
+
+    uint64_t Next();
+
+    /**
+    * Gets a value uniformly distributed in [0, 1).
+    */
+    double NextDouble() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    /**
+    * Gets a value uniformly distributed in [0, bound], 0 if bound is 0.
+    */
+    uint64_t NextUpTo(uint64_t bound) { return (bound == 0) ? 0 : Next() % (bound + 1); }
+
+  private:
+    uint64_t _state[4];
+  };
+
+  /**
+  * Two state Markov loss model. In the good state packets are lost with
+  * LossInGood probability and in the bad state with LossInBad. The model is
+  * disabled while GoodToBad is 0.
+  */
+  struct GilbertElliottConfig
+  {
+    double GoodToBad = 0;     // Probability per packet of moving from good to bad.
+    double BadToGood = 1;     // Probability per packet of moving from bad to good.
+    double LossInGood = 0;
+    double LossInBad = 1;
+  };
+
+  struct LinkConfig
+  {
+    uint64_t DelayNanoseconds = 0;
+
+    /**
+    * A uniformly distributed extra delay from 0 to this value. Packets are not
+    * reordered by jitter, a packet is never delivered before one sent ahead of it.
+    */
+    uint64_t JitterNanoseconds = 0;
+
+    double LossRate = 0;                  // Independent random loss.
+    GilbertElliottConfig BurstLoss;
+
+    /**
+    * The fraction of packets held back by ReorderNanoseconds, letting the packets
+    * sent after them overtake.
+    */
+    double ReorderRate = 0;
+    uint64_t ReorderNanoseconds = 0;
+
+    double DuplicateRate = 0;
+
+    /**
+    * The link rate, 0 for unlimited. Packets are serialised at this rate and wait
+    * in a queue of up to QueueLimitBytes, packets that don't fit are dropped.
+    */
+    uint64_t BandwidthBitsPerSecond = 0;
+    size_t QueueLimitBytes = 0;           // 0 for an unbounded queue.
+
+    uint64_t Seed = 1;
+  };
+
+  /**
+  * Running totals for a link. All fields are plain 64 bit integers so the
+  * structure can be copied straight across the flat C API.
+  */
+  struct LinkStats
+  {
+    uint64_t Sent;
+    uint64_t Delivered;
+    uint64_t BytesDelivered;
+    uint64_t RandomLost;
+    uint64_t BurstLost;
+    uint64_t QueueDropped;
+    uint64_t Reordered;
+    uint64_t Duplicated;
+  };
+
+  /**
+  * One direction of an emulated network path. Use a second link for the
+  * reverse direction. Not thread safe, a scenario runs on a single thread.
+  */
+  class EmulatedLink
+  {
+  public:
+    static const uint64_t NO_DELIVERY = UINT64_MAX;
+
+    EmulatedLink(VirtualClock& clock, const LinkConfig& config);
+
+    EmulatedLink(const EmulatedLink&) = delete;
+    EmulatedLink& operator=(const EmulatedLink&) = delete;
+
+    /**
+    * Sends a datagram at the clock's current time. The datagram is copied.
+    * @param[in] data: the datagram.
+    * @param[in] length: the length of the datagram.
+    * @@Returns: 0 if the datagram was accepted, which includes it being lost on the
+    *  link, or -1 if the buffer for it could not be allocated.
+    */
+    int Send(const uint8_t* data, size_t length);
+
+    /**
+    * Takes the next datagram due for delivery at or before the clock's current time.
+    * @param[out] datagram: set to the delivered datagram.
+    * @@Returns: 1 if a datagram was delivered or 0 if none is due.
+    */
+    int Receive(MediaBufferPtr& datagram);
+
+    /**
+    * Gets the time the next datagram is due, NO_DELIVERY if nothing is in flight.
+    */
+    uint64_t NextDeliveryNanoseconds() const;
+
+    /**
+    * Gets a hash of the delivery time, send order and length of every datagram
+    * delivered so far. Equal for two runs of the same scenario and seed.
+    */
+    uint64_t GetDigest() const { return _digest; }
+
+    const LinkStats& GetStats() const { return _stats; }
+
+    /**
+    * Sets the pool that datagrams are copied into. Defaults to MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+  private:
+    struct InFlight
+    {
+      uint64_t DeliverAt;
+      uint64_t Index;             // Send order, breaks ties so delivery order is deterministic.
+      MediaBufferPtr Datagram;
+    };
+
+    struct LaterFirst
+    {
+      bool operator()(const InFlight& a, const InFlight& b) const
+      {
+        return (a.DeliverAt != b.DeliverAt) ? a.DeliverAt > b.DeliverAt : a.Index > b.Index;
+      }
+    };
+
+    bool IsLost(double randomLoss, double transition, double burstLoss);
+    int Schedule(const uint8_t* data, size_t length, uint64_t deliverAt);
+
+    VirtualClock& _clock;
+    LinkConfig _config;
+    DeterministicRandom _random;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+
+    std::vector<InFlight> _inFlight;      // Min heap on delivery time.
+    bool _isBadState = false;
+    uint64_t _linkFreeAt = 0;             // When the serialiser finishes the queued packets.
+    uint64_t _lastInOrderDelivery = 0;
+    uint64_t _nextIndex = 0;
+    uint64_t _digest = 14695981039346656037ULL;
+    LinkStats _stats{};
+  };
+}
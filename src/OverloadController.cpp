@@ -0,0 +1,279 @@
+//-----------------------------------------------------------------------------
+// Filename: OverloadController.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "OverloadController.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTopology.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const char* const PRIORITY_NAMES[OverloadController::PRIORITY_COUNT] = { "high", "normal", "low" };
+    const char* const LEVEL_NAMES[] = { "none", "fast encode", "reduced frame rate", "reduced resolution", "paused" };
+
+    MetricGauge& _highLevel = MetricsRegistry::Default().GetGauge("sipsm_overload_level", "Degradation level applied to a session priority class.", "priority=\"high\"");
+    MetricGauge& _normalLevel = MetricsRegistry::Default().GetGauge("sipsm_overload_level", "Degradation level applied to a session priority class.", "priority=\"normal\"");
+    MetricGauge& _lowLevel = MetricsRegistry::Default().GetGauge("sipsm_overload_level", "Degradation level applied to a session priority class.", "priority=\"low\"");
+    MetricGauge& _utilisation = MetricsRegistry::Default().GetGauge("sipsm_overload_utilisation_percent", "Share of the cores used by the media sessions in the last interval.");
+    MetricCounter& _escalations = MetricsRegistry::Default().GetCounter("sipsm_overload_transitions_total", "Steps taken on the degradation ladder.", "direction=\"up\"");
+    MetricCounter& _relaxations = MetricsRegistry::Default().GetCounter("sipsm_overload_transitions_total", "Steps taken on the degradation ladder.", "direction=\"down\"");
+
+    MetricGauge* const LEVEL_GAUGES[OverloadController::PRIORITY_COUNT] = { &_highLevel, &_normalLevel, &_lowLevel };
+  }
+
+  struct OverloadController::Impl
+  {
+    OverloadConfig Config;
+    int Cores = 1;
+
+    std::atomic<uint64_t> StageNanoseconds[OverloadSession::STAGE_COUNT];
+    std::atomic<uint64_t> Frames{ 0 };
+    std::atomic<uint64_t> Missed{ 0 };
+
+    // Only used by Evaluate.
+    uint64_t IntervalStart = 0;
+    int RecoverCount = 0;
+
+    mutable std::mutex Mutex;
+    std::vector<std::unique_ptr<OverloadSession>> Sessions;
+    double Utilisation = 0;
+    uint64_t LastStageNanoseconds[OverloadSession::STAGE_COUNT] = {};
+    OverloadStats Stats{};
+  };
+
+  OverloadSession::OverloadSession(OverloadController& controller, SessionPriority priority, bool isVisible) :
+    _controller(controller),
+    _priority(priority),
+    _isVisible(isVisible)
+  { }
+
+  void OverloadSession::RecordStage(OverloadStage stage, uint64_t nanoseconds)
+  {
+    _controller._impl->StageNanoseconds[(int)stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+  }
+
+  void OverloadSession::RecordFrame(bool isDeadlineMissed)
+  {
+    _controller._impl->Frames.fetch_add(1, std::memory_order_relaxed);
+    if (isDeadlineMissed) {
+      _controller._impl->Missed.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  DegradationSettings OverloadSession::GetSettings() const
+  {
+    int level = _controller._levels[(int)_priority].load(std::memory_order_relaxed);
+    if (level >= (int)DegradationLevel::Paused && _isVisible.load(std::memory_order_relaxed)) {
+      level = (int)DegradationLevel::ReducedResolution;
+    }
+
+    DegradationSettings settings;
+    settings.Level = (DegradationLevel)level;
+    settings.CpuUsed = (level >= (int)DegradationLevel::FastEncode) ? _controller._impl->Config.FastCpuUsed : 0;
+    settings.FrameRateDivisor = (level >= (int)DegradationLevel::ReducedFrameRate) ? 2 : 1;
+    settings.ResolutionDivisor = (level >= (int)DegradationLevel::ReducedResolution) ? 2 : 1;
+    settings.IsPaused = level >= (int)DegradationLevel::Paused;
+    return settings;
+  }
+
+  OverloadController::OverloadController(const OverloadConfig& config) :
+    _impl(new Impl())
+  {
+    _impl->Config = config;
+    _impl->Cores = (config.Cores > 0) ? config.Cores : std::max(1, MediaTopology::GetProcessorCount());
+
+    for (int i = 0; i < OverloadSession::STAGE_COUNT; i++) {
+      _impl->StageNanoseconds[i].store(0, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < PRIORITY_COUNT; i++) {
+      _levels[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  OverloadController::~OverloadController()
+  {
+    for (int i = 0; i < PRIORITY_COUNT; i++) {
+      LEVEL_GAUGES[i]->Set(0);
+    }
+    delete _impl;
+  }
+
+  OverloadSession* OverloadController::AddSession(SessionPriority priority, bool isVisible)
+  {
+    std::unique_ptr<OverloadSession> session(new OverloadSession(*this, priority, isVisible));
+    OverloadSession* result = session.get();
+
+    std::lock_guard<std::mutex> lock(_impl->Mutex);
+    _impl->Sessions.push_back(std::move(session));
+    return result;
+  }
+
+  void OverloadController::RemoveSession(OverloadSession* session)
+  {
+    std::lock_guard<std::mutex> lock(_impl->Mutex);
+    auto& sessions = _impl->Sessions;
+    sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+      [session](const std::unique_ptr<OverloadSession>& s) { return s.get() == session; }), sessions.end());
+  }
+
+  bool OverloadController::Evaluate(uint64_t nowNanoseconds)
+  {
+    Impl& impl = *_impl;
+    const OverloadConfig& config = impl.Config;
+
+    if (impl.IntervalStart == 0) {
+      impl.IntervalStart = nowNanoseconds;
+      return false;
+    }
+
+    if (nowNanoseconds < impl.IntervalStart + config.IntervalNanoseconds) {
+      return false;
+    }
+
+    uint64_t elapsed = nowNanoseconds - impl.IntervalStart;
+    impl.IntervalStart = nowNanoseconds;
+
+    uint64_t stageNanoseconds[OverloadSession::STAGE_COUNT];
+    uint64_t work = 0;
+    for (int i = 0; i < OverloadSession::STAGE_COUNT; i++) {
+      stageNanoseconds[i] = impl.StageNanoseconds[i].exchange(0, std::memory_order_relaxed);
+      work += stageNanoseconds[i];
+    }
+    uint64_t frames = impl.Frames.exchange(0, std::memory_order_relaxed);
+    uint64_t missed = impl.Missed.exchange(0, std::memory_order_relaxed);
+
+    double utilisation = (double)work / ((double)elapsed * impl.Cores);
+    double missRatio = (frames > 0) ? (double)missed / frames : 0;
+    bool isOverloaded = utilisation > config.HighUtilisation || missRatio > config.MaxMissRatio;
+
+    std::lock_guard<std::mutex> lock(impl.Mutex);
+
+    impl.Utilisation = utilisation;
+    for (int i = 0; i < OverloadSession::STAGE_COUNT; i++) {
+      impl.LastStageNanoseconds[i] = (frames > 0) ? stageNanoseconds[i] / frames : 0;
+    }
+
+    impl.Stats.Intervals++;
+    impl.Stats.FramesReported += frames;
+    impl.Stats.FramesMissed += missed;
+    _utilisation.Set((int64_t)(utilisation * 100));
+
+    // A step is only worth taking for a class that has sessions, and the last step
+    // only for a class with sessions that can be paused.
+    int sessionCount[PRIORITY_COUNT] = {};
+    int hiddenCount[PRIORITY_COUNT] = {};
+    for (auto& session : impl.Sessions) {
+      sessionCount[(int)session->_priority]++;
+      if (!session->_isVisible.load(std::memory_order_relaxed)) {
+        hiddenCount[(int)session->_priority]++;
+      }
+    }
+
+    auto maxLevel = [&](int priority) {
+      if (sessionCount[priority] == 0) {
+        return (int)DegradationLevel::None;
+      }
+      return (hiddenCount[priority] > 0) ? (int)DegradationLevel::Paused : (int)DegradationLevel::ReducedResolution;
+    };
+
+    int changed = -1;
+
+    if (isOverloaded) {
+      impl.Stats.OverloadedIntervals++;
+      impl.RecoverCount = 0;
+
+      for (int priority = PRIORITY_COUNT - 1; priority >= 0 && changed < 0; priority--) {
+        int level = _levels[priority].load(std::memory_order_relaxed);
+        if (level < maxLevel(priority)) {
+          _levels[priority].store(level + 1, std::memory_order_relaxed);
+          changed = priority;
+        }
+      }
+
+      if (changed >= 0) {
+        impl.Stats.Escalations++;
+        _escalations.Add();
+        _isShedding.store(false, std::memory_order_relaxed);
+      }
+      else {
+        impl.Stats.SheddingIntervals++;
+        if (!_isShedding.exchange(true, std::memory_order_relaxed)) {
+          SIPSM_LOG_WARNING("Overload controller is shedding, every class is fully degraded and %.0f%% of %d cores are in use.",
+            utilisation * 100, impl.Cores);
+        }
+      }
+    }
+    else {
+      _isShedding.store(false, std::memory_order_relaxed);
+
+      if (utilisation < config.LowUtilisation && missed == 0) {
+        if (++impl.RecoverCount >= config.RecoverIntervals) {
+          impl.RecoverCount = 0;
+
+          for (int priority = 0; priority < PRIORITY_COUNT && changed < 0; priority++) {
+            int level = _levels[priority].load(std::memory_order_relaxed);
+            if (level > 0) {
+              // A level beyond what the class can use is dropped in one go.
+              int next = std::min(level - 1, maxLevel(priority));
+              _levels[priority].store(next, std::memory_order_relaxed);
+              changed = priority;
+            }
+          }
+
+          if (changed >= 0) {
+            impl.Stats.Relaxations++;
+            _relaxations.Add();
+          }
+        }
+      }
+      else {
+        impl.RecoverCount = 0;
+      }
+    }
+
+    if (changed >= 0) {
+      int level = _levels[changed].load(std::memory_order_relaxed);
+      LEVEL_GAUGES[changed]->Set(level);
+      SIPSM_LOG_INFO("Overload controller set %s priority sessions to %s, %.0f%% of %d cores in use and %.1f%% of frames missed.",
+        PRIORITY_NAMES[changed], LEVEL_NAMES[level], utilisation * 100, impl.Cores, missRatio * 100);
+    }
+
+    return changed >= 0;
+  }
+
+  DegradationLevel OverloadController::GetLevel(SessionPriority priority) const
+  {
+    return (DegradationLevel)_levels[(int)priority].load(std::memory_order_relaxed);
+  }
+
+  double OverloadController::GetUtilisation() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Mutex);
+    return _impl->Utilisation;
+  }
+
+  uint64_t OverloadController::GetStageNanoseconds(OverloadStage stage) const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Mutex);
+    return _impl->LastStageNanoseconds[(int)stage];
+  }
+
+  OverloadStats OverloadController::GetStats() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Mutex);
+    return _impl->Stats;
+  }
+}
@@ -0,0 +1,233 @@
+//-----------------------------------------------------------------------------
+// Filename: OverloadController.h
+//
+// Description: Host wide overload control for the native media sessions.
+// When the host runs out of CPU every encoder slows down together and
+// every session's latency grows. The controller watches the CPU time the
+// sessions spend in each stage and how many frames miss their deadline,
+// and when the host is overloaded it degrades video quality one step at a
+// time, lowest priority class first, so the remaining work fits:
+//
+//   1. FastEncode         the encoder's speed setting is raised.
+//   2. ReducedFrameRate   only every second frame is encoded.
+//   3. ReducedResolution  frames are encoded at half the width and height.
+//   4. Paused             sessions that aren't visible stop sending video,
+//                         visible sessions stay at ReducedResolution.
+//
+// Once every class is fully degraded and the host is still overloaded the
+// controller reports that it is shedding, new sessions should be refused
+// rather than existing ones dropped. When the load falls the steps are
+// undone in reverse order, highest priority class first, after the host
+// has stayed below the low watermark for a few intervals so the controller
+// doesn't oscillate.
+//
+// Sessions report from any thread. Evaluate is called periodically from a
+// single thread, for example the one that drives the frame timers.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  enum class SessionPriority
+  {
+    High = 0,
+    Normal = 1,
+    Low = 2,
+  };
+
+  enum class DegradationLevel
+  {
+    None = 0,
+    FastEncode = 1,
+    ReducedFrameRate = 2,
+    ReducedResolution = 3,
+    Paused = 4,
+  };
+
+  /**
+  * The stages a session reports CPU time for.
+  */
+  enum class OverloadStage
+  {
+    Capture = 0,
+    Convert = 1,
+    Encode = 2,
+    Protect = 3,
+    Receive = 4,
+    Decode = 5,
+  };
+
+  struct OverloadConfig
+  {
+    /**
+    * The number of cores available to the media sessions, 0 for all the logical
+    * processors.
+    */
+    int Cores = 0;
+
+    /**
+    * How often Evaluate looks at the load, in nanoseconds.
+    */
+    uint64_t IntervalNanoseconds = 250000000ULL;
+
+    /**
+    * The host is overloaded if the sessions used more than HighUtilisation of the
+    * cores or more than MaxMissRatio of the frames missed their deadline.
+    */
+    double HighUtilisation = 0.85;
+    double MaxMissRatio = 0.02;
+
+    /**
+    * A step is undone after RecoverIntervals intervals in a row below LowUtilisation
+    * with no missed deadlines.
+    */
+    double LowUtilisation = 0.60;
+    int RecoverIntervals = 4;
+
+    /**
+    * The encoder speed used from FastEncode upwards.
+    */
+    int FastCpuUsed = 12;
+  };
+
+  /**
+  * What a session should do with its next frame.
+  */
+  struct DegradationSettings
+  {
+    DegradationLevel Level = DegradationLevel::None;
+    int CpuUsed = 0;                // The encoder speed to use, 0 to keep the session's own.
+    int FrameRateDivisor = 1;       // Encode one frame in every FrameRateDivisor.
+    int ResolutionDivisor = 1;      // Divide the width and height by ResolutionDivisor.
+    bool IsPaused = false;
+  };
+
+  /**
+  * Running totals for a controller. All fields are plain 64 bit integers so the
+  * structure can be copied straight across the flat C API.
+  */
+  struct OverloadStats
+  {
+    uint64_t Intervals;
+    uint64_t OverloadedIntervals;
+    uint64_t SheddingIntervals;
+    uint64_t Escalations;
+    uint64_t Relaxations;
+    uint64_t FramesReported;
+    uint64_t FramesMissed;
+  };
+
+  class OverloadController;
+
+  /**
+  * A session's link to the controller, created by OverloadController::AddSession.
+  */
+  class OverloadSession
+  {
+  public:
+
+    static const int STAGE_COUNT = 6;
+
+    /**
+    * Adds CPU time spent by the session in a stage.
+    */
+    void RecordStage(OverloadStage stage, uint64_t nanoseconds);
+
+    /**
+    * Records the outcome of a frame that was due.
+    * @param[in] isDeadlineMissed: true if the frame was late or skipped because the
+    *  session fell behind. Frames skipped on purpose because of the degradation are
+    *  not reported.
+    */
+    void RecordFrame(bool isDeadlineMissed);
+
+    /**
+    * Sets whether anyone is watching the session's video. Only sessions that aren't
+    * visible are paused.
+    */
+    void SetVisible(bool isVisible) { _isVisible.store(isVisible, std::memory_order_relaxed); }
+
+    SessionPriority GetPriority() const { return _priority; }
+
+    /**
+    * Gets what the session should do with its next frame.
+    */
+    DegradationSettings GetSettings() const;
+
+  private:
+    friend class OverloadController;
+
+    OverloadSession(OverloadController& controller, SessionPriority priority, bool isVisible);
+
+    OverloadController& _controller;
+    SessionPriority _priority;
+    std::atomic<bool> _isVisible;
+  };
+
+  class OverloadController
+  {
+  public:
+
+    static const int PRIORITY_COUNT = 3;
+
+    explicit OverloadController(const OverloadConfig& config = OverloadConfig());
+    ~OverloadController();
+
+    OverloadController(const OverloadController&) = delete;
+    OverloadController& operator=(const OverloadController&) = delete;
+
+    /**
+    * Registers a session. The session is owned by the controller and is valid until
+    * it is passed to RemoveSession.
+    */
+    OverloadSession* AddSession(SessionPriority priority, bool isVisible = true);
+    void RemoveSession(OverloadSession* session);
+
+    /**
+    * Looks at the load since the last interval and moves one step up or down the
+    * degradation ladder if needed. Does nothing until the interval has passed.
+    * @param[in] nowNanoseconds: the current time from MediaScheduler::NowNanoseconds.
+    * @@Returns: true if a priority class changed level.
+    */
+    bool Evaluate(uint64_t nowNanoseconds);
+
+    /**
+    * Gets the level applied to a priority class.
+    */
+    DegradationLevel GetLevel(SessionPriority priority) const;
+
+    /**
+    * Whether every class is fully degraded and the host is still overloaded, in
+    * which case new sessions should be refused.
+    */
+    bool IsShedding() const { return _isShedding.load(std::memory_order_relaxed); }
+
+    /**
+    * Gets the fraction of the cores used by the sessions in the last interval.
+    */
+    double GetUtilisation() const;
+
+    /**
+    * Gets the CPU time per frame reported for a stage in the last interval.
+    */
+    uint64_t GetStageNanoseconds(OverloadStage stage) const;
+
+    OverloadStats GetStats() const;
+
+  private:
+    friend class OverloadSession;
+
+    struct Impl;
+    Impl* _impl;
+
+    std::atomic<int> _levels[PRIORITY_COUNT];
+    std::atomic<bool> _isShedding{ false };
+  };
+}
@@ -0,0 +1,562 @@
+//-----------------------------------------------------------------------------
+// Filename: SessionRouter.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "SessionRouter.h"
+#include "MediaMetrics.h"
+
+#include <atomic>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const int MIN_CAPACITY = 16;
+
+    // A cell's tag is 0 while it has never been used, 1 once its entry is removed and
+    // otherwise the top bits of the key's hash with bit 1 set.
+    const uint32_t TAG_EMPTY = 0;
+    const uint32_t TAG_DELETED = 1;
+
+    const int RTP_HEADER_LENGTH = 12;
+    const int RTCP_HEADER_LENGTH = 8;
+
+    uint64_t Mix(uint64_t value)
+    {
+      value ^= value >> 33;
+      value *= 0xff51afd7ed558ccdULL;
+      value ^= value >> 33;
+      value *= 0xc4ceb9fe1a85ec53ULL;
+      value ^= value >> 33;
+      return value;
+    }
+
+    uint64_t Hash(uint32_t ssrc)
+    {
+      return Mix(ssrc);
+    }
+
+    uint64_t Hash(const FiveTuple& tuple)
+    {
+      uint64_t words[sizeof(FiveTuple) / sizeof(uint64_t)];
+      memcpy(words, &tuple, sizeof(words));
+
+      uint64_t hash = 0;
+      for (uint64_t word : words) {
+        hash = Mix(hash ^ word);
+      }
+      return hash;
+    }
+
+    uint32_t Tag(uint64_t hash)
+    {
+      return (uint32_t)(hash >> 32) | 2;
+    }
+
+    size_t TableCapacity(size_t entries)
+    {
+      // Rebuilt at half full, so sized for four times the entries to leave room for
+      // removes and adds before the next rebuild.
+      size_t capacity = MIN_CAPACITY;
+      while (capacity < entries * 4) {
+        capacity *= 2;
+      }
+      return capacity;
+    }
+
+    uint32_t ReadUint32(const uint8_t* buffer)
+    {
+      return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+    }
+
+    template<typename Key>
+    struct Cell
+    {
+      std::atomic<uint32_t> Tag{ TAG_EMPTY };
+      std::atomic<void*> Session{ nullptr };
+      Key Value{};
+    };
+
+    /**
+    * An open addressing table with linear probing. A cell's key is written before its
+    * tag is published and never changes after, so a reader that sees the tag can
+    * compare the key without a lock. Removed cells are only reused by a rebuild.
+    */
+    template<typename Key>
+    struct Table
+    {
+      size_t Mask;
+      Cell<Key>* Cells;
+      size_t Used = 0;          // Cells that aren't empty, including deleted ones.
+      size_t Live = 0;
+
+      explicit Table(size_t capacity) : Mask(capacity - 1), Cells(new Cell<Key>[capacity]) { }
+      ~Table() { delete[] Cells; }
+
+      Table(const Table&) = delete;
+      Table& operator=(const Table&) = delete;
+
+      size_t Capacity() const { return Mask + 1; }
+
+      void* Find(const Key& key) const
+      {
+        uint64_t hash = Hash(key);
+        uint32_t tag = Tag(hash);
+        size_t index = (size_t)hash & Mask;
+        for (size_t probe = 0; probe <= Mask; probe++) {
+          const Cell<Key>& cell = Cells[index];
+          uint32_t cellTag = cell.Tag.load(std::memory_order_acquire);
+          if (cellTag == TAG_EMPTY) {
+            return nullptr;
+          }
+          if (cellTag == tag && cell.Value == key) {
+            return cell.Session.load(std::memory_order_acquire);
+          }
+          index = (index + 1) & Mask;
+        }
+        return nullptr;
+      }
+
+      /**
+      * Finds the live cell for a key or, if there isn't one, the empty cell it would go
+      * in. Writers only.
+      */
+      Cell<Key>* FindCell(const Key& key, bool* isLive)
+      {
+        uint64_t hash = Hash(key);
+        uint32_t tag = Tag(hash);
+        size_t index = (size_t)hash & Mask;
+        for (size_t probe = 0; probe <= Mask; probe++) {
+          Cell<Key>& cell = Cells[index];
+          uint32_t cellTag = cell.Tag.load(std::memory_order_relaxed);
+          if (cellTag == TAG_EMPTY) {
+            *isLive = false;
+            return &cell;
+          }
+          if (cellTag == tag && cell.Value == key) {
+            *isLive = true;
+            return &cell;
+          }
+          index = (index + 1) & Mask;
+        }
+        *isLive = false;
+        return nullptr;
+      }
+
+      /**
+      * Fills an empty cell. Writers only.
+      */
+      void Publish(Cell<Key>& cell, const Key& key, void* session)
+      {
+        cell.Value = key;
+        cell.Session.store(session, std::memory_order_relaxed);
+        cell.Tag.store(Tag(Hash(key)), std::memory_order_release);
+        Used++;
+        Live++;
+      }
+
+      void Delete(Cell<Key>& cell)
+      {
+        cell.Tag.store(TAG_DELETED, std::memory_order_release);
+        Live--;
+      }
+    };
+
+    template<typename Key>
+    void DestroyTable(void* table)
+    {
+      delete static_cast<Table<Key>*>(table);
+    }
+
+    struct RetiredObject
+    {
+      void* Object;
+      void (*Destroy)(void*);
+    };
+
+    /**
+    * The readers in a scope, counted per epoch parity. Spread over the metrics shards
+    * so threads mostly update their own cache line.
+    */
+    struct alignas(64) ReaderShard
+    {
+      std::atomic<int64_t> Readers[2];
+    };
+  }
+
+  int FiveTuple::FromAddresses(uint8_t protocol, const sockaddr* source, const sockaddr* destination, FiveTuple& tuple)
+  {
+    tuple = FiveTuple();
+    tuple.Protocol = protocol;
+
+    const sockaddr* addresses[2] = { source, destination };
+    uint8_t* outAddresses[2] = { tuple.SourceAddress, tuple.DestinationAddress };
+    uint16_t* outPorts[2] = { &tuple.SourcePort, &tuple.DestinationPort };
+
+    for (int i = 0; i < 2; i++) {
+      if (addresses[i] == nullptr) {
+        return -1;
+      }
+
+      if (addresses[i]->sa_family == AF_INET) {
+        const sockaddr_in* address = reinterpret_cast<const sockaddr_in*>(addresses[i]);
+        outAddresses[i][10] = 0xff;
+        outAddresses[i][11] = 0xff;
+        memcpy(outAddresses[i] + 12, &address->sin_addr, 4);
+        *outPorts[i] = ntohs(address->sin_port);
+      }
+      else if (addresses[i]->sa_family == AF_INET6) {
+        const sockaddr_in6* address = reinterpret_cast<const sockaddr_in6*>(addresses[i]);
+        memcpy(outAddresses[i], &address->sin6_addr, 16);
+        *outPorts[i] = ntohs(address->sin6_port);
+      }
+      else {
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  bool operator==(const FiveTuple& a, const FiveTuple& b)
+  {
+    return memcmp(&a, &b, sizeof(FiveTuple)) == 0;
+  }
+
+  struct SessionRouter::Impl
+  {
+    std::atomic<Table<uint32_t>*> Ssrcs;
+    std::atomic<Table<FiveTuple>*> Addresses;
+
+    std::atomic<uint32_t> Epoch{ 0 };
+    ReaderShard Shards[MetricsControl::SHARD_COUNT];
+
+    // Serialises the writers.
+    std::mutex Lock;
+    std::vector<RetiredObject> Retired;
+    bool HasRetiredTables = false;
+    SessionRouterStats Stats{};
+
+    explicit Impl(size_t capacity) :
+      Ssrcs(new Table<uint32_t>(TableCapacity(capacity))),
+      Addresses(new Table<FiveTuple>(TableCapacity(capacity)))
+    {
+      for (ReaderShard& shard : Shards) {
+        shard.Readers[0].store(0, std::memory_order_relaxed);
+        shard.Readers[1].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    /**
+    * Waits for the readers counted against the current parity, flipping it first so
+    * new readers count against the other one. Done twice as a reader may have read
+    * the parity just before the first flip and only be counted after it.
+    */
+    void WaitForReaders()
+    {
+      for (int flip = 0; flip < 2; flip++) {
+        uint32_t parity = Epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+
+        // Pairs with the fence in EnterRead. Either the scan sees the reader's count, or
+        // the reader sees the tags and tables changed before this.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (;;) {
+          int64_t readers = 0;
+          for (ReaderShard& shard : Shards) {
+            readers += shard.Readers[parity].load(std::memory_order_acquire);
+          }
+          if (readers == 0) {
+            break;
+          }
+          std::this_thread::yield();
+        }
+      }
+      Stats.GracePeriods++;
+    }
+
+    /**
+    * Waits for a grace period and frees the retired objects. Called with the lock held.
+    */
+    void ReclaimLocked()
+    {
+      if (Retired.empty()) {
+        return;
+      }
+
+      WaitForReaders();
+      for (const RetiredObject& retired : Retired) {
+        retired.Destroy(retired.Object);
+      }
+      Stats.Reclaimed += Retired.size();
+      Retired.clear();
+      HasRetiredTables = false;
+    }
+
+    /**
+    * Frees tables replaced by Add, which doesn't wait for readers itself. Called with
+    * the lock held by the methods that remove.
+    */
+    void ReclaimTablesLocked()
+    {
+      if (HasRetiredTables) {
+        ReclaimLocked();
+      }
+    }
+
+    void RetireLocked(void* object, void (*destroy)(void*))
+    {
+      Retired.push_back({ object, destroy });
+      Stats.Retired++;
+      if ((int)Retired.size() >= RECLAIM_BATCH) {
+        ReclaimLocked();
+      }
+    }
+
+    /**
+    * Replaces a table with one holding only its live entries. The old table is retired
+    * without waiting for readers, so adding can be done inside a ReadScope. The next
+    * remove frees it, so rebuilds under churn don't accumulate.
+    */
+    template<typename Key>
+    Table<Key>* Rebuild(std::atomic<Table<Key>*>& current, size_t entries)
+    {
+      Table<Key>* old = current.load(std::memory_order_relaxed);
+      Table<Key>* table = new Table<Key>(TableCapacity(entries));
+
+      for (size_t i = 0; i < old->Capacity(); i++) {
+        Cell<Key>& cell = old->Cells[i];
+        if (cell.Tag.load(std::memory_order_relaxed) > TAG_DELETED) {
+          bool isLive = false;
+          Cell<Key>* target = table->FindCell(cell.Value, &isLive);
+          table->Publish(*target, cell.Value, cell.Session.load(std::memory_order_relaxed));
+        }
+      }
+
+      current.store(table, std::memory_order_seq_cst);
+      Stats.Rebuilds++;
+      Retired.push_back({ old, DestroyTable<Key> });
+      Stats.Retired++;
+      HasRetiredTables = true;
+      return table;
+    }
+
+    template<typename Key>
+    int Add(std::atomic<Table<Key>*>& current, const Key& key, void* session)
+    {
+      if (session == nullptr) {
+        return -1;
+      }
+
+      std::lock_guard<std::mutex> lock(Lock);
+      Table<Key>* table = current.load(std::memory_order_relaxed);
+
+      bool isLive = false;
+      Cell<Key>* cell = table->FindCell(key, &isLive);
+      if (isLive) {
+        cell->Session.store(session, std::memory_order_release);
+        return 0;
+      }
+
+      if ((table->Used + 1) * 2 > table->Capacity()) {
+        table = Rebuild(current, table->Live + 1);
+        cell = table->FindCell(key, &isLive);
+      }
+
+      table->Publish(*cell, key, session);
+      Stats.Inserts++;
+      return 0;
+    }
+
+    template<typename Key>
+    int Remove(std::atomic<Table<Key>*>& current, const Key& key)
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      ReclaimTablesLocked();
+      Table<Key>* table = current.load(std::memory_order_relaxed);
+
+      bool isLive = false;
+      Cell<Key>* cell = table->FindCell(key, &isLive);
+      if (!isLive) {
+        return -1;
+      }
+
+      table->Delete(*cell);
+      Stats.Removes++;
+      return 0;
+    }
+
+    /**
+    * Removes the entries for a session. Called with the lock held.
+    */
+    template<typename Key>
+    int RemoveSession(std::atomic<Table<Key>*>& current, void* session)
+    {
+      Table<Key>* table = current.load(std::memory_order_relaxed);
+      int count = 0;
+      for (size_t i = 0; i < table->Capacity(); i++) {
+        Cell<Key>& cell = table->Cells[i];
+        if (cell.Tag.load(std::memory_order_relaxed) > TAG_DELETED &&
+          cell.Session.load(std::memory_order_relaxed) == session) {
+          table->Delete(cell);
+          count++;
+        }
+      }
+      Stats.Removes += count;
+      return count;
+    }
+  };
+
+  SessionRouter::SessionRouter(int capacity) :
+    _impl(new Impl((capacity > 0) ? (size_t)capacity : 0))
+  { }
+
+  SessionRouter::~SessionRouter()
+  {
+    for (const RetiredObject& retired : _impl->Retired) {
+      retired.Destroy(retired.Object);
+    }
+    delete _impl->Ssrcs.load();
+    delete _impl->Addresses.load();
+    delete _impl;
+  }
+
+  int SessionRouter::EnterRead() const
+  {
+    unsigned int shard = MetricsControl::ThreadShard() % MetricsControl::SHARD_COUNT;
+    uint32_t parity = _impl->Epoch.load(std::memory_order_seq_cst) & 1;
+    _impl->Shards[shard].Readers[parity].fetch_add(1, std::memory_order_seq_cst);
+
+    // Pairs with the fence in WaitForReaders, as the lookups in the scope only use
+    // acquire loads.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return (int)(shard * 2 + parity);
+  }
+
+  void SessionRouter::ExitRead(int token) const
+  {
+    _impl->Shards[token / 2].Readers[token % 2].fetch_sub(1, std::memory_order_release);
+  }
+
+  int SessionRouter::AddSsrc(uint32_t ssrc, void* session)
+  {
+    return _impl->Add(_impl->Ssrcs, ssrc, session);
+  }
+
+  int SessionRouter::RemoveSsrc(uint32_t ssrc)
+  {
+    return _impl->Remove(_impl->Ssrcs, ssrc);
+  }
+
+  int SessionRouter::AddAddress(const FiveTuple& tuple, void* session)
+  {
+    return _impl->Add(_impl->Addresses, tuple, session);
+  }
+
+  int SessionRouter::RemoveAddress(const FiveTuple& tuple)
+  {
+    return _impl->Remove(_impl->Addresses, tuple);
+  }
+
+  int SessionRouter::RemoveSession(void* session)
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    _impl->ReclaimTablesLocked();
+    return _impl->RemoveSession(_impl->Ssrcs, session) + _impl->RemoveSession(_impl->Addresses, session);
+  }
+
+  void* SessionRouter::LookupSsrc(uint32_t ssrc) const
+  {
+    ReadScope scope(*this);
+    return _impl->Ssrcs.load(std::memory_order_seq_cst)->Find(ssrc);
+  }
+
+  void* SessionRouter::LookupAddress(const FiveTuple& tuple) const
+  {
+    ReadScope scope(*this);
+    return _impl->Addresses.load(std::memory_order_seq_cst)->Find(tuple);
+  }
+
+  void* SessionRouter::Route(const FiveTuple& tuple, const uint8_t* packet, int length) const
+  {
+    ReadScope scope(*this);
+
+    void* session = _impl->Addresses.load(std::memory_order_seq_cst)->Find(tuple);
+    if (session != nullptr || packet == nullptr) {
+      return session;
+    }
+
+    // RTP and RTCP have a first byte of 128 to 191 and RTCP packet types are 192 to
+    // 223 (RFC5761 4). The sender SSRC follows the RTCP header's length.
+    if (length >= RTCP_HEADER_LENGTH && packet[0] >= 128 && packet[0] <= 191) {
+      bool isRtcp = packet[1] >= 192 && packet[1] <= 223;
+      if (isRtcp) {
+        return _impl->Ssrcs.load(std::memory_order_seq_cst)->Find(ReadUint32(packet + 4));
+      }
+      if (length >= RTP_HEADER_LENGTH) {
+        return _impl->Ssrcs.load(std::memory_order_seq_cst)->Find(ReadUint32(packet + 8));
+      }
+    }
+    return nullptr;
+  }
+
+  void SessionRouter::Retire(void* object, void (*destroy)(void*))
+  {
+    if (object == nullptr || destroy == nullptr) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    _impl->RetireLocked(object, destroy);
+  }
+
+  void SessionRouter::Reclaim()
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    _impl->ReclaimLocked();
+  }
+
+  void SessionRouter::Synchronize()
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    _impl->WaitForReaders();
+  }
+
+  int SessionRouter::GetSsrcCount() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    return (int)_impl->Ssrcs.load(std::memory_order_relaxed)->Live;
+  }
+
+  int SessionRouter::GetAddressCount() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    return (int)_impl->Addresses.load(std::memory_order_relaxed)->Live;
+  }
+
+  SessionRouterStats SessionRouter::GetStats() const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    SessionRouterStats stats = _impl->Stats;
+    stats.SsrcEntries = _impl->Ssrcs.load(std::memory_order_relaxed)->Live;
+    stats.AddressEntries = _impl->Addresses.load(std::memory_order_relaxed)->Live;
+    return stats;
+  }
+}
@@ -0,0 +1,205 @@
+//-----------------------------------------------------------------------------
+// Filename: SessionRouter.h
+//
+// Description: Routes datagrams arriving on a socket shared by many peers, as
+// an SFU does, to the session they belong to. A session is found by the
+// packet's 5-tuple or, for RTP and RTCP, by its SSRC.
+//
+// The lookups are lock-free so every receive thread can route at once. Each
+// key type has an open addressing hash table that readers probe without
+// taking a lock. Writers are serialised and never change a key readers can
+// see. A removed entry is marked deleted and the table is rebuilt and
+// swapped once deleted entries fill it. A replaced table, and any session
+// object handed to Retire, is only freed after a grace period, once every
+// reader that might still be using it has left its ReadScope.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+struct sockaddr;
+
+namespace SIPSorceryMedia {
+
+  /**
+  * A datagram's protocol, addresses and ports. IPv4 addresses are stored as IPv4
+  * mapped IPv6 addresses so both families share one key. Compared byte for byte.
+  */
+  struct FiveTuple
+  {
+    uint8_t Protocol = 0;           // IPPROTO_UDP or IPPROTO_TCP.
+    uint8_t Reserved[3] = {};
+    uint16_t SourcePort = 0;        // Host byte order.
+    uint16_t DestinationPort = 0;
+    uint8_t SourceAddress[16] = {};
+    uint8_t DestinationAddress[16] = {};
+
+    /**
+    * Builds a tuple from the sockaddr_in or sockaddr_in6 a receive reported and
+    * the address of the socket it arrived on.
+    * @param[out] tuple: set with the addresses and ports.
+    * @@Returns: 0 if successful or -1 if either address isn't IPv4 or IPv6.
+    */
+    static int FromAddresses(uint8_t protocol, const sockaddr* source, const sockaddr* destination, FiveTuple& tuple);
+  };
+
+  bool operator==(const FiveTuple& a, const FiveTuple& b);
+
+  /**
+  * Running totals for a router, updated by the writers. All fields are plain 64 bit
+  * integers so the structure can be copied straight across the flat C API.
+  */
+  struct SessionRouterStats
+  {
+    uint64_t SsrcEntries;
+    uint64_t AddressEntries;
+    uint64_t Inserts;
+    uint64_t Removes;
+    uint64_t Rebuilds;          // Tables replaced to grow or clear deleted entries.
+    uint64_t GracePeriods;      // Waits for the readers to leave their scopes.
+    uint64_t Retired;           // Sessions and tables handed over for freeing.
+    uint64_t Reclaimed;         // Retired objects freed after a grace period.
+  };
+
+  class SessionRouter
+  {
+  public:
+
+    /**
+    * The number of retired objects that are kept before a writer waits for a grace
+    * period and frees them.
+    */
+    static const int RECLAIM_BATCH = 64;
+
+    /**
+    * Keeps the router's lookups safe while the sessions they return are in use. A
+    * session handed to Retire is not freed while any scope that was entered before
+    * it was removed is still open. Scopes are meant to be short, a receive and its
+    * dispatch, and may be nested. A thread in a scope must not call a method that
+    * removes, retires, reclaims or synchronizes, it would wait for itself. Adding
+    * never waits, so a receive thread can map the new 5-tuple of a session it has just
+    * routed by SSRC, after a NAT rebinding, inside its scope.
+    */
+    class ReadScope
+    {
+    public:
+      explicit ReadScope(const SessionRouter& router) : _router(router), _token(router.EnterRead()) { }
+      ~ReadScope() { _router.ExitRead(_token); }
+
+      ReadScope(const ReadScope&) = delete;
+      ReadScope& operator=(const ReadScope&) = delete;
+
+    private:
+      const SessionRouter& _router;
+      int _token;
+    };
+
+    /**
+    * @param[in] capacity: the number of entries of each type to size the tables for
+    *  up front. They grow as needed.
+    */
+    explicit SessionRouter(int capacity = 1024);
+
+    /**
+    * Frees the tables and any retired objects. No reader may still be using the router.
+    */
+    ~SessionRouter();
+
+    SessionRouter(const SessionRouter&) = delete;
+    SessionRouter& operator=(const SessionRouter&) = delete;
+
+    /**
+    * Maps an SSRC to a session, replacing any session it was mapped to. Doesn't wait for
+    * readers, a table it replaces to grow is freed by a later remove or Reclaim.
+    * @param[in] session: the caller's session, must not be null.
+    * @@Returns: 0 if successful or -1 if session was null.
+    */
+    int AddSsrc(uint32_t ssrc, void* session);
+
+    /**
+    * Removes an SSRC. Waits for a grace period first if a table replaced by an add is
+    * waiting to be freed.
+    * @@Returns: 0 if the SSRC was removed or -1 if it wasn't mapped.
+    */
+    int RemoveSsrc(uint32_t ssrc);
+
+    /**
+    * Maps a 5-tuple to a session, replacing any session it was mapped to. Doesn't wait
+    * for readers, see AddSsrc.
+    * @@Returns: 0 if successful or -1 if session was null.
+    */
+    int AddAddress(const FiveTuple& tuple, void* session);
+
+    /**
+    * Removes a 5-tuple, see RemoveSsrc.
+    * @@Returns: 0 if the 5-tuple was removed or -1 if it wasn't mapped.
+    */
+    int RemoveAddress(const FiveTuple& tuple);
+
+    /**
+    * Removes every SSRC and 5-tuple mapped to a session. Visits every entry, so is
+    * meant for session teardown rather than the media path.
+    * @@Returns: the number of entries removed.
+    */
+    int RemoveSession(void* session);
+
+    /**
+    * Gets the session an SSRC is mapped to. Lock-free.
+    * @@Returns: the session or null if the SSRC isn't mapped.
+    */
+    void* LookupSsrc(uint32_t ssrc) const;
+
+    /**
+    * Gets the session a 5-tuple is mapped to. Lock-free.
+    * @@Returns: the session or null if the 5-tuple isn't mapped.
+    */
+    void* LookupAddress(const FiveTuple& tuple) const;
+
+    /**
+    * Routes a received datagram. The 5-tuple is tried first as it covers STUN and DTLS
+    * as well as media. An RTP or RTCP packet (RFC7983) from an address that isn't
+    * mapped, for example after a NAT rebinding, is then routed by its sender SSRC.
+    * Lock-free.
+    * @param[in] tuple: the datagram's 5-tuple.
+    * @param[in] packet: the datagram.
+    * @param[in] length: the length of the datagram.
+    * @@Returns: the session or null if neither key is mapped.
+    */
+    void* Route(const FiveTuple& tuple, const uint8_t* packet, int length) const;
+
+    /**
+    * Frees an object once no reader can still be using it, called after removing the
+    * session's entries. The object is freed by a later call that fills the batch, by
+    * Reclaim or by the destructor, on whichever thread that is.
+    * @param[in] object: the object to free.
+    * @param[in] destroy: called with the object to free it.
+    */
+    void Retire(void* object, void (*destroy)(void*));
+
+    /**
+    * Waits for a grace period and frees every retired object.
+    */
+    void Reclaim();
+
+    /**
+    * Waits until every ReadScope that was open when it was called has been left.
+    */
+    void Synchronize();
+
+    int GetSsrcCount() const;
+    int GetAddressCount() const;
+
+    SessionRouterStats GetStats() const;
+
+  private:
+    int EnterRead() const;
+    void ExitRead(int token) const;
+
+    struct Impl;
+    Impl* _impl;
+  };
+}
@@ -0,0 +1,755 @@
+//-----------------------------------------------------------------------------
+// Filename: SharedFrameRing.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "SharedFrameRing.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#endif
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const uint32_t RING_MAGIC = 0x31524653;     // "SFR1"
+    const uint32_t RING_VERSION = 1;
+    const size_t PAGE_SIZE_BYTES = 4096;
+    const size_t CACHE_LINE = 64;
+    const int FREE_QUEUE = 0;
+    const int FRAME_QUEUE = 1;
+    const int QUEUE_COUNT = 2;
+
+    // The atomics are shared between processes, which is only safe if they don't
+    // fall back to a lock.
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "32 bit atomics must be lock free.");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics must be lock free.");
+
+    /**
+    * A bounded multi producer, multi consumer queue cell (Vyukov). The sequence
+    * says whether the cell is free for the enqueue or filled for the dequeue at
+    * a given position.
+    */
+    struct QueueCell
+    {
+      std::atomic<uint32_t> Sequence;
+      uint32_t Slot;
+    };
+
+    struct QueueHeader
+    {
+      alignas(CACHE_LINE) std::atomic<uint32_t> EnqueuePosition;
+      alignas(CACHE_LINE) std::atomic<uint32_t> DequeuePosition;
+
+      // Bumped on every enqueue. Waiters block on it with a futex on Linux.
+      alignas(CACHE_LINE) std::atomic<uint32_t> Signal;
+      std::atomic<uint32_t> Waiters;
+    };
+
+    struct SlotHeader
+    {
+      uint64_t Id;
+      uint64_t TimestampNanoseconds;
+      int32_t Length;
+      int32_t Width;
+      int32_t Height;
+      int32_t Reserved;
+    };
+
+    struct RingHeader
+    {
+      std::atomic<uint32_t> Magic;
+      uint32_t Version;
+      uint32_t Width;
+      uint32_t Height;
+      uint32_t SlotCount;
+      uint32_t SlotCapacity;
+      uint64_t TotalSize;
+      uint64_t CellsOffset[QUEUE_COUNT];
+      uint64_t SlotHeadersOffset;
+      uint64_t SlotsOffset;
+      uint64_t SlotStride;
+
+      alignas(CACHE_LINE) std::atomic<uint64_t> FramesPublished;
+      std::atomic<uint64_t> FramesReceived;
+      std::atomic<uint64_t> AcquireTimeouts;
+      std::atomic<uint64_t> ReceiveTimeouts;
+      std::atomic<uint64_t> LatencyTotalNanoseconds;
+      std::atomic<uint64_t> LatencyMaxNanoseconds;
+
+      QueueHeader Queues[QUEUE_COUNT];
+    };
+
+    size_t RoundUp(size_t value, size_t multiple)
+    {
+      return (value + multiple - 1) / multiple * multiple;
+    }
+
+    int32_t Clamp(int32_t value, int32_t max)
+    {
+      return (value < 0) ? 0 : (value > max) ? max : value;
+    }
+
+    /**
+    * Whether count items of a size starting at an offset fit in the mapping, without
+    * overflowing.
+    */
+    bool FitsIn(uint64_t offset, uint64_t count, uint64_t size, uint64_t mappedSize)
+    {
+      return offset <= mappedSize && (size == 0 || count <= (mappedSize - offset) / size);
+    }
+
+    uint32_t NextPowerOfTwo(uint32_t value)
+    {
+      uint32_t power = 1;
+      while (power < value) {
+        power <<= 1;
+      }
+      return power;
+    }
+
+    std::atomic<uint32_t> _ringCount{ 0 };
+  }
+
+  /**
+  * The ring's sizes and offsets. Copied out of the shared header, once checked, so
+  * another process changing the header afterwards can't move them outside the mapping.
+  */
+  struct RingLayout
+  {
+    uint32_t Width = 0;
+    uint32_t Height = 0;
+    uint32_t SlotCount = 0;
+    uint32_t SlotCapacity = 0;
+    uint64_t CellsOffset[QUEUE_COUNT] = {};
+    uint64_t SlotHeadersOffset = 0;
+    uint64_t SlotsOffset = 0;
+    uint64_t SlotStride = 0;
+  };
+
+  struct SharedFrameRing::Impl
+  {
+    RingHeader* Header = nullptr;
+    RingLayout Layout;
+    uint8_t* Base = nullptr;
+    size_t Size = 0;
+    std::string Name;
+    bool IsCreator = false;
+
+#if defined(_WIN32)
+    HANDLE Mapping = nullptr;
+    HANDLE Semaphores[QUEUE_COUNT] = { nullptr, nullptr };
+#else
+    int Fd = -1;
+#endif
+
+    QueueCell* Cells(int queue) { return reinterpret_cast<QueueCell*>(Base + Layout.CellsOffset[queue]); }
+    SlotHeader* SlotHeaders() { return reinterpret_cast<SlotHeader*>(Base + Layout.SlotHeadersOffset); }
+    uint8_t* SlotData(int slot) { return Base + Layout.SlotsOffset + (size_t)slot * Layout.SlotStride; }
+
+    /**
+    * Copies the layout from the header of a ring created by another process and checks
+    * everything in it lies within the mapping.
+    * @@Returns: 0 if the layout is valid or -1 if not.
+    */
+    int LoadLayout()
+    {
+      RingLayout layout;
+      layout.Width = Header->Width;
+      layout.Height = Header->Height;
+      layout.SlotCount = Header->SlotCount;
+      layout.SlotCapacity = Header->SlotCapacity;
+      for (int q = 0; q < QUEUE_COUNT; q++) {
+        layout.CellsOffset[q] = Header->CellsOffset[q];
+      }
+      layout.SlotHeadersOffset = Header->SlotHeadersOffset;
+      layout.SlotsOffset = Header->SlotsOffset;
+      layout.SlotStride = Header->SlotStride;
+
+      uint64_t chromaSize = (uint64_t)((layout.Width + 1) / 2) * ((layout.Height + 1) / 2);
+      uint64_t frameSize = (uint64_t)layout.Width * layout.Height + chromaSize * 2;
+
+      bool isValid = layout.Width > 0 && layout.Height > 0 && layout.Width <= INT32_MAX / layout.Height &&
+        layout.SlotCount > 0 && layout.SlotCount <= INT32_MAX && (layout.SlotCount & (layout.SlotCount - 1)) == 0 &&
+        layout.SlotCapacity >= frameSize && layout.SlotCapacity <= INT32_MAX && layout.SlotCapacity <= layout.SlotStride &&
+        layout.SlotHeadersOffset >= sizeof(RingHeader) && layout.SlotHeadersOffset % alignof(SlotHeader) == 0 &&
+        FitsIn(layout.SlotHeadersOffset, layout.SlotCount, sizeof(SlotHeader), Size) &&
+        layout.SlotsOffset >= sizeof(RingHeader) && FitsIn(layout.SlotsOffset, layout.SlotCount, layout.SlotStride, Size);
+
+      for (int q = 0; q < QUEUE_COUNT; q++) {
+        isValid = isValid && layout.CellsOffset[q] >= sizeof(RingHeader) && layout.CellsOffset[q] % alignof(QueueCell) == 0 &&
+          FitsIn(layout.CellsOffset[q], layout.SlotCount, sizeof(QueueCell), Size);
+      }
+
+      if (!isValid) {
+        return -1;
+      }
+
+      Layout = layout;
+      return 0;
+    }
+
+    ~Impl()
+    {
+#if defined(_WIN32)
+      if (Base != nullptr) {
+        UnmapViewOfFile(Base);
+      }
+      for (int i = 0; i < QUEUE_COUNT; i++) {
+        if (Semaphores[i] != nullptr) {
+          CloseHandle(Semaphores[i]);
+        }
+      }
+      if (Mapping != nullptr) {
+        CloseHandle(Mapping);
+      }
+#else
+      if (Base != nullptr) {
+        munmap(Base, Size);
+      }
+      if (Fd >= 0) {
+        close(Fd);
+      }
+#if !defined(__linux__)
+      if (IsCreator) {
+        shm_unlink(Name.c_str());
+      }
+#endif
+#endif
+    }
+
+    /**
+    * Creates the shared memory and maps it.
+    */
+    int CreateMapping(size_t size)
+    {
+      char name[96];
+      uint32_t count = _ringCount.fetch_add(1, std::memory_order_relaxed);
+
+#if defined(_WIN32)
+      snprintf(name, sizeof(name), "Local\\sipsm-frame-ring-%lu-%u", GetCurrentProcessId(), count);
+      Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+        (DWORD)(size & 0xffffffff), name);
+      if (Mapping == nullptr) {
+        SIPSM_LOG_ERROR("Failed to create the shared frame ring %s, error %lu.", name, GetLastError());
+        return -1;
+      }
+      Name = name;
+#elif defined(__linux__)
+      // Another process opens the memfd through the creator's /proc entry.
+      Fd = memfd_create("sipsm-frame-ring", MFD_CLOEXEC);
+      if (Fd < 0 || ftruncate(Fd, (off_t)size) != 0) {
+        SIPSM_LOG_ERROR("Failed to create the shared frame ring memfd, error %d.", errno);
+        return -1;
+      }
+      (void)count;
+      snprintf(name, sizeof(name), "/proc/%d/fd/%d", (int)getpid(), Fd);
+      Name = name;
+#else
+      snprintf(name, sizeof(name), "/sipsm-ring-%d-%u", (int)getpid(), count);
+      Fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (Fd < 0 || ftruncate(Fd, (off_t)size) != 0) {
+        SIPSM_LOG_ERROR("Failed to create the shared frame ring %s, error %d.", name, errno);
+        return -1;
+      }
+      Name = name;
+#endif
+
+      IsCreator = true;
+      return Map(size);
+    }
+
+    /**
+    * Opens shared memory created by another process and maps it.
+    */
+    int OpenMapping(const std::string& name)
+    {
+      Name = name;
+
+#if defined(_WIN32)
+      Mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+      if (Mapping == nullptr) {
+        SIPSM_LOG_ERROR("Failed to open the shared frame ring %s, error %lu.", name.c_str(), GetLastError());
+        return -1;
+      }
+      return Map(0);
+#else
+#if defined(__linux__)
+      Fd = open(name.c_str(), O_RDWR | O_CLOEXEC);
+#else
+      Fd = shm_open(name.c_str(), O_RDWR, 0600);
+#endif
+      struct stat info;
+      if (Fd < 0 || fstat(Fd, &info) != 0) {
+        SIPSM_LOG_ERROR("Failed to open the shared frame ring %s, error %d.", name.c_str(), errno);
+        return -1;
+      }
+      return Map((size_t)info.st_size);
+#endif
+    }
+
+    int Map(size_t size)
+    {
+#if defined(_WIN32)
+      Base = static_cast<uint8_t*>(MapViewOfFile(Mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+      if (Base == nullptr) {
+        SIPSM_LOG_ERROR("Failed to map the shared frame ring %s, error %lu.", Name.c_str(), GetLastError());
+        return -1;
+      }
+
+      MEMORY_BASIC_INFORMATION info;
+      VirtualQuery(Base, &info, sizeof(info));
+      Size = info.RegionSize;
+#else
+      void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+      if (base == MAP_FAILED) {
+        SIPSM_LOG_ERROR("Failed to map the shared frame ring %s, error %d.", Name.c_str(), errno);
+        return -1;
+      }
+      Base = static_cast<uint8_t*>(base);
+      Size = size;
+#endif
+
+      Header = reinterpret_cast<RingHeader*>(Base);
+      return 0;
+    }
+
+    int OpenSemaphores(bool isCreate)
+    {
+#if defined(_WIN32)
+      // A semaphore rather than an auto reset event, pushes that happen before a
+      // waiter wakes would merge into one set event and leave other waiters asleep.
+      for (int i = 0; i < QUEUE_COUNT; i++) {
+        std::string semaphoreName = Name + ((i == FREE_QUEUE) ? "-free" : "-frames");
+        Semaphores[i] = (isCreate) ? CreateSemaphoreA(nullptr, 0, MAXLONG, semaphoreName.c_str()) :
+          OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, semaphoreName.c_str());
+        if (Semaphores[i] == nullptr) {
+          SIPSM_LOG_ERROR("Failed to open the shared frame ring semaphore %s, error %lu.", semaphoreName.c_str(), GetLastError());
+          return -1;
+        }
+      }
+#else
+      (void)isCreate;
+#endif
+      return 0;
+    }
+
+    void InitialiseQueues()
+    {
+      for (int q = 0; q < QUEUE_COUNT; q++) {
+        QueueHeader& queue = Header->Queues[q];
+        queue.EnqueuePosition.store(0, std::memory_order_relaxed);
+        queue.DequeuePosition.store(0, std::memory_order_relaxed);
+
+        QueueCell* cells = Cells(q);
+        for (uint32_t i = 0; i < Layout.SlotCount; i++) {
+          cells[i].Sequence.store(i, std::memory_order_relaxed);
+          cells[i].Slot = 0;
+        }
+      }
+
+      for (uint32_t slot = 0; slot < Layout.SlotCount; slot++) {
+        Push(FREE_QUEUE, slot);
+      }
+    }
+
+    bool TryDequeue(int q, uint32_t& slot)
+    {
+      QueueHeader& queue = Header->Queues[q];
+      QueueCell* cells = Cells(q);
+      uint32_t mask = Layout.SlotCount - 1;
+      uint32_t position = queue.DequeuePosition.load(std::memory_order_relaxed);
+
+      while (true) {
+        QueueCell& cell = cells[position & mask];
+        int32_t difference = (int32_t)(cell.Sequence.load(std::memory_order_acquire) - (position + 1));
+
+        if (difference == 0) {
+          if (queue.DequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            slot = cell.Slot;
+            cell.Sequence.store(position + mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (difference < 0) {
+          return false;
+        }
+        else {
+          position = queue.DequeuePosition.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+    * Adds a slot to a queue. Each queue has a cell for every slot so this never
+    * finds the queue full.
+    */
+    void Push(int q, uint32_t slot)
+    {
+      QueueHeader& queue = Header->Queues[q];
+      QueueCell* cells = Cells(q);
+      uint32_t mask = Layout.SlotCount - 1;
+      uint32_t position = queue.EnqueuePosition.load(std::memory_order_relaxed);
+
+      while (true) {
+        QueueCell& cell = cells[position & mask];
+        int32_t difference = (int32_t)(cell.Sequence.load(std::memory_order_acquire) - position);
+
+        if (difference == 0) {
+          if (queue.EnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            cell.Slot = slot;
+            cell.Sequence.store(position + 1, std::memory_order_release);
+            break;
+          }
+        }
+        else {
+          position = queue.EnqueuePosition.load(std::memory_order_relaxed);
+        }
+      }
+
+      // The signal is bumped before the waiters are checked and a waiter registers
+      // before checking the signal, so one of them always sees the other.
+      queue.Signal.fetch_add(1, std::memory_order_seq_cst);
+      if (queue.Waiters.load(std::memory_order_seq_cst) > 0) {
+        Wake(q);
+      }
+    }
+
+    /**
+    * Takes a slot from a queue, waiting for one if the queue is empty.
+    */
+    int Pop(int q, uint32_t& slot, int timeoutMilliseconds)
+    {
+      QueueHeader& queue = Header->Queues[q];
+      uint64_t deadline = (timeoutMilliseconds > 0) ?
+        MediaScheduler::NowNanoseconds() + (uint64_t)timeoutMilliseconds * 1000000ULL : 0;
+
+      while (true) {
+        uint32_t signal = queue.Signal.load(std::memory_order_seq_cst);
+        if (TryDequeue(q, slot)) {
+          return 0;
+        }
+
+        int64_t remainingNanoseconds = -1;
+        if (timeoutMilliseconds == 0) {
+          return TIMED_OUT;
+        }
+        else if (timeoutMilliseconds > 0) {
+          remainingNanoseconds = (int64_t)(deadline - MediaScheduler::NowNanoseconds());
+          if (remainingNanoseconds <= 0) {
+            return TIMED_OUT;
+          }
+        }
+
+        queue.Waiters.fetch_add(1, std::memory_order_seq_cst);
+        if (queue.Signal.load(std::memory_order_seq_cst) == signal) {
+          Wait(q, signal, remainingNanoseconds);
+        }
+        queue.Waiters.fetch_sub(1, std::memory_order_seq_cst);
+      }
+    }
+
+    /**
+    * Blocks until the queue's signal moves on from a value, the time runs out or a
+    * spurious wake up.
+    * @param[in] timeoutNanoseconds: -1 to wait without a limit.
+    */
+    void Wait(int q, uint32_t signal, int64_t timeoutNanoseconds)
+    {
+#if defined(_WIN32)
+      (void)signal;
+      DWORD milliseconds = (timeoutNanoseconds < 0) ? INFINITE : (DWORD)((timeoutNanoseconds + 999999) / 1000000);
+      WaitForSingleObject(Semaphores[q], milliseconds);
+#elif defined(__linux__)
+      // Not FUTEX_PRIVATE_FLAG, the word is shared with other processes.
+      timespec timeout;
+      timeout.tv_sec = (time_t)(timeoutNanoseconds / 1000000000LL);
+      timeout.tv_nsec = (long)(timeoutNanoseconds % 1000000000LL);
+      syscall(SYS_futex, &Header->Queues[q].Signal, FUTEX_WAIT, signal, (timeoutNanoseconds < 0) ? nullptr : &timeout, nullptr, 0);
+#else
+      (void)q;
+      (void)signal;
+      (void)timeoutNanoseconds;
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+#endif
+    }
+
+    void Wake(int q)
+    {
+#if defined(_WIN32)
+      // One release per push. Releases nobody waits for only cause spurious wake ups.
+      ReleaseSemaphore(Semaphores[q], 1, nullptr);
+#elif defined(__linux__)
+      syscall(SYS_futex, &Header->Queues[q].Signal, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#else
+      (void)q;
+#endif
+    }
+  };
+
+  SharedFrameRing* SharedFrameRing::Create(const SharedFrameRingConfig& config)
+  {
+    if (config.Width <= 0 || config.Height <= 0 || config.SlotCount <= 0) {
+      SIPSM_LOG_ERROR("Invalid shared frame ring size %dx%d with %d slots.", config.Width, config.Height, config.SlotCount);
+      return nullptr;
+    }
+
+    uint32_t slotCount = NextPowerOfTwo((uint32_t)config.SlotCount);
+    size_t chromaSize = (size_t)((config.Width + 1) / 2) * ((config.Height + 1) / 2);
+    size_t slotCapacity = RoundUp((size_t)config.Width * config.Height + chromaSize * 2, CACHE_LINE);
+
+    // Each frame starts on its own page.
+    size_t cellsOffset = RoundUp(sizeof(RingHeader), CACHE_LINE);
+    size_t cellsSize = RoundUp(slotCount * sizeof(QueueCell), CACHE_LINE);
+    size_t slotHeadersOffset = cellsOffset + cellsSize * QUEUE_COUNT;
+    size_t slotsOffset = RoundUp(slotHeadersOffset + slotCount * sizeof(SlotHeader), PAGE_SIZE_BYTES);
+    size_t slotStride = RoundUp(slotCapacity, PAGE_SIZE_BYTES);
+    size_t totalSize = slotsOffset + slotStride * slotCount;
+
+    Impl* impl = new Impl();
+    if (impl->CreateMapping(totalSize) != 0 || impl->OpenSemaphores(true) != 0) {
+      delete impl;
+      return nullptr;
+    }
+
+    // The memory starts zeroed, which is a valid state for every atomic.
+    RingHeader* header = new (impl->Base) RingHeader();
+    header->Version = RING_VERSION;
+    header->Width = (uint32_t)config.Width;
+    header->Height = (uint32_t)config.Height;
+    header->SlotCount = slotCount;
+    header->SlotCapacity = (uint32_t)slotCapacity;
+    header->TotalSize = totalSize;
+    header->CellsOffset[FREE_QUEUE] = cellsOffset;
+    header->CellsOffset[FRAME_QUEUE] = cellsOffset + cellsSize;
+    header->SlotHeadersOffset = slotHeadersOffset;
+    header->SlotsOffset = slotsOffset;
+    header->SlotStride = slotStride;
+
+    impl->Layout.Width = header->Width;
+    impl->Layout.Height = header->Height;
+    impl->Layout.SlotCount = slotCount;
+    impl->Layout.SlotCapacity = header->SlotCapacity;
+    impl->Layout.CellsOffset[FREE_QUEUE] = cellsOffset;
+    impl->Layout.CellsOffset[FRAME_QUEUE] = cellsOffset + cellsSize;
+    impl->Layout.SlotHeadersOffset = slotHeadersOffset;
+    impl->Layout.SlotsOffset = slotsOffset;
+    impl->Layout.SlotStride = slotStride;
+
+    impl->InitialiseQueues();
+
+    // Published last, Open checks for it.
+    header->Magic.store(RING_MAGIC, std::memory_order_release);
+
+    SIPSM_LOG_DEBUG("Created shared frame ring %s, %u slots of %dx%d, %zu bytes.", impl->Name.c_str(), slotCount,
+      config.Width, config.Height, totalSize);
+
+    return new SharedFrameRing(impl);
+  }
+
+  SharedFrameRing* SharedFrameRing::Open(const std::string& name)
+  {
+    Impl* impl = new Impl();
+    if (impl->OpenMapping(name) != 0) {
+      delete impl;
+      return nullptr;
+    }
+
+    RingHeader* header = impl->Header;
+    if (impl->Size < sizeof(RingHeader) || header->Magic.load(std::memory_order_acquire) != RING_MAGIC ||
+      header->Version != RING_VERSION) {
+      SIPSM_LOG_ERROR("%s is not a shared frame ring.", name.c_str());
+      delete impl;
+      return nullptr;
+    }
+
+    // The header is written by another process, nothing in it is used until it has
+    // been checked against the mapping.
+    if (impl->LoadLayout() != 0) {
+      SIPSM_LOG_ERROR("The shared frame ring %s has an invalid layout.", name.c_str());
+      delete impl;
+      return nullptr;
+    }
+
+    if (impl->OpenSemaphores(false) != 0) {
+      delete impl;
+      return nullptr;
+    }
+
+    return new SharedFrameRing(impl);
+  }
+
+  SharedFrameRing::~SharedFrameRing()
+  {
+    delete _impl;
+  }
+
+  const std::string& SharedFrameRing::GetName() const
+  {
+    return _impl->Name;
+  }
+
+  int SharedFrameRing::GetWidth() const
+  {
+    return (int)_impl->Layout.Width;
+  }
+
+  int SharedFrameRing::GetHeight() const
+  {
+    return (int)_impl->Layout.Height;
+  }
+
+  int SharedFrameRing::GetSlotCount() const
+  {
+    return (int)_impl->Layout.SlotCount;
+  }
+
+  int SharedFrameRing::GetSlotCapacity() const
+  {
+    return (int)_impl->Layout.SlotCapacity;
+  }
+
+  int SharedFrameRing::Acquire(SharedFrame& frame, int timeoutMilliseconds)
+  {
+    uint32_t slot = 0;
+    if (_impl->Pop(FREE_QUEUE, slot, timeoutMilliseconds) != 0) {
+      _impl->Header->AcquireTimeouts.fetch_add(1, std::memory_order_relaxed);
+      return TIMED_OUT;
+    }
+
+    // The queue is written by another process as well.
+    if (slot >= _impl->Layout.SlotCount) {
+      SIPSM_LOG_ERROR("The shared frame ring %s returned an invalid free slot %u.", _impl->Name.c_str(), slot);
+      return -1;
+    }
+
+    frame = SharedFrame();
+    frame.Slot = (int)slot;
+    frame.Data = _impl->SlotData((int)slot);
+    frame.Capacity = (int)_impl->Layout.SlotCapacity;
+    return 0;
+  }
+
+  int SharedFrameRing::Publish(SharedFrame& frame)
+  {
+    if (frame.Slot < 0 || frame.Slot >= (int)_impl->Layout.SlotCount) {
+      return -1;
+    }
+
+    frame.TimestampNanoseconds = MediaScheduler::NowNanoseconds();
+
+    SlotHeader& header = _impl->SlotHeaders()[frame.Slot];
+    header.Id = frame.Id;
+    header.TimestampNanoseconds = frame.TimestampNanoseconds;
+    header.Length = frame.Length;
+    header.Width = frame.Width;
+    header.Height = frame.Height;
+
+    _impl->Header->FramesPublished.fetch_add(1, std::memory_order_relaxed);
+    _impl->Push(FRAME_QUEUE, (uint32_t)frame.Slot);
+
+    frame = SharedFrame();
+    return 0;
+  }
+
+  int SharedFrameRing::Receive(SharedFrame& frame, int timeoutMilliseconds)
+  {
+    uint32_t slot = 0;
+    if (_impl->Pop(FRAME_QUEUE, slot, timeoutMilliseconds) != 0) {
+      _impl->Header->ReceiveTimeouts.fetch_add(1, std::memory_order_relaxed);
+      return TIMED_OUT;
+    }
+
+    // The queue and the slot header are written by another process, check the slot
+    // and keep the sizes within it.
+    const RingLayout& layout = _impl->Layout;
+    if (slot >= layout.SlotCount) {
+      SIPSM_LOG_ERROR("The shared frame ring %s returned an invalid frame slot %u.", _impl->Name.c_str(), slot);
+      return -1;
+    }
+
+    const SlotHeader& header = _impl->SlotHeaders()[slot];
+    RingHeader* ring = _impl->Header;
+    frame.Slot = (int)slot;
+    frame.Data = _impl->SlotData((int)slot);
+    frame.Capacity = (int)layout.SlotCapacity;
+    frame.Length = Clamp(header.Length, (int32_t)layout.SlotCapacity);
+    frame.Width = Clamp(header.Width, (int32_t)layout.Width);
+    frame.Height = Clamp(header.Height, (int32_t)layout.Height);
+    frame.Id = header.Id;
+    frame.TimestampNanoseconds = header.TimestampNanoseconds;
+
+    uint64_t latency = MediaScheduler::NowNanoseconds() - header.TimestampNanoseconds;
+    ring->FramesReceived.fetch_add(1, std::memory_order_relaxed);
+    ring->LatencyTotalNanoseconds.fetch_add(latency, std::memory_order_relaxed);
+
+    uint64_t max = ring->LatencyMaxNanoseconds.load(std::memory_order_relaxed);
+    while (latency > max && !ring->LatencyMaxNanoseconds.compare_exchange_weak(max, latency, std::memory_order_relaxed)) {}
+
+    return 0;
+  }
+
+  int SharedFrameRing::Release(SharedFrame& frame)
+  {
+    if (frame.Slot < 0 || frame.Slot >= (int)_impl->Layout.SlotCount) {
+      return -1;
+    }
+
+    _impl->Push(FREE_QUEUE, (uint32_t)frame.Slot);
+    frame = SharedFrame();
+    return 0;
+  }
+
+  void SharedFrameRing::Reset()
+  {
+    _impl->InitialiseQueues();
+  }
+
+  SharedFrameRingStats SharedFrameRing::GetStats() const
+  {
+    RingHeader* ring = _impl->Header;
+    SharedFrameRingStats stats;
+    stats.FramesPublished = ring->FramesPublished.load(std::memory_order_relaxed);
+    stats.FramesReceived = ring->FramesReceived.load(std::memory_order_relaxed);
+    stats.AcquireTimeouts = ring->AcquireTimeouts.load(std::memory_order_relaxed);
+    stats.ReceiveTimeouts = ring->ReceiveTimeouts.load(std::memory_order_relaxed);
+    stats.LatencyTotalNanoseconds = ring->LatencyTotalNanoseconds.load(std::memory_order_relaxed);
+    stats.LatencyMaxNanoseconds = ring->LatencyMaxNanoseconds.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void SharedFrameRing::ClearStats()
+  {
+    RingHeader* ring = _impl->Header;
+    ring->FramesPublished.store(0, std::memory_order_relaxed);
+    ring->FramesReceived.store(0, std::memory_order_relaxed);
+    ring->AcquireTimeouts.store(0, std::memory_order_relaxed);
+    ring->ReceiveTimeouts.store(0, std::memory_order_relaxed);
+    ring->LatencyTotalNanoseconds.store(0, std::memory_order_relaxed);
+    ring->LatencyMaxNanoseconds.store(0, std::memory_order_relaxed);
+  }
+}
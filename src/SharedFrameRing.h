@@ -0,0 +1,179 @@
+//-----------------------------------------------------------------------------
+// Filename: SharedFrameRing.h
+//
+// Description: A ring of I420 frames in shared memory for passing video
+// between processes without copying it, for example from a decode worker to
+// a composition worker to an encode worker. A stage that crashes then takes
+// down only its own process.
+//
+// The ring is a fixed number of frame slots, each large enough for an I420
+// image of the ring's maximum size, and two lock-free queues of slot
+// numbers: free slots and published frames. A producer takes a free slot,
+// writes the image straight into it, for example with the caller buffer
+// overload of ImageConvertNative::ConvertRGBtoYUV, and publishes it. A consumer receives the slot, reads the image in place, for
+// example with VpxEncoderNative::Encode, and releases it back to the
+// producers. Only the 4 byte slot number crosses between the processes.
+// Both queues allow any number of producers and consumers.
+//
+// The memory is a memfd on Linux, a POSIX shared memory object on other
+// Unix systems and a named file mapping on Windows. Waiting for a slot or a
+// frame blocks on a futex in the shared memory on Linux and on a named
+// semaphore on Windows, elsewhere it polls.
+//
+// Slots held by a process that dies are not returned to the ring. The
+// creator can call Reset once the other processes have gone.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace SIPSorceryMedia {
+
+  struct SharedFrameRingConfig
+  {
+    /**
+    * The largest frame the slots hold. Smaller frames can be published.
+    */
+    int Width = 640;
+    int Height = 480;
+
+    /**
+    * The number of frame slots, rounded up to a power of two.
+    */
+    int SlotCount = 8;
+  };
+
+  /**
+  * A frame slot held by a producer or a consumer.
+  */
+  struct SharedFrame
+  {
+    int Slot = -1;
+    uint8_t* Data = nullptr;        // The I420 image in the shared memory.
+    int Capacity = 0;               // The bytes available at Data.
+
+    // Set by the producer before publishing and read by the consumer.
+    int Length = 0;
+    int Width = 0;
+    int Height = 0;
+    uint64_t Id = 0;
+    uint64_t TimestampNanoseconds = 0;    // MediaScheduler::NowNanoseconds when published.
+  };
+
+  /**
+  * Running totals for a ring, shared by every process that has it open. All
+  * fields are plain 64 bit integers so the structure can be copied straight
+  * across the flat C API.
+  */
+  struct SharedFrameRingStats
+  {
+    uint64_t FramesPublished;
+    uint64_t FramesReceived;
+    uint64_t AcquireTimeouts;       // Producers that found no free slot in time.
+    uint64_t ReceiveTimeouts;
+    uint64_t LatencyTotalNanoseconds;   // Publish to receive, summed over the received frames.
+    uint64_t LatencyMaxNanoseconds;
+  };
+
+  class SharedFrameRing
+  {
+  public:
+
+    static const int WAIT_INFINITE = -1;
+    static const int TIMED_OUT = 1;
+
+    /**
+    * Creates a new ring.
+    * @@Returns: the ring or nullptr if the shared memory couldn't be created.
+    */
+    static SharedFrameRing* Create(const SharedFrameRingConfig& config = SharedFrameRingConfig());
+
+    /**
+    * Opens a ring created by another process.
+    * @param[in] name: the ring's GetName.
+    * @@Returns: the ring or nullptr if it couldn't be opened.
+    */
+    static SharedFrameRing* Open(const std::string& name);
+
+    /**
+    * Unmaps the ring. The shared memory is freed once every process has closed it.
+    */
+    ~SharedFrameRing();
+
+    SharedFrameRing(const SharedFrameRing&) = delete;
+    SharedFrameRing& operator=(const SharedFrameRing&) = delete;
+
+    /**
+    * Gets the name another process passes to Open, for example on its command line.
+    */
+    const std::string& GetName() const;
+
+    int GetWidth() const;
+    int GetHeight() const;
+    int GetSlotCount() const;
+
+    /**
+    * Gets the bytes each slot holds, enough for an I420 image of the ring's size.
+    */
+    int GetSlotCapacity() const;
+
+    /**
+    * Takes a free slot to write a frame into.
+    * @param[out] frame: set to the slot.
+    * @param[in] timeoutMilliseconds: how long to wait for a free slot, 0 not to wait or
+    *  WAIT_INFINITE.
+    * @@Returns: 0 if successful, TIMED_OUT if no slot became free in time or -1 if the
+    *  other process put an invalid slot on the queue.
+    */
+    int Acquire(SharedFrame& frame, int timeoutMilliseconds = WAIT_INFINITE);
+
+    /**
+    * Publishes a frame written to an acquired slot to the consumers. The frame's Length,
+    * Width, Height and Id must have been set, the timestamp is set here.
+    * @@Returns: 0 if successful or -1 if the frame doesn't hold a slot.
+    */
+    int Publish(SharedFrame& frame);
+
+    /**
+    * Takes the oldest published frame.
+    * @param[out] frame: set to the frame's slot.
+    * @param[in] timeoutMilliseconds: how long to wait for a frame, 0 not to wait or
+    *  WAIT_INFINITE.
+    * @@Returns: 0 if successful, TIMED_OUT if no frame was published in time or -1 if
+    *  the other process put an invalid slot on the queue.
+    */
+    int Receive(SharedFrame& frame, int timeoutMilliseconds = WAIT_INFINITE);
+
+    /**
+    * Returns a slot to the producers, either a received frame that has been consumed or
+    * an acquired slot that won't be published.
+    * @@Returns: 0 if successful or -1 if the frame doesn't hold a slot.
+    */
+    int Release(SharedFrame& frame);
+
+    /**
+    * Makes every slot free again and clears the published frames. Only safe when no
+    * other process is using the ring, for example after restarting a crashed worker.
+    */
+    void Reset();
+
+    SharedFrameRingStats GetStats() const;
+
+    /**
+    * Zeroes the statistics, for every process using the ring.
+    */
+    void ClearStats();
+
+  private:
+
+    struct Impl;
+    Impl* _impl;
+
+    explicit SharedFrameRing(Impl* impl) : _impl(impl) { }
+  };
+}
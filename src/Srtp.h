@@ -28,6 +28,7 @@
 #pragma once
 
 #include "DtlsHandshake.h"
+#include "SrtpNative.h"
 
 #include "srtp2/srtp.h"
 #include "openssl/srtp.h"
@@ -51,12 +52,16 @@ namespace SIPSorceryMedia {
 			*/
       static void InitialiseLibSrtp()
       {
-        // Only need to call the libsrtp initialisation routines once per process.
-        if (!_isLibSrtpInitialised) {
-					srtp_init();
+        SrtpNative::InitialiseLibSrtp();
+      }
 
-					_isLibSrtpInitialised = true;
-        }
+      /**
+      * Gets the name of the AES and HMAC implementation that protects RTP, for
+      * example "OpenSSL EVP" or "libsrtp internal AES".
+      */
+      static String^ GetCryptoBackend()
+      {
+        return gcnew String(SrtpNative::GetCryptoBackendName(SrtpNative::GetCryptoInfo().Rtp));
       }
 
 			/**
@@ -115,12 +120,6 @@ namespace SIPSorceryMedia {
 
 		private:
 
-			static const int SRTP_ANTI_REPLAY_WINDOW_SIZE = 128;
-			static const int SRTP_AES_KEY_KEY_LEN = SRTP_AES_128_KEY_LEN;
-
-			static bool _isLibSrtpInitialised = false;
-
-			srtp_t * _session{ nullptr };
-			System::String^ _key;
+			SrtpNative* _native{ nullptr };
 	};
 }
\ No newline at end of file
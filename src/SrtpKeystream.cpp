@@ -0,0 +1,1273 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpKeystream.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "SrtpKeystream.h"
+#include "MediaLog.h"
+#include "MediaScheduler.h"
+#include "SrtpMultiBuffer.h"
+#include "srtp2/srtp.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <memory>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    const int AES_BLOCK_LENGTH = 16;
+    const int AUTH_TAG_LENGTH = 10;
+    const int ROC_LENGTH = 4;
+    const int HMAC_BLOCK_LENGTH = 64;
+    const int RTP_HEADER_LENGTH = 12;
+    const uint64_t MAX_INDEX = (1ULL << 48) - 1;
+
+    // The key derivation labels (RFC3711 4.3.1 and 4.3.2).
+    const uint8_t LABEL_RTP_ENCRYPTION = 0x00;
+    const uint8_t LABEL_RTP_AUTH = 0x01;
+    const uint8_t LABEL_RTP_SALT = 0x02;
+    const uint8_t LABEL_RTCP_ENCRYPTION = 0x03;
+    const uint8_t LABEL_RTCP_AUTH = 0x04;
+    const uint8_t LABEL_RTCP_SALT = 0x05;
+
+    // A cache slot's tag is free, busy while one side is using it, or the packet index
+    // plus one once its keystream is ready.
+    const uint64_t SLOT_FREE = 0;
+    const uint64_t SLOT_BUSY = ~0ULL;
+
+    /**
+    * A ready slot's tag, the generation of the keys it was computed with above the 48
+    * bit index, so keystream cached before a rekey is never used after it.
+    */
+    uint64_t ReadyTag(uint64_t generation, uint64_t index)
+    {
+      return (((generation % 0x7fff) << 48) | index) + 1;
+    }
+
+    /**
+    * The counter block for a packet (RFC3711 4.1.1), the salt XORed with the SSRC and
+    * the packet index and the block counter in the last two bytes.
+    */
+    void MakeIv(const uint8_t* salt, uint32_t ssrc, uint64_t index, uint16_t counter, uint8_t* iv)
+    {
+      memcpy(iv, salt, SrtpSessionKeys::MASTER_SALT_LENGTH);
+      iv[14] = (uint8_t)(counter >> 8);
+      iv[15] = (uint8_t)counter;
+
+      for (int i = 0; i < 4; i++) {
+        iv[4 + i] ^= (uint8_t)(ssrc >> (24 - 8 * i));
+      }
+      for (int i = 0; i < 6; i++) {
+        iv[8 + i] ^= (uint8_t)(index >> (40 - 8 * i));
+      }
+    }
+
+    /**
+    * XORs the AES counter mode keystream starting at a counter block into a buffer,
+    * or writes the keystream itself if in is a buffer of zeros.
+    */
+    int AesCtr(EVP_CIPHER_CTX* ctx, const uint8_t* iv, const uint8_t* in, uint8_t* out, int length)
+    {
+      int outLength = 0;
+      if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1 ||
+        EVP_EncryptUpdate(ctx, out, &outLength, in, length) != 1) {
+        return -1;
+      }
+      return 0;
+    }
+
+    EVP_CIPHER_CTX* NewAesCtr(const uint8_t* key)
+    {
+      EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+      if (ctx != nullptr && EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, key, nullptr) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return nullptr;
+      }
+      return ctx;
+    }
+
+    /**
+    * The AES-CM pseudo random function of the key derivation (RFC3711 4.3.3).
+    */
+    int DeriveKey(EVP_CIPHER_CTX* ctx, const uint8_t* masterSalt, uint8_t label, uint8_t* out, int length)
+    {
+      uint8_t iv[AES_BLOCK_LENGTH] = {};
+      memcpy(iv, masterSalt, SrtpSessionKeys::MASTER_SALT_LENGTH);
+      iv[7] ^= label;
+
+      uint8_t zeros[32] = {};
+      return AesCtr(ctx, iv, zeros, out, length);
+    }
+
+    /**
+    * XORs the keystream into a buffer a word at a time.
+    */
+    void XorKeystream(uint8_t* buffer, const uint8_t* keystream, int length)
+    {
+      int i = 0;
+      for (; i + 8 <= length; i += 8) {
+        uint64_t word, key;
+        memcpy(&word, buffer + i, 8);
+        memcpy(&key, keystream + i, 8);
+        word ^= key;
+        memcpy(buffer + i, &word, 8);
+      }
+      for (; i < length; i++) {
+        buffer[i] ^= keystream[i];
+      }
+    }
+
+    uint32_t ReadUint32(const uint8_t* buffer)
+    {
+      return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+    }
+
+
+    /**
+    * Gets the length of an RTP packet's header, the fixed header, the CSRCs and any
+    * header extension, none of which are encrypted.
+    * @@Returns: the header length or -1 if the packet is too short or not RTP.
+    */
+    int GetHeaderLength(const uint8_t* buffer, int length)
+    {
+      if (buffer == nullptr || length < RTP_HEADER_LENGTH || (buffer[0] >> 6) != 2) {
+        return -1;
+      }
+
+      int headerLength = RTP_HEADER_LENGTH + 4 * (buffer[0] & 0x0f);
+      if ((buffer[0] & 0x10) != 0) {
+        if (headerLength + 4 > length) {
+          return -1;
+        }
+        headerLength += 4 + 4 * (((int)buffer[headerLength + 2] << 8) | buffer[headerLength + 3]);
+      }
+      return (headerLength <= length) ? headerLength : -1;
+    }
+
+    void WriteRoc(uint8_t* buffer, uint64_t index)
+    {
+      uint32_t roc = (uint32_t)(index >> 16);
+      buffer[0] = (uint8_t)(roc >> 24);
+      buffer[1] = (uint8_t)(roc >> 16);
+      buffer[2] = (uint8_t)(roc >> 8);
+      buffer[3] = (uint8_t)roc;
+    }
+
+    /**
+    * A stream's highest index and which of the indices below it have been seen, up to
+    * 128 of them.
+    */
+    struct ReplayWindow
+    {
+      bool HasIndex = false;
+      uint64_t HighestIndex = 0;
+      uint64_t Bits[2] = {};              // Bit n set if HighestIndex - n has been seen.
+
+      /**
+      * Estimates a packet's index from its sequence number and the highest index seen
+      * (RFC3711 3.3.1).
+      * @@Returns: false if the index is before the first rollover.
+      */
+      bool EstimateIndex(uint16_t seq, uint64_t* index) const
+      {
+        if (!HasIndex) {
+          *index = seq;
+          return true;
+        }
+
+        int64_t roc = (int64_t)(HighestIndex >> 16);
+        uint16_t highestSeq = (uint16_t)HighestIndex;
+        if (highestSeq < 32768) {
+          if (seq > highestSeq && seq - highestSeq > 32768) {
+            roc--;
+          }
+        }
+        else if (highestSeq - 32768 > seq) {
+          roc++;
+        }
+
+        if (roc < 0) {
+          return false;
+        }
+        *index = ((uint64_t)roc << 16) | seq;
+        return true;
+      }
+
+      /**
+      * @@Returns: true if the index hasn't been seen and isn't too far behind the highest.
+      */
+      bool Check(uint64_t index, int windowSize) const
+      {
+        if (index > MAX_INDEX) {
+          return false;
+        }
+        if (!HasIndex || index > HighestIndex) {
+          return true;
+        }
+
+        uint64_t delta = HighestIndex - index;
+        return delta < (uint64_t)windowSize && (Bits[delta / 64] & (1ULL << (delta % 64))) == 0;
+      }
+
+      /**
+      * Records a checked index.
+      */
+      void Record(uint64_t index)
+      {
+        if (!HasIndex || index > HighestIndex) {
+          uint64_t shift = HasIndex ? index - HighestIndex : 128;
+          if (shift >= 128) {
+            Bits[0] = 0;
+            Bits[1] = 0;
+          }
+          else if (shift >= 64) {
+            Bits[1] = Bits[0] << (shift - 64);
+            Bits[0] = 0;
+          }
+          else if (shift > 0) {
+            Bits[1] = (Bits[1] << shift) | (Bits[0] >> (64 - shift));
+            Bits[0] <<= shift;
+          }
+          Bits[0] |= 1;
+          HighestIndex = index;
+          HasIndex = true;
+          return;
+        }
+
+        uint64_t delta = HighestIndex - index;
+        Bits[delta / 64] |= 1ULL << (delta % 64);
+      }
+    };
+
+    /**
+    * The keys and contexts for one direction of AES_CM_128_HMAC_SHA1_80.
+    */
+    struct RtpTransform
+    {
+      SrtpSessionKeys Keys{};
+      EVP_CIPHER_CTX* Cipher = nullptr;
+
+      // HMAC-SHA1 with the inner and outer padded keys hashed once, each packet starts
+      // from copies of the two states.
+      const EVP_MD* Sha1 = nullptr;
+      EVP_MD_CTX* InnerPad = nullptr;
+      EVP_MD_CTX* OuterPad = nullptr;
+      EVP_MD_CTX* Digest = nullptr;
+
+      // Set if batches can use the multi-buffer kernels.
+      bool IsMultiBuffer = false;
+      SrtpLaneKeys LaneKeys{};
+
+      // The MKI that names the master key on the wire, if the session uses one.
+      uint8_t Mki[SrtpKeystreamSender::MAX_MKI_LENGTH] = {};
+
+      ~RtpTransform()
+      {
+        EVP_CIPHER_CTX_free(Cipher);
+        EVP_MD_CTX_free(InnerPad);
+        EVP_MD_CTX_free(OuterPad);
+        EVP_MD_CTX_free(Digest);
+        Keys.Cleanse();
+        OPENSSL_cleanse(&LaneKeys, sizeof(LaneKeys));
+      }
+
+      int Init(const uint8_t* masterKey)
+      {
+        if (SrtpSessionKeys::Derive(masterKey, false, Keys) != 0) {
+          SIPSM_LOG_ERROR("Failed to derive the SRTP session keys.");
+          return srtp_err_status_fail;
+        }
+
+        Cipher = NewAesCtr(Keys.EncryptionKey);
+        Sha1 = EVP_sha1();
+        InnerPad = EVP_MD_CTX_new();
+        OuterPad = EVP_MD_CTX_new();
+        Digest = EVP_MD_CTX_new();
+
+        uint8_t innerPad[HMAC_BLOCK_LENGTH];
+        uint8_t outerPad[HMAC_BLOCK_LENGTH];
+        memset(innerPad, 0x36, sizeof(innerPad));
+        memset(outerPad, 0x5c, sizeof(outerPad));
+        for (int i = 0; i < SrtpSessionKeys::AUTH_KEY_LENGTH; i++) {
+          innerPad[i] ^= Keys.AuthKey[i];
+          outerPad[i] ^= Keys.AuthKey[i];
+        }
+
+        bool isMacReady = Sha1 != nullptr && InnerPad != nullptr && OuterPad != nullptr && Digest != nullptr &&
+          EVP_DigestInit_ex(InnerPad, Sha1, nullptr) == 1 && EVP_DigestUpdate(InnerPad, innerPad, sizeof(innerPad)) == 1 &&
+          EVP_DigestInit_ex(OuterPad, Sha1, nullptr) == 1 && EVP_DigestUpdate(OuterPad, outerPad, sizeof(outerPad)) == 1;
+        OPENSSL_cleanse(innerPad, sizeof(innerPad));
+        OPENSSL_cleanse(outerPad, sizeof(outerPad));
+
+        if (Cipher == nullptr || !isMacReady) {
+          SIPSM_LOG_ERROR("Failed to create the OpenSSL contexts for SRTP.");
+          return srtp_err_status_fail;
+        }
+
+        IsMultiBuffer = SrtpMultiBuffer::IsSupported();
+        if (IsMultiBuffer) {
+          SrtpMultiBuffer::ExpandKeys(Keys, LaneKeys);
+        }
+        return srtp_err_status_ok;
+      }
+
+      int Encrypt(uint32_t ssrc, uint64_t index, int offset, uint8_t* data, int length)
+      {
+        uint8_t iv[AES_BLOCK_LENGTH];
+        MakeIv(Keys.Salt, ssrc, index, (uint16_t)(offset / AES_BLOCK_LENGTH), iv);
+        return AesCtr(Cipher, iv, data, data, length);
+      }
+
+      /**
+      * Computes the full 20 byte HMAC.
+      */
+      int Authenticate(const uint8_t* data, int length, uint8_t* tag)
+      {
+        unsigned int tagLength = 0;
+        if (EVP_MD_CTX_copy_ex(Digest, InnerPad) != 1 ||
+          EVP_DigestUpdate(Digest, data, (size_t)length) != 1 ||
+          EVP_DigestFinal_ex(Digest, tag, &tagLength) != 1 ||
+          EVP_MD_CTX_copy_ex(Digest, OuterPad) != 1 ||
+          EVP_DigestUpdate(Digest, tag, tagLength) != 1 ||
+          EVP_DigestFinal_ex(Digest, tag, &tagLength) != 1) {
+          return -1;
+        }
+        return 0;
+      }
+
+      void SetCipherLane(SrtpCipherLane& lane, uint32_t ssrc, uint64_t index, int offset, uint8_t* data, int length) const
+      {
+        lane.Keys = &LaneKeys;
+        MakeIv(Keys.Salt, ssrc, index, (uint16_t)(offset / AES_BLOCK_LENGTH), lane.Counter);
+        lane.Data = data;
+        lane.Length = length;
+      }
+    };
+
+    /**
+    * A sender's keys for one master key.
+    */
+    struct SenderKeys
+    {
+      RtpTransform Transform;
+      EVP_CIPHER_CTX* PrecomputeCipher = nullptr;   // The precompute's own context as it runs on another thread.
+      uint64_t Generation = 0;
+
+      ~SenderKeys()
+      {
+        EVP_CIPHER_CTX_free(PrecomputeCipher);
+      }
+
+      int Init(const uint8_t* masterKey, const uint8_t* mki, int mkiLength, uint64_t generation)
+      {
+        int err = Transform.Init(masterKey);
+        if (err != srtp_err_status_ok) {
+          return err;
+        }
+
+        PrecomputeCipher = NewAesCtr(Transform.Keys.EncryptionKey);
+        if (PrecomputeCipher == nullptr) {
+          SIPSM_LOG_ERROR("Failed to create the OpenSSL contexts for SRTP.");
+          return srtp_err_status_fail;
+        }
+
+        memcpy(Transform.Mki, mki, mkiLength);
+        Generation = generation;
+        return srtp_err_status_ok;
+      }
+    };
+
+    struct Slot
+    {
+      std::atomic<uint64_t> Tag{ SLOT_FREE };
+      uint8_t* Keystream = nullptr;
+    };
+
+    struct Stream
+    {
+      uint32_t Ssrc = 0;
+      ReplayWindow Replay;
+
+      // The cache, only for the first MAX_STREAMS streams. The precompute fills it from
+      // NextIndex, published by the sender, up to PacketCount packets ahead.
+      std::unique_ptr<Slot[]> Slots;
+      std::atomic<uint64_t> NextIndex{ 0 };
+      std::atomic<uint64_t> PrecomputedTo{ 0 };
+    };
+
+    struct ReceiveStream
+    {
+      uint32_t Ssrc = 0;
+      ReplayWindow Replay;
+    };
+
+    /**
+    * A packet between the checks and the crypto.
+    */
+    struct PendingPacket
+    {
+      RtpTransform* Transform;            // The keys the packet is protected with.
+      uint32_t Ssrc;
+      uint64_t Index;
+      uint8_t* Payload;
+      int PayloadLength;
+      int Encrypted;                      // Payload bytes already XORed with cached keystream.
+      int AuthLength;                     // The bytes the tag covers, including the ROC.
+      uint8_t Tag[EVP_MAX_MD_SIZE];
+      uint8_t ReceivedTag[AUTH_TAG_LENGTH];
+      uint8_t Overwritten[ROC_LENGTH];    // Receiver, the bytes the ROC was written over.
+    };
+  }
+
+  int SrtpSessionKeys::Derive(const uint8_t* masterKey, bool isRtcp, SrtpSessionKeys& keys)
+  {
+    EVP_CIPHER_CTX* ctx = NewAesCtr(masterKey);
+    if (ctx == nullptr) {
+      return -1;
+    }
+
+    const uint8_t* masterSalt = masterKey + MASTER_KEY_LENGTH;
+    int result = 0;
+    if (DeriveKey(ctx, masterSalt, isRtcp ? LABEL_RTCP_ENCRYPTION : LABEL_RTP_ENCRYPTION, keys.EncryptionKey, MASTER_KEY_LENGTH) != 0 ||
+      DeriveKey(ctx, masterSalt, isRtcp ? LABEL_RTCP_AUTH : LABEL_RTP_AUTH, keys.AuthKey, AUTH_KEY_LENGTH) != 0 ||
+      DeriveKey(ctx, masterSalt, isRtcp ? LABEL_RTCP_SALT : LABEL_RTP_SALT, keys.Salt, MASTER_SALT_LENGTH) != 0) {
+      result = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return result;
+  }
+
+  void SrtpSessionKeys::Cleanse()
+  {
+    OPENSSL_cleanse(this, sizeof(SrtpSessionKeys));
+  }
+
+  struct SrtpKeystreamSender::Impl
+  {
+    SrtpKeystreamSender& Owner;
+    int PacketCount = 0;
+    int KeystreamLength = 0;
+    MediaScheduler* Scheduler = nullptr;
+    bool IsMultiBuffer = false;
+    int MkiLength = 0;
+    uint8_t Mki[MAX_MKI_LENGTH] = {};
+
+    // The current keys are swapped by the protecting thread and read by the precompute.
+    // Keys from Rekey wait in PendingKeys until the next packet, and the keys replaced
+    // are freed once no precompute can be using them.
+    std::atomic<SenderKeys*> Keys{ nullptr };
+    std::atomic<SenderKeys*> PendingKeys{ nullptr };
+    std::vector<SenderKeys*> RetiredKeys;
+    std::atomic<uint64_t> NextGeneration{ 0 };
+    std::atomic<bool> IsPrecomputing{ false };
+
+    std::vector<std::unique_ptr<Stream>> Streams;
+    std::atomic<Stream*> Cached[MAX_STREAMS];
+    std::vector<uint8_t> KeystreamMemory;
+    std::vector<uint8_t> Zeros;
+
+    std::atomic<bool> IsPrecomputePending{ false };
+
+    std::atomic<uint64_t> Protected{ 0 };
+    std::atomic<uint64_t> BatchedPackets{ 0 };
+    std::atomic<uint64_t> KeystreamHits{ 0 };
+    std::atomic<uint64_t> KeystreamMisses{ 0 };
+    std::atomic<uint64_t> PacketsPrecomputed{ 0 };
+    std::atomic<uint64_t> PrecomputeRuns{ 0 };
+    std::atomic<uint64_t> ReplayFailures{ 0 };
+    std::atomic<uint64_t> Rekeys{ 0 };
+
+    explicit Impl(SrtpKeystreamSender& owner) : Owner(owner)
+    {
+      for (std::atomic<Stream*>& cached : Cached) {
+        cached.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    ~Impl()
+    {
+      delete Keys.load(std::memory_order_relaxed);
+      delete PendingKeys.load(std::memory_order_relaxed);
+      for (SenderKeys* keys : RetiredKeys) {
+        delete keys;
+      }
+      if (!KeystreamMemory.empty()) {
+        OPENSSL_cleanse(KeystreamMemory.data(), KeystreamMemory.size());
+      }
+    }
+
+    Stream* GetStream(uint32_t ssrc)
+    {
+      for (std::unique_ptr<Stream>& stream : Streams) {
+        if (stream->Ssrc == ssrc) {
+          return stream.get();
+        }
+      }
+
+      Stream* stream = new Stream();
+      stream->Ssrc = ssrc;
+      int cacheIndex = (int)Streams.size();
+      Streams.emplace_back(stream);
+
+      if (PacketCount > 0 && cacheIndex < MAX_STREAMS) {
+        stream->Slots.reset(new Slot[PacketCount]);
+        for (int i = 0; i < PacketCount; i++) {
+          stream->Slots[i].Keystream = KeystreamMemory.data() + ((size_t)cacheIndex * PacketCount + i) * KeystreamLength;
+        }
+        Cached[cacheIndex].store(stream, std::memory_order_release);
+      }
+      return stream;
+    }
+
+    /**
+    * Frees the keys replaced by a rekey if no precompute is running. Called before each
+    * packet or batch, so the keys a batch's packets hold stay valid until it is done.
+    */
+    void Begin()
+    {
+      // The precompute flags itself before it reads Keys, and the new keys were stored
+      // before this check, so a precompute that isn't running yet will see them.
+      if (!RetiredKeys.empty() && !IsPrecomputing.load(std::memory_order_seq_cst)) {
+        for (SenderKeys* keys : RetiredKeys) {
+          delete keys;
+        }
+        RetiredKeys.clear();
+      }
+    }
+
+    /**
+    * Gets the keys to protect with, first switching to any keys from Rekey.
+    */
+    SenderKeys* CurrentKeys()
+    {
+      SenderKeys* keys = Keys.load(std::memory_order_relaxed);
+      if (PendingKeys.load(std::memory_order_relaxed) == nullptr) {
+        return keys;
+      }
+
+      SenderKeys* next = PendingKeys.exchange(nullptr, std::memory_order_acquire);
+      if (next == nullptr) {
+        return keys;
+      }
+
+      Keys.store(next, std::memory_order_seq_cst);
+      RetiredKeys.push_back(keys);
+      Rekeys.fetch_add(1, std::memory_order_relaxed);
+
+      // The cached keystream is for the old key, have it computed again.
+      for (std::unique_ptr<Stream>& stream : Streams) {
+        stream->PrecomputedTo.store(0, std::memory_order_relaxed);
+      }
+      return next;
+    }
+
+    /**
+    * Checks and records a packet's index, XORs in any cached keystream and puts the
+    * ROC where the tag goes, leaving the rest of the encryption and the tag.
+    */
+    int Prepare(uint8_t* buffer, int length, PendingPacket& packet)
+    {
+      SenderKeys* keys = CurrentKeys();
+      int headerLength = (keys != nullptr) ? GetHeaderLength(buffer, length) : -1;
+      if (headerLength < 0) {
+        return srtp_err_status_bad_param;
+      }
+      packet.Transform = &keys->Transform;
+
+      uint16_t seq = (uint16_t)(((int)buffer[2] << 8) | buffer[3]);
+      packet.Ssrc = ReadUint32(buffer + 8);
+      Stream* stream = GetStream(packet.Ssrc);
+
+      if (!stream->Replay.EstimateIndex(seq, &packet.Index) || !stream->Replay.Check(packet.Index, REPLAY_WINDOW_SIZE)) {
+        ReplayFailures.fetch_add(1, std::memory_order_relaxed);
+        return srtp_err_status_replay_fail;
+      }
+      stream->Replay.Record(packet.Index);
+
+      packet.Payload = buffer + headerLength;
+      packet.PayloadLength = length - headerLength;
+      packet.Encrypted = 0;
+
+      if (stream->Slots) {
+        Slot& slot = stream->Slots[packet.Index % PacketCount];
+        uint64_t ready = ReadyTag(keys->Generation, packet.Index);
+        if (slot.Tag.compare_exchange_strong(ready, SLOT_BUSY, std::memory_order_acquire)) {
+          packet.Encrypted = (packet.PayloadLength < KeystreamLength) ? packet.PayloadLength : KeystreamLength;
+          XorKeystream(packet.Payload, slot.Keystream, packet.Encrypted);
+          slot.Tag.store(SLOT_FREE, std::memory_order_release);
+          KeystreamHits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+          KeystreamMisses.fetch_add(1, std::memory_order_relaxed);
+        }
+        stream->NextIndex.store(stream->Replay.HighestIndex + 1, std::memory_order_release);
+        SchedulePrecompute(*stream, packet.Index);
+      }
+
+      // The tag covers the packet and the rollover counter (RFC3711 4.2), which is put
+      // where the tag goes and then overwritten.
+      WriteRoc(buffer + length, packet.Index);
+      packet.AuthLength = length + ROC_LENGTH;
+      return srtp_err_status_ok;
+    }
+
+    void Finish(uint8_t* buffer, int length, const PendingPacket& packet, int* outLength)
+    {
+      // The MKI goes between the packet and the tag (RFC3711 3.1).
+      memcpy(buffer + length, packet.Transform->Mki, MkiLength);
+      memcpy(buffer + length + MkiLength, packet.Tag, AUTH_TAG_LENGTH);
+      *outLength = length + MkiLength + AUTH_TAG_LENGTH;
+      Protected.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void RunPrecompute(void* context)
+    {
+      Impl* impl = static_cast<Impl*>(context);
+      impl->Owner.Precompute();
+      impl->IsPrecomputePending.store(false, std::memory_order_release);
+    }
+
+    /**
+    * Queues a precompute once a stream's cache is half used.
+    */
+    void SchedulePrecompute(const Stream& stream, uint64_t index)
+    {
+      if (Scheduler == nullptr ||
+        stream.PrecomputedTo.load(std::memory_order_relaxed) > index + PacketCount / 2 ||
+        IsPrecomputePending.exchange(true, std::memory_order_acq_rel)) {
+        return;
+      }
+
+      if (Scheduler->Submit(RunPrecompute, this, TaskPriority::Background) != 0) {
+        IsPrecomputePending.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  SrtpKeystreamSender::SrtpKeystreamSender() :
+    _impl(new Impl(*this))
+  { }
+
+  SrtpKeystreamSender::~SrtpKeystreamSender()
+  {
+    while (_impl->IsPrecomputePending.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    delete _impl;
+  }
+
+  int SrtpKeystreamSender::Init(const uint8_t* masterKey, int packetCount, int keystreamLength, MediaScheduler* scheduler)
+  {
+    if (masterKey == nullptr || packetCount < 0 || keystreamLength <= 0 || _impl->Keys.load() != nullptr) {
+      return srtp_err_status_bad_param;
+    }
+
+    std::unique_ptr<SenderKeys> keys(new SenderKeys());
+    int err = keys->Init(masterKey, _impl->Mki, _impl->MkiLength, _impl->NextGeneration.fetch_add(1));
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+    _impl->IsMultiBuffer = keys->Transform.IsMultiBuffer;
+    _impl->Keys.store(keys.release());
+
+    _impl->PacketCount = packetCount;
+    _impl->KeystreamLength = (keystreamLength + AES_BLOCK_LENGTH - 1) / AES_BLOCK_LENGTH * AES_BLOCK_LENGTH;
+    _impl->Scheduler = scheduler;
+    if (packetCount > 0) {
+      _impl->KeystreamMemory.resize((size_t)MAX_STREAMS * packetCount * _impl->KeystreamLength);
+      _impl->Zeros.resize(_impl->KeystreamLength);
+    }
+
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamSender::SetMki(const uint8_t* mki, int mkiLength)
+  {
+    if (mki == nullptr || mkiLength <= 0 || mkiLength > MAX_MKI_LENGTH || _impl->Keys.load() != nullptr) {
+      return srtp_err_status_bad_param;
+    }
+
+    memcpy(_impl->Mki, mki, mkiLength);
+    _impl->MkiLength = mkiLength;
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamSender::Rekey(const uint8_t* masterKey, const uint8_t* mki)
+  {
+    if (masterKey == nullptr || mki == nullptr || _impl->MkiLength == 0 || _impl->Keys.load() == nullptr) {
+      return srtp_err_status_bad_param;
+    }
+
+    std::unique_ptr<SenderKeys> keys(new SenderKeys());
+    int err = keys->Init(masterKey, mki, _impl->MkiLength, _impl->NextGeneration.fetch_add(1));
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+
+    // A rekey that hasn't been picked up yet is superseded.
+    delete _impl->PendingKeys.exchange(keys.release(), std::memory_order_acq_rel);
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamSender::Protect(uint8_t* buffer, int length, int* outLength)
+  {
+    *outLength = length;
+    _impl->Begin();
+
+    PendingPacket packet;
+    int err = _impl->Prepare(buffer, length, packet);
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+
+    RtpTransform& transform = *packet.Transform;
+    if (packet.Encrypted < packet.PayloadLength &&
+      transform.Encrypt(packet.Ssrc, packet.Index, packet.Encrypted, packet.Payload + packet.Encrypted, packet.PayloadLength - packet.Encrypted) != 0) {
+      return srtp_err_status_cipher_fail;
+    }
+
+    if (transform.Authenticate(buffer, packet.AuthLength, packet.Tag) != 0) {
+      return srtp_err_status_auth_fail;
+    }
+
+    _impl->Finish(buffer, length, packet, outLength);
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamSender::ProtectBatch(SrtpBatchPacket* packets, int count)
+  {
+    SrtpKeystreamSender* senders[SrtpMultiBuffer::MAX_LANES];
+    for (int i = 0; i < SrtpMultiBuffer::MAX_LANES; i++) {
+      senders[i] = this;
+    }
+
+    int protectedCount = 0;
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      protectedCount += ProtectBatch(senders, packets + start, chunk);
+    }
+    return protectedCount;
+  }
+
+  int SrtpKeystreamSender::ProtectBatch(SrtpKeystreamSender* const* senders, SrtpBatchPacket* packets, int count)
+  {
+    int protectedCount = 0;
+
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+
+      PendingPacket pending[SrtpMultiBuffer::MAX_LANES];
+      SrtpCipherLane cipherLanes[SrtpMultiBuffer::MAX_LANES];
+      SrtpAuthLane authLanes[SrtpMultiBuffer::MAX_LANES];
+      int lanePackets[SrtpMultiBuffer::MAX_LANES];
+      int cipherCount = 0;
+      int authCount = 0;
+
+      for (int i = 0; i < chunk; i++) {
+        senders[start + i]->_impl->Begin();
+      }
+
+      for (int i = 0; i < chunk; i++) {
+        SrtpBatchPacket& batchPacket = packets[start + i];
+        Impl* impl = senders[start + i]->_impl;
+        batchPacket.OutLength = batchPacket.Length;
+
+        if (!impl->IsMultiBuffer) {
+          batchPacket.Status = senders[start + i]->Protect(batchPacket.Buffer, batchPacket.Length, &batchPacket.OutLength);
+          protectedCount += (batchPacket.Status == srtp_err_status_ok) ? 1 : 0;
+          continue;
+        }
+
+        PendingPacket& packet = pending[i];
+        batchPacket.Status = impl->Prepare(batchPacket.Buffer, batchPacket.Length, packet);
+        if (batchPacket.Status != srtp_err_status_ok) {
+          continue;
+        }
+
+        if (packet.Encrypted < packet.PayloadLength) {
+          packet.Transform->SetCipherLane(cipherLanes[cipherCount++], packet.Ssrc, packet.Index, packet.Encrypted,
+            packet.Payload + packet.Encrypted, packet.PayloadLength - packet.Encrypted);
+        }
+
+        SrtpAuthLane& authLane = authLanes[authCount];
+        authLane.Keys = &packet.Transform->LaneKeys;
+        authLane.Data = batchPacket.Buffer;
+        authLane.Length = packet.AuthLength;
+        authLane.Tag = packet.Tag;
+        lanePackets[authCount++] = i;
+      }
+
+      // The payloads are encrypted before the tags are computed over them.
+      if (cipherCount > 0) {
+        SrtpMultiBuffer::AesCtr(cipherLanes, cipherCount);
+      }
+      if (authCount > 0) {
+        SrtpMultiBuffer::HmacSha1(authLanes, authCount);
+      }
+
+      for (int lane = 0; lane < authCount; lane++) {
+        int i = lanePackets[lane];
+        SrtpBatchPacket& batchPacket = packets[start + i];
+        Impl* impl = senders[start + i]->_impl;
+        impl->Finish(batchPacket.Buffer, batchPacket.Length, pending[i], &batchPacket.OutLength);
+        impl->BatchedPackets.fetch_add(1, std::memory_order_relaxed);
+        protectedCount++;
+      }
+    }
+
+    return protectedCount;
+  }
+
+  int SrtpKeystreamSender::Precompute()
+  {
+    if (_impl->PacketCount == 0) {
+      return 0;
+    }
+
+    _impl->IsPrecomputing.store(true, std::memory_order_seq_cst);
+    SenderKeys* keys = _impl->Keys.load(std::memory_order_seq_cst);
+    if (keys == nullptr) {
+      _impl->IsPrecomputing.store(false, std::memory_order_release);
+      return 0;
+    }
+
+    _impl->PrecomputeRuns.fetch_add(1, std::memory_order_relaxed);
+
+    int count = 0;
+    uint8_t iv[AES_BLOCK_LENGTH];
+    for (std::atomic<Stream*>& cached : _impl->Cached) {
+      Stream* stream = cached.load(std::memory_order_acquire);
+      if (stream == nullptr) {
+        break;
+      }
+
+      uint64_t next = stream->NextIndex.load(std::memory_order_acquire);
+      uint64_t end = next + _impl->PacketCount;
+      for (uint64_t index = next; index < end && index <= MAX_INDEX; index++) {
+        Slot& slot = stream->Slots[index % _impl->PacketCount];
+
+        // A slot holding an index before next has been passed over and can be reused.
+        uint64_t ready = ReadyTag(keys->Generation, index);
+        uint64_t tag = slot.Tag.load(std::memory_order_acquire);
+        if (tag == ready || tag == SLOT_BUSY ||
+          !slot.Tag.compare_exchange_strong(tag, SLOT_BUSY, std::memory_order_acq_rel)) {
+          continue;
+        }
+
+        MakeIv(keys->Transform.Keys.Salt, stream->Ssrc, index, 0, iv);
+        if (AesCtr(keys->PrecomputeCipher, iv, _impl->Zeros.data(), slot.Keystream, _impl->KeystreamLength) != 0) {
+          slot.Tag.store(SLOT_FREE, std::memory_order_release);
+          continue;
+        }
+        slot.Tag.store(ready, std::memory_order_release);
+        count++;
+      }
+      stream->PrecomputedTo.store(end, std::memory_order_relaxed);
+    }
+
+    _impl->PacketsPrecomputed.fetch_add(count, std::memory_order_relaxed);
+    _impl->IsPrecomputing.store(false, std::memory_order_release);
+    return count;
+  }
+
+  SrtpKeystreamStats SrtpKeystreamSender::GetStats() const
+  {
+    SrtpKeystreamStats stats{};
+    stats.Packets = _impl->Protected.load(std::memory_order_relaxed);
+    stats.BatchedPackets = _impl->BatchedPackets.load(std::memory_order_relaxed);
+    stats.KeystreamHits = _impl->KeystreamHits.load(std::memory_order_relaxed);
+    stats.KeystreamMisses = _impl->KeystreamMisses.load(std::memory_order_relaxed);
+    stats.PacketsPrecomputed = _impl->PacketsPrecomputed.load(std::memory_order_relaxed);
+    stats.PrecomputeRuns = _impl->PrecomputeRuns.load(std::memory_order_relaxed);
+    stats.ReplayFailures = _impl->ReplayFailures.load(std::memory_order_relaxed);
+    stats.Rekeys = _impl->Rekeys.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  struct SrtpKeystreamReceiver::Impl
+  {
+    bool IsMultiBuffer = false;
+    int MkiLength = 0;
+    uint8_t Mki[SrtpKeystreamSender::MAX_MKI_LENGTH] = {};
+    std::atomic<uint64_t> GraceNanoseconds{ DEFAULT_REKEY_GRACE_MILLISECONDS * 1000000ULL };
+
+    // Packets are accepted under the current key, the newest key from Rekey until a
+    // packet under it makes it current, and the previous key until its grace window is
+    // over. Keys that are dropped are freed at the start of the next call.
+    RtpTransform* Current = nullptr;
+    RtpTransform* Next = nullptr;
+    RtpTransform* Previous = nullptr;
+    uint64_t PreviousExpiresAt = 0;
+    std::atomic<RtpTransform*> PendingKeys{ nullptr };
+    std::vector<RtpTransform*> RetiredKeys;
+
+    std::vector<std::unique_ptr<ReceiveStream>> Streams;
+
+    std::atomic<uint64_t> Unprotected{ 0 };
+    std::atomic<uint64_t> BatchedPackets{ 0 };
+    std::atomic<uint64_t> AuthFailures{ 0 };
+    std::atomic<uint64_t> ReplayFailures{ 0 };
+    std::atomic<uint64_t> Rekeys{ 0 };
+    std::atomic<uint64_t> MkiFailures{ 0 };
+
+    ~Impl()
+    {
+      delete Current;
+      delete Next;
+      delete Previous;
+      delete PendingKeys.load(std::memory_order_relaxed);
+      FreeRetiredKeys();
+    }
+
+    void FreeRetiredKeys()
+    {
+      for (RtpTransform* keys : RetiredKeys) {
+        delete keys;
+      }
+      RetiredKeys.clear();
+    }
+
+    /**
+    * Frees the keys dropped by the last call, takes any keys from Rekey and drops the
+    * previous key once its grace window is over. Called before each packet or batch.
+    */
+    void Begin()
+    {
+      FreeRetiredKeys();
+
+      if (PendingKeys.load(std::memory_order_relaxed) != nullptr) {
+        RtpTransform* keys = PendingKeys.exchange(nullptr, std::memory_order_acquire);
+        if (keys != nullptr) {
+          if (Next != nullptr) {
+            RetiredKeys.push_back(Next);
+          }
+          Next = keys;
+        }
+      }
+
+      if (Previous != nullptr && MediaScheduler::NowNanoseconds() >= PreviousExpiresAt) {
+        RetiredKeys.push_back(Previous);
+        Previous = nullptr;
+      }
+    }
+
+    /**
+    * Gets the keys a packet's MKI names.
+    * @@Returns: the keys or nullptr if the MKI matches none of them.
+    */
+    RtpTransform* FindKeys(const uint8_t* mki) const
+    {
+      if (MkiLength == 0) {
+        return Current;
+      }
+
+      RtpTransform* candidates[] = { Current, Next, Previous };
+      for (RtpTransform* keys : candidates) {
+        if (keys != nullptr && memcmp(keys->Mki, mki, MkiLength) == 0) {
+          return keys;
+        }
+      }
+      return nullptr;
+    }
+
+    /**
+    * Makes the newest keys current, the first packet under them has been authenticated.
+    */
+    void PromoteNext()
+    {
+      if (Previous != nullptr) {
+        RetiredKeys.push_back(Previous);
+      }
+      Previous = Current;
+      PreviousExpiresAt = MediaScheduler::NowNanoseconds() + GraceNanoseconds.load(std::memory_order_relaxed);
+      Current = Next;
+      Next = nullptr;
+      Rekeys.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ReceiveStream* FindStream(uint32_t ssrc)
+    {
+      for (std::unique_ptr<ReceiveStream>& stream : Streams) {
+        if (stream->Ssrc == ssrc) {
+          return stream.get();
+        }
+      }
+      return nullptr;
+    }
+
+    /**
+    * Checks a packet's index against the replay window, keeps its tag and puts the ROC
+    * in its place. A stream is only added once a packet has been authenticated.
+    * The index is estimated from the replay window alone, which only authenticated
+    * packets advance, never from unauthenticated packets earlier in a batch.
+    */
+    int Prepare(uint8_t* buffer, int length, PendingPacket& packet)
+    {
+      int authLength = length - MkiLength - AUTH_TAG_LENGTH;
+      int headerLength = (Current != nullptr && authLength >= RTP_HEADER_LENGTH) ? GetHeaderLength(buffer, authLength) : -1;
+      if (headerLength < 0) {
+        return srtp_err_status_bad_param;
+      }
+
+      packet.Transform = FindKeys(buffer + authLength);
+      if (packet.Transform == nullptr) {
+        MkiFailures.fetch_add(1, std::memory_order_relaxed);
+        return srtp_err_status_bad_mki;
+      }
+
+      uint16_t seq = (uint16_t)(((int)buffer[2] << 8) | buffer[3]);
+      packet.Ssrc = ReadUint32(buffer + 8);
+      ReceiveStream* stream = FindStream(packet.Ssrc);
+      ReplayWindow empty;
+      const ReplayWindow& replay = (stream != nullptr) ? stream->Replay : empty;
+
+      if (!replay.EstimateIndex(seq, &packet.Index) || !replay.Check(packet.Index, REPLAY_WINDOW_SIZE)) {
+        ReplayFailures.fetch_add(1, std::memory_order_relaxed);
+        return srtp_err_status_replay_fail;
+      }
+
+      packet.Payload = buffer + headerLength;
+      packet.PayloadLength = authLength - headerLength;
+      packet.Encrypted = 0;
+
+      memcpy(packet.ReceivedTag, buffer + length - AUTH_TAG_LENGTH, AUTH_TAG_LENGTH);
+      memcpy(packet.Overwritten, buffer + authLength, ROC_LENGTH);
+      WriteRoc(buffer + authLength, packet.Index);
+      packet.AuthLength = authLength + ROC_LENGTH;
+      return srtp_err_status_ok;
+    }
+
+    /**
+    * Compares the tags and records the index. The payload is decrypted after.
+    */
+    int Verify(uint8_t* buffer, int length, const PendingPacket& packet)
+    {
+      int authLength = length - MkiLength - AUTH_TAG_LENGTH;
+      if (CRYPTO_memcmp(packet.Tag, packet.ReceivedTag, AUTH_TAG_LENGTH) != 0) {
+        memcpy(buffer + authLength, packet.Overwritten, ROC_LENGTH);
+        AuthFailures.fetch_add(1, std::memory_order_relaxed);
+        return srtp_err_status_auth_fail;
+      }
+
+      // Checked again as an earlier packet in the same batch may have had the index.
+      ReceiveStream* stream = FindStream(packet.Ssrc);
+      if (stream == nullptr) {
+        stream = new ReceiveStream();
+        stream->Ssrc = packet.Ssrc;
+        Streams.emplace_back(stream);
+      }
+      else if (!stream->Replay.Check(packet.Index, REPLAY_WINDOW_SIZE)) {
+        memcpy(buffer + authLength, packet.Overwritten, ROC_LENGTH);
+        ReplayFailures.fetch_add(1, std::memory_order_relaxed);
+        return srtp_err_status_replay_fail;
+      }
+      stream->Replay.Record(packet.Index);
+
+      if (packet.Transform == Next) {
+        PromoteNext();
+      }
+      return srtp_err_status_ok;
+    }
+  };
+
+  SrtpKeystreamReceiver::SrtpKeystreamReceiver() :
+    _impl(new Impl())
+  { }
+
+  SrtpKeystreamReceiver::~SrtpKeystreamReceiver()
+  {
+    delete _impl;
+  }
+
+  int SrtpKeystreamReceiver::Init(const uint8_t* masterKey)
+  {
+    if (masterKey == nullptr || _impl->Current != nullptr) {
+      return srtp_err_status_bad_param;
+    }
+
+    std::unique_ptr<RtpTransform> keys(new RtpTransform());
+    int err = keys->Init(masterKey);
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+
+    memcpy(keys->Mki, _impl->Mki, _impl->MkiLength);
+    _impl->IsMultiBuffer = keys->IsMultiBuffer;
+    _impl->Current = keys.release();
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamReceiver::SetMki(const uint8_t* mki, int mkiLength)
+  {
+    if (mki == nullptr || mkiLength <= 0 || mkiLength > SrtpKeystreamSender::MAX_MKI_LENGTH || _impl->Current != nullptr) {
+      return srtp_err_status_bad_param;
+    }
+
+    memcpy(_impl->Mki, mki, mkiLength);
+    _impl->MkiLength = mkiLength;
+    return srtp_err_status_ok;
+  }
+
+  void SrtpKeystreamReceiver::SetRekeyGraceWindow(int milliseconds)
+  {
+    _impl->GraceNanoseconds.store((milliseconds > 0) ? (uint64_t)milliseconds * 1000000ULL : 0, std::memory_order_relaxed);
+  }
+
+  int SrtpKeystreamReceiver::Rekey(const uint8_t* masterKey, const uint8_t* mki)
+  {
+    if (masterKey == nullptr || mki == nullptr || _impl->MkiLength == 0) {
+      return srtp_err_status_bad_param;
+    }
+
+    std::unique_ptr<RtpTransform> keys(new RtpTransform());
+    int err = keys->Init(masterKey);
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+    memcpy(keys->Mki, mki, _impl->MkiLength);
+
+    delete _impl->PendingKeys.exchange(keys.release(), std::memory_order_acq_rel);
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamReceiver::Unprotect(uint8_t* buffer, int length, int* outLength)
+  {
+    *outLength = length;
+    _impl->Begin();
+
+    PendingPacket packet;
+    int err = _impl->Prepare(buffer, length, packet);
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+
+    RtpTransform& transform = *packet.Transform;
+    if (transform.Authenticate(buffer, packet.AuthLength, packet.Tag) != 0) {
+      return srtp_err_status_auth_fail;
+    }
+
+    err = _impl->Verify(buffer, length, packet);
+    if (err != srtp_err_status_ok) {
+      return err;
+    }
+
+    if (transform.Encrypt(packet.Ssrc, packet.Index, 0, packet.Payload, packet.PayloadLength) != 0) {
+      return srtp_err_status_cipher_fail;
+    }
+
+    *outLength = length - _impl->MkiLength - AUTH_TAG_LENGTH;
+    _impl->Unprotected.fetch_add(1, std::memory_order_relaxed);
+    return srtp_err_status_ok;
+  }
+
+  int SrtpKeystreamReceiver::UnprotectBatch(SrtpBatchPacket* packets, int count)
+  {
+    SrtpKeystreamReceiver* receivers[SrtpMultiBuffer::MAX_LANES];
+    for (int i = 0; i < SrtpMultiBuffer::MAX_LANES; i++) {
+      receivers[i] = this;
+    }
+
+    int unprotectedCount = 0;
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      unprotectedCount += UnprotectBatch(receivers, packets + start, chunk);
+    }
+    return unprotectedCount;
+  }
+
+  int SrtpKeystreamReceiver::UnprotectBatch(SrtpKeystreamReceiver* const* receivers, SrtpBatchPacket* packets, int count)
+  {
+    int unprotectedCount = 0;
+
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+
+      PendingPacket pending[SrtpMultiBuffer::MAX_LANES];
+      SrtpCipherLane cipherLanes[SrtpMultiBuffer::MAX_LANES];
+      SrtpAuthLane authLanes[SrtpMultiBuffer::MAX_LANES];
+      int lanePackets[SrtpMultiBuffer::MAX_LANES];
+      int cipherCount = 0;
+      int authCount = 0;
+
+      for (int i = 0; i < chunk; i++) {
+        receivers[start + i]->_impl->Begin();
+      }
+
+      for (int i = 0; i < chunk; i++) {
+        SrtpBatchPacket& batchPacket = packets[start + i];
+        Impl* impl = receivers[start + i]->_impl;
+        batchPacket.OutLength = batchPacket.Length;
+
+        if (!impl->IsMultiBuffer) {
+          batchPacket.Status = receivers[start + i]->Unprotect(batchPacket.Buffer, batchPacket.Length, &batchPacket.OutLength);
+          unprotectedCount += (batchPacket.Status == srtp_err_status_ok) ? 1 : 0;
+          continue;
+        }
+
+        PendingPacket& packet = pending[i];
+        batchPacket.Status = impl->Prepare(batchPacket.Buffer, batchPacket.Length, packet);
+        if (batchPacket.Status != srtp_err_status_ok) {
+          continue;
+        }
+
+        SrtpAuthLane& authLane = authLanes[authCount];
+        authLane.Keys = &packet.Transform->LaneKeys;
+        authLane.Data = batchPacket.Buffer;
+        authLane.Length = packet.AuthLength;
+        authLane.Tag = packet.Tag;
+        lanePackets[authCount++] = i;
+      }
+
+      // The tags are checked before anything is decrypted.
+      if (authCount > 0) {
+        SrtpMultiBuffer::HmacSha1(authLanes, authCount);
+      }
+
+      for (int lane = 0; lane < authCount; lane++) {
+        int i = lanePackets[lane];
+        SrtpBatchPacket& batchPacket = packets[start + i];
+        Impl* impl = receivers[start + i]->_impl;
+        PendingPacket& packet = pending[i];
+
+        batchPacket.Status = impl->Verify(batchPacket.Buffer, batchPacket.Length, packet);
+        if (batchPacket.Status == srtp_err_status_ok) {
+          packet.Transform->SetCipherLane(cipherLanes[cipherCount++], packet.Ssrc, packet.Index, 0, packet.Payload, packet.PayloadLength);
+          batchPacket.OutLength = batchPacket.Length - impl->MkiLength - AUTH_TAG_LENGTH;
+          impl->Unprotected.fetch_add(1, std::memory_order_relaxed);
+          impl->BatchedPackets.fetch_add(1, std::memory_order_relaxed);
+          unprotectedCount++;
+        }
+      }
+
+      if (cipherCount > 0) {
+        SrtpMultiBuffer::AesCtr(cipherLanes, cipherCount);
+      }
+    }
+
+    return unprotectedCount;
+  }
+
+  SrtpKeystreamStats SrtpKeystreamReceiver::GetStats() const
+  {
+    SrtpKeystreamStats stats{};
+    stats.Packets = _impl->Unprotected.load(std::memory_order_relaxed);
+    stats.BatchedPackets = _impl->BatchedPackets.load(std::memory_order_relaxed);
+    stats.AuthFailures = _impl->AuthFailures.load(std::memory_order_relaxed);
+    stats.ReplayFailures = _impl->ReplayFailures.load(std::memory_order_relaxed);
+    stats.Rekeys = _impl->Rekeys.load(std::memory_order_relaxed);
+    stats.MkiFailures = _impl->MkiFailures.load(std::memory_order_relaxed);
+    return stats;
+  }
+}
@@ -0,0 +1,287 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpKeystream.h
+//
+// Description: Protects outbound RTP for the default SRTP profile,
+// AES_CM_128_HMAC_SHA1_80, with the AES counter mode keystream for each
+// stream's next packets computed ahead of time. A sender's packets have a
+// fixed SSRC and consecutive indices, and the keystream depends on nothing
+// else (RFC3711 4.1.1), so it can be generated off the send path, for
+// example in the scheduler's Background lane. Protect is then an XOR and
+// the HMAC. A packet whose keystream isn't ready, or the part of a payload
+// longer than the precomputed length, is encrypted inline as before.
+//
+// The session keys are derived from the master key with the RFC3711 key
+// derivation function, and OpenSSL does the AES and HMAC-SHA1. The packets
+// are identical to libsrtp's.
+//
+// Packets can also be protected and unprotected in batches, across streams
+// and sessions, with the blocks of several packets interleaved by the
+// SrtpMultiBuffer kernels.
+//
+// With an MKI (RFC3711 3.1) each packet names its master key, so a session
+// can be rekeyed in place. The new keys are derived on the thread that asks
+// for them and the sending or receiving thread switches over at its next
+// packet. The streams' rollover counters and replay windows carry on across
+// the change, and a receiver accepts the previous key for a grace window so
+// packets still in flight under it aren't lost.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  class MediaScheduler;
+
+  /**
+  * The session keys for one direction of an SRTP session (RFC3711 4.3).
+  */
+  struct SrtpSessionKeys
+  {
+    static const int MASTER_KEY_LENGTH = 16;
+    static const int MASTER_SALT_LENGTH = 14;
+    static const int AUTH_KEY_LENGTH = 20;
+
+    uint8_t EncryptionKey[MASTER_KEY_LENGTH];
+    uint8_t Salt[MASTER_SALT_LENGTH];
+    uint8_t AuthKey[AUTH_KEY_LENGTH];
+
+    /**
+    * Derives the SRTP session keys with a key derivation rate of 0.
+    * @param[in] masterKey: the master key followed by the master salt.
+    * @param[in] isRtcp: true for the SRTCP keys, false for the SRTP ones.
+    * @@Returns: 0 if successful or -1 if the cipher failed.
+    */
+    static int Derive(const uint8_t* masterKey, bool isRtcp, SrtpSessionKeys& keys);
+
+    /**
+    * Overwrites the keys.
+    */
+    void Cleanse();
+  };
+
+  /**
+  * Running totals for a keystream sender or receiver. All fields are plain 64 bit
+  * integers so the structure can be copied straight across the flat C API.
+  */
+  struct SrtpKeystreamStats
+  {
+    uint64_t Packets;               // Packets protected or unprotected.
+    uint64_t BatchedPackets;        // Of those, the ones that went through the multi-buffer kernels.
+    uint64_t KeystreamHits;         // Sender, packets whose keystream was ready.
+    uint64_t KeystreamMisses;       // Sender, packets encrypted inline.
+    uint64_t PacketsPrecomputed;
+    uint64_t PrecomputeRuns;
+    uint64_t AuthFailures;          // Receiver, packets whose tag didn't match.
+    uint64_t ReplayFailures;        // Packets with an index already seen or too old.
+    uint64_t Rekeys;                // Times a new master key came into use.
+    uint64_t MkiFailures;           // Receiver, packets whose MKI matched no key.
+  };
+
+  /**
+  * A packet in a batch to protect or unprotect in place. A packet to protect must
+  * have room for the authentication tag.
+  */
+  struct SrtpBatchPacket
+  {
+    uint8_t* Buffer;
+    int Length;
+    int OutLength;                  // Set to the length of the protected or unprotected packet.
+    int Status;                     // Set to 0 or an srtp_err_status_t value.
+  };
+
+  class SrtpKeystreamSender
+  {
+  public:
+
+    /**
+    * The streams, SSRCs, that get precomputed keystream. Any more are protected with
+    * inline keystream.
+    */
+    static const int MAX_STREAMS = 4;
+
+    /**
+    * The payload bytes of keystream precomputed for each packet, a 20ms Opus or G.711
+    * frame fits.
+    */
+    static const int DEFAULT_KEYSTREAM_LENGTH = 256;
+
+    /**
+    * The number of indices below the highest sent that can still be sent once, the same
+    * as libsrtp's 128 packet window.
+    */
+    static const int REPLAY_WINDOW_SIZE = 128;
+
+    /**
+    * The longest MKI supported.
+    */
+    static const int MAX_MKI_LENGTH = 4;
+
+    SrtpKeystreamSender();
+
+    /**
+    * Waits for a scheduled precompute to finish.
+    */
+    ~SrtpKeystreamSender();
+
+    SrtpKeystreamSender(const SrtpKeystreamSender&) = delete;
+    SrtpKeystreamSender& operator=(const SrtpKeystreamSender&) = delete;
+
+    /**
+    * Derives the session keys and sizes the keystream caches.
+    * @param[in] masterKey: the master key followed by the master salt, 30 bytes.
+    * @param[in] packetCount: the number of packets ahead to precompute keystream for
+    *  on each stream, 0 to always encrypt inline.
+    * @param[in] keystreamLength: the payload bytes of keystream to precompute for each
+    *  packet, rounded up to the AES block size.
+    * @param[in] scheduler: optional, if set the precomputing is queued on the scheduler's
+    *  Background lane as the caches run down, otherwise the owner calls Precompute.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Init(const uint8_t* masterKey, int packetCount, int keystreamLength = DEFAULT_KEYSTREAM_LENGTH,
+      MediaScheduler* scheduler = nullptr);
+
+    /**
+    * Optional, adds an MKI to every packet so the sender can be rekeyed. Must be called
+    * before Init.
+    * @param[in] mki: the MKI of the master key passed to Init.
+    * @param[in] mkiLength: the length of the MKI, at most MAX_MKI_LENGTH. Every key's
+    *  MKI has this length.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int SetMki(const uint8_t* mki, int mkiLength);
+
+    /**
+    * Derives the keys for a new master key, which the packets protected from the next
+    * one on use. Can be called from any thread, the protecting thread only swaps the
+    * keys. The keystream precomputed for the old key is discarded.
+    * @param[in] masterKey: the master key followed by the master salt, 30 bytes.
+    * @param[in] mki: the new key's MKI, the length set by SetMki.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Rekey(const uint8_t* masterKey, const uint8_t* mki);
+
+    /**
+    * Protects an RTP packet in place, see SrtpNative::ProtectRTP. Only one thread may
+    * protect at a time, Precompute can run on another at the same time.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Protect(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Protects a batch of packets, from any of this sender's streams, interleaving them
+    * eight at a time. Each packet's Status is set as Protect would return it. If the
+    * processor doesn't support the kernels the packets are protected one at a time.
+    * @@Returns: the number of packets protected.
+    */
+    int ProtectBatch(SrtpBatchPacket* packets, int count);
+
+    /**
+    * Protects a batch of packets for several senders, for example every session on a
+    * send thread. Packet i is protected by senders[i]. See ProtectBatch.
+    */
+    static int ProtectBatch(SrtpKeystreamSender* const* senders, SrtpBatchPacket* packets, int count);
+
+    /**
+    * Fills each stream's cache with the keystream for its next packets. Safe to call
+    * from any one thread at a time while another protects.
+    * @@Returns: the number of packets whose keystream was computed.
+    */
+    int Precompute();
+
+    SrtpKeystreamStats GetStats() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+
+  /**
+  * Unprotects inbound RTP for AES_CM_128_HMAC_SHA1_80 with the same transform as
+  * SrtpKeystreamSender, a packet or a batch at a time. Streams are added as their
+  * first authenticated packet arrives. Only one thread may unprotect at a time.
+  */
+  class SrtpKeystreamReceiver
+  {
+  public:
+
+    /**
+    * The number of indices below the highest received that are still accepted once,
+    * the same as SrtpNative's libsrtp sessions.
+    */
+    static const int REPLAY_WINDOW_SIZE = 128;
+
+    /**
+    * The time packets under the previous key are still accepted once the first packet
+    * under a new key has arrived.
+    */
+    static const int DEFAULT_REKEY_GRACE_MILLISECONDS = 2000;
+
+    SrtpKeystreamReceiver();
+    ~SrtpKeystreamReceiver();
+
+    SrtpKeystreamReceiver(const SrtpKeystreamReceiver&) = delete;
+    SrtpKeystreamReceiver& operator=(const SrtpKeystreamReceiver&) = delete;
+
+    /**
+    * Derives the session keys.
+    * @param[in] masterKey: the master key followed by the master salt, 30 bytes.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Init(const uint8_t* masterKey);
+
+    /**
+    * Optional, expects an MKI on every packet so the receiver can be rekeyed, see
+    * SrtpKeystreamSender::SetMki. Must be called before Init.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int SetMki(const uint8_t* mki, int mkiLength);
+
+    /**
+    * Sets how long the previous key is accepted for after a rekey.
+    */
+    void SetRekeyGraceWindow(int milliseconds);
+
+    /**
+    * Derives the keys for a new master key, which is accepted alongside the current
+    * one. The first packet authenticated under the new key makes it current, and the
+    * old key is then accepted for the grace window. Only the current, previous and
+    * newest keys are kept. Can be called from any thread, the unprotecting thread only
+    * swaps the keys.
+    * @param[in] masterKey: the master key followed by the master salt, 30 bytes.
+    * @param[in] mki: the new key's MKI, the length set by SetMki.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Rekey(const uint8_t* masterKey, const uint8_t* mki);
+
+    /**
+    * Authenticates and decrypts an SRTP packet in place, see SrtpNative::UnprotectRTP.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not, bad_mki if the
+    *  packet's MKI matches none of the keys.
+    */
+    int Unprotect(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Unprotects a batch of packets, see SrtpKeystreamSender::ProtectBatch. A packet
+    * that fails authentication is left as it was.
+    * @@Returns: the number of packets unprotected.
+    */
+    int UnprotectBatch(SrtpBatchPacket* packets, int count);
+
+    /**
+    * Unprotects a batch of packets for several receivers. Packet i is unprotected by
+    * receivers[i].
+    */
+    static int UnprotectBatch(SrtpKeystreamReceiver* const* receivers, SrtpBatchPacket* packets, int count);
+
+    SrtpKeystreamStats GetStats() const;
+
+  private:
+    struct Impl;
+    Impl* _impl;
+  };
+}
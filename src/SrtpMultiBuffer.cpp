@@ -0,0 +1,458 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpMultiBuffer.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "SrtpMultiBuffer.h"
+#include "SrtpKeystream.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SIPSM_MULTI_BUFFER 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(SIPSM_MULTI_BUFFER) && defined(__GNUC__)
+#define SIPSM_TARGET_CRYPTO __attribute__((target("aes,sha,sse4.1,ssse3")))
+#else
+#define SIPSM_TARGET_CRYPTO
+#endif
+
+namespace SIPSorceryMedia {
+
+#ifdef SIPSM_MULTI_BUFFER
+
+  namespace {
+
+    const int AES_BLOCK_LENGTH = 16;
+    const int AES_ROUNDS = 10;
+    const int SHA1_BLOCK_LENGTH = 64;
+    const int SHA1_DIGEST_LENGTH = 20;
+
+    /**
+    * The blocks of at most this many lanes can be left over from a single packet, the
+    * rest are interleaved.
+    */
+    const int MAX_BLOCKS_IN_FLIGHT = SrtpMultiBuffer::MAX_LANES;
+
+    struct CpuFeatures
+    {
+      bool HasAes;
+      bool HasSse41;
+      bool HasSha;
+    };
+
+    CpuFeatures DetectFeatures()
+    {
+      // CPUID leaf 1 ECX bit 25 is AES-NI and leaf 7 EBX bit 29 is SHA.
+      CpuFeatures features{};
+#ifdef _MSC_VER
+      int regs[4] = {};
+      __cpuid(regs, 0);
+      int maxLeaf = regs[0];
+      __cpuid(regs, 1);
+      features.HasAes = (regs[2] & (1 << 25)) != 0;
+      features.HasSse41 = (regs[2] & (1 << 19)) != 0;
+      if (maxLeaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        features.HasSha = (regs[1] & (1 << 29)) != 0;
+      }
+#else
+      unsigned int regs[4] = {};
+      unsigned int maxLeaf = __get_cpuid_max(0, nullptr);
+      __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+      features.HasAes = (regs[2] & (1u << 25)) != 0;
+      features.HasSse41 = (regs[2] & (1u << 19)) != 0;
+      if (maxLeaf >= 7) {
+        __get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+        features.HasSha = (regs[1] & (1u << 29)) != 0;
+      }
+#endif
+      return features;
+    }
+
+    const CpuFeatures& GetCpuFeatures()
+    {
+      static const CpuFeatures features = DetectFeatures();
+      return features;
+    }
+
+    SIPSM_TARGET_CRYPTO __m128i ExpandStep(__m128i key, __m128i generated)
+    {
+      generated = _mm_shuffle_epi32(generated, 0xff);
+      key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+      key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+      key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+      return _mm_xor_si128(key, generated);
+    }
+
+    SIPSM_TARGET_CRYPTO void ExpandAesKey(const uint8_t* key, uint8_t* roundKeys)
+    {
+      __m128i rk[AES_ROUNDS + 1];
+      rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+      rk[1] = ExpandStep(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+      rk[2] = ExpandStep(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+      rk[3] = ExpandStep(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+      rk[4] = ExpandStep(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+      rk[5] = ExpandStep(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+      rk[6] = ExpandStep(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+      rk[7] = ExpandStep(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+      rk[8] = ExpandStep(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+      rk[9] = ExpandStep(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1b));
+      rk[10] = ExpandStep(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+
+      for (int i = 0; i <= AES_ROUNDS; i++) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(roundKeys + i * AES_BLOCK_LENGTH), rk[i]);
+      }
+    }
+
+    /**
+    * The SHA1 working state of each lane.
+    */
+    template <int Count>
+    struct Sha1LaneState
+    {
+      __m128i Abcd[Count];
+      __m128i Previous[Count];
+      __m128i Schedule[Count][4];
+    };
+
+    /**
+    * Runs one group of four rounds on every lane. Each group takes the next four
+    * message words, the first four groups from the block and the rest from the
+    * schedule. The group is a template argument as the round function is an
+    * immediate, and the lane count so the lanes are unrolled and kept in registers.
+    */
+    template <int Group, int Count>
+    SIPSM_TARGET_CRYPTO inline void Sha1Group(Sha1LaneState<Count>& lanes, const __m128i* eSave, const uint8_t* const* blocks)
+    {
+      const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+      for (int l = 0; l < Count; l++) {
+        __m128i* w = lanes.Schedule[l];
+        __m128i words;
+        if (Group < 4) {
+          words = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks[l] + Group * 16)), byteSwap);
+        }
+        else {
+          words = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w[Group & 3], w[(Group + 1) & 3]), w[(Group + 2) & 3]), w[(Group + 3) & 3]);
+        }
+        w[Group & 3] = words;
+
+        __m128i e = (Group == 0) ? _mm_add_epi32(eSave[l], words) : _mm_sha1nexte_epu32(lanes.Previous[l], words);
+        lanes.Previous[l] = lanes.Abcd[l];
+        lanes.Abcd[l] = _mm_sha1rnds4_epu32(lanes.Abcd[l], e, Group / 5);
+      }
+    }
+
+    /**
+    * Runs the SHA1 compression function on one block for each lane, stepping every
+    * lane through each group of four rounds before the next.
+    */
+    template <int Count>
+    SIPSM_TARGET_CRYPTO void Sha1Compress(uint32_t* const* states, const uint8_t* const* blocks)
+    {
+      Sha1LaneState<Count> lanes;
+      __m128i abcdSave[Count];
+      __m128i eSave[Count];
+
+      for (int l = 0; l < Count; l++) {
+        lanes.Abcd[l] = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(states[l])), 0x1b);
+        abcdSave[l] = lanes.Abcd[l];
+        eSave[l] = _mm_set_epi32((int)states[l][4], 0, 0, 0);
+      }
+
+      Sha1Group<0>(lanes, eSave, blocks);
+      Sha1Group<1>(lanes, eSave, blocks);
+      Sha1Group<2>(lanes, eSave, blocks);
+      Sha1Group<3>(lanes, eSave, blocks);
+      Sha1Group<4>(lanes, eSave, blocks);
+      Sha1Group<5>(lanes, eSave, blocks);
+      Sha1Group<6>(lanes, eSave, blocks);
+      Sha1Group<7>(lanes, eSave, blocks);
+      Sha1Group<8>(lanes, eSave, blocks);
+      Sha1Group<9>(lanes, eSave, blocks);
+      Sha1Group<10>(lanes, eSave, blocks);
+      Sha1Group<11>(lanes, eSave, blocks);
+      Sha1Group<12>(lanes, eSave, blocks);
+      Sha1Group<13>(lanes, eSave, blocks);
+      Sha1Group<14>(lanes, eSave, blocks);
+      Sha1Group<15>(lanes, eSave, blocks);
+      Sha1Group<16>(lanes, eSave, blocks);
+      Sha1Group<17>(lanes, eSave, blocks);
+      Sha1Group<18>(lanes, eSave, blocks);
+      Sha1Group<19>(lanes, eSave, blocks);
+
+      for (int l = 0; l < Count; l++) {
+        __m128i e = _mm_sha1nexte_epu32(lanes.Previous[l], eSave[l]);
+        __m128i abcd = _mm_add_epi32(lanes.Abcd[l], abcdSave[l]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(states[l]), _mm_shuffle_epi32(abcd, 0x1b));
+        states[l][4] = (uint32_t)_mm_extract_epi32(e, 3);
+      }
+    }
+
+    /**
+    * Compresses a block for each of up to MAX_LANES lanes.
+    */
+    void Sha1Compress(uint32_t* const* states, const uint8_t* const* blocks, int count)
+    {
+      switch (count) {
+      case 1: Sha1Compress<1>(states, blocks); break;
+      case 2: Sha1Compress<2>(states, blocks); break;
+      case 3: Sha1Compress<3>(states, blocks); break;
+      case 4: Sha1Compress<4>(states, blocks); break;
+      default:
+        // Past four lanes the state no longer fits in the registers.
+        Sha1Compress<4>(states, blocks);
+        Sha1Compress(states + 4, blocks + 4, count - 4);
+        break;
+      }
+    }
+
+    void HashPad(const uint8_t* key, int keyLength, uint8_t pad, uint32_t* state)
+    {
+      static const uint32_t SHA1_INITIAL_STATE[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+      uint8_t block[SHA1_BLOCK_LENGTH];
+      memset(block, pad, sizeof(block));
+      for (int i = 0; i < keyLength; i++) {
+        block[i] ^= key[i];
+      }
+
+      memcpy(state, SHA1_INITIAL_STATE, sizeof(SHA1_INITIAL_STATE));
+      const uint8_t* blocks[1] = { block };
+      Sha1Compress(&state, blocks, 1);
+      memset(block, 0, sizeof(block));
+    }
+
+    void WriteBigEndian64(uint8_t* buffer, uint64_t value)
+    {
+      for (int i = 0; i < 8; i++) {
+        buffer[i] = (uint8_t)(value >> (56 - 8 * i));
+      }
+    }
+
+    /**
+    * The blocks left of one lane's SHA1 message, the whole blocks of its data then the
+    * last part of the data with the padding.
+    */
+    struct Sha1Message
+    {
+      uint32_t State[5];
+      const uint8_t* Data;
+      int WholeBlocks;
+      int TailBlocks;
+      int Next;
+      uint8_t Tail[2 * SHA1_BLOCK_LENGTH];
+
+      /**
+      * @param[in] prefixLength: the bytes already hashed into the state.
+      */
+      void Init(const uint32_t* state, const uint8_t* data, int length, int prefixLength)
+      {
+        memcpy(State, state, sizeof(State));
+        Data = data;
+        WholeBlocks = length / SHA1_BLOCK_LENGTH;
+        Next = 0;
+
+        int remaining = length % SHA1_BLOCK_LENGTH;
+        TailBlocks = (remaining + 1 + 8 <= SHA1_BLOCK_LENGTH) ? 1 : 2;
+        memset(Tail, 0, TailBlocks * SHA1_BLOCK_LENGTH);
+        memcpy(Tail, data + WholeBlocks * SHA1_BLOCK_LENGTH, remaining);
+        Tail[remaining] = 0x80;
+        WriteBigEndian64(Tail + TailBlocks * SHA1_BLOCK_LENGTH - 8, (uint64_t)(prefixLength + length) * 8);
+      }
+
+      bool IsDone() const { return Next == WholeBlocks + TailBlocks; }
+
+      const uint8_t* NextBlock()
+      {
+        int block = Next++;
+        return (block < WholeBlocks) ? Data + block * SHA1_BLOCK_LENGTH : Tail + (block - WholeBlocks) * SHA1_BLOCK_LENGTH;
+      }
+
+      void WriteDigest(uint8_t* digest) const
+      {
+        for (int i = 0; i < 5; i++) {
+          digest[4 * i] = (uint8_t)(State[i] >> 24);
+          digest[4 * i + 1] = (uint8_t)(State[i] >> 16);
+          digest[4 * i + 2] = (uint8_t)(State[i] >> 8);
+          digest[4 * i + 3] = (uint8_t)State[i];
+        }
+      }
+    };
+
+    /**
+    * Hashes every lane's message, compressing a block of each unfinished lane per step.
+    */
+    void Sha1Lanes(Sha1Message* messages, int count)
+    {
+      uint32_t* states[SrtpMultiBuffer::MAX_LANES];
+      const uint8_t* blocks[SrtpMultiBuffer::MAX_LANES];
+
+      while (true) {
+        int active = 0;
+        for (int l = 0; l < count; l++) {
+          if (!messages[l].IsDone()) {
+            states[active] = messages[l].State;
+            blocks[active] = messages[l].NextBlock();
+            active++;
+          }
+        }
+        if (active == 0) {
+          break;
+        }
+        Sha1Compress(states, blocks, active);
+      }
+    }
+
+    /**
+    * A counter block queued for encryption and the data its keystream is XORed with.
+    */
+    struct PendingBlock
+    {
+      const uint8_t* RoundKeys;
+      __m128i Counter;
+      uint8_t* Data;
+      int Length;
+    };
+
+    /**
+    * Encrypts up to MAX_BLOCKS_IN_FLIGHT counter blocks, each under its own round keys,
+    * a round of every block at a time, and XORs the keystream into their data.
+    */
+    SIPSM_TARGET_CRYPTO void EncryptBlocks(const PendingBlock* blocks, int count)
+    {
+      __m128i state[MAX_BLOCKS_IN_FLIGHT];
+      for (int b = 0; b < count; b++) {
+        state[b] = _mm_xor_si128(blocks[b].Counter, _mm_load_si128(reinterpret_cast<const __m128i*>(blocks[b].RoundKeys)));
+      }
+
+      for (int round = 1; round < AES_ROUNDS; round++) {
+        for (int b = 0; b < count; b++) {
+          state[b] = _mm_aesenc_si128(state[b], _mm_load_si128(reinterpret_cast<const __m128i*>(blocks[b].RoundKeys + round * AES_BLOCK_LENGTH)));
+        }
+      }
+
+      for (int b = 0; b < count; b++) {
+        __m128i keystream = _mm_aesenclast_si128(state[b], _mm_load_si128(reinterpret_cast<const __m128i*>(blocks[b].RoundKeys + AES_ROUNDS * AES_BLOCK_LENGTH)));
+        __m128i* data = reinterpret_cast<__m128i*>(blocks[b].Data);
+
+        if (blocks[b].Length == AES_BLOCK_LENGTH) {
+          _mm_storeu_si128(data, _mm_xor_si128(_mm_loadu_si128(data), keystream));
+        }
+        else {
+          alignas(16) uint8_t tail[AES_BLOCK_LENGTH];
+          _mm_store_si128(reinterpret_cast<__m128i*>(tail), keystream);
+          for (int i = 0; i < blocks[b].Length; i++) {
+            blocks[b].Data[i] ^= tail[i];
+          }
+        }
+      }
+    }
+  }
+
+  bool SrtpMultiBuffer::IsSupported()
+  {
+    const CpuFeatures& features = GetCpuFeatures();
+    return features.HasAes && features.HasSse41 && features.HasSha;
+  }
+
+  bool SrtpMultiBuffer::IsAesNiSupported()
+  {
+    return GetCpuFeatures().HasAes;
+  }
+
+  void SrtpMultiBuffer::ExpandKeys(const SrtpSessionKeys& keys, SrtpLaneKeys& laneKeys)
+  {
+    ExpandAesKey(keys.EncryptionKey, laneKeys.RoundKeys);
+    HashPad(keys.AuthKey, SrtpSessionKeys::AUTH_KEY_LENGTH, 0x36, laneKeys.InnerState);
+    HashPad(keys.AuthKey, SrtpSessionKeys::AUTH_KEY_LENGTH, 0x5c, laneKeys.OuterState);
+  }
+
+  void SrtpMultiBuffer::AesCtr(SrtpCipherLane* lanes, int count)
+  {
+    PendingBlock pending[MAX_BLOCKS_IN_FLIGHT];
+    int pendingCount = 0;
+
+    // The blocks of all the lanes are queued in turn and encrypted a full set at a
+    // time, so a single long packet is interleaved with itself.
+    for (int l = 0; l < count; l++) {
+      SrtpCipherLane& lane = lanes[l];
+      __m128i counter = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lane.Counter));
+      int start = ((int)lane.Counter[14] << 8) | lane.Counter[15];
+
+      for (int offset = 0, block = 0; offset < lane.Length; offset += AES_BLOCK_LENGTH, block++) {
+        uint16_t blockCounter = (uint16_t)(start + block);
+        PendingBlock& pendingBlock = pending[pendingCount];
+        pendingBlock.RoundKeys = lane.Keys->RoundKeys;
+        pendingBlock.Counter = _mm_insert_epi16(counter, (uint16_t)((blockCounter >> 8) | (blockCounter << 8)), 7);
+        pendingBlock.Data = lane.Data + offset;
+        pendingBlock.Length = (lane.Length - offset < AES_BLOCK_LENGTH) ? lane.Length - offset : AES_BLOCK_LENGTH;
+
+        if (++pendingCount == MAX_BLOCKS_IN_FLIGHT) {
+          EncryptBlocks(pending, pendingCount);
+          pendingCount = 0;
+        }
+      }
+    }
+
+    if (pendingCount > 0) {
+      EncryptBlocks(pending, pendingCount);
+    }
+  }
+
+  void SrtpMultiBuffer::HmacSha1(SrtpAuthLane* lanes, int count)
+  {
+    Sha1Message messages[MAX_LANES];
+
+    for (int l = 0; l < count; l++) {
+      messages[l].Init(lanes[l].Keys->InnerState, lanes[l].Data, lanes[l].Length, SHA1_BLOCK_LENGTH);
+    }
+    Sha1Lanes(messages, count);
+
+    uint8_t innerDigests[MAX_LANES][SHA1_DIGEST_LENGTH];
+    for (int l = 0; l < count; l++) {
+      messages[l].WriteDigest(innerDigests[l]);
+      messages[l].Init(lanes[l].Keys->OuterState, innerDigests[l], SHA1_DIGEST_LENGTH, SHA1_BLOCK_LENGTH);
+    }
+    Sha1Lanes(messages, count);
+
+    for (int l = 0; l < count; l++) {
+      messages[l].WriteDigest(lanes[l].Tag);
+    }
+  }
+
+#else
+
+  bool SrtpMultiBuffer::IsSupported()
+  {
+    return false;
+  }
+
+  bool SrtpMultiBuffer::IsAesNiSupported()
+  {
+    return false;
+  }
+
+  void SrtpMultiBuffer::ExpandKeys(const SrtpSessionKeys& keys, SrtpLaneKeys& laneKeys)
+  { }
+
+  void SrtpMultiBuffer::AesCtr(SrtpCipherLane* lanes, int count)
+  { }
+
+  void SrtpMultiBuffer::HmacSha1(SrtpAuthLane* lanes, int count)
+  { }
+
+#endif
+}
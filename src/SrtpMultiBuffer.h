@@ -0,0 +1,99 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpMultiBuffer.h
+//
+// Description: Multi-buffer AES-128 counter mode and HMAC-SHA1 kernels for
+// protecting and unprotecting several SRTP packets at once. The packets of a
+// batch can be from different streams and sessions, each with its own keys.
+// A small packet is only a few AES blocks and one or two SHA1 blocks, and
+// each block depends on the one before it, so a single packet leaves the
+// AES and SHA units idle waiting on latency. The kernels interleave the
+// blocks of up to MAX_LANES packets, so the units always have independent
+// work, using the AES-NI and SHA extensions.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  struct SrtpSessionKeys;
+
+  /**
+  * One direction's keys in the form the kernels use, the expanded AES round keys
+  * and the SHA1 states after hashing the HMAC inner and outer padded keys.
+  */
+  struct SrtpLaneKeys
+  {
+    static const int AES_ROUND_KEYS_LENGTH = 176;
+
+    alignas(16) uint8_t RoundKeys[AES_ROUND_KEYS_LENGTH];
+    uint32_t InnerState[5];
+    uint32_t OuterState[5];
+  };
+
+  /**
+  * A buffer to XOR with AES counter mode keystream.
+  */
+  struct SrtpCipherLane
+  {
+    const SrtpLaneKeys* Keys;
+    uint8_t Counter[16];          // The first counter block, see RFC3711 4.1.1.
+    uint8_t* Data;
+    int Length;
+  };
+
+  /**
+  * A buffer to compute the HMAC-SHA1 of.
+  */
+  struct SrtpAuthLane
+  {
+    const SrtpLaneKeys* Keys;
+    const uint8_t* Data;
+    int Length;
+    uint8_t* Tag;                 // Set to the 20 byte HMAC.
+  };
+
+  class SrtpMultiBuffer
+  {
+  public:
+
+    /**
+    * The number of packets whose blocks are interleaved.
+    */
+    static const int MAX_LANES = 8;
+
+    /**
+    * @@Returns: true if the processor has the AES-NI and SHA extensions. If not the
+    *  kernels must not be called and packets are protected one at a time.
+    */
+    static bool IsSupported();
+
+    /**
+    * @@Returns: true if the processor has AES-NI, which OpenSSL uses for AES.
+    */
+    static bool IsAesNiSupported();
+
+    /**
+    * Expands a direction's session keys for the kernels. Only call if IsSupported.
+    */
+    static void ExpandKeys(const SrtpSessionKeys& keys, SrtpLaneKeys& laneKeys);
+
+    /**
+    * XORs the keystream into each lane's data.
+    * @param[in] lanes: the buffers, up to MAX_LANES.
+    * @param[in] count: the number of lanes.
+    */
+    static void AesCtr(SrtpCipherLane* lanes, int count);
+
+    /**
+    * Computes the HMAC of each lane's data.
+    * @param[in] lanes: the buffers, up to MAX_LANES.
+    * @param[in] count: the number of lanes.
+    */
+    static void HmacSha1(SrtpAuthLane* lanes, int count);
+  };
+}
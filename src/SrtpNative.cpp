@@ -0,0 +1,647 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpNative.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "SrtpNative.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTrace.h"
+#include "SrtpMultiBuffer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+
+    /**
+    * Process wide metrics for one SRTP operation, aggregated over all sessions.
+    */
+    struct SrtpOpMetrics
+    {
+      SrtpOpMetrics(const char* op) :
+        Packets(MetricsRegistry::Default().GetCounter("sipsm_srtp_packets_total", "Packets successfully processed by SRTP.", Label(op))),
+        Bytes(MetricsRegistry::Default().GetCounter("sipsm_srtp_bytes_total", "Output bytes of successfully processed SRTP packets.", Label(op))),
+        Failures(MetricsRegistry::Default().GetCounter("sipsm_srtp_failures_total", "Packets that SRTP failed to process.", Label(op))),
+        Duration(MetricsRegistry::Default().GetHistogram("sipsm_srtp_duration_ns", "Time taken to process an SRTP packet.", Label(op)))
+      { }
+
+      void Record(int res, int length)
+      {
+        if (res == srtp_err_status_ok) {
+          Packets.Add();
+          Bytes.Add(length);
+        }
+        else {
+          Failures.Add();
+        }
+      }
+
+      static std::string Label(const char* op) { return std::string("op=\"") + op + "\""; }
+
+      MetricCounter& Packets;
+      MetricCounter& Bytes;
+      MetricCounter& Failures;
+      MetricHistogram& Duration;
+    };
+
+    SrtpOpMetrics _protectRtpMetrics("protect_rtp");
+    SrtpOpMetrics _unprotectRtpMetrics("unprotect_rtp");
+    SrtpOpMetrics _protectRtcpMetrics("protect_rtcp");
+    SrtpOpMetrics _unprotectRtcpMetrics("unprotect_rtcp");
+  }
+
+  bool SrtpNative::_isLibSrtpInitialised = false;
+  bool SrtpNative::_isOpenSslPreferred = false;
+  SrtpCryptoInfo SrtpNative::_cryptoInfo{};
+
+  void SrtpNative::InitialiseLibSrtp()
+  {
+    // Only need to call the libsrtp initialisation routines once per process.
+    if (!_isLibSrtpInitialised) {
+      srtp_init();
+
+      _cryptoInfo = ProbeCryptoBackends();
+      _isLibSrtpInitialised = true;
+
+      SrtpCryptoInfo info = GetCryptoInfo();
+      SIPSM_LOG_INFO("SRTP using %s with %s, RTP protected with %s%s.", srtp_get_version_string(),
+        GetCryptoBackendName(info.LibSrtp), GetCryptoBackendName(info.Rtp),
+        (info.IsAesNi) ? ", AES-NI available" : ", no AES-NI");
+    }
+  }
+
+  SrtpCryptoInfo SrtpNative::ProbeCryptoBackends()
+  {
+    SrtpCryptoInfo info{};
+
+    // libsrtp has no call to say which crypto library it was built with, and its AES-GCM
+    // ciphers exist with NSS as well as OpenSSL. The build says which one it links, with
+    // SIPSM_LIBSRTP_OPENSSL or SIPSM_LIBSRTP_INTERNAL_AES, otherwise it is unknown.
+    srtp_policy_t policy;
+    memset(&policy, 0, sizeof(policy));
+    srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtp);
+    srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtcp);
+
+    unsigned char key[SRTP_AES_GCM_128_KEY_LEN_WSALT] = {};
+    policy.key = key;
+    policy.ssrc.type = ssrc_any_outbound;
+    policy.window_size = SRTP_ANTI_REPLAY_WINDOW_SIZE;
+
+    srtp_t probe = nullptr;
+    if (srtp_create(&probe, &policy) == srtp_err_status_ok) {
+      srtp_dealloc(probe);
+      info.IsAesGcmAvailable = true;
+    }
+
+#if defined(SIPSM_LIBSRTP_OPENSSL)
+    info.LibSrtp = SrtpCryptoBackend::LibSrtpOpenSsl;
+#elif defined(SIPSM_LIBSRTP_INTERNAL_AES)
+    info.LibSrtp = SrtpCryptoBackend::LibSrtpInternal;
+#else
+    info.LibSrtp = SrtpCryptoBackend::Unknown;
+#endif
+    info.IsAesNi = SrtpMultiBuffer::IsAesNiSupported();
+    return info;
+  }
+
+  SrtpCryptoInfo SrtpNative::GetCryptoInfo()
+  {
+    InitialiseLibSrtp();
+
+    SrtpCryptoInfo info = _cryptoInfo;
+    info.Rtp = (_isOpenSslPreferred && info.LibSrtp != SrtpCryptoBackend::LibSrtpOpenSsl) ? SrtpCryptoBackend::OpenSsl : info.LibSrtp;
+    return info;
+  }
+
+  const char* SrtpNative::GetCryptoBackendName(SrtpCryptoBackend backend)
+  {
+    switch (backend) {
+    case SrtpCryptoBackend::LibSrtpInternal:
+      return "libsrtp internal AES";
+    case SrtpCryptoBackend::LibSrtpOpenSsl:
+      return "libsrtp OpenSSL";
+    case SrtpCryptoBackend::OpenSsl:
+      return "OpenSSL EVP";
+    default:
+      return "unknown";
+    }
+  }
+
+  SrtpNative::SrtpNative()
+  {
+    InitialiseLibSrtp();
+
+    // Need pre-processor directive of ENABLE_DEBUGGING for libsrtp debugging.
+    //debug_on(mod_srtp);
+    //debug_on(srtp_mod_auth);
+  }
+
+  SrtpNative::~SrtpNative()
+  {
+    if (_session != nullptr) {
+      MemoryAccountScope scope(_memoryAccount, MemoryCategory::Srtp);
+      srtp_dealloc(_session);
+      _session = nullptr;
+    }
+    delete _keystreamSender;
+    delete _keystreamReceiver;
+    OPENSSL_cleanse(_masterKeys, sizeof(_masterKeys));
+  }
+
+  bool SrtpNative::IsNewSsrc(const uint8_t* buffer, int length, int ssrcOffset)
+  {
+    if (_memoryAccount == nullptr || _measuredSsrcCount == MEASURED_SSRC_COUNT || length < ssrcOffset + 4) {
+      return false;
+    }
+
+    uint32_t ssrc = ((uint32_t)buffer[ssrcOffset] << 24) | ((uint32_t)buffer[ssrcOffset + 1] << 16) |
+      ((uint32_t)buffer[ssrcOffset + 2] << 8) | buffer[ssrcOffset + 3];
+
+    for (int i = 0; i < _measuredSsrcCount; i++) {
+      if (_measuredSsrcs[i] == ssrc) {
+        return false;
+      }
+    }
+
+    _measuredSsrcs[_measuredSsrcCount++] = ssrc;
+    return true;
+  }
+
+  void SrtpNative::InitPolicy(srtp_policy_t& policy, unsigned char* key, srtp_ssrc_type_t ssrcType,
+    srtp_master_key_t* masterKeys, srtp_master_key_t** masterKeyPointers)
+  {
+    memset(&policy, 0, sizeof(policy));
+
+    // set policy to describe a policy for an SRTP stream
+    srtp_crypto_policy_set_rtp_default(&policy.rtp);
+    srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+
+    policy.key = key;
+    policy.ssrc.value = 0;
+    policy.window_size = SRTP_ANTI_REPLAY_WINDOW_SIZE;
+    policy.allow_repeat_tx = 0;
+    policy.ssrc.type = ssrcType;
+    policy.enc_xtn_hdr_count = 0;
+    policy.next = NULL;
+
+    // With an MKI libsrtp is given the master keys it holds for RTCP, the newest last.
+    if (_mkiLength > 0) {
+      for (int i = 0; i < _masterKeyCount; i++) {
+        masterKeys[i].key = _masterKeys[i];
+        masterKeys[i].mki_id = _masterKeyMkis[i];
+        masterKeys[i].mki_size = (unsigned int)_mkiLength;
+        masterKeyPointers[i] = &masterKeys[i];
+      }
+      policy.key = NULL;
+      policy.keys = masterKeyPointers;
+      policy.num_master_keys = (unsigned long)_masterKeyCount;
+    }
+  }
+
+  int SrtpNative::CreateSession(unsigned char* key, srtp_ssrc_type_t ssrcType)
+  {
+    if (_mkiLength > 0) {
+      memcpy(_masterKeys[0], key, SRTP_MASTER_KEY_LEN);
+      memcpy(_masterKeyMkis[0], _mki, _mkiLength);
+      _masterKeyCount = 1;
+    }
+
+    srtp_policy_t policy;
+    srtp_master_key_t masterKeys[MAX_MASTER_KEYS];
+    srtp_master_key_t* masterKeyPointers[MAX_MASTER_KEYS];
+    InitPolicy(policy, key, ssrcType, masterKeys, masterKeyPointers);
+
+    // RTP with an MKI is always on the native transform, which can be rekeyed without
+    // re-creating its streams.
+    bool isNativeTransform = _isNativeTransform || _mkiLength > 0 || GetCryptoInfo().Rtp == SrtpCryptoBackend::OpenSsl;
+
+    if (ssrcType == ssrc_any_outbound && (_keystreamPackets > 0 || isNativeTransform) && _keystreamSender == nullptr) {
+      _keystreamSender = new SrtpKeystreamSender();
+      int err = (_mkiLength > 0) ? _keystreamSender->SetMki(_mki, _mkiLength) : srtp_err_status_ok;
+      if (err == srtp_err_status_ok) {
+        err = _keystreamSender->Init(key, _keystreamPackets, SrtpKeystreamSender::DEFAULT_KEYSTREAM_LENGTH, _keystreamScheduler);
+      }
+      if (err != srtp_err_status_ok) {
+        delete _keystreamSender;
+        _keystreamSender = nullptr;
+        return err;
+      }
+    }
+    else if (ssrcType == ssrc_any_inbound && isNativeTransform && _keystreamReceiver == nullptr) {
+      _keystreamReceiver = new SrtpKeystreamReceiver();
+      _keystreamReceiver->SetRekeyGraceWindow(_rekeyGraceMilliseconds);
+      int err = (_mkiLength > 0) ? _keystreamReceiver->SetMki(_mki, _mkiLength) : srtp_err_status_ok;
+      if (err == srtp_err_status_ok) {
+        err = _keystreamReceiver->Init(key);
+      }
+      if (err != srtp_err_status_ok) {
+        delete _keystreamReceiver;
+        _keystreamReceiver = nullptr;
+        return err;
+      }
+    }
+
+    _ssrcType = ssrcType;
+    MemoryAccountScope scope(_memoryAccount, MemoryCategory::Srtp);
+    return srtp_create(&_session, &policy);
+  }
+
+  int SrtpNative::SetMki(const uint8_t* mki, int mkiLength)
+  {
+    if (mki == nullptr || mkiLength <= 0 || mkiLength > SrtpKeystreamSender::MAX_MKI_LENGTH || _session != nullptr) {
+      SIPSM_LOG_ERROR("The SRTP MKI must be set before the session is initialised and be 1 to %d bytes.", SrtpKeystreamSender::MAX_MKI_LENGTH);
+      return srtp_err_status_bad_param;
+    }
+
+    memcpy(_mki, mki, mkiLength);
+    _mkiLength = mkiLength;
+    return srtp_err_status_ok;
+  }
+
+  int SrtpNative::Rekey(const uint8_t* key, int keyLength, const uint8_t* mki)
+  {
+    if (_session == nullptr || _mkiLength == 0 || key == nullptr || keyLength < SRTP_MASTER_KEY_LEN || mki == nullptr) {
+      SIPSM_LOG_ERROR("Cannot rekey the SRTP session, it must be initialised with an MKI and the key must be at least %d bytes.", SRTP_MASTER_KEY_LEN);
+      return srtp_err_status_bad_param;
+    }
+
+    int err = (_keystreamSender != nullptr) ? _keystreamSender->Rekey(key, mki) : _keystreamReceiver->Rekey(key, mki);
+    if (err != srtp_err_status_ok) {
+      SIPSM_LOG_ERROR("Failed to derive the keys for the new SRTP master key, result %d.", err);
+      return err;
+    }
+
+    // libsrtp keeps the previous key as well as the new one, so late RTCP under the
+    // previous key is still accepted until the next rekey.
+    if (_masterKeyCount == MAX_MASTER_KEYS) {
+      memcpy(_masterKeys[0], _masterKeys[1], SRTP_MASTER_KEY_LEN);
+      memcpy(_masterKeyMkis[0], _masterKeyMkis[1], _mkiLength);
+      _masterKeyCount--;
+    }
+    memcpy(_masterKeys[_masterKeyCount], key, SRTP_MASTER_KEY_LEN);
+    memcpy(_masterKeyMkis[_masterKeyCount], mki, _mkiLength);
+    _masterKeyCount++;
+
+    srtp_policy_t policy;
+    srtp_master_key_t masterKeys[MAX_MASTER_KEYS];
+    srtp_master_key_t* masterKeyPointers[MAX_MASTER_KEYS];
+    InitPolicy(policy, nullptr, _ssrcType, masterKeys, masterKeyPointers);
+
+    // libsrtp carries the streams' indices and replay windows over to the new keys.
+    MemoryAccountScope scope(_memoryAccount, MemoryCategory::Srtp);
+    err = srtp_update(_session, &policy);
+    if (err != srtp_err_status_ok) {
+      SIPSM_LOG_ERROR("Failed to update the SRTCP keys, result %d.", err);
+    }
+    return err;
+  }
+
+  int SrtpNative::InitWithKey(const uint8_t* key, int keyLength, bool isClient)
+  {
+    if (key == nullptr || keyLength < SRTP_MASTER_KEY_LEN) {
+      SIPSM_LOG_ERROR("The SRTP key was too short, it must be at least %d bytes.", SRTP_MASTER_KEY_LEN);
+      return srtp_err_status_bad_param;
+    }
+
+    unsigned char masterKey[SRTP_MASTER_KEY_LEN];
+    memcpy(masterKey, key, SRTP_MASTER_KEY_LEN);
+
+    int err = CreateSession(masterKey, (isClient) ? ssrc_any_outbound : ssrc_any_inbound);
+
+    SIPSM_LOG_DEBUG("Create srtp session result %d.", err);
+
+    return err;
+  }
+
+  int SrtpNative::InitFromDtls(SSL* ssl, bool isClient)
+  {
+    unsigned char dtls_buffer[SRTP_AES_KEY_KEY_LEN * 2 + SRTP_SALT_LEN * 2];
+
+    const char* label = "EXTRACTOR-dtls_srtp";
+
+    if (ssl == nullptr) {
+      SIPSM_LOG_ERROR("Cannot initialise SRTP session, the DTLS connection was not available.");
+      return -1;
+    }
+
+    int res = SSL_export_keying_material(ssl,
+      dtls_buffer,
+      sizeof(dtls_buffer),
+      label,
+      strlen(label),
+      NULL,
+      0,
+      0);
+
+    if (res != 1) {
+      SIPSM_LOG_ERROR("Export of SSL key information failed.");
+      return -1;
+    }
+
+    int err = InitFromKeyingMaterial(dtls_buffer, sizeof(dtls_buffer), isClient);
+    OPENSSL_cleanse(dtls_buffer, sizeof(dtls_buffer));
+
+    return err;
+  }
+
+  int SrtpNative::InitFromKeyingMaterial(const uint8_t* material, int length, bool isClient)
+  {
+    unsigned char client_write_key[SRTP_AES_KEY_KEY_LEN + SRTP_SALT_LEN];
+    unsigned char server_write_key[SRTP_AES_KEY_KEY_LEN + SRTP_SALT_LEN];
+    size_t offset = 0;
+
+    if (material == nullptr || length < SRTP_MASTER_KEY_LEN * 2) {
+      SIPSM_LOG_ERROR("Cannot initialise SRTP session, the keying material was too short.");
+      return -1;
+    }
+
+    memcpy(&client_write_key[0], &material[offset], SRTP_AES_KEY_KEY_LEN);
+    offset += SRTP_AES_KEY_KEY_LEN;
+    memcpy(&server_write_key[0], &material[offset], SRTP_AES_KEY_KEY_LEN);
+    offset += SRTP_AES_KEY_KEY_LEN;
+    memcpy(&client_write_key[SRTP_AES_KEY_KEY_LEN], &material[offset], SRTP_SALT_LEN);
+    offset += SRTP_SALT_LEN;
+    memcpy(&server_write_key[SRTP_AES_KEY_KEY_LEN], &material[offset], SRTP_SALT_LEN);
+
+    /* Init transmit direction */
+    int err = CreateSession((isClient) ? client_write_key : server_write_key,
+      (isClient) ? ssrc_any_inbound : ssrc_any_outbound);
+
+    OPENSSL_cleanse(client_write_key, sizeof(client_write_key));
+    OPENSSL_cleanse(server_write_key, sizeof(server_write_key));
+
+    if (err != srtp_err_status_ok) {
+      SIPSM_LOG_ERROR("Unable to create SRTP session.");
+      return -1;
+    }
+
+    if (isClient) {
+      SIPSM_LOG_DEBUG("Create srtp client session result %d.", err);
+    }
+    else {
+      SIPSM_LOG_DEBUG("Create srtp server session result %d.", err);
+    }
+
+    return 0;
+  }
+
+  int SrtpNative::ProtectRTP(uint8_t* buffer, int length, int* outLength)
+  {
+    int res;
+    {
+      ScopedLatency latency(_protectRtpMetrics.Duration);
+      SIPSM_TRACE_SCOPE("srtp", "Srtp::ProtectRTP", 0);
+      MemoryAccountScope scope((IsNewSsrc(buffer, length, 8)) ? _memoryAccount : nullptr, MemoryCategory::Srtp);
+      res = (_keystreamSender != nullptr) ? _keystreamSender->Protect(buffer, length, &length) : srtp_protect(_session, buffer, &length);
+    }
+    *outLength = length;
+    _protectRtpMetrics.Record(res, length);
+
+    if (res == srtp_err_status_ok) {
+      _stats.RtpProtected++;
+      _stats.BytesProtected += length;
+    }
+    else {
+      _stats.ProtectFailures++;
+    }
+
+    return res;
+  }
+
+  int SrtpNative::PrecomputeKeystream()
+  {
+    return (_keystreamSender != nullptr) ? _keystreamSender->Precompute() : 0;
+  }
+
+  SrtpKeystreamStats SrtpNative::GetKeystreamStats() const
+  {
+    if (_keystreamSender != nullptr) {
+      return _keystreamSender->GetStats();
+    }
+    return (_keystreamReceiver != nullptr) ? _keystreamReceiver->GetStats() : SrtpKeystreamStats{};
+  }
+
+  void SrtpNative::RecordBatchPacket(const SrtpBatchPacket& packet, bool isProtect)
+  {
+    (isProtect ? _protectRtpMetrics : _unprotectRtpMetrics).Record(packet.Status, packet.OutLength);
+
+    if (packet.Status != srtp_err_status_ok) {
+      (isProtect ? _stats.ProtectFailures : _stats.UnprotectFailures)++;
+    }
+    else if (isProtect) {
+      _stats.RtpProtected++;
+      _stats.BytesProtected += packet.OutLength;
+    }
+    else {
+      _stats.RtpUnprotected++;
+      _stats.BytesUnprotected += packet.OutLength;
+    }
+  }
+
+  int SrtpNative::ProtectRTPBatch(SrtpBatchPacket* packets, int count)
+  {
+    SrtpNative* sessions[SrtpMultiBuffer::MAX_LANES];
+    for (int i = 0; i < SrtpMultiBuffer::MAX_LANES; i++) {
+      sessions[i] = this;
+    }
+
+    int protectedCount = 0;
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      protectedCount += ProtectRTPBatch(sessions, packets + start, chunk);
+    }
+    return protectedCount;
+  }
+
+  int SrtpNative::ProtectRTPBatch(SrtpNative* const* sessions, SrtpBatchPacket* packets, int count)
+  {
+    SIPSM_TRACE_SCOPE("srtp", "Srtp::ProtectRTPBatch", 0);
+
+    // Packets for sessions with the native transform are gathered into a batch, the
+    // rest go through libsrtp one at a time.
+    SrtpKeystreamSender* senders[SrtpMultiBuffer::MAX_LANES];
+    SrtpBatchPacket batch[SrtpMultiBuffer::MAX_LANES];
+    int batchPackets[SrtpMultiBuffer::MAX_LANES];
+    int protectedCount = 0;
+
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      int batchCount = 0;
+
+      for (int i = start; i < start + chunk; i++) {
+        if (sessions[i]->_keystreamSender != nullptr) {
+          senders[batchCount] = sessions[i]->_keystreamSender;
+          batch[batchCount] = packets[i];
+          batchPackets[batchCount++] = i;
+        }
+        else {
+          packets[i].Status = sessions[i]->ProtectRTP(packets[i].Buffer, packets[i].Length, &packets[i].OutLength);
+          protectedCount += (packets[i].Status == srtp_err_status_ok) ? 1 : 0;
+        }
+      }
+
+      protectedCount += SrtpKeystreamSender::ProtectBatch(senders, batch, batchCount);
+
+      for (int b = 0; b < batchCount; b++) {
+        int i = batchPackets[b];
+        packets[i] = batch[b];
+        sessions[i]->RecordBatchPacket(packets[i], true);
+      }
+    }
+
+    return protectedCount;
+  }
+
+  int SrtpNative::UnprotectRTPBatch(SrtpBatchPacket* packets, int count)
+  {
+    SrtpNative* sessions[SrtpMultiBuffer::MAX_LANES];
+    for (int i = 0; i < SrtpMultiBuffer::MAX_LANES; i++) {
+      sessions[i] = this;
+    }
+
+    int unprotectedCount = 0;
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      unprotectedCount += UnprotectRTPBatch(sessions, packets + start, chunk);
+    }
+    return unprotectedCount;
+  }
+
+  int SrtpNative::UnprotectRTPBatch(SrtpNative* const* sessions, SrtpBatchPacket* packets, int count)
+  {
+    SIPSM_TRACE_SCOPE("srtp", "Srtp::UnprotectRTPBatch", 0);
+
+    SrtpKeystreamReceiver* receivers[SrtpMultiBuffer::MAX_LANES];
+    SrtpBatchPacket batch[SrtpMultiBuffer::MAX_LANES];
+    int batchPackets[SrtpMultiBuffer::MAX_LANES];
+    int unprotectedCount = 0;
+
+    for (int start = 0; start < count; start += SrtpMultiBuffer::MAX_LANES) {
+      int chunk = (count - start < SrtpMultiBuffer::MAX_LANES) ? count - start : SrtpMultiBuffer::MAX_LANES;
+      int batchCount = 0;
+
+      for (int i = start; i < start + chunk; i++) {
+        if (sessions[i]->_keystreamReceiver != nullptr) {
+          receivers[batchCount] = sessions[i]->_keystreamReceiver;
+          batch[batchCount] = packets[i];
+          batchPackets[batchCount++] = i;
+        }
+        else {
+          packets[i].Status = sessions[i]->UnprotectRTP(packets[i].Buffer, packets[i].Length, &packets[i].OutLength);
+          unprotectedCount += (packets[i].Status == srtp_err_status_ok) ? 1 : 0;
+        }
+      }
+
+      unprotectedCount += SrtpKeystreamReceiver::UnprotectBatch(receivers, batch, batchCount);
+
+      for (int b = 0; b < batchCount; b++) {
+        int i = batchPackets[b];
+        packets[i] = batch[b];
+        sessions[i]->RecordBatchPacket(packets[i], false);
+      }
+    }
+
+    return unprotectedCount;
+  }
+
+  int SrtpNative::ProtectRTP(const uint8_t* rtp, int length, MediaBufferPtr& packet)
+  {
+    packet = _pool->Acquire(length + SRTP_MAX_TRAILER_LEN);
+    if (!packet) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer for the SRTP packet.");
+      _stats.ProtectFailures++;
+      return srtp_err_status_alloc_fail;
+    }
+
+    memcpy(packet->Data(), rtp, length);
+
+    int outLength = 0;
+    int res = ProtectRTP(packet->Data(), length, &outLength);
+
+    if (res == srtp_err_status_ok) {
+      packet->SetLength(outLength);
+    }
+    else {
+      packet.Reset();
+    }
+
+    return res;
+  }
+
+  int SrtpNative::UnprotectRTP(uint8_t* buffer, int length, int* outLength)
+  {
+    int res;
+    {
+      ScopedLatency latency(_unprotectRtpMetrics.Duration);
+      SIPSM_TRACE_SCOPE("srtp", "Srtp::UnprotectRTP", 0);
+      MemoryAccountScope scope((IsNewSsrc(buffer, length, 8)) ? _memoryAccount : nullptr, MemoryCategory::Srtp);
+      res = (_keystreamReceiver != nullptr) ? _keystreamReceiver->Unprotect(buffer, length, &length) : srtp_unprotect(_session, buffer, &length);
+    }
+    *outLength = length;
+    _unprotectRtpMetrics.Record(res, length);
+
+    if (res == srtp_err_status_ok) {
+      _stats.RtpUnprotected++;
+      _stats.BytesUnprotected += length;
+    }
+    else {
+      _stats.UnprotectFailures++;
+    }
+
+    return res;
+  }
+
+  int SrtpNative::ProtectRTCP(uint8_t* buffer, int length, int* outLength)
+  {
+    int res;
+    {
+      ScopedLatency latency(_protectRtcpMetrics.Duration);
+      SIPSM_TRACE_SCOPE("srtp", "Srtp::ProtectRTCP", 0);
+      MemoryAccountScope scope((IsNewSsrc(buffer, length, 4)) ? _memoryAccount : nullptr, MemoryCategory::Srtp);
+      res = (_mkiLength > 0) ? srtp_protect_rtcp_mki(_session, buffer, &length, 1, (unsigned int)(_masterKeyCount - 1)) :
+        srtp_protect_rtcp(_session, buffer, &length);
+    }
+    *outLength = length;
+    _protectRtcpMetrics.Record(res, length);
+
+    if (res == srtp_err_status_ok) {
+      _stats.RtcpProtected++;
+      _stats.BytesProtected += length;
+    }
+    else {
+      _stats.ProtectFailures++;
+    }
+
+    return res;
+  }
+
+  int SrtpNative::UnprotectRTCP(uint8_t* buffer, int length, int* outLength)
+  {
+    int res;
+    {
+      ScopedLatency latency(_unprotectRtcpMetrics.Duration);
+      SIPSM_TRACE_SCOPE("srtp", "Srtp::UnprotectRTCP", 0);
+      MemoryAccountScope scope((IsNewSsrc(buffer, length, 4)) ? _memoryAccount : nullptr, MemoryCategory::Srtp);
+      res = (_mkiLength > 0) ? srtp_unprotect_rtcp_mki(_session, buffer, &length, 1) : srtp_unprotect_rtcp(_session, buffer, &length);
+    }
+    *outLength = length;
+    _unprotectRtcpMetrics.Record(res, length);
+
+    if (res == srtp_err_status_ok) {
+      _stats.RtcpUnprotected++;
+      _stats.BytesUnprotected += length;
+    }
+    else {
+      _stats.UnprotectFailures++;
+    }
+
+    return res;
+  }
+}
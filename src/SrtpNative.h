@@ -0,0 +1,339 @@
+//-----------------------------------------------------------------------------
+// Filename: SrtpNative.h
+//
+// Description: Native (non-CLR) SRTP session wrapper around Cisco's libsrtp.
+// This is the core used by both the C++/CLI Srtp class and the flat C API
+// in NativeApi.h.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//
+// libsrtp license:
+// See LICENSE_libsrtp file or https://github.com/cisco/libsrtp/blob/master/LICENSE.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+#include "MediaMemory.h"
+#include "SrtpKeystream.h"
+#include "srtp2/srtp.h"
+#include "openssl/ssl.h"
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  /**
+  * Running totals for an SRTP session. All fields are plain 64 bit integers so
+  * the structure can be copied straight across the flat C API.
+  */
+  struct SrtpStats
+  {
+    uint64_t RtpProtected;
+    uint64_t RtpUnprotected;
+    uint64_t RtcpProtected;
+    uint64_t RtcpUnprotected;
+    uint64_t BytesProtected;
+    uint64_t BytesUnprotected;
+    uint64_t ProtectFailures;
+    uint64_t UnprotectFailures;
+  };
+
+  /**
+  * An implementation of the AES and HMAC-SHA1 that protect SRTP packets.
+  */
+  enum class SrtpCryptoBackend
+  {
+    LibSrtpInternal = 0,        // libsrtp's portable AES, libsrtp was built without a crypto library.
+    LibSrtpOpenSsl = 1,         // libsrtp built with OpenSSL.
+    OpenSsl = 2,                // The transform in SrtpKeystream.h, OpenSSL EVP called directly.
+    Unknown = 3                 // libsrtp's crypto library wasn't given to the build, see ProbeCryptoBackends.
+  };
+
+  /**
+  * The SRTP crypto backends found when libsrtp was initialised.
+  */
+  struct SrtpCryptoInfo
+  {
+    SrtpCryptoBackend LibSrtp;  // What libsrtp protects with, used for RTCP and other profiles.
+    SrtpCryptoBackend Rtp;      // What new sessions on the default profile protect RTP with.
+    bool IsAesGcmAvailable;     // Whether libsrtp can create AES-GCM sessions.
+    bool IsAesNi;               // Whether the processor has AES-NI for OpenSSL to use.
+  };
+
+  class SrtpNative
+  {
+  public:
+
+    static const int SRTP_ANTI_REPLAY_WINDOW_SIZE = 128;
+    static const int SRTP_AES_KEY_KEY_LEN = SRTP_AES_128_KEY_LEN;
+    static const int SRTP_MASTER_KEY_LEN = SRTP_AES_KEY_KEY_LEN + SRTP_SALT_LEN;
+
+    /**
+    * Initialises the libsrtp library. Only needs to be called once per process.
+    */
+    static void InitialiseLibSrtp();
+
+    /**
+    * Gets the crypto backends in use, initialising libsrtp if needed.
+    */
+    static SrtpCryptoInfo GetCryptoInfo();
+
+    /**
+    * Gets a backend's name for logs and reports, for example "OpenSSL EVP".
+    */
+    static const char* GetCryptoBackendName(SrtpCryptoBackend backend);
+
+    /**
+    * Optional, sets whether sessions created from now on protect RTP with OpenSSL
+    * unless libsrtp is known to have been built with OpenSSL. vcpkg builds it with its
+    * internal AES by default, which uses no AES-NI and costs several times as much per
+    * packet. Defaults to false, so sessions stay on libsrtp and its replay database.
+    * A session can also ask for OpenSSL with SetNativeTransform.
+    */
+    static void SetOpenSslPreferred(bool isPreferred) { _isOpenSslPreferred = isPreferred; }
+
+    SrtpNative();
+    ~SrtpNative();
+
+    /**
+    * Creates the SRTP session from raw key material.
+    * @param[in] key: the master key followed by the master salt.
+    * @param[in] keyLength: the length of the key buffer, must be at least
+    *  SRTP_MASTER_KEY_LEN.
+    * @param[in] isClient: set to true if the SRTP session is being used to send or
+    *  false if it being used to receive.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int InitWithKey(const uint8_t* key, int keyLength, bool isClient);
+
+    /**
+    * Creates the SRTP session from the keying material exported from a completed
+    * DTLS handshake (RFC5764).
+    * @param[in] ssl: the SSL connection that has completed the DTLS handshake.
+    * @param[in] isClient: set to true if the SRTP session is being used to receive or
+    *  false if it being used to send.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int InitFromDtls(SSL* ssl, bool isClient);
+
+    /**
+    * Creates the SRTP session from keying material already exported from a DTLS
+    * handshake, see DtlsHandshakeNative::ExportSrtpKeyingMaterial.
+    * @param[in] material: the client key, server key, client salt and server salt.
+    * @param[in] length: the length of the material, must be at least
+    *  2 * SRTP_MASTER_KEY_LEN.
+    * @param[in] isClient: set to true if the SRTP session is being used to receive or
+    *  false if it being used to send.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int InitFromKeyingMaterial(const uint8_t* material, int length, bool isClient);
+
+    /**
+    * Optional, puts an MKI (RFC3711 3.1) on every packet, naming the master key it is
+    * protected with, so the session can be rekeyed. Must be called before the session
+    * is initialised, and RTP then goes through the native transform, see
+    * SetNativeTransform.
+    * @param[in] mki: the MKI of the master key the session is initialised with.
+    * @param[in] mkiLength: the length of the MKI, up to 4 bytes. Every key's MKI has
+    *  this length.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int SetMki(const uint8_t* mki, int mkiLength);
+
+    /**
+    * Optional, sets how long a receiving session accepts RTP under the previous master
+    * key after the first packet under a new one. Must be called before the session is
+    * initialised.
+    */
+    void SetRekeyGraceWindow(int milliseconds) { _rekeyGraceMilliseconds = milliseconds; }
+
+    int GetMkiLength() const { return _mkiLength; }
+
+    /**
+    * Changes the master key in place, the session must have an MKI. The streams keep
+    * their rollover counters and replay windows, so no packets are lost.
+    *
+    * A sending session protects RTP with the new key from its next packet. A receiving
+    * session accepts both keys and moves to the new one when the first packet under it
+    * arrives, then accepts the previous key for the grace window. The RTP keys are
+    * derived on the calling thread and the thread protecting or unprotecting RTP only
+    * swaps them. The RTCP keys are updated in libsrtp by this call, so it must not run
+    * at the same time as ProtectRTCP or UnprotectRTCP. RTCP under the previous key is
+    * accepted until the next rekey.
+    * @param[in] key: the new master key followed by the master salt.
+    * @param[in] keyLength: the length of the key buffer, must be at least
+    *  SRTP_MASTER_KEY_LEN.
+    * @param[in] mki: the new key's MKI, the length set by SetMki.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int Rekey(const uint8_t* key, int keyLength, const uint8_t* mki);
+
+    /**
+    * Protects an RTP packet in place.
+    * @param[in,out] buffer: the RTP packet. Must have room for the authentication tag.
+    * @param[in] length: the length of the RTP packet.
+    * @param[out] outLength: the length of the protected packet.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int ProtectRTP(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Copies an RTP packet into a pooled buffer, with room for the authentication tag,
+    * and protects it. The original packet is left untouched so it can be kept for
+    * retransmission.
+    * @param[in] rtp: the RTP packet.
+    * @param[in] length: the length of the RTP packet.
+    * @param[out] packet: set to the protected packet.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int ProtectRTP(const uint8_t* rtp, int length, MediaBufferPtr& packet);
+
+    /**
+    * Decrypts and authenticates an SRTP packet in place.
+    * @param[in,out] buffer: the SRTP packet.
+    * @param[in] length: the length of the SRTP packet.
+    * @param[out] outLength: the length of the unprotected RTP packet.
+    * @@Returns: 0 if successful or an srtp_err_status_t value if not.
+    */
+    int UnprotectRTP(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Protects a batch of RTP packets in place. With the native transform, see
+    * SetNativeTransform, the packets are interleaved by the multi-buffer kernels,
+    * otherwise they are protected one at a time by libsrtp.
+    * @param[in,out] packets: the packets, each one's Status and OutLength are set as
+    *  ProtectRTP would set them.
+    * @param[in] count: the number of packets.
+    * @@Returns: the number of packets protected.
+    */
+    int ProtectRTPBatch(SrtpBatchPacket* packets, int count);
+
+    /**
+    * Protects a batch of RTP packets for several sessions, for example every session
+    * sent to from one thread. Packet i is protected by sessions[i].
+    */
+    static int ProtectRTPBatch(SrtpNative* const* sessions, SrtpBatchPacket* packets, int count);
+
+    /**
+    * Unprotects a batch of SRTP packets in place. See ProtectRTPBatch.
+    */
+    int UnprotectRTPBatch(SrtpBatchPacket* packets, int count);
+
+    /**
+    * Unprotects a batch of SRTP packets for several sessions. Packet i is unprotected
+    * by sessions[i].
+    */
+    static int UnprotectRTPBatch(SrtpNative* const* sessions, SrtpBatchPacket* packets, int count);
+
+    /**
+    * Protects an RTCP packet in place. See ProtectRTP.
+    */
+    int ProtectRTCP(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Decrypts and authenticates an SRTCP packet in place. See UnprotectRTP.
+    */
+    int UnprotectRTCP(uint8_t* buffer, int length, int* outLength);
+
+    /**
+    * Gets the running totals for this session.
+    */
+    const SrtpStats& GetStats() const { return _stats; }
+
+    /**
+    * Sets the pool that protected packets are allocated from. Defaults to
+    * MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    /**
+    * Optional, the account the memory held by libsrtp is charged to.
+    *
+    * The libsrtp session is kept while a session is idle. It holds the rollover
+    * counter, replay window and SRTCP index of each stream, which libsrtp has no way
+    * to restore, and re-creating it would reuse key stream.
+    */
+    void SetMemoryAccount(MemoryAccount* account) { _memoryAccount = account; }
+
+    /**
+    * Optional, protects outbound RTP with keystream computed ahead of time, see
+    * SrtpKeystreamSender. Must be called before the session is initialised and only
+    * applies to a session used to send. RTCP is still protected by libsrtp.
+    * @param[in] packetCount: the number of packets ahead to precompute keystream for
+    *  on each stream, 0 to turn it off.
+    * @param[in] scheduler: optional, the scheduler to precompute on. If not set the
+    *  owner calls PrecomputeKeystream, for example from its idle loop.
+    */
+    void SetKeystreamPrecompute(int packetCount, MediaScheduler* scheduler = nullptr)
+    {
+      _keystreamPackets = packetCount;
+      _keystreamScheduler = scheduler;
+    }
+
+    /**
+    * Optional, protects or unprotects RTP with the OpenSSL transform in SrtpKeystream.h
+    * rather than libsrtp, so batches can be interleaved. Must be called before the
+    * session is initialised. RTCP is still protected by libsrtp. Sessions use the
+    * transform regardless if libsrtp has no crypto library, see SetOpenSslPreferred.
+    */
+    void SetNativeTransform(bool isEnabled) { _isNativeTransform = isEnabled; }
+
+    /**
+    * Fills the keystream caches, see SrtpKeystreamSender::Precompute.
+    * @@Returns: the number of packets whose keystream was computed, 0 if precomputing
+    *  isn't in use.
+    */
+    int PrecomputeKeystream();
+
+    /**
+    * Gets the native transform's totals, all zero if it isn't in use.
+    */
+    SrtpKeystreamStats GetKeystreamStats() const;
+
+  private:
+
+    static bool _isLibSrtpInitialised;
+    static bool _isOpenSslPreferred;
+    static SrtpCryptoInfo _cryptoInfo;
+
+    /**
+    * libsrtp adds a stream the first time it sees an SSRC. The first few SSRCs are
+    * remembered so the memory for those streams can be charged to the account.
+    */
+    static const int MEASURED_SSRC_COUNT = 4;
+
+    /**
+    * The master keys libsrtp holds for RTCP with an MKI, the previous and the newest.
+    */
+    static const int MAX_MASTER_KEYS = 2;
+
+    static SrtpCryptoInfo ProbeCryptoBackends();
+
+    void InitPolicy(srtp_policy_t& policy, unsigned char* key, srtp_ssrc_type_t ssrcType,
+      srtp_master_key_t* masterKeys, srtp_master_key_t** masterKeyPointers);
+    int CreateSession(unsigned char* key, srtp_ssrc_type_t ssrcType);
+    bool IsNewSsrc(const uint8_t* buffer, int length, int ssrcOffset);
+    void RecordBatchPacket(const SrtpBatchPacket& packet, bool isProtect);
+
+    srtp_t _session{ nullptr };
+    MemoryAccount* _memoryAccount{ nullptr };
+    uint32_t _measuredSsrcs[MEASURED_SSRC_COUNT]{};
+    int _measuredSsrcCount = 0;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+    SrtpStats _stats{};
+    SrtpKeystreamSender* _keystreamSender{ nullptr };
+    SrtpKeystreamReceiver* _keystreamReceiver{ nullptr };
+    bool _isNativeTransform = false;
+    int _keystreamPackets = 0;
+    MediaScheduler* _keystreamScheduler{ nullptr };
+    srtp_ssrc_type_t _ssrcType = ssrc_undefined;
+    uint8_t _mki[SrtpKeystreamSender::MAX_MKI_LENGTH]{};
+    int _mkiLength = 0;
+    int _rekeyGraceMilliseconds = SrtpKeystreamReceiver::DEFAULT_REKEY_GRACE_MILLISECONDS;
+    unsigned char _masterKeys[MAX_MASTER_KEYS][SRTP_MASTER_KEY_LEN]{};
+    unsigned char _masterKeyMkis[MAX_MASTER_KEYS][SrtpKeystreamSender::MAX_MKI_LENGTH]{};
+    int _masterKeyCount = 0;
+  };
+}
@@ -0,0 +1,382 @@
+//-----------------------------------------------------------------------------
+// Filename: ThumbnailDecoder.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "ThumbnailDecoder.h"
+#include "ImageConvertNative.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaScheduler.h"
+#include "Vp8Bitstream.h"
+#include "VpxEncoderNative.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    MetricCounter& _thumbnailsUpdated = MetricsRegistry::Default().GetCounter("sipsm_thumbnails_updated_total", "Thumbnails decoded from a key frame.");
+    MetricCounter& _thumbnailsSkipped = MetricsRegistry::Default().GetCounter("sipsm_thumbnail_decodes_skipped_total", "Key frames due a thumbnail that weren't decoded as the queue was full.");
+
+    /**
+    * Fits an image inside the thumbnail size keeping its aspect ratio. Images that
+    * already fit are left as they are.
+    */
+    void FitThumbnail(int width, int height, int maxWidth, int maxHeight, int* outWidth, int* outHeight)
+    {
+      if (width <= maxWidth && height <= maxHeight) {
+        *outWidth = width;
+        *outHeight = height;
+      }
+      else if ((int64_t)width * maxHeight >= (int64_t)height * maxWidth) {
+        *outWidth = maxWidth;
+        *outHeight = (int)((int64_t)height * maxWidth / width);
+      }
+      else {
+        *outWidth = (int)((int64_t)width * maxHeight / height);
+        *outHeight = maxHeight;
+      }
+
+      // Even sizes so the chroma planes of the I420 image are exactly half size.
+      *outWidth = (*outWidth > 2) ? *outWidth & ~1 : 2;
+      *outHeight = (*outHeight > 2) ? *outHeight & ~1 : 2;
+    }
+  }
+
+  struct ThumbnailDecoderPool::Impl
+  {
+    struct Decoder
+    {
+      VpxEncoderNative Vpx;
+      ImageConvertNative Convert;
+    };
+
+    int Width = DEFAULT_WIDTH;
+    int Height = DEFAULT_HEIGHT;
+    int MaxQueued = DEFAULT_MAX_QUEUED;
+    MediaScheduler* Scheduler = nullptr;
+
+    std::vector<std::unique_ptr<Decoder>> Decoders;
+
+    // The streams with a key frame waiting to be decoded, the free decoders and the
+    // number of background tasks draining the queue, one per decoder in use.
+    std::mutex Lock;
+    std::deque<ThumbnailStream::Impl*> Queue;
+    std::vector<Decoder*> Free;
+    int Running = 0;
+
+    std::atomic<uint64_t> FramesOffered{ 0 };
+    std::atomic<uint64_t> KeyFramesOffered{ 0 };
+    std::atomic<uint64_t> DecodesQueued{ 0 };
+    std::atomic<uint64_t> DecodesSkipped{ 0 };
+    std::atomic<uint64_t> ThumbnailsUpdated{ 0 };
+    std::atomic<uint64_t> DecodeFailures{ 0 };
+    std::atomic<uint64_t> DecodeNanosecondsTotal{ 0 };
+
+    /**
+    * Queues a stream whose key frame is ready and starts another task to drain the
+    * queue if a decoder is free.
+    * @@Returns: true if the stream was queued or false if the queue is full.
+    */
+    bool Enqueue(ThumbnailStream::Impl* stream)
+    {
+      bool isStart = false;
+      {
+        std::lock_guard<std::mutex> lock(Lock);
+        if (Decoders.empty() || (int)Queue.size() >= MaxQueued) {
+          return false;
+        }
+        Queue.push_back(stream);
+        if (Running < (int)Decoders.size()) {
+          Running++;
+          isStart = true;
+        }
+      }
+
+      if (isStart && Scheduler->Submit(RunDecodes, this, TaskPriority::Background) != 0) {
+        std::lock_guard<std::mutex> lock(Lock);
+        Running--;
+        auto position = std::find(Queue.begin(), Queue.end(), stream);
+        if (position == Queue.end()) {
+          // A task already running took the stream and will decode it.
+          return true;
+        }
+        Queue.erase(position);
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+    * Takes a decoder and decodes the queued key frames until the queue is empty.
+    */
+    static void RunDecodes(void* context)
+    {
+      Impl* pool = static_cast<Impl*>(context);
+      Decoder* decoder = nullptr;
+
+      while (true) {
+        ThumbnailStream::Impl* stream = nullptr;
+        {
+          std::lock_guard<std::mutex> lock(pool->Lock);
+          if (decoder == nullptr) {
+            decoder = pool->Free.back();
+            pool->Free.pop_back();
+          }
+          if (pool->Queue.empty()) {
+            pool->Free.push_back(decoder);
+            pool->Running--;
+            return;
+          }
+          stream = pool->Queue.front();
+          pool->Queue.pop_front();
+        }
+
+        Decode(pool, decoder, stream);
+      }
+    }
+
+    static void Decode(Impl* pool, Decoder* decoder, ThumbnailStream::Impl* stream);
+  };
+
+  ThumbnailDecoderPool::ThumbnailDecoderPool(int decoders, int width, int height, MediaScheduler* scheduler) :
+    _impl(new Impl())
+  {
+    _impl->Width = (width > 0) ? width : DEFAULT_WIDTH;
+    _impl->Height = (height > 0) ? height : DEFAULT_HEIGHT;
+    _impl->Scheduler = (scheduler != nullptr) ? scheduler : &MediaScheduler::Default();
+
+    for (int d = 0; d < ((decoders > 0) ? decoders : DEFAULT_DECODERS); d++) {
+      std::unique_ptr<Impl::Decoder> decoder(new Impl::Decoder());
+      if (decoder->Vpx.InitDecoder() != 0) {
+        SIPSM_LOG_ERROR("Failed to initialise a VP8 decoder for the thumbnail pool.");
+        continue;
+      }
+      _impl->Free.push_back(decoder.get());
+      _impl->Decoders.push_back(std::move(decoder));
+    }
+  }
+
+  ThumbnailDecoderPool::~ThumbnailDecoderPool()
+  {
+    Flush();
+    delete _impl;
+  }
+
+  void ThumbnailDecoderPool::Flush()
+  {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(_impl->Lock);
+        if (_impl->Running == 0) {
+          return;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  void ThumbnailDecoderPool::Park()
+  {
+    // Only the free decoders are parked, one in use is left until the next time.
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+    for (Impl::Decoder* decoder : _impl->Free) {
+      decoder->Vpx.Park();
+      decoder->Convert.Park();
+    }
+  }
+
+  int ThumbnailDecoderPool::GetDecoderCount() const { return (int)_impl->Decoders.size(); }
+  int ThumbnailDecoderPool::GetWidth() const { return _impl->Width; }
+  int ThumbnailDecoderPool::GetHeight() const { return _impl->Height; }
+
+  ThumbnailStats ThumbnailDecoderPool::GetStats() const
+  {
+    ThumbnailStats stats;
+    stats.FramesOffered = _impl->FramesOffered.load(std::memory_order_relaxed);
+    stats.KeyFramesOffered = _impl->KeyFramesOffered.load(std::memory_order_relaxed);
+    stats.DecodesQueued = _impl->DecodesQueued.load(std::memory_order_relaxed);
+    stats.DecodesSkipped = _impl->DecodesSkipped.load(std::memory_order_relaxed);
+    stats.ThumbnailsUpdated = _impl->ThumbnailsUpdated.load(std::memory_order_relaxed);
+    stats.DecodeFailures = _impl->DecodeFailures.load(std::memory_order_relaxed);
+    stats.DecodeNanosecondsTotal = _impl->DecodeNanosecondsTotal.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  struct ThumbnailStream::Impl
+  {
+    ThumbnailDecoderPool::Impl* Pool = nullptr;
+    std::atomic<uint64_t> RefreshNanoseconds{ 0 };
+
+    // When the last key frame was queued, -1 if none has been or its decode failed.
+    std::atomic<int64_t> LastQueuedNanoseconds{ -1 };
+
+    // The key frame being decoded. Set by PushFrame and only read by the decode
+    // while IsPending is set.
+    std::atomic<bool> IsPending{ false };
+    MediaBufferPtr PendingFrame;
+    uint64_t PendingNanoseconds = 0;
+
+    mutable std::mutex Lock;
+    MediaBufferPtr Thumbnail;
+    int Width = 0;
+    int Height = 0;
+    uint64_t UpdatedNanoseconds = 0;
+
+    bool IsDue(uint64_t nowNanoseconds) const
+    {
+      int64_t lastQueued = LastQueuedNanoseconds.load(std::memory_order_relaxed);
+      return lastQueued < 0 || nowNanoseconds - (uint64_t)lastQueued >= RefreshNanoseconds.load(std::memory_order_relaxed);
+    }
+  };
+
+  void ThumbnailDecoderPool::Impl::Decode(Impl* pool, Decoder* decoder, ThumbnailStream::Impl* stream)
+  {
+    uint64_t start = MediaScheduler::NowNanoseconds();
+
+    MediaBufferPtr decoded;
+    MediaBufferPtr thumbnail;
+    unsigned int width = 0, height = 0;
+    int thumbnailWidth = 0, thumbnailHeight = 0;
+
+    int result = decoder->Vpx.Decode(stream->PendingFrame->Data(), (int)stream->PendingFrame->Length(), decoded, &width, &height);
+    if (result == 0 && decoded) {
+      FitThumbnail((int)width, (int)height, pool->Width, pool->Height, &thumbnailWidth, &thumbnailHeight);
+      if (thumbnailWidth == (int)width && thumbnailHeight == (int)height) {
+        thumbnail = std::move(decoded);
+      }
+      else {
+        result = decoder->Convert.Scale(decoded->Data(), AV_PIX_FMT_YUV420P, (int)width, (int)height,
+          thumbnailWidth, thumbnailHeight, thumbnail);
+      }
+    }
+    else {
+      result = -1;
+    }
+
+    stream->PendingFrame.Reset();
+
+    if (result == 0) {
+      std::lock_guard<std::mutex> lock(stream->Lock);
+      stream->Thumbnail = std::move(thumbnail);
+      stream->Width = thumbnailWidth;
+      stream->Height = thumbnailHeight;
+      stream->UpdatedNanoseconds = stream->PendingNanoseconds;
+      pool->ThumbnailsUpdated.fetch_add(1, std::memory_order_relaxed);
+      _thumbnailsUpdated.Add();
+    }
+    else {
+      // Try again with the next key frame.
+      stream->LastQueuedNanoseconds.store(-1, std::memory_order_relaxed);
+      pool->DecodeFailures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    pool->DecodeNanosecondsTotal.fetch_add(MediaScheduler::NowNanoseconds() - start, std::memory_order_relaxed);
+
+    // The stream can be destroyed from here on.
+    stream->IsPending.store(false, std::memory_order_release);
+  }
+
+  ThumbnailStream::ThumbnailStream(ThumbnailDecoderPool& pool, int refreshMilliseconds) :
+    _impl(new Impl())
+  {
+    _impl->Pool = pool._impl;
+    SetRefreshInterval(refreshMilliseconds);
+  }
+
+  ThumbnailStream::~ThumbnailStream()
+  {
+    while (_impl->IsPending.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    delete _impl;
+  }
+
+  void ThumbnailStream::SetRefreshInterval(int refreshMilliseconds)
+  {
+    _impl->RefreshNanoseconds.store((uint64_t)((refreshMilliseconds > 0) ? refreshMilliseconds : 0) * 1000000ULL, std::memory_order_relaxed);
+  }
+
+  int ThumbnailStream::PushFrame(const uint8_t* frame, int length, uint64_t nowNanoseconds)
+  {
+    ThumbnailDecoderPool::Impl* pool = _impl->Pool;
+    pool->FramesOffered.fetch_add(1, std::memory_order_relaxed);
+
+    Vp8FrameInfo info;
+    if (Vp8Bitstream::ParseFrameHeader(frame, length, &info) != 0) {
+      return -1;
+    }
+
+    if (!info.IsKeyFrame) {
+      return 0;
+    }
+
+    pool->KeyFramesOffered.fetch_add(1, std::memory_order_relaxed);
+
+    if (!_impl->IsDue(nowNanoseconds) || _impl->IsPending.load(std::memory_order_acquire)) {
+      return 0;
+    }
+
+    MediaBufferPtr copy = MediaBufferPool::Default().Acquire(length);
+    if (!copy) {
+      SIPSM_LOG_ERROR("Failed to allocate a buffer for a thumbnail key frame of %d bytes.", length);
+      return 0;
+    }
+
+    memcpy(copy->Data(), frame, length);
+    copy->SetLength(length);
+
+    _impl->PendingFrame = std::move(copy);
+    _impl->PendingNanoseconds = nowNanoseconds;
+
+    // Set before the frame is queued, a decode that fails resets it so the next key
+    // frame is tried.
+    int64_t lastQueued = _impl->LastQueuedNanoseconds.exchange((int64_t)nowNanoseconds, std::memory_order_relaxed);
+    _impl->IsPending.store(true, std::memory_order_release);
+
+    if (!pool->Enqueue(_impl)) {
+      _impl->LastQueuedNanoseconds.store(lastQueued, std::memory_order_relaxed);
+      _impl->PendingFrame.Reset();
+      _impl->IsPending.store(false, std::memory_order_release);
+      pool->DecodesSkipped.fetch_add(1, std::memory_order_relaxed);
+      _thumbnailsSkipped.Add();
+      return 0;
+    }
+
+    pool->DecodesQueued.fetch_add(1, std::memory_order_relaxed);
+    return 1;
+  }
+
+  bool ThumbnailStream::IsRefreshDue(uint64_t nowNanoseconds) const
+  {
+    return !_impl->IsPending.load(std::memory_order_acquire) && _impl->IsDue(nowNanoseconds);
+  }
+
+  int ThumbnailStream::GetThumbnail(MediaBufferPtr& image, int* width, int* height, uint64_t* updatedNanoseconds) const
+  {
+    std::lock_guard<std::mutex> lock(_impl->Lock);
+
+    if (!_impl->Thumbnail) {
+      return -1;
+    }
+
+    image = _impl->Thumbnail;
+    *width = _impl->Width;
+    *height = _impl->Height;
+    *updatedNanoseconds = _impl->UpdatedNanoseconds;
+    return 0;
+  }
+}
@@ -0,0 +1,167 @@
+//-----------------------------------------------------------------------------
+// Filename: ThumbnailDecoder.h
+//
+// Description: Live thumbnails of many VP8 streams from a few decoders. A
+// ThumbnailStream inspects the frames it is offered with Vp8Bitstream and
+// only decodes a key frame, once its refresh interval has passed. A key
+// frame doesn't depend on any earlier frame, so it can be decoded by any
+// decoder, and a ThumbnailDecoderPool shares a small number of them between
+// all of the streams instead of keeping one per stream with its reference
+// frames. The decode and the downscale to thumbnail size run on the
+// scheduler's background lane so the threads forwarding the streams only
+// pay for the inspection and a copy of the key frame.
+//
+// Key frames wait in a queue for a free decoder. A key frame that arrives
+// while the queue is full is skipped and the stream tries again with its
+// next key frame. Streams whose senders rarely send key frames can use
+// IsRefreshDue to decide when to ask for one with a PLI.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  class MediaScheduler;
+
+  /**
+  * Running totals for a decoder pool over all of its streams. All fields are plain
+  * 64 bit integers so the structure can be copied straight across the flat C API.
+  */
+  struct ThumbnailStats
+  {
+    uint64_t FramesOffered;             // Frames passed to ThumbnailStream::PushFrame.
+    uint64_t KeyFramesOffered;
+    uint64_t DecodesQueued;             // Key frames copied and queued for a decoder.
+    uint64_t DecodesSkipped;            // Key frames due a refresh while the queue was full.
+    uint64_t ThumbnailsUpdated;
+    uint64_t DecodeFailures;
+    uint64_t DecodeNanosecondsTotal;    // Decoding and scaling, on the background lane.
+  };
+
+  class ThumbnailDecoderPool
+  {
+  public:
+
+    static const int DEFAULT_DECODERS = 2;
+    static const int DEFAULT_WIDTH = 160;
+    static const int DEFAULT_HEIGHT = 90;
+
+    /**
+    * The most key frames waiting for a decoder. Each one holds a copy of its frame.
+    */
+    static const int DEFAULT_MAX_QUEUED = 64;
+
+    /**
+    * @param[in] decoders: the number of VP8 decoders, and so of key frames that can be
+    *  decoded at the same time.
+    * @param[in] width: the maximum width of the thumbnails.
+    * @param[in] height: the maximum height of the thumbnails. Thumbnails keep the
+    *  aspect ratio of their stream and fit within width by height.
+    * @param[in] scheduler: the scheduler the decodes run on, null for
+    *  MediaScheduler::Default.
+    */
+    explicit ThumbnailDecoderPool(int decoders = DEFAULT_DECODERS, int width = DEFAULT_WIDTH, int height = DEFAULT_HEIGHT,
+      MediaScheduler* scheduler = nullptr);
+
+    /**
+    * Destructor. The streams using the pool must have been destroyed.
+    */
+    ~ThumbnailDecoderPool();
+
+    ThumbnailDecoderPool(const ThumbnailDecoderPool&) = delete;
+    ThumbnailDecoderPool& operator=(const ThumbnailDecoderPool&) = delete;
+
+    /**
+    * Waits for the decodes that have been queued to finish.
+    */
+    void Flush();
+
+    /**
+    * Frees the decoders' libvpx contexts and scaling contexts while no decodes are
+    * queued, for example when no dashboard is watching. They are created again by
+    * the next decode.
+    */
+    void Park();
+
+    int GetDecoderCount() const;
+    int GetWidth() const;
+    int GetHeight() const;
+
+    ThumbnailStats GetStats() const;
+
+  private:
+    friend class ThumbnailStream;
+
+    struct Impl;
+    Impl* _impl;
+  };
+
+  class ThumbnailStream
+  {
+  public:
+
+    static const int DEFAULT_REFRESH_MILLISECONDS = 5000;
+
+    /**
+    * @param[in] pool: the decoders to use, must outlive the stream.
+    * @param[in] refreshMilliseconds: the least time between thumbnails.
+    */
+    explicit ThumbnailStream(ThumbnailDecoderPool& pool, int refreshMilliseconds = DEFAULT_REFRESH_MILLISECONDS);
+
+    /**
+    * Destructor. Waits for a decode of the stream's key frame in progress.
+    */
+    ~ThumbnailStream();
+
+    ThumbnailStream(const ThumbnailStream&) = delete;
+    ThumbnailStream& operator=(const ThumbnailStream&) = delete;
+
+    /**
+    * Changes the least time between thumbnails. Takes effect from the next frame.
+    */
+    void SetRefreshInterval(int refreshMilliseconds);
+
+    /**
+    * Offers an encoded frame of the stream. Only the frame's header is read unless it
+    * is a key frame, the refresh interval has passed since the last thumbnail and the
+    * pool's queue isn't full, in which case the frame is copied and queued for decoding.
+    * @param[in] frame: the encoded VP8 frame.
+    * @param[in] length: the length of the encoded frame.
+    * @param[in] nowNanoseconds: the time the frame arrived, from
+    *  MediaScheduler::NowNanoseconds.
+    * @@Returns: 1 if the frame was queued for decoding, 0 if not or -1 if the frame's
+    *  header is invalid.
+    */
+    int PushFrame(const uint8_t* frame, int length, uint64_t nowNanoseconds);
+
+    /**
+    * Whether the refresh interval has passed without a key frame being queued, the
+    * caller can send a PLI to ask the sender for one.
+    */
+    bool IsRefreshDue(uint64_t nowNanoseconds) const;
+
+    /**
+    * Gets the latest thumbnail.
+    * @param[out] image: set to the thumbnail, a packed I420 image. The buffer isn't
+    *  written to again, a new thumbnail replaces it.
+    * @param[out] width: the width of the thumbnail.
+    * @param[out] height: the height of the thumbnail.
+    * @param[out] updatedNanoseconds: when the key frame it was decoded from arrived.
+    * @@Returns: 0 if successful or -1 if no thumbnail has been decoded yet.
+    */
+    int GetThumbnail(MediaBufferPtr& image, int* width, int* height, uint64_t* updatedNanoseconds) const;
+
+  private:
+    friend class ThumbnailDecoderPool;
+
+    struct Impl;
+    Impl* _impl;
+  };
+}
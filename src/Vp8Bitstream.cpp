@@ -0,0 +1,179 @@
+//-----------------------------------------------------------------------------
+// Filename: Vp8Bitstream.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Vp8Bitstream.h"
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    const int RTP_HEADER_LENGTH = 12;
+    const uint8_t RTP_VERSION = 2;
+
+    const uint8_t VP8_EXTENDED_BIT = 0x80;        // X: extended control bits present.
+    const uint8_t VP8_NON_REFERENCE_BIT = 0x20;   // N: non-reference frame.
+    const uint8_t VP8_START_BIT = 0x10;           // S: start of a VP8 partition.
+    const uint8_t VP8_PARTITION_MASK = 0x07;      // PID: partition index.
+    const uint8_t VP8_PICTURE_ID_BIT = 0x80;      // I: picture ID present.
+    const uint8_t VP8_TL0PICIDX_BIT = 0x40;       // L: TL0PICIDX present.
+    const uint8_t VP8_TID_BIT = 0x20;             // T: TID present.
+    const uint8_t VP8_KEYIDX_BIT = 0x10;          // K: KEYIDX present.
+    const uint8_t VP8_LONG_PICTURE_ID_BIT = 0x80; // M: 15 bit picture ID.
+
+    const uint8_t VP8_INTER_FRAME_BIT = 0x01;     // Frame tag, 0 for a key frame.
+    const uint8_t VP8_SHOW_FRAME_BIT = 0x10;
+
+    // The start code that follows the frame tag of a key frame.
+    const uint8_t KEY_FRAME_START_CODE[] = { 0x9d, 0x01, 0x2a };
+  }
+
+  int Vp8Bitstream::ParseFrameHeader(const uint8_t* frame, int length, Vp8FrameInfo* info)
+  {
+    if (frame == nullptr || info == nullptr || length < FRAME_TAG_LENGTH) {
+      return -1;
+    }
+
+    uint32_t tag = frame[0] | ((uint32_t)frame[1] << 8) | ((uint32_t)frame[2] << 16);
+
+    info->IsKeyFrame = ((tag & VP8_INTER_FRAME_BIT) == 0) ? 1 : 0;
+    info->Version = (tag >> 1) & 0x07;
+    info->IsShown = ((tag & VP8_SHOW_FRAME_BIT) != 0) ? 1 : 0;
+    info->FirstPartitionLength = (int32_t)(tag >> 5);
+    info->Width = 0;
+    info->Height = 0;
+    info->HorizontalScale = 0;
+    info->VerticalScale = 0;
+
+    if (info->IsKeyFrame) {
+      if (length < KEY_FRAME_HEADER_LENGTH ||
+        frame[3] != KEY_FRAME_START_CODE[0] || frame[4] != KEY_FRAME_START_CODE[1] || frame[5] != KEY_FRAME_START_CODE[2]) {
+        return -1;
+      }
+
+      // 14 bits of size and 2 of scale, little endian.
+      uint16_t width = frame[6] | (frame[7] << 8);
+      uint16_t height = frame[8] | (frame[9] << 8);
+
+      info->Width = width & 0x3fff;
+      info->Height = height & 0x3fff;
+      info->HorizontalScale = width >> 14;
+      info->VerticalScale = height >> 14;
+    }
+
+    return 0;
+  }
+
+  int Vp8Bitstream::ParsePayloadDescriptor(const uint8_t* payload, int length, Vp8PayloadDescriptor* descriptor)
+  {
+    if (payload == nullptr || descriptor == nullptr || length < 1) {
+      return -1;
+    }
+
+    int offset = 0;
+    uint8_t first = payload[offset++];
+
+    descriptor->IsNonReference = ((first & VP8_NON_REFERENCE_BIT) != 0) ? 1 : 0;
+    descriptor->IsPartitionStart = ((first & VP8_START_BIT) != 0) ? 1 : 0;
+    descriptor->PartitionIndex = first & VP8_PARTITION_MASK;
+    descriptor->PictureId = -1;
+    descriptor->Tl0PicIdx = -1;
+    descriptor->TemporalLayer = -1;
+    descriptor->IsLayerSync = 0;
+    descriptor->KeyIndex = -1;
+
+    if ((first & VP8_EXTENDED_BIT) != 0) {
+      if (offset >= length) {
+        return -1;
+      }
+      uint8_t extension = payload[offset++];
+
+      if ((extension & VP8_PICTURE_ID_BIT) != 0) {
+        if (offset >= length) {
+          return -1;
+        }
+        if ((payload[offset] & VP8_LONG_PICTURE_ID_BIT) != 0) {
+          if (offset + 2 > length) {
+            return -1;
+          }
+          descriptor->PictureId = ((payload[offset] & 0x7f) << 8) | payload[offset + 1];
+          offset += 2;
+        }
+        else {
+          descriptor->PictureId = payload[offset++];
+        }
+      }
+
+      if ((extension & VP8_TL0PICIDX_BIT) != 0) {
+        if (offset >= length) {
+          return -1;
+        }
+        descriptor->Tl0PicIdx = payload[offset++];
+      }
+
+      if ((extension & (VP8_TID_BIT | VP8_KEYIDX_BIT)) != 0) {
+        if (offset >= length) {
+          return -1;
+        }
+        uint8_t layer = payload[offset++];
+
+        if ((extension & VP8_TID_BIT) != 0) {
+          descriptor->TemporalLayer = layer >> 6;
+          descriptor->IsLayerSync = ((layer & 0x20) != 0) ? 1 : 0;
+        }
+        if ((extension & VP8_KEYIDX_BIT) != 0) {
+          descriptor->KeyIndex = layer & 0x1f;
+        }
+      }
+    }
+
+    descriptor->Length = offset;
+    return 0;
+  }
+
+  int Vp8Bitstream::InspectRtp(const uint8_t* rtp, int length, Vp8PayloadDescriptor* descriptor, Vp8FrameInfo* info)
+  {
+    if (rtp == nullptr || length < RTP_HEADER_LENGTH || (rtp[0] >> 6) != RTP_VERSION) {
+      return -1;
+    }
+
+    int end = length;
+    int offset = RTP_HEADER_LENGTH + (rtp[0] & 0x0f) * 4;
+
+    if ((rtp[0] & 0x20) != 0) {
+      // Padding, the last byte holds the padding length, which counts itself.
+      if (rtp[length - 1] == 0) {
+        return -1;
+      }
+      end -= rtp[length - 1];
+    }
+
+    if ((rtp[0] & 0x10) != 0) {
+      if (offset + 4 > end) {
+        return -1;
+      }
+      offset += 4 + ((rtp[offset + 2] << 8) | rtp[offset + 3]) * 4;
+    }
+
+    if (offset >= end || ParsePayloadDescriptor(rtp + offset, end - offset, descriptor) != 0) {
+      return -1;
+    }
+
+    if (!descriptor->IsPartitionStart || descriptor->PartitionIndex != 0) {
+      return 0;
+    }
+
+    offset += descriptor->Length;
+    return (ParseFrameHeader(rtp + offset, end - offset, info) == 0) ? 1 : -1;
+  }
+
+  bool Vp8Bitstream::IsKeyFrame(const uint8_t* frame, int length)
+  {
+    Vp8FrameInfo info;
+    return ParseFrameHeader(frame, length, &info) == 0 && info.IsKeyFrame;
+  }
+}
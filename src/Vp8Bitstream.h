@@ -0,0 +1,104 @@
+//-----------------------------------------------------------------------------
+// Filename: Vp8Bitstream.h
+//
+// Description: Reads what a forwarder or recorder needs to know about a VP8
+// frame without decoding it. The frame tag and, for key frames, the rest of
+// the uncompressed data chunk at the start of every frame (RFC6386 9.1) give
+// the frame type, version, whether it is shown, the length of the first
+// partition and the dimensions. The RTP payload descriptor (RFC7741 4.2)
+// gives the partition, picture ID and temporal layer of a packet. The
+// parsers only read the first few bytes of their input and never allocate.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+namespace SIPSorceryMedia {
+
+  /**
+  * The uncompressed data chunk of a VP8 frame. All fields are plain 32 bit integers
+  * so the structure can be copied straight across the flat C API.
+  */
+  struct Vp8FrameInfo
+  {
+    int32_t IsKeyFrame;
+    int32_t Version;                // 0 to 3, the reconstruction and loop filter profile.
+    int32_t IsShown;                // 0 for frames only used as references, e.g. golden frames.
+    int32_t FirstPartitionLength;
+    int32_t Width;                  // Key frames only, 0 for inter frames.
+    int32_t Height;                 // Key frames only, 0 for inter frames.
+    int32_t HorizontalScale;        // Key frames only, the upscaling the sender asked for.
+    int32_t VerticalScale;          // Key frames only.
+  };
+
+  /**
+  * The VP8 payload descriptor of an RTP packet. Fields that aren't present are -1.
+  */
+  struct Vp8PayloadDescriptor
+  {
+    int32_t Length;                 // The length of the descriptor, the VP8 payload follows it.
+    int32_t IsNonReference;         // N: the frame can be dropped without affecting others.
+    int32_t IsPartitionStart;       // S: the packet starts a partition.
+    int32_t PartitionIndex;         // PID.
+    int32_t PictureId;              // 7 or 15 bit picture ID.
+    int32_t Tl0PicIdx;              // Temporal layer zero index.
+    int32_t TemporalLayer;          // TID.
+    int32_t IsLayerSync;            // Y, only valid with TemporalLayer.
+    int32_t KeyIndex;               // KEYIDX.
+  };
+
+  class Vp8Bitstream
+  {
+  public:
+
+    /**
+    * The bytes of the uncompressed data chunk, a 3 byte frame tag followed for key
+    * frames by a 3 byte start code and the 4 bytes of dimensions.
+    */
+    static const int FRAME_TAG_LENGTH = 3;
+    static const int KEY_FRAME_HEADER_LENGTH = 10;
+
+    /**
+    * Parses the uncompressed data chunk at the start of a VP8 frame. Only the first
+    * KEY_FRAME_HEADER_LENGTH bytes are read, so the start of a frame from the first RTP
+    * packet is enough.
+    * @param[in] frame: the start of the encoded frame.
+    * @param[in] length: the bytes available from the start of the frame.
+    * @param[out] info: set with the frame's header.
+    * @@Returns: 0 if successful or -1 if the frame is too short or a key frame's start
+    *  code is missing.
+    */
+    static int ParseFrameHeader(const uint8_t* frame, int length, Vp8FrameInfo* info);
+
+    /**
+    * Parses the VP8 payload descriptor at the start of an RTP payload.
+    * @param[in] payload: the RTP payload.
+    * @param[in] length: the length of the RTP payload.
+    * @param[out] descriptor: set with the descriptor.
+    * @@Returns: 0 if successful or -1 if the descriptor is truncated.
+    */
+    static int ParsePayloadDescriptor(const uint8_t* payload, int length, Vp8PayloadDescriptor* descriptor);
+
+    /**
+    * Parses the payload descriptor of an unprotected RTP packet carrying VP8 and, if
+    * the packet starts a frame, the frame's header. Skips the CSRCs, header extension
+    * and padding.
+    * @param[in] rtp: the RTP packet.
+    * @param[in] length: the length of the RTP packet.
+    * @param[out] descriptor: set with the payload descriptor.
+    * @param[out] info: set with the frame's header if the packet starts a frame.
+    * @@Returns: 1 if the packet starts a frame and info was set, 0 if it doesn't or -1
+    *  if the packet could not be parsed.
+    */
+    static int InspectRtp(const uint8_t* rtp, int length, Vp8PayloadDescriptor* descriptor, Vp8FrameInfo* info);
+
+    /**
+    * Whether an encoded frame is a key frame with a valid header.
+    */
+    static bool IsKeyFrame(const uint8_t* frame, int length);
+  };
+}
@@ -0,0 +1,189 @@
+//-----------------------------------------------------------------------------
+// Filename: Vp8Packetiser.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "Vp8Packetiser.h"
+#include "Vp8Bitstream.h"
+#include "MediaLog.h"
+
+#include <string.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    const uint8_t RTP_VERSION = 2;
+    const uint8_t RTP_MARKER_BIT = 0x80;
+
+    const uint8_t VP8_START_BIT = 0x10;           // S: start of a VP8 partition.
+
+    uint16_t ReadUInt16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+    uint32_t ReadUInt32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+  }
+
+  Vp8Packetiser::Vp8Packetiser(uint32_t ssrc, uint8_t payloadType, int maxPacketSize) :
+    _ssrc(ssrc),
+    _payloadType(payloadType & 0x7f),
+    _maxPacketSize(maxPacketSize)
+  { }
+
+  int Vp8Packetiser::Packetise(const uint8_t* frame, int length, uint32_t timestamp, std::vector<MediaBufferPtr>& packets)
+  {
+    const int maxPayload = _maxPacketSize - RTP_HEADER_LENGTH - VP8_DESCRIPTOR_LENGTH;
+    int offset = 0;
+
+    while (offset < length) {
+      int payloadLength = (length - offset < maxPayload) ? length - offset : maxPayload;
+      int packetLength = RTP_HEADER_LENGTH + VP8_DESCRIPTOR_LENGTH + payloadLength;
+      bool isLast = (offset + payloadLength == length);
+
+      MediaBufferPtr packet = _pool->Acquire(packetLength + TRAILER_ROOM);
+      if (!packet) {
+        SIPSM_LOG_ERROR("Failed to allocate a buffer for a VP8 RTP packet.");
+        return -1;
+      }
+
+      uint8_t* p = packet->Data();
+      p[0] = RTP_VERSION << 6;
+      p[1] = _payloadType | ((isLast) ? RTP_MARKER_BIT : 0);
+      p[2] = (uint8_t)(_sequenceNumber >> 8);
+      p[3] = (uint8_t)_sequenceNumber;
+      p[4] = (uint8_t)(timestamp >> 24);
+      p[5] = (uint8_t)(timestamp >> 16);
+      p[6] = (uint8_t)(timestamp >> 8);
+      p[7] = (uint8_t)timestamp;
+      p[8] = (uint8_t)(_ssrc >> 24);
+      p[9] = (uint8_t)(_ssrc >> 16);
+      p[10] = (uint8_t)(_ssrc >> 8);
+      p[11] = (uint8_t)_ssrc;
+      p[RTP_HEADER_LENGTH] = (offset == 0) ? VP8_START_BIT : 0;
+      memcpy(p + RTP_HEADER_LENGTH + VP8_DESCRIPTOR_LENGTH, frame + offset, payloadLength);
+
+      packet->SetLength(packetLength);
+      packets.push_back(std::move(packet));
+
+      _sequenceNumber++;
+      offset += payloadLength;
+    }
+
+    return 0;
+  }
+
+  int Vp8Depacketiser::Push(const uint8_t* rtp, int length, MediaBufferPtr& frame)
+  {
+    _stats.PacketsReceived++;
+
+    if (rtp == nullptr || length < Vp8Packetiser::RTP_HEADER_LENGTH || (rtp[0] >> 6) != RTP_VERSION) {
+      _stats.PacketsInvalid++;
+      return -1;
+    }
+
+    bool isMarker = (rtp[1] & RTP_MARKER_BIT) != 0;
+    uint16_t sequenceNumber = ReadUInt16(rtp + 2);
+    uint32_t timestamp = ReadUInt32(rtp + 4);
+
+    size_t end = length;
+    size_t offset = Vp8Packetiser::RTP_HEADER_LENGTH + (rtp[0] & 0x0f) * 4;
+
+    if ((rtp[0] & 0x20) != 0) {
+      // Padding, the last byte holds the padding length, which includes itself.
+      size_t padding = rtp[length - 1];
+      if (padding == 0 || offset + padding > end) {
+        _stats.PacketsInvalid++;
+        return -1;
+      }
+      end -= padding;
+    }
+
+    if ((rtp[0] & 0x10) != 0 && offset + 4 <= end) {
+      offset += 4 + ReadUInt16(rtp + offset + 2) * 4;
+    }
+
+    if (offset >= end) {
+      _stats.PacketsInvalid++;
+      return -1;
+    }
+
+    Vp8PayloadDescriptor descriptor;
+    if (Vp8Bitstream::ParsePayloadDescriptor(rtp + offset, (int)(end - offset), &descriptor) != 0) {
+      _stats.PacketsInvalid++;
+      return -1;
+    }
+
+    offset += descriptor.Length;
+    bool isFrameStart = descriptor.IsPartitionStart && descriptor.PartitionIndex == 0;
+
+    if (_isAssembling && (sequenceNumber != _nextSequenceNumber || timestamp != _timestamp || isFrameStart)) {
+      // A packet is missing or the previous frame's marker packet never arrived.
+      Discard();
+    }
+
+    _nextSequenceNumber = sequenceNumber + 1;
+
+    if (!_isAssembling) {
+      if (!isFrameStart) {
+        // Waiting for the start of the next frame.
+        return 0;
+      }
+
+      _isAssembling = true;
+      _timestamp = timestamp;
+      _frameLength = 0;
+    }
+
+    if (Append(rtp + offset, end - offset) != 0) {
+      Discard();
+      return 0;
+    }
+
+    if (isMarker) {
+      _frame->SetLength(_frameLength);
+      _frame->SetId(_timestamp);
+      frame = std::move(_frame);
+      _isAssembling = false;
+      _stats.FramesOutput++;
+    }
+
+    return 0;
+  }
+
+  int Vp8Depacketiser::Append(const uint8_t* payload, size_t length)
+  {
+    size_t required = _frameLength + length;
+
+    if (!_frame || _frame->Capacity() < required) {
+      size_t capacity = (_frame) ? _frame->Capacity() * 2 : INITIAL_FRAME_CAPACITY;
+      while (capacity < required) {
+        capacity *= 2;
+      }
+
+      MediaBufferPtr larger = _pool->Acquire(capacity);
+      if (!larger) {
+        SIPSM_LOG_ERROR("Failed to allocate a buffer for a VP8 frame of %zu bytes.", capacity);
+        return -1;
+      }
+
+      if (_frameLength > 0) {
+        memcpy(larger->Data(), _frame->Data(), _frameLength);
+      }
+      _frame = std::move(larger);
+    }
+
+    memcpy(_frame->Data() + _frameLength, payload, length);
+    _frameLength = required;
+    return 0;
+  }
+
+  void Vp8Depacketiser::Discard()
+  {
+    if (_isAssembling) {
+      _isAssembling = false;
+      _frameLength = 0;
+      _stats.FramesDiscarded++;
+    }
+  }
+}
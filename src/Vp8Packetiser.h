@@ -0,0 +1,118 @@
+//-----------------------------------------------------------------------------
+// Filename: Vp8Packetiser.h
+//
+// Description: Native RTP packetisation of VP8 frames (RFC7741). The
+// packetiser splits an encoded frame into RTP packets with the minimal one
+// byte VP8 payload descriptor. The depacketiser reassembles frames from
+// packets received in order and discards any frame with a missing packet.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+
+#include <stdint.h>
+#include <vector>
+
+namespace SIPSorceryMedia {
+
+  class Vp8Packetiser
+  {
+  public:
+
+    static const int RTP_HEADER_LENGTH = 12;
+    static const int VP8_DESCRIPTOR_LENGTH = 1;
+    static const int DEFAULT_MAX_PACKET_SIZE = 1200;
+
+    /**
+    * Spare bytes left at the end of each packet buffer so the packet can be
+    * protected in place. Matches libsrtp's SRTP_MAX_TRAILER_LEN.
+    */
+    static const int TRAILER_ROOM = 144;
+
+    /**
+    * @param[in] ssrc: the synchronisation source of the RTP stream.
+    * @param[in] payloadType: the RTP payload type negotiated for VP8.
+    * @param[in] maxPacketSize: the maximum length of an RTP packet, header included,
+    *  before SRTP protection.
+    */
+    Vp8Packetiser(uint32_t ssrc, uint8_t payloadType, int maxPacketSize = DEFAULT_MAX_PACKET_SIZE);
+
+    /**
+    * Splits an encoded VP8 frame into RTP packets. The marker bit is set on the
+    * last packet.
+    * @param[in] frame: the encoded frame.
+    * @param[in] length: the length of the encoded frame.
+    * @param[in] timestamp: the RTP timestamp for the frame.
+    * @param[out] packets: the packets are appended to this list.
+    * @@Returns: 0 if successful or -1 if a packet buffer could not be allocated.
+    */
+    int Packetise(const uint8_t* frame, int length, uint32_t timestamp, std::vector<MediaBufferPtr>& packets);
+
+    /**
+    * Sets the pool that packets are allocated from. Defaults to
+    * MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    uint16_t GetSequenceNumber() const { return _sequenceNumber; }
+
+  private:
+    uint32_t _ssrc;
+    uint8_t _payloadType;
+    int _maxPacketSize;
+    uint16_t _sequenceNumber = 0;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+  };
+
+  /**
+  * Running totals for a depacketiser. All fields are plain 64 bit integers so
+  * the structure can be copied straight across the flat C API.
+  */
+  struct Vp8DepacketiserStats
+  {
+    uint64_t PacketsReceived;
+    uint64_t PacketsInvalid;
+    uint64_t FramesOutput;
+    uint64_t FramesDiscarded;
+  };
+
+  class Vp8Depacketiser
+  {
+  public:
+
+    /**
+    * Adds a received RTP packet carrying VP8.
+    * @param[in] rtp: the unprotected RTP packet.
+    * @param[in] length: the length of the RTP packet.
+    * @param[out] frame: set to the reassembled frame when the packet completes one,
+    *  otherwise left empty. The buffer's Id is set to the RTP timestamp.
+    * @@Returns: 0 if the packet was accepted or -1 if it could not be parsed.
+    */
+    int Push(const uint8_t* rtp, int length, MediaBufferPtr& frame);
+
+    /**
+    * Sets the pool that frames are assembled in. Defaults to MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    const Vp8DepacketiserStats& GetStats() const { return _stats; }
+
+  private:
+    static const size_t INITIAL_FRAME_CAPACITY = 64 * 1024;
+
+    int Append(const uint8_t* payload, size_t length);
+    void Discard();
+
+    MediaBufferPtr _frame;
+    size_t _frameLength = 0;
+    uint32_t _timestamp = 0;
+    uint16_t _nextSequenceNumber = 0;
+    bool _isAssembling = false;
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+    Vp8DepacketiserStats _stats{};
+  };
+}
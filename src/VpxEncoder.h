@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include "VpxEncoderNative.h"
+
 #include <stdio.h>
 #include <vpx/vpx_encoder.h>
 #include <vpx/vpx_decoder.h>
@@ -80,23 +82,36 @@ namespace SIPSorceryMedia {
     */
     int Decode(unsigned char* buffer, int bufferSize, array<Byte>^% outBuffer, unsigned int% width, unsigned int% height);
 
+    /**
+    * Reads whether a VP8 frame is a key frame and, for key frames, its dimensions from
+    * the frame's header without decoding it. Only the first 10 bytes are read, see
+    * Vp8Bitstream.
+    * @param[in] buffer: pointer to the VP8 encoded frame.
+    * @param[in] bufferSize: the bytes available from the start of the frame.
+    * @param[out] isKeyFrame: whether the frame is a key frame.
+    * @param[out] width: the width of a key frame, 0 for an inter frame.
+    * @param[out] height: the height of a key frame, 0 for an inter frame.
+    * @@Returns: 0 if successful or -1 if the frame header is invalid.
+    */
+    static int GetFrameInfo(unsigned char* buffer, int bufferSize, bool% isKeyFrame, unsigned int% width, unsigned int% height);
+
     /**
     * Returns the current width of the VP8 encoder.
     * @@Returns: the current width of the VP8 encoder.
     */
-    int GetWidth() { return _width; }
+    int GetWidth() { return _native->GetWidth(); }
 
     /**
     * Returns the current height of the VP8 encoder.
     * @@Returns: the current height of the VP8 encoder.
     */
-    int GetHeight() { return _height; }
+    int GetHeight() { return _native->GetHeight(); }
 
     /**
     * Returns the current stride/alignment of the VP8 encoder.
     * @@Returns: the current width/alignment of the VP8 encoder.
     */
-    int GetStride() { return _stride; }
+    int GetStride() { return _native->GetStride(); }
 
     /*
      * quantizer settings
@@ -169,10 +184,7 @@ namespace SIPSorceryMedia {
 
   private:
 
-    vpx_codec_ctx_t* _vpxCodec;
-    vpx_codec_ctx_t* _vpxDecoder;
-    vpx_image_t* _rawImage;
-    int _width = 0, _height = 0, _stride = 0;
+    VpxEncoderNative* _native;
 
     unsigned int _rc_target_bitrate = 300;
 
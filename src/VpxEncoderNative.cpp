@@ -0,0 +1,441 @@
+//-----------------------------------------------------------------------------
+// Filename: VpxEncoderNative.cpp
+//
+// Description: See header.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#include "VpxEncoderNative.h"
+#include "MediaLog.h"
+#include "MediaMetrics.h"
+#include "MediaTrace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace SIPSorceryMedia {
+
+  namespace {
+    MetricsRegistry& _metrics = MetricsRegistry::Default();
+
+    MetricCounter& _keyFramesEncoded = _metrics.GetCounter("sipsm_vpx_frames_encoded_total", "Frames output by the VP8 encoder.", "type=\"key\"");
+    MetricCounter& _deltaFramesEncoded = _metrics.GetCounter("sipsm_vpx_frames_encoded_total", "Frames output by the VP8 encoder.", "type=\"delta\"");
+    MetricCounter& _bytesEncoded = _metrics.GetCounter("sipsm_vpx_bytes_encoded_total", "Bytes output by the VP8 encoder.");
+    MetricCounter& _encodeFailures = _metrics.GetCounter("sipsm_vpx_failures_total", "VP8 encode or decode calls that failed.", "op=\"encode\"");
+    MetricHistogram& _encodeDuration = _metrics.GetHistogram("sipsm_vpx_duration_ns", "Time taken by a VP8 encode or decode call.", "op=\"encode\"");
+
+    MetricCounter& _framesDecoded = _metrics.GetCounter("sipsm_vpx_frames_decoded_total", "Images output by the VP8 decoder.");
+    MetricCounter& _bytesDecoded = _metrics.GetCounter("sipsm_vpx_bytes_decoded_total", "Encoded bytes input to the VP8 decoder.");
+    MetricCounter& _decodeFailures = _metrics.GetCounter("sipsm_vpx_failures_total", "VP8 encode or decode calls that failed.", "op=\"decode\"");
+    MetricHistogram& _decodeDuration = _metrics.GetHistogram("sipsm_vpx_duration_ns", "Time taken by a VP8 encode or decode call.", "op=\"decode\"");
+  }
+
+  VpxEncoderNative::VpxEncoderNative()
+  { }
+
+  VpxEncoderNative::~VpxEncoderNative()
+  {
+    DestroyEncoder();
+    DestroyDecoder();
+  }
+
+  void VpxEncoderNative::DestroyEncoder()
+  {
+    if (_vpxCodec != nullptr) {
+      MemoryAccountScope scope(_memoryAccount, MemoryCategory::Codec);
+      vpx_codec_destroy(_vpxCodec);
+      delete _vpxCodec;
+      _vpxCodec = nullptr;
+    }
+  }
+
+  void VpxEncoderNative::DestroyDecoder()
+  {
+    if (_vpxDecoder != nullptr) {
+      MemoryAccountScope scope(_memoryAccount, MemoryCategory::Codec);
+      vpx_codec_destroy(_vpxDecoder);
+      delete _vpxDecoder;
+      _vpxDecoder = nullptr;
+      _decodedFrame.Reset();
+      _decoderWidth = 0;
+      _decoderHeight = 0;
+    }
+  }
+
+  void VpxEncoderNative::Park()
+  {
+    if (_vpxCodec != nullptr) {
+      DestroyEncoder();
+      _isEncoderParked = true;
+    }
+
+    if (_vpxDecoder != nullptr) {
+      DestroyDecoder();
+      _isDecoderParked = true;
+    }
+  }
+
+  // Setting config parameters in Chromium source.
+  // https://chromium.googlesource.com/external/webrtc/stable/src/+/b8671cb0516ec9f6c7fe22a6bbe331d5b091cdbb/modules/video_coding/codecs/vp8/vp8.cc
+  // Updated link 15 Jun 2020.
+  // https://chromium.googlesource.com/external/webrtc/stable/src/+/refs/heads/master/modules/video_coding/codecs/vp8/vp8_impl.cc
+  int VpxEncoderNative::InitEncoder(unsigned int width, unsigned int height, unsigned int stride, const VpxEncoderConfig& config)
+  {
+    _width = width;
+    _height = height;
+    _stride = stride;
+
+    vpx_codec_enc_cfg_t vpxConfig;
+    vpx_codec_err_t res;
+
+    SIPSM_LOG_INFO("Using %s", vpx_codec_iface_name(vpx_codec_vp8_cx()));
+
+    /* Populate encoder configuration */
+    res = vpx_codec_enc_config_default((vpx_codec_vp8_cx()), &vpxConfig, 0);
+
+    if (res) {
+      SIPSM_LOG_ERROR("Failed to get VPX codec config: %s", vpx_codec_err_to_string(res));
+      return -1;
+    }
+
+    vpxConfig.g_w = width;
+    vpxConfig.g_h = height;
+    vpxConfig.rc_target_bitrate = config.TargetBitrate;
+    vpxConfig.rc_min_quantizer = config.MinQuantizer;
+    vpxConfig.rc_max_quantizer = config.MaxQuantizer;
+    vpxConfig.g_pass = VPX_RC_ONE_PASS;
+    vpxConfig.rc_end_usage = (config.IsCbr) ? VPX_CBR : VPX_VBR;
+    vpxConfig.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    vpxConfig.g_lag_in_frames = 0;
+    vpxConfig.rc_resize_allowed = 0;
+    vpxConfig.kf_max_dist = 20;
+
+    _encoderConfig = vpxConfig;
+    _initialWidth = width;
+    _initialHeight = height;
+    _cpuUsed = config.CpuUsed;
+
+    return CreateEncoder();
+  }
+
+  int VpxEncoderNative::CreateEncoder()
+  {
+    MemoryAccountScope scope(_memoryAccount, MemoryCategory::Codec);
+
+    DestroyEncoder();
+    _vpxCodec = new vpx_codec_ctx_t();
+
+    // Always created at the initial size so the resolution can be raised again after
+    // it has been lowered.
+    vpx_codec_enc_cfg_t vpxConfig = _encoderConfig;
+    vpxConfig.g_w = _initialWidth;
+    vpxConfig.g_h = _initialHeight;
+
+    /* Initialize codec */
+    if (vpx_codec_enc_init(_vpxCodec, (vpx_codec_vp8_cx()), &vpxConfig, 0)) {
+      SIPSM_LOG_ERROR("Failed to initialize libvpx encoder.");
+      delete _vpxCodec;
+      _vpxCodec = nullptr;
+      return -1;
+    }
+
+    if ((_encoderConfig.g_w != vpxConfig.g_w || _encoderConfig.g_h != vpxConfig.g_h) &&
+      vpx_codec_enc_config_set(_vpxCodec, &_encoderConfig)) {
+      SIPSM_LOG_ERROR("Failed to restore the VPX encoder resolution.");
+      return -1;
+    }
+
+    if (_cpuUsed != 0) {
+      return SetCpuUsed(_cpuUsed);
+    }
+
+    return 0;
+  }
+
+  int VpxEncoderNative::SetCpuUsed(int cpuUsed)
+  {
+    if (_isEncoderParked) {
+      _cpuUsed = cpuUsed;
+      return 0;
+    }
+
+    if (_vpxCodec == nullptr) {
+      return -1;
+    }
+
+    vpx_codec_err_t res = vpx_codec_control(_vpxCodec, VP8E_SET_CPUUSED, cpuUsed);
+    if (res) {
+      SIPSM_LOG_ERROR("Failed to set the VPX encoder speed to %d: %s", cpuUsed, vpx_codec_err_to_string(res));
+      return -1;
+    }
+
+    _cpuUsed = cpuUsed;
+    return 0;
+  }
+
+  int VpxEncoderNative::SetResolution(unsigned int width, unsigned int height)
+  {
+    if ((_vpxCodec == nullptr && !_isEncoderParked) || width == 0 || height == 0 ||
+      (int)width > _initialWidth || (int)height > _initialHeight) {
+      return -1;
+    }
+
+    if ((int)width == _width && (int)height == _height) {
+      return 0;
+    }
+
+    if (_isEncoderParked) {
+      _encoderConfig.g_w = width;
+      _encoderConfig.g_h = height;
+      _width = width;
+      _height = height;
+      return 0;
+    }
+
+    // libvpx accepts a smaller size for a one pass encoder without lag, which is how
+    // the encoder is always configured.
+    vpx_codec_enc_cfg_t vpxConfig = _encoderConfig;
+    vpxConfig.g_w = width;
+    vpxConfig.g_h = height;
+
+    MemoryAccountScope scope(_memoryAccount, MemoryCategory::Codec);
+
+    vpx_codec_err_t res = vpx_codec_enc_config_set(_vpxCodec, &vpxConfig);
+    if (res) {
+      SIPSM_LOG_ERROR("Failed to change the VPX encoder resolution to %ux%u: %s", width, height, vpx_codec_err_to_string(res));
+      return -1;
+    }
+
+    _encoderConfig = vpxConfig;
+    _width = width;
+    _height = height;
+    return 0;
+  }
+
+  int VpxEncoderNative::InitDecoder()
+  {
+    return CreateDecoder();
+  }
+
+  int VpxEncoderNative::CreateDecoder()
+  {
+    MemoryAccountScope scope(_memoryAccount, MemoryCategory::Codec);
+
+    DestroyDecoder();
+    _vpxDecoder = new vpx_codec_ctx_t();
+    //vpx_codec_flags_t flags = VPX_CODEC_USE_POSTPROC;
+
+    /* Initialize decoder */
+    if (vpx_codec_dec_init(_vpxDecoder, (vpx_codec_vp8_dx()), NULL, 0)) {
+      SIPSM_LOG_ERROR("Failed to initialize libvpx decoder.");
+      delete _vpxDecoder;
+      _vpxDecoder = nullptr;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  int VpxEncoderNative::Encode(const uint8_t* i420, int i420Length, int sampleCount, const uint8_t** frame, int* frameLength, bool* isKeyFrame)
+  {
+    *frame = nullptr;
+    *frameLength = 0;
+    *isKeyFrame = false;
+
+    // libvpx reads a whole frame from the wrapped buffer whatever its length.
+    int chromaLength = ((_width + 1) / 2) * ((_height + 1) / 2);
+    if (i420 == nullptr || i420Length < _width * _height + 2 * chromaLength) {
+      SIPSM_LOG_ERROR("I420 frame of %d bytes is too short for %dx%d.", i420Length, _width, _height);
+      _stats.EncodeFailures++;
+      _encodeFailures.Add();
+      return -1;
+    }
+
+    if (_isEncoderParked) {
+      if (CreateEncoder() != 0) {
+        _stats.EncodeFailures++;
+        _encodeFailures.Add();
+        return -1;
+      }
+      _isEncoderParked = false;
+    }
+
+    // The wrapped image only references the caller's buffer, libvpx does not take ownership.
+    vpx_img_wrap(&_rawImage, VPX_IMG_FMT_I420, _width, _height, 1, const_cast<uint8_t*>(i420));
+
+    const vpx_codec_cx_pkt_t* pkt;
+    vpx_enc_frame_flags_t flags = 0;
+
+    ScopedLatency latency(_encodeDuration);
+    SIPSM_TRACE_SCOPE("vpx", "VpxEncoder::Encode", (uint64_t)sampleCount);
+
+    if (vpx_codec_encode(_vpxCodec, &_rawImage, sampleCount, 1, flags, VPX_DL_REALTIME)) {
+      SIPSM_LOG_ERROR("VPX codec failed to encode the frame.");
+      _stats.EncodeFailures++;
+      _encodeFailures.Add();
+      return -1;
+    }
+
+    vpx_codec_iter_t iter = NULL;
+
+    while ((pkt = vpx_codec_get_cx_data(_vpxCodec, &iter))) {
+      switch (pkt->kind) {
+      case VPX_CODEC_CX_FRAME_PKT:
+        *frame = static_cast<const uint8_t*>(pkt->data.frame.buf);
+        *frameLength = (int)pkt->data.frame.sz;
+        *isKeyFrame = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
+        break;
+      default:
+        break;
+      }
+    }
+
+    if (*frame != nullptr) {
+      _stats.FramesEncoded++;
+      _stats.BytesEncoded += *frameLength;
+      _bytesEncoded.Add(*frameLength);
+      if (*isKeyFrame) {
+        _stats.KeyFramesEncoded++;
+        _keyFramesEncoded.Add();
+      }
+      else {
+        _deltaFramesEncoded.Add();
+      }
+    }
+
+    return 0;
+  }
+
+  int VpxEncoderNative::Encode(const uint8_t* i420, int i420Length, int sampleCount, MediaBufferPtr& frame, bool* isKeyFrame)
+  {
+    const uint8_t* encoded = nullptr;
+    int encodedLength = 0;
+
+    frame.Reset();
+
+    int res = Encode(i420, i420Length, sampleCount, &encoded, &encodedLength, isKeyFrame);
+
+    if (res == 0 && encoded != nullptr) {
+      frame = _pool->Acquire(encodedLength);
+      if (!frame) {
+        SIPSM_LOG_ERROR("Failed to allocate a buffer for the encoded frame.");
+        return -1;
+      }
+      memcpy(frame->Data(), encoded, encodedLength);
+      frame->SetId(sampleCount);
+    }
+
+    return res;
+  }
+
+  int VpxEncoderNative::Decode(const uint8_t* buffer, int bufferSize, const uint8_t** frame, int* frameLength, unsigned int* width, unsigned int* height)
+  {
+    *frame = nullptr;
+    *frameLength = 0;
+
+    int res = Decode(buffer, bufferSize, _decodedFrame, width, height);
+
+    if (res == 0 && _decodedFrame) {
+      *frame = _decodedFrame->Data();
+      *frameLength = (int)_decodedFrame->Length();
+    }
+
+    return res;
+  }
+
+  // https://swift.im/git/swift-contrib/tree/Swiften/ScreenSharing/VP8Decoder.cpp?id=6247ed394302ff2cf1f33a71df808bebf7241242
+  int VpxEncoderNative::Decode(const uint8_t* buffer, int bufferSize, MediaBufferPtr& frame, unsigned int* width, unsigned int* height)
+  {
+    vpx_codec_iter_t iter = NULL;
+    vpx_image_t* img;
+
+    frame.Reset();
+
+    if (_isDecoderParked) {
+      if (CreateDecoder() != 0) {
+        _stats.DecodeFailures++;
+        _decodeFailures.Add();
+        return -1;
+      }
+      _isDecoderParked = false;
+    }
+
+    ScopedLatency latency(_decodeDuration);
+    SIPSM_TRACE_SCOPE("vpx", "VpxEncoder::Decode", 0);
+
+    // libvpx allocates its frame buffers when it sees a key frame with a new size. The
+    // size is read from the key frame header (RFC6386 9.1) so only those decodes are
+    // measured for the memory account.
+    unsigned int keyFrameWidth = 0, keyFrameHeight = 0;
+    if (_memoryAccount != nullptr && bufferSize >= 10 && (buffer[0] & 0x01) == 0 &&
+      buffer[3] == 0x9d && buffer[4] == 0x01 && buffer[5] == 0x2a) {
+      keyFrameWidth = (buffer[6] | (buffer[7] << 8)) & 0x3fff;
+      keyFrameHeight = (buffer[8] | (buffer[9] << 8)) & 0x3fff;
+    }
+
+    bool isResize = keyFrameWidth != 0 && (keyFrameWidth != _decoderWidth || keyFrameHeight != _decoderHeight);
+    MemoryAccountScope scope((isResize) ? _memoryAccount : nullptr, MemoryCategory::Codec);
+
+    /* Decode the frame */
+    vpx_codec_err_t decodeResult = vpx_codec_decode(_vpxDecoder, buffer, bufferSize, NULL, 0);
+
+    if (isResize && decodeResult == VPX_CODEC_OK) {
+      _decoderWidth = keyFrameWidth;
+      _decoderHeight = keyFrameHeight;
+    }
+
+    if (decodeResult != VPX_CODEC_OK) {
+      SIPSM_LOG_ERROR("VPX codec failed to decode the frame: %s.", vpx_codec_err_to_string(decodeResult));
+      _stats.DecodeFailures++;
+      _decodeFailures.Add();
+      return -1;
+    }
+
+    while ((img = vpx_codec_get_frame(_vpxDecoder, &iter))) {
+
+      *width = img->d_w;
+      *height = img->d_h;
+
+      unsigned int chromaWidth = (img->d_w + 1) >> 1;
+      unsigned int chromaHeight = (img->d_h + 1) >> 1;
+      int outputSize = img->d_w * img->d_h + 2 * chromaWidth * chromaHeight;
+
+      // In the steady state the pool hands back the buffer released by the previous
+      // frame so no allocation takes place.
+      frame = _pool->Acquire(outputSize);
+      if (!frame) {
+        SIPSM_LOG_ERROR("Failed to allocate a buffer for the decoded frame.");
+        _stats.DecodeFailures++;
+        _decodeFailures.Add();
+        return -1;
+      }
+
+      uint8_t* bufferOut = frame->Data();
+      int pointer = 0;
+
+      for (unsigned int plane = 0; plane < 3; plane++) {
+
+        const unsigned char* buf = img->planes[plane];
+        unsigned int planeWidth = (plane ? chromaWidth : img->d_w);
+        unsigned int planeHeight = (plane ? chromaHeight : img->d_h);
+
+        for (unsigned int y = 0; y < planeHeight; y++) {
+          memcpy(bufferOut + pointer, buf, planeWidth);
+          pointer += planeWidth;
+          buf += img->stride[plane];
+        }
+      }
+    }
+
+    if (frame) {
+      _stats.FramesDecoded++;
+      _stats.BytesDecoded += bufferSize;
+      _framesDecoded.Add();
+      _bytesDecoded.Add(bufferSize);
+    }
+
+    return 0;
+  }
+}
@@ -0,0 +1,194 @@
+//-----------------------------------------------------------------------------
+// Filename: VpxEncoderNative.h
+//
+// Description: Native (non-CLR) VP8 encoder and decoder wrapper for libvpx.
+// This is the core used by both the C++/CLI VpxEncoder class and the flat C
+// API in NativeApi.h.
+//
+// License:
+// BSD 3-Clause "New" or "Revised" License, see included LICENSE.md file.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "MediaBuffer.h"
+#include "MediaMemory.h"
+
+#include <stdint.h>
+#include <vpx/vpx_encoder.h>
+#include <vpx/vpx_decoder.h>
+#include <vpx/vp8cx.h>
+#include <vpx/vp8dx.h>
+
+namespace SIPSorceryMedia {
+
+  /**
+  * Encoder settings applied when the encoder is initialised.
+  */
+  struct VpxEncoderConfig
+  {
+    unsigned int TargetBitrate = 300;   // In kbps.
+    unsigned int MinQuantizer = 50;
+    unsigned int MaxQuantizer = 60;
+    bool IsCbr = false;
+
+    /**
+    * The libvpx speed setting, -16 to 16. Higher values encode faster at lower
+    * quality. 0 leaves the libvpx default.
+    */
+    int CpuUsed = 0;
+  };
+
+  /**
+  * Running totals for an encoder/decoder instance. All fields are plain 64 bit
+  * integers so the structure can be copied straight across the flat C API.
+  */
+  struct VpxStats
+  {
+    uint64_t FramesEncoded;
+    uint64_t KeyFramesEncoded;
+    uint64_t BytesEncoded;
+    uint64_t EncodeFailures;
+    uint64_t FramesDecoded;
+    uint64_t BytesDecoded;
+    uint64_t DecodeFailures;
+  };
+
+  class VpxEncoderNative
+  {
+  public:
+
+    VpxEncoderNative();
+    ~VpxEncoderNative();
+
+    /**
+    * Initialises the VP8 encoder.
+    * @param[in] width: the width of the I420 image that will be encoded.
+    * @param[in] height: the height of the I420 image that will be encoded.
+    * @param[in] stride: the stride (alignment) of the I420 image that will be encoded.
+    * @param[in] config: the rate control settings for the encoder.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int InitEncoder(unsigned int width, unsigned int height, unsigned int stride, const VpxEncoderConfig& config);
+
+    /**
+    * Changes the encoder's speed setting, see VpxEncoderConfig::CpuUsed. Takes effect
+    * from the next frame.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int SetCpuUsed(int cpuUsed);
+
+    /**
+    * Changes the size of the images passed to Encode without restarting the encoder.
+    * The size can't be larger than the size the encoder was initialised with. The
+    * encoder outputs a key frame at the new size.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int SetResolution(unsigned int width, unsigned int height);
+
+    /**
+    * Initialises the VP8 decoder.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int InitDecoder();
+
+    /**
+    * Attempts to encode an I420 frame as VP8.
+    * @param[in] i420: pointer to the buffer with the i420 frame to encode.
+    * @param[in] i420Length: the length of the i420 buffer.
+    * @param[in] sampleCount: an integer which when multiplied by the stream's timebase gives the
+    *  presentation time of the sample.
+    * @param[out] frame: set to the encoded frame. The pointer is owned by the encoder
+    *  and is only valid until the next call to Encode. Set to nullptr if the encoder
+    *  did not output a frame.
+    * @param[out] frameLength: the length of the encoded frame.
+    * @param[out] isKeyFrame: set to true if the encoded frame is a key frame.
+    * @@Returns: 0 if successful or -1 if not, including if i420Length is shorter than an
+    *  I420 frame of the encoder's width and height.
+    */
+    int Encode(const uint8_t* i420, int i420Length, int sampleCount, const uint8_t** frame, int* frameLength, bool* isKeyFrame);
+
+    /**
+    * Attempts to encode an I420 frame as VP8 and copies the encoded frame into a pooled
+    * buffer that the caller can hold on to, for example to queue for packetisation.
+    * @param[out] frame: set to the encoded frame, or left empty if the encoder did not
+    *  output a frame. The buffer's Id is set to the sample count.
+    * See the Encode overload above for the remaining parameters.
+    */
+    int Encode(const uint8_t* i420, int i420Length, int sampleCount, MediaBufferPtr& frame, bool* isKeyFrame);
+
+    /**
+    * Attempts to decode a VP8 frame to a packed I420 image.
+    * @param[in] buffer: pointer to the VP8 encoded frame to decode.
+    * @param[in] bufferSize: the length of the VP8 encoded frame.
+    * @param[out] frame: set to the decoded I420 image. The pointer is owned by the decoder
+    *  and is only valid until the next call to Decode. Set to nullptr if the decoder
+    *  did not output an image.
+    * @param[out] frameLength: the length of the decoded I420 image.
+    * @param[out] width: the width of the decoded I420 image.
+    * @param[out] height: the height of the decoded I420 image.
+    * @@Returns: 0 if successful or -1 if not.
+    */
+    int Decode(const uint8_t* buffer, int bufferSize, const uint8_t** frame, int* frameLength, unsigned int* width, unsigned int* height);
+
+    /**
+    * Attempts to decode a VP8 frame to a packed I420 image in a pooled buffer.
+    * @param[out] frame: set to the decoded I420 image, or left empty if the decoder did
+    *  not output an image.
+    * See the Decode overload above for the remaining parameters.
+    */
+    int Decode(const uint8_t* buffer, int bufferSize, MediaBufferPtr& frame, unsigned int* width, unsigned int* height);
+
+    /**
+    * Frees the libvpx encoder and decoder contexts, including their reference frames,
+    * while the session is idle. They are created again on the next call to Encode or
+    * Decode. The first frame encoded afterwards is a key frame and the first frame
+    * decoded must be one, so the receiver should ask for it with a PLI.
+    */
+    void Park();
+    bool IsParked() const { return _isEncoderParked || _isDecoderParked; }
+
+    /**
+    * Sets the pool that encoded and decoded frames are allocated from. Defaults to
+    * MediaBufferPool::Default().
+    */
+    void SetBufferPool(MediaBufferPool* pool) { _pool = pool; }
+
+    /**
+    * Optional, the account the memory held by libvpx is charged to.
+    */
+    void SetMemoryAccount(MemoryAccount* account) { _memoryAccount = account; }
+
+    int GetWidth() const { return _width; }
+    int GetHeight() const { return _height; }
+    int GetStride() const { return _stride; }
+
+    /**
+    * Gets the running totals for this encoder/decoder.
+    */
+    const VpxStats& GetStats() const { return _stats; }
+
+  private:
+
+    int CreateEncoder();
+    int CreateDecoder();
+    void DestroyEncoder();
+    void DestroyDecoder();
+
+    vpx_codec_ctx_t* _vpxCodec{ nullptr };
+    vpx_codec_ctx_t* _vpxDecoder{ nullptr };
+    vpx_image_t _rawImage{};
+    vpx_codec_enc_cfg_t _encoderConfig{};
+    int _width = 0, _height = 0, _stride = 0;
+    int _initialWidth = 0, _initialHeight = 0;
+    int _cpuUsed = 0;
+    bool _isEncoderParked = false;
+    bool _isDecoderParked = false;
+    unsigned int _decoderWidth = 0, _decoderHeight = 0;   // The size the decoder last allocated for.
+    MemoryAccount* _memoryAccount{ nullptr };
+
+    MediaBufferPool* _pool{ &MediaBufferPool::Default() };
+    MediaBufferPtr _decodedFrame;     // Keeps the last decoded image alive for the raw pointer Decode.
+    VpxStats _stats{};
+  };
+}